@@ -54,6 +54,9 @@ static char *opt_oci_layer_compress;
 static char **opt_gpg_key_ids;
 static char *opt_gpg_homedir;
 static char *opt_from_commit;
+static int opt_oci_layer_compress_level = -1;
+static int opt_jobs = 1;
+static char *opt_refs_from;
 
 static GOptionEntry options[] = {
   { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, N_("Export runtime instead of app"), NULL },
@@ -68,6 +71,9 @@ static GOptionEntry options[] = {
   // This is not used anymore as it is the default, but accept it if old code uses it
   { "oci-use-labels", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &opt_oci_use_labels, NULL, NULL },
   { "oci-layer-compress", 0, 0, G_OPTION_ARG_STRING, &opt_oci_layer_compress, N_("How to compress OCI image layers (default: gzip)"), "gzip|zstd" },
+  { "oci-layer-compress-level", 0, 0, G_OPTION_ARG_INT, &opt_oci_layer_compress_level, N_("Compression level for OCI image layers"), N_("LEVEL") },
+  { "jobs", 0, 0, G_OPTION_ARG_INT, &opt_jobs, N_("Number of threads to compress zstd OCI image layers with (0 for NUMCPUs, default: 1)"), N_("NUM-JOBS") },
+  { "refs-from", 0, 0, G_OPTION_ARG_FILENAME, &opt_refs_from, N_("Export all refs listed in FILE to one OCI image directory"), N_("FILE") },
   { NULL }
 };
 
@@ -461,21 +467,23 @@ generate_labels (FlatpakOciDescriptor *layer_desc,
 
 
 
+/* Writes the layer, config and manifest of @ref_str to @registry, but
+ * doesn't add it to the index */
 static gboolean
-build_oci (OstreeRepo                 *repo,
-           const char                 *commit_checksum,
-           GFile                      *dir,
-           const char                 *name,
-           const char                 *ref_str,
-           FlatpakOciWriteLayerFlags   write_layer_flags,
-           GCancellable               *cancellable,
-           GError                    **error)
+write_oci_image (OstreeRepo                 *repo,
+                 FlatpakOciRegistry         *registry,
+                 const char                 *commit_checksum,
+                 const char                 *name,
+                 const char                 *ref_str,
+                 FlatpakOciWriteLayerFlags   write_layer_flags,
+                 int                         n_threads,
+                 FlatpakOciDescriptor      **out_manifest_desc,
+                 GCancellable               *cancellable,
+                 GError                    **error)
 {
   g_autoptr(GFile) root = NULL;
   g_autoptr(GVariant) commit_data = NULL;
   g_autoptr(GVariant) commit_metadata = NULL;
-  g_autofree char *dir_uri = NULL;
-  g_autoptr(FlatpakOciRegistry) registry = NULL;
   g_autoptr(FlatpakOciLayerWriter) layer_writer = NULL;
   struct archive *archive;
   g_autofree char *uncompressed_digest = NULL;
@@ -485,7 +493,6 @@ build_oci (OstreeRepo                 *repo,
   g_autoptr(FlatpakOciDescriptor) image_desc = NULL;
   g_autoptr(FlatpakOciDescriptor) manifest_desc = NULL;
   g_autoptr(FlatpakOciManifest) manifest = NULL;
-  g_autoptr(FlatpakOciIndex) index = NULL;
   g_autoptr(GHashTable) flatpak_labels = NULL;
   g_autoptr(FlatpakDecomposed) ref = NULL;
   g_autofree char *arch = NULL;
@@ -507,12 +514,9 @@ build_oci (OstreeRepo                 *repo,
 
   arch = flatpak_decomposed_dup_arch (ref);
 
-  dir_uri = g_file_get_uri (dir);
-  registry = flatpak_oci_registry_new (dir_uri, TRUE, -1, cancellable, error);
-  if (registry == NULL)
-    return FALSE;
-
-  layer_writer = flatpak_oci_registry_write_layer (registry, write_layer_flags, cancellable, error);
+  layer_writer = flatpak_oci_registry_write_layer (registry, write_layer_flags,
+                                                   opt_oci_layer_compress_level, n_threads,
+                                                   cancellable, error);
   if (layer_writer == NULL)
     return FALSE;
 
@@ -560,11 +564,39 @@ build_oci (OstreeRepo                 *repo,
   if (manifest_desc == NULL)
     return FALSE;
 
+  *out_manifest_desc = g_steal_pointer (&manifest_desc);
+  return TRUE;
+}
+
+static gboolean
+build_oci (OstreeRepo                 *repo,
+           const char                 *commit_checksum,
+           GFile                      *dir,
+           const char                 *name,
+           const char                 *ref_str,
+           FlatpakOciWriteLayerFlags   write_layer_flags,
+           GCancellable               *cancellable,
+           GError                    **error)
+{
+  g_autofree char *dir_uri = NULL;
+  g_autoptr(FlatpakOciRegistry) registry = NULL;
+  g_autoptr(FlatpakOciDescriptor) manifest_desc = NULL;
+  g_autoptr(FlatpakOciIndex) index = NULL;
+
+  dir_uri = g_file_get_uri (dir);
+  registry = flatpak_oci_registry_new (dir_uri, TRUE, -1, cancellable, error);
+  if (registry == NULL)
+    return FALSE;
+
+  if (!write_oci_image (repo, registry, commit_checksum, name, ref_str, write_layer_flags,
+                        opt_jobs, &manifest_desc, cancellable, error))
+    return FALSE;
+
   index = flatpak_oci_registry_load_index (registry, NULL, NULL);
   if (index == NULL)
     index = flatpak_oci_index_new ();
 
-  flatpak_oci_index_add_manifest (index, flatpak_decomposed_get_ref (ref), manifest_desc);
+  flatpak_oci_index_add_manifest (index, ref_str, manifest_desc);
 
   if (!flatpak_oci_registry_save_index (registry, index, cancellable, error))
     return FALSE;
@@ -572,6 +604,7 @@ build_oci (OstreeRepo                 *repo,
   return TRUE;
 }
 
+
 static gboolean
 _repo_resolve_rev (OstreeRepo *repo, const char *ref, char **out_rev,
                    GCancellable *cancellable, GError **error)
@@ -616,6 +649,134 @@ _repo_resolve_rev (OstreeRepo *repo, const char *ref, char **out_rev,
     }
 }
 
+typedef struct
+{
+  OstreeRepo                *repo;
+  GFile                     *dir;
+  char                      *ref;
+  char                      *commit;
+  FlatpakOciWriteLayerFlags  write_layer_flags;
+  FlatpakOciDescriptor      *manifest_desc;
+  GError                    *error;
+} OciImageJob;
+
+static void
+oci_image_job_free (OciImageJob *job)
+{
+  g_free (job->ref);
+  g_free (job->commit);
+  g_clear_pointer (&job->manifest_desc, flatpak_oci_descriptor_free);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (OciImageJob, oci_image_job_free)
+
+static void
+oci_image_job_run (gpointer data,
+                   gpointer user_data)
+{
+  OciImageJob *job = data;
+  GCancellable *cancellable = user_data;
+  g_autofree char *dir_uri = g_file_get_uri (job->dir);
+  g_autoptr(FlatpakOciRegistry) registry = NULL;
+  g_autoptr(FlatpakDecomposed) ref = NULL;
+  g_autofree char *id = NULL;
+
+  ref = flatpak_decomposed_new_from_ref (job->ref, &job->error);
+  if (ref == NULL)
+    return;
+
+  id = flatpak_decomposed_dup_id (ref);
+
+  /* Blobs are written to temporary files and linked into place by their
+   * digest, so the registries of different jobs can share the directory,
+   * and identical layers of different refs end up stored once */
+  registry = flatpak_oci_registry_new (dir_uri, TRUE, -1, cancellable, &job->error);
+  if (registry == NULL)
+    return;
+
+  if (!write_oci_image (job->repo, registry, job->commit, id, job->ref,
+                        job->write_layer_flags, 1, &job->manifest_desc,
+                        cancellable, &job->error))
+    g_prefix_error (&job->error, "%s: ", job->ref);
+}
+
+/* Exports each ref, one per line of @refs_file, as its own image of the
+ * index in @dir. The images are built on up to --jobs threads, each
+ * compressing its layer on one thread, and the index is written once. */
+static gboolean
+build_oci_catalog (OstreeRepo                 *repo,
+                   const char                 *refs_file,
+                   GFile                      *dir,
+                   FlatpakOciWriteLayerFlags   write_layer_flags,
+                   GCancellable               *cancellable,
+                   GError                    **error)
+{
+  g_autoptr(GFile) file = g_file_new_for_commandline_arg (refs_file);
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) oci_image_job_free);
+  g_autofree char *dir_uri = NULL;
+  g_autoptr(FlatpakOciRegistry) registry = NULL;
+  g_autoptr(FlatpakOciIndex) index = NULL;
+  GThreadPool *pool;
+  int i;
+
+  if (!g_file_load_contents (file, cancellable, &contents, NULL, NULL, error))
+    return FALSE;
+
+  dir_uri = g_file_get_uri (dir);
+  registry = flatpak_oci_registry_new (dir_uri, TRUE, -1, cancellable, error);
+  if (registry == NULL)
+    return FALSE;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      const char *line = g_strstrip (lines[i]);
+      g_autoptr(OciImageJob) job = NULL;
+
+      if (*line == 0 || *line == '#')
+        continue;
+
+      job = g_new0 (OciImageJob, 1);
+      job->repo = repo;
+      job->dir = dir;
+      job->ref = g_strdup (line);
+      job->write_layer_flags = write_layer_flags;
+
+      if (!_repo_resolve_rev (repo, job->ref, &job->commit, cancellable, error))
+        return FALSE;
+
+      g_ptr_array_add (jobs, g_steal_pointer (&job));
+    }
+
+  pool = g_thread_pool_new (oci_image_job_run, cancellable, opt_jobs, FALSE, NULL);
+  for (i = 0; i < jobs->len; i++)
+    g_thread_pool_push (pool, g_ptr_array_index (jobs, i), NULL);
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  index = flatpak_oci_registry_load_index (registry, NULL, NULL);
+  if (index == NULL)
+    index = flatpak_oci_index_new ();
+
+  for (i = 0; i < jobs->len; i++)
+    {
+      OciImageJob *job = g_ptr_array_index (jobs, i);
+
+      if (job->error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&job->error));
+          return FALSE;
+        }
+
+      flatpak_oci_index_add_manifest (index, job->ref, job->manifest_desc);
+    }
+
+  return flatpak_oci_registry_save_index (registry, index, cancellable, error);
+}
+
 gboolean
 flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -637,15 +798,29 @@ flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
   if (!flatpak_option_context_parse (context, options, &argc, &argv, FLATPAK_BUILTIN_FLAG_NO_DIR, NULL, cancellable, error))
     return FALSE;
 
-  if (argc < 4)
-    return usage_error (context, _("LOCATION, FILENAME and NAME must be specified"), error);
+  if (opt_refs_from != NULL)
+    {
+      if (!opt_oci)
+        return usage_error (context, _("--refs-from requires --oci"), error);
 
-  if (argc > 5)
-    return usage_error (context, _("Too many arguments"), error);
+      if (argc < 3)
+        return usage_error (context, _("LOCATION and FILENAME must be specified"), error);
+
+      if (argc > 3)
+        return usage_error (context, _("Too many arguments"), error);
+    }
+  else
+    {
+      if (argc < 4)
+        return usage_error (context, _("LOCATION, FILENAME and NAME must be specified"), error);
+
+      if (argc > 5)
+        return usage_error (context, _("Too many arguments"), error);
+    }
 
   location = argv[1];
   filename = argv[2];
-  name = argv[3];
+  name = argc >= 4 ? argv[3] : NULL;
 
   if (argc >= 5)
     branch = argv[4];
@@ -665,24 +840,28 @@ flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
     }
 
   /* We can't use flatpak_repo_resolve_rev() here because it takes a NULL
-   * remote name to mean the ref is local. */
-  if (_repo_resolve_rev (repo, name, &commit_checksum, NULL, NULL))
-    full_branch = g_strdup (name);
-  else
+   * remote name to mean the ref is local. With --refs-from, there's no NAME
+   * and build_oci_catalog() resolves each ref. */
+  if (name != NULL)
     {
-      if (!flatpak_is_valid_name (name, -1, &my_error))
-        return flatpak_fail (error, _("'%s' is not a valid name: %s"), name, my_error->message);
+      if (_repo_resolve_rev (repo, name, &commit_checksum, NULL, NULL))
+        full_branch = g_strdup (name);
+      else
+        {
+          if (!flatpak_is_valid_name (name, -1, &my_error))
+            return flatpak_fail (error, _("'%s' is not a valid name: %s"), name, my_error->message);
 
-      if (!flatpak_is_valid_branch (branch, -1, &my_error))
-        return flatpak_fail (error, _("'%s' is not a valid branch name: %s"), branch, my_error->message);
+          if (!flatpak_is_valid_branch (branch, -1, &my_error))
+            return flatpak_fail (error, _("'%s' is not a valid branch name: %s"), branch, my_error->message);
 
-      if (opt_runtime)
-        full_branch = flatpak_build_runtime_ref (name, branch, opt_arch);
-      else
-        full_branch = flatpak_build_app_ref (name, branch, opt_arch);
+          if (opt_runtime)
+            full_branch = flatpak_build_runtime_ref (name, branch, opt_arch);
+          else
+            full_branch = flatpak_build_app_ref (name, branch, opt_arch);
 
-      if (!_repo_resolve_rev (repo, full_branch, &commit_checksum, cancellable, error))
-        return FALSE;
+          if (!_repo_resolve_rev (repo, full_branch, &commit_checksum, cancellable, error))
+            return FALSE;
+        }
     }
 
   file = g_file_new_for_commandline_arg (filename);
@@ -705,7 +884,25 @@ flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
       else
         return usage_error (context, _("--oci-layer-compress value must be gzip or zstd"), error);
 
-      if (!build_oci (repo, commit_checksum, file, name, full_branch, write_layer_flags, cancellable, error))
+      if (opt_oci_layer_compress_level != -1)
+        {
+          int max_level = (write_layer_flags & FLATPAK_OCI_WRITE_LAYER_FLAGS_ZSTD) != 0 ? 19 : 9;
+
+          if (opt_oci_layer_compress_level < 1 || opt_oci_layer_compress_level > max_level)
+            return usage_error (context, _("--oci-layer-compress-level value is out of range"), error);
+        }
+
+      if (opt_jobs < 0)
+        return usage_error (context, _("--jobs value must not be negative"), error);
+      if (opt_jobs == 0)
+        opt_jobs = g_get_num_processors ();
+
+      if (opt_refs_from != NULL)
+        {
+          if (!build_oci_catalog (repo, opt_refs_from, file, write_layer_flags, cancellable, error))
+            return FALSE;
+        }
+      else if (!build_oci (repo, commit_checksum, file, name, full_branch, write_layer_flags, cancellable, error))
         return FALSE;
     }
   else
@@ -26,6 +26,7 @@
 #include <string.h>
 
 #include <glib/gi18n.h>
+#include <gio/gunixinputstream.h>
 
 #include "libglnx.h"
 
@@ -36,6 +37,7 @@
 
 static char *opt_src_repo;
 static char *opt_src_ref;
+static char *opt_refs_from;
 static char *opt_subject;
 static char *opt_body;
 static gboolean opt_update_appstream;
@@ -57,6 +59,7 @@ static gboolean opt_no_summary_index = FALSE;
 static GOptionEntry options[] = {
   { "src-repo", 0, 0, G_OPTION_ARG_STRING, &opt_src_repo, N_("Source repo dir"), N_("SRC-REPO") },
   { "src-ref", 0, 0, G_OPTION_ARG_STRING, &opt_src_ref, N_("Source repo ref"), N_("SRC-REF") },
+  { "refs-from", 0, 0, G_OPTION_ARG_FILENAME, &opt_refs_from, N_("Read lines of [SRC-REF] DST-REF from FILE, or - for stdin"), N_("FILE") },
   { "untrusted", 0, 0, G_OPTION_ARG_NONE, &opt_untrusted, "Do not trust SRC-REPO", NULL },
   { "force", 0, 0, G_OPTION_ARG_NONE, &opt_force, "Always commit, even if same content", NULL },
   { "extra-collection-id", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_extra_collection_ids, "Add an extra collection id ref and binding", "COLLECTION-ID" },
@@ -126,6 +129,122 @@ _ostree_get_relative_static_delta_path (const char *from,
   return g_string_free (ret, FALSE);
 }
 
+/* Copies the objects of a commit from a trusted local repo. Unlike a pull
+ * this skips re-checksumming the objects, and libostree hardlinks them when
+ * the repos are on the same filesystem and have compatible modes. The commit
+ * object goes last, so an interrupted import never leaves a commit behind
+ * without its trees. */
+static gboolean
+import_commit_from_local_repo (OstreeRepo   *dst_repo,
+                               OstreeRepo   *src_repo,
+                               const char   *commit,
+                               GCancellable *cancellable,
+                               GError      **error)
+{
+  g_autoptr(GHashTable) reachable = NULL;
+  GHashTableIter iter;
+  GVariant *key;
+  gboolean have_commit = FALSE;
+  OstreeRepoCommitState commit_state = 0;
+
+  if (!ostree_repo_has_object (dst_repo, OSTREE_OBJECT_TYPE_COMMIT, commit, &have_commit,
+                               cancellable, error))
+    return FALSE;
+
+  if (have_commit &&
+      ostree_repo_load_commit (dst_repo, commit, NULL, &commit_state, NULL) &&
+      (commit_state & OSTREE_REPO_COMMIT_STATE_PARTIAL) == 0)
+    return TRUE;
+
+  reachable = ostree_repo_traverse_new_reachable ();
+  if (!ostree_repo_traverse_commit_union (src_repo, commit, 0, reachable, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, reachable);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &key, NULL))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      gboolean have_object = FALSE;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+      if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+        continue;
+
+      if (!ostree_repo_has_object (dst_repo, objtype, checksum, &have_object, cancellable, error))
+        return FALSE;
+
+      if (!have_object &&
+          !ostree_repo_import_object_from_with_trust (dst_repo, src_repo, objtype, checksum,
+                                                      TRUE, cancellable, error))
+        return FALSE;
+    }
+
+  return ostree_repo_import_object_from_with_trust (dst_repo, src_repo, OSTREE_OBJECT_TYPE_COMMIT,
+                                                    commit, TRUE, cancellable, error);
+}
+
+/* Each line is either DST-REF, to commit the same ref from the source
+ * repo, or SRC-REF DST-REF. Empty lines and lines starting with # are
+ * ignored. */
+static gboolean
+read_ref_mappings (const char   *path,
+                   GPtrArray    *src_refs,
+                   GPtrArray    *dst_refs,
+                   GCancellable *cancellable,
+                   GError      **error)
+{
+  g_autoptr(GInputStream) input = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_auto(GStrv) lines = NULL;
+  int i;
+
+  if (strcmp (path, "-") == 0)
+    {
+      input = g_unix_input_stream_new (STDIN_FILENO, FALSE);
+    }
+  else
+    {
+      g_autoptr(GFile) file = g_file_new_for_commandline_arg (path);
+
+      input = G_INPUT_STREAM (g_file_read (file, cancellable, error));
+      if (input == NULL)
+        return FALSE;
+    }
+
+  bytes = flatpak_read_stream (input, TRUE, error);
+  if (bytes == NULL)
+    return FALSE;
+
+  lines = g_strsplit (g_bytes_get_data (bytes, NULL), "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      g_auto(GStrv) fields = NULL;
+      const char *line = g_strstrip (lines[i]);
+      const char *refs[2];
+      guint n_refs = 0;
+      int j;
+
+      if (*line == 0 || *line == '#')
+        continue;
+
+      fields = g_strsplit_set (line, " \t", -1);
+      for (j = 0; fields[j] != NULL; j++)
+        {
+          if (*fields[j] == 0)
+            continue;
+          if (n_refs == G_N_ELEMENTS (refs))
+            return flatpak_fail (error, _("Invalid ref mapping on line %d of %s"), i + 1, path);
+          refs[n_refs++] = fields[j];
+        }
+
+      g_ptr_array_add (src_refs, g_strdup (refs[0]));
+      g_ptr_array_add (dst_refs, g_strdup (refs[n_refs - 1]));
+    }
+
+  return TRUE;
+}
+
 static GVariant *
 new_bytearray (const guchar *data,
                gsize         len)
@@ -268,6 +387,7 @@ flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancella
   int n_dst_refs = 0;
   g_autoptr(FlatpakRepoTransaction) transaction = NULL;
   g_autoptr(GPtrArray) src_refs = NULL;
+  g_autoptr(GPtrArray) mapped_dst_refs = NULL;
   g_autoptr(GPtrArray) resolved_src_refs = NULL;
   OstreeRepoCommitState src_commit_state;
   struct timespec ts;
@@ -289,14 +409,32 @@ flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancella
   dst_refs = (const char **) argv + 2;
   n_dst_refs = argc - 2;
 
-  if (opt_src_repo == NULL && n_dst_refs != 1)
-    return usage_error (context, _("If --src-repo is not specified, exactly one destination ref must be specified"), error);
+  src_refs = g_ptr_array_new_with_free_func (g_free);
+
+  if (opt_refs_from != NULL)
+    {
+      if (n_dst_refs != 0 || opt_src_ref != NULL)
+        return usage_error (context, _("--refs-from can't be combined with --src-ref or DST-REF arguments"), error);
 
-  if (opt_src_ref != NULL && n_dst_refs != 1)
-    return usage_error (context, _("If --src-ref is specified, exactly one destination ref must be specified"), error);
+      mapped_dst_refs = g_ptr_array_new_with_free_func (g_free);
+      if (!read_ref_mappings (opt_refs_from, src_refs, mapped_dst_refs, cancellable, error))
+        return FALSE;
 
-  if (opt_src_repo == NULL && opt_src_ref == NULL)
-    return flatpak_fail (error, _("Either --src-repo or --src-ref must be specified"));
+      g_ptr_array_add (mapped_dst_refs, NULL);
+      dst_refs = (const char **) mapped_dst_refs->pdata;
+      n_dst_refs = src_refs->len;
+    }
+  else
+    {
+      if (opt_src_repo == NULL && n_dst_refs != 1)
+        return usage_error (context, _("If --src-repo is not specified, exactly one destination ref must be specified"), error);
+
+      if (opt_src_ref != NULL && n_dst_refs != 1)
+        return usage_error (context, _("If --src-ref is specified, exactly one destination ref must be specified"), error);
+
+      if (opt_src_repo == NULL && opt_src_ref == NULL)
+        return flatpak_fail (error, _("Either --src-repo or --src-ref must be specified"));
+    }
 
   /* Always create a commit if we're eol:ing, even though the app is the same */
   if (opt_endoflife != NULL || opt_endoflife_rebase != NULL)
@@ -360,13 +498,12 @@ flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancella
       src_repo = g_object_ref (dst_repo);
     }
 
-  src_refs = g_ptr_array_new_with_free_func (g_free);
   if (opt_src_ref)
     {
       g_assert (n_dst_refs == 1);
       g_ptr_array_add (src_refs, g_strdup (opt_src_ref));
     }
-  else
+  else if (opt_refs_from == NULL)
     {
       g_assert (opt_src_repo != NULL);
       if (n_dst_refs == 0)
@@ -410,7 +547,8 @@ flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancella
       g_ptr_array_add (resolved_src_refs, resolved_ref);
     }
 
-  if (src_repo_uri != NULL)
+  /* Trusted local repos are imported from directly, below */
+  if (src_repo_uri != NULL && opt_untrusted)
     {
       OstreeRepoPullFlags pullflags = 0;
       GVariantBuilder builder;
@@ -445,16 +583,26 @@ flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancella
         return FALSE;
     }
 
+  transaction = flatpak_repo_transaction_start (dst_repo, cancellable, error);
+  if (transaction == NULL)
+    return FALSE;
+
+  if (src_repo_uri != NULL && !opt_untrusted)
+    {
+      for (i = 0; i < resolved_src_refs->len; i++)
+        {
+          const char *resolved_ref = g_ptr_array_index (resolved_src_refs, i);
+
+          if (!import_commit_from_local_repo (dst_repo, src_repo, resolved_ref, cancellable, error))
+            return FALSE;
+        }
+    }
+
   /* By now we have the commit with commit_id==resolved_ref and dependencies in dst_repo. We now create a new
    * commit based on the toplevel tree ref from that commit.
    * This is equivalent to:
    *   ostree commit --skip-if-unchanged --repo=${destrepo} --tree=ref=${resolved_ref}
    */
-
-  transaction = flatpak_repo_transaction_start (dst_repo, cancellable, error);
-  if (transaction == NULL)
-    return FALSE;
-
   for (i = 0; i < resolved_src_refs->len; i++)
     {
       const char *dst_ref = dst_refs[i];
@@ -26,6 +26,7 @@
 #include <string.h>
 
 #include <glib/gi18n.h>
+#include <gio/gunixinputstream.h>
 
 #include "libglnx.h"
 
@@ -55,6 +56,7 @@ static char **opt_subsets;
 static char *opt_collection_id = NULL;
 static int opt_token_type = -1;
 static gboolean opt_no_summary_index = FALSE;
+static gint opt_jobs;
 
 static GOptionEntry options[] = {
   { "subject", 's', 0, G_OPTION_ARG_STRING, &opt_subject, N_("One line subject"), N_("SUBJECT") },
@@ -78,6 +80,7 @@ static GOptionEntry options[] = {
   { "disable-fsync", 0, 0, G_OPTION_ARG_NONE, &opt_disable_fsync, "Do not invoke fsync()", NULL },
   { "disable-sandbox", 0, 0, G_OPTION_ARG_NONE, &opt_disable_sandbox, "Do not sandbox icon validator", NULL },
   { "no-summary-index", 0, 0, G_OPTION_ARG_NONE, &opt_no_summary_index, N_("Don't generate a summary index"), NULL },
+  { "jobs", 0, 0, G_OPTION_ARG_INT, &opt_jobs, N_("Max parallel jobs for writing file contents (default: NUMCPUs)"), N_("NUM-JOBS") },
 
   { NULL }
 };
@@ -216,6 +219,437 @@ commit_filter (OstreeRepo *repo,
   return OSTREE_REPO_COMMIT_FILTER_ALLOW;
 }
 
+/* The checksums of the file objects written by the previous export of a
+ * build dir, keyed by what lstat() says about the source file. Any change
+ * to the content, mode or xattrs of a file changes its ctime, so a file
+ * with a matching key doesn't need to be read and checksummed again, as
+ * long as its object is still in the repo. */
+#define EXPORT_CACHE_FILE ".flatpak-export-cache"
+#define EXPORT_CACHE_FORMAT "a{ss}"
+
+typedef struct
+{
+  OstreeRepo  *repo;
+  CommitData  *commit_data;
+  GHashTable  *old_checksums; /* stat key => checksum */
+  GHashTable  *new_checksums;
+  guint        n_reused;
+  guint        n_jobs;
+  int          root_dfd;
+  GThreadPool *pool;
+  GPtrArray   *pending; /* ExportJob, in walk order */
+} ExportCache;
+
+/* A file that isn't in the cache and needs to be checksummed, compressed
+ * and written to the repo. With more than one job these run on a thread
+ * pool while the walk continues, and the results are added to the mtree
+ * in walk order once the pool is drained. */
+typedef struct
+{
+  OstreeRepo        *repo;
+  int                root_dfd;
+  char              *path; /* relative to root_dfd */
+  char              *key;
+  GFileInfo         *file_info;
+  OstreeMutableTree *mtree;
+  char              *name;
+  char              *checksum;
+  GError            *error;
+} ExportJob;
+
+static void
+export_job_free (ExportJob *job)
+{
+  g_free (job->path);
+  g_free (job->key);
+  g_clear_object (&job->file_info);
+  g_clear_object (&job->mtree);
+  g_free (job->name);
+  g_free (job->checksum);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ExportJob, export_job_free)
+
+static char *
+export_cache_key (const struct stat *stbuf)
+{
+  return g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT
+                          ":%" G_GINT64_FORMAT ".%ld:%" G_GINT64_FORMAT ".%ld:%o",
+                          (guint64) stbuf->st_dev, (guint64) stbuf->st_ino, (guint64) stbuf->st_size,
+                          (gint64) stbuf->st_mtim.tv_sec, (long) stbuf->st_mtim.tv_nsec,
+                          (gint64) stbuf->st_ctim.tv_sec, (long) stbuf->st_ctim.tv_nsec,
+                          (guint) stbuf->st_mode);
+}
+
+static GHashTable *
+load_export_cache (GFile *base)
+{
+  g_autoptr(GFile) cache_file = g_file_get_child (base, EXPORT_CACHE_FILE);
+  g_autoptr(GHashTable) checksums = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) cache = NULL;
+  GVariantIter iter;
+  const char *key, *checksum;
+
+  mfile = g_mapped_file_new (flatpak_file_get_path_cached (cache_file), FALSE, NULL);
+  if (mfile == NULL)
+    return g_steal_pointer (&checksums);
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  cache = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (EXPORT_CACHE_FORMAT), bytes, FALSE));
+
+  g_variant_iter_init (&iter, cache);
+  while (g_variant_iter_next (&iter, "{&s&s}", &key, &checksum))
+    {
+      if (ostree_validate_checksum_string (checksum, NULL))
+        g_hash_table_insert (checksums, g_strdup (key), g_strdup (checksum));
+    }
+
+  return g_steal_pointer (&checksums);
+}
+
+static void
+save_export_cache (GFile      *base,
+                   GHashTable *checksums)
+{
+  g_autoptr(GFile) cache_file = g_file_get_child (base, EXPORT_CACHE_FILE);
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GError) local_error = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (EXPORT_CACHE_FORMAT));
+  g_hash_table_iter_init (&iter, checksums);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&builder, "{ss}", (const char *) key, (const char *) value);
+  cache = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!glnx_file_replace_contents_at (AT_FDCWD, flatpak_file_get_path_cached (cache_file),
+                                      g_variant_get_data (cache), g_variant_get_size (cache),
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error))
+    g_info ("Failed to save the export cache: %s", local_error->message);
+}
+
+static GFileInfo *
+file_info_from_stat (const char        *name,
+                     const struct stat *stbuf)
+{
+  g_autoptr(GFileInfo) file_info = g_file_info_new ();
+  GFileType type;
+
+  if (S_ISDIR (stbuf->st_mode))
+    type = G_FILE_TYPE_DIRECTORY;
+  else if (S_ISREG (stbuf->st_mode))
+    type = G_FILE_TYPE_REGULAR;
+  else if (S_ISLNK (stbuf->st_mode))
+    type = G_FILE_TYPE_SYMBOLIC_LINK;
+  else
+    type = G_FILE_TYPE_SPECIAL;
+
+  g_file_info_set_name (file_info, name);
+  g_file_info_set_file_type (file_info, type);
+  g_file_info_set_size (file_info, stbuf->st_size);
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", stbuf->st_uid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", stbuf->st_gid);
+  g_file_info_set_attribute_uint32 (file_info, "unix::mode", stbuf->st_mode);
+
+  return g_steal_pointer (&file_info);
+}
+
+static gboolean
+export_job_write_content (ExportJob *job,
+                          GError   **error)
+{
+  g_autoptr(GInputStream) raw_input = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  g_autofree guchar *csum = NULL;
+  guint64 length;
+
+  if (g_file_info_get_file_type (job->file_info) == G_FILE_TYPE_SYMBOLIC_LINK)
+    {
+      g_autofree char *target = glnx_readlinkat_malloc (job->root_dfd, job->path, NULL, error);
+
+      if (target == NULL)
+        return FALSE;
+
+      g_file_info_set_symlink_target (job->file_info, target);
+    }
+  else
+    {
+      glnx_autofd int fd = -1;
+
+      if (!glnx_openat_rdonly (job->root_dfd, job->path, FALSE, &fd, error))
+        return FALSE;
+
+      raw_input = g_unix_input_stream_new (g_steal_fd (&fd), TRUE);
+    }
+
+  if (!ostree_raw_file_to_content_stream (raw_input, job->file_info, NULL,
+                                          &input, &length, NULL, error))
+    return FALSE;
+
+  if (!ostree_repo_write_content (job->repo, NULL, input, length,
+                                  &csum, NULL, error))
+    return FALSE;
+
+  job->checksum = ostree_checksum_from_bytes (csum);
+
+  return TRUE;
+}
+
+static void
+export_job_run (gpointer data,
+                gpointer user_data)
+{
+  ExportJob *job = data;
+
+  export_job_write_content (job, &job->error);
+}
+
+static gboolean
+export_job_finish (ExportCache *cache,
+                   ExportJob   *job,
+                   GError     **error)
+{
+  if (job->error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&job->error));
+      return FALSE;
+    }
+
+  if (!ostree_mutable_tree_replace_file (job->mtree, job->name, job->checksum, error))
+    return FALSE;
+
+  g_hash_table_insert (cache->new_checksums, g_steal_pointer (&job->key), g_steal_pointer (&job->checksum));
+
+  return TRUE;
+}
+
+/* Waits for the queued jobs and, unless the walk failed, adds their
+ * results to the mtrees */
+static gboolean
+export_cache_flush (ExportCache *cache,
+                    gboolean     apply,
+                    GError     **error)
+{
+  g_autoptr(GPtrArray) pending = g_steal_pointer (&cache->pending);
+
+  if (cache->pool != NULL)
+    g_thread_pool_free (g_steal_pointer (&cache->pool), FALSE, TRUE);
+
+  if (!apply)
+    return TRUE;
+
+  for (guint i = 0; pending != NULL && i < pending->len; i++)
+    {
+      if (!export_job_finish (cache, g_ptr_array_index (pending, i), error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+write_file_to_mtree_cached (ExportCache       *cache,
+                            const char        *path,
+                            const char        *name,
+                            const struct stat *stbuf,
+                            GFileInfo         *file_info,
+                            OstreeMutableTree *mtree,
+                            GCancellable      *cancellable,
+                            GError           **error)
+{
+  g_autofree char *key = export_cache_key (stbuf);
+  const char *cached_checksum = g_hash_table_lookup (cache->old_checksums, key);
+  g_autoptr(ExportJob) job = NULL;
+
+  if (cached_checksum != NULL)
+    {
+      gboolean have_object = FALSE;
+
+      if (!ostree_repo_has_object (cache->repo, OSTREE_OBJECT_TYPE_FILE, cached_checksum,
+                                   &have_object, cancellable, error))
+        return FALSE;
+
+      if (have_object)
+        {
+          cache->n_reused++;
+          g_hash_table_insert (cache->new_checksums, g_steal_pointer (&key), g_strdup (cached_checksum));
+          return ostree_mutable_tree_replace_file (mtree, name, cached_checksum, error);
+        }
+    }
+
+  job = g_new0 (ExportJob, 1);
+  job->repo = cache->repo;
+  job->root_dfd = cache->root_dfd;
+  job->path = g_strdup (path + strspn (path, "/"));
+  job->key = g_steal_pointer (&key);
+  job->file_info = g_object_ref (file_info);
+  job->mtree = g_object_ref (mtree);
+  job->name = g_strdup (name);
+
+  if (cache->pool != NULL)
+    {
+      ExportJob *queued = g_steal_pointer (&job);
+
+      g_ptr_array_add (cache->pending, queued);
+      return g_thread_pool_push (cache->pool, queued, error);
+    }
+
+  export_job_run (job, NULL);
+  return export_job_finish (cache, job, error);
+}
+
+static gboolean
+write_dir_metadata (ExportCache       *cache,
+                    GFileInfo         *file_info,
+                    OstreeMutableTree *mtree,
+                    GCancellable      *cancellable,
+                    GError           **error)
+{
+  g_autoptr(GVariant) dirmeta = ostree_create_directory_metadata (file_info, NULL);
+  g_autofree guchar *csum = NULL;
+  g_autofree char *checksum = NULL;
+
+  if (!ostree_repo_write_metadata (cache->repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   dirmeta, &csum, cancellable, error))
+    return FALSE;
+
+  checksum = ostree_checksum_from_bytes (csum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, checksum);
+
+  return TRUE;
+}
+
+/* Does what ostree_repo_write_directory_to_mtree() does with our commit
+ * filter, but takes the checksums of unchanged files from the cache */
+static gboolean
+write_dfd_to_mtree_cached (ExportCache       *cache,
+                           int                dfd,
+                           const char        *path,
+                           OstreeMutableTree *mtree,
+                           GCancellable      *cancellable,
+                           GError           **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      g_autofree char *child_path = NULL;
+      g_autoptr(GFileInfo) file_info = NULL;
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (!glnx_fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+
+      child_path = g_build_filename (path, dent->d_name, NULL);
+      file_info = file_info_from_stat (dent->d_name, &stbuf);
+
+      if (commit_filter (cache->repo, child_path, file_info, cache->commit_data) == OSTREE_REPO_COMMIT_FILTER_SKIP)
+        continue;
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          g_autoptr(OstreeMutableTree) child_mtree = NULL;
+          glnx_autofd int child_dfd = -1;
+
+          if (!ostree_mutable_tree_ensure_dir (mtree, dent->d_name, &child_mtree, error))
+            return FALSE;
+
+          if (!write_dir_metadata (cache, file_info, child_mtree, cancellable, error))
+            return FALSE;
+
+          if (!glnx_opendirat (dfd_iter.fd, dent->d_name, FALSE, &child_dfd, error))
+            return FALSE;
+
+          if (!write_dfd_to_mtree_cached (cache, child_dfd, child_path, child_mtree, cancellable, error))
+            return FALSE;
+        }
+      else if (S_ISREG (stbuf.st_mode) || S_ISLNK (stbuf.st_mode))
+        {
+          if (!write_file_to_mtree_cached (cache, child_path, dent->d_name, &stbuf, file_info,
+                                           mtree, cancellable, error))
+            return FALSE;
+        }
+      else
+        {
+          return glnx_throw (error, "Unsupported file type for %s", child_path);
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+write_directory_to_mtree_cached (ExportCache       *cache,
+                                 GFile             *dir,
+                                 OstreeMutableTree *mtree,
+                                 GCancellable      *cancellable,
+                                 GError           **error)
+{
+  glnx_autofd int dfd = -1;
+  g_autoptr(GFileInfo) file_info = NULL;
+  struct stat stbuf;
+  gboolean ret;
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (dir), TRUE, &dfd, error))
+    return FALSE;
+
+  if (!glnx_fstat (dfd, &stbuf, error))
+    return FALSE;
+
+  /* The filter also canonicalizes the root directory */
+  file_info = file_info_from_stat ("/", &stbuf);
+  commit_filter (cache->repo, "/", file_info, cache->commit_data);
+
+  if (!write_dir_metadata (cache, file_info, mtree, cancellable, error))
+    return FALSE;
+
+  cache->root_dfd = dfd;
+  if (cache->n_jobs > 1)
+    {
+      cache->pending = g_ptr_array_new_with_free_func ((GDestroyNotify) export_job_free);
+      cache->pool = g_thread_pool_new (export_job_run, NULL, cache->n_jobs, FALSE, NULL);
+    }
+
+  /* Always drain the pool, the jobs use dfd */
+  ret = write_dfd_to_mtree_cached (cache, dfd, "/", mtree, cancellable, error);
+  if (!export_cache_flush (cache, ret, error))
+    ret = FALSE;
+
+  return ret;
+}
+
+static gboolean
+write_directory_to_mtree (ExportCache              *cache,
+                          gboolean                  use_cache,
+                          OstreeRepo               *repo,
+                          GFile                    *dir,
+                          OstreeMutableTree        *mtree,
+                          OstreeRepoCommitModifier *modifier,
+                          GCancellable             *cancellable,
+                          GError                  **error)
+{
+  if (use_cache)
+    return write_directory_to_mtree_cached (cache, dir, mtree, cancellable, error);
+
+  return ostree_repo_write_directory_to_mtree (repo, dir, mtree, modifier, cancellable, error);
+}
+
 static gboolean
 add_file_to_mtree (GFile             *file,
                    const char        *name,
@@ -818,6 +1252,10 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   OstreeRepoTransactionStats stats;
   g_autoptr(OstreeRepoCommitModifier) modifier = NULL;
   CommitData commit_data = {0};
+  ExportCache export_cache = {0};
+  g_autoptr(GHashTable) old_checksums = NULL;
+  g_autoptr(GHashTable) new_checksums = NULL;
+  gboolean use_export_cache;
   g_auto(GVariantDict) metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
   g_autoptr(GVariant) metadata_dict_v = NULL;
   g_autoptr(GVariant) subsets_v = NULL;
@@ -1004,11 +1442,28 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
                                               (OstreeRepoCommitFilter) commit_filter, &commit_data, NULL);
 
+  if (opt_jobs <= 0)
+    opt_jobs = g_get_num_processors ();
+
+  /* Bare repos already avoid re-reading files hardlinked from the repo,
+   * through the scan above, the cache is for the usual archive repos */
+  use_export_cache = ostree_repo_get_mode (repo) == OSTREE_REPO_MODE_ARCHIVE;
+  if (use_export_cache)
+    {
+      old_checksums = load_export_cache (base);
+      new_checksums = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      export_cache.repo = repo;
+      export_cache.commit_data = &commit_data;
+      export_cache.old_checksums = old_checksums;
+      export_cache.new_checksums = new_checksums;
+      export_cache.n_jobs = opt_jobs;
+    }
+
   if (is_extension)
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, files, files_mtree, modifier, cancellable, error))
+      if (!write_directory_to_mtree (&export_cache, use_export_cache, repo, files, files_mtree, modifier, cancellable, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -1017,7 +1472,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, usr, files_mtree, modifier, cancellable, error))
+      if (!write_directory_to_mtree (&export_cache, use_export_cache, repo, usr, files_mtree, modifier, cancellable, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -1026,7 +1481,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, files, files_mtree, modifier, cancellable, error))
+      if (!write_directory_to_mtree (&export_cache, use_export_cache, repo, files, files_mtree, modifier, cancellable, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -1034,7 +1489,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
       if (!ostree_mutable_tree_ensure_dir (mtree, "export", &export_mtree, error))
         goto out;
 
-      if (!ostree_repo_write_directory_to_mtree (repo, export, export_mtree, modifier, cancellable, error))
+      if (!write_directory_to_mtree (&export_cache, use_export_cache, repo, export, export_mtree, modifier, cancellable, error))
         goto out;
     }
 
@@ -1044,6 +1499,12 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   if (!ostree_repo_write_mtree (repo, mtree, &root, cancellable, error))
     goto out;
 
+  if (use_export_cache)
+    {
+      g_info ("Reused %u unchanged files from the export cache", export_cache.n_reused);
+      save_export_cache (base, new_checksums);
+    }
+
   if (!flatpak_repo_collect_sizes (repo, root, &installed_size, &download_size, cancellable, error))
     goto out;
 
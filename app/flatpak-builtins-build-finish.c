@@ -101,34 +101,22 @@ export_dir (int           source_parent_fd,
 
   while (TRUE)
     {
-      struct stat stbuf;
       g_autofree char *source_printable = NULL;
 
-      if (!glnx_dirfd_iterator_next_dent (&source_iter, &dent, cancellable, error))
+      /* The type comes from the dirent where possible, only entries that
+       * get exported need to be stat()ed, by the copy */
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&source_iter, &dent, cancellable, error))
         return FALSE;
 
       if (dent == NULL)
         break;
 
-      if (fstatat (source_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == -1)
-        {
-          if (errno == ENOENT)
-            {
-              continue;
-            }
-          else
-            {
-              glnx_set_error_from_errno (error);
-              return FALSE;
-            }
-        }
-
       /* Don't export any hidden files or backups */
       if (g_str_has_prefix (dent->d_name, ".") ||
           g_str_has_suffix (dent->d_name, "~"))
         continue;
 
-      if (S_ISDIR (stbuf.st_mode))
+      if (dent->d_type == DT_DIR)
         {
           g_autofree gchar *child_relpath = g_build_filename (source_relpath, dent->d_name, NULL);
 
@@ -137,7 +125,7 @@ export_dir (int           source_parent_fd,
                            cancellable, error))
             return FALSE;
         }
-      else if (S_ISREG (stbuf.st_mode))
+      else if (dent->d_type == DT_REG)
         {
           g_autofree gchar *name_without_extension = NULL;
           int i;
@@ -166,7 +154,7 @@ export_dir (int           source_parent_fd,
 
           g_print (_("Exporting %s\n"), source_printable);
 
-          if (!glnx_file_copy_at (source_iter.fd, dent->d_name, &stbuf,
+          if (!glnx_file_copy_at (source_iter.fd, dent->d_name, NULL,
                                   destination_dfd, dent->d_name,
                                   GLNX_FILE_COPY_NOXATTRS,
                                   cancellable,
@@ -197,29 +185,6 @@ export_dir (int           source_parent_fd,
   return TRUE;
 }
 
-static gboolean
-copy_exports (GFile        *source,
-              GFile        *destination,
-              const char   *source_prefix,
-              char        **allowed_prefixes,
-              char        **allowed_extensions,
-              gboolean      require_exact_match,
-              GCancellable *cancellable,
-              GError      **error)
-{
-  if (!flatpak_mkdir_p (destination, cancellable, error))
-    return FALSE;
-
-  /* The fds are closed by this call */
-  if (!export_dir (AT_FDCWD, flatpak_file_get_path_cached (source), source_prefix,
-                   AT_FDCWD, flatpak_file_get_path_cached (destination),
-                   allowed_prefixes, allowed_extensions, require_exact_match,
-                   cancellable, error))
-    return FALSE;
-
-  return TRUE;
-}
-
 static gboolean
 collect_exports (GFile          *base,
                  const char     *app_id,
@@ -229,6 +194,8 @@ collect_exports (GFile          *base,
 {
   g_autoptr(GFile) files = NULL;
   g_autoptr(GFile) export = NULL;
+  glnx_autofd int files_dfd = -1;
+  glnx_autofd int export_dfd = -1;
   int i;
   const char *paths[] = {
     "share/applications",                 /* Copy desktop files */
@@ -253,44 +220,50 @@ collect_exports (GFile          *base,
   if (opt_no_exports)
     return TRUE;
 
+  /* Everything below is relative to these, so that the paths are only
+   * resolved once */
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (files), TRUE, &files_dfd, error) ||
+      !glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (export), TRUE, &export_dfd, error))
+    return FALSE;
+
   for (i = 0; paths[i]; i++)
     {
       const char * path = paths[i];
-      g_autoptr(GFile) src = g_file_resolve_relative_path (files, path);
+      const char *dest;
+      g_autofree char *dest_parent = NULL;
       g_auto(GStrv) allowed_prefixes = NULL;
       g_auto(GStrv) allowed_extensions = NULL;
       gboolean require_exact_match = FALSE;
+      struct stat stbuf;
 
       if (!flatpak_context_get_allowed_exports (arg_context, path, app_id,
                                                 &allowed_extensions, &allowed_prefixes, &require_exact_match))
         return flatpak_fail (error, "Unexpectedly not allowed to export %s", path);
 
-      if (g_file_query_exists (src, cancellable))
-        {
-          g_info ("Exporting from %s", path);
-          g_autoptr(GFile) dest = NULL;
-          g_autoptr(GFile) dest_parent = NULL;
+      if (!glnx_fstatat_allow_noent (files_dfd, path, &stbuf, 0, error))
+        return FALSE;
 
-          if (strcmp (path, "share/appdata") == 0)
-            dest = g_file_resolve_relative_path (export, "share/metainfo");
-          else
-            dest = g_file_resolve_relative_path (export, path);
+      if (errno == ENOENT)
+        continue;
 
-          dest_parent = g_file_get_parent (dest);
-          g_info ("Ensuring export/%s parent exists", path);
-          if (!flatpak_mkdir_p (dest_parent, cancellable, error))
-            return FALSE;
-          g_info ("Copying from files/%s", path);
-          if (!copy_exports (src,
-                             dest,
-                             path,
-                             allowed_prefixes,
-                             allowed_extensions,
-                             require_exact_match,
-                             cancellable,
-                             error))
-            return FALSE;
-        }
+      g_info ("Exporting from %s", path);
+
+      if (strcmp (path, "share/appdata") == 0)
+        dest = "share/metainfo";
+      else
+        dest = path;
+
+      dest_parent = g_path_get_dirname (dest);
+      g_info ("Ensuring export/%s parent exists", path);
+      if (!glnx_shutil_mkdir_p_at (export_dfd, dest_parent, 0755, cancellable, error))
+        return FALSE;
+
+      g_info ("Copying from files/%s", path);
+      if (!export_dir (files_dfd, path, path,
+                       export_dfd, dest,
+                       allowed_prefixes, allowed_extensions, require_exact_match,
+                       cancellable, error))
+        return FALSE;
     }
 
   g_assert_no_error (*error);
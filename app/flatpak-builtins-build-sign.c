@@ -37,15 +37,123 @@ static char *opt_arch;
 static gboolean opt_runtime;
 static char **opt_gpg_key_ids;
 static char *opt_gpg_homedir;
+static gint opt_jobs;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, N_("Arch to install for"), N_("ARCH") },
   { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, N_("Look for runtime with the specified name"), NULL },
   { "gpg-sign", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_gpg_key_ids, N_("GPG Key ID to sign the commit with"), N_("KEY-ID") },
   { "gpg-homedir", 0, 0, G_OPTION_ARG_STRING, &opt_gpg_homedir, N_("GPG Homedir to use when looking for keyrings"), N_("HOMEDIR") },
+  { "jobs", 0, 0, G_OPTION_ARG_INT, &opt_jobs, N_("Max parallel jobs (default: NUMCPUs)"), N_("NUM-JOBS") },
   { NULL }
 };
 
+typedef struct
+{
+  OstreeRepo *repo;
+  char       *commit;
+  GError     *error;
+} SignJob;
+
+static void
+sign_job_free (SignJob *job)
+{
+  g_free (job->commit);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+static gboolean
+sign_commit (OstreeRepo   *repo,
+             const char   *commit,
+             GCancellable *cancellable,
+             GError      **error)
+{
+  char **iter;
+
+  for (iter = opt_gpg_key_ids; iter && *iter; iter++)
+    {
+      const char *keyid = *iter;
+      g_autoptr(GError) local_error = NULL;
+
+      if (!ostree_repo_sign_commit (repo,
+                                    commit,
+                                    keyid,
+                                    opt_gpg_homedir,
+                                    cancellable,
+                                    &local_error))
+        {
+          if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return FALSE;
+            }
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+sign_job_run (gpointer data,
+              gpointer user_data)
+{
+  SignJob *job = data;
+  GCancellable *cancellable = user_data;
+
+  sign_commit (job->repo, job->commit, cancellable, &job->error);
+}
+
+/* Each commit has its own detached metadata, so different commits can be
+ * signed concurrently. The gpg-agent serves all of them from one session. */
+static gboolean
+sign_commits (OstreeRepo   *repo,
+              GPtrArray    *commits,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) sign_job_free);
+  GThreadPool *pool;
+  int i;
+
+  if (opt_jobs <= 1 || commits->len <= 1)
+    {
+      for (i = 0; i < commits->len; i++)
+        {
+          if (!sign_commit (repo, g_ptr_array_index (commits, i), cancellable, error))
+            return FALSE;
+        }
+
+      return TRUE;
+    }
+
+  pool = g_thread_pool_new (sign_job_run, cancellable, opt_jobs, FALSE, NULL);
+
+  for (i = 0; i < commits->len; i++)
+    {
+      SignJob *job = g_new0 (SignJob, 1);
+
+      job->repo = repo;
+      job->commit = g_strdup (g_ptr_array_index (commits, i));
+      g_ptr_array_add (jobs, job);
+      g_thread_pool_push (pool, job, NULL);
+    }
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  for (i = 0; i < jobs->len; i++)
+    {
+      SignJob *job = g_ptr_array_index (jobs, i);
+
+      if (job->error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&job->error));
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
 
 gboolean
 flatpak_builtin_build_sign (int argc, char **argv, GCancellable *cancellable, GError **error)
@@ -57,10 +165,10 @@ flatpak_builtin_build_sign (int argc, char **argv, GCancellable *cancellable, GE
   const char *location;
   const char *branch;
   const char *id = NULL;
-  g_autofree char *commit_checksum = NULL;
   int i;
-  char **iter;
   g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) commits = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GHashTable) seen_commits = g_hash_table_new (g_str_hash, g_str_equal);
   const char *collection_id;
 
   context = g_option_context_new (_("LOCATION [ID [BRANCH]] - Sign an application or runtime"));
@@ -93,6 +201,9 @@ flatpak_builtin_build_sign (int argc, char **argv, GCancellable *cancellable, GE
   if (opt_gpg_key_ids == NULL)
     return flatpak_fail (error, _("No gpg key ids specified"));
 
+  if (opt_jobs <= 0)
+    opt_jobs = g_get_num_processors ();
+
   repofile = g_file_new_for_commandline_arg (location);
   repo = ostree_repo_new (repofile);
 
@@ -132,35 +243,23 @@ flatpak_builtin_build_sign (int argc, char **argv, GCancellable *cancellable, GE
         }
     }
 
+  /* Several refs can point to the same commit, only sign it once */
   for (i = 0; i < refs->len; i++)
     {
       const char *ref = g_ptr_array_index (refs, i);
+      g_autofree char *commit_checksum = NULL;
 
       if (!flatpak_repo_resolve_rev (repo, collection_id, NULL, ref, FALSE,
                                      &commit_checksum, cancellable, error))
         return FALSE;
 
-      for (iter = opt_gpg_key_ids; iter && *iter; iter++)
-        {
-          const char *keyid = *iter;
-          g_autoptr(GError) local_error = NULL;
-
-          if (!ostree_repo_sign_commit (repo,
-                                        commit_checksum,
-                                        keyid,
-                                        opt_gpg_homedir,
-                                        cancellable,
-                                        &local_error))
-            {
-              if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
-                {
-                  g_propagate_error (error, g_steal_pointer (&local_error));
-                  return FALSE;
-                }
-            }
-        }
+      if (g_hash_table_add (seen_commits, commit_checksum))
+        g_ptr_array_add (commits, g_steal_pointer (&commit_checksum));
     }
 
+  if (!sign_commits (repo, commits, cancellable, error))
+    return FALSE;
+
   return TRUE;
 }
 
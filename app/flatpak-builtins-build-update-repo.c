@@ -59,6 +59,7 @@ static gboolean opt_no_update_appstream;
 static gboolean opt_no_update_summary;
 static gint opt_prune_depth = -1;
 static gint opt_static_delta_jobs;
+static gint opt_jobs;
 static char **opt_static_delta_ignore_refs;
 static char *opt_authenticator_name = NULL;
 static gboolean opt_authenticator_install = -1;
@@ -86,7 +87,8 @@ static GOptionEntry options[] = {
   { "generate-static-deltas", 0, 0, G_OPTION_ARG_NONE, &opt_generate_deltas, N_("Generate delta files"), NULL },
   { "no-update-summary", 0, 0, G_OPTION_ARG_NONE, &opt_no_update_summary, N_("Don't update the summary"), NULL },
   { "no-update-appstream", 0, 0, G_OPTION_ARG_NONE, &opt_no_update_appstream, N_("Don't update the appstream branch"), NULL },
-  { "static-delta-jobs", 0, 0, G_OPTION_ARG_INT, &opt_static_delta_jobs, N_("Max parallel jobs when creating deltas (default: NUMCPUs)"), N_("NUM-JOBS") },
+  { "jobs", 0, 0, G_OPTION_ARG_INT, &opt_jobs, N_("Max parallel jobs (default: NUMCPUs)"), N_("NUM-JOBS") },
+  { "static-delta-jobs", 0, 0, G_OPTION_ARG_INT, &opt_static_delta_jobs, N_("Max parallel jobs when creating deltas (default: same as --jobs)"), N_("NUM-JOBS") },
   { "static-delta-ignore-ref", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_static_delta_ignore_refs, N_("Don't create deltas matching refs"), N_("PATTERN") },
   { "prune", 0, 0, G_OPTION_ARG_NONE, &opt_prune, N_("Prune unused objects"), NULL },
   { "prune-dry-run", 0, 0, G_OPTION_ARG_NONE, &opt_prune_dry_run, N_("Prune but don't actually remove anything"), NULL },
@@ -199,6 +201,189 @@ out:
   return ret;
 }
 
+/* A delta from a parent commit that turned out to be barely smaller than
+ * the objects a client would otherwise download is replaced by a marker
+ * like this, holding the delta name, so it isn't generated again on each
+ * run. Markers are listed and cleaned up alongside the real deltas. */
+#define SKIPPED_DELTA_FILE "flatpak-skipped"
+
+/* Keep from-parent deltas only if they're at most this percentage of the
+ * size of the new objects */
+#define DELTA_MAX_SIZE_PERCENT 90
+
+static gboolean
+get_delta_size (OstreeRepo   *repo,
+                const char   *deltadir,
+                guint64      *out_size,
+                GCancellable *cancellable,
+                GError      **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  struct dirent *dent;
+  guint64 size = 0;
+
+  if (!glnx_dirfd_iterator_init_at (ostree_repo_get_dfd (repo), deltadir, FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type != DT_REG)
+        continue;
+
+      if (!glnx_fstatat (dfd_iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+
+      size += stbuf.st_size;
+    }
+
+  *out_size = size;
+  return TRUE;
+}
+
+/* The storage size of the objects reachable from @to but not from @from,
+ * which for archive repos is what a pull without the delta downloads */
+static gboolean
+get_new_objects_size (OstreeRepo   *repo,
+                      const char   *from,
+                      const char   *to,
+                      guint64      *out_size,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  g_autoptr(GHashTable) from_reachable = ostree_repo_traverse_new_reachable ();
+  g_autoptr(GHashTable) to_reachable = ostree_repo_traverse_new_reachable ();
+  GHashTableIter iter;
+  GVariant *key;
+  guint64 size = 0;
+
+  if (!ostree_repo_traverse_commit_union (repo, from, 0, from_reachable, cancellable, error) ||
+      !ostree_repo_traverse_commit_union (repo, to, 0, to_reachable, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, to_reachable);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &key, NULL))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+      guint64 object_size;
+
+      if (g_hash_table_contains (from_reachable, key))
+        continue;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+      if (!ostree_repo_query_object_storage_size (repo, objtype, checksum, &object_size,
+                                                  cancellable, error))
+        return FALSE;
+
+      size += object_size;
+    }
+
+  *out_size = size;
+  return TRUE;
+}
+
+static gboolean
+skip_delta_if_not_smaller (OstreeRepo   *repo,
+                           const char   *from,
+                           const char   *to,
+                           const char   *ref,
+                           GCancellable *cancellable,
+                           GError      **error)
+{
+  g_autofree char *deltadir = _ostree_get_relative_static_delta_path (from, to, NULL);
+  g_autofree char *marker = g_build_filename (deltadir, SKIPPED_DELTA_FILE, NULL);
+  g_autofree char *delta_name = g_strdup_printf ("%s-%s", from, to);
+  int repo_dfd = ostree_repo_get_dfd (repo);
+  guint64 delta_size, objects_size;
+
+  if (!get_delta_size (repo, deltadir, &delta_size, cancellable, error) ||
+      !get_new_objects_size (repo, from, to, &objects_size, cancellable, error))
+    return FALSE;
+
+  if (delta_size * 100 <= objects_size * DELTA_MAX_SIZE_PERCENT)
+    return TRUE;
+
+  g_print (_("Delta %s (%.10s-%.10s) isn't smaller than its objects, dropping it\n"), ref, from, to);
+
+  if (!glnx_shutil_rm_rf_at (repo_dfd, deltadir, cancellable, error) ||
+      !glnx_shutil_mkdir_p_at (repo_dfd, deltadir, 0755, cancellable, error))
+    return FALSE;
+
+  return glnx_file_replace_contents_at (repo_dfd, marker,
+                                        (const guint8 *) delta_name, strlen (delta_name),
+                                        0, cancellable, error);
+}
+
+/* Adds the names of the deltas that were dropped by
+ * skip_delta_if_not_smaller() to @deltas */
+static gboolean
+list_skipped_deltas (OstreeRepo   *repo,
+                     GPtrArray    *deltas,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
+  struct dirent *dent;
+  int repo_dfd = ostree_repo_get_dfd (repo);
+
+  if (!glnx_fstatat_allow_noent (repo_dfd, "deltas", NULL, 0, error))
+    return FALSE;
+
+  if (errno == ENOENT)
+    return TRUE;
+
+  if (!glnx_dirfd_iterator_init_at (repo_dfd, "deltas", FALSE, &dfd_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      g_auto(GLnxDirFdIterator) sub_dfd_iter = { 0, };
+      struct dirent *sub_dent;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&dfd_iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type != DT_DIR)
+        continue;
+
+      if (!glnx_dirfd_iterator_init_at (dfd_iter.fd, dent->d_name, FALSE, &sub_dfd_iter, error))
+        return FALSE;
+
+      while (TRUE)
+        {
+          g_autofree char *marker = NULL;
+          g_autofree char *delta_name = NULL;
+
+          if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&sub_dfd_iter, &sub_dent, cancellable, error))
+            return FALSE;
+
+          if (sub_dent == NULL)
+            break;
+
+          if (sub_dent->d_type != DT_DIR)
+            continue;
+
+          marker = g_build_filename (sub_dent->d_name, SKIPPED_DELTA_FILE, NULL);
+          delta_name = glnx_file_get_contents_utf8_at (sub_dfd_iter.fd, marker, NULL, cancellable, NULL);
+          if (delta_name != NULL && strchr (delta_name, '-') != NULL)
+            g_ptr_array_add (deltas, g_steal_pointer (&delta_name));
+        }
+    }
+
+  return TRUE;
+}
+
 static gboolean
 generate_one_delta (OstreeRepo   *repo,
                     const char   *from,
@@ -238,6 +423,12 @@ generate_one_delta (OstreeRepo   *repo,
       return FALSE;
     }
 
+  /* Deltas from scratch are kept regardless, they still save clients
+   * the many requests of a pull of loose objects */
+  if (from != NULL &&
+      !skip_delta_if_not_smaller (repo, from, to, ref, cancellable, error))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -305,8 +496,269 @@ spawn_delta_generation (GMainContext *context,
   return TRUE;
 }
 
+typedef struct
+{
+  OstreeRepo   *repo;
+  GMainContext *context;
+  GCancellable *cancellable;
+  GError       *error;
+  gboolean      res;
+  gint          done;
+} AppstreamGeneration;
+
+static gpointer
+generate_appstream_thread (gpointer user_data)
+{
+  AppstreamGeneration *generation = user_data;
+
+  generation->res = flatpak_repo_generate_appstream (generation->repo, (const char **) opt_gpg_key_ids,
+                                                     opt_gpg_homedir, 0,
+                                                     generation->cancellable, &generation->error);
+
+  g_atomic_int_set (&generation->done, TRUE);
+  g_main_context_wakeup (generation->context);
+
+  return NULL;
+}
+
+static gboolean
+ref_wants_deltas (const char *ref,
+                  GPtrArray  *ignore_patterns)
+{
+  gboolean ignore_ref = FALSE;
+  int i;
+
+  if (g_str_has_prefix (ref, "app/") || g_str_has_prefix (ref, "runtime/"))
+    {
+      g_auto(GStrv) parts = g_strsplit (ref, "/", 4);
+
+      for (i = 0; i < ignore_patterns->len; i++)
+        {
+          GPatternSpec *pattern = g_ptr_array_index(ignore_patterns, i);
+          if (g_pattern_match_string (pattern, parts[1]))
+            {
+              ignore_ref = TRUE;
+              break;
+            }
+        }
+
+    }
+  else if (g_str_has_prefix (ref, "appstream/"))
+    {
+      /* Old appstream branch deltas poorly, and most users handle the new format */
+      ignore_ref = TRUE;
+    }
+  else if (g_str_has_prefix (ref, "appstream2/"))
+    {
+      /* Always delta this */
+      ignore_ref = FALSE;
+    }
+  else
+    {
+      /* Ignore unknown ref types */
+      ignore_ref = TRUE;
+    }
+
+  if (ignore_ref)
+    g_info ("Ignoring deltas for ref %s", ref);
+
+  return !ignore_ref;
+}
+
+/* Persisted between runs: for each ref, the commit its deltas were last
+ * looked at for, the deltas that were generated for it, and the ones that
+ * were kept around. A ref whose commit didn't change and whose deltas all
+ * still exist isn't looked at again. */
+#define DELTA_STATE_FILE "flatpak-delta-state"
+#define DELTA_STATE_FORMAT "a{s(sasas)}"
+
+static GHashTable *
+load_delta_state (OstreeRepo *repo)
+{
+  g_autoptr(GHashTable) state = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_variant_unref);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) state_v = NULL;
+  GVariantIter iter;
+  const char *ref;
+  GVariant *entry;
+
+  bytes = flatpak_load_file_at (ostree_repo_get_dfd (repo), DELTA_STATE_FILE, NULL, NULL);
+  if (bytes == NULL)
+    return g_steal_pointer (&state);
+
+  state_v = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (DELTA_STATE_FORMAT), bytes, FALSE));
+
+  g_variant_iter_init (&iter, state_v);
+  while (g_variant_iter_next (&iter, "{&s@(sasas)}", &ref, &entry))
+    g_hash_table_insert (state, g_strdup (ref), entry);
+
+  return g_steal_pointer (&state);
+}
+
+static void
+save_delta_state (OstreeRepo *repo,
+                  GHashTable *state)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GVariant) state_v = NULL;
+  g_autoptr(GError) local_error = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (DELTA_STATE_FORMAT));
+  g_hash_table_iter_init (&iter, state);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&builder, "{s@(sasas)}", (const char *) key, (GVariant *) value);
+  state_v = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!glnx_file_replace_contents_at (ostree_repo_get_dfd (repo), DELTA_STATE_FILE,
+                                      g_variant_get_data (state_v), g_variant_get_size (state_v),
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error))
+    g_info ("Failed to save the delta state: %s", local_error->message);
+}
+
+/* If the deltas of @ref are up to date according to @entry, marks them as
+ * wanted and returns TRUE */
+static gboolean
+reuse_delta_state (GVariant   *entry,
+                   const char *commit,
+                   GHashTable *all_deltas_hash,
+                   GHashTable *wanted_deltas_hash)
+{
+  const char *state_commit;
+  g_autofree const char **generated = NULL;
+  g_autofree const char **kept = NULL;
+  int i;
+
+  if (entry == NULL)
+    return FALSE;
+
+  g_variant_get (entry, "(&s^a&s^a&s)", &state_commit, &generated, &kept);
+  if (strcmp (state_commit, commit) != 0)
+    return FALSE;
+
+  for (i = 0; generated[i] != NULL; i++)
+    {
+      if (!g_hash_table_contains (all_deltas_hash, generated[i]))
+        return FALSE;
+    }
+
+  for (i = 0; generated[i] != NULL; i++)
+    g_hash_table_insert (wanted_deltas_hash, g_strdup (generated[i]), GINT_TO_POINTER (1));
+  for (i = 0; kept[i] != NULL; i++)
+    g_hash_table_insert (wanted_deltas_hash, g_strdup (kept[i]), GINT_TO_POINTER (1));
+
+  return TRUE;
+}
+
+static gboolean
+spawn_ref_deltas (GMainContext *context,
+                  int          *n_spawned_delta_generate,
+                  OstreeRepo   *repo,
+                  GVariant     *params,
+                  GHashTable   *all_deltas_hash,
+                  GHashTable   *wanted_deltas_hash,
+                  GHashTable   *old_state,
+                  GHashTable   *new_state,
+                  const char   *ref,
+                  const char   *commit,
+                  GError      **error)
+{
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GVariant) parent_variant = NULL;
+  g_autofree char *parent_commit = NULL;
+  g_autofree char *grandparent_commit = NULL;
+  g_autoptr(GPtrArray) generated = NULL;
+  g_autoptr(GPtrArray) kept = NULL;
+  GVariant *old_entry = g_hash_table_lookup (old_state, ref);
+
+  if (reuse_delta_state (old_entry, commit, all_deltas_hash, wanted_deltas_hash))
+    {
+      g_hash_table_insert (new_state, g_strdup (ref), g_variant_ref (old_entry));
+      return TRUE;
+    }
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
+                                 &variant, NULL))
+    {
+      g_warning ("Couldn't load commit %s", commit);
+      return TRUE;
+    }
+
+  generated = g_ptr_array_new_with_free_func (g_free);
+  kept = g_ptr_array_new_with_free_func (g_free);
+
+  /* From empty */
+  if (!g_hash_table_contains (all_deltas_hash, commit))
+    {
+      if (!spawn_delta_generation (context, n_spawned_delta_generate, repo, params,
+                                   ref, NULL, commit,
+                                   error))
+        return FALSE;
+    }
+
+  /* Mark this one as wanted */
+  g_ptr_array_add (generated, g_strdup (commit));
+
+  parent_commit = ostree_commit_get_parent (variant);
+
+  if (parent_commit != NULL &&
+      !ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, parent_commit,
+                                 &parent_variant, NULL))
+    {
+      g_warning ("Couldn't load parent commit %s", parent_commit);
+      parent_variant = NULL;
+    }
+
+  /* From parent */
+  if (parent_variant != NULL)
+    {
+      g_autofree char *from_parent = g_strdup_printf ("%s-%s", parent_commit, commit);
+
+      if (!g_hash_table_contains (all_deltas_hash, from_parent))
+        {
+          if (!spawn_delta_generation (context, n_spawned_delta_generate, repo, params,
+                                       ref, parent_commit, commit,
+                                       error))
+            return FALSE;
+        }
+
+      /* Mark parent-to-current as wanted */
+      g_ptr_array_add (generated, g_steal_pointer (&from_parent));
+
+      /* We also want to keep around the parent and the grandparent-to-parent deltas
+       * because otherwise these will be deleted immediately which may cause a race if
+       * someone is currently downloading them.
+       * However, there is no need to generate these if they don't exist.
+       */
+
+      g_ptr_array_add (kept, g_strdup (parent_commit));
+      grandparent_commit = ostree_commit_get_parent (parent_variant);
+      if (grandparent_commit != NULL)
+        g_ptr_array_add (kept, g_strdup_printf ("%s-%s", grandparent_commit, parent_commit));
+    }
+
+  for (guint i = 0; i < generated->len; i++)
+    g_hash_table_insert (wanted_deltas_hash, g_strdup (g_ptr_array_index (generated, i)), GINT_TO_POINTER (1));
+  for (guint i = 0; i < kept->len; i++)
+    g_hash_table_insert (wanted_deltas_hash, g_strdup (g_ptr_array_index (kept, i)), GINT_TO_POINTER (1));
+
+  g_ptr_array_add (generated, NULL);
+  g_ptr_array_add (kept, NULL);
+  g_hash_table_insert (new_state, g_strdup (ref),
+                       g_variant_ref_sink (g_variant_new ("(s^as^as)", commit,
+                                                          (char **) generated->pdata,
+                                                          (char **) kept->pdata)));
+
+  return TRUE;
+}
+
+/* If @update_appstream is set, the appstream branches are generated in a
+ * thread while the deltas of the app and runtime refs are generated, and
+ * the appstream deltas are generated once it's done. */
 static gboolean
 generate_all_deltas (OstreeRepo   *repo,
+                     gboolean      update_appstream,
                      GPtrArray   **unwanted_deltas,
                      GCancellable *cancellable,
                      GError      **error)
@@ -315,6 +767,8 @@ generate_all_deltas (OstreeRepo   *repo,
   g_autoptr(GHashTable) all_deltas_hash = NULL;
   g_autoptr(GHashTable) wanted_deltas_hash = NULL;
   g_autoptr(GPtrArray) all_deltas = NULL;
+  g_autoptr(GHashTable) old_state = NULL;
+  g_autoptr(GHashTable) new_state = NULL;
   int i;
   GHashTableIter iter;
   gpointer key, value;
@@ -323,6 +777,9 @@ generate_all_deltas (OstreeRepo   *repo,
   int n_spawned_delta_generate = 0;
   g_autoptr(GMainContextPopDefault) context = NULL;
   g_autoptr(GPtrArray) ignore_patterns = g_ptr_array_new_with_free_func ((GDestroyNotify)g_pattern_spec_free);
+  AppstreamGeneration appstream_generation = { NULL };
+  GThread *appstream_thread = NULL;
+  g_autoptr(GError) local_error = NULL;
 
   g_print ("Generating static deltas\n");
 
@@ -336,6 +793,11 @@ generate_all_deltas (OstreeRepo   *repo,
                                             cancellable, error))
     return FALSE;
 
+  /* Skipped deltas count as existing, so they aren't generated again, and
+   * are cleaned up like real deltas once unwanted */
+  if (!list_skipped_deltas (repo, all_deltas, cancellable, error))
+    return FALSE;
+
   wanted_deltas_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   all_deltas_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
@@ -348,6 +810,9 @@ generate_all_deltas (OstreeRepo   *repo,
                               cancellable, error))
     return FALSE;
 
+  old_state = load_delta_state (repo);
+  new_state = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_variant_unref);
+
   context = flatpak_main_context_new_default ();
 
   if (opt_static_delta_ignore_refs != NULL)
@@ -357,117 +822,78 @@ generate_all_deltas (OstreeRepo   *repo,
                          g_pattern_spec_new (opt_static_delta_ignore_refs[i]));
     }
 
+  if (update_appstream)
+    {
+      g_print (_("Updating appstream branch\n"));
+      appstream_generation.repo = repo;
+      appstream_generation.context = context;
+      appstream_generation.cancellable = cancellable;
+      appstream_thread = g_thread_new ("flatpak-appstream", generate_appstream_thread, &appstream_generation);
+    }
+
   g_hash_table_iter_init (&iter, all_refs);
-  while (g_hash_table_iter_next (&iter, &key, &value))
+  while (local_error == NULL && g_hash_table_iter_next (&iter, &key, &value))
     {
       const char *ref = key;
       const char *commit = value;
-      g_autoptr(GVariant) variant = NULL;
-      g_autoptr(GVariant) parent_variant = NULL;
-      g_autofree char *parent_commit = NULL;
-      g_autofree char *grandparent_commit = NULL;
-      gboolean ignore_ref = FALSE;
 
-      if (g_str_has_prefix (ref, "app/") || g_str_has_prefix (ref, "runtime/"))
-        {
-          g_auto(GStrv) parts = g_strsplit (ref, "/", 4);
-
-          for (i = 0; i < ignore_patterns->len; i++)
-            {
-              GPatternSpec *pattern = g_ptr_array_index(ignore_patterns, i);
-              if (g_pattern_match_string (pattern, parts[1]))
-                {
-                  ignore_ref = TRUE;
-                  break;
-                }
-            }
-
-        }
-      else if (g_str_has_prefix (ref, "appstream/"))
-        {
-          /* Old appstream branch deltas poorly, and most users handle the new format */
-          ignore_ref = TRUE;
-        }
-      else if (g_str_has_prefix (ref, "appstream2/"))
-        {
-          /* Always delta this */
-          ignore_ref = FALSE;
-        }
-      else
-        {
-          /* Ignore unknown ref types */
-          ignore_ref = TRUE;
-        }
+      /* These are regenerated by the appstream thread, so wait for it */
+      if (update_appstream && g_str_has_prefix (ref, "appstream2/"))
+        continue;
 
-      if (ignore_ref)
-        {
-          g_info ("Ignoring deltas for ref %s", ref);
-          continue;
-        }
+      if (ref_wants_deltas (ref, ignore_patterns))
+        spawn_ref_deltas (context, &n_spawned_delta_generate, repo, params,
+                          all_deltas_hash, wanted_deltas_hash, old_state, new_state,
+                          ref, commit, &local_error);
+    }
 
-      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit,
-                                     &variant, NULL))
-        {
-          g_warning ("Couldn't load commit %s", commit);
-          continue;
-        }
+  if (appstream_thread != NULL)
+    {
+      while (!g_atomic_int_get (&appstream_generation.done))
+        g_main_context_iteration (context, TRUE);
+      g_thread_join (appstream_thread);
 
-      /* From empty */
-      if (!g_hash_table_contains (all_deltas_hash, commit))
+      if (!appstream_generation.res)
         {
-          if (!spawn_delta_generation (context, &n_spawned_delta_generate, repo, params,
-                                       ref, NULL, commit,
-                                       error))
-            return FALSE;
+          if (local_error == NULL)
+            local_error = g_steal_pointer (&appstream_generation.error);
+          g_clear_error (&appstream_generation.error);
         }
 
-      /* Mark this one as wanted */
-      g_hash_table_insert (wanted_deltas_hash, g_strdup (commit), GINT_TO_POINTER (1));
+      g_clear_pointer (&all_refs, g_hash_table_unref);
+      if (local_error == NULL)
+        ostree_repo_list_refs (repo, NULL, &all_refs, cancellable, &local_error);
 
-      parent_commit = ostree_commit_get_parent (variant);
-
-      if (parent_commit != NULL &&
-          !ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, parent_commit,
-                                     &parent_variant, NULL))
-        {
-          g_warning ("Couldn't load parent commit %s", parent_commit);
-          continue;
-        }
-
-      /* From parent */
-      if (parent_variant != NULL)
+      if (all_refs != NULL)
         {
-          g_autofree char *from_parent = g_strdup_printf ("%s-%s", parent_commit, commit);
-
-          if (!g_hash_table_contains (all_deltas_hash, from_parent))
+          g_hash_table_iter_init (&iter, all_refs);
+          while (local_error == NULL && g_hash_table_iter_next (&iter, &key, &value))
             {
-              if (!spawn_delta_generation (context, &n_spawned_delta_generate, repo, params,
-                                           ref, parent_commit, commit,
-                                           error))
-                return FALSE;
-            }
+              const char *ref = key;
+              const char *commit = value;
 
-          /* Mark parent-to-current as wanted */
-          g_hash_table_insert (wanted_deltas_hash, g_strdup (from_parent), GINT_TO_POINTER (1));
-
-          /* We also want to keep around the parent and the grandparent-to-parent deltas
-           * because otherwise these will be deleted immediately which may cause a race if
-           * someone is currently downloading them.
-           * However, there is no need to generate these if they don't exist.
-           */
-
-          g_hash_table_insert (wanted_deltas_hash, g_strdup (parent_commit), GINT_TO_POINTER (1));
-          grandparent_commit = ostree_commit_get_parent (parent_variant);
-          if (grandparent_commit != NULL)
-            g_hash_table_insert (wanted_deltas_hash,
-                                 g_strdup_printf ("%s-%s", grandparent_commit, parent_commit),
-                                 GINT_TO_POINTER (1));
+              if (g_str_has_prefix (ref, "appstream2/"))
+                spawn_ref_deltas (context, &n_spawned_delta_generate, repo, params,
+                                  all_deltas_hash, wanted_deltas_hash, old_state, new_state,
+                          ref, commit, &local_error);
+            }
         }
     }
 
+  /* Don't leave any delta generation running, even on errors */
   while (n_spawned_delta_generate > 0)
     g_main_context_iteration (context, TRUE);
 
+  if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  /* Deltas that failed to generate are missing on the next run, so their
+   * refs get looked at again */
+  save_delta_state (repo, new_state);
+
   *unwanted_deltas = g_ptr_array_new_with_free_func (g_free);
   for (i = 0; i < all_deltas->len; i++)
     {
@@ -498,8 +924,11 @@ flatpak_builtin_build_update_repo (int argc, char **argv,
   if (argc < 2)
     return usage_error (context, _("LOCATION must be specified"), error);
 
+  if (opt_jobs <= 0)
+    opt_jobs = g_get_num_processors ();
+
   if (opt_static_delta_jobs <= 0)
-    opt_static_delta_jobs = g_get_num_processors ();
+    opt_static_delta_jobs = opt_jobs;
 
   location = argv[1];
 
@@ -604,7 +1033,9 @@ flatpak_builtin_build_update_repo (int argc, char **argv,
         return FALSE;
     }
 
-  if (!opt_no_update_appstream)
+  /* When generating deltas, the appstream is generated while the deltas of
+   * the other refs are being generated */
+  if (!opt_no_update_appstream && !opt_generate_deltas)
     {
       g_print (_("Updating appstream branch\n"));
       if (!flatpak_repo_generate_appstream (repo, (const char **) opt_gpg_key_ids, opt_gpg_homedir, 0, cancellable, error))
@@ -612,7 +1043,7 @@ flatpak_builtin_build_update_repo (int argc, char **argv,
     }
 
   if (opt_generate_deltas &&
-      !generate_all_deltas (repo, &unwanted_deltas, cancellable, error))
+      !generate_all_deltas (repo, !opt_no_update_appstream, &unwanted_deltas, cancellable, error))
     return FALSE;
 
   if (unwanted_deltas != NULL)
@@ -636,7 +1067,7 @@ flatpak_builtin_build_update_repo (int argc, char **argv,
         flags |= FLATPAK_REPO_UPDATE_FLAG_DISABLE_INDEX;
 
       g_print (_("Updating summary\n"));
-      if (!flatpak_repo_update (repo, flags, (const char **) opt_gpg_key_ids, opt_gpg_homedir, cancellable, error))
+      if (!flatpak_repo_update_full (repo, flags, opt_jobs, (const char **) opt_gpg_key_ids, opt_gpg_homedir, cancellable, error))
         return FALSE;
     }
 
@@ -32,6 +32,7 @@
 
 #include "flatpak-builtins.h"
 #include "flatpak-utils-private.h"
+#include "flatpak-run-dbus-private.h"
 #include "flatpak-run-private.h"
 
 static gboolean opt_runtime;
@@ -586,14 +587,14 @@ flatpak_builtin_build (int argc, char **argv, GCancellable *cancellable, GError
         flatpak_decomposed_new_from_parts (FLATPAK_KINDS_APP, id, arch, "nobranch", NULL);
       if (fake_ref != NULL &&
           !flatpak_run_add_extension_args (bwrap, metakey, fake_ref, FALSE, "/app",
-                                           &app_extensions, &app_ld_path,
+                                           &app_extensions, &app_ld_path, NULL,
                                            cancellable, error))
         return FALSE;
     }
 
   if (!custom_usr &&
       !flatpak_run_add_extension_args (bwrap, runtime_metakey, runtime_ref, FALSE, "/usr",
-                                       &runtime_extensions, &runtime_ld_path,
+                                       &runtime_extensions, &runtime_ld_path, NULL,
                                        cancellable, error))
     return FALSE;
 
@@ -623,7 +624,7 @@ flatpak_builtin_build (int argc, char **argv, GCancellable *cancellable, GError
                                          app_context,
                                          shares, devices, sockets, features,
                                          app_id_dir, NULL, -1,
-                                         instance_id, NULL, cancellable, error))
+                                         instance_id, NULL, NULL, cancellable, error))
     return FALSE;
 
   for (i = 0; opt_bind_mounts != NULL && opt_bind_mounts[i] != NULL; i++)
@@ -667,6 +668,9 @@ flatpak_builtin_build (int argc, char **argv, GCancellable *cancellable, GError
 
   g_ptr_array_add (bwrap->argv, NULL);
 
+  if (!flatpak_run_wait_dbus_proxy (bwrap, error))
+    return FALSE;
+
   g_snprintf (pid_str, sizeof (pid_str), "%d", getpid ());
   pid_path = g_build_filename (instance_id_host_dir, "pid", NULL);
   g_file_set_contents (pid_path, pid_str, -1, NULL);
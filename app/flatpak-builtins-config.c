@@ -192,12 +192,49 @@ parse_boolean (const char  *value,
     }
 }
 
+static char *
+parse_deploy_flush (const char  *value,
+                    GError     **error)
+{
+  if (g_strcmp0 (value, "syncfs") == 0 ||
+      g_strcmp0 (value, "fsync") == 0 ||
+      g_strcmp0 (value, "none") == 0)
+    return g_strdup (value);
+
+  flatpak_fail (error, _("'%s' is not a valid value (use 'syncfs', 'fsync' or 'none')"), value);
+  return NULL;
+}
+
+static char *
+parse_checkout_mode (const char  *value,
+                     GError     **error)
+{
+  if (g_strcmp0 (value, "hardlink") == 0 ||
+      g_strcmp0 (value, "reflink") == 0)
+    return g_strdup (value);
+
+  flatpak_fail (error, _("'%s' is not a valid value (use 'hardlink' or 'reflink')"), value);
+  return NULL;
+}
+
 static char *
 print_locale (const char *value)
 {
   return g_strdup (value);
 }
 
+static char *
+print_deploy_flush (const char *value)
+{
+  return g_strdup (value);
+}
+
+static char *
+print_checkout_mode (const char *value)
+{
+  return g_strdup (value);
+}
+
 static char *
 print_lang (const char *value)
 {
@@ -234,6 +271,18 @@ get_report_os_info_default (FlatpakDir *dir)
   return g_strdup ("true");
 }
 
+static char *
+get_deploy_flush_default (FlatpakDir *dir)
+{
+  return g_strdup ("syncfs");
+}
+
+static char *
+get_checkout_mode_default (FlatpakDir *dir)
+{
+  return g_strdup ("hardlink");
+}
+
 typedef struct
 {
   const char *name;
@@ -246,6 +295,8 @@ ConfigKey keys[] = {
   { "languages", parse_lang, print_lang, get_lang_default },
   { "extra-languages", parse_locale, print_locale, NULL },
   { "report-os-info", parse_boolean, print_boolean, get_report_os_info_default },
+  { "deploy-flush", parse_deploy_flush, print_deploy_flush, get_deploy_flush_default },
+  { "checkout-mode", parse_checkout_mode, print_checkout_mode, get_checkout_mode_default },
 };
 
 static ConfigKey *
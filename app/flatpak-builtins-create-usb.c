@@ -288,6 +288,52 @@ add_runtime (GHashTable        *all_refs,
   return TRUE;
 }
 
+static gboolean
+pull_to_usb_repo (OstreeRepo         *dest_repo,
+                  const char         *src_repo_uri,
+                  GVariant           *collection_refs,
+                  const char * const *subpaths,
+                  GCancellable       *cancellable,
+                  GError            **error)
+{
+  g_auto(GLnxConsoleRef) console = { 0, };
+  g_autoptr(OstreeAsyncProgressFinish) progress = NULL;
+  GVariantBuilder builder;
+  g_autoptr(GVariant) opts = NULL;
+  OstreeRepoPullFlags flags = OSTREE_REPO_PULL_FLAGS_MIRROR;
+
+  glnx_console_lock (&console);
+
+  if (console.is_tty)
+    progress = ostree_async_progress_new_and_connect (ostree_repo_pull_default_console_progress_changed, &console);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+
+  g_variant_builder_add (&builder, "{s@v}", "collection-refs",
+                         g_variant_new_variant (collection_refs));
+  if (subpaths != NULL)
+    {
+      g_variant_builder_add (&builder, "{s@v}", "subdirs",
+                             g_variant_new_variant (g_variant_new_strv (subpaths, -1)));
+    }
+  g_variant_builder_add (&builder, "{s@v}", "flags",
+                         g_variant_new_variant (g_variant_new_int32 (flags)));
+  g_variant_builder_add (&builder, "{s@v}", "depth",
+                         g_variant_new_variant (g_variant_new_int32 (0)));
+  opts = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!ostree_repo_pull_with_options (dest_repo, src_repo_uri,
+                                      opts,
+                                      progress,
+                                      cancellable, error))
+    {
+      ostree_repo_abort_transaction (dest_repo, cancellable, NULL);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /* Copied from src/ostree/ot-builtin-create-usb.c in ostree.git, with slight modifications */
 static gboolean
 ostree_create_usb (GOptionContext *context,
@@ -299,8 +345,6 @@ ostree_create_usb (GOptionContext *context,
                    GCancellable   *cancellable,
                    GError        **error)
 {
-  g_autoptr(OstreeAsyncProgressFinish) progress = NULL;
-  g_auto(GLnxConsoleRef) console = { 0, };
   guint num_refs = 0;
 
   /* Open the destination repository on the USB stick or create it if it doesn’t exist.
@@ -338,57 +382,61 @@ ostree_create_usb (GOptionContext *context,
   if (!ostree_repo_is_writable (dest_repo, error))
     return glnx_prefix_error (error, "Cannot write to repository");
 
-  /* Copy across all of the collection–refs to the destination repo. We have to
-   * do it one ref at a time in order to get the subpaths right. */
+  /* Copy across all of the collection–refs to the destination repo. Refs
+   * with subpaths have to be pulled one at a time in order to get the
+   * subpaths right, all the others are pulled together so libostree can
+   * import their objects in parallel. */
+  g_autofree char *src_repo_uri = g_file_get_uri (ostree_repo_get_path (src_repo));
+  g_auto(GVariantBuilder) full_refs_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  gboolean have_full_refs = FALSE;
+
+  /* Rather than syncing once per pulled ref, sync the whole file system once
+   * after all objects are written */
+  ostree_repo_set_disable_fsync (dest_repo, TRUE);
+
+  g_variant_builder_init (&full_refs_builder, G_VARIANT_TYPE ("a(sss)"));
 
   GLNX_HASH_TABLE_FOREACH_KV (all_refs, OstreeCollectionRef *, c_r, CommitAndSubpaths *, c_s)
   {
-    GVariantBuilder builder;
-    g_autoptr(GVariant) opts = NULL;
-    OstreeRepoPullFlags flags = OSTREE_REPO_PULL_FLAGS_MIRROR;
-    GVariantBuilder refs_builder;
-
     num_refs++;
 
-    g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(sss)"));
-    g_variant_builder_add (&refs_builder, "(sss)",
-                           c_r->collection_id, c_r->ref_name,
-                           c_s->commit ? c_s->commit : "");
-
-    glnx_console_lock (&console);
-
-    if (console.is_tty)
-      progress = ostree_async_progress_new_and_connect (ostree_repo_pull_default_console_progress_changed, &console);
-
-    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
-
-    g_variant_builder_add (&builder, "{s@v}", "collection-refs",
-                           g_variant_new_variant (g_variant_builder_end (&refs_builder)));
-    if (c_s->subpaths != NULL)
+    if (c_s->subpaths == NULL)
       {
-        g_variant_builder_add (&builder, "{s@v}", "subdirs",
-                               g_variant_new_variant (g_variant_new_strv ((const char * const *) c_s->subpaths, -1)));
+        g_variant_builder_add (&full_refs_builder, "(sss)",
+                               c_r->collection_id, c_r->ref_name,
+                               c_s->commit ? c_s->commit : "");
+        have_full_refs = TRUE;
       }
-    g_variant_builder_add (&builder, "{s@v}", "flags",
-                           g_variant_new_variant (g_variant_new_int32 (flags)));
-    g_variant_builder_add (&builder, "{s@v}", "depth",
-                           g_variant_new_variant (g_variant_new_int32 (0)));
-    opts = g_variant_ref_sink (g_variant_builder_end (&builder));
-
-    g_autofree char *src_repo_uri = g_file_get_uri (ostree_repo_get_path (src_repo));
-
-    if (!ostree_repo_pull_with_options (dest_repo, src_repo_uri,
-                                        opts,
-                                        progress,
-                                        cancellable, error))
+    else
       {
-        ostree_repo_abort_transaction (dest_repo, cancellable, NULL);
-        return FALSE;
-      }
+        GVariantBuilder refs_builder;
 
-    glnx_console_unlock (&console);
+        g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(sss)"));
+        g_variant_builder_add (&refs_builder, "(sss)",
+                               c_r->collection_id, c_r->ref_name,
+                               c_s->commit ? c_s->commit : "");
+
+        if (!pull_to_usb_repo (dest_repo, src_repo_uri,
+                               g_variant_builder_end (&refs_builder),
+                               (const char * const *) c_s->subpaths,
+                               cancellable, error))
+          return FALSE;
+      }
   }
 
+  if (have_full_refs)
+    {
+      if (!pull_to_usb_repo (dest_repo, src_repo_uri,
+                             g_variant_builder_end (&full_refs_builder),
+                             NULL, cancellable, error))
+        return FALSE;
+    }
+
+  if (syncfs (ostree_repo_get_dfd (dest_repo)) != 0)
+    return glnx_throw_errno_prefix (error, "syncfs");
+
+  ostree_repo_set_disable_fsync (dest_repo, FALSE);
+
   /* Ensure a summary file is present to make it easier to look up commit checksums. */
   /* FIXME: It should be possible to work without this, but find_remotes_cb() in
    * ostree-repo-pull.c currently assumes a summary file (signed or unsigned) is
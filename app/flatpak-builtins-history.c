@@ -45,6 +45,7 @@ static char *opt_until;
 static gboolean opt_reverse;
 static const char **opt_cols;
 static gboolean opt_json;
+static gboolean opt_json_lines;
 
 static GOptionEntry options[] = {
   { "since", 0, 0, G_OPTION_ARG_STRING, &opt_since, N_("Only show changes after TIME"), N_("TIME") },
@@ -52,6 +53,7 @@ static GOptionEntry options[] = {
   { "reverse", 0, 0, G_OPTION_ARG_NONE, &opt_reverse, N_("Show newest entries first"), NULL },
   { "columns", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_cols, N_("What information to show"), N_("FIELD,…") },
   { "json", 'j', 0, G_OPTION_ARG_NONE, &opt_json, N_("Show output in JSON format"), NULL },
+  { "json-lines", 0, 0, G_OPTION_ARG_NONE, &opt_json_lines, N_("Show output as one JSON object per line"), NULL },
   { NULL }
 };
 
@@ -117,6 +119,12 @@ get_time (sd_journal *j,
   return g_date_time_new_from_unix_local (t);
 }
 
+/* The time filters apply to the timestamp of the flatpak process logging
+ * the change, but the journal is ordered by the time the entry was
+ * received, which can only be later. This is how much later we allow
+ * it to be when deciding where to start or stop reading. */
+#define HISTORY_RECEIVE_SLACK_USEC (60 * G_USEC_PER_SEC)
+
 static gboolean
 print_history (GPtrArray    *dirs,
                Column       *columns,
@@ -128,8 +136,9 @@ print_history (GPtrArray    *dirs,
 {
   g_autoptr(FlatpakTablePrinter) printer = NULL;
   sd_journal *j;
+  guint64 since_usec = 0;
+  guint64 until_usec = G_MAXUINT64;
   int r;
-  int i;
   int k;
   int ret;
 
@@ -139,6 +148,10 @@ print_history (GPtrArray    *dirs,
   printer = flatpak_table_printer_new ();
 
   flatpak_table_printer_set_columns (printer, columns, opt_cols == NULL);
+  /* The journal can go back years, so print entries as they are read
+   * whenever the output format allows it */
+  flatpak_table_printer_set_json_lines (printer, opt_json_lines);
+  flatpak_table_printer_set_streaming (printer, !opt_json);
 
   if ((r = sd_journal_open (&j, 0)) < 0)
     {
@@ -154,8 +167,34 @@ print_history (GPtrArray    *dirs,
       return FALSE;
     }
 
-  if (reverse)
+  /* Matches on the same field are ORed, and ANDed with the one above,
+   * so the journal only hands us entries for the requested installations */
+  for (guint i = 0; dirs != NULL && i < dirs->len; i++)
+    {
+      g_autofree char *name = flatpak_dir_get_name (dirs->pdata[i]);
+      g_autofree char *match = g_strconcat ("INSTALLATION=", name, NULL);
+
+      if ((r = sd_journal_add_match (j, match, 0)) < 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       _("Failed to add match to journal: %s"), strerror (-r));
+          return FALSE;
+        }
+    }
+
+  if (since)
+    since_usec = g_date_time_to_unix (since) * G_USEC_PER_SEC;
+  if (until)
+    until_usec = g_date_time_to_unix (until) * G_USEC_PER_SEC;
+
+  /* Start reading at the requested time range, rather than at either
+   * end of the journal */
+  if (reverse && until)
+    ret = sd_journal_seek_realtime_usec (j, until_usec + HISTORY_RECEIVE_SLACK_USEC);
+  else if (reverse)
     ret = sd_journal_seek_tail (j);
+  else if (since)
+    ret = sd_journal_seek_realtime_usec (j, since_usec);
   else
     ret = sd_journal_seek_head (j);
   if (ret == 0)
@@ -164,6 +203,18 @@ print_history (GPtrArray    *dirs,
       {
         g_autofree char *ref_str = NULL;
         g_autofree char *remote = NULL;
+        guint64 received_usec;
+
+        /* stop once we are past the requested time range */
+
+        if (sd_journal_get_realtime_usec (j, &received_usec) == 0)
+          {
+            if (reverse && received_usec < since_usec)
+              break;
+            if (!reverse && until_usec != G_MAXUINT64 &&
+                received_usec >= until_usec + HISTORY_RECEIVE_SLACK_USEC)
+              break;
+          }
 
         /* determine whether to skip this entry */
 
@@ -185,21 +236,6 @@ print_history (GPtrArray    *dirs,
         if (remote && remote[0] == '/')
           continue;
 
-        if (dirs)
-          {
-            gboolean include = FALSE;
-            g_autofree char *installation = get_field (j, "INSTALLATION", NULL);
-
-            for (i = 0; i < dirs->len && !include; i++)
-              {
-                g_autofree char *name = flatpak_dir_get_name (dirs->pdata[i]);
-                if (g_strcmp0 (name, installation) == 0)
-                  include = TRUE;
-              }
-            if (!include)
-              continue;
-          }
-
         if (since || until)
           {
             g_autoptr(GDateTime) time = get_time (j, NULL);
@@ -364,7 +400,12 @@ print_history (GPtrArray    *dirs,
         flatpak_table_printer_finish_row (printer);
       }
 
-  opt_json ? flatpak_table_printer_print_json (printer) : flatpak_table_printer_print (printer);
+  if (opt_json_lines)
+    flatpak_table_printer_print_json_lines (printer);
+  else if (opt_json)
+    flatpak_table_printer_print_json (printer);
+  else
+    flatpak_table_printer_print (printer);
 
   sd_journal_close (j);
 
@@ -244,7 +244,7 @@ install_from (FlatpakDir *dir,
     {
       g_autoptr(FlatpakHttpSession) http_session = NULL;
       http_session = flatpak_create_http_session (PACKAGE_STRING);
-      file_data = flatpak_load_uri (http_session, filename, 0, NULL, NULL, NULL, NULL, cancellable, error);
+      file_data = flatpak_load_uri (http_session, filename, FLATPAK_HTTP_FLAGS_USE_CACHE, NULL, NULL, NULL, NULL, cancellable, error);
       if (file_data == NULL)
         {
           g_prefix_error (error, "Can't load uri %s: ", filename);
@@ -482,7 +482,7 @@ flatpak_builtin_install (int argc, char **argv, GCancellable *cancellable, GErro
                                                         cancellable, &local_error);
                   else
                     {
-                      g_autoptr(FlatpakRemoteState) state = get_remote_state (this_dir, this_remote, FALSE, FALSE,
+                      g_autoptr(FlatpakRemoteState) state = get_remote_state (this_dir, this_remote, FALSE, FALSE, FALSE,
                                                                               arch, (const char **)opt_sideload_repos,
                                                                               cancellable, error);
                       if (state == NULL)
@@ -153,7 +153,6 @@ print_table_for_refs (gboolean      print_apps,
           FlatpakDecomposed *ref = g_ptr_array_index (dir_refs, j);
           const char *partial_ref;
           const char *repo = NULL;
-          g_autoptr(FlatpakDeploy) deploy = NULL;
           g_autoptr(GBytes) deploy_data = NULL;
           g_autoptr(GError) local_error = NULL;
           const char *active;
@@ -173,17 +172,9 @@ print_table_for_refs (gboolean      print_apps,
           if (arch != NULL && !flatpak_decomposed_is_arch (ref, arch))
             continue;
 
-          deploy = flatpak_dir_load_deployed (dir, ref, NULL, cancellable, &local_error);
-
-          if (deploy == NULL)
-            {
-              g_warning (_("Unable to load details of %s: %s"),
-                         partial_ref, local_error->message);
-              g_clear_error (&local_error);
-              continue;
-            }
-
-          deploy_data = flatpak_deploy_get_deploy_data (deploy, FLATPAK_DEPLOY_VERSION_CURRENT, cancellable, &local_error);
+          /* Only the deploy data is needed, which comes from the deployed
+           * index without loading the whole deploy */
+          deploy_data = flatpak_dir_get_deploy_data (dir, ref, FLATPAK_DEPLOY_VERSION_CURRENT, cancellable, &local_error);
 
           if (deploy_data == NULL)
             {
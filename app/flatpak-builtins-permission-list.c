@@ -62,44 +62,30 @@ list_table (XdpDbusPermissionStore *store,
             FlatpakTablePrinter    *printer,
             GError                **error)
 {
-  const char *one_id[2];
-  g_auto(GStrv) store_ids = NULL;
-  char **ids;
-  int i;
+  const char *one_id[2] = { id, NULL };
+  g_autoptr(GPtrArray) entries = NULL;
+  guint i;
 
-  if (id)
-    {
-      one_id[0] = id;
-      one_id[1] = NULL;
-      ids = (char **) one_id;
-    }
-  else
-    {
-      if (!xdp_dbus_permission_store_call_list_sync (store, table, &store_ids, NULL, error))
-        return FALSE;
-      ids = store_ids;
-    }
+  entries = lookup_permission_table (store, table, id ? one_id : NULL, error);
+  if (entries == NULL)
+    return FALSE;
 
-  for (i = 0; ids[i]; i++)
+  for (i = 0; i < entries->len; i++)
     {
-      g_autoptr(GVariant) permissions = NULL;
-      g_autoptr(GVariant) data = NULL;
+      PermissionStoreEntry *entry = g_ptr_array_index (entries, i);
       g_autoptr(GVariant) d = NULL;
       g_autofree char *txt = NULL;
       GVariantIter iter;
       char *key;
       GVariantIter *val;
 
-      if (!xdp_dbus_permission_store_call_lookup_sync (store, table, ids[i], &permissions, &data, NULL, error))
-        return FALSE;
-
-      d = g_variant_get_child_value (data, 0);
+      d = g_variant_get_child_value (entry->data, 0);
       txt = g_variant_print (d, FALSE);
 
-      if (g_variant_iter_init (&iter, permissions) == 0)
+      if (g_variant_iter_init (&iter, entry->permissions) == 0)
         {
           flatpak_table_printer_add_column (printer, table);
-          flatpak_table_printer_add_column (printer, ids[i]);
+          flatpak_table_printer_add_column (printer, entry->id);
           flatpak_table_printer_add_column (printer, "");
           flatpak_table_printer_add_column (printer, "");
           flatpak_table_printer_add_column (printer, txt);
@@ -111,7 +97,7 @@ list_table (XdpDbusPermissionStore *store,
           char *p;
 
           flatpak_table_printer_add_column (printer, table);
-          flatpak_table_printer_add_column (printer, ids[i]);
+          flatpak_table_printer_add_column (printer, entry->id);
           flatpak_table_printer_add_column (printer, key);
           flatpak_table_printer_add_column (printer, "");
 
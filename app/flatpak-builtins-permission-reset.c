@@ -50,21 +50,21 @@ remove_for_app (XdpDbusPermissionStore *store,
                 const char             *app_id,
                 GError                **error)
 {
-  char **ids;
-  int i;
+  g_autoptr(GPtrArray) entries = NULL;
+  guint i;
 
   /* FIXME some portals cache their permission tables and assume that they're
    * the only writers, so they may miss these changes.
    * See https://github.com/flatpak/xdg-desktop-portal/issues/197
    */
 
-  if (!xdp_dbus_permission_store_call_list_sync (store, table, &ids, NULL, error))
+  entries = lookup_permission_table (store, table, NULL, error);
+  if (entries == NULL)
     return FALSE;
 
-  for (i = 0; ids[i]; i++)
+  for (i = 0; i < entries->len; i++)
     {
-      g_autoptr(GVariant) permissions = NULL;
-      g_autoptr(GVariant) data = NULL;
+      PermissionStoreEntry *entry = g_ptr_array_index (entries, i);
       GVariantIter iter;
       char *key;
       GVariant *value;
@@ -73,12 +73,7 @@ remove_for_app (XdpDbusPermissionStore *store,
 
       g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sas}"));
 
-      if (!xdp_dbus_permission_store_call_lookup_sync (store, table, ids[i],
-                                                       &permissions, &data,
-                                                       NULL, error))
-        return FALSE;
-
-      g_variant_iter_init (&iter, permissions);
+      g_variant_iter_init (&iter, entry->permissions);
       while (g_variant_iter_loop (&iter, "{s@as}", &key, &value))
         {
           if (app_id == NULL || strcmp (key, app_id) == 0)
@@ -92,9 +87,10 @@ remove_for_app (XdpDbusPermissionStore *store,
 
       if (need_to_set)
         {
-          if (!xdp_dbus_permission_store_call_set_sync (store, table, TRUE, ids[i],
+          forget_permission_table (table);
+          if (!xdp_dbus_permission_store_call_set_sync (store, table, TRUE, entry->id,
                                                         g_variant_builder_end (&builder),
-                                                        data ? data : g_variant_new_byte (0),
+                                                        entry->data ? entry->data : g_variant_new_byte (0),
                                                         NULL, error))
             return FALSE;
         }
@@ -51,29 +51,26 @@ list_for_app (XdpDbusPermissionStore *store,
               FlatpakTablePrinter    *printer,
               GError                **error)
 {
-  char **ids;
-  int i;
+  g_autoptr(GPtrArray) entries = NULL;
+  guint i;
 
-  if (!xdp_dbus_permission_store_call_list_sync (store, table, &ids, NULL, error))
+  entries = lookup_permission_table (store, table, NULL, error);
+  if (entries == NULL)
     return FALSE;
 
-  for (i = 0; ids[i]; i++)
+  for (i = 0; i < entries->len; i++)
     {
-      g_autoptr(GVariant) permissions = NULL;
-      g_autoptr(GVariant) data = NULL;
+      PermissionStoreEntry *entry = g_ptr_array_index (entries, i);
       g_autoptr(GVariant) d = NULL;
       g_autofree char *txt = NULL;
       GVariantIter iter;
       char *key;
       GVariantIter *val;
 
-      if (!xdp_dbus_permission_store_call_lookup_sync (store, table, ids[i], &permissions, &data, NULL, error))
-        return FALSE;
-
-      d = g_variant_get_child_value (data, 0);
+      d = g_variant_get_child_value (entry->data, 0);
       txt = g_variant_print (d, FALSE);
 
-      g_variant_iter_init (&iter, permissions);
+      g_variant_iter_init (&iter, entry->permissions);
       while (g_variant_iter_loop (&iter, "{sas}", &key, &val))
         {
           char *p;
@@ -82,7 +79,7 @@ list_for_app (XdpDbusPermissionStore *store,
             continue;
 
           flatpak_table_printer_add_column (printer, table);
-          flatpak_table_printer_add_column (printer, ids[i]);
+          flatpak_table_printer_add_column (printer, entry->id);
           flatpak_table_printer_add_column (printer, key);
           flatpak_table_printer_add_column (printer, "");
 
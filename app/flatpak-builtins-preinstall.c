@@ -52,6 +52,7 @@ static gboolean opt_include_debug;
 static gboolean opt_yes;
 static gboolean opt_reinstall;
 static gboolean opt_noninteractive;
+static int opt_jobs = 1;
 
 static GOptionEntry options[] = {
   { "no-pull", 0, 0, G_OPTION_ARG_NONE, &opt_no_pull, N_("Don't pull, only install from local cache"), NULL },
@@ -64,6 +65,7 @@ static GOptionEntry options[] = {
   { "assumeyes", 'y', 0, G_OPTION_ARG_NONE, &opt_yes, N_("Automatically answer yes for all questions"), NULL },
   { "reinstall", 0, 0, G_OPTION_ARG_NONE, &opt_reinstall, N_("Uninstall first if already installed"), NULL },
   { "noninteractive", 0, 0, G_OPTION_ARG_NONE, &opt_noninteractive, N_("Produce minimal output and don't ask questions"), NULL },
+  { "jobs", 0, 0, G_OPTION_ARG_INT, &opt_jobs, N_("Max parallel downloads (default: 1)"), N_("NUM-JOBS") },
   /* Translators: A sideload is when you install from a local USB drive rather than the Internet. */
   { "sideload-repo", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_sideload_repos, N_("Use this local repo for sideloads"), N_("PATH") },
   { NULL }
@@ -107,6 +109,12 @@ flatpak_builtin_preinstall (int argc, char **argv, GCancellable *cancellable, GE
   flatpak_transaction_set_auto_install_sdk (transaction, opt_include_sdk);
   flatpak_transaction_set_auto_install_debug (transaction, opt_include_debug);
 
+  /* Fetch the objects shared between the refs from each remote only once,
+   * and keep downloading the next refs while the previous ones deploy */
+  flatpak_transaction_set_batch_pulls (transaction, opt_jobs > 1);
+  flatpak_transaction_set_max_parallel_ops (transaction, opt_jobs);
+  flatpak_transaction_set_pipelined (transaction, opt_jobs > 1);
+
   for (int i = 0; opt_sideload_repos != NULL && opt_sideload_repos[i] != NULL; i++)
     flatpak_transaction_add_sideload_repo (transaction, opt_sideload_repos[i]);
 
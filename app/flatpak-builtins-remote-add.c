@@ -254,7 +254,7 @@ load_options (const char *remote_name,
       g_autoptr(FlatpakHttpSession) http_session = NULL;
 
       http_session = flatpak_create_http_session (PACKAGE_STRING);
-      bytes = flatpak_load_uri (http_session, filename, 0, NULL, NULL, NULL, NULL, NULL, &local_error);
+      bytes = flatpak_load_uri (http_session, filename, FLATPAK_HTTP_FLAGS_USE_CACHE, NULL, NULL, NULL, NULL, NULL, &local_error);
 
       if (bytes == NULL)
         {
@@ -137,7 +137,7 @@ flatpak_builtin_remote_info (int argc, char **argv, GCancellable *cancellable, G
                                       &matched_kinds, &match_id, &match_arch, &match_branch, error))
     return FALSE;
 
-  state = get_remote_state (preferred_dir, remote, opt_cached, opt_sideloaded, match_arch, NULL, NULL, error);
+  state = get_remote_state (preferred_dir, remote, opt_cached, TRUE, opt_sideloaded, match_arch, NULL, NULL, error);
   if (state == NULL)
     return FALSE;
 
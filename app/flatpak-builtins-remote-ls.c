@@ -47,6 +47,7 @@ static char *opt_arch;
 static char *opt_app_runtime;
 static const char **opt_cols;
 static gboolean opt_json;
+static gboolean opt_json_lines;
 
 static GOptionEntry options[] = {
   { "show-details", 'd', 0, G_OPTION_ARG_NONE, &opt_show_details, N_("Show arches and branches"), NULL },
@@ -61,6 +62,7 @@ static GOptionEntry options[] = {
   /* Translators: A sideload is when you install from a local USB drive rather than the Internet. */
   { "sideloaded", 0, 0, G_OPTION_ARG_NONE, &opt_sideloaded, N_("Only list refs available as sideloads"), NULL },
   { "json", 'j', 0, G_OPTION_ARG_NONE, &opt_json, N_("Show output in JSON format"), NULL },
+  { "json-lines", 0, 0, G_OPTION_ARG_NONE, &opt_json_lines, N_("Show output as one JSON object per line"), NULL },
   { NULL }
 };
 
@@ -82,30 +84,6 @@ static Column all_columns[] = {
 };
 
 
-typedef struct RemoteStateDirPair
-{
-  FlatpakRemoteState *state;
-  FlatpakDir         *dir;
-} RemoteStateDirPair;
-
-static void
-remote_state_dir_pair_free (RemoteStateDirPair *pair)
-{
-  flatpak_remote_state_unref (pair->state);
-  g_object_unref (pair->dir);
-  g_free (pair);
-}
-
-static RemoteStateDirPair *
-remote_state_dir_pair_new (FlatpakDir *dir, FlatpakRemoteState *state)
-{
-  RemoteStateDirPair *pair = g_new (RemoteStateDirPair, 1);
-
-  pair->state = state;
-  pair->dir = g_object_ref (dir);
-  return pair;
-}
-
 static char *
 strip_last_element (const char *id,
                     gsize id_len)
@@ -120,10 +98,23 @@ strip_last_element (const char *id,
   return g_strndup (id, id_len);
 }
 
+/* Lists the refs of one remote into @printer. This is called for each
+ * remote as soon as its state is available, so that with a streaming
+ * printer the first results are output before the later remotes are
+ * even loaded.
+ */
 static gboolean
-ls_remote (GHashTable *refs_hash, const char **arches, const char *app_runtime, Column *columns, GCancellable *cancellable, GError **error)
+ls_remote (FlatpakTablePrinter *printer,
+           FlatpakDir          *dir,
+           FlatpakRemoteState  *state,
+           GHashTable          *refs,
+           const char         **arches,
+           const char          *app_runtime,
+           Column              *columns,
+           GCancellable        *cancellable,
+           GError             **error)
 {
-  g_autoptr(FlatpakTablePrinter) printer = NULL;
+  const char *remote = state->remote_name;
   guint n_keys;
   g_autofree FlatpakDecomposed **keys = NULL;
   int i, j;
@@ -133,11 +124,9 @@ ls_remote (GHashTable *refs_hash, const char **arches, const char *app_runtime,
   g_autofree char *match_branch = NULL;
   gboolean need_cache_data = FALSE;
   gboolean need_appstream_data = FALSE;
-
-  printer = flatpak_table_printer_new ();
-
-  flatpak_table_printer_set_columns (printer, columns,
-                                     opt_cols == NULL && !opt_show_details);
+  g_autoptr(AsMetadata) mdata = NULL;
+  g_autoptr(GHashTable) pref_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL); /* value owned by refs */
+  g_autoptr(GHashTable) names = g_hash_table_new_full ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal, (GDestroyNotify)flatpak_decomposed_unref, g_free);
 
   if (app_runtime)
     {
@@ -159,218 +148,205 @@ ls_remote (GHashTable *refs_hash, const char **arches, const char *app_runtime,
         need_appstream_data = TRUE;
     }
 
-  GLNX_HASH_TABLE_FOREACH_KV (refs_hash, GHashTable *, refs, RemoteStateDirPair *, remote_state_dir_pair)
+  GLNX_HASH_TABLE_FOREACH (refs, FlatpakDecomposed *, ref)
+    {
+      char *partial_ref = flatpak_make_valid_id_prefix (flatpak_decomposed_get_pref (ref));
+      g_hash_table_insert (pref_hash, partial_ref, ref);
+    }
+
+  GLNX_HASH_TABLE_FOREACH_KV (refs, FlatpakDecomposed *, ref, const char *, checksum)
     {
-      FlatpakDir *dir = remote_state_dir_pair->dir;
-      FlatpakRemoteState *state = remote_state_dir_pair->state;
-      const char *remote = state->remote_name;
-      g_autoptr(AsMetadata) mdata = NULL;
-      g_autoptr(GHashTable) pref_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL); /* value owned by refs */
-      g_autoptr(GHashTable) names = g_hash_table_new_full ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal, (GDestroyNotify)flatpak_decomposed_unref, g_free);
-
-      GLNX_HASH_TABLE_FOREACH (refs, FlatpakDecomposed *, ref)
+      if (arches != NULL && !flatpak_decomposed_is_arches (ref, -1, arches))
+        continue;
+
+      if (flatpak_decomposed_is_runtime (ref) && !opt_runtime)
+        continue;
+
+      if (flatpak_decomposed_is_app (ref) && !opt_app)
+        continue;
+
+      if (!opt_all &&
+          flatpak_decomposed_is_runtime (ref) &&
+          flatpak_decomposed_id_is_subref (ref))
         {
-          char *partial_ref = flatpak_make_valid_id_prefix (flatpak_decomposed_get_pref (ref));
-          g_hash_table_insert (pref_hash, partial_ref, ref);
+          g_autoptr(FlatpakDecomposed) parent_ref = NULL;
+          gsize id_len;
+          const char *id = flatpak_decomposed_peek_id (ref, &id_len);
+          g_autofree char *parent_id = strip_last_element (id, id_len);
+
+          parent_ref = flatpak_decomposed_new_from_decomposed (ref, FLATPAK_KINDS_RUNTIME,
+                                                               parent_id, NULL, NULL, NULL);
+
+          if (parent_ref != NULL &&
+              g_hash_table_lookup (pref_hash, flatpak_decomposed_get_pref (parent_ref)))
+            continue;
         }
 
-      GLNX_HASH_TABLE_FOREACH_KV (refs, FlatpakDecomposed *, ref, const char *, checksum)
+      if (!opt_all && opt_arch == NULL &&
+          /* Hide non-primary arches if the primary arch exists */
+          !flatpak_decomposed_is_arch (ref, arches[0]))
         {
-          if (opt_only_updates)
-            {
-              g_autoptr(GBytes) deploy_data = flatpak_dir_get_deploy_data (dir, ref, FLATPAK_DEPLOY_VERSION_ANY, cancellable, NULL);
+          g_autoptr(FlatpakDecomposed) alt_arch = flatpak_decomposed_new_from_decomposed (ref, 0, NULL, arches[0], NULL, NULL);
 
-              if (deploy_data == NULL)
-                continue;
-
-              if (g_strcmp0 (flatpak_deploy_data_get_origin (deploy_data), remote) != 0)
-                continue;
+          if (alt_arch && g_hash_table_lookup (refs, alt_arch))
+            continue;
+        }
 
-              if (g_strcmp0 (flatpak_deploy_data_get_commit (deploy_data), checksum) == 0)
-                continue;
-            }
+      /* Only hit the disk for deploy data once the cheap filters on
+       * the ref name have passed */
+      if (opt_only_updates)
+        {
+          g_autoptr(GBytes) deploy_data = flatpak_dir_get_deploy_data (dir, ref, FLATPAK_DEPLOY_VERSION_ANY, cancellable, NULL);
 
-          if (arches != NULL && !flatpak_decomposed_is_arches (ref, -1, arches))
+          if (deploy_data == NULL)
             continue;
 
-          if (flatpak_decomposed_is_runtime (ref) && !opt_runtime)
+          if (g_strcmp0 (flatpak_deploy_data_get_origin (deploy_data), remote) != 0)
             continue;
 
-          if (flatpak_decomposed_is_app (ref) && !opt_app)
+          if (g_strcmp0 (flatpak_deploy_data_get_commit (deploy_data), checksum) == 0)
             continue;
+        }
 
-          if (!opt_all &&
-              flatpak_decomposed_is_runtime (ref) &&
-              flatpak_decomposed_id_is_subref (ref))
-            {
-              g_autoptr(FlatpakDecomposed) parent_ref = NULL;
-              gsize id_len;
-              const char *id = flatpak_decomposed_peek_id (ref, &id_len);
-              g_autofree char *parent_id = strip_last_element (id, id_len);
+      if (g_hash_table_lookup (names, ref) == NULL)
+        g_hash_table_insert (names, flatpak_decomposed_ref (ref), g_strdup (checksum));
+    }
 
-              parent_ref = flatpak_decomposed_new_from_decomposed (ref, FLATPAK_KINDS_RUNTIME,
-                                                                   parent_id, NULL, NULL, NULL);
+  if (need_appstream_data && g_hash_table_size (names) > 0)
+    {
+      mdata = as_metadata_new ();
+      flatpak_dir_load_appstream_data (dir, remote, NULL, mdata, NULL, NULL);
+    }
 
-              if (parent_ref != NULL &&
-                  g_hash_table_lookup (pref_hash, flatpak_decomposed_get_pref (parent_ref)))
-                continue;
-            }
+  keys = (FlatpakDecomposed **) g_hash_table_get_keys_as_array (names, &n_keys);
+  qsort (keys, n_keys, sizeof (char *), (GCompareFunc) flatpak_decomposed_strcmp_p);
 
-          if (!opt_all && opt_arch == NULL &&
-              /* Hide non-primary arches if the primary arch exists */
-              !flatpak_decomposed_is_arch (ref, arches[0]))
-            {
-              g_autoptr(FlatpakDecomposed) alt_arch = flatpak_decomposed_new_from_decomposed (ref, 0, NULL, arches[0], NULL, NULL);
+  for (i = 0; i < n_keys; i++)
+    {
+      FlatpakDecomposed *ref = keys[i];
+      const char *ref_str = flatpak_decomposed_get_ref (ref);
+      guint64 installed_size;
+      guint64 download_size;
+      g_autofree char *runtime = NULL;
+      AsComponent *cpt = NULL;
+      gboolean has_sparse_cache;
+      VarMetadataRef sparse_cache;
+      g_autofree char *id = flatpak_decomposed_dup_id (ref);
+      g_autofree char *arch = flatpak_decomposed_dup_arch (ref);
+      g_autofree char *branch = flatpak_decomposed_dup_branch (ref);
+
+      /* The sparse cache is optional */
+      has_sparse_cache = flatpak_remote_state_lookup_sparse_cache (state, ref_str, &sparse_cache, NULL);
+      if (!opt_all && has_sparse_cache)
+        {
+          const char *eol = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLIFE, NULL);
+          const char *eol_rebase = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLIFE_REBASE, NULL);
 
-              if (alt_arch && g_hash_table_lookup (refs, alt_arch))
-                continue;
-            }
+          if (eol != NULL || eol_rebase != NULL)
+            continue;
+        }
+
+      if (need_cache_data)
+        {
+          g_autofree char *metadata = NULL;
+          g_autoptr(GKeyFile) metakey = NULL;
+
+          if (!flatpak_remote_state_load_data (state, ref_str,
+                                               &download_size, &installed_size, &metadata,
+                                               error))
+            return FALSE;
 
-          if (g_hash_table_lookup (names, ref) == NULL)
-            g_hash_table_insert (names, flatpak_decomposed_ref (ref), g_strdup (checksum));
+          metakey = g_key_file_new ();
+          if (g_key_file_load_from_data (metakey, metadata, -1, 0, NULL))
+            runtime = g_key_file_get_string (metakey, "Application", "runtime", NULL);
         }
 
-      if (need_appstream_data)
+      if (app_runtime && runtime)
         {
-          mdata = as_metadata_new ();
-          flatpak_dir_load_appstream_data (dir, remote, NULL, mdata, NULL, NULL);
+          g_auto(GStrv) pref = g_strsplit (runtime, "/", 3);
+          if ((match_id && pref[0] && strcmp (pref[0], match_id) != 0) ||
+              (match_arch && pref[1] && strcmp (pref[1], match_arch) != 0) ||
+              (match_branch && pref[2] && strcmp (pref[2], match_branch) != 0))
+            continue;
         }
 
-      keys = (FlatpakDecomposed **) g_hash_table_get_keys_as_array (names, &n_keys);
-      qsort (keys, n_keys, sizeof (char *), (GCompareFunc) flatpak_decomposed_strcmp_p);
+      if (need_appstream_data)
+        cpt = metadata_find_component (mdata, ref_str);
 
-      for (i = 0; i < n_keys; i++)
+      for (j = 0; columns[j].name; j++)
         {
-          FlatpakDecomposed *ref = keys[i];
-          const char *ref_str = flatpak_decomposed_get_ref (ref);
-          guint64 installed_size;
-          guint64 download_size;
-          g_autofree char *runtime = NULL;
-          AsComponent *cpt = NULL;
-          gboolean has_sparse_cache;
-          VarMetadataRef sparse_cache;
-          g_autofree char *id = flatpak_decomposed_dup_id (ref);
-          g_autofree char *arch = flatpak_decomposed_dup_arch (ref);
-          g_autofree char *branch = flatpak_decomposed_dup_branch (ref);
-
-          /* The sparse cache is optional */
-          has_sparse_cache = flatpak_remote_state_lookup_sparse_cache (state, ref_str, &sparse_cache, NULL);
-          if (!opt_all && has_sparse_cache)
+          if (strcmp (columns[j].name, "name") == 0)
             {
-              const char *eol = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLIFE, NULL);
-              const char *eol_rebase = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLIFE_REBASE, NULL);
+              const char *name = NULL;
+              g_autofree char *readable_id = NULL;
 
-              if (eol != NULL || eol_rebase != NULL)
-                continue;
-            }
+              if (cpt)
+                name = as_component_get_name (cpt);
 
-          if (need_cache_data)
-            {
-              g_autofree char *metadata = NULL;
-              g_autoptr(GKeyFile) metakey = NULL;
+              if (name == NULL)
+                readable_id = flatpak_decomposed_dup_readable_id (ref);
 
-              if (!flatpak_remote_state_load_data (state, ref_str,
-                                                   &download_size, &installed_size, &metadata,
-                                                   error))
-                return FALSE;
-
-              metakey = g_key_file_new ();
-              if (g_key_file_load_from_data (metakey, metadata, -1, 0, NULL))
-                runtime = g_key_file_get_string (metakey, "Application", "runtime", NULL);
+              flatpak_table_printer_add_column (printer, name ? name : readable_id);
             }
+          else if (strcmp (columns[j].name, "description") == 0)
+            {
+              const char *comment = NULL;
+              if (cpt)
+                  comment = as_component_get_summary (cpt);
 
-          if (need_appstream_data)
-            cpt = metadata_find_component (mdata, ref_str);
+              flatpak_table_printer_add_column (printer, comment);
+            }
+          else if (strcmp (columns[j].name, "version") == 0)
+            flatpak_table_printer_add_column (printer, cpt ? component_get_version_latest (cpt) : "");
+          else if (strcmp (columns[j].name, "ref") == 0)
+            flatpak_table_printer_add_column (printer, ref_str);
+          else if (strcmp (columns[j].name, "application") == 0)
+            flatpak_table_printer_add_column (printer, id);
+          else if (strcmp (columns[j].name, "arch") == 0)
+            flatpak_table_printer_add_column (printer, arch);
+          else if (strcmp (columns[j].name, "branch") == 0)
+            flatpak_table_printer_add_column (printer, branch);
+          else if (strcmp (columns[j].name, "origin") == 0)
+            flatpak_table_printer_add_column (printer, remote);
+          else if (strcmp (columns[j].name, "commit") == 0)
+            {
+              g_autofree char *value = NULL;
 
-          if (app_runtime && runtime)
+              value = g_strdup ((char *) g_hash_table_lookup (names, keys[i]));
+              value[MIN (strlen (value), 12)] = 0;
+              flatpak_table_printer_add_column (printer, value);
+            }
+          else if (strcmp (columns[j].name, "installed-size") == 0)
             {
-              g_auto(GStrv) pref = g_strsplit (runtime, "/", 3);
-              if ((match_id && pref[0] && strcmp (pref[0], match_id) != 0) ||
-                  (match_arch && pref[1] && strcmp (pref[1], match_arch) != 0) ||
-                  (match_branch && pref[2] && strcmp (pref[2], match_branch) != 0))
-                continue;
+              g_autofree char *installed = g_format_size (installed_size);
+              flatpak_table_printer_add_decimal_column (printer, installed);
             }
-
-          for (j = 0; columns[j].name; j++)
+          else if (strcmp (columns[j].name, "download-size") == 0)
             {
-              if (strcmp (columns[j].name, "name") == 0)
-                {
-                  const char *name = NULL;
-                  g_autofree char *readable_id = NULL;
-
-                  if (cpt)
-                    name = as_component_get_name (cpt);
-
-                  if (name == NULL)
-                    readable_id = flatpak_decomposed_dup_readable_id (ref);
-
-                  flatpak_table_printer_add_column (printer, name ? name : readable_id);
-                }
-              else if (strcmp (columns[j].name, "description") == 0)
-                {
-                  const char *comment = NULL;
-                  if (cpt)
-                      comment = as_component_get_summary (cpt);
-
-                  flatpak_table_printer_add_column (printer, comment);
-                }
-              else if (strcmp (columns[j].name, "version") == 0)
-                flatpak_table_printer_add_column (printer, cpt ? component_get_version_latest (cpt) : "");
-              else if (strcmp (columns[j].name, "ref") == 0)
-                flatpak_table_printer_add_column (printer, ref_str);
-              else if (strcmp (columns[j].name, "application") == 0)
-                flatpak_table_printer_add_column (printer, id);
-              else if (strcmp (columns[j].name, "arch") == 0)
-                flatpak_table_printer_add_column (printer, arch);
-              else if (strcmp (columns[j].name, "branch") == 0)
-                flatpak_table_printer_add_column (printer, branch);
-              else if (strcmp (columns[j].name, "origin") == 0)
-                flatpak_table_printer_add_column (printer, remote);
-              else if (strcmp (columns[j].name, "commit") == 0)
+              g_autofree char *download = g_format_size (download_size);
+              flatpak_table_printer_add_decimal_column (printer, download);
+            }
+          else if (strcmp (columns[j].name, "runtime") == 0)
+            {
+              flatpak_table_printer_add_column (printer, runtime);
+            }
+          else if (strcmp (columns[j].name, "options") == 0)
+            {
+              flatpak_table_printer_add_column (printer, ""); /* Extra */
+              if (has_sparse_cache)
                 {
-                  g_autofree char *value = NULL;
+                  const char *eol = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLIFE, NULL);
+                  const char *eol_rebase = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLIFE_REBASE, NULL);
 
-                  value = g_strdup ((char *) g_hash_table_lookup (names, keys[i]));
-                  value[MIN (strlen (value), 12)] = 0;
-                  flatpak_table_printer_add_column (printer, value);
-                }
-              else if (strcmp (columns[j].name, "installed-size") == 0)
-                {
-                  g_autofree char *installed = g_format_size (installed_size);
-                  flatpak_table_printer_add_decimal_column (printer, installed);
-                }
-              else if (strcmp (columns[j].name, "download-size") == 0)
-                {
-                  g_autofree char *download = g_format_size (download_size);
-                  flatpak_table_printer_add_decimal_column (printer, download);
-                }
-              else if (strcmp (columns[j].name, "runtime") == 0)
-                {
-                  flatpak_table_printer_add_column (printer, runtime);
-                }
-              else if (strcmp (columns[j].name, "options") == 0)
-                {
-                  flatpak_table_printer_add_column (printer, ""); /* Extra */
-                  if (has_sparse_cache)
-                    {
-                      const char *eol = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLIFE, NULL);
-                      const char *eol_rebase = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLIFE_REBASE, NULL);
-
-                      if (eol)
-                        flatpak_table_printer_append_with_comma_printf (printer, "eol=%s", eol);
-                      if (eol_rebase)
-                        flatpak_table_printer_append_with_comma_printf (printer, "eol-rebase=%s", eol_rebase);
-                    }
+                  if (eol)
+                    flatpak_table_printer_append_with_comma_printf (printer, "eol=%s", eol);
+                  if (eol_rebase)
+                    flatpak_table_printer_append_with_comma_printf (printer, "eol-rebase=%s", eol_rebase);
                 }
             }
-
-          flatpak_table_printer_finish_row (printer);
         }
-    }
 
-  if (flatpak_table_printer_get_current_row (printer) > 0)
-    {
-      opt_json ? flatpak_table_printer_print_json (printer) : flatpak_table_printer_print (printer);
+      flatpak_table_printer_finish_row (printer);
     }
 
   return TRUE;
@@ -384,7 +360,7 @@ flatpak_builtin_remote_ls (int argc, char **argv, GCancellable *cancellable, GEr
   const char **arches = flatpak_get_arches ();
   const char *opt_arches[] = {NULL, NULL};
   gboolean has_remote;
-  g_autoptr(GHashTable) refs_hash = g_hash_table_new_full (g_direct_hash, g_direct_equal, (GDestroyNotify) g_hash_table_unref, (GDestroyNotify) remote_state_dir_pair_free);
+  g_autoptr(FlatpakTablePrinter) printer = NULL;
   g_autofree char *col_help = NULL;
   g_autofree Column *columns = NULL;
 
@@ -419,11 +395,25 @@ flatpak_builtin_remote_ls (int argc, char **argv, GCancellable *cancellable, GEr
         }
     }
 
+  /* show origin by default if listing multiple remotes */
+  all_columns[5].def = !has_remote;
+
+  columns = handle_column_args (all_columns, opt_show_details, opt_cols, error);
+  if (columns == NULL)
+    return FALSE;
+
+  printer = flatpak_table_printer_new ();
+  flatpak_table_printer_set_columns (printer, columns,
+                                     opt_cols == NULL && !opt_show_details);
+  /* Plain output is written out remote by remote, so that scripts
+   * reading from a pipe don't have to wait for everything to load */
+  flatpak_table_printer_set_json_lines (printer, opt_json_lines);
+  flatpak_table_printer_set_streaming (printer, !opt_json);
+
   if (has_remote)
     {
       g_autoptr(FlatpakDir) preferred_dir = NULL;
       g_autoptr(GHashTable) refs = NULL;
-      RemoteStateDirPair *remote_state_dir_pair = NULL;
       g_autoptr(FlatpakRemoteState) state = NULL;
       gboolean is_local = FALSE;
 
@@ -436,7 +426,7 @@ flatpak_builtin_remote_ls (int argc, char **argv, GCancellable *cancellable, GEr
             return FALSE;
         }
 
-      state = get_remote_state (preferred_dir, argv[1], opt_cached, opt_sideloaded, opt_arches[0], NULL, cancellable, error);
+      state = get_remote_state (preferred_dir, argv[1], opt_cached, TRUE, opt_sideloaded, opt_arches[0], NULL, cancellable, error);
       if (state == NULL)
         return FALSE;
 
@@ -448,8 +438,9 @@ flatpak_builtin_remote_ls (int argc, char **argv, GCancellable *cancellable, GEr
                                          cancellable, error))
         return FALSE;
 
-      remote_state_dir_pair = remote_state_dir_pair_new (preferred_dir, g_steal_pointer (&state));
-      g_hash_table_insert (refs_hash, g_steal_pointer (&refs), remote_state_dir_pair);
+      if (!ls_remote (printer, preferred_dir, state, refs, arches, opt_app_runtime, columns,
+                      cancellable, error))
+        return FALSE;
     }
   else
     {
@@ -468,14 +459,13 @@ flatpak_builtin_remote_ls (int argc, char **argv, GCancellable *cancellable, GEr
           for (j = 0; remotes[j] != NULL; j++)
             {
               g_autoptr(GHashTable) refs = NULL;
-              RemoteStateDirPair *remote_state_dir_pair = NULL;
               const char *remote_name = remotes[j];
               g_autoptr(FlatpakRemoteState) state = NULL;
 
               if (flatpak_dir_get_remote_disabled (dir, remote_name))
                 continue;
 
-              state = get_remote_state (dir, remote_name, opt_cached, opt_sideloaded, opt_arches[0], NULL,
+              state = get_remote_state (dir, remote_name, opt_cached, TRUE, opt_sideloaded, opt_arches[0], NULL,
                                         cancellable, error);
               if (state == NULL)
                 return FALSE;
@@ -488,20 +478,24 @@ flatpak_builtin_remote_ls (int argc, char **argv, GCancellable *cancellable, GEr
                                                  cancellable, error))
                 return FALSE;
 
-              remote_state_dir_pair = remote_state_dir_pair_new (dir, g_steal_pointer (&state));
-              g_hash_table_insert (refs_hash, g_steal_pointer (&refs), remote_state_dir_pair);
+              if (!ls_remote (printer, dir, state, refs, arches, opt_app_runtime, columns,
+                              cancellable, error))
+                return FALSE;
             }
         }
     }
 
-  /* show origin by default if listing multiple remotes */
-  all_columns[5].def = !has_remote;
-
-  columns = handle_column_args (all_columns, opt_show_details, opt_cols, error);
-  if (columns == NULL)
-    return FALSE;
+  if (flatpak_table_printer_get_current_row (printer) > 0)
+    {
+      if (opt_json_lines)
+        flatpak_table_printer_print_json_lines (printer);
+      else if (opt_json)
+        flatpak_table_printer_print_json (printer);
+      else
+        flatpak_table_printer_print (printer);
+    }
 
-  return ls_remote (refs_hash, arches, opt_app_runtime, columns, cancellable, error);
+  return TRUE;
 }
 
 gboolean
@@ -59,6 +59,8 @@ static char *opt_collection_id = NULL;
 static char *opt_authenticator_name = NULL;
 static char **opt_authenticator_options = NULL;
 static gboolean opt_authenticator_install = -1;
+static gboolean opt_http3 = -1;
+static gint64 opt_max_download_rate = -1;
 static char **opt_gpg_import;
 static char *opt_signature_lookaside = NULL;
 
@@ -97,6 +99,9 @@ static GOptionEntry common_options[] = {
   { "no-authenticator-install", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &opt_authenticator_install, N_("Don't autoinstall authenticator"), NULL },
   { "follow-redirect", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &opt_do_follow_redirect, N_("Follow the redirect set in the summary file"), NULL },
   { "no-follow-redirect", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &opt_no_follow_redirect, N_("Don't follow the redirect set in the summary file"), NULL },
+  { "http3", 0, 0, G_OPTION_ARG_NONE, &opt_http3, N_("Try HTTP/3 for downloads from this remote"), NULL },
+  { "no-http3", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &opt_http3, N_("Don't try HTTP/3 for downloads from this remote"), NULL },
+  { "max-download-rate", 0, 0, G_OPTION_ARG_INT64, &opt_max_download_rate, N_("Limit downloads from this remote to BYTES per second (0 for no limit)"), N_("BYTES") },
   { NULL }
 };
 
@@ -277,6 +282,23 @@ get_config_from_opts (FlatpakDir *dir, const char *remote_name, gboolean *change
       *changed = TRUE;
     }
 
+  if (opt_http3 != -1)
+    {
+      g_key_file_set_boolean (config, group, "xa.http3", opt_http3);
+      *changed = TRUE;
+    }
+
+  if (opt_max_download_rate == 0)
+    {
+      g_key_file_remove_key (config, group, "xa.max-download-rate", NULL);
+      *changed = TRUE;
+    }
+  else if (opt_max_download_rate > 0)
+    {
+      g_key_file_set_uint64 (config, group, "xa.max-download-rate", opt_max_download_rate);
+      *changed = TRUE;
+    }
+
   if (opt_do_follow_redirect)
     {
       g_key_file_set_boolean (config, group, "url-is-set", FALSE);
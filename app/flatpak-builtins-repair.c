@@ -23,7 +23,10 @@
 #include <locale.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <glib/gi18n.h>
 
@@ -38,10 +41,12 @@
 
 static gboolean opt_dry_run;
 static gboolean opt_reinstall_all;
+static gboolean opt_fast;
 
 static GOptionEntry options[] = {
   { "dry-run", 0, 0, G_OPTION_ARG_NONE, &opt_dry_run, N_("Don't make any changes"), NULL },
   { "reinstall-all", 0, 0, G_OPTION_ARG_NONE, &opt_reinstall_all, N_("Reinstall all refs"), NULL },
+  { "fast", 0, 0, G_OPTION_ARG_NONE, &opt_fast, N_("Don't checksum objects protected by fs-verity"), NULL },
   { NULL }
 };
 
@@ -51,6 +56,218 @@ typedef enum {
   FSCK_STATUS_HAS_INVALID_OBJECTS,
 } FsckStatus;
 
+#define FSCK_MAX_THREADS 8
+
+/* File objects that were successfully checksummed are recorded in this
+ * file in the repo, together with the inode, size and ctime of the loose
+ * object. This lets an interrupted repair resume where it stopped, and lets
+ * later repairs skip objects that haven't been touched since. We use the
+ * ctime rather than the mtime, because ostree canonicalizes the mtime of
+ * objects, and the ctime can't be set from userspace. */
+#define REPAIR_CHECKPOINT_FILE ".flatpak-repair-checkpoint"
+#define REPAIR_CHECKPOINT_MAGIC "FPREPCK1"
+#define REPAIR_CHECKPOINT_INTERVAL_SECS 30
+
+typedef struct {
+  guint8  csum[OSTREE_SHA256_DIGEST_LEN];
+  guint64 ino;
+  guint64 size;
+  gint64  ctime_sec;
+  gint64  ctime_nsec;
+} VerifiedObject;
+
+typedef struct {
+  VerifiedObject obj;
+  gboolean       seen; /* Verified or confirmed during this run */
+} VerifiedEntry;
+
+typedef struct {
+  OstreeRepo  *repo;
+  GThreadPool *pool;
+
+  /* Protects everything below */
+  GMutex       lock;
+  GCond        cond;
+  GHashTable  *object_status_cache;
+  GHashTable  *verified; /* csum bytes -> VerifiedEntry */
+  gint64       last_checkpoint;
+} FsckContext;
+
+/* A set of file objects being checked on the thread pool */
+typedef struct {
+  guint      pending;
+  FsckStatus status;
+} FsckBatch;
+
+typedef struct {
+  FsckBatch *batch;
+  char       checksum[OSTREE_SHA256_STRING_LEN + 1];
+} FsckJob;
+
+static guint
+verified_csum_hash (gconstpointer key)
+{
+  guint hash;
+
+  memcpy (&hash, key, sizeof (hash));
+  return hash;
+}
+
+static gboolean
+verified_csum_equal (gconstpointer a,
+                     gconstpointer b)
+{
+  return memcmp (a, b, OSTREE_SHA256_DIGEST_LEN) == 0;
+}
+
+static GHashTable *
+load_repair_checkpoint (OstreeRepo *repo)
+{
+  g_autoptr(GHashTable) verified = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  glnx_autofd int fd = -1;
+  const char *contents;
+  gsize len, magic_len = strlen (REPAIR_CHECKPOINT_MAGIC);
+
+  verified = g_hash_table_new_full (verified_csum_hash, verified_csum_equal, NULL, g_free);
+
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), REPAIR_CHECKPOINT_FILE, TRUE, &fd, &local_error) ||
+      (bytes = glnx_fd_readall_bytes (fd, NULL, &local_error)) == NULL)
+    {
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_debug ("Ignoring repair checkpoint: %s", local_error->message);
+      return g_steal_pointer (&verified);
+    }
+
+  contents = g_bytes_get_data (bytes, &len);
+
+  if (len < magic_len ||
+      memcmp (contents, REPAIR_CHECKPOINT_MAGIC, magic_len) != 0 ||
+      (len - magic_len) % sizeof (VerifiedObject) != 0)
+    {
+      g_debug ("Ignoring invalid repair checkpoint");
+      return g_steal_pointer (&verified);
+    }
+
+  for (gsize offset = magic_len; offset < len; offset += sizeof (VerifiedObject))
+    {
+      VerifiedEntry *entry = g_new0 (VerifiedEntry, 1);
+
+      memcpy (&entry->obj, contents + offset, sizeof (VerifiedObject));
+      g_hash_table_replace (verified, entry->obj.csum, entry);
+    }
+
+  return g_steal_pointer (&verified);
+}
+
+/* Called with ctx->lock held. If only_seen is set, records for objects
+ * that were not visited in this run are dropped, which is what we want
+ * once all refs have been verified. */
+static void
+save_repair_checkpoint_locked (FsckContext *ctx,
+                               gboolean     only_seen)
+{
+  g_autoptr(GByteArray) data = g_byte_array_new ();
+  g_autoptr(GError) local_error = NULL;
+
+  if (opt_dry_run)
+    return;
+
+  g_byte_array_append (data, (const guint8 *) REPAIR_CHECKPOINT_MAGIC,
+                       strlen (REPAIR_CHECKPOINT_MAGIC));
+
+  GLNX_HASH_TABLE_FOREACH_V (ctx->verified, VerifiedEntry *, entry)
+    {
+      if (!only_seen || entry->seen)
+        g_byte_array_append (data, (const guint8 *) &entry->obj, sizeof (VerifiedObject));
+    }
+
+  if (!glnx_file_replace_contents_at (ostree_repo_get_dfd (ctx->repo), REPAIR_CHECKPOINT_FILE,
+                                      data->data, data->len, GLNX_FILE_REPLACE_NODATASYNC,
+                                      NULL, &local_error))
+    g_printerr (_("Failed to save repair checkpoint: %s\n"), local_error->message);
+
+  ctx->last_checkpoint = g_get_monotonic_time ();
+}
+
+static void
+maybe_save_repair_checkpoint (FsckContext *ctx)
+{
+  g_mutex_lock (&ctx->lock);
+  if (g_get_monotonic_time () - ctx->last_checkpoint > REPAIR_CHECKPOINT_INTERVAL_SECS * G_USEC_PER_SEC)
+    save_repair_checkpoint_locked (ctx, FALSE);
+  g_mutex_unlock (&ctx->lock);
+}
+
+static void
+fsck_job_thread_func (gpointer data,
+                      gpointer user_data);
+
+static FsckContext *
+fsck_context_new (OstreeRepo *repo,
+                  GError    **error)
+{
+  g_autofree FsckContext *ctx = g_new0 (FsckContext, 1);
+
+  ctx->pool = g_thread_pool_new (fsck_job_thread_func, ctx,
+                                 CLAMP (g_get_num_processors (), 1, FSCK_MAX_THREADS),
+                                 FALSE, error);
+  if (ctx->pool == NULL)
+    return NULL;
+
+  ctx->repo = repo;
+  g_mutex_init (&ctx->lock);
+  g_cond_init (&ctx->cond);
+  ctx->object_status_cache = g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
+                                                    (GDestroyNotify) g_variant_unref, NULL);
+  ctx->verified = load_repair_checkpoint (repo);
+  ctx->last_checkpoint = g_get_monotonic_time ();
+
+  return g_steal_pointer (&ctx);
+}
+
+static void
+fsck_context_free (FsckContext *ctx)
+{
+  /* All batches are waited for, so this doesn't block */
+  g_thread_pool_free (ctx->pool, FALSE, TRUE);
+  g_mutex_clear (&ctx->lock);
+  g_cond_clear (&ctx->cond);
+  g_hash_table_unref (ctx->object_status_cache);
+  g_hash_table_unref (ctx->verified);
+  g_free (ctx);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FsckContext, fsck_context_free)
+
+static gboolean
+object_status_cache_lookup (FsckContext *ctx,
+                            GVariant    *key,
+                            FsckStatus  *out_status)
+{
+  gpointer cached_status;
+  gboolean found;
+
+  g_mutex_lock (&ctx->lock);
+  found = g_hash_table_lookup_extended (ctx->object_status_cache, key, NULL, &cached_status);
+  g_mutex_unlock (&ctx->lock);
+
+  if (found)
+    *out_status = GPOINTER_TO_INT (cached_status);
+  return found;
+}
+
+static void
+object_status_cache_insert (FsckContext *ctx,
+                            GVariant    *key,
+                            FsckStatus   status)
+{
+  g_mutex_lock (&ctx->lock);
+  g_hash_table_insert (ctx->object_status_cache, g_variant_ref (key), GINT_TO_POINTER (status));
+  g_mutex_unlock (&ctx->lock);
+}
+
 static FsckStatus
 fsck_one_object (OstreeRepo      *repo,
                  const char      *checksum,
@@ -88,51 +305,210 @@ fsck_one_object (OstreeRepo      *repo,
   return FSCK_STATUS_OK;
 }
 
+/* Not defined by libglnx */
+#ifndef STATX_ATTR_VERITY
+#define STATX_ATTR_VERITY 0x00100000
+#endif
+
+typedef struct {
+  guint64  ino;
+  guint64  size;
+  gint64   ctime_sec;
+  gint64   ctime_nsec;
+  gboolean verity;
+} LooseObjectStat;
+
+static gboolean
+stat_loose_object (OstreeRepo      *repo,
+                   const char      *checksum,
+                   LooseObjectStat *out_stat)
+{
+  g_autofree char *path = NULL;
+  struct glnx_statx stx;
+  struct stat stbuf;
+  const guint mask = GLNX_STATX_INO | GLNX_STATX_SIZE | GLNX_STATX_CTIME;
+
+  path = g_strdup_printf ("objects/%c%c/%s.%s", checksum[0], checksum[1], checksum + 2,
+                          ostree_repo_get_mode (repo) == OSTREE_REPO_MODE_ARCHIVE ? "filez" : "file");
+
+  if (glnx_statx (ostree_repo_get_dfd (repo), path, AT_SYMLINK_NOFOLLOW, mask, &stx, NULL) &&
+      (stx.stx_mask & mask) == mask)
+    {
+      out_stat->ino = stx.stx_ino;
+      out_stat->size = stx.stx_size;
+      out_stat->ctime_sec = stx.stx_ctime.tv_sec;
+      out_stat->ctime_nsec = stx.stx_ctime.tv_nsec;
+      out_stat->verity = (stx.stx_attributes_mask & stx.stx_attributes & STATX_ATTR_VERITY) != 0;
+      return TRUE;
+    }
+
+  /* Kernels before 4.11 don't have statx() */
+  if (errno == ENOSYS &&
+      fstatat (ostree_repo_get_dfd (repo), path, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+      out_stat->ino = stbuf.st_ino;
+      out_stat->size = stbuf.st_size;
+      out_stat->ctime_sec = stbuf.st_ctim.tv_sec;
+      out_stat->ctime_nsec = stbuf.st_ctim.tv_nsec;
+      out_stat->verity = FALSE;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Like fsck_one_object() for file objects, but skips the checksum if the
+ * loose object is unchanged since it was last verified. With --fast, it is
+ * also skipped for objects that have fs-verity enabled: ostree only enables
+ * it after the content was checksummed, and from then on the kernel fails
+ * any read of content that doesn't match. */
+static FsckStatus
+fsck_file_object (FsckContext *ctx,
+                  const char  *checksum)
+{
+  guint8 csum[OSTREE_SHA256_DIGEST_LEN];
+  VerifiedEntry *entry;
+  LooseObjectStat st;
+  gboolean have_stat;
+  FsckStatus status;
+
+  have_stat = stat_loose_object (ctx->repo, checksum, &st);
+
+  if (have_stat && st.verity && opt_fast)
+    return FSCK_STATUS_OK;
+
+  ostree_checksum_inplace_to_bytes (checksum, csum);
+
+  if (have_stat)
+    {
+      g_mutex_lock (&ctx->lock);
+      entry = g_hash_table_lookup (ctx->verified, csum);
+      if (entry != NULL &&
+          entry->obj.ino == st.ino &&
+          entry->obj.size == st.size &&
+          entry->obj.ctime_sec == st.ctime_sec &&
+          entry->obj.ctime_nsec == st.ctime_nsec)
+        {
+          entry->seen = TRUE;
+          g_mutex_unlock (&ctx->lock);
+          return FSCK_STATUS_OK;
+        }
+      g_mutex_unlock (&ctx->lock);
+    }
+
+  status = fsck_one_object (ctx->repo, checksum, OSTREE_OBJECT_TYPE_FILE, FALSE);
+
+  g_mutex_lock (&ctx->lock);
+  if (status == FSCK_STATUS_OK && have_stat)
+    {
+      entry = g_new0 (VerifiedEntry, 1);
+      memcpy (entry->obj.csum, csum, sizeof (csum));
+      entry->obj.ino = st.ino;
+      entry->obj.size = st.size;
+      entry->obj.ctime_sec = st.ctime_sec;
+      entry->obj.ctime_nsec = st.ctime_nsec;
+      entry->seen = TRUE;
+      g_hash_table_replace (ctx->verified, entry->obj.csum, entry);
+    }
+  else
+    g_hash_table_remove (ctx->verified, csum);
+  g_mutex_unlock (&ctx->lock);
+
+  return status;
+}
+
 /* This is used for leaf object types */
 static FsckStatus
-fsck_leaf_object (OstreeRepo      *repo,
+fsck_leaf_object (FsckContext     *ctx,
                   const char      *checksum,
-                  OstreeObjectType objtype,
-                  GHashTable      *object_status_cache)
+                  OstreeObjectType objtype)
 {
   g_autoptr(GVariant) key = NULL;
-  gpointer cached_status;
   FsckStatus status = 0;
 
   key = g_variant_ref_sink (ostree_object_name_serialize (checksum, objtype));
 
-  if (g_hash_table_lookup_extended (object_status_cache, key, NULL, &cached_status))
+  if (!object_status_cache_lookup (ctx, key, &status))
     {
-      status = GPOINTER_TO_INT (cached_status);
-    }
-  else
-    {
-      status = fsck_one_object (repo, checksum, objtype, FALSE);
-      g_hash_table_insert (object_status_cache, g_steal_pointer (&key), GINT_TO_POINTER (status));
+      if (objtype == OSTREE_OBJECT_TYPE_FILE)
+        status = fsck_file_object (ctx, checksum);
+      else
+        status = fsck_one_object (ctx->repo, checksum, objtype, FALSE);
+      object_status_cache_insert (ctx, key, status);
     }
 
   return status;
 }
 
+static void
+fsck_job_thread_func (gpointer data,
+                      gpointer user_data)
+{
+  FsckJob *job = data;
+  FsckContext *ctx = user_data;
+  FsckStatus status;
+
+  status = fsck_leaf_object (ctx, job->checksum, OSTREE_OBJECT_TYPE_FILE);
+
+  g_mutex_lock (&ctx->lock);
+  job->batch->status = MAX (job->batch->status, status);
+  job->batch->pending--;
+  g_cond_broadcast (&ctx->cond);
+  g_mutex_unlock (&ctx->lock);
+
+  g_free (job);
+}
+
+static void
+fsck_batch_push (FsckContext *ctx,
+                 FsckBatch   *batch,
+                 const char  *checksum)
+{
+  FsckJob *job = g_new0 (FsckJob, 1);
+
+  job->batch = batch;
+  memcpy (job->checksum, checksum, OSTREE_SHA256_STRING_LEN);
+
+  g_mutex_lock (&ctx->lock);
+  batch->pending++;
+  g_mutex_unlock (&ctx->lock);
+
+  g_thread_pool_push (ctx->pool, job, NULL);
+}
+
+static FsckStatus
+fsck_batch_wait (FsckContext *ctx,
+                 FsckBatch   *batch)
+{
+  FsckStatus status;
+
+  g_mutex_lock (&ctx->lock);
+  while (batch->pending > 0)
+    g_cond_wait (&ctx->cond, &ctx->lock);
+  status = batch->status;
+  g_mutex_unlock (&ctx->lock);
+
+  return status;
+}
 
 static FsckStatus
-fsck_dirtree (OstreeRepo *repo,
-              gboolean    partial,
-              const char *checksum,
-              GHashTable *object_status_cache)
+fsck_dirtree (FsckContext *ctx,
+              gboolean     partial,
+              const char  *checksum)
 {
+  OstreeRepo *repo = ctx->repo;
   OstreeRepoCommitIterResult iterres;
   g_autoptr(GError) local_error = NULL;
   FsckStatus status = 0;
+  FsckBatch batch = { 0, };
   g_autoptr(GVariant) key = NULL;
   g_autoptr(GVariant) dirtree = NULL;
-  gpointer cached_status;
   ostree_cleanup_repo_commit_traverse_iter
   OstreeRepoCommitTraverseIter iter = { 0, };
 
   key = g_variant_ref_sink (ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_DIR_TREE));
-  if (g_hash_table_lookup_extended (object_status_cache, key, NULL, &cached_status))
-    return GPOINTER_TO_INT (cached_status);
+  if (object_status_cache_lookup (ctx, key, &status))
+    return status;
 
   /* First verify the dirtree itself */
   status = fsck_one_object (repo, checksum, OSTREE_OBJECT_TYPE_DIR_TREE, partial);
@@ -149,7 +525,8 @@ fsck_dirtree (OstreeRepo *repo,
         }
       else
         {
-          /* Then its children, recursively */
+          /* Then its children, recursively. Files are checksummed on the
+           * thread pool while we continue with the subdirectories. */
           while (TRUE)
             {
               iterres = ostree_repo_commit_traverse_iter_next (&iter, NULL, &local_error);
@@ -167,11 +544,16 @@ fsck_dirtree (OstreeRepo *repo,
                 {
                   char *name;
                   char *commit_checksum;
+                  g_autoptr(GVariant) file_key = NULL;
                   FsckStatus file_status;
 
                   ostree_repo_commit_traverse_iter_get_file (&iter, &name, &commit_checksum);
-                  file_status = fsck_leaf_object (repo, commit_checksum, OSTREE_OBJECT_TYPE_FILE, object_status_cache);
-                  status = MAX (status, file_status);
+
+                  file_key = g_variant_ref_sink (ostree_object_name_serialize (commit_checksum, OSTREE_OBJECT_TYPE_FILE));
+                  if (object_status_cache_lookup (ctx, file_key, &file_status))
+                    status = MAX (status, file_status);
+                  else
+                    fsck_batch_push (ctx, &batch, commit_checksum);
                 }
               else if (iterres == OSTREE_REPO_COMMIT_ITER_RESULT_DIR)
                 {
@@ -183,10 +565,10 @@ fsck_dirtree (OstreeRepo *repo,
 
                   ostree_repo_commit_traverse_iter_get_dir (&iter, &name, &dirtree_checksum, &meta_checksum);
 
-                  meta_status = fsck_leaf_object (repo, meta_checksum, OSTREE_OBJECT_TYPE_DIR_META, object_status_cache);
+                  meta_status = fsck_leaf_object (ctx, meta_checksum, OSTREE_OBJECT_TYPE_DIR_META);
                   status = MAX (status, meta_status);
 
-                  dirtree_status = fsck_dirtree (repo, partial, dirtree_checksum, object_status_cache);
+                  dirtree_status = fsck_dirtree (ctx, partial, dirtree_checksum);
 
                   status = MAX (status, dirtree_status);
                 }
@@ -196,15 +578,19 @@ fsck_dirtree (OstreeRepo *repo,
         }
     }
 
-  g_hash_table_insert (object_status_cache, g_steal_pointer (&key), GINT_TO_POINTER (status));
+  /* The cached status of a dirtree covers all its children, so we
+   * have to wait for the files before recording it */
+  status = MAX (status, fsck_batch_wait (ctx, &batch));
+
+  object_status_cache_insert (ctx, key, status);
   return status;
 }
 
 static FsckStatus
-fsck_commit (OstreeRepo *repo,
-             const char *checksum,
-             GHashTable *object_status_cache)
+fsck_commit (FsckContext *ctx,
+             const char  *checksum)
 {
+  OstreeRepo *repo = ctx->repo;
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GVariant) commit = NULL;
   g_autoptr(GVariant) dirtree_csum_bytes = NULL;
@@ -241,13 +627,13 @@ fsck_commit (OstreeRepo *repo,
   g_variant_get_child (commit, 7, "@ay", &meta_csum_bytes);
   meta_checksum = ostree_checksum_from_bytes (ostree_checksum_bytes_peek (meta_csum_bytes));
 
-  meta_status = fsck_leaf_object (repo, meta_checksum, OSTREE_OBJECT_TYPE_DIR_META, object_status_cache);
+  meta_status = fsck_leaf_object (ctx, meta_checksum, OSTREE_OBJECT_TYPE_DIR_META);
   status = MAX (status, meta_status);
 
   g_variant_get_child (commit, 6, "@ay", &dirtree_csum_bytes);
   dirtree_checksum = ostree_checksum_from_bytes (ostree_checksum_bytes_peek (dirtree_csum_bytes));
 
-  dirtree_status = fsck_dirtree (repo, partial, dirtree_checksum, object_status_cache);
+  dirtree_status = fsck_dirtree (ctx, partial, dirtree_checksum);
   status = MAX (status, dirtree_status);
 
   /* It's ok for partial commits to have missing objects
@@ -318,7 +704,7 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
   g_autoptr(GPtrArray) refs = NULL;
   FlatpakDir *dir = NULL;
   g_autoptr(GHashTable) all_refs = NULL;
-  g_autoptr(GHashTable) object_status_cache = NULL;
+  g_autoptr(FsckContext) fsck_ctx = NULL;
   g_autoptr(FlatpakTransaction) transaction = NULL;
   OstreeRepo *repo;
   g_autoptr(GFile) file = NULL;
@@ -350,6 +736,8 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
 
   /*
    * Try to repair a flatpak directory:
+   *  + Drop the index of deployed refs, which gets rebuilt from the
+   *    deploy dirs
    *  + Delete any mirror refs which may be leaking disk space
    *    (https://github.com/flatpak/flatpak/issues/3222)
    *  + Scan all locally available refs
@@ -357,6 +745,8 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
    *  + Verify the commits they point to and all object they reference:
    *  +  Remove any invalid objects
    *  +  Note any missing objects
+   *  +  Skip file objects that are unchanged since they were last
+   *       verified, according to the repair checkpoint
    *  + Any refs that had invalid object, or non-partial refs that had missing
    *      objects are removed
    *  + Prune (depth=0) all object not references by a ref, which gets rid of
@@ -367,11 +757,15 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
    *      re-install them (pull + deploy)
    */
 
+  if (!opt_dry_run)
+    flatpak_dir_drop_deployed_index (dir);
+
   if (!flatpak_dir_delete_mirror_refs (dir, opt_dry_run, cancellable, error))
     return FALSE;
 
-  object_status_cache = g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
-                                               (GDestroyNotify) g_variant_unref, NULL);
+  fsck_ctx = fsck_context_new (repo, error);
+  if (fsck_ctx == NULL)
+    return FALSE;
 
   /* Validate that the commit for each ref is available */
   if (!ostree_repo_list_refs (repo, NULL, &all_refs, cancellable, error))
@@ -428,7 +822,8 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
 
     g_print (_("[%d/%d] Verifying %s…\n"), i, g_hash_table_size (all_refs), refspec);
 
-    status = fsck_commit (repo, checksum, object_status_cache);
+    status = fsck_commit (fsck_ctx, checksum);
+    maybe_save_repair_checkpoint (fsck_ctx);
     if (status != FSCK_STATUS_OK)
       {
         if (opt_dry_run)
@@ -461,6 +856,11 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
       }
   }
 
+  /* All refs are verified, so forget about objects we didn't visit */
+  g_mutex_lock (&fsck_ctx->lock);
+  save_repair_checkpoint_locked (fsck_ctx, TRUE);
+  g_mutex_unlock (&fsck_ctx->lock);
+
   g_print (_("Checking remotes...\n"));
 
   GLNX_HASH_TABLE_FOREACH_KV (all_refs, const char *, refspec, const char *, checksum)
@@ -64,6 +64,9 @@ static int opt_app_fd = -1;
 static char *opt_usr_path;
 static int opt_usr_fd = -1;
 static gboolean opt_clear_env;
+static gboolean opt_prepare_only;
+static gboolean opt_profile_startup;
+static gboolean opt_headless;
 static GArray *opt_bind_fds = NULL;
 static GArray *opt_ro_bind_fds = NULL;
 
@@ -184,8 +187,11 @@ static GOptionEntry options[] = {
   { "usr-path", 0, 0, G_OPTION_ARG_FILENAME, &opt_usr_path, N_("Use PATH instead of the runtime's /usr"), N_("PATH") },
   { "usr-fd", 0, 0, G_OPTION_ARG_CALLBACK, &opt_usr_fd_cb, N_("Use FD instead of the runtime's /usr"), N_("FD") },
   { "clear-env", 0, 0, G_OPTION_ARG_NONE, &opt_clear_env, N_("Clear all outside environment variables"), NULL },
+  { "headless", 0, 0, G_OPTION_ARG_NONE, &opt_headless, N_("Don't use any services from the desktop session"), NULL },
   { "bind-fd", 0, 0, G_OPTION_ARG_CALLBACK | G_OPTION_FLAG_HIDDEN, &option_bind_fd_cb, N_("Bind mount the file or directory referred to by FD to its canonicalized path"), N_("FD") },
   { "ro-bind-fd", 0, 0, G_OPTION_ARG_CALLBACK | G_OPTION_FLAG_HIDDEN, &option_ro_bind_fd_cb, N_("Bind mount the file or directory referred to by FD read-only to its canonicalized path"), N_("FD") },
+  { "prepare-only", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &opt_prepare_only, N_("Only regenerate the cached ld.so.cache, don't run anything"), NULL },
+  { "profile-startup", 0, 0, G_OPTION_ARG_NONE, &opt_profile_startup, N_("Print how long each step of starting the app took, as JSON"), NULL },
   { NULL }
 };
 
@@ -210,6 +216,8 @@ flatpak_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
   FlatpakRunFlags flags = 0;
   glnx_autofd int app_fd = -1;
   glnx_autofd int usr_fd = -1;
+  gint64 start_time = g_get_monotonic_time ();
+  const char *profile_output;
 
   run_environ = g_get_environ ();
 
@@ -239,6 +247,13 @@ flatpak_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
                                      &dirs, cancellable, error))
     return FALSE;
 
+  /* FLATPAK_PROFILE_STARTUP=FILE writes the same thing to FILE */
+  profile_output = g_getenv ("FLATPAK_PROFILE_STARTUP");
+  if (opt_profile_startup)
+    profile_output = "-";
+  if (profile_output != NULL && *profile_output != '\0')
+    flatpak_startup_profile_start (profile_output, start_time);
+
   /* Move the user dir to the front so it "wins" in case an app is in more than
    * one installation */
   if (dirs->len > 1)
@@ -380,6 +395,8 @@ flatpak_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
       g_clear_error (&local_error);
     }
 
+  flatpak_startup_profile_mark ("deploy-lookup");
+
   /* Default to TRUE, unless sandboxed */
   if (opt_a11y_bus == -1)
     opt_a11y_bus = !opt_sandbox;
@@ -412,6 +429,10 @@ flatpak_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
     flags |= FLATPAK_RUN_FLAG_NO_SESSION_BUS_PROXY;
   if (!opt_clear_env)
     flags |= FLATPAK_RUN_FLAG_CLEAR_ENV;
+  if (opt_prepare_only)
+    flags |= FLATPAK_RUN_FLAG_PREPARE_ONLY;
+  if (opt_headless)
+    flags |= FLATPAK_RUN_FLAG_HEADLESS;
 
   if (opt_app_fd >= 0 && opt_app_path != NULL)
     {
@@ -28,6 +28,7 @@
 #include "flatpak-dir-private.h"
 #include "flatpak-table-printer.h"
 #include "flatpak-utils-private.h"
+#include "flatpak-xml-utils-private.h"
 
 static char *opt_arch;
 static const char **opt_cols;
@@ -50,70 +51,46 @@ static Column all_columns[] = {
   { NULL }
 };
 
-static GPtrArray *
-get_remote_stores (GPtrArray *dirs, const char *arch, GCancellable *cancellable)
-{
-  GError *error = NULL;
-  GPtrArray *ret = g_ptr_array_new_with_free_func (g_object_unref);
-  guint i, j;
-
-  for (i = 0; i < dirs->len; ++i)
-    {
-      FlatpakDir *dir = g_ptr_array_index (dirs, i);
-      g_auto(GStrv) remotes = NULL;
-
-      flatpak_log_dir_access (dir);
-
-      remotes = flatpak_dir_list_enumerated_remotes (dir, cancellable, &error);
-      if (error)
-        {
-          g_warning ("%s", error->message);
-          g_clear_error (&error);
-          continue;
-        }
-      else if (remotes == NULL)
-        continue;
-
-      for (j = 0; remotes[j]; ++j)
-        {
-          g_autoptr(AsMetadata) mdata = as_metadata_new ();
-
-          flatpak_dir_load_appstream_data (dir, remotes[j], arch, mdata, cancellable, &error);
-
-          if (error)
-            {
-              g_warning ("%s", error->message);
-              g_clear_error (&error);
-            }
-
-          g_object_set_data_full (G_OBJECT (mdata), "remote-name", g_strdup (remotes[j]), g_free);
-          g_ptr_array_add (ret, g_steal_pointer (&mdata));
-        }
-    }
-  return ret;
-}
-
 typedef struct MatchResult
 {
-  AsComponent *app;
-  GPtrArray   *remotes;
-  guint        score;
+  FlatpakDecomposed *decomposed;
+  char              *id;
+  char              *name;
+  char              *summary;
+  char              *version;
+  GPtrArray         *remotes;
+  guint              score;
 } MatchResult;
 
 static void
 match_result_free (MatchResult *result)
 {
-  g_object_unref (result->app);
+  flatpak_decomposed_unref (result->decomposed);
+  g_free (result->id);
+  g_free (result->name);
+  g_free (result->summary);
+  g_free (result->version);
   g_ptr_array_unref (result->remotes);
   g_free (result);
 }
 
 static MatchResult *
-match_result_new (AsComponent *app, guint score)
+match_result_new (FlatpakDecomposed *decomposed,
+                  const char        *name,
+                  const char        *summary,
+                  const char        *version,
+                  guint              score)
 {
   MatchResult *result = g_new (MatchResult, 1);
 
-  result->app = g_object_ref (app);
+  result->decomposed = flatpak_decomposed_ref (decomposed);
+  /* The appstream component ID doesn't necessarily match the flatpak app ID
+   * (e.g. sometimes there's a .desktop suffix on the appstream ID) so this
+   * uses the flatpak app ID from the bundle element */
+  result->id = flatpak_decomposed_dup_id (decomposed);
+  result->name = g_strdup (name);
+  result->summary = g_strdup (summary);
+  result->version = g_strdup (version);
   result->remotes = g_ptr_array_new_with_free_func (g_free);
   result->score = score;
 
@@ -141,70 +118,314 @@ compare_by_score (MatchResult *a, MatchResult *b, gpointer user_data)
   return (int) b->score - (int) a->score;
 }
 
-static gboolean
-as_app_equal (AsComponent *app1, AsComponent *app2)
+static int
+compare_apps (MatchResult *a, FlatpakDecomposed *b)
 {
-  if (app1 == app2)
-    return TRUE;
-
-  FlatpakDecomposed *app1_decomposed = g_object_get_data (G_OBJECT (app1), "decomposed");
-  FlatpakDecomposed *app2_decomposed = g_object_get_data (G_OBJECT (app2), "decomposed");
-
   /* Ignore arch when comparing since it's not shown in the search output and
    * we don't want duplicate results for the same app with different arches.
    */
-  return flatpak_decomposed_equal_except_arch (app1_decomposed, app2_decomposed);
+  return !flatpak_decomposed_equal_except_arch (a->decomposed, b);
 }
 
-static int
-compare_apps (MatchResult *a, AsComponent *b)
+/* Adds a match, avoiding duplicate entries but showing multiple remotes */
+static GSList *
+add_match (GSList            *matches,
+           FlatpakDecomposed *decomposed,
+           const char        *name,
+           const char        *summary,
+           const char        *version,
+           const char        *remote_name,
+           guint              score)
 {
-  return !as_app_equal (a->app, b);
+  GSList *list_entry = g_slist_find_custom (matches, decomposed,
+                                            (GCompareFunc) compare_apps);
+  MatchResult *result = NULL;
+
+  if (list_entry != NULL)
+    result = list_entry->data;
+  else
+    {
+      result = match_result_new (decomposed, name, summary, version, score);
+      matches = g_slist_insert_sorted_with_data (matches, result,
+                                                 (GCompareDataFunc) compare_by_score, NULL);
+    }
+  match_result_add_remote (result, remote_name);
+
+  return matches;
 }
 
-/* as_component_get_id() returns the appstream component ID which doesn't
- * necessarily match the flatpak app ID (e.g. sometimes there's a .desktop
- * suffix on the appstream ID) so this gets the flatpak app ID via the bundle
- * element
- */
-static char *
-component_get_flatpak_id (AsComponent *app)
+static gboolean
+fallback_matches (FlatpakDecomposed *decomposed,
+                  const char        *name,
+                  const char        *search_text)
 {
-  FlatpakDecomposed *app_decomposed = g_object_get_data (G_OBJECT (app), "decomposed");
-  return flatpak_decomposed_dup_id (app_decomposed);
+  g_autofree char *app_id = flatpak_decomposed_dup_id (decomposed);
+
+  return strcasestr (app_id, search_text) != NULL ||
+         (name != NULL && strcasestr (name, search_text) != NULL);
+}
+
+/* Maps the search index written by flatpak_dir_deploy_appstream(), or
+ * returns %NULL if there isn't one, e.g. for OCI remotes */
+static GVariant *
+load_search_index (FlatpakDir *dir,
+                   const char *remote_name,
+                   const char *arch)
+{
+  g_autofree char *index_path = NULL;
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) index = NULL;
+  guint32 version;
+
+  if (flatpak_dir_get_remote_oci (dir, remote_name))
+    return NULL;
+
+  index_path = g_build_filename (flatpak_file_get_path_cached (flatpak_dir_get_path (dir)),
+                                 "appstream", remote_name, arch ? arch : flatpak_get_arch (),
+                                 "active", FLATPAK_APPSTREAM_SEARCH_INDEX, NULL);
+  mfile = g_mapped_file_new (index_path, FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  index = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_APPSTREAM_SEARCH_INDEX_FORMAT),
+                                                        bytes, FALSE));
+
+  g_variant_get_child (index, 0, "u", &version);
+  if (version != FLATPAK_APPSTREAM_SEARCH_INDEX_VERSION)
+    return NULL;
+
+  return g_steal_pointer (&index);
 }
 
-/* as_component_get_branch() seems to return NULL in practice, so use the
- * bundle id to get the branch
- */
 static const char *
-component_get_branch (AsComponent *app)
+lookup_translated (GVariant *translations)
+{
+  const char * const *languages = g_get_language_names ();
+  const char *value = NULL;
+
+  for (gsize i = 0; languages[i] != NULL; i++)
+    {
+      const char *lang = strcmp (languages[i], "C") == 0 ? "" : languages[i];
+
+      if (g_variant_lookup (translations, lang, "&s", &value))
+        return value;
+    }
+
+  if (g_variant_lookup (translations, "", "&s", &value))
+    return value;
+
+  return NULL;
+}
+
+/* Scores like as_component_search_matches(): every search term has to be a
+ * prefix of some token, and each term adds the weights of what it matched */
+static guint
+search_index_entry_matches (GVariant    *tokens,
+                            const char **search_terms)
+{
+  guint score = 0;
+
+  if (search_terms[0] == NULL)
+    return 0;
+
+  for (gsize i = 0; search_terms[i] != NULL; i++)
+    {
+      gsize n_tokens = g_variant_n_children (tokens);
+      guint term_match = 0;
+
+      for (gsize j = 0; j < n_tokens; j++)
+        {
+          const char *token;
+          guint16 match;
+
+          g_variant_get_child (tokens, j, "(&sq)", &token, &match);
+          if (g_str_has_prefix (token, search_terms[i]))
+            term_match |= match;
+        }
+
+      if (term_match == 0)
+        return 0;
+
+      score += term_match;
+    }
+
+  return score;
+}
+
+static GSList *
+search_index (GSList      *matches,
+              GVariant    *index,
+              const char  *remote_name,
+              const char  *search_text,
+              const char **search_terms)
+{
+  g_autoptr(GVariant) components = g_variant_get_child_value (index, 1);
+  gsize n_components = g_variant_n_children (components);
+
+  for (gsize i = 0; i < n_components; i++)
+    {
+      g_autoptr(GVariant) names = NULL;
+      g_autoptr(GVariant) summaries = NULL;
+      g_autoptr(GVariant) tokens = NULL;
+      g_autoptr(FlatpakDecomposed) decomposed = NULL;
+      const char *ref;
+      const char *version;
+      const char *name;
+      guint score;
+
+      g_variant_get_child (components, i, "(&s@a{ss}@a{ss}&s@a(sq))",
+                           &ref, &names, &summaries, &version, &tokens);
+
+      decomposed = flatpak_decomposed_new_from_ref (ref, NULL);
+      if (decomposed == NULL)
+        continue;
+
+      name = lookup_translated (names);
+
+      score = search_index_entry_matches (tokens, search_terms);
+      if (score == 0)
+        {
+          if (fallback_matches (decomposed, name, search_text))
+            score = 50;
+          else
+            continue;
+        }
+
+      matches = add_match (matches, decomposed, name, lookup_translated (summaries),
+                           *version != 0 ? version : NULL, remote_name, score);
+    }
+
+  return matches;
+}
+
+static GSList *
+search_appstream (GSList     *matches,
+                  AsMetadata *mdata,
+                  const char *remote_name,
+                  const char *search_text)
 {
-  FlatpakDecomposed *app_decomposed = g_object_get_data (G_OBJECT (app), "decomposed");
-  return flatpak_decomposed_get_branch (app_decomposed);
+#if AS_CHECK_VERSION(1, 0, 0)
+  AsComponentBox *apps = as_metadata_get_components (mdata);
+#else
+  GPtrArray *apps = as_metadata_get_components (mdata);
+#endif
+
+#if AS_CHECK_VERSION(1, 0, 0)
+  for (guint i = 0; i < as_component_box_len (apps); ++i)
+    {
+      AsComponent *app = as_component_box_index (apps, i);
+#else
+  for (guint i = 0; i < apps->len; ++i)
+    {
+      AsComponent *app = g_ptr_array_index (apps, i);
+#endif
+      g_autoptr(FlatpakDecomposed) decomposed = NULL;
+
+      AsBundle *bundle = as_component_get_bundle (app, AS_BUNDLE_KIND_FLATPAK);
+      if (bundle == NULL || as_bundle_get_id (bundle) == NULL ||
+          (decomposed = flatpak_decomposed_new_from_ref (as_bundle_get_id (bundle), NULL)) == NULL)
+        {
+          g_info ("Ignoring app %s from remote %s as it lacks a flatpak bundle",
+                  as_component_get_id (app), remote_name);
+          continue;
+        }
+
+      guint score = as_component_search_matches (app, search_text);
+      if (score == 0)
+        {
+          if (fallback_matches (decomposed, as_component_get_name (app), search_text))
+            score = 50;
+          else
+            continue;
+        }
+
+      matches = add_match (matches, decomposed,
+                           as_component_get_name (app),
+                           as_component_get_summary (app),
+                           component_get_version_latest (app),
+                           remote_name, score);
+    }
+
+  return matches;
+}
+
+static GSList *
+search_remotes (GPtrArray    *dirs,
+                const char   *arch,
+                const char   *search_text,
+                GCancellable *cancellable)
+{
+  GError *error = NULL;
+  GSList *matches = NULL;
+  g_auto(GStrv) search_terms = flatpak_appstream_search_tokenize (search_text);
+  guint i, j;
+
+  for (i = 0; i < dirs->len; ++i)
+    {
+      FlatpakDir *dir = g_ptr_array_index (dirs, i);
+      g_auto(GStrv) remotes = NULL;
+
+      flatpak_log_dir_access (dir);
+
+      remotes = flatpak_dir_list_enumerated_remotes (dir, cancellable, &error);
+      if (error)
+        {
+          g_warning ("%s", error->message);
+          g_clear_error (&error);
+          continue;
+        }
+      else if (remotes == NULL)
+        continue;
+
+      for (j = 0; remotes[j]; ++j)
+        {
+          g_autoptr(AsMetadata) mdata = NULL;
+          g_autoptr(GVariant) index = NULL;
+
+          /* The precomputed index avoids parsing the whole appstream xml */
+          index = load_search_index (dir, remotes[j], arch);
+          if (index != NULL)
+            {
+              matches = search_index (matches, index, remotes[j], search_text,
+                                      (const char **) search_terms);
+              continue;
+            }
+
+          mdata = as_metadata_new ();
+          flatpak_dir_load_appstream_data (dir, remotes[j], arch, mdata, cancellable, &error);
+
+          if (error)
+            {
+              g_warning ("%s", error->message);
+              g_clear_error (&error);
+            }
+
+          matches = search_appstream (matches, mdata, remotes[j], search_text);
+        }
+    }
+
+  return matches;
 }
 
 static void
 print_app (Column *columns, MatchResult *res, FlatpakTablePrinter *printer)
 {
-  const char *version = component_get_version_latest (res->app);
-  g_autofree char *id = component_get_flatpak_id (res->app);
-  const char *name = as_component_get_name (res->app);
-  const char *comment = as_component_get_summary (res->app);
   guint i;
 
   for (i = 0; columns[i].name; i++)
     {
       if (strcmp (columns[i].name, "name") == 0)
-        flatpak_table_printer_add_column (printer, name);
+        flatpak_table_printer_add_column (printer, res->name);
       if (strcmp (columns[i].name, "description") == 0)
-        flatpak_table_printer_add_column (printer, comment);
+        flatpak_table_printer_add_column (printer, res->summary);
       else if (strcmp (columns[i].name, "application") == 0)
-        flatpak_table_printer_add_column (printer, id);
+        flatpak_table_printer_add_column (printer, res->id);
       else if (strcmp (columns[i].name, "version") == 0)
-        flatpak_table_printer_add_column (printer, version);
+        flatpak_table_printer_add_column (printer, res->version);
       else if (strcmp (columns[i].name, "branch") == 0)
-        flatpak_table_printer_add_column (printer, component_get_branch (res->app));
+        flatpak_table_printer_add_column (printer, flatpak_decomposed_get_branch (res->decomposed));
       else if (strcmp (columns[i].name, "remotes") == 0)
         {
           int j;
@@ -261,72 +482,7 @@ flatpak_builtin_search (int argc, char **argv, GCancellable *cancellable, GError
   if (!update_appstream (dirs, NULL, opt_arch, FLATPAK_APPSTREAM_TTL, TRUE, cancellable, error))
     return FALSE;
 
-  const char *search_text = argv[1];
-  GSList *matches = NULL;
-  guint j;
-
-  // We want a store for each remote so we keep the remote information
-  // as AsComponent doesn't currently contain that information
-  g_autoptr(GPtrArray) remote_stores = get_remote_stores (dirs, opt_arch, cancellable);
-  for (j = 0; j < remote_stores->len; ++j)
-    {
-      AsMetadata *mdata = g_ptr_array_index (remote_stores, j);
-#if AS_CHECK_VERSION(1, 0, 0)
-      AsComponentBox *apps = as_metadata_get_components (mdata);
-#else
-      GPtrArray *apps = as_metadata_get_components (mdata);
-#endif
-
-#if AS_CHECK_VERSION(1, 0, 0)
-      for (guint i = 0; i < as_component_box_len (apps); ++i)
-        {
-          AsComponent *app = as_component_box_index (apps, i);
-#else
-      for (guint i = 0; i < apps->len; ++i)
-        {
-          AsComponent *app = g_ptr_array_index (apps, i);
-#endif
-          const char *remote_name = g_object_get_data (G_OBJECT (mdata), "remote-name");
-          g_autoptr(FlatpakDecomposed) decomposed = NULL;
-
-          AsBundle *bundle = as_component_get_bundle (app, AS_BUNDLE_KIND_FLATPAK);
-          if (bundle == NULL || as_bundle_get_id (bundle) == NULL ||
-              (decomposed = flatpak_decomposed_new_from_ref (as_bundle_get_id (bundle), NULL)) == NULL)
-            {
-              g_info ("Ignoring app %s from remote %s as it lacks a flatpak bundle",
-                      as_component_get_id (app), remote_name);
-              continue;
-            }
-
-          g_object_set_data_full (G_OBJECT (app), "decomposed", g_steal_pointer (&decomposed),
-                                  (GDestroyNotify) flatpak_decomposed_unref);
-
-          guint score = as_component_search_matches (app, search_text);
-          if (score == 0)
-            {
-              g_autofree char *app_id = component_get_flatpak_id (app);
-              const char *app_name = as_component_get_name (app);
-              if (strcasestr (app_id, search_text) != NULL || strcasestr (app_name, search_text) != NULL)
-                score = 50;
-              else
-                continue;
-            }
-
-          // Avoid duplicate entries, but show multiple remotes
-          GSList *list_entry = g_slist_find_custom (matches, app,
-                                                    (GCompareFunc) compare_apps);
-          MatchResult *result = NULL;
-          if (list_entry != NULL)
-            result = list_entry->data;
-          else
-            {
-              result = match_result_new (app, score);
-              matches = g_slist_insert_sorted_with_data (matches, result,
-                                                         (GCompareDataFunc) compare_by_score, NULL);
-            }
-          match_result_add_remote (result, remote_name);
-        }
-    }
+  GSList *matches = search_remotes (dirs, opt_arch, argv[1], cancellable);
 
   if (matches != NULL)
     {
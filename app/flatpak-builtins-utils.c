@@ -643,6 +643,40 @@ get_appstream_timestamp (FlatpakDir *dir,
   return get_file_age (ts_file);
 }
 
+/* How many remotes update_appstream() updates at the same time */
+#define APPSTREAM_MAX_JOBS 4
+
+typedef struct {
+  FlatpakDir   *dir;
+  char         *remote;
+  const char   *arch;
+  GCancellable *cancellable;
+  GError       *error;
+} AppstreamJob;
+
+static void
+appstream_job_free (AppstreamJob *job)
+{
+  g_object_unref (job->dir);
+  g_free (job->remote);
+  g_clear_error (&job->error);
+  g_free (job);
+}
+
+/* This runs in a worker thread, with a FlatpakDir of its own so that it
+ * gets a separate OstreeRepo and http session */
+static void
+appstream_job_thread_func (gpointer data,
+                           gpointer user_data)
+{
+  AppstreamJob *job = data;
+
+  if (!flatpak_dir_ensure_repo (job->dir, job->cancellable, &job->error))
+    return;
+
+  flatpak_dir_update_appstream (job->dir, job->remote, job->arch, NULL,
+                                NULL, job->cancellable, &job->error);
+}
 
 gboolean
 update_appstream (GPtrArray    *dirs,
@@ -663,6 +697,9 @@ update_appstream (GPtrArray    *dirs,
 
   if (remote == NULL)
     {
+      g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) appstream_job_free);
+      GThreadPool *pool = NULL;
+
       for (j = 0; j < dirs->len; j++)
         {
           FlatpakDir *dir = g_ptr_array_index (dirs, j);
@@ -674,7 +711,7 @@ update_appstream (GPtrArray    *dirs,
 
           for (i = 0; remotes[i] != NULL; i++)
             {
-              g_autoptr(GError) local_error = NULL;
+              AppstreamJob *job;
               guint64 ts_file_age;
 
               ts_file_age = get_appstream_timestamp (dir, remotes[i], arch);
@@ -710,16 +747,41 @@ update_appstream (GPtrArray    *dirs,
                       g_print ("\n");
                     }
                 }
-              if (!flatpak_dir_update_appstream (dir, remotes[i], arch, &changed,
-                                                 NULL, cancellable, &local_error))
-                {
-                  if (quiet)
-                    g_info ("%s: %s", _("Error updating"), local_error->message);
-                  else
-                    g_printerr ("%s: %s\n", _("Error updating"), local_error->message);
-                }
+
+              job = g_new0 (AppstreamJob, 1);
+              job->dir = flatpak_dir_clone (dir);
+              job->remote = g_strdup (remotes[i]);
+              job->arch = arch;
+              job->cancellable = cancellable;
+              g_ptr_array_add (jobs, job);
             }
         }
+
+      /* The remotes are independent, so update them all at the same time.
+       * Each job deploys its appstream as soon as its own pull is done. */
+      if (jobs->len > 1)
+        pool = g_thread_pool_new (appstream_job_thread_func, NULL,
+                                  MIN (jobs->len, APPSTREAM_MAX_JOBS), FALSE, NULL);
+      for (i = 0; i < jobs->len; i++)
+        {
+          if (pool == NULL || !g_thread_pool_push (pool, g_ptr_array_index (jobs, i), NULL))
+            appstream_job_thread_func (g_ptr_array_index (jobs, i), NULL);
+        }
+      if (pool != NULL)
+        g_thread_pool_free (pool, FALSE, TRUE);
+
+      for (i = 0; i < jobs->len; i++)
+        {
+          AppstreamJob *job = g_ptr_array_index (jobs, i);
+
+          if (job->error == NULL)
+            continue;
+
+          if (quiet)
+            g_info ("%s: %s", _("Error updating"), job->error->message);
+          else
+            g_printerr ("%s: %s\n", _("Error updating"), job->error->message);
+        }
     }
   else
     {
@@ -784,6 +846,140 @@ get_permission_tables (XdpDbusPermissionStore *store)
   return (char **) g_ptr_array_free (tables, FALSE);
 }
 
+static void
+permission_store_entry_free (PermissionStoreEntry *entry)
+{
+  g_free (entry->id);
+  g_clear_pointer (&entry->permissions, g_variant_unref);
+  g_clear_pointer (&entry->data, g_variant_unref);
+  g_free (entry);
+}
+
+typedef struct {
+  XdpDbusPermissionStore *store;
+  GError                 *error;
+  int                     n_pending;
+} PermissionStoreBatch;
+
+typedef struct {
+  PermissionStoreBatch *batch;
+  PermissionStoreEntry *entry;
+} PermissionStoreLookup;
+
+static void
+permission_store_lookup_cb (GObject      *source_object,
+                            GAsyncResult *result,
+                            gpointer      user_data)
+{
+  PermissionStoreLookup *lookup = user_data;
+  PermissionStoreBatch *batch = lookup->batch;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!xdp_dbus_permission_store_call_lookup_finish (batch->store,
+                                                     &lookup->entry->permissions,
+                                                     &lookup->entry->data,
+                                                     result, &local_error) &&
+      batch->error == NULL)
+    batch->error = g_steal_pointer (&local_error);
+
+  batch->n_pending--;
+  g_free (lookup);
+}
+
+/* Caches whole tables for the lifetime of the command, as an audit of all
+ * the apps reads the same tables over and over */
+static GHashTable *permission_table_cache;
+
+/*
+ * lookup_permission_table:
+ * @store: The permission store
+ * @table: The table to read
+ * @ids: (nullable): The ids to look up, or %NULL for all of them
+ * @error: Used to report an error
+ *
+ * Looks up several entries of @table at once. All the Lookup calls are
+ * sent before waiting for the first reply, so this costs one round trip
+ * to the permission store rather than one per id.
+ *
+ * Returns: (transfer container) (element-type PermissionStoreEntry): the
+ *   entries, in the order of @ids or of the table
+ */
+GPtrArray *
+lookup_permission_table (XdpDbusPermissionStore *store,
+                         const char             *table,
+                         const char * const     *ids,
+                         GError                **error)
+{
+  g_autoptr(GMainContext) context = NULL;
+  g_auto(GStrv) store_ids = NULL;
+  g_autoptr(GPtrArray) entries = NULL;
+  PermissionStoreBatch batch = { store, NULL, 0 };
+  gsize i;
+
+  if (ids == NULL)
+    {
+      GPtrArray *cached = NULL;
+
+      if (permission_table_cache != NULL)
+        cached = g_hash_table_lookup (permission_table_cache, table);
+      if (cached != NULL)
+        return g_ptr_array_ref (cached);
+
+      if (!xdp_dbus_permission_store_call_list_sync (store, table, &store_ids, NULL, error))
+        return NULL;
+      ids = (const char * const *) store_ids;
+    }
+
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify) permission_store_entry_free);
+
+  context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+
+  for (i = 0; ids[i] != NULL; i++)
+    {
+      PermissionStoreEntry *entry = g_new0 (PermissionStoreEntry, 1);
+      PermissionStoreLookup *lookup = g_new0 (PermissionStoreLookup, 1);
+
+      entry->id = g_strdup (ids[i]);
+      g_ptr_array_add (entries, entry);
+
+      lookup->batch = &batch;
+      lookup->entry = entry;
+      xdp_dbus_permission_store_call_lookup (store, table, ids[i], NULL,
+                                             permission_store_lookup_cb, lookup);
+      batch.n_pending++;
+    }
+
+  while (batch.n_pending > 0)
+    g_main_context_iteration (context, TRUE);
+
+  g_main_context_pop_thread_default (context);
+
+  if (batch.error != NULL)
+    {
+      g_propagate_error (error, batch.error);
+      return NULL;
+    }
+
+  if (store_ids != NULL)
+    {
+      if (permission_table_cache == NULL)
+        permission_table_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                        g_free, (GDestroyNotify) g_ptr_array_unref);
+      g_hash_table_insert (permission_table_cache, g_strdup (table), g_ptr_array_ref (entries));
+    }
+
+  return g_steal_pointer (&entries);
+}
+
+/* Drops the cached copy of @table after it was written to */
+void
+forget_permission_table (const char *table)
+{
+  if (permission_table_cache != NULL)
+    g_hash_table_remove (permission_table_cache, table);
+}
+
 /*** column handling ***/
 
 static gboolean
@@ -1357,6 +1553,7 @@ FlatpakRemoteState *
 get_remote_state (FlatpakDir   *dir,
                   const char   *remote,
                   gboolean      cached,
+                  gboolean      stale_ok,
                   gboolean      only_sideloaded,
                   const char   *opt_arch,
                   const char  **opt_sideload_repos,
@@ -1372,6 +1569,12 @@ get_remote_state (FlatpakDir   *dir,
       if (state == NULL)
         return NULL;
     }
+  else if (!cached && stale_ok)
+    {
+      state = flatpak_dir_get_remote_state_stale_ok (dir, remote, cancellable, error);
+      if (state == NULL)
+        return NULL;
+    }
   else
     {
       state = flatpak_dir_get_remote_state_optional (dir, remote, cached, cancellable, &local_error);
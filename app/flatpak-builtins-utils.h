@@ -115,6 +115,18 @@ gboolean update_appstream (GPtrArray    *dirs,
                            GError      **error);
 
 char ** get_permission_tables (XdpDbusPermissionStore *store);
+
+typedef struct {
+  char     *id;
+  GVariant *permissions; /* a{sas} */
+  GVariant *data;        /* v */
+} PermissionStoreEntry;
+
+GPtrArray * lookup_permission_table (XdpDbusPermissionStore *store,
+                                     const char             *table,
+                                     const char * const     *ids,
+                                     GError                **error);
+void forget_permission_table (const char *table);
 gboolean reset_permissions_for_app (const char *app_id,
                                     GError    **error);
 
@@ -187,6 +199,7 @@ void print_wrapped (int         columns,
 FlatpakRemoteState * get_remote_state (FlatpakDir   *dir,
                                        const char   *remote,
                                        gboolean      cached,
+                                       gboolean      stale_ok,
                                        gboolean      only_sideloaded,
                                        const char   *opt_arch,
                                        const char  **opt_sideload_repos,
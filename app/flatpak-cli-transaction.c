@@ -1681,6 +1681,7 @@ flatpak_cli_transaction_new (FlatpakDir *dir,
   self->non_default_arch = non_default_arch;
 
   flatpak_transaction_set_no_interaction (FLATPAK_TRANSACTION (self), disable_interaction);
+  flatpak_transaction_set_prepare_launches (FLATPAK_TRANSACTION (self), TRUE);
   flatpak_transaction_add_default_dependency_sources (FLATPAK_TRANSACTION (self));
 
   return (FlatpakTransaction *) g_steal_pointer (&self);
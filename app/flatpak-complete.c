@@ -20,6 +20,8 @@
 
 #include "config.h"
 
+#include <sys/stat.h>
+
 #include "flatpak-complete.h"
 #include "flatpak-installation.h"
 #include "flatpak-utils-private.h"
@@ -191,6 +193,148 @@ find_current_element (const char *str)
   return count;
 }
 
+/* Completing the refs of a remote needs its summary, and loading and
+ * parsing that on every key press is slow for large remotes. So the refs
+ * that were found are kept in a small cache file, which is valid for as
+ * long as the summary cache and the repo config are unchanged. Installed
+ * refs don't need this, they come from the index of deployed refs. */
+#define COMPLETION_CACHE_FORMAT "(sas)"
+
+static char *
+get_completion_cache_path (FlatpakDir *dir,
+                           const char *remote,
+                           const char *arch)
+{
+  g_autofree char *key = g_strconcat (flatpak_file_get_path_cached (flatpak_dir_get_path (dir)), "\n",
+                                      remote, "\n", arch ? arch : "", NULL);
+  g_autofree char *checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+
+  return g_build_filename (g_get_user_cache_dir (), "flatpak", "completion", checksum, NULL);
+}
+
+static char *
+get_completion_cache_stamp (FlatpakDir *dir)
+{
+  g_autoptr(GFile) summaries = g_file_get_child (flatpak_dir_get_cache_dir (dir), "summaries");
+  g_autoptr(GFile) config = flatpak_build_file (flatpak_dir_get_path (dir), "repo", "config", NULL);
+  g_autoptr(GString) stamp = g_string_new ("");
+  GFile *files[] = { summaries, config };
+
+  for (gsize i = 0; i < G_N_ELEMENTS (files); i++)
+    {
+      struct stat stbuf;
+
+      if (stat (flatpak_file_get_path_cached (files[i]), &stbuf) != 0)
+        g_string_append (stamp, "none;");
+      else
+        g_string_append_printf (stamp, "%" G_GINT64_FORMAT ".%ld:%" G_GUINT64_FORMAT ";",
+                                (gint64) stbuf.st_mtim.tv_sec, (long) stbuf.st_mtim.tv_nsec,
+                                (guint64) stbuf.st_ino);
+    }
+
+  return g_string_free (g_steal_pointer (&stamp), FALSE);
+}
+
+static GPtrArray *
+load_cached_remote_refs (const char *path,
+                         const char *stamp)
+{
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GVariant) cached_refs = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+  const char *cached_stamp;
+  gsize n_refs;
+
+  mfile = g_mapped_file_new (path, FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  cache = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (COMPLETION_CACHE_FORMAT),
+                                                        bytes, FALSE));
+
+  g_variant_get (cache, "(&s@as)", &cached_stamp, &cached_refs);
+  if (strcmp (cached_stamp, stamp) != 0)
+    return NULL;
+
+  n_refs = g_variant_n_children (cached_refs);
+  refs = g_ptr_array_new_full (n_refs, (GDestroyNotify) flatpak_decomposed_unref);
+  for (gsize i = 0; i < n_refs; i++)
+    {
+      const char *ref_str;
+      FlatpakDecomposed *ref;
+
+      g_variant_get_child (cached_refs, i, "&s", &ref_str);
+      ref = flatpak_decomposed_new_from_ref (ref_str, NULL);
+      if (ref != NULL)
+        g_ptr_array_add (refs, ref);
+    }
+
+  return g_steal_pointer (&refs);
+}
+
+static void
+save_cached_remote_refs (const char *path,
+                         const char *stamp,
+                         GPtrArray  *refs)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE_STRING_ARRAY);
+  g_autoptr(GVariant) cache = NULL;
+  g_autofree char *dir = g_path_get_dirname (path);
+
+  for (guint i = 0; i < refs->len; i++)
+    g_variant_builder_add (&builder, "s", flatpak_decomposed_get_ref (g_ptr_array_index (refs, i)));
+
+  cache = g_variant_ref_sink (g_variant_new (COMPLETION_CACHE_FORMAT, stamp, &builder));
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    return;
+
+  if (!g_file_set_contents (path, g_variant_get_data (cache), g_variant_get_size (cache), NULL))
+    flatpak_completion_debug ("failed to save completion cache %s", path);
+}
+
+/* Returns all the refs of @remote for @arch, from the completion cache if possible */
+static GPtrArray *
+find_remote_refs_for_completion (FlatpakDir  *dir,
+                                 const char  *remote,
+                                 const char  *arch,
+                                 GError     **error)
+{
+  g_autofree char *cache_path = get_completion_cache_path (dir, remote, arch);
+  g_autofree char *stamp = get_completion_cache_stamp (dir);
+  g_autoptr(FlatpakRemoteState) state = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+
+  refs = load_cached_remote_refs (cache_path, stamp);
+  if (refs != NULL)
+    return g_steal_pointer (&refs);
+
+  state = get_remote_state (dir, remote, TRUE, FALSE, FALSE, arch, NULL, NULL, error);
+  if (state == NULL)
+    return NULL;
+
+  refs = flatpak_dir_find_remote_refs (dir, state,
+                                       NULL, /* name */
+                                       NULL, /* branch */
+                                       NULL, /* default branch */
+                                       arch,
+                                       NULL, /* default arch */
+                                       FLATPAK_KINDS_APP | FLATPAK_KINDS_RUNTIME,
+                                       FIND_MATCHING_REFS_FLAGS_NONE,
+                                       NULL, error);
+  if (refs == NULL)
+    return NULL;
+
+  /* Computed before loading the summary, so a concurrent update just
+   * makes the cache look stale next time */
+  save_cached_remote_refs (cache_path, stamp, refs);
+
+  return g_steal_pointer (&refs);
+}
+
 void
 flatpak_complete_partial_ref (FlatpakCompletion *completion,
                               FlatpakKinds       kinds,
@@ -224,19 +368,9 @@ flatpak_complete_partial_ref (FlatpakCompletion *completion,
 
   if (remote)
     {
-      g_autoptr(FlatpakRemoteState) state = get_remote_state (dir, remote, TRUE, FALSE,
-                                                              (element > 2) ? arch : only_arch, NULL,
-                                                              NULL, &error);
-      if (state != NULL)
-        refs = flatpak_dir_find_remote_refs (dir, state,
-                                             (element > 1) ? id : NULL,
-                                             NULL, /* branch */
-                                             NULL, /* default branch */
-                                             (element > 2) ? arch : only_arch,
-                                             NULL, /* default arch */
-                                             matched_kinds,
-                                             FIND_MATCHING_REFS_FLAGS_NONE,
-                                             NULL, &error);
+      refs = find_remote_refs_for_completion (dir, remote,
+                                              (element > 2) ? arch : only_arch,
+                                              &error);
     }
   else
     {
@@ -258,6 +392,11 @@ flatpak_complete_partial_ref (FlatpakCompletion *completion,
       g_autoptr(GString) comp = NULL;
       g_auto(GStrv) parts = g_strsplit (flatpak_decomposed_get_ref (ref), "/", 0);
 
+      /* The cached remote refs aren't filtered yet */
+      if ((flatpak_decomposed_get_kinds (ref) & matched_kinds) == 0 ||
+          (element > 1 && !flatpak_decomposed_is_id (ref, id)))
+        continue;
+
       if (!g_str_has_prefix (parts[element], cur_parts[element]))
         continue;
 
@@ -980,5 +980,8 @@ main (int    argc,
       g_printerr ("%s%s %s%s\n", prefix, _("error:"), suffix, error->message);
     }
 
+  /* Let summary refreshes for stale-ok queries finish after the output */
+  flatpak_dir_wait_background_refreshes ();
+
   return ret;
 }
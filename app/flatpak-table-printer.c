@@ -27,6 +27,7 @@
 #include "flatpak-tty-utils-private.h"
 #include "flatpak-utils-private.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -93,6 +94,9 @@ struct FlatpakTablePrinter
   char      *key;
   GPtrArray *current;
   int        n_columns;
+  gboolean   streaming;
+  gboolean   json_lines;
+  int        n_streamed;
 };
 
 FlatpakTablePrinter *
@@ -283,6 +287,32 @@ flatpak_table_printer_append_with_comma_printf (FlatpakTablePrinter *printer,
   flatpak_table_printer_append_with_comma (printer, s);
 }
 
+/* When streaming is enabled and the output is not fancy, rows are
+ * printed as soon as they are finished rather than collected until
+ * flatpak_table_printer_print(), so that consumers of a pipe see results
+ * right away. The caller must still call flatpak_table_printer_print()
+ * (or flatpak_table_printer_print_json_lines() in JSON lines mode) at
+ * the end, and must not use the JSON output or set cells in earlier rows.
+ */
+void
+flatpak_table_printer_set_streaming (FlatpakTablePrinter *printer,
+                                     gboolean             streaming)
+{
+  printer->streaming = streaming;
+}
+
+/* In JSON lines mode each row is written as a compact JSON object on a
+ * line of its own, see flatpak_table_printer_print_json_lines(). As that
+ * doesn't need a layout, a streaming printer then writes out every row as
+ * soon as it is finished, even on a terminal.
+ */
+void
+flatpak_table_printer_set_json_lines (FlatpakTablePrinter *printer,
+                                      gboolean             json_lines)
+{
+  printer->json_lines = json_lines;
+}
+
 void
 flatpak_table_printer_set_key (FlatpakTablePrinter *printer, const char *key)
 {
@@ -325,6 +355,74 @@ flatpak_table_printer_lookup_row (FlatpakTablePrinter *printer, const char *key)
   return -1;
 }
 
+/* Rows can only be written out as they are finished if nothing about
+ * the final layout depends on later rows, i.e. for JSON lines and for
+ * the plain tab separated output without any skip-unique columns.
+ */
+static gboolean
+printer_can_stream (FlatpakTablePrinter *printer)
+{
+  int i;
+
+  if (!printer->streaming)
+    return FALSE;
+
+  if (printer->json_lines)
+    return TRUE;
+
+  if (flatpak_fancy_output ())
+    return FALSE;
+
+  for (i = 0; i < printer->columns->len; i++)
+    {
+      TableColumn *col = g_ptr_array_index (printer->columns, i);
+
+      if (col && col->skip_unique)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void print_json_line (FlatpakTablePrinter *printer,
+                             GPtrArray           *cells);
+
+static void
+stream_current_row (FlatpakTablePrinter *printer)
+{
+  g_autoptr(GString) row_s = g_string_new ("");
+  int j;
+
+  if (printer->json_lines)
+    {
+      print_json_line (printer, printer->current);
+      fflush (stdout);
+
+      printer->n_streamed++;
+      g_ptr_array_set_size (printer->current, 0);
+      g_clear_pointer (&printer->key, g_free);
+      return;
+    }
+
+  if (printer->n_streamed > 0)
+    g_print ("\n");
+
+  for (j = 0; j < printer->current->len; j++)
+    {
+      Cell *cell = g_ptr_array_index (printer->current, j);
+
+      g_string_append_printf (row_s, "%s%s", cell->text, (j < printer->current->len - 1) ? "\t" : "");
+    }
+
+  g_strchomp (row_s->str);
+  g_print ("%s", row_s->str);
+  fflush (stdout);
+
+  printer->n_streamed++;
+  g_ptr_array_set_size (printer->current, 0);
+  g_clear_pointer (&printer->key, g_free);
+}
+
 void
 flatpak_table_printer_finish_row (FlatpakTablePrinter *printer)
 {
@@ -334,6 +432,12 @@ flatpak_table_printer_finish_row (FlatpakTablePrinter *printer)
   if (printer->current->len == 0)
     return; /* Ignore empty rows */
 
+  if (printer->rows->len == 0 && printer_can_stream (printer))
+    {
+      stream_current_row (printer);
+      return;
+    }
+
   printer->n_columns = MAX (printer->n_columns, printer->current->len);
   row = g_new0 (Row, 1);
   row->cells = g_steal_pointer (&printer->current);
@@ -725,6 +829,37 @@ flatpak_table_printer_print (FlatpakTablePrinter *printer)
   g_print ("\n");
 }
 
+static JsonObject *
+cells_to_json_object (FlatpakTablePrinter *printer,
+                      GPtrArray           *cells)
+{
+  g_autoptr(JsonObject) json_object = json_object_new ();
+
+  for (size_t j = 0; j < cells->len; j++)
+    {
+      Cell *cell = g_ptr_array_index (cells, j);
+      TableColumn *col = peek_table_column (printer, j);
+      const char *title = col && col->title ? col->title : "";
+      g_autofree gchar *normalized_title = g_ascii_strdown (title, -1);
+      g_strdelimit (normalized_title, " ", '_');
+      json_object_set_string_member (json_object, normalized_title, cell->text);
+    }
+
+  return g_steal_pointer (&json_object);
+}
+
+static void
+print_json_line (FlatpakTablePrinter *printer,
+                 GPtrArray           *cells)
+{
+  g_autoptr(JsonNode) node = json_node_new (JSON_NODE_OBJECT);
+  g_autofree gchar *json_string = NULL;
+
+  json_node_take_object (node, cells_to_json_object (printer, cells));
+  json_string = json_to_string (node, FALSE);
+  g_print ("%s\n", json_string);
+}
+
 void
 flatpak_table_printer_print_json (FlatpakTablePrinter *printer)
 {
@@ -734,20 +869,9 @@ flatpak_table_printer_print_json (FlatpakTablePrinter *printer)
 
   for (size_t i = 0; i < printer->rows->len; i++)
     {
-      g_autoptr(JsonObject) json_object = json_object_new ();
       Row *row = g_ptr_array_index (printer->rows, i);
-      
-      for (size_t j = 0; j < row->cells->len; j++)
-        {
-          Cell *cell = g_ptr_array_index (row->cells, j);
-          TableColumn *col = peek_table_column (printer, j);
-          const char *title = col && col->title ? col->title : "";
-          g_autofree gchar *normalized_title = g_ascii_strdown (title, -1);
-          g_strdelimit (normalized_title, " ", '_');
-          json_object_set_string_member (json_object, normalized_title, cell->text);
-        }
-      
-      json_array_add_object_element (json_array, g_steal_pointer (&json_object));
+
+      json_array_add_object_element (json_array, cells_to_json_object (printer, row->cells));
     }
 
   root_node = json_node_new (JSON_NODE_ARRAY);
@@ -757,10 +881,22 @@ flatpak_table_printer_print_json (FlatpakTablePrinter *printer)
   g_print ("%s\n", json_string);
 }
 
+/* Prints the rows that were not streamed yet, one JSON object per line */
+void
+flatpak_table_printer_print_json_lines (FlatpakTablePrinter *printer)
+{
+  for (size_t i = 0; i < printer->rows->len; i++)
+    {
+      Row *row = g_ptr_array_index (printer->rows, i);
+
+      print_json_line (printer, row->cells);
+    }
+}
+
 int
 flatpak_table_printer_get_current_row (FlatpakTablePrinter *printer)
 {
-  return printer->rows->len;
+  return printer->n_streamed + printer->rows->len;
 }
 
 static void
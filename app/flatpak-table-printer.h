@@ -54,6 +54,10 @@ void                flatpak_table_printer_append_with_comma (FlatpakTablePrinter
 void                flatpak_table_printer_append_with_comma_printf (FlatpakTablePrinter *printer,
                                                                     const char          *format,
                                                                     ...) G_GNUC_PRINTF (2, 3);
+void                flatpak_table_printer_set_streaming (FlatpakTablePrinter *printer,
+                                                         gboolean             streaming);
+void                flatpak_table_printer_set_json_lines (FlatpakTablePrinter *printer,
+                                                          gboolean             json_lines);
 void                flatpak_table_printer_set_key (FlatpakTablePrinter *printer,
                                                    const char          *key);
 void                flatpak_table_printer_finish_row (FlatpakTablePrinter *printer);
@@ -62,6 +66,7 @@ void                flatpak_table_printer_sort (FlatpakTablePrinter *printer,
 int                 flatpak_table_printer_lookup_row (FlatpakTablePrinter *printer, const char *key);
 void                flatpak_table_printer_print (FlatpakTablePrinter *printer);
 void                flatpak_table_printer_print_json (FlatpakTablePrinter *printer);
+void                flatpak_table_printer_print_json_lines (FlatpakTablePrinter *printer);
 void                flatpak_table_printer_print_full (FlatpakTablePrinter *printer,
                                                       int                  skip,
                                                       int                  columns,
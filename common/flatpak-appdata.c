@@ -47,6 +47,15 @@ typedef struct
   char      *lang;
   guint64    timestamp;
   const char *id;  /* interned */
+
+  /* The ids of the component we're looking for */
+  const char *app_id;
+  char       *legacy_id;
+  /* Set once the current component has an id that isn't one of the above,
+   * so the rest of it is ignored */
+  gboolean    skip_component;
+  /* Set when the matching component has been parsed completely */
+  gboolean    found;
 } ParserData;
 
 static void
@@ -82,6 +91,7 @@ parser_data_free (ParserData *data)
   g_ptr_array_unref (data->components);
   g_string_free (data->text, TRUE);
   g_free (data->lang);
+  g_free (data->legacy_id);
 
   g_free (data);
 }
@@ -89,16 +99,26 @@ parser_data_free (ParserData *data)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (ParserData, parser_data_free)
 
 static ParserData *
-parser_data_new (void)
+parser_data_new (const char *app_id)
 {
   ParserData *data = g_new0 (ParserData, 1);
 
   data->components = g_ptr_array_new_with_free_func (component_free);
   data->text = g_string_new ("");
+  data->app_id = app_id;
+  data->legacy_id = g_strconcat (app_id, ".desktop", NULL);
 
   return data;
 }
 
+static gboolean
+component_id_matches (ParserData *data,
+                      const char *id)
+{
+  return id != NULL && (g_str_equal (id, data->app_id) ||
+                        g_str_equal (id, data->legacy_id));
+}
+
 static void
 start_element (GMarkupParseContext *context,
                const char          *element_name,
@@ -115,6 +135,12 @@ start_element (GMarkupParseContext *context,
   if (g_str_equal (element_name, "component"))
     {
       g_ptr_array_add (data->components, component_new ());
+      data->skip_component = FALSE;
+      data->timestamp = 0;
+    }
+  else if (data->skip_component)
+    {
+      /* Not the component we're looking for */
     }
   else if (g_str_equal (element_name, "id"))
     {
@@ -282,9 +308,9 @@ end_element (GMarkupParseContext *context,
   if (elements->next)
     parent = (const char *) elements->next->data;
 
-  g_assert (data->components->len > 0);
-
-  component = g_ptr_array_index (data->components, data->components->len - 1);
+  /* Components that don't match are dropped, so this is NULL after them */
+  if (data->components->len > 0)
+    component = g_ptr_array_index (data->components, data->components->len - 1);
 
   if (data->in_text)
     {
@@ -293,12 +319,31 @@ end_element (GMarkupParseContext *context,
       data->in_text = FALSE;
     }
 
+  if (g_str_equal (element_name, "component"))
+    {
+      if (component_id_matches (data, component->id))
+        {
+          /* We have everything we need, so stop parsing by returning an error */
+          data->found = TRUE;
+          g_set_error_literal (error, G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT,
+                               "Found matching component");
+        }
+      else
+        g_ptr_array_set_size (data->components, data->components->len - 1);
+    }
+  else if (data->skip_component)
+    {
+      /* Not the component we're looking for */
+    }
   /* avoid picking up <id> elements from e.g. <provides> */
-  if (g_str_equal (element_name, "id"))
+  else if (g_str_equal (element_name, "id"))
     {
       g_assert (parent != NULL);
       if (g_str_equal (parent, "component"))
-        component->id = g_steal_pointer (&text);
+        {
+          component->id = g_steal_pointer (&text);
+          data->skip_component = !component_id_matches (data, component->id);
+        }
     }
   else if (!data->in_developer && g_str_equal (element_name, "name"))
     {
@@ -359,27 +404,24 @@ flatpak_parse_appdata (const char  *appdata_xml,
     NULL,
     NULL
   };
-  g_autoptr(ParserData) data = parser_data_new ();
+  g_autoptr(ParserData) data = parser_data_new (app_id);
   g_autoptr(GError) error = NULL;
   int i;
-  g_autofree char *legacy_id = NULL;
 
   context = g_markup_parse_context_new (&parser, G_MARKUP_TREAT_CDATA_AS_TEXT, data, NULL);
 
-  if (!g_markup_parse_context_parse (context, appdata_xml, -1, &error))
+  /* The parser stops with an error as soon as the matching component is found */
+  if (!g_markup_parse_context_parse (context, appdata_xml, -1, &error) && !data->found)
     {
       g_warning ("Failed to parse appdata: %s", error->message);
       return FALSE;
     }
 
-  legacy_id = g_strconcat (app_id, ".desktop", NULL);
-
   for (i = 0; i < data->components->len; i++)
     {
       Component *component = g_ptr_array_index (data->components, i);
 
-      if (g_str_equal (component->id, app_id) ||
-          g_str_equal (component->id, legacy_id))
+      if (component_id_matches (data, component->id))
         {
           *names = g_hash_table_ref (component->names);
           *comments = g_hash_table_ref (component->comments);
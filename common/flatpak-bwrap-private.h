@@ -23,12 +23,14 @@
 
 typedef struct
 {
-  GPtrArray *argv;
+  GPtrArray *argv; /* Strings owned by arg_chunk */
+  GStringChunk *arg_chunk;
   GArray    *noinherit_fds; /* Just keep these open while the bwrap lives */
   GArray    *fds;
   GStrv      envp;
   GPtrArray *runtime_dir_members;
   int        sync_fds[2];
+  gboolean   sync_pending; /* A helper will write to sync_fds[1] once ready */
 } FlatpakBwrap;
 
 extern char *flatpak_bwrap_empty_env[1];
@@ -78,6 +80,12 @@ gboolean      flatpak_bwrap_add_args_data (FlatpakBwrap *bwrap,
                                            gssize        content_size,
                                            const char   *path,
                                            GError      **error);
+gboolean      flatpak_bwrap_add_args_static_data (FlatpakBwrap *bwrap,
+                                                  const char   *name,
+                                                  const char   *content,
+                                                  gssize        content_size,
+                                                  const char   *path,
+                                                  GError      **error);
 void          flatpak_bwrap_add_bind_arg (FlatpakBwrap *bwrap,
                                           const char   *type,
                                           const char   *src,
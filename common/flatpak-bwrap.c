@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
@@ -49,7 +50,10 @@ flatpak_bwrap_new (char **env)
 {
   FlatpakBwrap *bwrap = g_new0 (FlatpakBwrap, 1);
 
-  bwrap->argv = g_ptr_array_new_with_free_func (g_free);
+  /* A launch adds several hundred arguments, so they are allocated from
+   * a chunk rather than individually, and freed all at once */
+  bwrap->argv = g_ptr_array_sized_new (256);
+  bwrap->arg_chunk = g_string_chunk_new (4096);
   bwrap->noinherit_fds = g_array_new (FALSE, TRUE, sizeof (int));
   g_array_set_clear_func (bwrap->noinherit_fds, (GDestroyNotify) glnx_close_fd);
   bwrap->fds = g_array_new (FALSE, TRUE, sizeof (int));
@@ -70,6 +74,7 @@ void
 flatpak_bwrap_free (FlatpakBwrap *bwrap)
 {
   g_ptr_array_unref (bwrap->argv);
+  g_string_chunk_free (bwrap->arg_chunk);
   g_array_unref (bwrap->noinherit_fds);
   g_array_unref (bwrap->fds);
   g_strfreev (bwrap->envp);
@@ -102,7 +107,7 @@ flatpak_bwrap_unset_env (FlatpakBwrap *bwrap,
 void
 flatpak_bwrap_add_arg (FlatpakBwrap *bwrap, const char *arg)
 {
-  g_ptr_array_add (bwrap->argv, g_strdup (arg));
+  g_ptr_array_add (bwrap->argv, g_string_chunk_insert (bwrap->arg_chunk, arg));
 }
 
 /*
@@ -114,7 +119,8 @@ flatpak_bwrap_add_arg (FlatpakBwrap *bwrap, const char *arg)
 void
 flatpak_bwrap_take_arg (FlatpakBwrap *bwrap, char *arg)
 {
-  g_ptr_array_add (bwrap->argv, arg);
+  flatpak_bwrap_add_arg (bwrap, arg);
+  g_free (arg);
 }
 
 void
@@ -161,9 +167,19 @@ void
 flatpak_bwrap_add_arg_printf (FlatpakBwrap *bwrap, const char *format, ...)
 {
   va_list args;
+  va_list args_copy;
+  char buf[128];
+  int len;
 
+  /* Most of these are short, so try to avoid the temporary allocation */
   va_start (args, format);
-  g_ptr_array_add (bwrap->argv, g_strdup_vprintf (format, args));
+  va_copy (args_copy, args);
+  len = g_vsnprintf (buf, sizeof (buf), format, args);
+  if (len >= 0 && (gsize) len < sizeof (buf))
+    flatpak_bwrap_add_arg (bwrap, buf);
+  else
+    flatpak_bwrap_take_arg (bwrap, g_strdup_vprintf (format, args_copy));
+  va_end (args_copy);
   va_end (args);
 }
 void
@@ -189,7 +205,7 @@ flatpak_bwrap_append_argsv (FlatpakBwrap *bwrap,
     len = g_strv_length (args);
 
   for (i = 0; i < len; i++)
-    g_ptr_array_add (bwrap->argv, g_strdup (args[i]));
+    flatpak_bwrap_add_arg (bwrap, args[i]);
 }
 
 void
@@ -288,6 +304,59 @@ flatpak_bwrap_add_args_data (FlatpakBwrap *bwrap,
   return TRUE;
 }
 
+/* Like flatpak_bwrap_add_args_data(), for content that is the same for
+ * most launches, such as the passwd file. It's kept on tmpfs under
+ * $XDG_RUNTIME_DIR/.flatpak-data by checksum, so that later launches
+ * only have to open it rather than set up a new memfd. */
+gboolean
+flatpak_bwrap_add_args_static_data (FlatpakBwrap *bwrap,
+                                    const char   *name,
+                                    const char   *content,
+                                    gssize        content_size,
+                                    const char   *path,
+                                    GError      **error)
+{
+  g_autofree char *user_runtime_dir = flatpak_get_real_xdg_runtime_dir ();
+  g_autofree char *data_dir = g_build_filename (user_runtime_dir, ".flatpak-data", NULL);
+  g_autofree char *checksum = NULL;
+  glnx_autofd int dfd = -1;
+  glnx_autofd int fd = -1;
+  struct stat stbuf;
+
+  if (content_size == -1)
+    content_size = strlen (content);
+
+  checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guchar *) content, content_size);
+
+  if (glnx_shutil_mkdir_p_at (AT_FDCWD, data_dir, 0700, NULL, NULL) &&
+      glnx_opendirat (AT_FDCWD, data_dir, TRUE, &dfd, NULL))
+    {
+      fd = openat (dfd, checksum, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+      if (fd < 0 && errno == ENOENT &&
+          glnx_file_replace_contents_with_perms_at (dfd, checksum,
+                                                    (const guint8 *) content, content_size,
+                                                    0600, (uid_t) -1, (gid_t) -1,
+                                                    GLNX_FILE_REPLACE_NODATASYNC,
+                                                    NULL, NULL))
+        fd = openat (dfd, checksum, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+
+      /* Only use what we could have written ourselves */
+      if (fd >= 0 &&
+          (fstat (fd, &stbuf) != 0 ||
+           !S_ISREG (stbuf.st_mode) ||
+           stbuf.st_uid != getuid () ||
+           (stbuf.st_mode & 0077) != 0 ||
+           stbuf.st_size != content_size))
+        glnx_close_fd (&fd);
+    }
+
+  if (fd < 0)
+    return flatpak_bwrap_add_args_data (bwrap, name, content, content_size, path, error);
+
+  flatpak_bwrap_add_args_data_fd (bwrap, "--ro-bind-data", g_steal_fd (&fd), path);
+  return TRUE;
+}
+
 /* This resolves the target here rather than in bwrap, because it may
  * not resolve in bwrap setup due to absolute symlinks conflicting
  * with /newroot root. For example, dest could be inside
@@ -365,25 +434,24 @@ flatpak_bwrap_bundle_args (FlatpakBwrap *bwrap,
                            gboolean      one_arg,
                            GError      **error)
 {
-  g_autofree gchar *data = NULL;
-  gchar *ptr;
+  g_autofree struct iovec *iov = NULL;
   gint i;
-  gsize data_len = 0;
   int fd;
   g_auto(GLnxTmpfile) args_tmpf  = { 0, };
 
   if (end == -1)
     end = bwrap->argv->len;
 
+  /* Each argument, including its nul terminator, is written straight
+   * from the chunk */
+  iov = g_new (struct iovec, end - start);
   for (i = start; i < end; i++)
-    data_len +=  strlen (bwrap->argv->pdata[i]) + 1;
-
-  data = g_new (gchar, data_len);
-  ptr = data;
-  for (i = start; i < end; i++)
-    ptr = g_stpcpy (ptr, bwrap->argv->pdata[i]) + 1;
+    {
+      iov[i - start].iov_base = bwrap->argv->pdata[i];
+      iov[i - start].iov_len = strlen (bwrap->argv->pdata[i]) + 1;
+    }
 
-  if (!flatpak_buffer_to_sealed_memfd_or_tmpfile (&args_tmpf, "bwrap-args", data, data_len, error))
+  if (!flatpak_iovec_to_sealed_memfd_or_tmpfile (&args_tmpf, "bwrap-args", iov, end - start, error))
     return FALSE;
 
   fd = g_steal_fd (&args_tmpf.fd);
@@ -408,12 +476,16 @@ flatpak_bwrap_bundle_args (FlatpakBwrap *bwrap,
   g_ptr_array_remove_range (bwrap->argv, start, end - start);
   if (one_arg)
     {
-      g_ptr_array_insert (bwrap->argv, start, g_strdup_printf ("--args=%d", fd));
+      g_autofree char *arg = g_strdup_printf ("--args=%d", fd);
+
+      g_ptr_array_insert (bwrap->argv, start, g_string_chunk_insert (bwrap->arg_chunk, arg));
     }
   else
     {
-      g_ptr_array_insert (bwrap->argv, start, g_strdup ("--args"));
-      g_ptr_array_insert (bwrap->argv, start + 1, g_strdup_printf ("%d", fd));
+      g_autofree char *fd_str = g_strdup_printf ("%d", fd);
+
+      g_ptr_array_insert (bwrap->argv, start, g_string_chunk_insert (bwrap->arg_chunk, "--args"));
+      g_ptr_array_insert (bwrap->argv, start + 1, g_string_chunk_insert (bwrap->arg_chunk, fd_str));
     }
 
   return TRUE;
@@ -50,6 +50,8 @@ typedef enum {
   FLATPAK_RUN_FLAG_PARENT_EXPOSE_PIDS = (1 << 20),
   FLATPAK_RUN_FLAG_PARENT_SHARE_PIDS  = (1 << 21),
   FLATPAK_RUN_FLAG_CLEAR_ENV          = (1 << 22),
+  FLATPAK_RUN_FLAG_PREPARE_ONLY       = (1 << 23),
+  FLATPAK_RUN_FLAG_HEADLESS           = (1 << 24),
 } FlatpakRunFlags;
 
 typedef struct FlatpakDir             FlatpakDir;
@@ -59,5 +61,6 @@ typedef struct _FlatpakImageSource    FlatpakImageSource;
 typedef struct FlatpakOciRegistry     FlatpakOciRegistry;
 typedef struct _FlatpakOciManifest    FlatpakOciManifest;
 typedef struct _FlatpakOciImage       FlatpakOciImage;
+typedef struct _FlatpakFilter         FlatpakFilter;
 
 #endif /* __FLATPAK_COMMON_TYPES_H__ */
@@ -96,6 +96,7 @@ struct FlatpakContext
   GHashTable            *device_permissions;
   GHashTable            *features_permissions;
   GHashTable            *env_vars;
+  GHashTable            *resources;
   GHashTable            *persistent;
   GHashTable            *filesystems;
   GHashTable            *session_bus_policy;
@@ -134,6 +135,9 @@ gboolean       flatpak_context_load_metadata (FlatpakContext *context,
 void           flatpak_context_save_metadata (FlatpakContext *context,
                                               gboolean        flatten,
                                               GKeyFile       *metakey);
+GVariant *     flatpak_context_serialize (FlatpakContext *context);
+FlatpakContext *flatpak_context_deserialize (GVariant *variant,
+                                             GError  **error);
 void           flatpak_context_set_session_bus_policy (FlatpakContext *context,
                                                        const char     *name,
                                                        FlatpakPolicy   policy);
@@ -162,6 +166,8 @@ gboolean       flatpak_context_adds_permissions (FlatpakContext *old_context,
 
 void           flatpak_context_reset_permissions (FlatpakContext *context);
 void           flatpak_context_reset_non_permissions (FlatpakContext *context);
+void           flatpak_context_add_unit_properties (FlatpakContext  *context,
+                                                    GVariantBuilder *builder);
 void           flatpak_context_make_sandboxed (FlatpakContext *context);
 
 FlatpakContext *flatpak_context_load_for_deploy (FlatpakDeploy *deploy,
@@ -470,11 +470,13 @@ flatpak_permission_adds_permissions (FlatpakPermission *old,
   return FALSE;
 }
 
+/* Permission names are interned, they come from a small set of well-known
+ * names and are copied around a lot when merging layers */
 static GHashTable *
 flatpak_permissions_new (void)
 {
   return g_hash_table_new_full (g_str_hash, g_str_equal,
-                                (GDestroyNotify) g_free,
+                                NULL,
                                 (GDestroyNotify) flatpak_permission_free);
 }
 
@@ -494,7 +496,7 @@ flatpak_permissions_dup (GHashTable *old)
                                  (gpointer *) &old_permission))
     {
       g_hash_table_insert (new,
-                           g_strdup (name),
+                           (char *) name,
                            flatpak_permission_dup (old_permission));
     }
 
@@ -510,7 +512,7 @@ flatpak_permissions_ensure (GHashTable *permissions,
   if (permission == NULL)
     {
       permission = flatpak_permission_new ();
-      g_hash_table_insert (permissions, g_strdup (name), permission);
+      g_hash_table_insert (permissions, (char *) g_intern_string (name), permission);
     }
 
   return permission;
@@ -689,7 +691,7 @@ flatpak_permissions_merge (GHashTable *permissions,
       else
         {
           g_hash_table_insert (permissions,
-                               g_strdup (name),
+                               (char *) name,
                                flatpak_permission_dup (other_permission));
         }
     }
@@ -1181,12 +1183,16 @@ flatpak_context_new (void)
 
   context = g_slice_new0 (FlatpakContext);
   context->env_vars = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  /* resource key from flatpak_context_resources => value as a string,
+   * see flatpak_context_parse_resource() */
+  context->resources = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
   context->persistent = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  /* filename or special filesystem name => FlatpakFilesystemMode */
-  context->filesystems = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  context->session_bus_policy = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  context->system_bus_policy = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  context->a11y_bus_policy = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  /* filename or special filesystem name => FlatpakFilesystemMode,
+   * the keys of this and of the bus policies are interned strings */
+  context->filesystems = g_hash_table_new (g_str_hash, g_str_equal);
+  context->session_bus_policy = g_hash_table_new (g_str_hash, g_str_equal);
+  context->system_bus_policy = g_hash_table_new (g_str_hash, g_str_equal);
+  context->a11y_bus_policy = g_hash_table_new (g_str_hash, g_str_equal);
   context->generic_policy = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                    g_free, (GDestroyNotify) g_strfreev);
   context->enumerable_usb_devices = g_hash_table_new_full (g_str_hash, g_str_equal,
@@ -1205,6 +1211,7 @@ void
 flatpak_context_free (FlatpakContext *context)
 {
   g_hash_table_destroy (context->env_vars);
+  g_hash_table_destroy (context->resources);
   g_hash_table_destroy (context->persistent);
   g_hash_table_destroy (context->filesystems);
   g_hash_table_destroy (context->session_bus_policy);
@@ -1358,12 +1365,154 @@ flatpak_context_set_env_var (FlatpakContext *context,
   g_hash_table_insert (context->env_vars, g_strdup (name), g_strdup (value));
 }
 
+typedef struct
+{
+  const char *key;        /* In [Resources] and --resource */
+  const char *property;   /* The systemd unit property, see systemd.resource-control(5) */
+  guint64     min;
+  guint64     max;
+  gboolean    is_size;    /* Takes K, M, G and T suffixes, and "infinity" */
+} FlatpakResourceControl;
+
+static const FlatpakResourceControl flatpak_context_resources[] = {
+  { "cpu-weight", "CPUWeight", 1, 10000, FALSE },
+  { "io-weight", "IOWeight", 1, 10000, FALSE },
+  { "memory-high", "MemoryHigh", 0, G_MAXUINT64, TRUE },
+  { "memory-max", "MemoryMax", 0, G_MAXUINT64, TRUE },
+  { "tasks-max", "TasksMax", 1, G_MAXUINT64, FALSE },
+};
+
+static const FlatpakResourceControl *
+flatpak_context_find_resource (const char *key)
+{
+  for (gsize i = 0; i < G_N_ELEMENTS (flatpak_context_resources); i++)
+    {
+      if (strcmp (flatpak_context_resources[i].key, key) == 0)
+        return &flatpak_context_resources[i];
+    }
+
+  return NULL;
+}
+
+/* Parses @value for the resource @key, "infinity" is returned as
+ * G_MAXUINT64, which is also what systemd uses for it */
+static gboolean
+flatpak_context_parse_resource (const char                     *key,
+                                const char                     *value,
+                                const FlatpakResourceControl  **out_resource,
+                                guint64                        *out_value,
+                                GError                        **error)
+{
+  const FlatpakResourceControl *resource = flatpak_context_find_resource (key);
+  guint64 number;
+  char *end = NULL;
+
+  if (resource == NULL)
+    {
+      g_autoptr(GString) keys = g_string_new ("");
+
+      for (gsize i = 0; i < G_N_ELEMENTS (flatpak_context_resources); i++)
+        g_string_append_printf (keys, "%s%s", i > 0 ? ", " : "", flatpak_context_resources[i].key);
+
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   _("Unknown resource %s, valid resources are: %s"), key, keys->str);
+      return FALSE;
+    }
+
+  if (strcmp (value, "infinity") == 0 && resource->max == G_MAXUINT64)
+    number = G_MAXUINT64;
+  else
+    {
+      if (!g_ascii_isdigit (*value))
+        goto invalid;
+
+      number = g_ascii_strtoull (value, &end, 10);
+      if (resource->is_size && *end != 0 && end[1] == 0)
+        {
+          const char *suffixes = "KMGT";
+          const char *suffix = strchr (suffixes, g_ascii_toupper (*end));
+
+          if (suffix == NULL)
+            goto invalid;
+
+          for (gsize i = 0; i <= (gsize) (suffix - suffixes); i++)
+            {
+              if (number > G_MAXUINT64 / 1024)
+                goto invalid;
+              number *= 1024;
+            }
+        }
+      else if (*end != 0)
+        goto invalid;
+
+      if (number < resource->min || number > resource->max || number == G_MAXUINT64)
+        goto invalid;
+    }
+
+  if (out_resource)
+    *out_resource = resource;
+  if (out_value)
+    *out_value = number;
+
+  return TRUE;
+
+invalid:
+  g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+               _("Invalid value %s for resource %s"), value, key);
+  return FALSE;
+}
+
+static gboolean
+flatpak_context_set_resource (FlatpakContext *context,
+                              const char     *key,
+                              const char     *value,
+                              GError        **error)
+{
+  const FlatpakResourceControl *resource;
+  guint64 number;
+
+  if (!flatpak_context_parse_resource (key, value, &resource, &number, error))
+    return FALSE;
+
+  /* Keys are the static strings from flatpak_context_resources */
+  g_hash_table_insert (context->resources, (char *) resource->key,
+                       number == G_MAXUINT64 ? g_strdup ("infinity") :
+                       g_strdup_printf ("%" G_GUINT64_FORMAT, number));
+  return TRUE;
+}
+
+/*
+ * flatpak_context_add_unit_properties:
+ * @context: A context
+ * @builder: A builder for an `a(sv)`
+ *
+ * Adds the resource controls of @context as properties of a systemd
+ * transient unit.
+ */
+void
+flatpak_context_add_unit_properties (FlatpakContext  *context,
+                                     GVariantBuilder *builder)
+{
+  for (gsize i = 0; i < G_N_ELEMENTS (flatpak_context_resources); i++)
+    {
+      const FlatpakResourceControl *resource = &flatpak_context_resources[i];
+      const char *value = g_hash_table_lookup (context->resources, resource->key);
+      guint64 number;
+
+      if (value == NULL ||
+          !flatpak_context_parse_resource (resource->key, value, NULL, &number, NULL))
+        continue;
+
+      g_variant_builder_add (builder, "(sv)", resource->property, g_variant_new_uint64 (number));
+    }
+}
+
 void
 flatpak_context_set_session_bus_policy (FlatpakContext *context,
                                         const char     *name,
                                         FlatpakPolicy   policy)
 {
-  g_hash_table_insert (context->session_bus_policy, g_strdup (name), GINT_TO_POINTER (policy));
+  g_hash_table_insert (context->session_bus_policy, (char *) g_intern_string (name), GINT_TO_POINTER (policy));
 }
 
 void
@@ -1371,7 +1520,7 @@ flatpak_context_set_a11y_bus_policy (FlatpakContext *context,
                                      const char     *name,
                                      FlatpakPolicy   policy)
 {
-  g_hash_table_insert (context->a11y_bus_policy, g_strdup (name), GINT_TO_POINTER (policy));
+  g_hash_table_insert (context->a11y_bus_policy, (char *) g_intern_string (name), GINT_TO_POINTER (policy));
 }
 
 GStrv
@@ -1395,7 +1544,7 @@ flatpak_context_set_system_bus_policy (FlatpakContext *context,
                                        const char     *name,
                                        FlatpakPolicy   policy)
 {
-  g_hash_table_insert (context->system_bus_policy, g_strdup (name), GINT_TO_POINTER (policy));
+  g_hash_table_insert (context->system_bus_policy, (char *) g_intern_string (name), GINT_TO_POINTER (policy));
 }
 
 static void
@@ -1450,6 +1599,23 @@ flatpak_context_add_query_to (GHashTable            *queries,
                        g_steal_pointer (&copy));
 }
 
+/* The keys are the canonical printed form of the queries, so they can
+ * be reused as is, and queries that are already present are skipped
+ * without copying them. */
+static void
+flatpak_context_merge_queries (GHashTable *queries,
+                               GHashTable *other)
+{
+  GLNX_HASH_TABLE_FOREACH_KV (other, const char *, key, const FlatpakUsbQuery *, usb_query)
+    {
+      if (g_hash_table_contains (queries, key))
+        continue;
+
+      g_hash_table_insert (queries, g_strdup (key),
+                           flatpak_usb_query_copy (usb_query));
+    }
+}
+
 static void
 flatpak_context_add_usb_query (FlatpakContext        *context,
                                const FlatpakUsbQuery *usb_query)
@@ -1966,10 +2132,30 @@ flatpak_context_take_filesystem (FlatpakContext        *context,
   if (g_str_equal (fs, "host-reset"))
     {
       g_return_if_fail (mode == FLATPAK_FILESYSTEM_MODE_NONE);
-      g_hash_table_insert (context->filesystems, g_strdup ("host"), GINT_TO_POINTER (mode));
+      g_hash_table_insert (context->filesystems, (char *) g_intern_static_string ("host"), GINT_TO_POINTER (mode));
     }
 
-  g_hash_table_insert (context->filesystems, fs, GINT_TO_POINTER (mode));
+  g_hash_table_insert (context->filesystems, (char *) g_intern_string (fs), GINT_TO_POINTER (mode));
+  g_free (fs);
+}
+
+static gboolean
+flatpak_context_is_empty (FlatpakContext *context)
+{
+  return g_hash_table_size (context->shares_permissions) == 0 &&
+         g_hash_table_size (context->socket_permissions) == 0 &&
+         g_hash_table_size (context->device_permissions) == 0 &&
+         g_hash_table_size (context->features_permissions) == 0 &&
+         g_hash_table_size (context->env_vars) == 0 &&
+         g_hash_table_size (context->resources) == 0 &&
+         g_hash_table_size (context->persistent) == 0 &&
+         g_hash_table_size (context->filesystems) == 0 &&
+         g_hash_table_size (context->session_bus_policy) == 0 &&
+         g_hash_table_size (context->system_bus_policy) == 0 &&
+         g_hash_table_size (context->a11y_bus_policy) == 0 &&
+         g_hash_table_size (context->generic_policy) == 0 &&
+         g_hash_table_size (context->enumerable_usb_devices) == 0 &&
+         g_hash_table_size (context->hidden_usb_devices) == 0;
 }
 
 void
@@ -1979,6 +2165,11 @@ flatpak_context_merge (FlatpakContext *context,
   GHashTableIter iter;
   gpointer key, value;
 
+  /* Most override layers don't exist or are empty, don't bother
+   * walking all the tables for them */
+  if (flatpak_context_is_empty (other))
+    return;
+
   flatpak_permissions_merge (context->shares_permissions,
                              other->shares_permissions);
   flatpak_permissions_merge (context->socket_permissions,
@@ -1992,6 +2183,10 @@ flatpak_context_merge (FlatpakContext *context,
   while (g_hash_table_iter_next (&iter, &key, &value))
     g_hash_table_insert (context->env_vars, g_strdup (key), g_strdup (value));
 
+  g_hash_table_iter_init (&iter, other->resources);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (context->resources, key, g_strdup (value));
+
   g_hash_table_iter_init (&iter, other->persistent);
   while (g_hash_table_iter_next (&iter, &key, &value))
     g_hash_table_insert (context->persistent, g_strdup (key), value);
@@ -2006,19 +2201,19 @@ flatpak_context_merge (FlatpakContext *context,
   /* Then set the new ones, which includes propagating host:reset. */
   g_hash_table_iter_init (&iter, other->filesystems);
   while (g_hash_table_iter_next (&iter, &key, &value))
-    g_hash_table_insert (context->filesystems, g_strdup (key), value);
+    g_hash_table_insert (context->filesystems, key, value);
 
   g_hash_table_iter_init (&iter, other->session_bus_policy);
   while (g_hash_table_iter_next (&iter, &key, &value))
-    g_hash_table_insert (context->session_bus_policy, g_strdup (key), value);
+    g_hash_table_insert (context->session_bus_policy, key, value);
 
   g_hash_table_iter_init (&iter, other->system_bus_policy);
   while (g_hash_table_iter_next (&iter, &key, &value))
-    g_hash_table_insert (context->system_bus_policy, g_strdup (key), value);
+    g_hash_table_insert (context->system_bus_policy, key, value);
 
   g_hash_table_iter_init (&iter, other->a11y_bus_policy);
   while (g_hash_table_iter_next (&iter, &key, &value))
-    g_hash_table_insert (context->a11y_bus_policy, g_strdup (key), value);
+    g_hash_table_insert (context->a11y_bus_policy, key, value);
 
   g_hash_table_iter_init (&iter, other->generic_policy);
   while (g_hash_table_iter_next (&iter, &key, &value))
@@ -2030,13 +2225,10 @@ flatpak_context_merge (FlatpakContext *context,
         flatpak_context_apply_generic_policy (context, (char *) key, policy_values[i]);
     }
 
-  g_hash_table_iter_init (&iter, other->enumerable_usb_devices);
-  while (g_hash_table_iter_next (&iter, NULL, &value))
-    flatpak_context_add_usb_query (context, value);
-
-  g_hash_table_iter_init (&iter, other->hidden_usb_devices);
-  while (g_hash_table_iter_next (&iter, NULL, &value))
-    flatpak_context_add_nousb_query (context, value);
+  flatpak_context_merge_queries (context->enumerable_usb_devices,
+                                 other->enumerable_usb_devices);
+  flatpak_context_merge_queries (context->hidden_usb_devices,
+                                 other->hidden_usb_devices);
 }
 
 static gboolean
@@ -2362,6 +2554,25 @@ option_env_cb (const gchar *option_name,
   return TRUE;
 }
 
+static gboolean
+option_resource_cb (const gchar *option_name,
+                    const gchar *value,
+                    gpointer     data,
+                    GError     **error)
+{
+  FlatpakContext *context = data;
+  g_auto(GStrv) split = g_strsplit (value, "=", 2);
+
+  if (split == NULL || split[0] == NULL || split[0][0] == 0 || split[1] == NULL)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   _("Invalid resource format %s"), value);
+      return FALSE;
+    }
+
+  return flatpak_context_set_resource (context, split[0], split[1], error);
+}
+
 gboolean
 flatpak_context_parse_env_block (FlatpakContext *context,
                                  const char *data,
@@ -2710,6 +2921,7 @@ static GOptionEntry context_options[] = {
   { "env", 0, G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_CALLBACK, &option_env_cb, N_("Set environment variable"), N_("VAR=VALUE") },
   { "env-fd", 0, G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_CALLBACK, &option_env_fd_cb, N_("Read environment variables in env -0 format from FD"), N_("FD") },
   { "unset-env", 0, G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_CALLBACK, &option_unset_env_cb, N_("Remove variable from environment"), N_("VAR") },
+  { "resource", 0, G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_CALLBACK, &option_resource_cb, N_("Set a resource control for the app's cgroup"), N_("RESOURCE=VALUE") },
   { "own-name", 0, G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_CALLBACK, &option_own_name_cb, N_("Allow app to own name on the session bus"), N_("DBUS_NAME") },
   { "talk-name", 0, G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_CALLBACK, &option_talk_name_cb, N_("Allow app to talk to name on the session bus"), N_("DBUS_NAME") },
   { "no-talk-name", 0, G_OPTION_FLAG_IN_MAIN, G_OPTION_ARG_CALLBACK, &option_no_talk_name_cb, N_("Don't allow app to talk to name on the session bus"), N_("DBUS_NAME") },
@@ -2959,6 +3171,25 @@ flatpak_context_load_metadata (FlatpakContext *context,
         }
     }
 
+  if (g_key_file_has_group (metakey, FLATPAK_METADATA_GROUP_RESOURCES))
+    {
+      g_auto(GStrv) keys = NULL;
+      gsize keys_count;
+
+      keys = g_key_file_get_keys (metakey, FLATPAK_METADATA_GROUP_RESOURCES, &keys_count, NULL);
+      for (i = 0; i < keys_count; i++)
+        {
+          const char *key = keys[i];
+          g_autofree char *value = g_key_file_get_string (metakey, FLATPAK_METADATA_GROUP_RESOURCES, key, NULL);
+          g_autoptr(GError) local_error = NULL;
+
+          /* Ignore what we don't understand, for forward compatibility */
+          if (value != NULL &&
+              !flatpak_context_set_resource (context, key, value, &local_error))
+            g_info ("Ignoring resource control: %s", local_error->message);
+        }
+    }
+
   groups = g_key_file_get_groups (metakey, NULL);
   for (i = 0; groups[i] != NULL; i++)
     {
@@ -3286,6 +3517,12 @@ flatpak_context_save_metadata (FlatpakContext *context,
                              FLATPAK_METADATA_KEY_UNSET_ENVIRONMENT, NULL);
     }
 
+  g_key_file_remove_group (metakey, FLATPAK_METADATA_GROUP_RESOURCES, NULL);
+  g_hash_table_iter_init (&iter, context->resources);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_key_file_set_string (metakey, FLATPAK_METADATA_GROUP_RESOURCES,
+                           (char *) key, (char *) value);
+
   groups = g_key_file_get_groups (metakey, NULL);
   for (i = 0; groups[i] != NULL; i++)
     {
@@ -3328,6 +3565,302 @@ flatpak_context_save_metadata (FlatpakContext *context,
                                     FLATPAK_METADATA_KEY_USB_HIDDEN_DEVICES);
 }
 
+/* Version of the format produced by flatpak_context_serialize(), bump this
+ * whenever the layout of the sections below changes */
+#define FLATPAK_CONTEXT_SERIALIZED_VERSION 2
+
+static GVariant *
+flatpak_permissions_serialize_variant (GHashTable *permissions)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(sbbas)"));
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, permissions);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      FlatpakPermission *permission = value;
+
+      g_variant_builder_add (&builder, "(sbb@as)", (const char *) key,
+                             permission->allowed, permission->reset,
+                             g_variant_new_strv ((const char * const *) permission->conditionals->pdata,
+                                                 permission->conditionals->len));
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+static void
+flatpak_permissions_deserialize_variant (GHashTable *permissions,
+                                         GVariant   *variant)
+{
+  GVariantIter iter;
+  const char *name;
+  gboolean allowed, reset;
+  GVariantIter *conditionals;
+
+  g_variant_iter_init (&iter, variant);
+  while (g_variant_iter_next (&iter, "(&sbbas)", &name, &allowed, &reset, &conditionals))
+    {
+      FlatpakPermission *permission = flatpak_permissions_ensure (permissions, name);
+      const char *conditional;
+
+      permission->allowed = allowed;
+      permission->reset = reset;
+      g_ptr_array_set_size (permission->conditionals, 0);
+      while (g_variant_iter_next (conditionals, "&s", &conditional))
+        g_ptr_array_add (permission->conditionals, g_strdup (conditional));
+      g_ptr_array_sort (permission->conditionals, flatpak_strcmp0_ptr);
+
+      g_variant_iter_free (conditionals);
+    }
+}
+
+/* Serializes a table whose values are small integers, such as the
+ * filesystems or the bus policies */
+static GVariant *
+flatpak_context_serialize_int_table (GHashTable *table)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{su}"));
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, table);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&builder, "{su}", (const char *) key, (guint32) GPOINTER_TO_INT (value));
+
+  return g_variant_builder_end (&builder);
+}
+
+static void
+flatpak_context_deserialize_int_table (GHashTable *table,
+                                       GVariant   *variant)
+{
+  GVariantIter iter;
+  const char *key;
+  guint32 value;
+
+  g_variant_iter_init (&iter, variant);
+  while (g_variant_iter_next (&iter, "{&su}", &key, &value))
+    g_hash_table_insert (table, (char *) g_intern_string (key), GINT_TO_POINTER (value));
+}
+
+static GVariant *
+flatpak_context_serialize_usb_devices (GHashTable *devices)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE_STRING_ARRAY);
+  GHashTableIter iter;
+  gpointer key;
+
+  g_hash_table_iter_init (&iter, devices);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_variant_builder_add (&builder, "s", (const char *) key);
+
+  return g_variant_builder_end (&builder);
+}
+
+static gboolean
+flatpak_context_deserialize_usb_devices (GHashTable *devices,
+                                         GVariant   *variant,
+                                         GError    **error)
+{
+  GVariantIter iter;
+  const char *query_string;
+
+  g_variant_iter_init (&iter, variant);
+  while (g_variant_iter_next (&iter, "&s", &query_string))
+    {
+      g_autoptr(FlatpakUsbQuery) usb_query = NULL;
+
+      if (!flatpak_usb_parse_usb (query_string, &usb_query, error))
+        return FALSE;
+
+      flatpak_context_add_query_to (devices, usb_query);
+    }
+
+  return TRUE;
+}
+
+/*
+ * flatpak_context_serialize:
+ * @context: A context
+ *
+ * Returns a versioned binary representation of @context, which can be
+ * turned back into an identical context with flatpak_context_deserialize().
+ * Unlike flatpak_context_save_metadata() this keeps the internal state
+ * (reset flags, unset environment variables, ...) as is, so it is suitable
+ * for caching a computed context, but not for writing metadata files.
+ *
+ * Returns: (transfer full): a variant of type `(ua{sv})`
+ */
+GVariant *
+flatpak_context_serialize (FlatpakContext *context)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE_VARDICT);
+  g_auto(GVariantBuilder) env_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{sms}"));
+  g_auto(GVariantBuilder) resources_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{ss}"));
+  g_auto(GVariantBuilder) persistent_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE_STRING_ARRAY);
+  g_auto(GVariantBuilder) policy_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{sas}"));
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_add (&builder, "{sv}", "shared",
+                         flatpak_permissions_serialize_variant (context->shares_permissions));
+  g_variant_builder_add (&builder, "{sv}", "sockets",
+                         flatpak_permissions_serialize_variant (context->socket_permissions));
+  g_variant_builder_add (&builder, "{sv}", "devices",
+                         flatpak_permissions_serialize_variant (context->device_permissions));
+  g_variant_builder_add (&builder, "{sv}", "features",
+                         flatpak_permissions_serialize_variant (context->features_permissions));
+
+  g_hash_table_iter_init (&iter, context->env_vars);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&env_builder, "{sms}", (const char *) key, (const char *) value);
+  g_variant_builder_add (&builder, "{sv}", "environment", g_variant_builder_end (&env_builder));
+
+  g_hash_table_iter_init (&iter, context->resources);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&resources_builder, "{ss}", (const char *) key, (const char *) value);
+  g_variant_builder_add (&builder, "{sv}", "resources", g_variant_builder_end (&resources_builder));
+
+  g_hash_table_iter_init (&iter, context->persistent);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_variant_builder_add (&persistent_builder, "s", (const char *) key);
+  g_variant_builder_add (&builder, "{sv}", "persistent", g_variant_builder_end (&persistent_builder));
+
+  g_variant_builder_add (&builder, "{sv}", "filesystems",
+                         flatpak_context_serialize_int_table (context->filesystems));
+  g_variant_builder_add (&builder, "{sv}", "session-bus",
+                         flatpak_context_serialize_int_table (context->session_bus_policy));
+  g_variant_builder_add (&builder, "{sv}", "system-bus",
+                         flatpak_context_serialize_int_table (context->system_bus_policy));
+  g_variant_builder_add (&builder, "{sv}", "a11y-bus",
+                         flatpak_context_serialize_int_table (context->a11y_bus_policy));
+
+  g_hash_table_iter_init (&iter, context->generic_policy);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&policy_builder, "{s^as}", (const char *) key, (char **) value);
+  g_variant_builder_add (&builder, "{sv}", "policy", g_variant_builder_end (&policy_builder));
+
+  g_variant_builder_add (&builder, "{sv}", "usb",
+                         flatpak_context_serialize_usb_devices (context->enumerable_usb_devices));
+  g_variant_builder_add (&builder, "{sv}", "nousb",
+                         flatpak_context_serialize_usb_devices (context->hidden_usb_devices));
+
+  return g_variant_ref_sink (g_variant_new ("(u@a{sv})",
+                                            FLATPAK_CONTEXT_SERIALIZED_VERSION,
+                                            g_variant_builder_end (&builder)));
+}
+
+/*
+ * flatpak_context_deserialize:
+ * @variant: A variant returned by flatpak_context_serialize()
+ * @error: Used to report an error
+ *
+ * Reverses flatpak_context_serialize(). Data written by a different
+ * version of the format is rejected, the caller is expected to recompute
+ * the context from the metadata in that case.
+ *
+ * Returns: (transfer full): a new context, or %NULL on error
+ */
+FlatpakContext *
+flatpak_context_deserialize (GVariant *variant,
+                             GError  **error)
+{
+  g_autoptr(FlatpakContext) context = flatpak_context_new ();
+  g_autoptr(GVariant) dict = NULL;
+  g_autoptr(GVariant) section = NULL;
+  guint32 version;
+
+  if (!g_variant_is_of_type (variant, G_VARIANT_TYPE ("(ua{sv})")))
+    return glnx_null_throw (error, "Invalid serialized context of type %s",
+                            g_variant_get_type_string (variant));
+
+  g_variant_get (variant, "(u@a{sv})", &version, &dict);
+  if (version != FLATPAK_CONTEXT_SERIALIZED_VERSION)
+    return glnx_null_throw (error, "Unsupported serialized context version %u", version);
+
+#define LOOKUP_SECTION(name, type) \
+  (g_clear_pointer (&section, g_variant_unref), \
+   section = g_variant_lookup_value (dict, name, G_VARIANT_TYPE (type)), \
+   section != NULL)
+
+  if (LOOKUP_SECTION ("shared", "a(sbbas)"))
+    flatpak_permissions_deserialize_variant (context->shares_permissions, section);
+  if (LOOKUP_SECTION ("sockets", "a(sbbas)"))
+    flatpak_permissions_deserialize_variant (context->socket_permissions, section);
+  if (LOOKUP_SECTION ("devices", "a(sbbas)"))
+    flatpak_permissions_deserialize_variant (context->device_permissions, section);
+  if (LOOKUP_SECTION ("features", "a(sbbas)"))
+    flatpak_permissions_deserialize_variant (context->features_permissions, section);
+
+  if (LOOKUP_SECTION ("environment", "a{sms}"))
+    {
+      GVariantIter iter;
+      const char *key;
+      const char *value;
+
+      g_variant_iter_init (&iter, section);
+      while (g_variant_iter_next (&iter, "{&sm&s}", &key, &value))
+        g_hash_table_insert (context->env_vars, g_strdup (key), g_strdup (value));
+    }
+
+  if (LOOKUP_SECTION ("resources", "a{ss}"))
+    {
+      GVariantIter iter;
+      const char *key;
+      const char *value;
+
+      g_variant_iter_init (&iter, section);
+      while (g_variant_iter_next (&iter, "{&s&s}", &key, &value))
+        {
+          if (!flatpak_context_set_resource (context, key, value, error))
+            return NULL;
+        }
+    }
+
+  if (LOOKUP_SECTION ("persistent", "as"))
+    {
+      GVariantIter iter;
+      const char *key;
+
+      g_variant_iter_init (&iter, section);
+      while (g_variant_iter_next (&iter, "&s", &key))
+        g_hash_table_insert (context->persistent, g_strdup (key), GINT_TO_POINTER (1));
+    }
+
+  if (LOOKUP_SECTION ("filesystems", "a{su}"))
+    flatpak_context_deserialize_int_table (context->filesystems, section);
+  if (LOOKUP_SECTION ("session-bus", "a{su}"))
+    flatpak_context_deserialize_int_table (context->session_bus_policy, section);
+  if (LOOKUP_SECTION ("system-bus", "a{su}"))
+    flatpak_context_deserialize_int_table (context->system_bus_policy, section);
+  if (LOOKUP_SECTION ("a11y-bus", "a{su}"))
+    flatpak_context_deserialize_int_table (context->a11y_bus_policy, section);
+
+  if (LOOKUP_SECTION ("policy", "a{sas}"))
+    {
+      GVariantIter iter;
+      const char *key;
+      char **values;
+
+      g_variant_iter_init (&iter, section);
+      while (g_variant_iter_next (&iter, "{&s^as}", &key, &values))
+        g_hash_table_insert (context->generic_policy, g_strdup (key), values);
+    }
+
+  if (LOOKUP_SECTION ("usb", "as") &&
+      !flatpak_context_deserialize_usb_devices (context->enumerable_usb_devices, section, error))
+    return NULL;
+  if (LOOKUP_SECTION ("nousb", "as") &&
+      !flatpak_context_deserialize_usb_devices (context->hidden_usb_devices, section, error))
+    return NULL;
+
+#undef LOOKUP_SECTION
+
+  return g_steal_pointer (&context);
+}
+
 gboolean
 flatpak_context_get_needs_session_bus_proxy (FlatpakContext *context)
 {
@@ -3538,6 +4071,10 @@ flatpak_context_to_args (FlatpakContext *context,
         g_ptr_array_add (args, g_strdup_printf ("--unset-env=%s", (char *) key));
     }
 
+  g_hash_table_iter_init (&iter, context->resources);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_ptr_array_add (args, g_strdup_printf ("--resource=%s=%s", (char *) key, (char *) value));
+
   g_hash_table_iter_init (&iter, context->persistent);
   while (g_hash_table_iter_next (&iter, &key, &value))
     g_ptr_array_add (args, g_strdup_printf ("--persist=%s", (char *) key));
@@ -3661,6 +4198,7 @@ void
 flatpak_context_reset_non_permissions (FlatpakContext *context)
 {
   g_hash_table_remove_all (context->env_vars);
+  g_hash_table_remove_all (context->resources);
 }
 
 void
@@ -3696,7 +4234,7 @@ flatpak_context_make_sandboxed (FlatpakContext *context)
   if (multiarch)
     {
       g_hash_table_insert (context->features_permissions,
-                           g_strdup ("multiarch"),
+                           (char *) g_intern_static_string ("multiarch"),
                            g_steal_pointer (&multiarch));
     }
 
@@ -38,8 +38,9 @@
  * Version 3 added timestamp
  * Version 4 guarantees that alt-id/eol/eolr/runtime/extension-of/appdata-content-rating
  *           are present if in the commit metadata or metadata file or appdata
+ * Version 5 added sdk/extra-data-runtime/extension-points
  */
-#define FLATPAK_DEPLOY_VERSION_CURRENT 4
+#define FLATPAK_DEPLOY_VERSION_CURRENT 5
 #define FLATPAK_DEPLOY_VERSION_ANY 0
 
 #define FLATPAK_TYPE_DIR flatpak_dir_get_type ()
@@ -80,6 +81,14 @@ typedef struct {
   GVariant   *summary;
 } FlatpakSideloadState;
 
+typedef struct {
+  FlatpakDir *dir;
+  char       *uri;
+  GFile      *location;
+  gboolean    loaded;
+  GHashTable *commits; /* checksum set, loaded on first use */
+} FlatpakSideloadPeer;
+
 /* The remote state represent the state of the remote at a particular
    time, including the summary file and the metadata (which may be from
    the summary or from a branch. We create this once per highlevel operation
@@ -105,16 +114,31 @@ typedef struct
   GBytes   *summary_sig_bytes;
   GError   *summary_fetch_error;
 
-  GRegex   *allow_refs;
-  GRegex   *deny_refs;
+  FlatpakFilter *allow_refs;
+  FlatpakFilter *deny_refs;
   int       refcount;
   gint32    default_token_type;
   GPtrArray *sideload_repos;
   GPtrArray *sideload_image_collections;
+  GPtrArray *sideload_peers;
+
+  /* Merged view of the sideload repo summaries, built on first use */
+  GHashTable *sideload_refs; /* ref -> latest FlatpakSideloadRef */
+  GHashTable *sideload_repo_commits; /* checksum -> FlatpakSideloadState */
+
+  /* Parsed refs, built on first lookup and rebuilt as subsummaries load */
+  GHashTable *all_refs; /* FlatpakDecomposed -> commit */
+  GHashTable *all_refs_by_id; /* id -> GPtrArray of FlatpakDecomposed owned by all_refs */
+  guint       all_refs_n_subsummaries;
+
+  GHashTable *ref_data; /* ref -> decoded cache entries */
 } FlatpakRemoteState;
 
 FlatpakRemoteState *flatpak_remote_state_ref (FlatpakRemoteState *remote_state);
 void flatpak_remote_state_unref (FlatpakRemoteState *remote_state);
+FlatpakRemoteState *flatpak_remote_state_copy (FlatpakRemoteState *self);
+gsize flatpak_remote_state_get_summary_size (FlatpakRemoteState *self);
+void flatpak_remote_state_compact (FlatpakRemoteState *self);
 gboolean flatpak_remote_state_ensure_summary (FlatpakRemoteState *self,
                                               GError            **error);
 gboolean flatpak_remote_state_ensure_subsummary (FlatpakRemoteState *self,
@@ -197,6 +221,7 @@ typedef enum {
   FLATPAK_HELPER_DEPLOY_FLAGS_INSTALL_HINT = 1 << 6,
   FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE_PINNED = 1 << 7,
   FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE_PREINSTALLED = 1 << 8,
+  FLATPAK_HELPER_DEPLOY_FLAGS_BACKGROUND = 1 << 9,
 } FlatpakHelperDeployFlags;
 
 #define FLATPAK_HELPER_DEPLOY_FLAGS_ALL (FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE | \
@@ -207,7 +232,8 @@ typedef enum {
                                          FLATPAK_HELPER_DEPLOY_FLAGS_APP_HINT | \
                                          FLATPAK_HELPER_DEPLOY_FLAGS_INSTALL_HINT | \
                                          FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE_PINNED | \
-                                         FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE_PREINSTALLED)
+                                         FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE_PREINSTALLED | \
+                                         FLATPAK_HELPER_DEPLOY_FLAGS_BACKGROUND)
 
 typedef enum {
   FLATPAK_HELPER_UNINSTALL_FLAGS_NONE = 0,
@@ -371,6 +397,8 @@ GQuark       flatpak_dir_error_quark (void);
 GPtrArray *flatpak_get_system_base_dir_locations        (GCancellable  *cancellable,
                                                          GError       **error);
 GFile *    flatpak_get_system_default_base_dir_location (void);
+GFile *    flatpak_get_system_installations_config_dir  (void);
+char *     flatpak_get_user_private_cache_dir           (const char    *name);
 
 GKeyFile *      flatpak_load_override_keyfile   (const char  *app_id,
                                                  gboolean     user,
@@ -432,7 +460,9 @@ GBytes *        flatpak_deploy_get_deploy_data (FlatpakDeploy      *deploy,
                                                 GCancellable       *cancellable,
                                                 GError            **error);
 GFile *         flatpak_deploy_get_files       (FlatpakDeploy      *deploy);
-FlatpakContext *flatpak_deploy_get_overrides   (FlatpakDeploy      *deploy);
+FlatpakContext *flatpak_deploy_get_overrides   (FlatpakDeploy      *deploy,
+                                                GError            **error);
+char *          flatpak_deploy_get_overrides_stamp (FlatpakDeploy  *deploy);
 GKeyFile *      flatpak_deploy_get_metadata    (FlatpakDeploy      *deploy);
 
 FlatpakDir *          flatpak_dir_new                                       (GFile                         *basedir,
@@ -442,6 +472,8 @@ FlatpakDir  *         flatpak_dir_get_user                                  (voi
 FlatpakDir  *         flatpak_dir_get_system_default                        (void);
 GPtrArray   *         flatpak_dir_get_system_list                           (GCancellable                  *cancellable,
                                                                              GError                       **error);
+GPtrArray   *         flatpak_dir_get_system_list_uncached                  (GCancellable                  *cancellable,
+                                                                             GError                       **error);
 FlatpakDir  *         flatpak_dir_get_system_by_id                          (const char                    *id,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
@@ -452,6 +484,15 @@ void                  flatpak_dir_set_no_system_helper                      (Fla
 void                  flatpak_dir_set_no_interaction                        (FlatpakDir                    *self,
                                                                              gboolean                       no_interaction);
 gboolean              flatpak_dir_get_no_interaction                        (FlatpakDir                    *self);
+void                  flatpak_dir_set_max_download_rate                     (FlatpakDir                    *self,
+                                                                             guint64                        bytes_per_sec);
+guint64               flatpak_dir_get_max_download_rate                     (FlatpakDir                    *self);
+void                  flatpak_dir_set_background_priority                   (FlatpakDir                    *self,
+                                                                             gboolean                       background_priority);
+gboolean              flatpak_dir_get_background_priority                   (FlatpakDir                    *self);
+void                  flatpak_dir_set_checkout_jobs                         (FlatpakDir                    *self,
+                                                                             guint                          n_jobs);
+guint                 flatpak_dir_get_checkout_jobs                         (FlatpakDir                    *self);
 GFile *               flatpak_dir_get_path                                  (FlatpakDir                    *self);
 GFile *               flatpak_dir_get_changed_path                          (FlatpakDir                    *self);
 const char *          flatpak_dir_get_id                                    (FlatpakDir                    *self);
@@ -550,6 +591,7 @@ char *                flatpak_dir_load_override                             (Fla
                                                                              GFile                        **file_out,
                                                                              GError                       **error);
 OstreeRepo *          flatpak_dir_get_repo                                  (FlatpakDir                    *self);
+GFile *               flatpak_dir_get_cache_dir                             (FlatpakDir                    *self);
 gboolean              flatpak_dir_ensure_path                               (FlatpakDir                    *self,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
@@ -586,6 +628,7 @@ gboolean              flatpak_dir_config_remove_pattern                     (Fla
                                                                              GError                       **error);
 gboolean              flatpak_dir_mark_changed                              (FlatpakDir                    *self,
                                                                              GError                       **error);
+void                  flatpak_dir_drop_deployed_index                       (FlatpakDir                    *self);
 gboolean              flatpak_dir_remove_appstream                          (FlatpakDir                    *self,
                                                                              const char                    *remote,
                                                                              GCancellable                  *cancellable,
@@ -618,11 +661,21 @@ gboolean              flatpak_dir_pull                                      (Fla
                                                                              FlatpakProgress               *progress,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
+gboolean              flatpak_dir_pull_batch                                (FlatpakDir                    *self,
+                                                                             FlatpakRemoteState            *state,
+                                                                             const char * const            *refs,
+                                                                             const char * const            *revs,
+                                                                             const char                    *token,
+                                                                             FlatpakPullFlags               flatpak_flags,
+                                                                             FlatpakProgress               *progress,
+                                                                             GCancellable                  *cancellable,
+                                                                             GError                       **error);
 gboolean              flatpak_dir_pull_untrusted_local                      (FlatpakDir                    *self,
                                                                              const char                    *src_path,
                                                                              const char                    *remote_name,
                                                                              const char                    *ref,
                                                                              const char                   **subpaths,
+                                                                             gboolean                       src_is_sealed,
                                                                              FlatpakProgress               *progress,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
@@ -688,6 +741,11 @@ gboolean              flatpak_dir_lock                                      (Fla
                                                                              GLnxLockFile                  *lockfile,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
+gboolean              flatpak_dir_lock_ref                                  (FlatpakDir                    *self,
+                                                                             FlatpakDecomposed             *ref,
+                                                                             GLnxLockFile                  *lockfile,
+                                                                             GCancellable                  *cancellable,
+                                                                             GError                       **error);
 gboolean              flatpak_dir_repo_lock                                 (FlatpakDir                    *self,
                                                                              GLnxLockFile                  *lockfile,
                                                                              gboolean                       exclusive,
@@ -814,6 +872,16 @@ gboolean              flatpak_dir_update_exports                            (Fla
                                                                              const char                    *app,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
+void                  flatpak_dir_set_defer_exports_cleanup                 (FlatpakDir                    *self,
+                                                                             gboolean                       defer_exports_cleanup);
+gboolean              flatpak_dir_flush_exports                             (FlatpakDir                    *self,
+                                                                             GCancellable                  *cancellable,
+                                                                             GError                       **error);
+void                  flatpak_dir_set_defer_uninstall_cleanup               (FlatpakDir                    *self,
+                                                                             gboolean                       defer_uninstall_cleanup);
+gboolean              flatpak_dir_flush_uninstall_cleanup                   (FlatpakDir                    *self,
+                                                                             GCancellable                  *cancellable,
+                                                                             GError                       **error);
 gboolean              flatpak_dir_prune                                     (FlatpakDir                    *self,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
@@ -827,6 +895,7 @@ gboolean              flatpak_dir_update_summary                            (Fla
 gboolean              flatpak_dir_cleanup_removed                           (FlatpakDir                    *self,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
+void                  flatpak_dir_reap_removed                              (FlatpakDir                    *self);
 gboolean              flatpak_dir_cleanup_undeployed_refs                   (FlatpakDir                    *self,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
@@ -895,6 +964,7 @@ gboolean              flatpak_dir_remove_remote                             (Fla
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
 GPtrArray *           flatpak_dir_get_sideload_repo_paths                   (FlatpakDir                    *self);
+char **               flatpak_dir_get_sideload_peer_uris                    (FlatpakDir                    *self);
 char **               flatpak_dir_list_remote_config_keys                   (FlatpakDir                    *self,
                                                                              const char                    *remote_name);
 char      *           flatpak_dir_get_remote_title                          (FlatpakDir                    *self,
@@ -986,6 +1056,11 @@ FlatpakRemoteState *  flatpak_dir_get_remote_state_optional                 (Fla
                                                                              gboolean                       only_cached,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
+FlatpakRemoteState *  flatpak_dir_get_remote_state_stale_ok                 (FlatpakDir                    *self,
+                                                                             const char                    *remote,
+                                                                             GCancellable                  *cancellable,
+                                                                             GError                       **error);
+void                  flatpak_dir_wait_background_refreshes                 (void);
 FlatpakRemoteState *  flatpak_dir_get_remote_state_local_only               (FlatpakDir                    *self,
                                                                              const char                    *remote,
                                                                              GCancellable                  *cancellable,
@@ -34,9 +34,12 @@ typedef struct
   char              *subdir_suffix;
   char              *add_ld_path;
   char             **merge_dirs;
+  char              *enable_if;
+  char             **merged_files; /* "$merge_dir/$name", for each file in the merge dirs */
   int                priority;
   gboolean           needs_tmpfs;
   gboolean           is_unmaintained;
+  gboolean           has_ref;
 } FlatpakExtension;
 
 void flatpak_extension_free (FlatpakExtension *extension);
@@ -328,6 +328,8 @@ flatpak_extension_free (FlatpakExtension *extension)
   g_free (extension->add_ld_path);
   g_free (extension->subdir_suffix);
   g_strfreev (extension->merge_dirs);
+  g_free (extension->enable_if);
+  g_strfreev (extension->merged_files);
   g_free (extension);
 }
 
@@ -341,6 +343,35 @@ flatpak_extension_compare (gconstpointer _a,
   return b->priority - a->priority;
 }
 
+/* The lock file and the merged files only depend on the deployed files,
+ * so they are resolved here to have them cached along with the rest
+ * rather than looked up on every launch */
+static void
+flatpak_extension_resolve_files (FlatpakExtension *ext)
+{
+  g_autofree char *real_ref = g_build_filename (ext->files_path, ext->directory, ".ref", NULL);
+  g_autoptr(GPtrArray) merged_files = g_ptr_array_new_with_free_func (g_free);
+  int i;
+
+  ext->has_ref = g_file_test (real_ref, G_FILE_TEST_EXISTS);
+
+  for (i = 0; ext->merge_dirs != NULL && ext->merge_dirs[i] != NULL; i++)
+    {
+      g_autofree char *source_dir = g_build_filename (ext->files_path, ext->merge_dirs[i], NULL);
+      g_auto(GLnxDirFdIterator) source_iter = { 0 };
+      struct dirent *dent;
+
+      if (!glnx_dirfd_iterator_init_at (AT_FDCWD, source_dir, TRUE, &source_iter, NULL))
+        continue;
+
+      while (glnx_dirfd_iterator_next_dent (&source_iter, &dent, NULL, NULL) && dent != NULL)
+        g_ptr_array_add (merged_files, g_build_filename (ext->merge_dirs[i], dent->d_name, NULL));
+    }
+
+  g_ptr_array_add (merged_files, NULL);
+  ext->merged_files = (char **) g_ptr_array_free (g_steal_pointer (&merged_files), FALSE);
+}
+
 static FlatpakExtension *
 flatpak_extension_new (const char        *id,
                        const char        *extension,
@@ -349,6 +380,7 @@ flatpak_extension_new (const char        *id,
                        const char        *add_ld_path,
                        const char        *subdir_suffix,
                        char             **merge_dirs,
+                       const char        *enable_if,
                        GFile             *files,
                        GFile             *deploy_dir,
                        gboolean           is_unmaintained,
@@ -365,8 +397,11 @@ flatpak_extension_new (const char        *id,
   ext->add_ld_path = g_strdup (add_ld_path);
   ext->subdir_suffix = g_strdup (subdir_suffix);
   ext->merge_dirs = g_strdupv (merge_dirs);
+  ext->enable_if = g_strdup (enable_if);
   ext->is_unmaintained = is_unmaintained;
 
+  flatpak_extension_resolve_files (ext);
+
   /* Unmaintained extensions won't have a deploy or commit; see
    * https://github.com/flatpak/flatpak/issues/167 */
   if (deploy_dir && !is_unmaintained)
@@ -441,17 +476,16 @@ add_extension (GKeyFile   *metakey,
   else
     is_unmaintained = TRUE;
 
-  /* Prefer a full extension (org.freedesktop.Locale) over subdirectory ones (org.freedesktop.Locale.sv) */
+  /* Prefer a full extension (org.freedesktop.Locale) over subdirectory ones (org.freedesktop.Locale.sv).
+   * The enable-if conditions are checked by flatpak_list_extensions(), as they can
+   * change without anything being installed. */
   if (files != NULL)
     {
-      if (flatpak_extension_matches_reason (extension, enable_if, TRUE))
-        {
-          ext = flatpak_extension_new (extension, extension, ref, directory,
-                                       add_ld_path, subdir_suffix, merge_dirs,
-                                       files, deploy_dir, is_unmaintained,
-                                       is_unmaintained ? NULL : flatpak_dir_get_repo (dir));
-          res = g_list_prepend (res, ext);
-        }
+      ext = flatpak_extension_new (extension, extension, ref, directory,
+                                   add_ld_path, subdir_suffix, merge_dirs, enable_if,
+                                   files, deploy_dir, is_unmaintained,
+                                   is_unmaintained ? NULL : flatpak_dir_get_repo (dir));
+      res = g_list_prepend (res, ext);
     }
   else if (g_key_file_get_boolean (metakey, group,
                                    FLATPAK_METADATA_KEY_SUBDIRECTORIES, NULL))
@@ -480,10 +514,10 @@ add_extension (GKeyFile   *metakey,
           if (subdir_deploy_dir)
             subdir_files = g_file_get_child (subdir_deploy_dir, "files");
 
-          if (subdir_files && flatpak_extension_matches_reason (id, enable_if, TRUE))
+          if (subdir_files)
             {
               ext = flatpak_extension_new (extension, id, dir_ref, extended_dir,
-                                           add_ld_path, subdir_suffix, merge_dirs,
+                                           add_ld_path, subdir_suffix, merge_dirs, enable_if,
                                            subdir_files, subdir_deploy_dir, FALSE,
                                            flatpak_dir_get_repo (subdir_dir));
               ext->needs_tmpfs = TRUE;
@@ -503,11 +537,11 @@ add_extension (GKeyFile   *metakey,
           if (dir_ref == NULL)
             continue;
 
-          if (subdir_files && flatpak_extension_matches_reason (unmaintained_refs[j], enable_if, TRUE))
+          if (subdir_files)
             {
               ext = flatpak_extension_new (extension, unmaintained_refs[j], dir_ref,
                                            extended_dir, add_ld_path, subdir_suffix,
-                                           merge_dirs, subdir_files, NULL, TRUE, NULL);
+                                           merge_dirs, enable_if, subdir_files, NULL, TRUE, NULL);
               ext->needs_tmpfs = TRUE;
               res = g_list_prepend (res, ext);
             }
@@ -517,10 +551,10 @@ add_extension (GKeyFile   *metakey,
   return res;
 }
 
-GList *
-flatpak_list_extensions (GKeyFile   *metakey,
-                         const char *arch,
-                         const char *default_branch)
+static GList *
+scan_extensions (GKeyFile   *metakey,
+                 const char *arch,
+                 const char *default_branch)
 {
   g_auto(GStrv) groups = NULL;
   int i, j;
@@ -528,9 +562,6 @@ flatpak_list_extensions (GKeyFile   *metakey,
 
   res = NULL;
 
-  if (arch == NULL)
-    arch = flatpak_get_arch ();
-
   groups = g_key_file_get_groups (metakey, NULL);
   for (i = 0; groups[i] != NULL; i++)
     {
@@ -565,7 +596,238 @@ flatpak_list_extensions (GKeyFile   *metakey,
         }
     }
 
-  return g_list_sort (g_list_reverse (res), flatpak_extension_compare);
+  return g_list_reverse (res);
+}
+
+#define EXTENSION_CACHE_ENTRY_FORMAT "(sssssmsmsmsasibbmsasb)"
+#define EXTENSION_CACHE_VERSION 2
+#define EXTENSION_CACHE_FORMAT "(a(sttt)a" EXTENSION_CACHE_ENTRY_FORMAT ")"
+
+/* Scanning the installations for the extensions of an app or runtime
+ * opens every installation once per extension, which makes up a good
+ * part of the startup time of short-lived apps. The result only changes
+ * when something is deployed or removed, which bumps the .changed file
+ * of the installation, so it is cached in the user's cache dir along
+ * with the state of those files.
+ *
+ * Returns the state to validate the cache with, or %NULL if the result
+ * can't be cached because there are unmaintained extensions, which are
+ * installed without bumping anything.
+ */
+static GVariant *
+get_extension_cache_stamps (void)
+{
+  g_autoptr(GPtrArray) dirs = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  int i;
+
+  dirs = flatpak_dir_get_system_list (NULL, &local_error);
+  if (dirs == NULL)
+    return NULL;
+  g_ptr_array_insert (dirs, 0, flatpak_dir_get_user ());
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sttt)"));
+  for (i = 0; i < dirs->len; i++)
+    {
+      FlatpakDir *dir = g_ptr_array_index (dirs, i);
+      GFile *path = flatpak_dir_get_path (dir);
+      g_autoptr(GFile) unmaintained_dir = g_file_get_child (path, "extension");
+      g_autoptr(GFile) changed_file = flatpak_dir_get_changed_path (dir);
+      struct stat stbuf = { 0, };
+
+      if (g_file_query_exists (unmaintained_dir, NULL))
+        return NULL;
+
+      if (stat (flatpak_file_get_path_cached (changed_file), &stbuf) != 0)
+        memset (&stbuf, 0, sizeof (stbuf));
+
+      g_variant_builder_add (&builder, "(sttt)",
+                             flatpak_file_get_path_cached (path),
+                             (guint64) stbuf.st_mtim.tv_sec,
+                             (guint64) stbuf.st_mtim.tv_nsec,
+                             (guint64) stbuf.st_ino);
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static char *
+get_extension_cache_path (GKeyFile   *metakey,
+                          const char *arch,
+                          const char *default_branch)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_auto(GStrv) groups = NULL;
+  g_autofree char *cache_dir = NULL;
+  guint32 version = EXTENSION_CACHE_VERSION;
+  gsize i, j;
+
+  g_checksum_update (checksum, (const guchar *) &version, sizeof (version));
+
+  /* Only the extension points matter, and hashing just those is a lot
+   * cheaper than serializing the whole keyfile for apps that have big
+   * permission and bus policy sections */
+  groups = g_key_file_get_groups (metakey, NULL);
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      g_auto(GStrv) keys = NULL;
+
+      if (!g_str_has_prefix (groups[i], FLATPAK_METADATA_GROUP_PREFIX_EXTENSION))
+        continue;
+
+      g_checksum_update (checksum, (const guchar *) groups[i], strlen (groups[i]) + 1);
+
+      keys = g_key_file_get_keys (metakey, groups[i], NULL, NULL);
+      for (j = 0; keys != NULL && keys[j] != NULL; j++)
+        {
+          g_autofree char *value = g_key_file_get_value (metakey, groups[i], keys[j], NULL);
+
+          g_checksum_update (checksum, (const guchar *) keys[j], strlen (keys[j]) + 1);
+          if (value != NULL)
+            g_checksum_update (checksum, (const guchar *) value, strlen (value) + 1);
+        }
+    }
+
+  g_checksum_update (checksum, (const guchar *) arch, strlen (arch) + 1);
+  if (default_branch)
+    g_checksum_update (checksum, (const guchar *) default_branch, strlen (default_branch) + 1);
+
+  /* The cached paths end up bind-mounted into the sandbox, so this
+   * must not be writable by the apps */
+  cache_dir = flatpak_get_user_private_cache_dir ("extensions");
+
+  return g_build_filename (cache_dir, g_checksum_get_string (checksum), NULL);
+}
+
+static gboolean
+load_cached_extensions (const char *path,
+                        GVariant   *stamps,
+                        GList     **extensions_out)
+{
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GVariant) cached_stamps = NULL;
+  g_autoptr(GVariant) entries = NULL;
+  GList *res = NULL;
+  gsize i;
+
+  mfile = g_mapped_file_new (path, FALSE, NULL);
+  if (mfile == NULL)
+    return FALSE;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  cache = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (EXTENSION_CACHE_FORMAT),
+                                                        bytes, FALSE));
+
+  cached_stamps = g_variant_get_child_value (cache, 0);
+  if (!g_variant_equal (cached_stamps, stamps))
+    return FALSE;
+
+  entries = g_variant_get_child_value (cache, 1);
+  for (i = 0; i < g_variant_n_children (entries); i++)
+    {
+      FlatpakExtension *ext = g_new0 (FlatpakExtension, 1);
+      g_autofree char *ref = NULL;
+
+      g_variant_get_child (entries, i, EXTENSION_CACHE_ENTRY_FORMAT,
+                           &ext->id, &ext->installed_id, &ref,
+                           &ext->directory, &ext->files_path, &ext->commit,
+                           &ext->add_ld_path, &ext->subdir_suffix, &ext->merge_dirs,
+                           &ext->priority, &ext->needs_tmpfs, &ext->is_unmaintained,
+                           &ext->enable_if, &ext->merged_files, &ext->has_ref);
+      ext->ref = flatpak_decomposed_new_from_ref (ref, NULL);
+
+      if (ext->ref == NULL)
+        {
+          flatpak_extension_free (ext);
+          g_list_free_full (res, (GDestroyNotify) flatpak_extension_free);
+          return FALSE;
+        }
+
+      res = g_list_prepend (res, ext);
+    }
+
+  *extensions_out = g_list_reverse (res);
+  return TRUE;
+}
+
+static void
+save_cached_extensions (const char *path,
+                        GVariant   *stamps,
+                        GList      *extensions)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *dir = g_path_get_dirname (path);
+  GList *l;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a" EXTENSION_CACHE_ENTRY_FORMAT));
+  for (l = extensions; l != NULL; l = l->next)
+    {
+      FlatpakExtension *ext = l->data;
+      const char *empty_strv[] = { NULL };
+
+      g_variant_builder_add (&builder, EXTENSION_CACHE_ENTRY_FORMAT,
+                             ext->id, ext->installed_id, flatpak_decomposed_get_ref (ext->ref),
+                             ext->directory, ext->files_path, ext->commit,
+                             ext->add_ld_path, ext->subdir_suffix,
+                             ext->merge_dirs ? (const char * const *) ext->merge_dirs : empty_strv,
+                             ext->priority, ext->needs_tmpfs, ext->is_unmaintained,
+                             ext->enable_if, (const char * const *) ext->merged_files,
+                             ext->has_ref);
+    }
+
+  cache = g_variant_ref_sink (g_variant_new ("(@a(sttt)@a" EXTENSION_CACHE_ENTRY_FORMAT ")",
+                                             stamps, g_variant_builder_end (&builder)));
+
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, dir, 0700, NULL, &local_error) ||
+      !glnx_file_replace_contents_at (AT_FDCWD, path,
+                                      g_variant_get_data (cache), g_variant_get_size (cache),
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error))
+    g_info ("Failed to cache extensions: %s", local_error->message);
+}
+
+GList *
+flatpak_list_extensions (GKeyFile   *metakey,
+                         const char *arch,
+                         const char *default_branch)
+{
+  g_autoptr(GVariant) stamps = NULL;
+  g_autofree char *cache_path = NULL;
+  GList *res = NULL;
+  GList *l, *next;
+
+  if (arch == NULL)
+    arch = flatpak_get_arch ();
+
+  stamps = get_extension_cache_stamps ();
+  if (stamps != NULL)
+    cache_path = get_extension_cache_path (metakey, arch, default_branch);
+
+  if (cache_path == NULL || !load_cached_extensions (cache_path, stamps, &res))
+    {
+      res = scan_extensions (metakey, arch, default_branch);
+
+      if (cache_path != NULL)
+        save_cached_extensions (cache_path, stamps, res);
+    }
+
+  for (l = res; l != NULL; l = next)
+    {
+      FlatpakExtension *ext = l->data;
+
+      next = l->next;
+      if (!flatpak_extension_matches_reason (ext->installed_id, ext->enable_if, TRUE))
+        {
+          flatpak_extension_free (ext);
+          res = g_list_delete_link (res, l);
+        }
+    }
+
+  return g_list_sort (res, flatpak_extension_compare);
 }
 
 void
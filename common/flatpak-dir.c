@@ -29,9 +29,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
 #include <utime.h>
+#include <linux/fs.h>
 
 #include <glib/gi18n-lib.h>
 #include <glib/gstdio.h>
@@ -57,7 +61,9 @@
 #include "flatpak-oci-registry-private.h"
 #include "flatpak-ref.h"
 #include "flatpak-repo-utils-private.h"
+#include "flatpak-run-dbus-private.h"
 #include "flatpak-run-private.h"
+#include "flatpak-trace-private.h"
 #include "flatpak-utils-base-private.h"
 #include "flatpak-variant-private.h"
 #include "flatpak-variant-impl-private.h"
@@ -78,6 +84,19 @@
 #define NO_SYSTEM_HELPER ((FlatpakSystemHelper *) (gpointer) 1)
 
 #define SUMMARY_CACHE_TIMEOUT_SEC (60 * 5)
+
+/* How long a summary index that some process checked against the remote
+ * is used as is by the other processes sharing the cache dir */
+#define SHARED_SUMMARY_INDEX_TIMEOUT_SEC 60
+
+/* How old a cached summary index may be to still be served to read-only
+ * queries while it is refreshed in the background */
+#define STALE_SUMMARY_INDEX_MAX_AGE_SEC (60 * 60 * 24)
+
+/* Set by root on cached subsummaries once they are durably on disk, to
+ * the checksum they were verified against. Only privileged processes can
+ * set trusted.* xattrs, so unlike user.* ones they can't be forged. */
+#define SUBSUMMARY_VERIFIED_XATTR "trusted.flatpak.verified-sha256"
 #define FILTER_MTIME_CHECK_TIMEOUT_MSEC 500
 
 #define SYSCONF_INSTALLATIONS_DIR "installations.d"
@@ -97,6 +116,10 @@
 #define FLATPAK_PREINSTALL_INSTALL_KEY "Install"
 
 #define SIDELOAD_REPOS_DIR_NAME "sideload-repos"
+#define SIDELOAD_PEERS_DIR_NAME "sideload-peers"
+#define SIDELOAD_PEER_FILE_EXT ".peer"
+#define SIDELOAD_PEER_GROUP "Sideload Peer"
+#define SIDELOAD_PEER_URL_KEY "Url"
 
 #define FLATPAK_TRIGGERS_DIR "triggers"
 
@@ -181,13 +204,16 @@ static gboolean flatpak_dir_lookup_remote_filter (FlatpakDir *self,
                                                   const char *name,
                                                   gboolean    force_load,
                                                   char      **checksum_out,
-                                                  GRegex    **allow_regex,
-                                                  GRegex    **deny_regex,
+                                                  FlatpakFilter **allow_filter,
+                                                  FlatpakFilter **deny_filter,
                                                   GError **error);
 
 static char *flatpak_dir_get_remote_signature_lookaside (FlatpakDir *self,
                                                          const char *remote_name);
 
+static FlatpakHTTPFlags flatpak_dir_get_remote_http_flags (FlatpakDir *self,
+                                                           const char *remote_name);
+
 static void ensure_http_session (FlatpakDir *self);
 
 static void flatpak_dir_log (FlatpakDir *self,
@@ -201,12 +227,13 @@ static void flatpak_dir_log (FlatpakDir *self,
                              const char *commit,
                              const char *old_commit,
                              const char *url,
+                             GVariant   *metrics,
                              const char *format,
-                             ...) G_GNUC_PRINTF (12, 13);
+                             ...) G_GNUC_PRINTF (13, 14);
 
 #define flatpak_dir_log(self, change, remote, ref, commit, old_commit, url, format, ...) \
   (flatpak_dir_log) (self, __FILE__, __LINE__, __FUNCTION__, \
-                     NULL, change, remote, ref, commit, old_commit, url, format, __VA_ARGS__)
+                     NULL, change, remote, ref, commit, old_commit, url, NULL, format, __VA_ARGS__)
 
 static GBytes *upgrade_deploy_data (GBytes             *deploy_data,
                                     GFile              *deploy_dir,
@@ -215,6 +242,11 @@ static GBytes *upgrade_deploy_data (GBytes             *deploy_data,
                                     GCancellable       *cancellable,
                                     GError            **error);
 
+static GPtrArray *flatpak_dir_scan_refs (FlatpakDir    *self,
+                                         FlatpakKinds   kinds,
+                                         GCancellable  *cancellable,
+                                         GError       **error);
+
 typedef struct
 {
   GBytes *bytes;
@@ -237,8 +269,8 @@ typedef struct {
   GTimeVal mtime;
   guint64 last_mtime_check;
   char *checksum;
-  GRegex *allow;
-  GRegex *deny;
+  FlatpakFilter *allow;
+  FlatpakFilter *deny;
 } RemoteFilter;
 
 struct FlatpakDir
@@ -261,13 +293,63 @@ struct FlatpakDir
   GHashTable      *remote_filters;
 
   /* Config cache, protected by config_cache lock */
-  GRegex          *masked;
-  GRegex          *pinned;
+  FlatpakFilter   *masked;
+  FlatpakFilter   *pinned;
+  /* Parsed options of all remotes in the repo config, name -> RemoteConfig.
+   * Immutable once built, and rebuilt when the repo config is reloaded. */
+  GHashTable      *remote_configs;
+  GKeyFile        *remote_configs_keyfile;
 
   FlatpakHttpSession *http_session;
+  guint64             max_download_rate;
+  gboolean            background_priority;
+  guint               checkout_jobs;
+  int                 reflinks_supported; /* atomic, 0 = unknown, 1 = yes, 2 = no */
+
+  gboolean         defer_exports_cleanup;
+  gboolean         exports_cleanup_pending;
+  gboolean         defer_uninstall_cleanup;
+  gboolean         uninstall_cleanup_pending;
+
+  /* Deployed index cache, protected by deployed_index lock */
+  GVariant        *deployed_index;
+  struct stat      deployed_index_stat;
+
+  /* Parsed metadata of deployed refs, protected by deployed_metadata lock */
+  GHashTable      *deployed_metadata;
+
+  /* The dir this was cloned from, which owns the pool of opened repos
+   * that finished clones hand back. The pool is protected by the
+   * repo_pool lock. */
+  FlatpakDir      *clone_parent;
+  GPtrArray       *repo_pool;
+  struct stat      repo_config_stat;
 };
 
 G_LOCK_DEFINE_STATIC (config_cache);
+G_LOCK_DEFINE_STATIC (deployed_index);
+G_LOCK_DEFINE_STATIC (deployed_metadata);
+G_LOCK_DEFINE_STATIC (repo_pool);
+
+/* Don't keep around more idle repos than a typical set of concurrent operations needs */
+#define FLATPAK_DIR_MAX_POOLED_REPOS 4
+
+typedef struct
+{
+  OstreeRepo  *repo;
+  GFile       *cache_dir;
+  struct stat  config_stat;
+} PooledRepo;
+
+static void
+pooled_repo_free (PooledRepo *pooled)
+{
+  g_clear_object (&pooled->repo);
+  g_clear_object (&pooled->cache_dir);
+  g_free (pooled);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PooledRepo, pooled_repo_free)
 
 typedef struct
 {
@@ -281,6 +363,11 @@ struct FlatpakDeploy
   FlatpakDecomposed *ref;
   GFile             *dir;
   GKeyFile          *metadata;
+  GBytes            *deploy_data;
+
+  /* The overrides are only loaded when asked for */
+  gboolean           user;
+  gboolean           overrides_loaded;
   FlatpakContext    *system_overrides;
   FlatpakContext    *user_overrides;
   FlatpakContext    *system_app_overrides;
@@ -375,6 +462,30 @@ flatpak_sideload_state_free (FlatpakSideloadState *sideload_state)
   g_free (sideload_state);
 }
 
+static void
+flatpak_sideload_peer_free (FlatpakSideloadPeer *sideload_peer)
+{
+  g_object_unref (sideload_peer->dir);
+  g_free (sideload_peer->uri);
+  g_object_unref (sideload_peer->location);
+  g_clear_pointer (&sideload_peer->commits, g_hash_table_unref);
+  g_free (sideload_peer);
+}
+
+typedef struct {
+  FlatpakSideloadState *ss;
+  char                 *checksum;
+  guint64               timestamp;
+  VarRefInfoRef         info; /* Points into ss->summary */
+} FlatpakSideloadRef;
+
+static void
+flatpak_sideload_ref_free (FlatpakSideloadRef *sideload_ref)
+{
+  g_free (sideload_ref->checksum);
+  g_free (sideload_ref);
+}
+
 static void
 variant_maybe_unref (GVariant *variant)
 {
@@ -390,6 +501,7 @@ flatpak_remote_state_new (void)
   state->refcount = 1;
   state->sideload_repos = g_ptr_array_new_with_free_func ((GDestroyNotify)flatpak_sideload_state_free);
   state->sideload_image_collections = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+  state->sideload_peers = g_ptr_array_new_with_free_func ((GDestroyNotify)flatpak_sideload_peer_free);
   state->subsummaries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)variant_maybe_unref);
   return state;
 }
@@ -420,15 +532,152 @@ flatpak_remote_state_unref (FlatpakRemoteState *remote_state)
       g_clear_pointer (&remote_state->summary_bytes, g_bytes_unref);
       g_clear_pointer (&remote_state->summary_sig_bytes, g_bytes_unref);
       g_clear_error (&remote_state->summary_fetch_error);
-      g_clear_pointer (&remote_state->allow_refs, g_regex_unref);
-      g_clear_pointer (&remote_state->deny_refs, g_regex_unref);
+      g_clear_pointer (&remote_state->allow_refs, flatpak_filter_unref);
+      g_clear_pointer (&remote_state->deny_refs, flatpak_filter_unref);
       g_clear_pointer (&remote_state->sideload_repos, g_ptr_array_unref);
       g_clear_pointer (&remote_state->sideload_image_collections, g_ptr_array_unref);
+      g_clear_pointer (&remote_state->sideload_peers, g_ptr_array_unref);
+      g_clear_pointer (&remote_state->sideload_refs, g_hash_table_unref);
+      g_clear_pointer (&remote_state->sideload_repo_commits, g_hash_table_unref);
+      g_clear_pointer (&remote_state->all_refs_by_id, g_hash_table_unref);
+      g_clear_pointer (&remote_state->all_refs, g_hash_table_unref);
+      g_clear_pointer (&remote_state->ref_data, g_hash_table_unref);
 
       g_free (remote_state);
     }
 }
 
+/* Returns a new state sharing the (immutable) summaries of @self, but
+ * with its own lazily built caches. A state is not threadsafe, so this
+ * is how a state is handed to another thread: make the copy on the
+ * thread that owns @self, and only use it from the other one.
+ * Sideload peers whose summary wasn't loaded yet are left out, as
+ * loading it would use the http session of the dir that added them. */
+FlatpakRemoteState *
+flatpak_remote_state_copy (FlatpakRemoteState *self)
+{
+  FlatpakRemoteState *copy = flatpak_remote_state_new ();
+  GHashTableIter iter;
+  gpointer key, value;
+
+  copy->remote_name = g_strdup (self->remote_name);
+  copy->is_file_uri = self->is_file_uri;
+  copy->is_oci = self->is_oci;
+  copy->collection_id = g_strdup (self->collection_id);
+  copy->default_token_type = self->default_token_type;
+
+  if (self->index)
+    copy->index = g_variant_ref (self->index);
+  if (self->index_sig_bytes)
+    copy->index_sig_bytes = g_bytes_ref (self->index_sig_bytes);
+  if (self->index_ht)
+    copy->index_ht = g_hash_table_ref (self->index_ht);
+
+  g_hash_table_iter_init (&iter, self->subsummaries);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (copy->subsummaries, g_strdup (key),
+                         value ? g_variant_ref (value) : NULL);
+
+  if (self->summary)
+    copy->summary = g_variant_ref (self->summary);
+  if (self->summary_bytes)
+    copy->summary_bytes = g_bytes_ref (self->summary_bytes);
+  if (self->summary_sig_bytes)
+    copy->summary_sig_bytes = g_bytes_ref (self->summary_sig_bytes);
+  if (self->summary_fetch_error)
+    copy->summary_fetch_error = g_error_copy (self->summary_fetch_error);
+
+  if (self->allow_refs)
+    copy->allow_refs = flatpak_filter_ref (self->allow_refs);
+  if (self->deny_refs)
+    copy->deny_refs = flatpak_filter_ref (self->deny_refs);
+
+  for (int i = 0; i < self->sideload_repos->len; i++)
+    {
+      FlatpakSideloadState *ss = g_ptr_array_index (self->sideload_repos, i);
+      FlatpakSideloadState *ss_copy = g_new0 (FlatpakSideloadState, 1);
+
+      ss_copy->repo = g_object_ref (ss->repo);
+      ss_copy->summary = g_variant_ref (ss->summary);
+      g_ptr_array_add (copy->sideload_repos, ss_copy);
+    }
+
+  for (int i = 0; i < self->sideload_image_collections->len; i++)
+    g_ptr_array_add (copy->sideload_image_collections,
+                     g_object_ref (g_ptr_array_index (self->sideload_image_collections, i)));
+
+  for (int i = 0; i < self->sideload_peers->len; i++)
+    {
+      FlatpakSideloadPeer *peer = g_ptr_array_index (self->sideload_peers, i);
+      FlatpakSideloadPeer *peer_copy;
+
+      if (!peer->loaded)
+        continue;
+
+      peer_copy = g_new0 (FlatpakSideloadPeer, 1);
+      peer_copy->dir = g_object_ref (peer->dir);
+      peer_copy->uri = g_strdup (peer->uri);
+      peer_copy->location = g_object_ref (peer->location);
+      peer_copy->loaded = TRUE;
+      if (peer->commits)
+        peer_copy->commits = g_hash_table_ref (peer->commits);
+      g_ptr_array_add (copy->sideload_peers, peer_copy);
+    }
+
+  return copy;
+}
+
+static void
+flatpak_remote_state_clear_sideload_index (FlatpakRemoteState *self)
+{
+  g_clear_pointer (&self->sideload_refs, g_hash_table_unref);
+  g_clear_pointer (&self->sideload_repo_commits, g_hash_table_unref);
+}
+
+/* The size of the summary data held by @self. Summaries loaded from the
+ * on-disk cache are mapped rather than copied, so this is mostly page
+ * cache rather than heap. */
+gsize
+flatpak_remote_state_get_summary_size (FlatpakRemoteState *self)
+{
+  gsize size = 0;
+
+  if (self->index != NULL)
+    size += g_variant_get_size (self->index);
+  if (self->summary != NULL)
+    size += g_variant_get_size (self->summary);
+
+  if (self->subsummaries != NULL)
+    {
+      GLNX_HASH_TABLE_FOREACH_V (self->subsummaries, GVariant *, subsummary)
+        size += g_variant_get_size (subsummary);
+    }
+
+  return size;
+}
+
+/* Drops the refs parsed for matching refs by name, which are only needed
+ * while working out what to install and are rebuilt if needed again. For
+ * a large remote these are by far the biggest part of the state, as every
+ * ref of every loaded arch is parsed. The summaries themselves and the
+ * per-ref data looked up so far are kept. */
+void
+flatpak_remote_state_compact (FlatpakRemoteState *self)
+{
+  if (self->all_refs == NULL)
+    return;
+
+  g_info ("Compacting state of remote %s: dropping %u parsed refs, keeping %" G_GSIZE_FORMAT " bytes of summaries and data for %u refs",
+          self->remote_name,
+          g_hash_table_size (self->all_refs),
+          flatpak_remote_state_get_summary_size (self),
+          self->ref_data ? g_hash_table_size (self->ref_data) : 0);
+
+  g_clear_pointer (&self->all_refs_by_id, g_hash_table_unref);
+  g_clear_pointer (&self->all_refs, g_hash_table_unref);
+  self->all_refs_n_subsummaries = 0;
+}
+
 static gboolean
 _validate_summary_for_collection_id (GVariant    *summary_v,
                                      const char  *collection_id,
@@ -481,11 +730,37 @@ flatpak_remote_state_add_sideload_repo (FlatpakRemoteState *self,
       else
         {
           g_ptr_array_add (self->sideload_repos, ss);
+          flatpak_remote_state_clear_sideload_index (self);
           g_info ("Using sideloaded repo %s for remote %s", flatpak_file_get_path_cached (dir), self->remote_name);
         }
     }
 }
 
+/* Peers are other machines on the local network serving an (archive mode)
+ * repo over http, typically a mirror of their own installation. We only
+ * ever use a peer for a commit whose checksum we already got from the
+ * remote's own signed summary, so the peer summary itself needs no trust.
+ * Peers come and go, so their summaries are only fetched once a pull
+ * actually looks for a commit, see sideload_peer_ensure_loaded().
+ */
+static void
+flatpak_remote_state_add_sideload_peer (FlatpakRemoteState *self,
+                                        FlatpakDir         *dir,
+                                        const char         *uri)
+{
+  FlatpakSideloadPeer *peer;
+
+  /* Sideloading only works if collection id is set */
+  if (self->collection_id == NULL || self->is_oci)
+    return;
+
+  peer = g_new0 (FlatpakSideloadPeer, 1);
+  peer->dir = g_object_ref (dir);
+  peer->uri = g_strdup (uri);
+  peer->location = g_file_new_for_uri (uri);
+  g_ptr_array_add (self->sideload_peers, peer);
+}
+
 void
 flatpak_remote_state_add_sideload_image_collection (FlatpakRemoteState     *self,
                                                     FlatpakImageCollection *image_collection)
@@ -681,6 +956,150 @@ get_timestamp_from_ref_info (VarRefInfoRef info)
  }
 
 
+static void
+add_summary_commits (GHashTable *commits,
+                     GVariant   *summary_v,
+                     const char *collection_id,
+                     gpointer    source)
+{
+  VarSummaryRef summary = var_summary_from_gvariant (summary_v);
+  VarRefMapRef ref_map;
+  gsize n;
+
+  if (!flatpak_summary_find_ref_map (summary, collection_id, &ref_map))
+    return;
+
+  n = var_ref_map_get_length (ref_map);
+  for (gsize i = 0; i < n; i++)
+    {
+      VarRefMapEntryRef entry = var_ref_map_get_at (ref_map, i);
+      VarRefInfoRef info = var_ref_map_entry_get_info (entry);
+      const guchar *bytes;
+      gsize bytes_len;
+      char *checksum;
+
+      bytes = var_ref_info_peek_checksum (info, &bytes_len);
+      if (bytes_len != OSTREE_SHA256_DIGEST_LEN)
+        continue;
+
+      /* Earlier sources take precedence */
+      checksum = ostree_checksum_from_bytes (bytes);
+      if (g_hash_table_contains (commits, checksum))
+        g_free (checksum);
+      else
+        g_hash_table_insert (commits, checksum, source);
+    }
+}
+
+/* Merges the summaries of all the sideload repos into hash
+ * tables, so that looking up a ref or commit doesn't have to go through
+ * every summary. This is dropped whenever a sideload source is added. */
+static void
+flatpak_remote_state_ensure_sideload_index (FlatpakRemoteState *self)
+{
+  if (self->sideload_refs != NULL)
+    return;
+
+  self->sideload_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify) flatpak_sideload_ref_free);
+  self->sideload_repo_commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (int i = 0; i < self->sideload_repos->len; i++)
+    {
+      FlatpakSideloadState *ss = g_ptr_array_index (self->sideload_repos, i);
+      VarSummaryRef summary = var_summary_from_gvariant (ss->summary);
+      VarRefMapRef ref_map;
+      gsize n;
+
+      add_summary_commits (self->sideload_repo_commits, ss->summary, self->collection_id, ss);
+
+      if (!flatpak_summary_find_ref_map (summary, self->collection_id, &ref_map))
+        continue;
+
+      n = var_ref_map_get_length (ref_map);
+      for (gsize j = 0; j < n; j++)
+        {
+          VarRefMapEntryRef entry = var_ref_map_get_at (ref_map, j);
+          VarRefInfoRef info = var_ref_map_entry_get_info (entry);
+          const char *ref = var_ref_map_entry_get_ref (entry);
+          FlatpakSideloadRef *latest;
+          const guchar *bytes;
+          gsize bytes_len;
+          guint64 timestamp;
+
+          bytes = var_ref_info_peek_checksum (info, &bytes_len);
+          if (bytes_len != OSTREE_SHA256_DIGEST_LEN)
+            continue;
+
+          /* On equal timestamps the first repo wins */
+          timestamp = get_timestamp_from_ref_info (info);
+          latest = g_hash_table_lookup (self->sideload_refs, ref);
+          if (latest != NULL && latest->timestamp >= timestamp)
+            continue;
+
+          latest = g_new0 (FlatpakSideloadRef, 1);
+          latest->ss = ss;
+          latest->checksum = ostree_checksum_from_bytes (bytes);
+          latest->timestamp = timestamp;
+          latest->info = info;
+          g_hash_table_replace (self->sideload_refs, g_strdup (ref), latest);
+        }
+    }
+}
+
+/* Fetches the summary of @peer the first time it is needed. This is only
+ * an optimization, so an unreachable peer is given up on right away
+ * rather than holding up the pull. */
+static void
+sideload_peer_ensure_loaded (FlatpakRemoteState  *self,
+                             FlatpakSideloadPeer *peer)
+{
+  g_autofree char *summary_uri = NULL;
+  g_autoptr(GBytes) summary_bytes = NULL;
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (peer->loaded)
+    return;
+
+  peer->loaded = TRUE;
+
+  ensure_http_session (peer->dir);
+
+  summary_uri = g_build_filename (peer->uri, "summary", NULL);
+  summary_bytes = flatpak_load_uri (peer->dir->http_session, summary_uri,
+                                    FLATPAK_HTTP_FLAGS_FAIL_FAST, NULL,
+                                    NULL, NULL, NULL, NULL, &local_error);
+  if (summary_bytes == NULL)
+    {
+      g_info ("Failed to load summary from sideload peer %s: %s", peer->uri, local_error->message);
+      return;
+    }
+
+  summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT, summary_bytes, FALSE));
+  if (!_validate_summary_for_collection_id (summary, self->collection_id, &local_error))
+    {
+      g_info ("Sideload peer %s not valid for remote %s: %s",
+              peer->uri, self->remote_name, local_error->message);
+      return;
+    }
+
+  peer->commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  add_summary_commits (peer->commits, summary, self->collection_id, peer);
+
+  g_info ("Using sideload peer %s for remote %s", peer->uri, self->remote_name);
+}
+
+static gboolean
+sideload_repo_has_commit (FlatpakSideloadState *ss,
+                          const char           *checksum)
+{
+  OstreeRepoCommitState commit_state;
+
+  return ostree_repo_load_commit (ss->repo, checksum, NULL, &commit_state, NULL) &&
+         commit_state == OSTREE_REPO_COMMIT_STATE_NORMAL;
+}
+
 void
 flatpak_remote_state_lookup_sideload_checksum (FlatpakRemoteState   *self,
                                                char                 *checksum,
@@ -709,15 +1128,32 @@ flatpak_remote_state_lookup_sideload_checksum (FlatpakRemoteState   *self,
     }
   else if (!self->is_oci && out_sideload_path)
     {
-      for (int i = 0; i < self->sideload_repos->len; i++)
+      FlatpakSideloadState *ss;
+
+      if (self->sideload_repos->len == 0 && self->sideload_peers->len == 0)
+        return;
+
+      flatpak_remote_state_ensure_sideload_index (self);
+
+      /* We only consider commits that are listed in the summary of the
+       * sideload repo, but still check that the repo really has it */
+      ss = g_hash_table_lookup (self->sideload_repo_commits, checksum);
+      if (ss != NULL && sideload_repo_has_commit (ss, checksum))
         {
-          FlatpakSideloadState *ss = g_ptr_array_index (self->sideload_repos, i);
-          OstreeRepoCommitState commit_state;
+          *out_sideload_path = g_object_ref (ostree_repo_get_path (ss->repo));
+          return;
+        }
+
+      /* Local repos are preferred, then LAN peers, before falling back
+       * to the remote itself */
+      for (int i = 0; i < self->sideload_peers->len; i++)
+        {
+          FlatpakSideloadPeer *peer = g_ptr_array_index (self->sideload_peers, i);
 
-          if (ostree_repo_load_commit (ss->repo, checksum, NULL, &commit_state, NULL) &&
-              commit_state == OSTREE_REPO_COMMIT_STATE_NORMAL)
+          sideload_peer_ensure_loaded (self, peer);
+          if (peer->commits != NULL && g_hash_table_contains (peer->commits, checksum))
             {
-              *out_sideload_path = g_object_ref (ostree_repo_get_path (ss->repo));
+              *out_sideload_path = g_object_ref (peer->location);
               return;
             }
         }
@@ -733,45 +1169,24 @@ flatpak_remote_state_resolve_sideloaded_ref_repos (FlatpakRemoteState    *self,
                                                    FlatpakSideloadState **out_sideload_state,
                                                    GError               **error)
 {
-  g_autofree char *latest_checksum = NULL;
-  guint64 latest_timestamp = 0;
-  FlatpakSideloadState *latest_ss = NULL;
-  VarRefInfoRef latest_sideload_info;
-
-  for (int i = 0; i < self->sideload_repos->len; i++)
-    {
-      FlatpakSideloadState *ss = g_ptr_array_index (self->sideload_repos, i);
-      g_autofree char *sideload_checksum = NULL;
-      VarRefInfoRef sideload_info;
-
-      if (flatpak_summary_lookup_ref (ss->summary, self->collection_id, ref, &sideload_checksum, &sideload_info))
-        {
-          guint64 timestamp = get_timestamp_from_ref_info (sideload_info);
+  FlatpakSideloadRef *latest;
 
-          if (latest_checksum == 0 || latest_timestamp < timestamp)
-            {
-              g_free (latest_checksum);
-              latest_checksum = g_steal_pointer (&sideload_checksum);
-              latest_timestamp = timestamp;
-              latest_sideload_info = sideload_info;
-              latest_ss = ss;
-            }
-        }
-    }
+  flatpak_remote_state_ensure_sideload_index (self);
 
-  if (latest_checksum == NULL)
+  latest = g_hash_table_lookup (self->sideload_refs, ref);
+  if (latest == NULL)
     return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
                                _("No such ref '%s' in remote %s"),
                                ref, self->remote_name);
 
   if (out_checksum)
-    *out_checksum = g_steal_pointer (&latest_checksum);
+    *out_checksum = g_strdup (latest->checksum);
   if (out_timestamp)
-    *out_timestamp = latest_timestamp;
+    *out_timestamp = latest->timestamp;
   if (out_info)
-    *out_info = latest_sideload_info;
+    *out_info = latest->info;
   if (out_sideload_state)
-    *out_sideload_state = latest_ss;
+    *out_sideload_state = latest->ss;
 
   return TRUE;
 }
@@ -1028,34 +1443,39 @@ flatpak_remote_state_get_cache_version (FlatpakRemoteState *self)
   return GUINT32_FROM_LE (var_metadata_lookup_uint32 (meta, "xa.cache-version", 0));
 }
 
-gboolean
-flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
-                                   const char         *ref,
-                                   guint64            *out_download_size,
-                                   guint64            *out_installed_size,
-                                   const char        **out_metadata,
-                                   GError            **error)
-{
-  VarCacheDataRef cache_data;
-  VarMetadataRef meta;
-  VarSummaryRef summary;
-  guint32 summary_version;
-  GVariant *summary_v;
-
-  if (!flatpak_remote_state_ensure_summary (self, error))
-    return FALSE;
-
-  summary_v = get_summary_for_ref (self, ref);
-  if (summary_v == NULL)
-    return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
-                               _("No entry for %s in remote %s summary flatpak cache"),
-                               ref, self->remote_name);
+/* The decoded xa.cache and sparse cache entries of a ref. Transactions
+ * look these up many times, so they are decoded once per remote state.
+ * This points into the summary variants, which live as long as the state. */
+typedef struct {
+  gboolean        has_cache;
+  guint64         download_size;
+  guint64         installed_size;
+  const char     *metadata;
+  GError         *cache_error;
 
+  gboolean        has_sparse_cache;
+  VarMetadataRef  sparse_cache;
+  GError         *sparse_cache_error;
+} FlatpakRemoteRefData;
 
-  summary = var_summary_from_gvariant (summary_v);
-  meta = var_summary_get_metadata (summary);
+static void
+flatpak_remote_ref_data_free (FlatpakRemoteRefData *data)
+{
+  g_clear_error (&data->cache_error);
+  g_clear_error (&data->sparse_cache_error);
+  g_free (data);
+}
 
-  summary_version = GUINT32_FROM_LE (var_metadata_lookup_uint32 (meta, "xa.summary-version", 0));
+static void
+decode_cache (FlatpakRemoteState   *self,
+              VarSummaryRef         summary,
+              guint32               summary_version,
+              const char           *ref,
+              FlatpakRemoteRefData *data)
+{
+  VarCacheDataRef cache_data;
+  VarMetadataRef meta = var_summary_get_metadata (summary);
+  GError **error = &data->cache_error;
 
   if (summary_version == 0)
     {
@@ -1068,7 +1488,7 @@ flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
         {
           flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("No summary or Flatpak cache available for remote %s"),
                               self->remote_name);
-          return FALSE;
+          return;
         }
 
       /* For stupid historical reasons the xa.cache is double-wrapped in a variant */
@@ -1076,9 +1496,12 @@ flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
       cache = var_cache_from_variant (cache_v);
 
       if (!var_cache_lookup (cache, ref, &pos, &cache_data))
-        return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
-                                   _("No entry for %s in remote %s summary flatpak cache"),
-                                   ref, self->remote_name);
+        {
+          flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
+                              _("No entry for %s in remote %s summary flatpak cache"),
+                              ref, self->remote_name);
+          return;
+        }
     }
   else if (summary_version == 1)
     {
@@ -1088,62 +1511,180 @@ flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
       VarVariantRef cache_data_v;
 
       if (!flatpak_var_ref_map_lookup_ref (ref_map, ref, &info))
-        return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
-                                   _("No entry for %s in remote %s summary flatpak cache"),
-                                   ref, self->remote_name);
+        {
+          flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
+                              _("No entry for %s in remote %s summary flatpak cache"),
+                              ref, self->remote_name);
+          return;
+        }
 
       commit_metadata = var_ref_info_get_metadata (info);
       if (!var_metadata_lookup (commit_metadata, "xa.data", NULL, &cache_data_v))
-        return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Missing xa.data in summary for remote %s"),
-                                   self->remote_name);
+        {
+          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Missing xa.data in summary for remote %s"),
+                              self->remote_name);
+          return;
+        }
       cache_data = var_cache_data_from_variant (cache_data_v);
     }
   else
     {
       flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Unsupported summary version %d for remote %s"),
                           summary_version, self->remote_name);
-      return FALSE;
+      return;
     }
 
-  if (out_installed_size)
-    *out_installed_size = var_cache_data_get_installed_size (cache_data);
-
-  if (out_download_size)
-    *out_download_size = var_cache_data_get_download_size (cache_data);
-
-  if (out_metadata)
-    *out_metadata = var_cache_data_get_metadata (cache_data);
-
-  return TRUE;
+  data->has_cache = TRUE;
+  data->installed_size = var_cache_data_get_installed_size (cache_data);
+  data->download_size = var_cache_data_get_download_size (cache_data);
+  data->metadata = var_cache_data_get_metadata (cache_data);
 }
 
-gboolean
-flatpak_remote_state_load_data (FlatpakRemoteState *self,
-                                const char         *ref,
-                                guint64            *out_download_size,
-                                guint64            *out_installed_size,
-                                char              **out_metadata,
-                                GError            **error)
+static void
+decode_sparse_cache (FlatpakRemoteState   *self,
+                     VarSummaryRef         summary,
+                     guint32               summary_version,
+                     const char           *ref,
+                     FlatpakRemoteRefData *data)
 {
-  if (self->summary || self->index)
+  VarMetadataRef meta = var_summary_get_metadata (summary);
+  VarVariantRef sparse_cache_v;
+
+  if (summary_version == 0)
     {
-      const char *metadata = NULL;
-      if (!flatpak_remote_state_lookup_cache (self, ref, out_download_size, out_installed_size, &metadata, error))
-        return FALSE;
+      if (var_metadata_lookup (meta, "xa.sparse-cache", NULL, &sparse_cache_v))
+        {
+          VarSparseCacheRef sparse_cache = var_sparse_cache_from_variant (sparse_cache_v);
+          if (var_sparse_cache_lookup (sparse_cache, ref, NULL, &data->sparse_cache))
+            data->has_sparse_cache = TRUE;
+        }
+    }
+  else if (summary_version == 1)
+    {
+      VarRefMapRef ref_map = var_summary_get_ref_map (summary);
+      VarRefInfoRef info;
 
-      if (out_metadata)
-        *out_metadata = g_strdup (metadata);
+      if (flatpak_var_ref_map_lookup_ref (ref_map, ref, &info))
+        {
+          data->sparse_cache = var_ref_info_get_metadata (info);
+          data->has_sparse_cache = TRUE;
+        }
     }
   else
     {
-      /* Look up from sideload */
-      g_autofree char *checksum = NULL;
-      guint64 timestamp;
-      FlatpakSideloadState *ss = NULL;
-      g_autoptr(FlatpakImageSource) image_source = NULL;
-      g_autoptr(GVariant) commit_data = NULL;
-      g_autoptr(GVariant) commit_metadata = NULL;
-      const char *xa_metadata = NULL;
+      flatpak_fail_error (&data->sparse_cache_error, FLATPAK_ERROR_INVALID_DATA,
+                          _("Unsupported summary version %d for remote %s"),
+                          summary_version, self->remote_name);
+      return;
+    }
+
+  if (!data->has_sparse_cache)
+    flatpak_fail_error (&data->sparse_cache_error, FLATPAK_ERROR_REF_NOT_FOUND,
+                        _("No entry for %s in remote %s summary flatpak sparse cache"),
+                        ref, self->remote_name);
+}
+
+/* Returns NULL if there is no summary covering @ref (yet) */
+static FlatpakRemoteRefData *
+flatpak_remote_state_get_ref_data (FlatpakRemoteState *self,
+                                   const char         *ref)
+{
+  FlatpakRemoteRefData *data;
+  VarSummaryRef summary;
+  guint32 summary_version;
+  GVariant *summary_v;
+
+  if (self->ref_data != NULL)
+    {
+      data = g_hash_table_lookup (self->ref_data, ref);
+      if (data != NULL)
+        return data;
+    }
+
+  summary_v = get_summary_for_ref (self, ref);
+  if (summary_v == NULL)
+    return NULL;
+
+  summary = var_summary_from_gvariant (summary_v);
+  summary_version = GUINT32_FROM_LE (var_metadata_lookup_uint32 (var_summary_get_metadata (summary),
+                                                                 "xa.summary-version", 0));
+
+  data = g_new0 (FlatpakRemoteRefData, 1);
+  decode_cache (self, summary, summary_version, ref, data);
+  decode_sparse_cache (self, summary, summary_version, ref, data);
+
+  if (self->ref_data == NULL)
+    self->ref_data = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify) flatpak_remote_ref_data_free);
+  g_hash_table_insert (self->ref_data, g_strdup (ref), data);
+
+  return data;
+}
+
+gboolean
+flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
+                                   const char         *ref,
+                                   guint64            *out_download_size,
+                                   guint64            *out_installed_size,
+                                   const char        **out_metadata,
+                                   GError            **error)
+{
+  FlatpakRemoteRefData *data;
+
+  if (!flatpak_remote_state_ensure_summary (self, error))
+    return FALSE;
+
+  data = flatpak_remote_state_get_ref_data (self, ref);
+  if (data == NULL)
+    return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
+                               _("No entry for %s in remote %s summary flatpak cache"),
+                               ref, self->remote_name);
+
+  if (!data->has_cache)
+    {
+      g_propagate_error (error, g_error_copy (data->cache_error));
+      return FALSE;
+    }
+
+  if (out_installed_size)
+    *out_installed_size = data->installed_size;
+
+  if (out_download_size)
+    *out_download_size = data->download_size;
+
+  if (out_metadata)
+    *out_metadata = data->metadata;
+
+  return TRUE;
+}
+
+gboolean
+flatpak_remote_state_load_data (FlatpakRemoteState *self,
+                                const char         *ref,
+                                guint64            *out_download_size,
+                                guint64            *out_installed_size,
+                                char              **out_metadata,
+                                GError            **error)
+{
+  if (self->summary || self->index)
+    {
+      const char *metadata = NULL;
+      if (!flatpak_remote_state_lookup_cache (self, ref, out_download_size, out_installed_size, &metadata, error))
+        return FALSE;
+
+      if (out_metadata)
+        *out_metadata = g_strdup (metadata);
+    }
+  else
+    {
+      /* Look up from sideload */
+      g_autofree char *checksum = NULL;
+      guint64 timestamp;
+      FlatpakSideloadState *ss = NULL;
+      g_autoptr(FlatpakImageSource) image_source = NULL;
+      g_autoptr(GVariant) commit_data = NULL;
+      g_autoptr(GVariant) commit_metadata = NULL;
+      const char *xa_metadata = NULL;
       guint64 download_size = 0;
       guint64 installed_size = 0;
 
@@ -1235,6 +1776,9 @@ flatpak_remote_state_new_image_source (FlatpakRemoteState  *self,
   if (image_source == NULL)
     return NULL;
 
+  if (flatpak_dir_get_remote_http_flags (dir, self->remote_name) & FLATPAK_HTTP_FLAGS_HTTP3)
+    flatpak_oci_registry_set_http3 (flatpak_image_source_get_registry (image_source), TRUE);
+
   return g_steal_pointer (&image_source);
 }
 
@@ -1297,6 +1841,70 @@ flatpak_remote_state_fetch_image_source (FlatpakRemoteState *self,
 }
 
 
+/* The commit made up for an OCI image only depends on the manifest and
+ * image config, which are both fixed by the manifest digest (which is
+ * also the checksum). So once made, it is kept in the cache dir and
+ * later lookups of the same image don't need to talk to the registry. */
+static GFile *
+get_oci_commit_cache_file (FlatpakDir *dir,
+                           const char *checksum)
+{
+  g_autofree char *filename = g_strconcat (checksum, ".commit", NULL);
+
+  return flatpak_build_file (dir->cache_dir, "oci-commits", filename, NULL);
+}
+
+static GVariant *
+load_cached_oci_commit (FlatpakDir *dir,
+                        const char *ref,
+                        const char *checksum)
+{
+  g_autoptr(GFile) cache_file = get_oci_commit_cache_file (dir, checksum);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) cached = NULL;
+  g_autoptr(GVariant) commit_data = NULL;
+  const char *cached_ref;
+
+  bytes = g_file_load_bytes (cache_file, NULL, NULL, NULL);
+  if (bytes == NULL)
+    return NULL;
+
+  cached = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE ("(sv)"), bytes, FALSE));
+  g_variant_get (cached, "(&sv)", &cached_ref, &commit_data);
+
+  if (g_strcmp0 (cached_ref, ref) != 0 ||
+      !g_variant_is_of_type (commit_data, OSTREE_COMMIT_GVARIANT_FORMAT) ||
+      !ostree_validate_structureof_commit (commit_data, NULL))
+    return NULL;
+
+  g_info ("Using cached commit for OCI image %s", checksum);
+
+  return g_steal_pointer (&commit_data);
+}
+
+static void
+save_cached_oci_commit (FlatpakDir *dir,
+                        const char *ref,
+                        const char *checksum,
+                        GVariant   *commit_data)
+{
+  g_autoptr(GFile) cache_file = get_oci_commit_cache_file (dir, checksum);
+  g_autoptr(GFile) cache_dir = g_file_get_parent (cache_file);
+  g_autoptr(GVariant) cached = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  cached = g_variant_ref_sink (g_variant_new ("(sv)", ref, commit_data));
+
+  /* This is only a cache, so failing to write it (for instance to a
+   * system repo that we only read) is not an error */
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, flatpak_file_get_path_cached (cache_dir), 0755, NULL, &local_error) ||
+      !glnx_file_replace_contents_at (AT_FDCWD, flatpak_file_get_path_cached (cache_file),
+                                      g_variant_get_data (cached), g_variant_get_size (cached),
+                                      GLNX_FILE_REPLACE_NODATASYNC,
+                                      NULL, &local_error))
+    g_info ("Failed to cache commit for OCI image %s: %s", checksum, local_error->message);
+}
+
 static GVariant *
 flatpak_remote_state_fetch_commit_object_oci (FlatpakRemoteState *self,
                                               FlatpakDir   *dir,
@@ -1307,12 +1915,25 @@ flatpak_remote_state_fetch_commit_object_oci (FlatpakRemoteState *self,
                                               GError      **error)
 {
   g_autoptr(FlatpakImageSource) image_source = NULL;
+  g_autoptr(GVariant) commit_data = NULL;
+  gboolean use_cache;
+
+  use_cache = ref != NULL && ostree_validate_checksum_string (checksum, NULL);
+
+  if (use_cache)
+    commit_data = load_cached_oci_commit (dir, ref, checksum);
+  if (commit_data != NULL)
+    return g_steal_pointer (&commit_data);
 
   image_source = flatpak_remote_state_fetch_image_source (self, dir, ref, checksum, token, cancellable, error);
   if (image_source == NULL)
     return NULL;
 
-  return flatpak_image_source_make_fake_commit (image_source);
+  commit_data = flatpak_image_source_make_fake_commit (image_source);
+  if (use_cache)
+    save_cached_oci_commit (dir, ref, checksum, commit_data);
+
+  return g_steal_pointer (&commit_data);
 }
 
 static GVariant *
@@ -1501,56 +2122,25 @@ flatpak_remote_state_lookup_sparse_cache (FlatpakRemoteState *self,
                                           VarMetadataRef     *out_metadata,
                                           GError            **error)
 {
-  VarSummaryRef summary;
-  VarMetadataRef meta;
-  VarVariantRef sparse_cache_v;
-  guint32 summary_version;
-  GVariant *summary_v;
+  FlatpakRemoteRefData *data;
 
   if (!flatpak_remote_state_ensure_summary (self, error))
     return FALSE;
 
-  summary_v = get_summary_for_ref (self, ref);
-  if (summary_v == NULL)
+  data = flatpak_remote_state_get_ref_data (self, ref);
+  if (data == NULL)
     return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
                                _("No entry for %s in remote %s summary flatpak sparse cache"),
                                ref, self->remote_name);
 
-  summary = var_summary_from_gvariant (summary_v);
-  meta = var_summary_get_metadata (summary);
-
-  summary_version = GUINT32_FROM_LE (var_metadata_lookup_uint32 (meta, "xa.summary-version", 0));
-
-  if (summary_version == 0)
-    {
-      if (var_metadata_lookup (meta, "xa.sparse-cache", NULL, &sparse_cache_v))
-        {
-          VarSparseCacheRef sparse_cache = var_sparse_cache_from_variant (sparse_cache_v);
-          if (var_sparse_cache_lookup (sparse_cache, ref, NULL, out_metadata))
-            return TRUE;
-        }
-    }
-  else if (summary_version == 1)
-    {
-      VarRefMapRef ref_map = var_summary_get_ref_map (summary);
-      VarRefInfoRef info;
-
-      if (flatpak_var_ref_map_lookup_ref (ref_map, ref, &info))
-        {
-          *out_metadata = var_ref_info_get_metadata (info);
-          return TRUE;
-        }
-    }
-  else
+  if (!data->has_sparse_cache)
     {
-      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Unsupported summary version %d for remote %s"),
-                          summary_version, self->remote_name);
+      g_propagate_error (error, g_error_copy (data->sparse_cache_error));
       return FALSE;
     }
 
-  return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
-                             _("No entry for %s in remote %s summary flatpak sparse cache"),
-                             ref, self->remote_name);
+  *out_metadata = data->sparse_cache;
+  return TRUE;
 }
 
 static DirExtraData *
@@ -1610,6 +2200,7 @@ flatpak_deploy_finalize (GObject *object)
   g_clear_pointer (&self->ref, flatpak_decomposed_unref);
   g_clear_object (&self->dir);
   g_clear_pointer (&self->metadata, g_key_file_unref);
+  g_clear_pointer (&self->deploy_data, g_bytes_unref);
   g_clear_pointer (&self->system_overrides, flatpak_context_free);
   g_clear_pointer (&self->user_overrides, flatpak_context_free);
   g_clear_pointer (&self->system_app_overrides, flatpak_context_free);
@@ -1671,12 +2262,25 @@ flatpak_deploy_get_deploy_data (FlatpakDeploy *deploy,
                                 GCancellable  *cancellable,
                                 GError       **error)
 {
-  return flatpak_load_deploy_data (deploy->dir,
-                                   deploy->ref,
-                                   deploy->repo,
-                                   required_version,
-                                   cancellable,
-                                   error);
+  GBytes *deploy_data;
+
+  if (deploy->deploy_data != NULL &&
+      flatpak_deploy_data_get_version (deploy->deploy_data) >= required_version)
+    return g_bytes_ref (deploy->deploy_data);
+
+  deploy_data = flatpak_load_deploy_data (deploy->dir,
+                                          deploy->ref,
+                                          deploy->repo,
+                                          required_version,
+                                          cancellable,
+                                          error);
+  if (deploy_data == NULL)
+    return NULL;
+
+  g_clear_pointer (&deploy->deploy_data, g_bytes_unref);
+  deploy->deploy_data = g_bytes_ref (deploy_data);
+
+  return deploy_data;
 }
 
 GFile *
@@ -1685,10 +2289,60 @@ flatpak_deploy_get_files (FlatpakDeploy *deploy)
   return g_file_get_child (deploy->dir, "files");
 }
 
+static gboolean
+flatpak_deploy_ensure_overrides (FlatpakDeploy *deploy,
+                                 GError       **error)
+{
+  if (deploy->overrides_loaded)
+    return TRUE;
+
+  /* Only load system global overrides for system installed apps */
+  if (!deploy->user)
+    {
+      deploy->system_overrides = flatpak_load_override_file (NULL, FALSE, error);
+      if (deploy->system_overrides == NULL)
+        return FALSE;
+    }
+
+  /* Always load user global overrides */
+  deploy->user_overrides = flatpak_load_override_file (NULL, TRUE, error);
+  if (deploy->user_overrides == NULL)
+    return FALSE;
+
+  /* Only apps have app overrides */
+  if (flatpak_decomposed_is_app (deploy->ref))
+    {
+      g_autofree char *id = flatpak_decomposed_dup_id (deploy->ref);
+
+      /* Only load system overrides for system installed apps */
+      if (!deploy->user)
+        {
+          deploy->system_app_overrides = flatpak_load_override_file (id, FALSE, error);
+          if (deploy->system_app_overrides == NULL)
+            return FALSE;
+        }
+
+      /* Always load user overrides */
+      deploy->user_app_overrides = flatpak_load_override_file (id, TRUE, error);
+      if (deploy->user_app_overrides == NULL)
+        return FALSE;
+    }
+
+  deploy->overrides_loaded = TRUE;
+
+  return TRUE;
+}
+
 FlatpakContext *
-flatpak_deploy_get_overrides (FlatpakDeploy *deploy)
+flatpak_deploy_get_overrides (FlatpakDeploy *deploy,
+                              GError       **error)
 {
-  FlatpakContext *overrides = flatpak_context_new ();
+  FlatpakContext *overrides;
+
+  if (!flatpak_deploy_ensure_overrides (deploy, error))
+    return NULL;
+
+  overrides = flatpak_context_new ();
 
   if (deploy->system_overrides)
     {
@@ -1737,6 +2391,50 @@ flatpak_deploy_get_overrides (FlatpakDeploy *deploy)
   return overrides;
 }
 
+static void
+append_override_stamp (GString    *stamp,
+                       FlatpakDir *dir,
+                       const char *app_id)
+{
+  g_autofree char *path = g_build_filename (flatpak_file_get_path_cached (flatpak_dir_get_path (dir)),
+                                            "overrides", app_id ? app_id : "global", NULL);
+  struct stat stbuf;
+
+  if (stat (path, &stbuf) != 0)
+    g_string_append_printf (stamp, "%s:none;", path);
+  else
+    g_string_append_printf (stamp, "%s:%" G_GINT64_FORMAT ".%ld:%" G_GINT64_FORMAT ":%" G_GUINT64_FORMAT ";",
+                            path, (gint64) stbuf.st_mtim.tv_sec, (long) stbuf.st_mtim.tv_nsec,
+                            (gint64) stbuf.st_size, (guint64) stbuf.st_ino);
+}
+
+/* Describes the state of the files that flatpak_deploy_get_overrides()
+ * reads, so that results derived from them can be cached */
+char *
+flatpak_deploy_get_overrides_stamp (FlatpakDeploy *deploy)
+{
+  g_autoptr(GString) stamp = g_string_new ("");
+  g_autoptr(FlatpakDir) user_dir = flatpak_dir_get_user ();
+  g_autoptr(FlatpakDir) system_dir = deploy->user ? NULL : flatpak_dir_get_system_default ();
+  g_autofree char *id = NULL;
+
+  if (flatpak_decomposed_is_app (deploy->ref))
+    id = flatpak_decomposed_dup_id (deploy->ref);
+
+  if (system_dir)
+    append_override_stamp (stamp, system_dir, NULL);
+  append_override_stamp (stamp, user_dir, NULL);
+
+  if (id != NULL)
+    {
+      if (system_dir)
+        append_override_stamp (stamp, system_dir, id);
+      append_override_stamp (stamp, user_dir, id);
+    }
+
+  return g_string_free (g_steal_pointer (&stamp), FALSE);
+}
+
 GKeyFile *
 flatpak_deploy_get_metadata (FlatpakDeploy *deploy)
 {
@@ -1747,7 +2445,8 @@ static FlatpakDeploy *
 flatpak_deploy_new (GFile             *dir,
                     FlatpakDecomposed *ref,
                     GKeyFile          *metadata,
-                    OstreeRepo        *repo)
+                    OstreeRepo        *repo,
+                    gboolean           user)
 {
   FlatpakDeploy *deploy;
 
@@ -1756,6 +2455,7 @@ flatpak_deploy_new (GFile             *dir,
   deploy->dir = g_object_ref (dir);
   deploy->metadata = g_key_file_ref (metadata);
   deploy->repo = g_object_ref (repo);
+  deploy->user = user;
 
   return deploy;
 }
@@ -2469,6 +3169,16 @@ flatpak_dir_uninitialized_mark_preinstalled (FlatpakDir       *self,
   return TRUE;
 }
 
+/* Where the system installations besides the default one are configured */
+GFile *
+flatpak_get_system_installations_config_dir (void)
+{
+  g_autofree char *path = g_build_filename (get_config_dir_location (),
+                                            SYSCONF_INSTALLATIONS_DIR, NULL);
+
+  return g_file_new_for_path (path);
+}
+
 GPtrArray *
 flatpak_get_system_base_dir_locations (GCancellable *cancellable,
                                        GError      **error)
@@ -2509,6 +3219,19 @@ flatpak_get_user_base_dir_location (void)
   return g_object_ref ((GFile *) file);
 }
 
+/* Caches that end up deciding what an app can do, or what is mounted in
+ * its sandbox, must not be writable from inside a sandbox, which is the
+ * case for $XDG_CACHE_HOME with --filesystem=home. They go in the user
+ * installation instead, which is hidden from the sandbox like the
+ * overrides are. */
+char *
+flatpak_get_user_private_cache_dir (const char *name)
+{
+  g_autoptr(GFile) base_dir = flatpak_get_user_base_dir_location ();
+
+  return g_build_filename (flatpak_file_get_path_cached (base_dir), ".cache", name, NULL);
+}
+
 static gboolean
 validate_commit_metadata (GVariant   *commit_data,
                           const char *ref,
@@ -2864,6 +3587,8 @@ flatpak_dir_system_helper_call_deploy (FlatpakDir         *self,
 
   if (flatpak_dir_get_no_interaction (self))
     arg_flags |= FLATPAK_HELPER_DEPLOY_FLAGS_NO_INTERACTION;
+  if (flatpak_dir_get_background_priority (self))
+    arg_flags |= FLATPAK_HELPER_DEPLOY_FLAGS_BACKGROUND;
 
   g_autoptr(GVariant) ret =
     flatpak_dir_system_helper_call (self, "Deploy",
@@ -3225,39 +3950,136 @@ flatpak_dir_system_helper_call_generate_oci_summary (FlatpakDir   *self,
   return ret != NULL;
 }
 
+static gboolean
+stat_repo_config (FlatpakDir  *self,
+                  struct stat *stbuf)
+{
+  g_autofree char *config_path = g_build_filename (flatpak_file_get_path_cached (self->basedir),
+                                                   "repo", "config", NULL);
+
+  return stat (config_path, stbuf) == 0;
+}
+
+static gboolean
+repo_config_stat_equal (const struct stat *a,
+                        const struct stat *b)
+{
+  return
+    a->st_dev == b->st_dev &&
+    a->st_ino == b->st_ino &&
+    a->st_size == b->st_size &&
+    a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+    a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Hand the opened repo of a clone back to the dir it was cloned from, so
+ * the next clone doesn't have to open (and re-check) the repo again. Each
+ * repo is only ever used by one clone at a time, so this keeps clones
+ * independent for pulls and transactions. */
 static void
-flatpak_dir_finalize (GObject *object)
+flatpak_dir_release_repo_to_pool (FlatpakDir *self)
 {
-  FlatpakDir *self = FLATPAK_DIR (object);
+  FlatpakDir *parent = self->clone_parent;
+  PooledRepo *pooled;
+  struct stat config_stat;
 
-  g_clear_object (&self->repo);
-  g_clear_object (&self->cache_dir);
-  g_clear_object (&self->basedir);
-  g_clear_pointer (&self->extra_data, dir_extra_data_free);
+  if (parent == NULL || self->repo == NULL || self->cache_dir == NULL)
+    return;
 
-  if (self->system_helper_bus != (gpointer) 1)
-    g_clear_object (&self->system_helper_bus);
+  /* If the config changed while we had the repo it may be stale, drop it */
+  if (!stat_repo_config (self, &config_stat) ||
+      !repo_config_stat_equal (&config_stat, &self->repo_config_stat))
+    return;
 
-  g_clear_pointer (&self->http_session, flatpak_http_session_free);
-  g_clear_pointer (&self->summary_cache, g_hash_table_unref);
-  g_clear_pointer (&self->remote_filters, g_hash_table_unref);
-  g_clear_pointer (&self->masked, g_regex_unref);
-  g_clear_pointer (&self->pinned, g_regex_unref);
-  g_clear_object (&self->subject);
+  pooled = g_new0 (PooledRepo, 1);
+  pooled->repo = g_steal_pointer (&self->repo);
+  pooled->cache_dir = g_steal_pointer (&self->cache_dir);
+  pooled->config_stat = config_stat;
 
-  G_OBJECT_CLASS (flatpak_dir_parent_class)->finalize (object);
+  G_LOCK (repo_pool);
+  if (parent->repo_pool == NULL)
+    parent->repo_pool = g_ptr_array_new_with_free_func ((GDestroyNotify) pooled_repo_free);
+  if (parent->repo_pool->len < FLATPAK_DIR_MAX_POOLED_REPOS)
+    g_ptr_array_add (parent->repo_pool, g_steal_pointer (&pooled));
+  G_UNLOCK (repo_pool);
+
+  g_clear_pointer (&pooled, pooled_repo_free);
 }
 
-static void
-flatpak_dir_set_property (GObject      *object,
-                          guint         prop_id,
-                          const GValue *value,
-                          GParamSpec   *pspec)
+static gboolean
+flatpak_dir_take_repo_from_pool (FlatpakDir *self)
 {
-  FlatpakDir *self = FLATPAK_DIR (object);
+  FlatpakDir *parent = self->clone_parent;
+  g_autoptr(PooledRepo) pooled = NULL;
+  struct stat config_stat;
 
-  switch (prop_id)
-    {
+  if (parent == NULL || !stat_repo_config (self, &config_stat))
+    return FALSE;
+
+  G_LOCK (repo_pool);
+  while (pooled == NULL && parent->repo_pool != NULL && parent->repo_pool->len > 0)
+    {
+      PooledRepo *candidate = g_ptr_array_steal_index_fast (parent->repo_pool,
+                                                            parent->repo_pool->len - 1);
+
+      if (repo_config_stat_equal (&candidate->config_stat, &config_stat))
+        pooled = candidate;
+      else
+        pooled_repo_free (candidate);
+    }
+  G_UNLOCK (repo_pool);
+
+  if (pooled == NULL)
+    return FALSE;
+
+  self->repo = g_steal_pointer (&pooled->repo);
+  self->cache_dir = g_steal_pointer (&pooled->cache_dir);
+  self->repo_config_stat = config_stat;
+
+  return TRUE;
+}
+
+static void
+flatpak_dir_finalize (GObject *object)
+{
+  FlatpakDir *self = FLATPAK_DIR (object);
+
+  flatpak_dir_release_repo_to_pool (self);
+
+  g_clear_object (&self->repo);
+  g_clear_object (&self->cache_dir);
+  g_clear_object (&self->basedir);
+  g_clear_pointer (&self->extra_data, dir_extra_data_free);
+
+  if (self->system_helper_bus != (gpointer) 1)
+    g_clear_object (&self->system_helper_bus);
+
+  g_clear_pointer (&self->http_session, flatpak_http_session_free);
+  g_clear_pointer (&self->summary_cache, g_hash_table_unref);
+  g_clear_pointer (&self->remote_filters, g_hash_table_unref);
+  g_clear_pointer (&self->masked, flatpak_filter_unref);
+  g_clear_pointer (&self->pinned, flatpak_filter_unref);
+  g_clear_pointer (&self->remote_configs, g_hash_table_unref);
+  g_clear_pointer (&self->remote_configs_keyfile, g_key_file_unref);
+  g_clear_pointer (&self->deployed_index, g_variant_unref);
+  g_clear_pointer (&self->deployed_metadata, g_hash_table_unref);
+  g_clear_object (&self->subject);
+  g_clear_object (&self->clone_parent);
+  g_clear_pointer (&self->repo_pool, g_ptr_array_unref);
+
+  G_OBJECT_CLASS (flatpak_dir_parent_class)->finalize (object);
+}
+
+static void
+flatpak_dir_set_property (GObject      *object,
+                          guint         prop_id,
+                          const GValue *value,
+                          GParamSpec   *pspec)
+{
+  FlatpakDir *self = FLATPAK_DIR (object);
+
+  switch (prop_id)
+    {
     case PROP_PATH:
       /* Canonicalize */
       self->basedir = g_file_new_for_path (flatpak_file_get_path_cached (g_value_get_object (value)));
@@ -3358,6 +4180,83 @@ flatpak_dir_get_no_interaction (FlatpakDir *self)
   return self->no_interaction;
 }
 
+/* Limits the rate of the HTTP downloads done by @self (OCI images, extra
+ * data, summaries and indexes) to @bytes_per_sec, 0 meaning no limit.
+ * libostree has no such setting, so ostree pulls are not affected. */
+void
+flatpak_dir_set_max_download_rate (FlatpakDir *self,
+                                   guint64     bytes_per_sec)
+{
+  self->max_download_rate = bytes_per_sec;
+
+  if (self->http_session)
+    flatpak_http_session_set_max_recv_speed (self->http_session, bytes_per_sec);
+}
+
+guint64
+flatpak_dir_get_max_download_rate (FlatpakDir *self)
+{
+  return self->max_download_rate;
+}
+
+/* The rate limit for downloads from @remote_name: the smallest of the one
+ * set on @self and the xa.max-download-rate of the remote, 0 meaning none. */
+static guint64
+flatpak_dir_get_remote_max_download_rate (FlatpakDir *self,
+                                          const char *remote_name)
+{
+  GKeyFile *config = flatpak_dir_get_repo_config (self);
+  g_autofree char *group = get_group (remote_name);
+  guint64 rate = self->max_download_rate;
+  guint64 remote_rate = 0;
+
+  if (config != NULL)
+    remote_rate = g_key_file_get_uint64 (config, group, "xa.max-download-rate", NULL);
+
+  if (remote_rate != 0 && (rate == 0 || remote_rate < rate))
+    rate = remote_rate;
+
+  return rate;
+}
+
+/* When set, deploys are done with idle I/O and the lowest CPU priority,
+ * for updates happening in the background. */
+void
+flatpak_dir_set_background_priority (FlatpakDir *self,
+                                     gboolean    background_priority)
+{
+  self->background_priority = background_priority;
+}
+
+gboolean
+flatpak_dir_get_background_priority (FlatpakDir *self)
+{
+  return self->background_priority;
+}
+
+/* The number of threads used to check out a commit when deploying, 0
+ * (the default) means one per CPU and 1 disables the parallel checkout. */
+void
+flatpak_dir_set_checkout_jobs (FlatpakDir *self,
+                               guint       n_jobs)
+{
+  self->checkout_jobs = n_jobs;
+}
+
+guint
+flatpak_dir_get_checkout_jobs (FlatpakDir *self)
+{
+  /* Background deploys shouldn't compete for the CPU, and the pool
+   * threads wouldn't have the lowered priority anyway */
+  if (self->background_priority)
+    return 1;
+
+  if (self->checkout_jobs == 0)
+    return g_get_num_processors ();
+
+  return self->checkout_jobs;
+}
+
 GFile *
 flatpak_dir_get_path (FlatpakDir *self)
 {
@@ -3637,41 +4536,9 @@ flatpak_dir_load_deployed (FlatpakDir        *self,
   if (!g_key_file_load_from_data (metakey, metadata_contents, metadata_size, 0, error))
     return glnx_prefix_error_null (error, "%s", flatpak_file_get_path_cached (metadata));
 
-  deploy = flatpak_deploy_new (deploy_dir, ref, metakey, self->repo);
-
-  /* Only load system global overrides for system installed apps */
-  if (!self->user)
-    {
-      deploy->system_overrides = flatpak_load_override_file (NULL, FALSE, error);
-      if (deploy->system_overrides == NULL)
-        return NULL;
-    }
-
-  /* Always load user global overrides */
-  deploy->user_overrides = flatpak_load_override_file (NULL, TRUE, error);
-  if (deploy->user_overrides == NULL)
-    return NULL;
-
-  /* Only apps have app overrides */
-  if (flatpak_decomposed_is_app (ref))
-    {
-      g_autofree char *id = flatpak_decomposed_dup_id (ref);
-
-      /* Only load system overrides for system installed apps */
-      if (!self->user)
-        {
-          deploy->system_app_overrides = flatpak_load_override_file (id, FALSE, error);
-          if (deploy->system_app_overrides == NULL)
-            return NULL;
-        }
-
-      /* Always load user overrides */
-      deploy->user_app_overrides = flatpak_load_override_file (id, TRUE, error);
-      if (deploy->user_app_overrides == NULL)
-        return NULL;
-    }
-
-  return deploy;
+  /* The overrides and deploy data are loaded when first asked for, as
+   * most users only need the metadata */
+  return flatpak_deploy_new (deploy_dir, ref, metakey, self->repo, self->user);
 }
 
 GFile *
@@ -3750,10 +4617,19 @@ flatpak_dir_get_repo (FlatpakDir *self)
   return self->repo;
 }
 
+/* This is where per-installation caches that the current user can write
+ * go. It is only valid after the repo has been ensured. */
+GFile *
+flatpak_dir_get_cache_dir (FlatpakDir *self)
+{
+  return self->cache_dir;
+}
+
 
 /* This is an exclusive per flatpak installation file lock that is taken
  * whenever any config in the directory outside the repo is to be changed. For
- * instance deployments, overrides or active commit changes.
+ * instance deployments, overrides or active commit changes. Deploys only
+ * hold it while making the new deployment active, see flatpak_dir_lock_ref().
  *
  * For concurrency protection of the actual repository we rely on ostree
  * to do the right thing.
@@ -3770,6 +4646,34 @@ flatpak_dir_lock (FlatpakDir   *self,
   return glnx_make_lock_file (AT_FDCWD, lock_path, LOCK_EX, lockfile, error);
 }
 
+/* This is an exclusive lock on the deployments of a single ref, which is
+ * held for the whole time a ref is deployed, updated or uninstalled. The
+ * slow parts of a deploy, like checking out the files, only hold this
+ * lock and not the one from flatpak_dir_lock(), so different refs can be
+ * deployed at the same time. If both are needed this one must be taken
+ * first.
+ */
+gboolean
+flatpak_dir_lock_ref (FlatpakDir        *self,
+                      FlatpakDecomposed *ref,
+                      GLnxLockFile      *lockfile,
+                      GCancellable      *cancellable,
+                      GError           **error)
+{
+  g_autoptr(GFile) locks_dir = g_file_get_child (flatpak_dir_get_path (self), "ref-locks");
+  g_autofree char *lock_name = NULL;
+  g_autofree char *lock_path = NULL;
+
+  if (!flatpak_mkdir_p (locks_dir, cancellable, error))
+    return FALSE;
+
+  /* Colons can't appear in refs, unlike dashes and underscores */
+  lock_name = g_strdelimit (g_strconcat (flatpak_decomposed_get_ref (ref), ".lock", NULL), "/", ':');
+  lock_path = g_build_filename (flatpak_file_get_path_cached (locks_dir), lock_name, NULL);
+
+  return glnx_make_lock_file (AT_FDCWD, lock_path, LOCK_EX, lockfile, error);
+}
+
 
 /* This is an lock that protects the repo itself. Any operation that
  * relies on objects not disappearing from the repo need to hold this
@@ -4149,6 +5053,78 @@ add_commit_metadata_to_deploy_data (GVariantDict *metadata_dict,
                                  g_variant_new_string (eol_rebase));
 }
 
+/* The refs that a deployed ref depends on, apart from the application
+ * runtime which is already stored as "runtime". Together the deployed refs
+ * form a dependency graph, which is what find_used_refs() walks, so this
+ * must be kept in sync with it. Extension points are stored rather than the
+ * extensions themselves, because which extensions match depends on what
+ * else is installed. */
+static void
+add_dependencies_to_deploy_data (GVariantDict *metadata_dict,
+                                 GKeyFile     *keyfile)
+{
+  g_auto(GStrv) groups = NULL;
+  g_autofree char *sdk = NULL;
+  gboolean is_app = g_key_file_has_group (keyfile, FLATPAK_METADATA_GROUP_APPLICATION);
+  g_autoptr(GVariantBuilder) extension_points = g_variant_builder_new (G_VARIANT_TYPE ("a(sasbs)"));
+
+  sdk = g_key_file_get_string (keyfile,
+                               is_app ? FLATPAK_METADATA_GROUP_APPLICATION : FLATPAK_METADATA_GROUP_RUNTIME,
+                               FLATPAK_METADATA_KEY_SDK, NULL);
+  if (sdk)
+    g_variant_dict_insert_value (metadata_dict, "sdk", g_variant_new_string (sdk));
+
+  /* Extensions with extra data need the runtime at install time */
+  if (!is_app &&
+      g_key_file_has_group (keyfile, FLATPAK_METADATA_GROUP_EXTRA_DATA) &&
+      !g_key_file_get_boolean (keyfile, FLATPAK_METADATA_GROUP_EXTRA_DATA, FLATPAK_METADATA_KEY_NO_RUNTIME, NULL))
+    {
+      g_autofree char *extension_runtime = g_key_file_get_string (keyfile, FLATPAK_METADATA_GROUP_EXTENSION_OF,
+                                                                  FLATPAK_METADATA_KEY_RUNTIME, NULL);
+      if (extension_runtime)
+        g_variant_dict_insert_value (metadata_dict, "extra-data-runtime",
+                                     g_variant_new_string (extension_runtime));
+    }
+
+  groups = g_key_file_get_groups (keyfile, NULL);
+  for (int i = 0; groups[i] != NULL; i++)
+    {
+      const char *tagged_extension;
+      g_autofree char *extension = NULL;
+      g_autofree char *version = NULL;
+      g_autofree char *autoprune_unless = NULL;
+      g_auto(GStrv) versions = NULL;
+      gboolean subdirectories;
+
+      if (!g_str_has_prefix (groups[i], FLATPAK_METADATA_GROUP_PREFIX_EXTENSION) ||
+          *(tagged_extension = (groups[i] + strlen (FLATPAK_METADATA_GROUP_PREFIX_EXTENSION))) == 0)
+        continue;
+
+      flatpak_parse_extension_with_tag (tagged_extension, &extension, NULL);
+
+      version = g_key_file_get_string (keyfile, groups[i], FLATPAK_METADATA_KEY_VERSION, NULL);
+      versions = g_key_file_get_string_list (keyfile, groups[i], FLATPAK_METADATA_KEY_VERSIONS, NULL, NULL);
+      subdirectories = g_key_file_get_boolean (keyfile, groups[i], FLATPAK_METADATA_KEY_SUBDIRECTORIES, NULL);
+      autoprune_unless = g_key_file_get_string (keyfile, groups[i], FLATPAK_METADATA_KEY_AUTOPRUNE_UNLESS, NULL);
+
+      /* No branches means the branch of the ref itself */
+      if (versions == NULL && version != NULL)
+        {
+          versions = g_new0 (char *, 2);
+          versions[0] = g_steal_pointer (&version);
+        }
+
+      g_variant_builder_add (extension_points, "(s^asbs)",
+                             extension,
+                             versions ? versions : (char *[]) { NULL },
+                             subdirectories,
+                             autoprune_unless ? autoprune_unless : "");
+    }
+
+  g_variant_dict_insert_value (metadata_dict, "extension-points",
+                               g_variant_builder_end (extension_points));
+}
+
 static void
 add_metadata_to_deploy_data (GVariantDict *metadata_dict,
                              GKeyFile     *keyfile)
@@ -4169,6 +5145,8 @@ add_metadata_to_deploy_data (GVariantDict *metadata_dict,
   if (extension_of)
     g_variant_dict_insert_value (metadata_dict, "extension-of",
                                  g_variant_new_string (extension_of));
+
+  add_dependencies_to_deploy_data (metadata_dict, keyfile);
 }
 
 static GBytes *
@@ -4182,7 +5160,8 @@ flatpak_dir_new_deploy_data (FlatpakDir         *self,
                              const char         *commit,
                              char              **subpaths,
                              guint64             installed_size,
-                             const char * const *previous_ids)
+                             const char * const *previous_ids,
+                             const char         *export_checksum)
 {
   char *empty_subpaths[] = {NULL};
   g_auto(GVariantDict) metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
@@ -4198,6 +5177,10 @@ flatpak_dir_new_deploy_data (FlatpakDir         *self,
     g_variant_dict_insert_value (&metadata_dict, "previous-ids",
                                  g_variant_new_strv (previous_ids, -1));
 
+  if (export_checksum)
+    g_variant_dict_insert_value (&metadata_dict, "export-checksum",
+                                 g_variant_new_string (export_checksum));
+
   add_commit_metadata_to_deploy_data (&metadata_dict, commit_metadata);
   add_metadata_to_deploy_data (&metadata_dict, metadata);
   add_appdata_to_deploy_data (&metadata_dict, deploy_dir, id);
@@ -4265,10 +5248,6 @@ upgrade_deploy_data (GBytes             *deploy_data,
       const char *commit;
       g_autoptr(GVariant) commit_data = NULL;
       g_autoptr(GVariant) commit_metadata = NULL;
-      g_autoptr(GKeyFile) keyfile = NULL;
-      g_autoptr(GFile) metadata_file = NULL;
-      g_autofree char *metadata_contents = NULL;
-      gsize metadata_size = 0;
       g_autofree char *id = flatpak_decomposed_dup_id (ref);
 
       /* Add fields from commit metadata to deploy */
@@ -4278,6 +5257,21 @@ upgrade_deploy_data (GBytes             *deploy_data,
       commit_metadata = g_variant_get_child_value (commit_data, 0);
       add_commit_metadata_to_deploy_data (&metadata_dict, commit_metadata);
 
+      /* Add fields from appdata to deploy, since appdata-content-rating wasn't
+       * added when upgrading from version 2 as it should have been
+       */
+      if (old_version >= 1)
+        add_appdata_to_deploy_data (&metadata_dict, deploy_dir, id);
+    }
+
+  /* Version 5 added the dependencies of the ref */
+  if (old_version < 5)
+    {
+      g_autoptr(GKeyFile) keyfile = NULL;
+      g_autoptr(GFile) metadata_file = NULL;
+      g_autofree char *metadata_contents = NULL;
+      gsize metadata_size = 0;
+
       /* Add fields from metadata file to deploy */
       keyfile = g_key_file_new ();
       metadata_file = g_file_resolve_relative_path (deploy_dir, "metadata");
@@ -4287,12 +5281,6 @@ upgrade_deploy_data (GBytes             *deploy_data,
       if (!g_key_file_load_from_data (keyfile, metadata_contents, metadata_size, 0, error))
         return glnx_prefix_error_null (error, "%s", flatpak_file_get_path_cached (metadata_file));
       add_metadata_to_deploy_data (&metadata_dict, keyfile);
-
-      /* Add fields from appdata to deploy, since appdata-content-rating wasn't
-       * added when upgrading from version 2 as it should have been
-       */
-      if (old_version >= 1)
-        add_appdata_to_deploy_data (&metadata_dict, deploy_dir, id);
     }
 
   subpaths = flatpak_deploy_data_get_subpaths (deploy_data);
@@ -4305,65 +5293,466 @@ upgrade_deploy_data (GBytes             *deploy_data,
   return g_variant_get_data_as_bytes (res);
 }
 
-GBytes *
-flatpak_dir_get_deploy_data (FlatpakDir        *self,
-                             FlatpakDecomposed *ref,
-                             int                required_version,
-                             GCancellable      *cancellable,
-                             GError           **error)
+/* The index of deployed refs keeps the deploy data of every deployed ref
+ * in a single file, so listing the installation doesn't have to walk the
+ * deploy dirs and load each deploy file. It is only used while .changed
+ * has the stamp it was written with, which catches changes made by other
+ * versions of flatpak. Writers unlink it before changing what is
+ * deployed and write it back once they are done, so it is never out of
+ * date if they get interrupted. */
+#define FLATPAK_DEPLOYED_INDEX ".deployed-index"
+#define FLATPAK_DEPLOYED_INDEX_LOCK ".deployed-index-lock"
+/* The mtime (seconds, nanoseconds) and inode of .changed, and the deploy
+ * data of each deployed ref, sorted by ref */
+#define FLATPAK_DEPLOYED_INDEX_FORMAT "(ttta(say))"
+
+static gboolean
+get_changed_stamp (FlatpakDir *self,
+                   guint64    *mtime_sec,
+                   guint64    *mtime_nsec,
+                   guint64    *ino)
 {
-  g_autoptr(GFile) deploy_dir = NULL;
+  g_autoptr(GFile) changed_file = flatpak_dir_get_changed_path (self);
+  struct stat stbuf;
 
-  deploy_dir = flatpak_dir_get_if_deployed (self, ref, NULL, cancellable);
-  if (deploy_dir == NULL)
+  if (stat (flatpak_file_get_path_cached (changed_file), &stbuf) != 0)
+    return FALSE;
+
+  *mtime_sec = stbuf.st_mtim.tv_sec;
+  *mtime_nsec = stbuf.st_mtim.tv_nsec;
+  *ino = stbuf.st_ino;
+
+  return TRUE;
+}
+
+static gboolean
+lock_deployed_index (FlatpakDir   *self,
+                     GLnxLockFile *lockfile)
+{
+  g_autoptr(GFile) lock_file = g_file_get_child (flatpak_dir_get_path (self), FLATPAK_DEPLOYED_INDEX_LOCK);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!glnx_make_lock_file (AT_FDCWD, flatpak_file_get_path_cached (lock_file), LOCK_EX,
+                            lockfile, &local_error))
     {
-      g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED,
-                   _("%s not installed"), flatpak_decomposed_get_ref (ref));
-      return NULL;
+      g_info ("Failed to lock the deployed index: %s", local_error->message);
+      return FALSE;
     }
 
-  if (!flatpak_dir_ensure_repo (self, cancellable, error))
-    return NULL;
-
-  return flatpak_load_deploy_data (deploy_dir,
-                                   ref,
-                                   self->repo,
-                                   required_version,
-                                   cancellable,
-                                   error);
+  return TRUE;
 }
 
-char *
-flatpak_dir_get_origin (FlatpakDir        *self,
-                        FlatpakDecomposed *ref,
-                        GCancellable      *cancellable,
-                        GError           **error)
+/* Returns the index of deployed refs, or %NULL if it is missing or out of date */
+static GVariant *
+flatpak_dir_get_deployed_index (FlatpakDir *self)
 {
-  g_autoptr(GBytes) deploy_data = NULL;
+  g_autoptr(GFile) index_file = g_file_get_child (flatpak_dir_get_path (self), FLATPAK_DEPLOYED_INDEX);
+  g_autoptr(GVariant) index = NULL;
+  guint64 mtime_sec, mtime_nsec, ino;
+  guint64 index_mtime_sec, index_mtime_nsec, index_ino;
+  struct stat stbuf;
 
-  deploy_data = flatpak_dir_get_deploy_data (self, ref, FLATPAK_DEPLOY_VERSION_ANY,
-                                             cancellable, error);
-  if (deploy_data == NULL)
+  if (stat (flatpak_file_get_path_cached (index_file), &stbuf) != 0)
     return NULL;
 
-  return g_strdup (flatpak_deploy_data_get_origin (deploy_data));
+  G_LOCK (deployed_index);
+  if (self->deployed_index != NULL &&
+      self->deployed_index_stat.st_dev == stbuf.st_dev &&
+      self->deployed_index_stat.st_ino == stbuf.st_ino &&
+      self->deployed_index_stat.st_size == stbuf.st_size &&
+      self->deployed_index_stat.st_mtim.tv_sec == stbuf.st_mtim.tv_sec &&
+      self->deployed_index_stat.st_mtim.tv_nsec == stbuf.st_mtim.tv_nsec)
+    index = g_variant_ref (self->deployed_index);
+  G_UNLOCK (deployed_index);
+
+  if (index == NULL)
+    {
+      g_autoptr(GMappedFile) mfile = NULL;
+      g_autoptr(GBytes) bytes = NULL;
+      glnx_autofd int fd = -1;
+
+      if (!glnx_openat_rdonly (AT_FDCWD, flatpak_file_get_path_cached (index_file), TRUE, &fd, NULL) ||
+          fstat (fd, &stbuf) != 0)
+        return NULL;
+
+      mfile = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+      if (mfile == NULL)
+        return NULL;
+
+      bytes = g_mapped_file_get_bytes (mfile);
+      index = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_DEPLOYED_INDEX_FORMAT),
+                                                            bytes, FALSE));
+
+      G_LOCK (deployed_index);
+      g_clear_pointer (&self->deployed_index, g_variant_unref);
+      self->deployed_index = g_variant_ref (index);
+      self->deployed_index_stat = stbuf;
+      G_UNLOCK (deployed_index);
+    }
+
+  if (!get_changed_stamp (self, &mtime_sec, &mtime_nsec, &ino))
+    return NULL;
+
+  g_variant_get_child (index, 0, "t", &index_mtime_sec);
+  g_variant_get_child (index, 1, "t", &index_mtime_nsec);
+  g_variant_get_child (index, 2, "t", &index_ino);
+  if (mtime_sec != index_mtime_sec || mtime_nsec != index_mtime_nsec || ino != index_ino)
+    return NULL;
+
+  return g_steal_pointer (&index);
 }
 
-gboolean
-flatpak_dir_ensure_path (FlatpakDir   *self,
-                         GCancellable *cancellable,
-                         GError      **error)
+static GBytes *
+deployed_index_lookup (GVariant          *index,
+                       FlatpakDecomposed *ref)
 {
-  /* In the system case, we use default perms */
-  if (!self->user)
-    return flatpak_mkdir_p (self->basedir, cancellable, error);
-  else
+  g_autoptr(GVariant) entries = g_variant_get_child_value (index, 3);
+  const char *ref_str = flatpak_decomposed_get_ref (ref);
+  gsize lo = 0;
+  gsize hi = g_variant_n_children (entries);
+
+  while (lo < hi)
     {
-      /* First make the parent */
-      g_autoptr(GFile) parent = g_file_get_parent (self->basedir);
-      if (!flatpak_mkdir_p (parent, cancellable, error))
-        return FALSE;
-      glnx_autofd int parent_dfd = -1;
+      gsize mid = lo + (hi - lo) / 2;
+      g_autoptr(GVariant) entry = g_variant_get_child_value (entries, mid);
+      const char *entry_ref;
+      int cmp;
+
+      g_variant_get_child (entry, 0, "&s", &entry_ref);
+      cmp = strcmp (ref_str, entry_ref);
+      if (cmp == 0)
+        {
+          g_autoptr(GVariant) deploy_data = g_variant_get_child_value (entry, 1);
+
+          /* Copied, as the deploy data in the index isn't aligned */
+          return g_bytes_new (g_variant_get_data (deploy_data), g_variant_get_size (deploy_data));
+        }
+      else if (cmp < 0)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+  return NULL;
+}
+
+static GPtrArray *
+deployed_index_list_refs (GVariant     *index,
+                          FlatpakKinds  kinds,
+                          const char   *name)
+{
+  g_autoptr(GVariant) entries = g_variant_get_child_value (index, 3);
+  g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func ((GDestroyNotify)flatpak_decomposed_unref);
+  gsize n_entries = g_variant_n_children (entries);
+  gsize i;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      g_autoptr(GVariant) entry = g_variant_get_child_value (entries, i);
+      g_autoptr(FlatpakDecomposed) ref = NULL;
+      const char *entry_ref;
+
+      g_variant_get_child (entry, 0, "&s", &entry_ref);
+      ref = flatpak_decomposed_new_from_ref (entry_ref, NULL);
+      if (ref == NULL ||
+          (flatpak_decomposed_get_kinds (ref) & kinds) == 0 ||
+          (name != NULL && !flatpak_decomposed_is_id (ref, name)))
+        continue;
+
+      g_ptr_array_add (refs, g_steal_pointer (&ref));
+    }
+
+  g_ptr_array_sort (refs, (GCompareFunc)flatpak_decomposed_strcmp_p);
+
+  return g_steal_pointer (&refs);
+}
+
+static int
+compare_deployed_index_entries (gconstpointer a,
+                                gconstpointer b)
+{
+  GVariant *entry_a = *(GVariant **) a;
+  GVariant *entry_b = *(GVariant **) b;
+  const char *ref_a, *ref_b;
+
+  g_variant_get_child (entry_a, 0, "&s", &ref_a);
+  g_variant_get_child (entry_b, 0, "&s", &ref_b);
+
+  return strcmp (ref_a, ref_b);
+}
+
+/* Writes the index with the current stamp of .changed, must be called
+ * with the index locked */
+static void
+write_deployed_index (FlatpakDir   *self,
+                      GPtrArray    *entries,
+                      GCancellable *cancellable)
+{
+  g_autoptr(GFile) index_file = g_file_get_child (flatpak_dir_get_path (self), FLATPAK_DEPLOYED_INDEX);
+  g_autoptr(GVariant) index = NULL;
+  g_autoptr(GError) local_error = NULL;
+  guint64 mtime_sec, mtime_nsec, ino;
+
+  if (!get_changed_stamp (self, &mtime_sec, &mtime_nsec, &ino))
+    return;
+
+  g_ptr_array_sort (entries, compare_deployed_index_entries);
+
+  index = g_variant_ref_sink (g_variant_new ("(ttt@a(say))",
+                                             mtime_sec, mtime_nsec, ino,
+                                             g_variant_new_array (G_VARIANT_TYPE ("(say)"),
+                                                                  (GVariant **) entries->pdata,
+                                                                  entries->len)));
+
+  if (!glnx_file_replace_contents_at (AT_FDCWD, flatpak_file_get_path_cached (index_file),
+                                      g_variant_get_data (index), g_variant_get_size (index),
+                                      GLNX_FILE_REPLACE_NODATASYNC,
+                                      cancellable, &local_error))
+    g_info ("Failed to write the deployed index: %s", local_error->message);
+}
+
+static GPtrArray *
+deployed_index_get_entries (GVariant *index)
+{
+  g_autoptr(GVariant) old_entries = g_variant_get_child_value (index, 3);
+  g_autoptr(GPtrArray) entries = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  gsize n_entries = g_variant_n_children (old_entries);
+  gsize i;
+
+  for (i = 0; i < n_entries; i++)
+    g_ptr_array_add (entries, g_variant_get_child_value (old_entries, i));
+
+  return g_steal_pointer (&entries);
+}
+
+/* Returns %NULL without setting @error if @ref isn't deployed */
+static GVariant *
+make_deployed_index_entry (FlatpakDir        *self,
+                           FlatpakDecomposed *ref,
+                           GCancellable      *cancellable,
+                           GError           **error)
+{
+  g_autoptr(GFile) deploy_dir = NULL;
+  g_autoptr(GBytes) deploy_data = NULL;
+
+  deploy_dir = flatpak_dir_get_if_deployed (self, ref, NULL, cancellable);
+  if (deploy_dir == NULL)
+    return NULL;
+
+  deploy_data = flatpak_load_deploy_data (deploy_dir, ref, self->repo,
+                                          FLATPAK_DEPLOY_VERSION_CURRENT,
+                                          cancellable, error);
+  if (deploy_data == NULL)
+    return NULL;
+
+  return g_variant_ref_sink (g_variant_new ("(s@ay)", flatpak_decomposed_get_ref (ref),
+                                            g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING,
+                                                                      deploy_data, TRUE)));
+}
+
+/* Removes the index of deployed refs before changing what is deployed,
+ * and returns what it contained if it was up to date. Must be called
+ * with the dir lock held. */
+static GVariant *
+flatpak_dir_take_deployed_index (FlatpakDir *self)
+{
+  g_auto(GLnxLockFile) lock = { 0, };
+  g_autoptr(GFile) index_file = g_file_get_child (flatpak_dir_get_path (self), FLATPAK_DEPLOYED_INDEX);
+  g_autoptr(GVariant) index = NULL;
+
+  if (!lock_deployed_index (self, &lock))
+    return NULL;
+
+  index = flatpak_dir_get_deployed_index (self);
+
+  if (unlink (flatpak_file_get_path_cached (index_file)) != 0 && errno != ENOENT)
+    g_info ("Failed to remove the deployed index: %s", g_strerror (errno));
+
+  return g_steal_pointer (&index);
+}
+
+/* Drops the index of deployed refs, so it is rebuilt from the deploy
+ * dirs the next time something is deployed */
+void
+flatpak_dir_drop_deployed_index (FlatpakDir *self)
+{
+  GVariant *index = flatpak_dir_take_deployed_index (self);
+
+  g_clear_pointer (&index, g_variant_unref);
+}
+
+/* Writes the index of deployed refs back after @ref was deployed or
+ * removed. If @old_index is %NULL, the index is rebuilt from the deploy
+ * dirs. Must be called with the dir lock held. Failing to save it isn't
+ * fatal, the readers then walk the deploy dirs instead. */
+static void
+flatpak_dir_save_deployed_index (FlatpakDir        *self,
+                                 GVariant          *old_index,
+                                 FlatpakDecomposed *ref,
+                                 GCancellable      *cancellable)
+{
+  g_auto(GLnxLockFile) lock = { 0, };
+  g_autoptr(GPtrArray) entries = NULL;
+  g_autoptr(GVariant) entry = NULL;
+  g_autoptr(GError) local_error = NULL;
+  guint i;
+
+  if (!lock_deployed_index (self, &lock))
+    return;
+
+  if (old_index != NULL)
+    {
+      const char *ref_str = flatpak_decomposed_get_ref (ref);
+
+      entries = deployed_index_get_entries (old_index);
+      for (i = 0; i < entries->len; i++)
+        {
+          const char *entry_ref;
+
+          g_variant_get_child (g_ptr_array_index (entries, i), 0, "&s", &entry_ref);
+          if (strcmp (entry_ref, ref_str) == 0)
+            {
+              g_ptr_array_remove_index_fast (entries, i);
+              break;
+            }
+        }
+
+      /* Bring entries written by an older version up to date, so readers
+       * asking for the current deploy version don't miss the index */
+      for (i = 0; i < entries->len && local_error == NULL; i++)
+        {
+          GVariant *old_entry = g_ptr_array_index (entries, i);
+          g_autoptr(GVariant) old_deploy_data = g_variant_get_child_value (old_entry, 1);
+          g_autoptr(GBytes) old_bytes = g_bytes_new (g_variant_get_data (old_deploy_data),
+                                                     g_variant_get_size (old_deploy_data));
+          g_autoptr(FlatpakDecomposed) entry_ref = NULL;
+          const char *entry_ref_str;
+
+          if (flatpak_deploy_data_get_version (old_bytes) >= FLATPAK_DEPLOY_VERSION_CURRENT)
+            continue;
+
+          g_variant_get_child (old_entry, 0, "&s", &entry_ref_str);
+          entry_ref = flatpak_decomposed_new_from_ref (entry_ref_str, NULL);
+          if (entry_ref == NULL)
+            continue;
+
+          entry = make_deployed_index_entry (self, entry_ref, cancellable, &local_error);
+          if (entry != NULL)
+            {
+              g_variant_unref (g_ptr_array_index (entries, i));
+              g_ptr_array_index (entries, i) = g_steal_pointer (&entry);
+            }
+        }
+
+      entry = make_deployed_index_entry (self, ref, cancellable, &local_error);
+      if (entry != NULL)
+        g_ptr_array_add (entries, g_steal_pointer (&entry));
+    }
+  else
+    {
+      g_autoptr(GPtrArray) refs = NULL;
+
+      entries = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+      refs = flatpak_dir_scan_refs (self, FLATPAK_KINDS_APP | FLATPAK_KINDS_RUNTIME,
+                                    cancellable, &local_error);
+      for (i = 0; refs != NULL && i < refs->len && local_error == NULL; i++)
+        {
+          entry = make_deployed_index_entry (self, g_ptr_array_index (refs, i), cancellable, &local_error);
+          if (entry != NULL)
+            g_ptr_array_add (entries, g_steal_pointer (&entry));
+        }
+    }
+
+  if (local_error != NULL)
+    {
+      g_info ("Failed to update the deployed index: %s", local_error->message);
+      return;
+    }
+
+  write_deployed_index (self, entries, cancellable);
+}
+
+GBytes *
+flatpak_dir_get_deploy_data (FlatpakDir        *self,
+                             FlatpakDecomposed *ref,
+                             int                required_version,
+                             GCancellable      *cancellable,
+                             GError           **error)
+{
+  g_autoptr(GFile) deploy_dir = NULL;
+  g_autoptr(GVariant) index = NULL;
+
+  index = flatpak_dir_get_deployed_index (self);
+  if (index != NULL)
+    {
+      g_autoptr(GBytes) deploy_data = deployed_index_lookup (index, ref);
+
+      if (deploy_data == NULL)
+        {
+          g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED,
+                       _("%s not installed"), flatpak_decomposed_get_ref (ref));
+          return NULL;
+        }
+
+      if (flatpak_deploy_data_get_version (deploy_data) >= required_version)
+        {
+          if (!flatpak_dir_ensure_repo (self, cancellable, error))
+            return NULL;
+
+          return g_steal_pointer (&deploy_data);
+        }
+    }
+
+  deploy_dir = flatpak_dir_get_if_deployed (self, ref, NULL, cancellable);
+  if (deploy_dir == NULL)
+    {
+      g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED,
+                   _("%s not installed"), flatpak_decomposed_get_ref (ref));
+      return NULL;
+    }
+
+  if (!flatpak_dir_ensure_repo (self, cancellable, error))
+    return NULL;
+
+  return flatpak_load_deploy_data (deploy_dir,
+                                   ref,
+                                   self->repo,
+                                   required_version,
+                                   cancellable,
+                                   error);
+}
+
+char *
+flatpak_dir_get_origin (FlatpakDir        *self,
+                        FlatpakDecomposed *ref,
+                        GCancellable      *cancellable,
+                        GError           **error)
+{
+  g_autoptr(GBytes) deploy_data = NULL;
+
+  deploy_data = flatpak_dir_get_deploy_data (self, ref, FLATPAK_DEPLOY_VERSION_ANY,
+                                             cancellable, error);
+  if (deploy_data == NULL)
+    return NULL;
+
+  return g_strdup (flatpak_deploy_data_get_origin (deploy_data));
+}
+
+gboolean
+flatpak_dir_ensure_path (FlatpakDir   *self,
+                         GCancellable *cancellable,
+                         GError      **error)
+{
+  /* In the system case, we use default perms */
+  if (!self->user)
+    return flatpak_mkdir_p (self->basedir, cancellable, error);
+  else
+    {
+      /* First make the parent */
+      g_autoptr(GFile) parent = g_file_get_parent (self->basedir);
+      if (!flatpak_mkdir_p (parent, cancellable, error))
+        return FALSE;
+      glnx_autofd int parent_dfd = -1;
       if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (parent), TRUE,
                            &parent_dfd, error))
         return FALSE;
@@ -4491,8 +5880,10 @@ flatpak_dir_recreate_repo (FlatpakDir   *self,
 
   G_LOCK (config_cache);
 
-  g_clear_pointer (&self->masked, g_regex_unref);
-  g_clear_pointer (&self->pinned, g_regex_unref);
+  g_clear_pointer (&self->masked, flatpak_filter_unref);
+  g_clear_pointer (&self->pinned, flatpak_filter_unref);
+  g_clear_pointer (&self->remote_configs, g_hash_table_unref);
+  g_clear_pointer (&self->remote_configs_keyfile, g_key_file_unref);
 
   G_UNLOCK (config_cache);
 
@@ -4755,6 +6146,11 @@ _flatpak_dir_ensure_repo (FlatpakDir   *self,
   if (self->repo != NULL)
     return TRUE;
 
+  /* A repo handed back by an earlier clone has already been through all of
+   * the below, and nothing changed its config since */
+  if (flatpak_dir_take_repo_from_pool (self))
+    return TRUE;
+
   /* Don't trigger polkit prompts if we are just doing this opportunistically */
   if (allow_empty)
     ensure_flags |= FLATPAK_HELPER_ENSURE_REPO_FLAGS_NO_INTERACTION;
@@ -4947,6 +6343,11 @@ _flatpak_dir_ensure_repo (FlatpakDir   *self,
   self->repo = g_object_ref (repo);
   self->cache_dir = g_object_ref (cache_dir);
 
+  /* Only clones hand their repo back to a pool */
+  if (self->clone_parent != NULL &&
+      !stat_repo_config (self, &self->repo_config_stat))
+    g_clear_object (&self->clone_parent);
+
   return TRUE;
 }
 
@@ -4980,8 +6381,10 @@ _flatpak_dir_reload_config (FlatpakDir   *self,
   /* Clear cached stuff from repo config */
   G_LOCK (config_cache);
 
-  g_clear_pointer (&self->masked, g_regex_unref);
-  g_clear_pointer (&self->pinned, g_regex_unref);
+  g_clear_pointer (&self->masked, flatpak_filter_unref);
+  g_clear_pointer (&self->pinned, flatpak_filter_unref);
+  g_clear_pointer (&self->remote_configs, g_hash_table_unref);
+  g_clear_pointer (&self->remote_configs_keyfile, g_key_file_unref);
 
   G_UNLOCK (config_cache);
   return TRUE;
@@ -5153,19 +6556,33 @@ flatpak_dir_mark_changed (FlatpakDir *self,
 {
   g_autoptr(GFile) changed_file = NULL;
   g_autofree char * changed_path = NULL;
+  g_auto(GLnxLockFile) index_lock = { 0, };
+  g_autoptr(GVariant) index = NULL;
 
   changed_file = flatpak_dir_get_changed_path (self);
   changed_path = g_file_get_path (changed_file);
 
-  if (!g_utime (changed_path, NULL))
-    return TRUE;
+  /* What is deployed doesn't change here, so carry the deployed index
+   * over to the new stamp. Deploys remove it while they run. */
+  if (lock_deployed_index (self, &index_lock))
+    index = flatpak_dir_get_deployed_index (self);
 
-  if (errno != ENOENT)
-    return glnx_throw_errno (error);
+  if (g_utime (changed_path, NULL) != 0)
+    {
+      if (errno != ENOENT)
+        return glnx_throw_errno (error);
 
-  if (!g_file_replace_contents (changed_file, "", 0, NULL, FALSE,
-                                G_FILE_CREATE_NONE, NULL, NULL, error))
-    return FALSE;
+      if (!g_file_replace_contents (changed_file, "", 0, NULL, FALSE,
+                                    G_FILE_CREATE_NONE, NULL, NULL, error))
+        return FALSE;
+    }
+
+  if (index != NULL)
+    {
+      g_autoptr(GPtrArray) entries = deployed_index_get_entries (index);
+
+      write_deployed_index (self, entries, NULL);
+    }
 
   return TRUE;
 }
@@ -5320,52 +6737,800 @@ remove_old_deploy_tmpdirs (GFile *dir)
     }
 }
 
-gboolean
-flatpak_dir_deploy_appstream (FlatpakDir   *self,
-                              const char   *remote,
-                              const char   *arch,
-                              gboolean     *out_changed,
-                              GCancellable *cancellable,
-                              GError      **error)
+/* These are rewritten on every deploy (uncompressed, filtered or indexed),
+ * so an incremental checkout never reuses them from the old checkout */
+static const char *appstream_regenerated_files[] = {
+  "appstream.xml",
+  "appstream.xml.gz",
+  FLATPAK_APPSTREAM_SEARCH_INDEX,
+  NULL
+};
+
+static gboolean
+path_is_under (const char          *path,
+               const char * const *prefixes)
 {
-  g_autoptr(GFile) appstream_dir = NULL;
-  g_autoptr(GFile) remote_dir = NULL;
-  g_autoptr(GFile) arch_dir = NULL;
-  g_autoptr(GFile) checkout_dir = NULL;
-  g_autoptr(GFile) real_checkout_dir = NULL;
-  g_autoptr(GFile) timestamp_file = NULL;
-  g_autofree char *arch_path = NULL;
-  gboolean checkout_exists;
-  const char *old_dir = NULL;
-  g_autofree char *new_checksum = NULL;
-  g_autoptr(GFile) active_link = NULL;
-  g_autofree char *branch = NULL;
-  g_autoptr(GFile) old_checkout_dir = NULL;
-  g_autoptr(GFile) active_tmp_link = NULL;
-  g_autoptr(GError) tmp_error = NULL;
-  g_autofree char *new_dir = NULL;
-  OstreeRepoCheckoutAtOptions options = { 0, };
-  glnx_autofd int dfd = -1;
-  g_autoptr(GFileInfo) file_info = NULL;
-  g_autofree char *tmpname = g_strdup (".active-XXXXXX");
-  g_auto(GLnxLockFile) lock = { 0, };
-  gboolean do_compress = FALSE;
-  gboolean do_uncompress = TRUE;
-  g_autofree char *filter_checksum = NULL;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
-  g_autofree char *subset = NULL;
-  g_auto(GLnxTmpDir) tmpdir = { 0, };
-  g_autoptr(FlatpakTempDir) tmplink = NULL;
+  gsize i;
 
-  /* Keep a shared repo lock to avoid prunes removing objects we're relying on
-   * while we do the checkout. This could happen if the ref changes after we
-   * read its current value for the checkout. */
-  if (!flatpak_dir_repo_lock (self, &lock, LOCK_SH, cancellable, error))
-    return FALSE;
+  for (i = 0; prefixes[i] != NULL; i++)
+    {
+      gsize len = strlen (prefixes[i]);
 
-  if (!flatpak_dir_lookup_remote_filter (self, remote, TRUE, &filter_checksum, &allow_refs, &deny_refs, error))
-    return FALSE;
+      if (strncmp (path, prefixes[i], len) == 0 &&
+          (path[len] == '\0' || path[len] == '/'))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Recreates the tree at @src_dfd in @dst_dfd with hardlinks, or with
+ * reflinked copies if @clone, leaving out @skip_paths (relative to the
+ * toplevel, @prefix being the path of @src_dfd in it) */
+static gboolean
+link_tree_at (int                  src_dfd,
+              int                  dst_dfd,
+              const char          *prefix,
+              const char * const  *skip_paths,
+              gboolean             clone,
+              GCancellable        *cancellable,
+              GError             **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+
+  if (!glnx_dirfd_iterator_init_at (src_dfd, ".", FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      g_autofree char *path = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      path = prefix ? g_build_filename (prefix, dent->d_name, NULL) : g_strdup (dent->d_name);
+      if (g_strv_contains (skip_paths, path))
+        continue;
+
+      if (dent->d_type == DT_DIR)
+        {
+          glnx_autofd int src_child_dfd = -1;
+          glnx_autofd int dst_child_dfd = -1;
+
+          if (!glnx_ensure_dir (dst_dfd, dent->d_name, 0755, error))
+            return FALSE;
+
+          if (!glnx_opendirat (src_dfd, dent->d_name, FALSE, &src_child_dfd, error) ||
+              !glnx_opendirat (dst_dfd, dent->d_name, FALSE, &dst_child_dfd, error))
+            return FALSE;
+
+          if (!link_tree_at (src_child_dfd, dst_child_dfd, path, skip_paths, clone, cancellable, error))
+            return FALSE;
+        }
+      else if (dent->d_type == DT_LNK)
+        {
+          g_autofree char *target = glnx_readlinkat_malloc (src_dfd, dent->d_name, cancellable, error);
+
+          if (target == NULL)
+            return FALSE;
+
+          if (symlinkat (target, dst_dfd, dent->d_name) != 0)
+            return glnx_throw_errno_prefix (error, "symlinkat(%s)", dent->d_name);
+        }
+      else if (clone)
+        {
+          /* glnx_regfile_copy_bytes() tries FICLONE first */
+          if (!glnx_file_copy_at (src_dfd, dent->d_name, NULL, dst_dfd, dent->d_name,
+                                  GLNX_FILE_COPY_NOXATTRS | GLNX_FILE_COPY_NOCHOWN,
+                                  cancellable, error))
+            return FALSE;
+        }
+      else if (linkat (src_dfd, dent->d_name, dst_dfd, dent->d_name, 0) != 0)
+        return glnx_throw_errno_prefix (error, "linkat(%s)", dent->d_name);
+    }
+
+  return TRUE;
+}
+
+/* Whether @self's filesystem can share blocks between files with
+ * FICLONE, probed once with a pair of anonymous files */
+static gboolean
+flatpak_dir_supports_reflinks (FlatpakDir *self)
+{
+  int supported = g_atomic_int_get (&self->reflinks_supported);
+
+  if (supported == 0)
+    {
+      g_auto(GLnxTmpfile) src = { 0, };
+      g_auto(GLnxTmpfile) dest = { 0, };
+      g_autoptr(GError) local_error = NULL;
+
+      supported = 2;
+#ifdef FICLONE
+      if (glnx_open_tmpfile_linkable_at (AT_FDCWD, flatpak_file_get_path_cached (self->basedir),
+                                         O_RDWR | O_CLOEXEC, &src, &local_error) &&
+          glnx_open_tmpfile_linkable_at (AT_FDCWD, flatpak_file_get_path_cached (self->basedir),
+                                         O_RDWR | O_CLOEXEC, &dest, &local_error) &&
+          glnx_loop_write (src.fd, "flatpak", 7) == 0 &&
+          ioctl (dest.fd, FICLONE, src.fd) == 0)
+        supported = 1;
+#endif
+
+      g_info ("Reflinks are %ssupported in %s", supported == 1 ? "" : "not ",
+              flatpak_file_get_path_cached (self->basedir));
+      g_atomic_int_set (&self->reflinks_supported, supported);
+    }
+
+  return supported == 1;
+}
+
+/* Whether checkouts should copy the files with reflinks rather than
+ * hardlink them to the repo objects, from the checkout-mode config key.
+ * Reflinked files are as quick to create but independent of the objects,
+ * so modifying a deployed file can't corrupt the repo. Falls back to
+ * hardlinks on filesystems without reflinks, where a real copy would be
+ * much slower. */
+static gboolean
+flatpak_dir_checkout_uses_reflinks (FlatpakDir *self)
+{
+  g_autofree char *mode = flatpak_dir_get_config (self, "checkout-mode", NULL);
+
+  return g_strcmp0 (mode, "reflink") == 0 && flatpak_dir_supports_reflinks (self);
+}
+
+static gboolean
+checkout_commit_subpath (FlatpakDir   *self,
+                         GFile        *root,
+                         const char   *checksum,
+                         const char   *checkout_path,
+                         const char   *subpath,
+                         GCancellable *cancellable,
+                         GError      **error)
+{
+  OstreeRepoCheckoutAtOptions options = { 0, };
+  g_autofree char *dirname = g_path_get_dirname (subpath);
+  g_autofree char *destination = NULL;
+  g_autofree char *abs_subpath = g_build_filename ("/", subpath, NULL);
+  g_autoptr(GFile) file = NULL;
+  GFileType type;
+
+  /* Files are checked out into the destination dir, dirs as the destination */
+  file = g_file_resolve_relative_path (root, subpath);
+  type = g_file_query_file_type (file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, cancellable);
+  if (type == G_FILE_TYPE_DIRECTORY)
+    destination = g_build_filename (checkout_path, subpath, NULL);
+  else
+    destination = g_build_filename (checkout_path, dirname, NULL);
+
+  options.mode = OSTREE_REPO_CHECKOUT_MODE_USER;
+  options.overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES;
+  options.enable_fsync = FALSE; /* The caller syncs the whole checkout */
+  options.bareuseronly_dirs = TRUE;
+  options.force_copy = flatpak_dir_checkout_uses_reflinks (self);
+  options.subpath = abs_subpath;
+
+  return ostree_repo_checkout_at (self->repo, &options,
+                                  AT_FDCWD, destination, checksum,
+                                  cancellable, error);
+}
+
+/* Populates @checkout_path for @new_checksum from the existing checkout of
+ * @old_checksum at @old_checkout_path. Unchanged files (typically the vast
+ * majority) are hardlinked (or reflinked, see
+ * flatpak_dir_checkout_uses_reflinks()) and only the changed files are
+ * checked out from the repo. @regenerated_paths are the paths that the caller modifies after
+ * checking out, these are never reused from the old checkout but always
+ * checked out fresh (if they exist in the new commit). Returns %FALSE if
+ * the old commit is no longer available, leaving a partial checkout that
+ * the caller has to remove.
+ */
+static gboolean
+checkout_commit_incremental (FlatpakDir          *self,
+                             const char          *old_checksum,
+                             const char          *old_checkout_path,
+                             const char          *new_checksum,
+                             const char          *checkout_path,
+                             const char * const  *regenerated_paths,
+                             GCancellable        *cancellable,
+                             GError             **error)
+{
+  g_autoptr(GFile) old_root = NULL;
+  g_autoptr(GFile) new_root = NULL;
+  g_autoptr(GPtrArray) modified = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_diff_item_unref);
+  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func (g_object_unref);
+  glnx_autofd int old_dfd = -1;
+  glnx_autofd int checkout_dfd = -1;
+  guint i;
+
+  if (!ostree_repo_read_commit (self->repo, old_checksum, &old_root, NULL, cancellable, error) ||
+      !ostree_repo_read_commit (self->repo, new_checksum, &new_root, NULL, cancellable, error))
+    return FALSE;
+
+  if (!ostree_diff_dirs (OSTREE_DIFF_FLAGS_NONE, old_root, new_root,
+                         modified, removed, added, cancellable, error))
+    return FALSE;
+
+  if (!glnx_opendirat (AT_FDCWD, old_checkout_path, TRUE, &old_dfd, error) ||
+      !glnx_opendirat (AT_FDCWD, checkout_path, TRUE, &checkout_dfd, error))
+    return FALSE;
+
+  if (!link_tree_at (old_dfd, checkout_dfd, NULL, regenerated_paths,
+                     flatpak_dir_checkout_uses_reflinks (self), cancellable, error))
+    return FALSE;
+
+  for (i = 0; i < removed->len; i++)
+    {
+      g_autofree char *path = g_file_get_relative_path (old_root, g_ptr_array_index (removed, i));
+
+      if (path_is_under (path, regenerated_paths))
+        continue;
+
+      if (!glnx_shutil_rm_rf_at (checkout_dfd, path, cancellable, error))
+        return FALSE;
+    }
+
+  for (i = 0; i < modified->len; i++)
+    {
+      OstreeDiffItem *item = g_ptr_array_index (modified, i);
+      g_autofree char *path = g_file_get_relative_path (new_root, item->target);
+
+      if (path_is_under (path, regenerated_paths))
+        continue;
+
+      /* Don't write through the hardlink into the old checkout */
+      if (!glnx_shutil_rm_rf_at (checkout_dfd, path, cancellable, error))
+        return FALSE;
+
+      if (!checkout_commit_subpath (self, new_root, new_checksum, checkout_path, path, cancellable, error))
+        return FALSE;
+    }
+
+  for (i = 0; i < added->len; i++)
+    {
+      g_autofree char *path = g_file_get_relative_path (new_root, g_ptr_array_index (added, i));
+
+      if (path_is_under (path, regenerated_paths))
+        continue;
+
+      if (!checkout_commit_subpath (self, new_root, new_checksum, checkout_path, path, cancellable, error))
+        return FALSE;
+    }
+
+  for (i = 0; regenerated_paths[i] != NULL; i++)
+    {
+      g_autoptr(GFile) file = g_file_resolve_relative_path (new_root, regenerated_paths[i]);
+
+      if (g_file_query_exists (file, cancellable) &&
+          !checkout_commit_subpath (self, new_root, new_checksum, checkout_path,
+                                    regenerated_paths[i], cancellable, error))
+        return FALSE;
+    }
+
+  g_info ("Checked out %s incrementally from %s: %u modified, %u added, %u removed",
+          new_checksum, old_checksum, modified->len, added->len, removed->len);
+
+  return TRUE;
+}
+
+typedef struct
+{
+  FlatpakDir   *self;
+  GFile        *root;
+  const char   *checksum;
+  const char   *checkout_path;
+  GCancellable *cancellable;
+  GMutex        lock;
+  GError       *error;
+} ParallelCheckout;
+
+static void
+parallel_checkout_thread_func (gpointer data,
+                               gpointer user_data)
+{
+  g_autofree char *subpath = data;
+  ParallelCheckout *checkout = user_data;
+  g_autoptr(GError) local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&checkout->lock);
+  failed = checkout->error != NULL;
+  g_mutex_unlock (&checkout->lock);
+
+  /* Don't bother with the rest once a job failed */
+  if (failed)
+    return;
+
+  if (!checkout_commit_subpath (checkout->self, checkout->root, checkout->checksum,
+                                checkout->checkout_path, subpath,
+                                checkout->cancellable, &local_error))
+    {
+      g_mutex_lock (&checkout->lock);
+      if (checkout->error == NULL)
+        checkout->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&checkout->lock);
+    }
+}
+
+/* Splits the checkout of @subpath (or the whole commit if %NULL) into one
+ * job per entry @depth levels down, creating the directories above them */
+static gboolean
+collect_checkout_jobs (GFile        *root,
+                       const char   *checkout_path,
+                       const char   *subpath,
+                       int           depth,
+                       GPtrArray    *jobs,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_autoptr(GFile) dir = subpath ? g_file_resolve_relative_path (root, subpath) : g_object_ref (root);
+  g_autofree char *destination = subpath ? g_build_filename (checkout_path, subpath, NULL) : g_strdup (checkout_path);
+  g_autoptr(GFileEnumerator) enumerator = NULL;
+
+  if (subpath != NULL && depth == 0)
+    {
+      g_ptr_array_add (jobs, g_strdup (subpath));
+      return TRUE;
+    }
+
+  if (subpath != NULL &&
+      g_file_query_file_type (dir, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, cancellable) != G_FILE_TYPE_DIRECTORY)
+    {
+      g_autofree char *parent = g_path_get_dirname (destination);
+
+      /* Files are checked out into their parent */
+      if (g_mkdir_with_parents (parent, 0755) != 0)
+        return glnx_throw_errno_prefix (error, "mkdir(%s)", parent);
+
+      g_ptr_array_add (jobs, g_strdup (subpath));
+      return TRUE;
+    }
+
+  if (g_mkdir_with_parents (destination, 0755) != 0)
+    return glnx_throw_errno_prefix (error, "mkdir(%s)", destination);
+
+  enumerator = g_file_enumerate_children (dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                          G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                          cancellable, error);
+  if (enumerator == NULL)
+    return FALSE;
+
+  while (TRUE)
+    {
+      GFileInfo *info;
+      g_autofree char *child = NULL;
+
+      if (!g_file_enumerator_iterate (enumerator, &info, NULL, cancellable, error))
+        return FALSE;
+
+      if (info == NULL)
+        break;
+
+      if (subpath)
+        child = g_build_filename (subpath, g_file_info_get_name (info), NULL);
+      else
+        child = g_strdup (g_file_info_get_name (info));
+
+      if (!collect_checkout_jobs (root, checkout_path, child, depth - 1, jobs, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Checks out @subpaths of the commit @checksum (or all of it if %NULL) into
+ * @checkout_path, spreading the work over flatpak_dir_get_checkout_jobs()
+ * threads. Large commits are CPU bound on parsing the dirtrees and on
+ * syscall latency, so the work is split by subdirectory: one job for each
+ * directory below the toplevel ones (i.e. files/lib, files/share, …) of a
+ * full checkout, or for each entry of the subpaths.
+ */
+static gboolean
+checkout_commit_parallel (FlatpakDir          *self,
+                          GFile               *root,
+                          const char          *checksum,
+                          const char          *checkout_path,
+                          const char * const  *subpaths,
+                          GCancellable        *cancellable,
+                          GError             **error)
+{
+  ParallelCheckout checkout = { self, root, checksum, checkout_path, cancellable };
+  g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func (g_free);
+  guint n_jobs = flatpak_dir_get_checkout_jobs (self);
+  GThreadPool *pool;
+  gsize i;
+
+  if (subpaths == NULL)
+    {
+      if (!collect_checkout_jobs (root, checkout_path, NULL, 2, jobs, cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      for (i = 0; subpaths[i] != NULL; i++)
+        {
+          if (!collect_checkout_jobs (root, checkout_path, subpaths[i], 1, jobs, cancellable, error))
+            return FALSE;
+        }
+    }
+
+  if (n_jobs <= 1 || jobs->len <= 1)
+    {
+      for (i = 0; i < jobs->len; i++)
+        {
+          if (!checkout_commit_subpath (self, root, checksum, checkout_path,
+                                        g_ptr_array_index (jobs, i), cancellable, error))
+            return FALSE;
+        }
+
+      return TRUE;
+    }
+
+  g_mutex_init (&checkout.lock);
+
+  pool = g_thread_pool_new (parallel_checkout_thread_func, &checkout,
+                            MIN (n_jobs, jobs->len), FALSE, error);
+  if (pool == NULL)
+    {
+      g_mutex_clear (&checkout.lock);
+      return FALSE;
+    }
+
+  for (i = 0; i < jobs->len; i++)
+    g_thread_pool_push (pool, g_strdup (g_ptr_array_index (jobs, i)), NULL);
+
+  /* Waits for all jobs to finish */
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  g_mutex_clear (&checkout.lock);
+
+  g_info ("Checked out %s with %u jobs in %u threads", checksum, jobs->len, MIN (n_jobs, jobs->len));
+
+  if (checkout.error != NULL)
+    {
+      g_propagate_error (error, checkout.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef enum {
+  FLATPAK_DEPLOY_FLUSH_SYNCFS,
+  FLATPAK_DEPLOY_FLUSH_FSYNC,
+  FLATPAK_DEPLOY_FLUSH_NONE,
+} FlatpakDeployFlush;
+
+/* How new checkouts are made durable before they are moved in place,
+ * from the deploy-flush config key:
+ *  - syncfs (the default) syncs the whole filesystem,
+ *  - fsync only syncs the files and directories of the checkout, which
+ *    avoids stalling on unrelated dirty data on shared machines,
+ *  - none doesn't sync at all, for throwaway installations that don't
+ *    need to survive a crash.
+ * Disabling fsync in the ostree repo config implies none.
+ */
+static FlatpakDeployFlush
+flatpak_dir_get_deploy_flush (FlatpakDir *self)
+{
+  g_autofree char *mode = NULL;
+
+  if (ostree_repo_get_disable_fsync (self->repo))
+    return FLATPAK_DEPLOY_FLUSH_NONE;
+
+  mode = flatpak_dir_get_config (self, "deploy-flush", NULL);
+  if (g_strcmp0 (mode, "fsync") == 0)
+    return FLATPAK_DEPLOY_FLUSH_FSYNC;
+  if (g_strcmp0 (mode, "none") == 0)
+    return FLATPAK_DEPLOY_FLUSH_NONE;
+
+  return FLATPAK_DEPLOY_FLUSH_SYNCFS;
+}
+
+/* Syncs the regular files in @path and then the directory itself */
+static gboolean
+fsync_dir_at (int           dfd,
+              const char   *path,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      glnx_autofd int fd = -1;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type != DT_REG)
+        continue;
+
+      if (!glnx_openat_rdonly (iter.fd, dent->d_name, FALSE, &fd, error))
+        return FALSE;
+
+      if (fsync (fd) != 0)
+        return glnx_throw_errno_prefix (error, "fsync(%s)", dent->d_name);
+    }
+
+  if (fsync (iter.fd) != 0)
+    return glnx_throw_errno_prefix (error, "fsync(%s)", path);
+
+  return TRUE;
+}
+
+static gboolean
+collect_dirs_at (int           dfd,
+                 const char   *path,
+                 GPtrArray    *dirs,
+                 GCancellable *cancellable,
+                 GError      **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+
+  if (!glnx_dirfd_iterator_init_at (dfd, path, FALSE, &iter, error))
+    return FALSE;
+
+  g_ptr_array_add (dirs, g_strdup (path));
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      g_autofree char *child = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type != DT_DIR)
+        continue;
+
+      child = g_build_filename (path, dent->d_name, NULL);
+      if (!collect_dirs_at (dfd, child, dirs, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct
+{
+  int           dfd;
+  GCancellable *cancellable;
+  GMutex        lock;
+  GError       *error;
+} FsyncTree;
+
+static void
+fsync_tree_thread_func (gpointer data,
+                        gpointer user_data)
+{
+  const char *path = data;
+  FsyncTree *fsync_tree = user_data;
+  g_autoptr(GError) local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&fsync_tree->lock);
+  failed = fsync_tree->error != NULL;
+  g_mutex_unlock (&fsync_tree->lock);
+
+  if (failed)
+    return;
+
+  if (!fsync_dir_at (fsync_tree->dfd, path, fsync_tree->cancellable, &local_error))
+    {
+      g_mutex_lock (&fsync_tree->lock);
+      if (fsync_tree->error == NULL)
+        fsync_tree->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&fsync_tree->lock);
+    }
+}
+
+/* Makes the new checkout at @path (relative to @dfd) durable. */
+static gboolean
+flatpak_dir_flush_checkout (FlatpakDir   *self,
+                            int           dfd,
+                            const char   *path,
+                            GCancellable *cancellable,
+                            GError      **error)
+{
+  FsyncTree fsync_tree = { dfd, cancellable };
+  g_autoptr(GPtrArray) dirs = NULL;
+  guint n_jobs;
+  GThreadPool *pool;
+  gsize i;
+
+  switch (flatpak_dir_get_deploy_flush (self))
+    {
+    case FLATPAK_DEPLOY_FLUSH_NONE:
+      return TRUE;
+
+    case FLATPAK_DEPLOY_FLUSH_SYNCFS:
+      {
+        glnx_autofd int checkout_dfd = -1;
+
+        if (!glnx_opendirat (dfd, path, TRUE, &checkout_dfd, error))
+          return FALSE;
+
+        if (syncfs (checkout_dfd) != 0)
+          return glnx_throw_errno_prefix (error, "syncfs");
+
+        return TRUE;
+      }
+
+    case FLATPAK_DEPLOY_FLUSH_FSYNC:
+    default:
+      break;
+    }
+
+  dirs = g_ptr_array_new_with_free_func (g_free);
+  if (!collect_dirs_at (dfd, path, dirs, cancellable, error))
+    return FALSE;
+
+  n_jobs = flatpak_dir_get_checkout_jobs (self);
+  if (n_jobs <= 1 || dirs->len <= 1)
+    {
+      for (i = 0; i < dirs->len; i++)
+        {
+          if (!fsync_dir_at (dfd, g_ptr_array_index (dirs, i), cancellable, error))
+            return FALSE;
+        }
+
+      return TRUE;
+    }
+
+  g_mutex_init (&fsync_tree.lock);
+
+  pool = g_thread_pool_new (fsync_tree_thread_func, &fsync_tree,
+                            MIN (n_jobs, dirs->len), FALSE, error);
+  if (pool == NULL)
+    {
+      g_mutex_clear (&fsync_tree.lock);
+      return FALSE;
+    }
+
+  /* The array owns the paths and outlives the pool */
+  for (i = 0; i < dirs->len; i++)
+    g_thread_pool_push (pool, g_ptr_array_index (dirs, i), NULL);
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  g_mutex_clear (&fsync_tree.lock);
+
+  if (fsync_tree.error != NULL)
+    {
+      g_propagate_error (error, fsync_tree.error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Makes changes to the entries of the directory @dfd durable, for
+ * example after moving a checkout into it. */
+static gboolean
+flatpak_dir_flush_dir (FlatpakDir *self,
+                       int         dfd,
+                       GError    **error)
+{
+  switch (flatpak_dir_get_deploy_flush (self))
+    {
+    case FLATPAK_DEPLOY_FLUSH_NONE:
+      return TRUE;
+
+    case FLATPAK_DEPLOY_FLUSH_FSYNC:
+      if (fsync (dfd) != 0)
+        return glnx_throw_errno_prefix (error, "fsync");
+      return TRUE;
+
+    case FLATPAK_DEPLOY_FLUSH_SYNCFS:
+    default:
+      if (syncfs (dfd) != 0)
+        return glnx_throw_errno_prefix (error, "syncfs");
+      return TRUE;
+    }
+}
+
+/* Writes a search index next to appstream.xml in @checkout_dir, reusing
+ * @appstream if the xml was already parsed for filtering. */
+static gboolean
+write_appstream_search_index (GFile        *checkout_dir,
+                              FlatpakXml   *appstream,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  g_autoptr(GFile) index_file = g_file_get_child (checkout_dir, FLATPAK_APPSTREAM_SEARCH_INDEX);
+  g_autoptr(FlatpakXml) parsed = NULL;
+  g_autoptr(GVariant) index = NULL;
+
+  if (appstream == NULL)
+    {
+      g_autoptr(GFile) appstream_xml = g_file_get_child (checkout_dir, "appstream.xml");
+      g_autoptr(GFileInputStream) in = NULL;
+
+      in = g_file_read (appstream_xml, cancellable, error);
+      if (in == NULL)
+        return FALSE;
+
+      parsed = flatpak_xml_parse (G_INPUT_STREAM (in), FALSE, cancellable, error);
+      if (parsed == NULL)
+        return FALSE;
+
+      appstream = parsed;
+    }
+
+  index = flatpak_appstream_xml_build_search_index (appstream);
+
+  return g_file_replace_contents (index_file,
+                                  g_variant_get_data (index), g_variant_get_size (index),
+                                  NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL,
+                                  cancellable, error);
+}
+
+gboolean
+flatpak_dir_deploy_appstream (FlatpakDir   *self,
+                              const char   *remote,
+                              const char   *arch,
+                              gboolean     *out_changed,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  g_autoptr(GFile) appstream_dir = NULL;
+  g_autoptr(GFile) remote_dir = NULL;
+  g_autoptr(GFile) arch_dir = NULL;
+  g_autoptr(GFile) checkout_dir = NULL;
+  g_autoptr(GFile) real_checkout_dir = NULL;
+  g_autoptr(GFile) timestamp_file = NULL;
+  g_autofree char *arch_path = NULL;
+  gboolean checkout_exists;
+  const char *old_dir = NULL;
+  g_autofree char *new_checksum = NULL;
+  g_autoptr(GFile) active_link = NULL;
+  g_autofree char *branch = NULL;
+  g_autoptr(GFile) old_checkout_dir = NULL;
+  g_autoptr(GFile) active_tmp_link = NULL;
+  g_autoptr(GError) tmp_error = NULL;
+  g_autofree char *new_dir = NULL;
+  OstreeRepoCheckoutAtOptions options = { 0, };
+  glnx_autofd int dfd = -1;
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autofree char *tmpname = g_strdup (".active-XXXXXX");
+  g_auto(GLnxLockFile) lock = { 0, };
+  gboolean do_compress = FALSE;
+  gboolean do_uncompress = TRUE;
+  g_autofree char *filter_checksum = NULL;
+  g_autoptr(FlatpakFilter) allow_refs = NULL;
+  g_autoptr(FlatpakFilter) deny_refs = NULL;
+  g_autofree char *subset = NULL;
+  g_auto(GLnxTmpDir) tmpdir = { 0, };
+  g_autoptr(FlatpakTempDir) tmplink = NULL;
+  g_autoptr(FlatpakXml) parsed_appstream = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *old_checksum = NULL;
+  gboolean have_old_commit = FALSE;
+  gboolean checked_out = FALSE;
+
+  /* Keep a shared repo lock to avoid prunes removing objects we're relying on
+   * while we do the checkout. This could happen if the ref changes after we
+   * read its current value for the checkout. */
+  if (!flatpak_dir_repo_lock (self, &lock, LOCK_SH, cancellable, error))
+    return FALSE;
+
+  if (!flatpak_dir_lookup_remote_filter (self, remote, TRUE, &filter_checksum, &allow_refs, &deny_refs, error))
+    return FALSE;
 
   appstream_dir = g_file_get_child (flatpak_dir_get_path (self), "appstream");
   remote_dir = g_file_get_child (appstream_dir, remote);
@@ -5459,7 +7624,38 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
   options.enable_fsync = FALSE; /* We checkout to a temp dir and sync before moving it in place */
   options.bareuseronly_dirs = TRUE; /* https://github.com/ostreedev/ostree/pull/927 */
 
-  if (!ostree_repo_checkout_at (self->repo, &options,
+  /* The appstream commits mostly contain icons that rarely change, so try to
+   * reuse the previous checkout and only check out what differs. */
+  old_checksum = old_dir ? g_strndup (old_dir, 64) : NULL;
+  if (old_checksum != NULL && ostree_validate_checksum_string (old_checksum, NULL))
+    {
+      g_autoptr(GFile) old_checkout = g_file_get_child (arch_dir, old_dir);
+
+      if (g_file_query_exists (old_checkout, cancellable) &&
+          ostree_repo_has_object (self->repo, OSTREE_OBJECT_TYPE_COMMIT, old_checksum,
+                                  &have_old_commit, cancellable, NULL) &&
+          have_old_commit)
+        {
+          checked_out = checkout_commit_incremental (self, old_checksum,
+                                                     flatpak_file_get_path_cached (old_checkout),
+                                                     new_checksum, tmpdir.path,
+                                                     appstream_regenerated_files,
+                                                     cancellable, &local_error);
+          if (!checked_out)
+            {
+              g_info ("Incremental appstream checkout failed, doing a full checkout: %s",
+                      local_error->message);
+              g_clear_error (&local_error);
+
+              if (!glnx_shutil_rm_rf_at (AT_FDCWD, tmpdir.path, cancellable, error) ||
+                  !glnx_ensure_dir (AT_FDCWD, tmpdir.path, 0755, error))
+                return FALSE;
+            }
+        }
+    }
+
+  if (!checked_out &&
+      !ostree_repo_checkout_at (self->repo, &options,
                                 AT_FDCWD, tmpdir.path, new_checksum,
                                 cancellable, error))
     return FALSE;
@@ -5499,13 +7695,14 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
       in = g_file_read (appstream_xml, NULL, NULL);
       if (in)
         {
-          g_autoptr(FlatpakXml) appstream = NULL;
+          FlatpakXml *appstream = NULL;
           g_autoptr(GBytes) content = NULL;
 
-          appstream = flatpak_xml_parse (G_INPUT_STREAM (in), FALSE, cancellable, error);
-          if (appstream == NULL)
+          parsed_appstream = flatpak_xml_parse (G_INPUT_STREAM (in), FALSE, cancellable, error);
+          if (parsed_appstream == NULL)
             return FALSE;
 
+          appstream = parsed_appstream;
           flatpak_appstream_xml_filter (appstream, allow_refs, deny_refs);
 
           if (!flatpak_appstream_xml_root_to_data (appstream, &content, NULL, error))
@@ -5547,6 +7744,13 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
         }
     }
 
+  /* The search index is only an optimization, search falls back to the xml */
+  if (!write_appstream_search_index (checkout_dir, parsed_appstream, cancellable, &local_error))
+    {
+      g_info ("Failed to write appstream search index: %s", local_error->message);
+      g_clear_error (&local_error);
+    }
+
   glnx_gen_temp_name (tmpname);
   active_tmp_link = g_file_get_child (arch_dir, tmpname);
 
@@ -5556,11 +7760,13 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
    /* This is a link, not a dir, but it will remove the same way on destroy */
   tmplink = g_object_ref (active_tmp_link);
 
-  if (syncfs (dfd) != 0)
-    {
-      glnx_set_error_from_errno (error);
-      return FALSE;
-    }
+  if (!flatpak_dir_flush_checkout (self, AT_FDCWD, tmpdir.path, cancellable, error))
+    return FALSE;
+
+  /* With syncfs this already covered the symlink */
+  if (flatpak_dir_get_deploy_flush (self) == FLATPAK_DEPLOY_FLUSH_FSYNC &&
+      !flatpak_dir_flush_dir (self, dfd, error))
+    return FALSE;
 
   /* By now the checkout to the temporary directory is on disk, as is the temporary
      symlink pointing to the final target. */
@@ -5572,11 +7778,8 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
   /* Don't delete tmpdir now that it's moved */
   glnx_tmpdir_unset (&tmpdir);
 
-  if (syncfs (dfd) != 0)
-    {
-      glnx_set_error_from_errno (error);
-      return FALSE;
-    }
+  if (!flatpak_dir_flush_dir (self, dfd, error))
+    return FALSE;
 
   if (!flatpak_file_rename (active_tmp_link,
                             active_link,
@@ -6031,6 +8234,48 @@ repo_get_remote_collection_id (OstreeRepo *repo,
   return TRUE;
 }
 
+/* Returns the dirs to pass as "subdirs" to ostree when pulling only
+ * @subpaths of a ref, as a NULL-terminated array.
+ *
+ * libostree can't apply static deltas to partial pulls, but it only
+ * fetches the dirtree and dirmeta objects on the way to the requested
+ * dirs, and skips everything we already have, so the cost of an update
+ * is in the number of dirs we ask it to walk. Subpaths that are inside
+ * other subpaths (like /de and /de/LC_MESSAGES), or listed twice, would
+ * only make it walk the same subtrees again, so they are dropped here. */
+static GPtrArray *
+get_subdirs_to_pull (const char **subpaths)
+{
+  g_autoptr(GPtrArray) subdirs = g_ptr_array_new_with_free_func (g_free);
+  gsize i, j;
+
+  g_ptr_array_add (subdirs, g_strdup ("/metadata"));
+
+  for (i = 0; subpaths[i] != NULL; i++)
+    {
+      gboolean covered = FALSE;
+
+      for (j = 0; subpaths[j] != NULL && !covered; j++)
+        {
+          if (i == j || !flatpak_has_path_prefix (subpaths[i], subpaths[j]))
+            continue;
+
+          /* Of two equal subpaths, keep the first one */
+          if (flatpak_has_path_prefix (subpaths[j], subpaths[i]))
+            covered = j < i;
+          else
+            covered = TRUE;
+        }
+
+      if (!covered)
+        g_ptr_array_add (subdirs, g_build_filename ("/files", subpaths[i], NULL));
+    }
+
+  g_ptr_array_add (subdirs, NULL);
+
+  return g_steal_pointer (&subdirs);
+}
+
 /* Get options for the OSTree pull operation which can be shared between
  * collection-based and normal pulls. Update @builder in place. */
 static void
@@ -6077,7 +8322,8 @@ get_common_pull_options (GVariantBuilder     *builder,
 
 
   g_variant_builder_init (&hdr_builder, G_VARIANT_TYPE ("a(ss)"));
-  g_variant_builder_add (&hdr_builder, "(ss)", "Flatpak-Ref", ref_to_fetch);
+  if (ref_to_fetch)
+    g_variant_builder_add (&hdr_builder, "(ss)", "Flatpak-Ref", ref_to_fetch);
   if (token)
     {
       g_autofree char *bearer_token = g_strdup_printf ("Bearer %s", token);
@@ -6268,6 +8514,7 @@ ensure_http_session (FlatpakDir *self)
       FlatpakHttpSession *http_session;
 
       http_session = flatpak_create_http_session (PACKAGE_STRING);
+      flatpak_http_session_set_max_recv_speed (http_session, self->max_download_rate);
 
       g_once_init_leave (&self->http_session, http_session);
     }
@@ -6380,15 +8627,123 @@ flatpak_dir_setup_extra_data (FlatpakDir                           *self,
   return TRUE;
 }
 
+/* Maps the file rather than reading it, so that large extra data is paged
+ * in from disk as needed and doesn't have to fit in memory */
+static GBytes *
+map_extra_data_file (int         dfd,
+                     const char *path,
+                     GError    **error)
+{
+  glnx_autofd int fd = -1;
+  g_autoptr(GMappedFile) mfile = NULL;
+
+  if (!glnx_openat_rdonly (dfd, path, TRUE, &fd, error))
+    return NULL;
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (mfile == NULL)
+    return NULL;
+
+  return g_mapped_file_get_bytes (mfile);
+}
+
+/* FLATPAK_EXTRA_DATA_CACHE_DIR can point to a directory of extra-data files
+ * named by their sha256, which several installations can share so that each
+ * file is only downloaded once. Nothing in it is trusted, everything taken
+ * from it is verified against the checksum from the commit. */
+static int
+open_extra_data_cache_dir (void)
+{
+  const char *path = g_getenv ("FLATPAK_EXTRA_DATA_CACHE_DIR");
+  g_autoptr(GError) local_error = NULL;
+  int dfd = -1;
+
+  if (path == NULL || *path == '\0')
+    return -1;
+
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, path, 0755, &dfd, NULL, &local_error))
+    {
+      g_info ("Not using extra-data cache %s: %s", path, local_error->message);
+      return -1;
+    }
+
+  return dfd;
+}
+
+static GBytes *
+lookup_extra_data_cache (const char *sha256,
+                         guint64     size)
+{
+  glnx_autofd int cache_dfd = open_extra_data_cache_dir ();
+  g_autoptr(GBytes) bytes = NULL;
+  g_autofree char *actual_sha256 = NULL;
+
+  if (cache_dfd < 0)
+    return NULL;
+
+  bytes = map_extra_data_file (cache_dfd, sha256, NULL);
+  if (bytes == NULL)
+    return NULL;
+
+  if (g_bytes_get_size (bytes) == size)
+    actual_sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
+
+  if (g_strcmp0 (actual_sha256, sha256) != 0)
+    {
+      g_info ("Ignoring invalid extra-data %s in cache", sha256);
+      return NULL;
+    }
+
+  g_info ("Using extra-data %s from cache", sha256);
+
+  return g_steal_pointer (&bytes);
+}
+
+/* Adds the verified file @name in @dfd to the cache, as a hardlink if
+ * possible, otherwise as a (reflinked where supported) copy. */
+static void
+add_to_extra_data_cache (int         dfd,
+                         const char *name,
+                         const char *sha256)
+{
+  glnx_autofd int cache_dfd = open_extra_data_cache_dir ();
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *tmpname = NULL;
+
+  if (cache_dfd < 0)
+    return;
+
+  /* Go via a temporary name so others never see a partial file, and so
+   * that a bad file already in the cache gets replaced */
+  tmpname = g_strconcat (".", sha256, ".XXXXXX", NULL);
+  glnx_gen_temp_name (tmpname);
+
+  if (linkat (dfd, name, cache_dfd, tmpname, 0) != 0 &&
+      !glnx_file_copy_at (dfd, name, NULL, cache_dfd, tmpname,
+                          GLNX_FILE_COPY_NOXATTRS | GLNX_FILE_COPY_NOCHOWN,
+                          NULL, &local_error))
+    {
+      g_info ("Failed to add extra-data %s to cache: %s", sha256, local_error->message);
+      return;
+    }
+
+  if (!glnx_renameat (cache_dfd, tmpname, cache_dfd, sha256, &local_error))
+    {
+      g_info ("Failed to add extra-data %s to cache: %s", sha256, local_error->message);
+      (void) unlinkat (cache_dfd, tmpname, 0);
+    }
+}
+
 static gboolean
-flatpak_dir_pull_extra_data_to_bytes (FlatpakDir       *self,
-                                      GVariant         *extra_data_sources,
-                                      int               extra_data_index,
-                                      FlatpakProgress  *progress,
-                                      GBytes          **bytes_out,
-                                      const char      **name_out,
-                                      GCancellable     *cancellable,
-                                      GError          **error)
+flatpak_dir_pull_extra_data_to_bytes (FlatpakDir              *self,
+                                      GVariant                *extra_data_sources,
+                                      int                      extra_data_index,
+                                      FlatpakLoadUriProgress   progress_cb,
+                                      gpointer                 progress_data,
+                                      GBytes                 **bytes_out,
+                                      const char             **name_out,
+                                      GCancellable            *cancellable,
+                                      GError                 **error)
 {
   const char *name = NULL;
   guint64 download_size;
@@ -6400,6 +8755,8 @@ flatpak_dir_pull_extra_data_to_bytes (FlatpakDir       *self,
   g_autoptr(GBytes) bytes = NULL;
   g_autoptr(GFile) extra_local_file = NULL;
   g_autoptr(GFile) base_dir = NULL;
+  glnx_autofd int partial_dfd = -1;
+  gboolean verified = FALSE;
 
   flatpak_repo_parse_extra_data_sources (extra_data_sources,
                                          extra_data_index,
@@ -6432,85 +8789,315 @@ flatpak_dir_pull_extra_data_to_bytes (FlatpakDir       *self,
                                  _("Unsupported extra data uri %s"), uri);
     }
 
-  /* TODO: Download to disk to support resumed downloads on error */
+  base_dir = flatpak_get_user_base_dir_location ();
+  extra_local_file = flatpak_build_file (base_dir,
+                                         "extra-data",
+                                         expected_sha256,
+                                         name,
+                                         NULL);
+
+  if (g_file_query_exists (extra_local_file, cancellable))
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      g_info ("Loading extra-data from local file %s",
+              flatpak_file_get_path_cached (extra_local_file));
+
+      bytes = map_extra_data_file (AT_FDCWD,
+                                   flatpak_file_get_path_cached (extra_local_file),
+                                   &local_error);
+      if (bytes == NULL)
+        {
+          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                                     _("Failed to load local extra-data %s: %s"),
+                                     flatpak_file_get_path_cached (extra_local_file),
+                                     local_error->message);
+        }
+
+      if (g_bytes_get_size (bytes) != download_size)
+        {
+          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                                     _("Wrong size for extra-data %s"),
+                                     flatpak_file_get_path_cached (extra_local_file));
+        }
+    }
+  else if ((bytes = lookup_extra_data_cache (expected_sha256, download_size)) != NULL)
+    {
+      verified = TRUE;
+    }
+  else
+    {
+      g_autoptr(GFile) partial_dir = g_file_get_child (flatpak_dir_get_cache_dir (self), "extra-data");
+      g_autofree char *partial_path = g_file_get_path (partial_dir);
+
+      /* Downloads go to a file in the cache, so that if they are
+       * interrupted the next attempt can continue where this one stopped */
+      if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, partial_path, 0755,
+                                        &partial_dfd, cancellable, error))
+        return FALSE;
+
+      ensure_http_session (self);
+      if (!flatpak_download_http_uri_resumable (self->http_session,
+                                                uri,
+                                                NULL, 0,
+                                                partial_dfd, expected_sha256,
+                                                progress_cb,
+                                                progress_data,
+                                                cancellable, error))
+        {
+          g_prefix_error (error, _("While downloading %s: "), uri);
+          return FALSE;
+        }
+
+      bytes = map_extra_data_file (partial_dfd, expected_sha256, error);
+      if (bytes == NULL)
+        return FALSE;
+    }
+
+  g_assert (bytes != NULL);
+
+  if (!verified)
+    {
+      if (g_bytes_get_size (bytes) == download_size)
+        actual_sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
+
+      /* The mapping keeps the data around after the unlink. Only share the
+       * download with other installations once we know it is right. */
+      if (partial_dfd != -1)
+        {
+          if (g_strcmp0 (actual_sha256, expected_sha256) == 0)
+            add_to_extra_data_cache (partial_dfd, expected_sha256, expected_sha256);
+          (void) unlinkat (partial_dfd, expected_sha256, 0);
+        }
+
+      if (g_bytes_get_size (bytes) != download_size)
+        {
+          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                                     _("Wrong size for extra data %s"), uri);
+        }
+
+      if (strcmp (actual_sha256, expected_sha256) != 0)
+        {
+          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                                     _("Invalid checksum for extra data %s"), uri);
+        }
+    }
+
+  if (bytes_out)
+    *bytes_out = g_steal_pointer (&bytes);
+  if (name_out)
+    *name_out = name;
+  return TRUE;
+}
+
+/* The most extra-data files downloaded at the same time */
+#define MAX_PARALLEL_EXTRA_DATA_DOWNLOADS 4
+
+typedef struct ExtraDataPull ExtraDataPull;
+
+typedef struct {
+  ExtraDataPull *pull;
+  guint64        downloaded; /* protected by pull->lock */
+  gboolean       done;       /* protected by pull->lock */
+  gboolean       reported;   /* only accessed by the calling thread */
+  GBytes        *bytes;
+  const char    *name;
+  GError        *error;
+} ExtraDataDownload;
+
+struct ExtraDataPull {
+  FlatpakDir        *dir;
+  GVariant          *extra_data_sources;
+  GCancellable      *cancellable;
+  GMutex             lock;
+  GCond              cond;
+  ExtraDataDownload *downloads;
+};
+
+static void
+extra_data_download_progress (guint64  downloaded_bytes,
+                              gpointer user_data)
+{
+  ExtraDataDownload *download = user_data;
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&download->pull->lock);
+
+  download->downloaded = downloaded_bytes;
+}
+
+static void
+extra_data_download_thread_func (gpointer data,
+                                 gpointer user_data)
+{
+  ExtraDataDownload *download = data;
+  ExtraDataPull *pull = user_data;
+  g_autoptr(GMutexLocker) locker = NULL;
+
+  if (!g_cancellable_set_error_if_cancelled (pull->cancellable, &download->error))
+    flatpak_dir_pull_extra_data_to_bytes (pull->dir,
+                                          pull->extra_data_sources,
+                                          download - pull->downloads,
+                                          extra_data_download_progress,
+                                          download,
+                                          &download->bytes,
+                                          &download->name,
+                                          pull->cancellable,
+                                          &download->error);
+
+  locker = g_mutex_locker_new (&pull->lock);
+  download->done = TRUE;
+  g_cond_signal (&pull->cond);
+}
+
+static void
+cancel_extra_data_pull_cb (GCancellable *cancellable,
+                           GCancellable *pull_cancellable)
+{
+  g_cancellable_cancel (pull_cancellable);
+}
+
+/* Downloads several extra-data files at the same time, on a few worker
+ * threads that share the http session's connections. FlatpakProgress is
+ * not thread-safe, so the workers only record how far they got and all
+ * the progress reporting happens here, in the calling thread. */
+static gboolean
+flatpak_dir_pull_extra_data_parallel (FlatpakDir       *self,
+                                      GVariant         *extra_data_sources,
+                                      gsize             n_extra_data,
+                                      FlatpakProgress  *progress,
+                                      GPtrArray        *extra_data_out,
+                                      GPtrArray        *names_out,
+                                      GCancellable     *cancellable,
+                                      GError          **error)
+{
+  ExtraDataPull pull = { NULL };
+  g_autoptr(GCancellable) pull_cancellable = g_cancellable_new ();
+  GThreadPool *pool;
+  gulong cancelled_id = 0;
+  gsize n_reported = 0;
+  GError *first_error = NULL;
+  gsize i;
+
+  pull.dir = self;
+  pull.extra_data_sources = extra_data_sources;
+  pull.cancellable = pull_cancellable;
+  pull.downloads = g_new0 (ExtraDataDownload, n_extra_data);
+  g_mutex_init (&pull.lock);
+  g_cond_init (&pull.cond);
 
-  base_dir = flatpak_get_user_base_dir_location ();
-  extra_local_file = flatpak_build_file (base_dir,
-                                         "extra-data",
-                                         expected_sha256,
-                                         name,
-                                         NULL);
+  if (cancellable)
+    cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (cancel_extra_data_pull_cb),
+                                          pull_cancellable, NULL);
 
-  if (g_file_query_exists (extra_local_file, cancellable))
+  /* Create the session up front rather than racing for it in the workers */
+  ensure_http_session (self);
+
+  pool = g_thread_pool_new (extra_data_download_thread_func, &pull,
+                            MIN (n_extra_data, MAX_PARALLEL_EXTRA_DATA_DOWNLOADS),
+                            FALSE, NULL);
+  for (i = 0; i < n_extra_data; i++)
     {
-      gsize extra_local_size;
-      g_autofree char *extra_local_contents = NULL;
-      g_autoptr(GError) local_error = NULL;
+      pull.downloads[i].pull = &pull;
+      g_thread_pool_push (pool, &pull.downloads[i], NULL);
+    }
 
-      g_info ("Loading extra-data from local file %s",
-              flatpak_file_get_path_cached (extra_local_file));
+  g_mutex_lock (&pull.lock);
+  while (n_reported < n_extra_data)
+    {
+      g_autoptr(GArray) completed_sizes = g_array_new (FALSE, FALSE, sizeof (guint64));
+      guint64 in_flight = 0;
 
-      if (!g_file_load_contents (extra_local_file,
-                                 cancellable,
-                                 &extra_local_contents,
-                                 &extra_local_size,
-                                 NULL,
-                                 &local_error))
-        {
-          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
-                                     _("Failed to load local extra-data %s: %s"),
-                                     flatpak_file_get_path_cached (extra_local_file),
-                                     local_error->message);
-        }
+      g_cond_wait_until (&pull.cond, &pull.lock,
+                         g_get_monotonic_time () + 100 * G_TIME_SPAN_MILLISECOND);
 
-      if (extra_local_size != download_size)
+      for (i = 0; i < n_extra_data; i++)
         {
-          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
-                                     _("Wrong size for extra-data %s"),
-                                     flatpak_file_get_path_cached (extra_local_file));
+          ExtraDataDownload *download = &pull.downloads[i];
+
+          if (!download->done)
+            {
+              in_flight += download->downloaded;
+              continue;
+            }
+
+          if (download->reported)
+            continue;
+
+          download->reported = TRUE;
+          n_reported++;
+
+          if (download->error != NULL)
+            {
+              if (first_error == NULL && !g_cancellable_is_cancelled (pull_cancellable))
+                first_error = g_error_copy (download->error);
+              g_cancellable_cancel (pull_cancellable);
+            }
+          else
+            {
+              guint64 download_size;
+
+              flatpak_repo_parse_extra_data_sources (extra_data_sources, i,
+                                                     NULL, &download_size,
+                                                     NULL, NULL, NULL);
+              g_array_append_val (completed_sizes, download_size);
+            }
         }
 
-      bytes = g_bytes_new (extra_local_contents, extra_local_size);
+      g_mutex_unlock (&pull.lock);
+
+      for (i = 0; i < completed_sizes->len; i++)
+        flatpak_progress_complete_extra_data_download (progress, g_array_index (completed_sizes, guint64, i));
+      if (first_error == NULL)
+        flatpak_progress_update_extra_data (progress, in_flight);
+
+      g_mutex_lock (&pull.lock);
     }
-  else
-    {
-      ensure_http_session (self);
-      bytes = flatpak_load_uri (self->http_session,
-                                uri,
-                                0, NULL,
-                                extra_data_progress_report,
-                                progress,
-                                NULL,
-                                cancellable, error);
+  g_mutex_unlock (&pull.lock);
 
-      if (bytes == NULL)
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (cancelled_id != 0)
+    g_cancellable_disconnect (cancellable, cancelled_id);
+
+  /* If we were cancelled from outside, report that rather than whatever
+   * error the first aborted download happened to return */
+  if (first_error == NULL)
+    {
+      for (i = 0; i < n_extra_data; i++)
         {
-          g_prefix_error (error, _("While downloading %s: "), uri);
-          return FALSE;
+          if (pull.downloads[i].error != NULL)
+            {
+              first_error = g_error_copy (pull.downloads[i].error);
+              break;
+            }
         }
     }
 
-  g_assert (bytes != NULL);
-
-  if (g_bytes_get_size (bytes) != download_size)
+  for (i = 0; i < n_extra_data; i++)
     {
-      return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
-                                 _("Wrong size for extra data %s"), uri);
+      ExtraDataDownload *download = &pull.downloads[i];
+
+      if (first_error == NULL)
+        {
+          if (extra_data_out)
+            g_ptr_array_add (extra_data_out, g_steal_pointer (&download->bytes));
+          if (names_out)
+            g_ptr_array_add (names_out, g_strdup (download->name));
+        }
+
+      g_clear_pointer (&download->bytes, g_bytes_unref);
+      g_clear_error (&download->error);
     }
 
-  flatpak_progress_complete_extra_data_download (progress, download_size);
+  g_free (pull.downloads);
+  g_mutex_clear (&pull.lock);
+  g_cond_clear (&pull.cond);
 
-  actual_sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
-  if (strcmp (actual_sha256, expected_sha256) != 0)
+  if (first_error != NULL)
     {
-      return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
-                                 _("Invalid checksum for extra data %s"), uri);
+      g_propagate_error (error, first_error);
+      return FALSE;
     }
 
-  if (bytes_out)
-    *bytes_out = g_steal_pointer (&bytes);
-  if (name_out)
-    *name_out = name;
   return TRUE;
 }
 
@@ -6532,14 +9119,27 @@ flatpak_dir_pull_extra_data (FlatpakDir       *self,
   /* Other fields were already set in flatpak_dir_setup_extra_data() */
   flatpak_progress_start_extra_data (progress);
 
+  if (n_extra_data > 1)
+    {
+      gboolean res;
+
+      res = flatpak_dir_pull_extra_data_parallel (self, extra_data_sources, n_extra_data,
+                                                  progress, extra_data_out, names_out,
+                                                  cancellable, error);
+      flatpak_progress_reset_extra_data (progress);
+      return res;
+    }
+
   for (size_t i = 0; i < n_extra_data; i++)
     {
       g_autoptr(GBytes) bytes = NULL;
       const char *name = NULL;
+      guint64 download_size;
 
       if (!flatpak_dir_pull_extra_data_to_bytes (self,
                                                  extra_data_sources,
                                                  i,
+                                                 extra_data_progress_report,
                                                  progress,
                                                  &bytes,
                                                  &name,
@@ -6550,6 +9150,11 @@ flatpak_dir_pull_extra_data (FlatpakDir       *self,
           return FALSE;
         }
 
+      flatpak_repo_parse_extra_data_sources (extra_data_sources, i,
+                                             NULL, &download_size,
+                                             NULL, NULL, NULL);
+      flatpak_progress_complete_extra_data_download (progress, download_size);
+
       if (extra_data_out)
         g_ptr_array_add (extra_data_out, g_steal_pointer (&bytes));
       if (names_out)
@@ -6858,6 +9463,9 @@ flatpak_dir_mirror_oci (FlatpakDir          *self,
         return FALSE;
     }
 
+  flatpak_oci_registry_set_max_download_rate (flatpak_image_source_get_registry (image_source),
+                                              flatpak_dir_get_remote_max_download_rate (self, state->remote_name));
+
   flatpak_progress_start_oci_pull (progress);
 
   g_info ("Mirroring OCI image %s", flatpak_image_source_get_digest (image_source));
@@ -6878,6 +9486,35 @@ flatpak_dir_mirror_oci (FlatpakDir          *self,
   return TRUE;
 }
 
+/* The metrics that are logged with a pull, see flatpak_progress_get_metrics() */
+static GVariant *
+pull_metrics_new (FlatpakProgress *progress,
+                  const char      *source,
+                  gint64           start_time)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+
+  if (progress != NULL)
+    {
+      g_autoptr(GVariant) progress_metrics = flatpak_progress_get_metrics (progress);
+      GVariantIter iter;
+      const char *key;
+      GVariant *value;
+
+      g_variant_iter_init (&iter, progress_metrics);
+      while (g_variant_iter_loop (&iter, "{&sv}", &key, &value))
+        g_variant_builder_add (&builder, "{sv}", key, value);
+    }
+
+  g_variant_builder_add (&builder, "{sv}", "source", g_variant_new_string (source));
+  g_variant_builder_add (&builder, "{sv}", "duration-usec",
+                         g_variant_new_uint64 (g_get_monotonic_time () - start_time));
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
 static gboolean
 flatpak_dir_pull_oci (FlatpakDir          *self,
                       FlatpakRemoteState  *state,
@@ -6900,6 +9537,8 @@ flatpak_dir_pull_oci (FlatpakDir          *self,
   G_GNUC_UNUSED g_autofree char *latest_commit =
     flatpak_dir_read_latest (self, state->remote_name, ref, &latest_alt_commit, cancellable, NULL);
   g_autofree char *name = NULL;
+  g_autoptr(GVariant) metrics = NULL;
+  gint64 start_time = g_get_monotonic_time ();
 
   if (opt_image_source)
     image_source = g_object_ref (opt_image_source);
@@ -6922,6 +9561,9 @@ flatpak_dir_pull_oci (FlatpakDir          *self,
   if (repo == NULL)
     repo = self->repo;
 
+  flatpak_oci_registry_set_max_download_rate (flatpak_image_source_get_registry (image_source),
+                                              flatpak_dir_get_remote_max_download_rate (self, state->remote_name));
+
   flatpak_progress_start_oci_pull (progress);
 
   g_info ("Pulling OCI image %s", oci_digest);
@@ -6960,13 +9602,233 @@ flatpak_dir_pull_oci (FlatpakDir          *self,
     }
 
   registry = flatpak_image_source_get_registry (image_source);
+  metrics = pull_metrics_new (progress, "oci", start_time);
   (flatpak_dir_log) (self, __FILE__, __LINE__, __FUNCTION__, name,
-                     "pull oci", flatpak_oci_registry_get_uri (registry), ref, NULL, NULL, NULL,
+                     "pull oci", flatpak_oci_registry_get_uri (registry), ref, NULL, NULL, NULL, metrics,
                      "Pulled %s from %s", ref, flatpak_oci_registry_get_uri (registry));
 
   return TRUE;
 }
 
+/* This is ostree's private superblock format, see
+ * ostree-repo-static-delta-private.h */
+#define STATIC_DELTA_SUPERBLOCK_FORMAT "(a{sv}tayay(a{sv}aya(say)sstayay)aya(uayttay)a(yaytt))"
+
+static GVariant *
+load_static_deltas_for_rev (FlatpakDir         *self,
+                            FlatpakRemoteState *state,
+                            const char         *url,
+                            const char         *rev,
+                            const char         *token,
+                            GCancellable       *cancellable)
+{
+  g_autofree char *index_path = NULL;
+  g_autofree char *index_url = NULL;
+  g_autoptr(GBytes) index_bytes = NULL;
+  g_autoptr(GVariant) index = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  /* Old style summaries list all the deltas */
+  if (state->summary != NULL)
+    {
+      g_autoptr(GVariant) metadata = g_variant_get_child_value (state->summary, 1);
+      GVariant *deltas = g_variant_lookup_value (metadata, "ostree.static-deltas", G_VARIANT_TYPE_VARDICT);
+
+      if (deltas != NULL)
+        return deltas;
+    }
+
+  /* Otherwise there is a per-commit index */
+  ensure_http_session (self);
+
+  index_path = flatpak_repo_get_static_delta_index_path (rev);
+  index_url = g_build_filename (url, index_path, NULL);
+  index_bytes = flatpak_load_uri (self->http_session, index_url, 0, token,
+                                  NULL, NULL, NULL, cancellable, &local_error);
+  if (index_bytes == NULL)
+    {
+      g_info ("No static delta index for commit %s: %s", rev, local_error->message);
+      return NULL;
+    }
+
+  index = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE_VARDICT, index_bytes, FALSE));
+  return g_variant_lookup_value (index, "ostree.static-deltas", G_VARIANT_TYPE_VARDICT);
+}
+
+static gboolean
+get_static_delta_size (FlatpakDir   *self,
+                       const char   *url,
+                       const char   *from,
+                       const char   *to,
+                       GVariant     *expected_digest,
+                       const char   *token,
+                       guint64      *out_size,
+                       GCancellable *cancellable)
+{
+  g_autofree char *superblock_path = flatpak_repo_get_static_delta_superblock_path (from, to);
+  g_autofree char *superblock_url = g_build_filename (url, superblock_path, NULL);
+  g_autoptr(GBytes) superblock_bytes = NULL;
+  g_autoptr(GVariant) superblock = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) headers = NULL;
+  g_autoptr(GVariant) fallbacks = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *digest = NULL;
+  g_autofree char *expected = NULL;
+  gboolean little_endian = FALSE;
+  guchar endianness;
+  guint64 size = 0;
+
+  ensure_http_session (self);
+
+  superblock_bytes = flatpak_load_uri (self->http_session, superblock_url, 0, token,
+                                       NULL, NULL, NULL, cancellable, &local_error);
+  if (superblock_bytes == NULL)
+    {
+      g_info ("Failed to load static delta superblock %s: %s", superblock_path, local_error->message);
+      return FALSE;
+    }
+
+  /* The digest comes from the signed summary (or the index it points to),
+   * so make sure we are sizing the delta ostree would actually use */
+  digest = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, superblock_bytes);
+  expected = ostree_checksum_from_bytes_v (expected_digest);
+  if (strcmp (digest, expected) != 0)
+    {
+      g_info ("Static delta superblock %s has unexpected digest", superblock_path);
+      return FALSE;
+    }
+
+  superblock = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (STATIC_DELTA_SUPERBLOCK_FORMAT),
+                                                             superblock_bytes, FALSE));
+
+  metadata = g_variant_get_child_value (superblock, 0);
+  if (g_variant_lookup (metadata, "ostree.endianness", "y", &endianness))
+    little_endian = endianness == 'l';
+
+  headers = g_variant_get_child_value (superblock, 6);
+  for (gsize i = 0; i < g_variant_n_children (headers); i++)
+    {
+      guint64 compressed_size;
+
+      g_variant_get_child (headers, i, "(u@aytt@ay)", NULL, NULL, &compressed_size, NULL, NULL);
+      size += little_endian ? GUINT64_FROM_LE (compressed_size) : GUINT64_FROM_BE (compressed_size);
+    }
+
+  fallbacks = g_variant_get_child_value (superblock, 7);
+  for (gsize i = 0; i < g_variant_n_children (fallbacks); i++)
+    {
+      guint64 compressed_size;
+
+      g_variant_get_child (fallbacks, i, "(y@aytt)", NULL, NULL, &compressed_size, NULL);
+      size += little_endian ? GUINT64_FROM_LE (compressed_size) : GUINT64_FROM_BE (compressed_size);
+    }
+
+  *out_size = size;
+  return TRUE;
+}
+
+/* libostree picks the static delta on its own: the one starting from the
+ * newest commit we have locally (which includes any not yet pruned commit
+ * and the commits of all other deployed refs), or a from-scratch one if we
+ * don't have the ref at all. It never compares that with a plain object
+ * pull though. So we make the same choice here, and if the delta is
+ * bigger than downloading all the objects of the commit we disable deltas
+ * for this pull. */
+static gboolean
+static_delta_is_larger_than_objects (FlatpakDir         *self,
+                                     FlatpakRemoteState *state,
+                                     OstreeRepo         *repo,
+                                     const char         *url,
+                                     const char         *ref,
+                                     const char         *rev,
+                                     const char         *current_checksum,
+                                     const char         *token,
+                                     GCancellable       *cancellable)
+{
+  g_autoptr(GVariant) deltas = NULL;
+  g_autofree char *summary_checksum = NULL;
+  g_autofree char *best_from = NULL;
+  g_autoptr(GVariant) best_digest = NULL;
+  g_autoptr(GVariant) scratch_digest = NULL;
+  guint64 best_timestamp = 0;
+  guint64 download_size = 0;
+  guint64 delta_size = 0;
+  GVariantIter iter;
+  const char *delta_name;
+  GVariant *digest;
+
+  /* The download size in the summary is only valid for the commit it lists */
+  if (!flatpak_remote_state_lookup_ref (state, ref, &summary_checksum, NULL, NULL, NULL, NULL, NULL) ||
+      g_strcmp0 (summary_checksum, rev) != 0 ||
+      !flatpak_remote_state_load_data (state, ref, &download_size, NULL, NULL, NULL) ||
+      download_size == 0)
+    return FALSE;
+
+  deltas = load_static_deltas_for_rev (self, state, url, rev, token, cancellable);
+  if (deltas == NULL)
+    return FALSE;
+
+  g_variant_iter_init (&iter, deltas);
+  while (g_variant_iter_next (&iter, "{&s@v}", &delta_name, &digest))
+    {
+      g_autoptr(GVariant) digest_v = digest;
+      g_autoptr(GVariant) digest_ay = g_variant_get_variant (digest_v);
+      g_autofree char *from = NULL;
+      g_autofree char *to = NULL;
+      g_autoptr(GVariant) commit = NULL;
+      OstreeRepoCommitState commit_state;
+      guint64 timestamp;
+
+      flatpak_repo_parse_static_delta_name (delta_name, &from, &to);
+
+      if (g_strcmp0 (to, rev) != 0 ||
+          !g_variant_is_of_type (digest_ay, G_VARIANT_TYPE_BYTESTRING) ||
+          g_variant_get_size (digest_ay) != OSTREE_SHA256_DIGEST_LEN)
+        continue;
+
+      if (from == NULL)
+        {
+          g_clear_pointer (&scratch_digest, g_variant_unref);
+          scratch_digest = g_steal_pointer (&digest_ay);
+          continue;
+        }
+
+      if (!ostree_validate_checksum_string (from, NULL) ||
+          !ostree_repo_load_commit (repo, from, &commit, &commit_state, NULL) ||
+          commit_state != OSTREE_REPO_COMMIT_STATE_NORMAL)
+        continue;
+
+      timestamp = ostree_commit_get_timestamp (commit);
+      if (best_from == NULL || timestamp > best_timestamp)
+        {
+          g_free (best_from);
+          best_from = g_steal_pointer (&from);
+          g_clear_pointer (&best_digest, g_variant_unref);
+          best_digest = g_steal_pointer (&digest_ay);
+          best_timestamp = timestamp;
+        }
+    }
+
+  if (best_from == NULL)
+    {
+      /* libostree only uses from-scratch deltas for new refs */
+      if (scratch_digest == NULL || current_checksum != NULL)
+        return FALSE;
+
+      best_digest = g_steal_pointer (&scratch_digest);
+    }
+
+  if (!get_static_delta_size (self, url, best_from, rev, best_digest, token,
+                              &delta_size, cancellable))
+    return FALSE;
+
+  g_info ("Static delta from %s to %s is %" G_GUINT64_FORMAT " bytes, objects are %" G_GUINT64_FORMAT " bytes",
+          best_from ? best_from : "scratch", rev, delta_size, download_size);
+
+  return delta_size > download_size;
+}
+
 gboolean
 flatpak_dir_pull (FlatpakDir                           *self,
                   FlatpakRemoteState                   *state,
@@ -6988,9 +9850,12 @@ flatpak_dir_pull (FlatpakDir                           *self,
   gboolean have_commit = FALSE;
   g_autofree char *rev = NULL;
   g_autofree char *url = NULL;
+  g_autofree char *sideload_uri = NULL;
   g_autoptr(GPtrArray) subdirs_arg = NULL;
   g_auto(GLnxLockFile) lock = { 0, };
   g_autofree char *current_checksum = NULL;
+  g_autoptr(GVariant) metrics = NULL;
+  gint64 start_time = g_get_monotonic_time ();
 
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
     return FALSE;
@@ -7030,10 +9895,13 @@ flatpak_dir_pull (FlatpakDir                           *self,
       return FALSE;
     }
 
+  if (sideload_repo)
+    sideload_uri = g_file_get_uri (sideload_repo);
+
   g_info ("%s: Using commit %s for pull of ref %s from remote %s%s%s",
           G_STRFUNC, rev, ref, state->remote_name,
-          sideload_repo ? "sideloaded from " : "",
-          sideload_repo ? flatpak_file_get_path_cached (sideload_repo) : ""
+          sideload_uri ? "sideloaded from " : "",
+          sideload_uri ? sideload_uri : ""
           );
 
   if (repo == NULL)
@@ -7043,15 +9911,7 @@ flatpak_dir_pull (FlatpakDir                           *self,
      abort the transaction on error */
 
   if (subpaths != NULL && subpaths[0] != NULL)
-    {
-      subdirs_arg = g_ptr_array_new_with_free_func (g_free);
-      int i;
-      g_ptr_array_add (subdirs_arg, g_strdup ("/metadata"));
-      for (i = 0; subpaths[i] != NULL; i++)
-        g_ptr_array_add (subdirs_arg,
-                         g_build_filename ("/files", subpaths[i], NULL));
-      g_ptr_array_add (subdirs_arg, NULL);
-    }
+    subdirs_arg = get_subdirs_to_pull (subpaths);
 
   /* Setup extra data information before starting to pull, so we can have precise
    * progress reports */
@@ -7086,56 +9946,206 @@ flatpak_dir_pull (FlatpakDir                           *self,
   flatpak_repo_resolve_rev (repo, NULL, state->remote_name, ref, TRUE,
                             &current_checksum, NULL, NULL);
 
+  if (sideload_repo == NULL && subdirs_arg == NULL &&
+      (flatpak_flags & FLATPAK_PULL_FLAGS_NO_STATIC_DELTAS) == 0 &&
+      !g_str_has_prefix (url, "file:") &&
+      static_delta_is_larger_than_objects (self, state, repo, url, ref, rev,
+                                           current_checksum, token, cancellable))
+    {
+      g_info ("Pulling objects of %s instead of using a static delta", ref);
+      flatpak_flags |= FLATPAK_PULL_FLAGS_NO_STATIC_DELTAS;
+    }
+
   if (!repo_pull (repo, state,
                   subdirs_arg ? (const char **) subdirs_arg->pdata : NULL,
                   ref, rev, sideload_repo, token, flatpak_flags, flags,
                   progress, self,
                   cancellable, error))
     {
-      g_prefix_error (error, _("While pulling %s from remote %s: "), ref, state->remote_name);
-      goto out;
+      g_prefix_error (error, _("While pulling %s from remote %s: "), ref, state->remote_name);
+      goto out;
+    }
+
+
+  if (require_metadata)
+    {
+      g_autoptr(GVariant) commit_data = NULL;
+      if (!ostree_repo_load_commit (repo, rev, &commit_data, NULL, error) ||
+          !validate_commit_metadata (commit_data,
+                                     ref,
+                                     (const char *)g_bytes_get_data (require_metadata, NULL),
+                                     g_bytes_get_size (require_metadata),
+                                     error))
+        goto out;
+    }
+
+  if (!flatpak_dir_pull_ostree_extra_data (self, repo,
+                                           state->remote_name,
+                                           ref, rev,
+                                           flatpak_flags,
+                                           progress,
+                                           cancellable,
+                                           error))
+    goto out;
+
+
+  if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
+    goto out;
+
+  ret = TRUE;
+
+  metrics = pull_metrics_new (progress, sideload_repo ? "sideload" : "remote", start_time);
+  (flatpak_dir_log) (self, __FILE__, __LINE__, __FUNCTION__, NULL,
+                     "pull", state->remote_name, ref, rev, current_checksum, NULL, metrics,
+                     "Pulled %s from %s", ref, state->remote_name);
+
+out:
+  if (!ret)
+    {
+      ostree_repo_abort_transaction (repo, cancellable, NULL);
+      g_assert (error == NULL || *error != NULL);
+    }
+
+  return ret;
+}
+
+/* This pulls the objects for multiple refs from the same remote in a single
+ * ostree pull, so the summary, delta indexes and HTTP connections are shared
+ * and objects common to several refs are only fetched once. It is meant to
+ * be followed by a regular flatpak_dir_pull() for each ref: the remote refs
+ * are left untouched, so those pulls still do the downgrade checks, extra
+ * data handling and metadata validation, but find all the objects locally.
+ *
+ * The refs must not use subpaths or sideload repos, and OCI remotes are not
+ * supported (this is a no-op for them). */
+gboolean
+flatpak_dir_pull_batch (FlatpakDir          *self,
+                        FlatpakRemoteState  *state,
+                        const char * const  *refs,
+                        const char * const  *revs,
+                        const char          *token,
+                        FlatpakPullFlags     flatpak_flags,
+                        FlatpakProgress     *progress,
+                        GCancellable        *cancellable,
+                        GError             **error)
+{
+  gboolean force_disable_deltas = (flatpak_flags & FLATPAK_PULL_FLAGS_NO_STATIC_DELTAS) != 0;
+  g_auto(GLnxLockFile) lock = { 0, };
+  g_autoptr(GPtrArray) old_checksums = NULL;
+  g_autoptr(GVariant) options = NULL;
+  g_autoptr(GError) dummy_error = NULL;
+  g_autofree char *url = NULL;
+  GVariantBuilder builder;
+  gboolean res;
+  guint n_refs;
+  guint i;
+
+  /* The ostree fetcher asserts if error is NULL */
+  if (error == NULL)
+    error = &dummy_error;
+
+  n_refs = g_strv_length ((char **) refs);
+  g_return_val_if_fail (g_strv_length ((char **) revs) == n_refs, FALSE);
+
+  if (n_refs == 0)
+    return TRUE;
+
+  if (!flatpak_dir_ensure_repo (self, cancellable, error))
+    return FALSE;
+
+  if (!flatpak_dir_repo_lock (self, &lock, LOCK_SH, cancellable, error))
+    return FALSE;
+
+  if (flatpak_dir_get_remote_oci (self, state->remote_name))
+    return TRUE;
+
+  if (!ostree_repo_remote_get_url (self->repo, state->remote_name, &url, error))
+    return FALSE;
+
+  if (*url == 0)
+    return TRUE; /* Empty url, silently disables updates */
+
+  old_checksums = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; i < n_refs; i++)
+    {
+      g_autofree char *old_checksum = NULL;
+      gboolean have_commit = FALSE;
+      g_autoptr(GError) local_error = NULL;
+
+      if (!flatpak_repo_resolve_rev (self->repo, NULL, state->remote_name, refs[i], TRUE,
+                                     &old_checksum, cancellable, error))
+        return FALSE;
+      g_ptr_array_add (old_checksums, g_steal_pointer (&old_checksum));
+
+      /* Same workaround for incomplete pulled commits as in flatpak_dir_pull() */
+      if (!ostree_repo_has_object (self->repo, OSTREE_OBJECT_TYPE_COMMIT, revs[i], &have_commit, NULL, &local_error))
+        g_warning ("Encountered error checking for commit object %s: %s", revs[i], local_error->message);
+      else if (!have_commit &&
+               !ostree_repo_mark_commit_partial (self->repo, revs[i], TRUE, &local_error))
+        g_warning ("Encountered error marking commit partial: %s: %s", revs[i], local_error->message);
     }
 
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  get_common_pull_options (&builder, state, NULL, token, NULL, NULL,
+                           force_disable_deltas, OSTREE_REPO_PULL_FLAGS_BAREUSERONLY_FILES,
+                           progress, self);
+  g_variant_builder_add (&builder, "{s@v}", "refs",
+                         g_variant_new_variant (g_variant_new_strv (refs, -1)));
+  g_variant_builder_add (&builder, "{s@v}", "override-commit-ids",
+                         g_variant_new_variant (g_variant_new_strv (revs, -1)));
 
-  if (require_metadata)
+  if (state->sideload_repos->len > 0)
     {
-      g_autoptr(GVariant) commit_data = NULL;
-      if (!ostree_repo_load_commit (repo, rev, &commit_data, NULL, error) ||
-          !validate_commit_metadata (commit_data,
-                                     ref,
-                                     (const char *)g_bytes_get_data (require_metadata, NULL),
-                                     g_bytes_get_size (require_metadata),
-                                     error))
-        goto out;
+      GVariantBuilder localcache_repos_builder;
+
+      g_variant_builder_init (&localcache_repos_builder, G_VARIANT_TYPE ("as"));
+      for (i = 0; i < state->sideload_repos->len; i++)
+        {
+          FlatpakSideloadState *ss = g_ptr_array_index (state->sideload_repos, i);
+          GFile *sideload_path = ostree_repo_get_path (ss->repo);
+
+          g_variant_builder_add (&localcache_repos_builder, "s",
+                                 flatpak_file_get_path_cached (sideload_path));
+        }
+      g_variant_builder_add (&builder, "{s@v}", "localcache-repos",
+                             g_variant_new_variant (g_variant_builder_end (&localcache_repos_builder)));
     }
 
-  if (!flatpak_dir_pull_ostree_extra_data (self, repo,
-                                           state->remote_name,
-                                           ref, rev,
-                                           flatpak_flags,
-                                           progress,
-                                           cancellable,
-                                           error))
-    goto out;
+  options = g_variant_ref_sink (g_variant_builder_end (&builder));
 
+  if (!ostree_repo_prepare_transaction (self->repo, NULL, cancellable, error))
+    return FALSE;
 
-  if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
-    goto out;
+  {
+    g_auto(FlatpakMainContext) context = FLATKPAK_MAIN_CONTEXT_INIT;
+    flatpak_progress_init_main_context (progress, &context);
 
-  ret = TRUE;
+    res = ostree_repo_pull_with_options (self->repo, state->remote_name,
+                                         options, context.ostree_progress, cancellable, error);
+  }
 
-  (flatpak_dir_log) (self, __FILE__, __LINE__, __FUNCTION__, NULL,
-                     "pull", state->remote_name, ref, rev, current_checksum, NULL,
-                     "Pulled %s from %s", ref, state->remote_name);
+  if (!res)
+    {
+      translate_ostree_repo_pull_errors (error);
+      ostree_repo_abort_transaction (self->repo, cancellable, NULL);
+      return FALSE;
+    }
 
-out:
-  if (!ret)
+  /* Put the remote refs back to where they were, so only the objects are
+   * committed and the following per-ref pulls behave as before */
+  for (i = 0; i < n_refs; i++)
+    ostree_repo_transaction_set_ref (self->repo, state->remote_name, refs[i],
+                                     g_ptr_array_index (old_checksums, i));
+
+  if (!ostree_repo_commit_transaction (self->repo, NULL, cancellable, error))
     {
-      ostree_repo_abort_transaction (repo, cancellable, NULL);
-      g_assert (error == NULL || *error != NULL);
+      ostree_repo_abort_transaction (self->repo, cancellable, NULL);
+      return FALSE;
     }
 
-  return ret;
+  g_info ("Batch pulled %u refs from remote %s", n_refs, state->remote_name);
+
+  return TRUE;
 }
 
 static gboolean
@@ -7146,12 +10156,13 @@ repo_pull_local_untrusted (FlatpakDir          *self,
                            const char         **dirs_to_pull,
                            const char          *ref,
                            const char          *checksum,
+                           gboolean             objects_verified,
                            FlatpakProgress     *progress,
                            GCancellable        *cancellable,
                            GError             **error)
 {
   /* The latter flag was introduced in https://github.com/ostreedev/ostree/pull/926 */
-  const OstreeRepoPullFlags flags = OSTREE_REPO_PULL_FLAGS_UNTRUSTED | OSTREE_REPO_PULL_FLAGS_BAREUSERONLY_FILES;
+  OstreeRepoPullFlags flags = OSTREE_REPO_PULL_FLAGS_UNTRUSTED | OSTREE_REPO_PULL_FLAGS_BAREUSERONLY_FILES;
   GVariantBuilder builder;
   g_autoptr(GVariant) options = NULL;
   gboolean res;
@@ -7165,6 +10176,12 @@ repo_pull_local_untrusted (FlatpakDir          *self,
   if (error == NULL)
     error = &dummy_error;
 
+  /* If the caller already verified every object in place, let ostree
+   * import them without checksumming again, which allows it to hardlink
+   * them rather than copy when both repos are on the same filesystem. */
+  if (objects_verified)
+    flags &= ~OSTREE_REPO_PULL_FLAGS_UNTRUSTED;
+
   refs[0] = ref;
   commits[0] = checksum;
 
@@ -7205,12 +10222,60 @@ repo_pull_local_untrusted (FlatpakDir          *self,
   return res;
 }
 
+/* Verify all objects stored in @repo itself (not its parent) the way an
+ * untrusted pull would: the checksum must match and content objects must
+ * be valid for a bare-user-only repo. */
+static gboolean
+verify_local_repo_objects (OstreeRepo   *repo,
+                           GCancellable *cancellable,
+                           GError      **error)
+{
+  g_autoptr(GHashTable) objects = NULL;
+  GHashTableIter iter;
+  gpointer key;
+
+  if (!ostree_repo_list_objects (repo,
+                                 OSTREE_REPO_LIST_OBJECTS_LOOSE | OSTREE_REPO_LIST_OBJECTS_NO_PARENTS,
+                                 &objects, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, objects);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+
+      ostree_object_name_deserialize (key, &checksum, &objtype);
+
+      if (!ostree_repo_fsck_object (repo, objtype, checksum, cancellable, error))
+        return FALSE;
+
+      if (objtype == OSTREE_OBJECT_TYPE_FILE)
+        {
+          g_autoptr(GFileInfo) info = NULL;
+          guint32 mode;
+
+          if (!ostree_repo_load_file (repo, checksum, NULL, &info, NULL, cancellable, error))
+            return FALSE;
+
+          mode = g_file_info_get_attribute_uint32 (info, "unix::mode");
+          if (g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR &&
+              ((mode & ~S_IFMT) & ~0775) != 0)
+            return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                                       "Content object %s has invalid mode 0%o", checksum, mode);
+        }
+    }
+
+  return TRUE;
+}
+
 gboolean
 flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
                                   const char          *src_path,
                                   const char          *remote_name,
                                   const char          *ref,
                                   const char         **subpaths,
+                                  gboolean             src_is_sealed,
                                   FlatpakProgress     *progress,
                                   GCancellable        *cancellable,
                                   GError             **error)
@@ -7231,6 +10296,9 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
   g_auto(GLnxLockFile) lock = { 0, };
   gboolean ret = FALSE;
   g_autofree const char **ref_bindings = NULL;
+  g_autoptr(GVariant) metrics = NULL;
+  gint64 start_time = g_get_monotonic_time ();
+  gboolean objects_verified = FALSE;
 
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
     return FALSE;
@@ -7317,14 +10385,26 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
     }
 
   if (subpaths != NULL && subpaths[0] != NULL)
+    subdirs_arg = get_subdirs_to_pull (subpaths);
+
+  /* When the caller can no longer modify the source repo, check the
+   * objects where they are so that the import can link instead of copy.
+   * Only the objects in the repo itself are checked, and both opening it
+   * and the pull follow its core.parent, which the caller wrote before it
+   * was sealed. So this is only safe if the parent is our own repo. */
+  if (src_is_sealed)
     {
-      subdirs_arg = g_ptr_array_new_with_free_func (g_free);
-      int i;
-      g_ptr_array_add (subdirs_arg, g_strdup ("/metadata"));
-      for (i = 0; subpaths[i] != NULL; i++)
-        g_ptr_array_add (subdirs_arg,
-                         g_build_filename ("/files", subpaths[i], NULL));
-      g_ptr_array_add (subdirs_arg, NULL);
+      OstreeRepo *src_parent = ostree_repo_get_parent (src_repo);
+
+      if (src_parent != NULL && !ostree_repo_equal (src_parent, self->repo))
+        g_info ("Not trusting objects in %s, its parent is not the system repo", src_path);
+      else if (!verify_local_repo_objects (src_repo, cancellable, error))
+        {
+          g_prefix_error (error, _("While verifying %s in %s: "), ref, src_path);
+          return FALSE;
+        }
+      else
+        objects_verified = TRUE;
     }
 
   if (!ostree_repo_prepare_transaction (self->repo, NULL, cancellable, error))
@@ -7334,7 +10414,7 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
 
   if (!repo_pull_local_untrusted (self, self->repo, remote_name, url,
                                   subdirs_arg ? (const char **) subdirs_arg->pdata : NULL,
-                                  ref, checksum, progress,
+                                  ref, checksum, objects_verified, progress,
                                   cancellable, error))
     {
       g_prefix_error (error, _("While pulling %s from remote %s: "), ref, remote_name);
@@ -7375,8 +10455,10 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
 
   ret = TRUE;
 
-  flatpak_dir_log (self, "pull local", src_path, ref, checksum, current_checksum, NULL,
-                   "Pulled %s from %s", ref, src_path);
+  metrics = pull_metrics_new (progress, "local", start_time);
+  (flatpak_dir_log) (self, __FILE__, __LINE__, __FUNCTION__, NULL,
+                     "pull local", src_path, ref, checksum, current_checksum, NULL, metrics,
+                     "Pulled %s from %s", ref, src_path);
 out:
   if (!ret)
     ostree_repo_abort_transaction (self->repo, cancellable, NULL);
@@ -7595,6 +10677,11 @@ flatpak_dir_list_refs_for_name (FlatpakDir   *self,
                                 GError      **error)
 {
   g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(GVariant) index = NULL;
+
+  index = flatpak_dir_get_deployed_index (self);
+  if (index != NULL)
+    return deployed_index_list_refs (index, kinds, name);
 
   refs = g_ptr_array_new_with_free_func ((GDestroyNotify)flatpak_decomposed_unref);
 
@@ -7619,8 +10706,9 @@ flatpak_dir_list_refs_for_name (FlatpakDir   *self,
   return g_steal_pointer (&refs);
 }
 
-GPtrArray *
-flatpak_dir_list_refs (FlatpakDir   *self,
+/* Lists the deployed refs by walking the deploy dirs */
+static GPtrArray *
+flatpak_dir_scan_refs (FlatpakDir   *self,
                        FlatpakKinds kinds,
                        GCancellable *cancellable,
                        GError      **error)
@@ -7716,6 +10804,21 @@ flatpak_dir_list_refs (FlatpakDir   *self,
   return g_steal_pointer (&refs);
 }
 
+GPtrArray *
+flatpak_dir_list_refs (FlatpakDir   *self,
+                       FlatpakKinds kinds,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_autoptr(GVariant) index = NULL;
+
+  index = flatpak_dir_get_deployed_index (self);
+  if (index != NULL)
+    return deployed_index_list_refs (index, kinds, NULL);
+
+  return flatpak_dir_scan_refs (self, kinds, cancellable, error);
+}
+
 gboolean
 flatpak_dir_is_runtime_extension (FlatpakDir        *self,
                                   FlatpakDecomposed *ref)
@@ -8043,6 +11146,163 @@ maybe_reload_dbus_config (GCancellable *cancellable)
                                      NULL);
 }
 
+/* The parts of the exports each known trigger reads, and the files it
+ * writes there, which must not count as input changes. Triggers with
+ * per_subdir set handle each subdirectory of their input on its own,
+ * and get passed the names of the ones that changed. */
+static const struct {
+  const char *name;
+  const char *input;
+  const char *outputs[3];
+  gboolean per_subdir;
+} trigger_inputs[] = {
+  { "desktop-database.trigger", "share/applications", { "mimeinfo.cache", NULL }, FALSE },
+  { "gtk-icon-cache.trigger", "share/icons", { "icon-theme.cache", "index.theme", NULL }, TRUE },
+  { "mime-database.trigger", "share/mime/packages", { NULL }, FALSE },
+};
+
+static int
+lookup_trigger_inputs (const char *name)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (trigger_inputs); i++)
+    {
+      if (strcmp (trigger_inputs[i].name, name) == 0)
+        return i;
+    }
+
+  return -1;
+}
+
+static void
+checksum_trigger_input_dir (GChecksum          *checksum,
+                            int                 dfd,
+                            const char         *path,
+                            const char * const *outputs)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  struct dirent *dent;
+  guint i;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, path, TRUE, &iter, NULL))
+    {
+      g_checksum_update (checksum, (const guchar *) "missing", -1);
+      return;
+    }
+
+  while (glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, NULL) && dent != NULL)
+    g_ptr_array_add (names, g_strdup (dent->d_name));
+
+  g_ptr_array_sort (names, flatpak_strcmp0_ptr);
+
+  for (i = 0; i < names->len; i++)
+    {
+      const char *name = g_ptr_array_index (names, i);
+      g_autofree char *entry = NULL;
+      struct stat stbuf;
+      gboolean is_dir = FALSE;
+
+      /* Only whether the outputs exist matters, they change on every run */
+      if (g_strv_contains (outputs, name))
+        entry = g_strdup_printf ("%s/%s:output", path, name);
+      else if (fstatat (iter.fd, name, &stbuf, 0) != 0)
+        entry = g_strdup_printf ("%s/%s:dangling", path, name);
+      else if ((is_dir = S_ISDIR (stbuf.st_mode)))
+        /* The mtime of directories changes when outputs are written */
+        entry = g_strdup_printf ("%s/%s:dir", path, name);
+      else
+        /* Checked out files have a zero mtime, but deploys hardlink
+         * unchanged files from the repo, so the inode changes with the content */
+        entry = g_strdup_printf ("%s/%s:%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT,
+                                 path, name, (guint64) stbuf.st_dev, (guint64) stbuf.st_ino,
+                                 (gint64) stbuf.st_size, (gint64) stbuf.st_mtime);
+
+      g_checksum_update (checksum, (const guchar *) entry, -1);
+
+      if (is_dir)
+        {
+          g_autofree char *subpath = g_build_filename (path, name, NULL);
+
+          checksum_trigger_input_dir (checksum, dfd, subpath, outputs);
+        }
+    }
+}
+
+/* Returns a checksum of everything the trigger depends on, or %NULL if we
+ * don't know what that is and it always needs to run. If @subdir is set,
+ * only that subdirectory of the input is considered. */
+static char *
+get_trigger_input_checksum (FlatpakDir *self,
+                            GFile      *trigger,
+                            const char *subdir)
+{
+  g_autoptr(GChecksum) checksum = NULL;
+  g_autoptr(GFile) exports = NULL;
+  g_autofree char *trigger_path = NULL;
+  g_autofree char *trigger_stat = NULL;
+  g_autofree char *input = NULL;
+  glnx_autofd int exports_dfd = -1;
+  g_autofree char *name = g_file_get_basename (trigger);
+  struct stat stbuf;
+  int i;
+
+  i = lookup_trigger_inputs (name);
+  if (i < 0)
+    return NULL;
+
+  trigger_path = g_file_get_path (trigger);
+  if (stat (trigger_path, &stbuf) != 0)
+    return NULL;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  /* Rerun if the trigger itself changed */
+  trigger_stat = g_strdup_printf ("%s:%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT,
+                                  trigger_path, (gint64) stbuf.st_size, (gint64) stbuf.st_mtime);
+  g_checksum_update (checksum, (const guchar *) trigger_stat, -1);
+
+  if (subdir != NULL)
+    input = g_build_filename (trigger_inputs[i].input, subdir, NULL);
+  else
+    input = g_strdup (trigger_inputs[i].input);
+
+  exports = flatpak_dir_get_exports_dir (self);
+  if (glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (exports), TRUE, &exports_dfd, NULL))
+    checksum_trigger_input_dir (checksum, exports_dfd, input, trigger_inputs[i].outputs);
+  else
+    g_checksum_update (checksum, (const guchar *) "missing", -1);
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Returns the sorted names of the subdirectories of the trigger input */
+static GPtrArray *
+list_trigger_input_subdirs (FlatpakDir *self,
+                            int         i)
+{
+  g_autoptr(GPtrArray) subdirs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GFile) exports = flatpak_dir_get_exports_dir (self);
+  g_autofree char *input = g_build_filename (flatpak_file_get_path_cached (exports),
+                                             trigger_inputs[i].input, NULL);
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, input, TRUE, &iter, NULL))
+    return g_steal_pointer (&subdirs);
+
+  while (glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL, NULL) && dent != NULL)
+    {
+      if (dent->d_type == DT_DIR)
+        g_ptr_array_add (subdirs, g_strdup (dent->d_name));
+    }
+
+  g_ptr_array_sort (subdirs, flatpak_strcmp0_ptr);
+
+  return g_steal_pointer (&subdirs);
+}
+
 gboolean
 flatpak_dir_run_triggers (FlatpakDir   *self,
                           GCancellable *cancellable,
@@ -8054,6 +11314,9 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
   g_autoptr(GFile) triggersdir = NULL;
   GError *temp_error = NULL;
   g_autofree char *triggerspath = NULL;
+  g_autoptr(GFile) stamps_file = NULL;
+  g_autoptr(GKeyFile) stamps = NULL;
+  gboolean stamps_changed = FALSE;
 
   maybe_reload_dbus_config (cancellable);
 
@@ -8079,6 +11342,13 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
 
   triggersdir = g_file_new_for_path (triggerspath);
 
+  /* Remember what the inputs of each trigger looked like after it last
+   * ran, so we can skip it if nothing it reads changed since */
+  stamps_file = g_file_get_child (self->basedir, ".trigger-inputs");
+  stamps = g_key_file_new ();
+  (void) g_key_file_load_from_file (stamps, flatpak_file_get_path_cached (stamps_file),
+                                    G_KEY_FILE_NONE, NULL);
+
   dir_enum = g_file_enumerate_children (triggersdir, "standard::type,standard::name",
                                         0, cancellable, error);
   if (!dir_enum)
@@ -8104,6 +11374,50 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
           g_autofree char *basedir = realpath (basedir_orig, NULL);
           g_autoptr(FlatpakBwrap) bwrap = NULL;
           g_autofree char *commandline = NULL;
+          g_autofree char *old_input_checksum = NULL;
+          g_autofree char *input_checksum = NULL;
+          g_autoptr(GPtrArray) subdirs = NULL;
+          g_autoptr(GPtrArray) changed_subdirs = NULL;
+          int inputs = lookup_trigger_inputs (name);
+          int wait_status = 0;
+          gboolean spawned;
+          guint i;
+
+          if (inputs >= 0 && trigger_inputs[inputs].per_subdir)
+            {
+              /* The stamps of these are kept per subdirectory, in a group
+               * named after the trigger */
+              subdirs = list_trigger_input_subdirs (self, inputs);
+              changed_subdirs = g_ptr_array_new_with_free_func (g_free);
+
+              for (i = 0; i < subdirs->len; i++)
+                {
+                  const char *subdir = g_ptr_array_index (subdirs, i);
+                  g_autofree char *subdir_checksum = get_trigger_input_checksum (self, child, subdir);
+                  g_autofree char *old_subdir_checksum = g_key_file_get_string (stamps, name, subdir, NULL);
+
+                  if (subdir_checksum == NULL || g_strcmp0 (subdir_checksum, old_subdir_checksum) != 0)
+                    g_ptr_array_add (changed_subdirs, g_strdup (subdir));
+                }
+
+              if (changed_subdirs->len == 0)
+                {
+                  g_info ("skipping trigger %s, its inputs are unchanged", name);
+                  g_clear_object (&child_info);
+                  continue;
+                }
+            }
+          else
+            {
+              input_checksum = get_trigger_input_checksum (self, child, NULL);
+              old_input_checksum = g_key_file_get_string (stamps, "triggers", name, NULL);
+              if (input_checksum != NULL && g_strcmp0 (input_checksum, old_input_checksum) == 0)
+                {
+                  g_info ("skipping trigger %s, its inputs are unchanged", name);
+                  g_clear_object (&child_info);
+                  continue;
+                }
+            }
 
           g_info ("running trigger %s", name);
 
@@ -8126,29 +11440,84 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
                                   flatpak_file_get_path_cached (child),
                                   basedir,
                                   NULL);
+          if (changed_subdirs != NULL)
+            {
+              for (i = 0; i < changed_subdirs->len; i++)
+                flatpak_bwrap_add_arg (bwrap, g_ptr_array_index (changed_subdirs, i));
+            }
           flatpak_bwrap_finish (bwrap);
 
           commandline = flatpak_quote_argv ((const char **) bwrap->argv->pdata, -1);
           g_info ("Running '%s'", commandline);
 
+          FLATPAK_TRACE1 (trigger_start, name);
+
           /* We use LEAVE_DESCRIPTORS_OPEN and close them in the child_setup
            * to work around a deadlock in GLib < 2.60 */
-          if (!g_spawn_sync ("/",
-                             (char **) bwrap->argv->pdata,
-                             NULL,
-                             G_SPAWN_SEARCH_PATH | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
-                             flatpak_bwrap_child_setup_cb, bwrap->fds,
-                             NULL, NULL,
-                             NULL, &trigger_error))
+          spawned = g_spawn_sync ("/",
+                                  (char **) bwrap->argv->pdata,
+                                  NULL,
+                                  G_SPAWN_SEARCH_PATH | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
+                                  flatpak_bwrap_child_setup_cb, bwrap->fds,
+                                  NULL, NULL,
+                                  &wait_status, &trigger_error);
+
+          FLATPAK_TRACE2 (trigger_done, name, wait_status);
+
+          if (!spawned)
             {
               g_warning ("Error running trigger %s: %s", name, trigger_error->message);
               g_clear_error (&trigger_error);
             }
+          else if (WIFEXITED (wait_status) && WEXITSTATUS (wait_status) == 0 &&
+                   changed_subdirs != NULL)
+            {
+              g_auto(GStrv) stamped = g_key_file_get_keys (stamps, name, NULL, NULL);
+
+              for (i = 0; i < changed_subdirs->len; i++)
+                {
+                  const char *subdir = g_ptr_array_index (changed_subdirs, i);
+                  g_autofree char *subdir_checksum = get_trigger_input_checksum (self, child, subdir);
+
+                  if (subdir_checksum != NULL)
+                    g_key_file_set_string (stamps, name, subdir, subdir_checksum);
+                }
+
+              /* Forget the subdirectories that are gone */
+              for (i = 0; stamped != NULL && stamped[i] != NULL; i++)
+                {
+                  if (!g_ptr_array_find_with_equal_func (subdirs, stamped[i], g_str_equal, NULL))
+                    g_key_file_remove_key (stamps, name, stamped[i], NULL);
+                }
+
+              g_key_file_remove_key (stamps, "triggers", name, NULL);
+              stamps_changed = TRUE;
+            }
+          else if (WIFEXITED (wait_status) && WEXITSTATUS (wait_status) == 0)
+            {
+              /* The trigger writes its outputs next to its inputs, which
+               * can change the directories, so checksum again */
+              g_clear_pointer (&input_checksum, g_free);
+              input_checksum = get_trigger_input_checksum (self, child, NULL);
+              if (input_checksum != NULL)
+                {
+                  g_key_file_set_string (stamps, "triggers", name, input_checksum);
+                  stamps_changed = TRUE;
+                }
+            }
         }
 
       g_clear_object (&child_info);
     }
 
+  if (stamps_changed)
+    {
+      g_autoptr(GError) stamps_error = NULL;
+
+      if (!g_key_file_save_to_file (stamps, flatpak_file_get_path_cached (stamps_file), &stamps_error))
+        g_info ("Failed to save trigger input checksums: %s", stamps_error->message);
+    }
+
   if (temp_error != NULL)
     {
       g_propagate_error (error, temp_error);
@@ -8869,6 +12238,9 @@ out:
 }
 
 
+/* Symlinks @source_name into @destination_name, adding the paths of the
+ * created symlinks (@source_relpath being the path of @source_name in the
+ * exports dir) to @exported if not %NULL */
 static gboolean
 export_dir (int           source_parent_fd,
             const char   *source_name,
@@ -8876,6 +12248,7 @@ export_dir (int           source_parent_fd,
             const char   *source_relpath,
             int           destination_parent_fd,
             const char   *destination_name,
+            GPtrArray    *exported,
             GCancellable *cancellable,
             GError      **error)
 {
@@ -8933,7 +12306,7 @@ export_dir (int           source_parent_fd,
           g_autofree gchar *child_relpath = g_strconcat (source_relpath, dent->d_name, "/", NULL);
 
           if (!export_dir (source_iter.fd, dent->d_name, child_symlink_prefix, child_relpath, destination_dfd, dent->d_name,
-                           cancellable, error))
+                           exported, cancellable, error))
             goto out;
         }
       else if (S_ISREG (stbuf.st_mode))
@@ -8962,6 +12335,9 @@ export_dir (int           source_parent_fd,
                   goto out;
                 }
 
+              if (exported)
+                g_ptr_array_add (exported, g_strconcat (source_relpath, dent->d_name, NULL));
+
               break;
             }
         }
@@ -8977,6 +12353,7 @@ static gboolean
 flatpak_export_dir (GFile        *source,
                     GFile        *destination,
                     const char   *symlink_prefix,
+                    GPtrArray    *exported,
                     GCancellable *cancellable,
                     GError      **error)
 {
@@ -8992,23 +12369,111 @@ flatpak_export_dir (GFile        *source,
   };
   int i;
 
-  for (i = 0; i < G_N_ELEMENTS (exported_subdirs); i = i + 2)
+  for (i = 0; i < G_N_ELEMENTS (exported_subdirs); i = i + 2)
+    {
+      /* The fds are closed by this call */
+      g_autoptr(GFile) sub_source = g_file_resolve_relative_path (source, exported_subdirs[i]);
+      g_autoptr(GFile) sub_destination = g_file_resolve_relative_path (destination, exported_subdirs[i]);
+      g_autofree char *sub_symlink_prefix = g_build_filename (exported_subdirs[i + 1], symlink_prefix, exported_subdirs[i], NULL);
+      g_autofree char *sub_relpath = g_strconcat (exported_subdirs[i], "/", NULL);
+
+      if (!g_file_query_exists (sub_source, cancellable))
+        continue;
+
+      if (!flatpak_mkdir_p (sub_destination, cancellable, error))
+        return FALSE;
+
+      if (!export_dir (AT_FDCWD, flatpak_file_get_path_cached (sub_source), sub_symlink_prefix, sub_relpath,
+                       AT_FDCWD, flatpak_file_get_path_cached (sub_destination),
+                       exported, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Each app's exports are recorded in a manifest, so updating them only
+ * has to look at that app's symlinks rather than at all the exports */
+#define EXPORTS_MANIFEST_DIR ".manifests"
+
+static GFile *
+get_exports_manifest_file (GFile      *exports,
+                           const char *app)
+{
+  g_autofree char *path = g_build_filename (EXPORTS_MANIFEST_DIR, app, NULL);
+
+  return g_file_resolve_relative_path (exports, path);
+}
+
+/* Returns %NULL if there is no manifest for @app, i.e. its exports
+ * predate the manifests */
+static char **
+load_exports_manifest (GFile        *manifest,
+                       GCancellable *cancellable)
+{
+  g_autofree char *contents = NULL;
+
+  if (!g_file_load_contents (manifest, cancellable, &contents, NULL, NULL, NULL))
+    return NULL;
+
+  return g_strsplit (contents, "\n", -1);
+}
+
+static gboolean
+save_exports_manifest (GFile        *manifest,
+                       GPtrArray    *exported,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_autoptr(GFile) manifest_dir = g_file_get_parent (manifest);
+  g_autoptr(GString) contents = g_string_new ("");
+  guint i;
+
+  for (i = 0; i < exported->len; i++)
+    {
+      if (i > 0)
+        g_string_append_c (contents, '\n');
+      g_string_append (contents, g_ptr_array_index (exported, i));
+    }
+
+  if (!flatpak_mkdir_p (manifest_dir, cancellable, error))
+    return FALSE;
+
+  return g_file_replace_contents (manifest, contents->str, contents->len, NULL, FALSE,
+                                  G_FILE_CREATE_REPLACE_DESTINATION, NULL, cancellable, error);
+}
+
+/* Removes the symlinks in @old_exported that are not in @exported and
+ * no longer resolve */
+static gboolean
+remove_stale_exports (GFile         *exports,
+                      char         **old_exported,
+                      GPtrArray     *exported,
+                      GError       **error)
+{
+  g_autoptr(GHashTable) current = g_hash_table_new (g_str_hash, g_str_equal);
+  guint i;
+
+  for (i = 0; i < exported->len; i++)
+    g_hash_table_add (current, g_ptr_array_index (exported, i));
+
+  for (i = 0; old_exported[i] != NULL; i++)
     {
-      /* The fds are closed by this call */
-      g_autoptr(GFile) sub_source = g_file_resolve_relative_path (source, exported_subdirs[i]);
-      g_autoptr(GFile) sub_destination = g_file_resolve_relative_path (destination, exported_subdirs[i]);
-      g_autofree char *sub_symlink_prefix = g_build_filename (exported_subdirs[i + 1], symlink_prefix, exported_subdirs[i], NULL);
+      g_autofree char *path = NULL;
+      struct stat stbuf;
 
-      if (!g_file_query_exists (sub_source, cancellable))
+      if (*old_exported[i] == '\0' ||
+          g_hash_table_contains (current, old_exported[i]))
         continue;
 
-      if (!flatpak_mkdir_p (sub_destination, cancellable, error))
-        return FALSE;
+      path = g_build_filename (flatpak_file_get_path_cached (exports), old_exported[i], NULL);
 
-      if (!export_dir (AT_FDCWD, flatpak_file_get_path_cached (sub_source), sub_symlink_prefix, "",
-                       AT_FDCWD, flatpak_file_get_path_cached (sub_destination),
-                       cancellable, error))
-        return FALSE;
+      if (lstat (path, &stbuf) != 0 || !S_ISLNK (stbuf.st_mode) ||
+          stat (path, &stbuf) == 0 || errno != ENOENT)
+        continue;
+
+      if (unlink (path) != 0 && errno != ENOENT)
+        return glnx_throw_errno_prefix (error, "unlink(%s)", path);
     }
 
   return TRUE;
@@ -9025,12 +12490,21 @@ flatpak_dir_update_exports (FlatpakDir   *self,
   g_autoptr(FlatpakDecomposed) current_ref = NULL;
   g_autofree char *active_id = NULL;
   g_autofree char *symlink_prefix = NULL;
+  g_autoptr(GFile) manifest = NULL;
+  g_auto(GStrv) old_exported = NULL;
+  g_autoptr(GPtrArray) exported = g_ptr_array_new_with_free_func (g_free);
 
   exports = flatpak_dir_get_exports_dir (self);
 
   if (!flatpak_mkdir_p (exports, cancellable, error))
     goto out;
 
+  if (changed_app)
+    {
+      manifest = get_exports_manifest_file (exports, changed_app);
+      old_exported = load_exports_manifest (manifest, cancellable);
+    }
+
   if (changed_app &&
       (current_ref = flatpak_dir_current_ref (self, changed_app, cancellable)) &&
       (active_id = flatpak_dir_read_active (self, current_ref, cancellable)))
@@ -9048,13 +12522,35 @@ flatpak_dir_update_exports (FlatpakDir   *self,
           symlink_prefix = g_build_filename ("..", "app", changed_app, "current", "active", "export", NULL);
           if (!flatpak_export_dir (export, exports,
                                    symlink_prefix,
+                                   exported,
                                    cancellable,
                                    error))
             goto out;
         }
     }
 
-  if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
+  if (manifest != NULL)
+    {
+      if (exported->len > 0)
+        {
+          if (!save_exports_manifest (manifest, exported, cancellable, error))
+            goto out;
+        }
+      else
+        (void) g_file_delete (manifest, cancellable, NULL); /* Nothing exported anymore */
+    }
+
+  if (old_exported != NULL)
+    {
+      /* Only the symlinks this app had can have become stale */
+      if (!remove_stale_exports (exports, old_exported, exported, error))
+        goto out;
+    }
+  /* Removing the stale exports means going over all of them, so when
+   * changing many apps in a row we only do it once at the end */
+  else if (self->defer_exports_cleanup)
+    self->exports_cleanup_pending = TRUE;
+  else if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
     goto out;
 
   ret = TRUE;
@@ -9063,6 +12559,166 @@ out:
   return ret;
 }
 
+/* While set, flatpak_dir_update_exports() leaves the removal of stale
+ * exports to flatpak_dir_flush_exports(). This doesn't apply to changes
+ * done via the system helper. */
+void
+flatpak_dir_set_defer_exports_cleanup (FlatpakDir *self,
+                                       gboolean    defer_exports_cleanup)
+{
+  self->defer_exports_cleanup = defer_exports_cleanup;
+}
+
+gboolean
+flatpak_dir_flush_exports (FlatpakDir   *self,
+                           GCancellable *cancellable,
+                           GError      **error)
+{
+  g_autoptr(GFile) exports = NULL;
+
+  if (!self->exports_cleanup_pending)
+    return TRUE;
+
+  exports = flatpak_dir_get_exports_dir (self);
+  if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
+    return FALSE;
+
+  self->exports_cleanup_pending = FALSE;
+
+  return TRUE;
+}
+
+/* While set, flatpak_dir_uninstall() leaves the removal of the mirror
+ * refs and the update of the .changed stamp to
+ * flatpak_dir_flush_uninstall_cleanup(), so that they are done once for
+ * a whole batch of refs. Like for the exports, this doesn't apply to
+ * changes done via the system helper. */
+void
+flatpak_dir_set_defer_uninstall_cleanup (FlatpakDir *self,
+                                         gboolean    defer_uninstall_cleanup)
+{
+  self->defer_uninstall_cleanup = defer_uninstall_cleanup;
+}
+
+gboolean
+flatpak_dir_flush_uninstall_cleanup (FlatpakDir   *self,
+                                     GCancellable *cancellable,
+                                     GError      **error)
+{
+  g_auto(GLnxLockFile) lock = { 0, };
+
+  if (!self->uninstall_cleanup_pending)
+    return TRUE;
+
+  self->uninstall_cleanup_pending = FALSE;
+
+  /* The refs are gone already, so let others know even if the
+   * cleanup below fails */
+  if (!flatpak_dir_mark_changed (self, error))
+    return FALSE;
+
+  if (!flatpak_dir_lock (self, &lock, cancellable, error))
+    return FALSE;
+
+  return flatpak_dir_delete_mirror_refs (self, FALSE, cancellable, error);
+}
+
+/* Extra data can be large, so it is written out and checksummed in chunks
+ * in one pass, rather than hashing all of it before writing any. It goes
+ * to an anonymous tmpfile that is only linked in once the checksum is
+ * known to be right, so a bad file never shows up in the extradir. */
+#define EXTRA_DATA_WRITE_CHUNK_SIZE (1024 * 1024)
+
+static gboolean
+write_extra_data_file (int            dfd,
+                       const char    *name,
+                       const guchar  *data,
+                       gsize          len,
+                       const char    *expected_sha256,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  gsize offset = 0;
+
+  if (!glnx_open_tmpfile_linkable_at (dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+
+  while (offset < len)
+    {
+      gsize chunk_size = MIN (len - offset, EXTRA_DATA_WRITE_CHUNK_SIZE);
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      g_checksum_update (checksum, data + offset, chunk_size);
+      if (glnx_loop_write (tmpf.fd, data + offset, chunk_size) < 0)
+        return glnx_throw_errno_prefix (error, "write");
+
+      offset += chunk_size;
+    }
+
+  if (strcmp (g_checksum_get_string (checksum), expected_sha256) != 0)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for extra data"));
+
+  if (fchmod (tmpf.fd, 0644) != 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE, dfd, name, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+/* If the extra-data cache has the file, copy it from there instead, which
+ * shares the blocks with the cache on filesystems that support reflinks.
+ * The copy is verified before it is linked in. */
+static gboolean
+copy_extra_data_from_cache (int         dfd,
+                            const char *name,
+                            const char *sha256,
+                            guint64     size)
+{
+  glnx_autofd int cache_dfd = open_extra_data_cache_dir ();
+  glnx_autofd int src_fd = -1;
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autofree char *actual_sha256 = NULL;
+  struct stat stbuf;
+
+  if (cache_dfd < 0)
+    return FALSE;
+
+  if (!glnx_openat_rdonly (cache_dfd, sha256, TRUE, &src_fd, NULL) ||
+      !glnx_fstat (src_fd, &stbuf, NULL) ||
+      (guint64) stbuf.st_size != size)
+    return FALSE;
+
+  if (!glnx_open_tmpfile_linkable_at (dfd, ".", O_RDWR | O_CLOEXEC, &tmpf, NULL) ||
+      glnx_regfile_copy_bytes (src_fd, tmpf.fd, (off_t) -1) < 0)
+    return FALSE;
+
+  mfile = g_mapped_file_new_from_fd (tmpf.fd, FALSE, NULL);
+  if (mfile == NULL)
+    return FALSE;
+
+  actual_sha256 = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                               (const guchar *) g_mapped_file_get_contents (mfile),
+                                               g_mapped_file_get_length (mfile));
+
+  if (strcmp (actual_sha256, sha256) != 0)
+    return FALSE;
+
+  if (fchmod (tmpf.fd, 0644) != 0 ||
+      !glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE, dfd, name, NULL))
+    return FALSE;
+
+  g_info ("Copied extra-data %s from cache", name);
+
+  return TRUE;
+}
+
 static gboolean
 extract_extra_data (FlatpakDir   *self,
                     const char   *checksum,
@@ -9077,6 +12733,7 @@ extract_extra_data (FlatpakDir   *self,
   g_autoptr(GError) local_error = NULL;
   gsize i, n_extra_data = 0;
   gsize n_extra_data_sources;
+  glnx_autofd int extradir_dfd = -1;
 
   extra_data_sources = flatpak_repo_get_extra_data_sources (self->repo, checksum,
                                                             cancellable, &local_error);
@@ -9124,6 +12781,10 @@ extract_extra_data (FlatpakDir   *self,
       return FALSE;
     }
 
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (extradir), TRUE,
+                       &extradir_dfd, error))
+    return FALSE;
+
   for (i = 0; i < n_extra_data_sources; i++)
     {
       g_autofree char *extra_data_sha256 = NULL;
@@ -9153,8 +12814,6 @@ extract_extra_data (FlatpakDir   *self,
       for (j = 0; j < n_extra_data; j++)
         {
           g_autoptr(GVariant) content = NULL;
-          g_autoptr(GFile) dest = NULL;
-          g_autofree char *sha256 = NULL;
           const char *extra_data_name = NULL;
           const guchar *data;
           gsize len;
@@ -9172,16 +12831,10 @@ extract_extra_data (FlatpakDir   *self,
           if (len != download_size)
             return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra data"));
 
-          sha256 = g_compute_checksum_for_data (G_CHECKSUM_SHA256, data, len);
-          if (strcmp (sha256, extra_data_sha256) != 0)
-            return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for extra data"));
-
-          dest = g_file_get_child (extradir, extra_data_name);
-          if (!g_file_replace_contents (dest,
-                                        g_variant_get_data (content),
-                                        g_variant_get_size (content),
-                                        NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
-                                        NULL, cancellable, error))
+          if (!copy_extra_data_from_cache (extradir_dfd, extra_data_name,
+                                           extra_data_sha256, download_size) &&
+              !write_extra_data_file (extradir_dfd, extra_data_name, data, len,
+                                      extra_data_sha256, cancellable, error))
             {
               g_prefix_error (error, _("While writing extra data file '%s': "), extra_data_name);
               return FALSE;
@@ -9346,7 +12999,7 @@ apply_extra_data (FlatpakDir   *self,
   if (!flatpak_run_add_environment_args (bwrap, NULL, run_flags, id,
                                          app_context, 0, 0, 0, 0,
                                          NULL, NULL, -1,
-                                         NULL, NULL, cancellable, error))
+                                         NULL, NULL, NULL, cancellable, error))
     return FALSE;
 
   flatpak_bwrap_populate_runtime_dir (bwrap, NULL);
@@ -9355,6 +13008,9 @@ apply_extra_data (FlatpakDir   *self,
 
   flatpak_bwrap_add_args (bwrap, "--", "/app/bin/apply_extra", NULL);
 
+  if (!flatpak_run_wait_dbus_proxy (bwrap, error))
+    return FALSE;
+
   flatpak_bwrap_finish (bwrap);
 
   g_info ("Running /app/bin/apply_extra ");
@@ -9604,16 +13260,184 @@ flatpak_dir_update_deploy_ref (FlatpakDir *self,
   return TRUE;
 }
 
-gboolean
-flatpak_dir_deploy (FlatpakDir          *self,
-                    const char          *origin,
-                    FlatpakDecomposed   *ref,
-                    const char          *checksum_or_latest,
-                    const char * const * subpaths,
-                    const char * const * previous_ids,
-                    const char          *parental_controls_action_id,
-                    GCancellable        *cancellable,
-                    GError             **error)
+/* Identifies the result of flatpak_rewrite_export_dir(): the export
+ * subtree of the commit and everything else the rewritten files depend
+ * on. Returns %NULL if there is nothing to export. */
+static char *
+compute_export_checksum (GFile              *root,
+                         const char         *app,
+                         const char         *branch,
+                         const char         *arch,
+                         const char         *flatpak_binary,
+                         const char         *metadata_contents,
+                         const char * const *previous_ids)
+{
+  g_autoptr(GFile) export = g_file_get_child (root, "export");
+  g_autoptr(GChecksum) checksum = NULL;
+  gsize i;
+
+  if (g_file_query_file_type (export, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) != G_FILE_TYPE_DIRECTORY ||
+      !ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (export), NULL))
+    return NULL;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+#define UPDATE_STRING(_s) g_checksum_update (checksum, (const guchar *) ((_s) ? (_s) : ""), strlen ((_s) ? (_s) : "") + 1)
+  UPDATE_STRING (PACKAGE_VERSION);
+  UPDATE_STRING (ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (export)));
+  UPDATE_STRING (ostree_repo_file_tree_get_metadata_checksum (OSTREE_REPO_FILE (export)));
+  UPDATE_STRING (app);
+  UPDATE_STRING (branch);
+  UPDATE_STRING (arch);
+  UPDATE_STRING (flatpak_binary);
+  UPDATE_STRING (metadata_contents);
+  for (i = 0; previous_ids != NULL && previous_ids[i] != NULL; i++)
+    UPDATE_STRING (previous_ids[i]);
+#undef UPDATE_STRING
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* If the active deployment of @ref rewrote the exact same exports,
+ * replaces @export with hardlinks to its result, so that the desktop,
+ * service and MIME files don't have to be parsed and rewritten again. */
+static gboolean
+reuse_active_export (FlatpakDir        *self,
+                     FlatpakDecomposed *ref,
+                     GFile             *deploy_base,
+                     const char        *export_checksum,
+                     GFile             *export,
+                     GCancellable      *cancellable)
+{
+  const char *no_skip[] = { NULL };
+  g_autofree char *old_active = NULL;
+  g_autoptr(GFile) old_checkout = NULL;
+  g_autoptr(GFile) old_export = NULL;
+  g_autoptr(GBytes) old_deploy_data = NULL;
+  g_autoptr(GFile) parent = g_file_get_parent (export);
+  g_auto(GLnxTmpDir) tmpdir = { 0, };
+  g_autofree char *template = NULL;
+  glnx_autofd int old_export_dfd = -1;
+  g_autoptr(GError) local_error = NULL;
+
+  old_active = flatpak_dir_read_active (self, ref, cancellable);
+  if (old_active == NULL)
+    return FALSE;
+
+  old_checkout = g_file_get_child (deploy_base, old_active);
+  old_deploy_data = flatpak_load_deploy_data (old_checkout, ref, self->repo,
+                                              FLATPAK_DEPLOY_VERSION_ANY, cancellable, NULL);
+  if (old_deploy_data == NULL ||
+      g_strcmp0 (flatpak_deploy_data_get_string (old_deploy_data, "export-checksum"), export_checksum) != 0)
+    return FALSE;
+
+  old_export = g_file_get_child (old_checkout, "export");
+  template = g_build_filename (flatpak_file_get_path_cached (parent), ".export-XXXXXX", NULL);
+
+  /* Link into a temporary dir and swap it in, so @export is intact on
+   * errors. The checked out original is then removed with the tmpdir. */
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (old_export), TRUE, &old_export_dfd, &local_error) ||
+      !glnx_mkdtempat (AT_FDCWD, template, 0755, &tmpdir, &local_error) ||
+      !link_tree_at (old_export_dfd, tmpdir.fd, NULL, no_skip, FALSE, cancellable, &local_error))
+    {
+      g_info ("Failed to reuse exports of %s: %s", old_active, local_error->message);
+      return FALSE;
+    }
+
+  if (glnx_renameat2_exchange (AT_FDCWD, tmpdir.path,
+                               AT_FDCWD, flatpak_file_get_path_cached (export)) != 0)
+    {
+      g_info ("Failed to reuse exports of %s: %s", old_active, g_strerror (errno));
+      return FALSE;
+    }
+
+  g_info ("Reusing exports of %s", old_active);
+
+  return TRUE;
+}
+
+/* These are created or rewritten in the checkout by the deploy, so
+ * they are never reused from the previous deployment */
+static const char *deploy_regenerated_paths[] = {
+  "deploy",
+  "export",
+  "files/.ref",
+  "files/extra",
+  NULL
+};
+
+/* Checks out @checksum into @checkout_path by reusing the files of the
+ * active full (i.e. not subpath) deployment of @ref, if there is one and
+ * its commit is still in the repo. Returns %FALSE with no error set if
+ * there is nothing to reuse.
+ */
+static gboolean
+checkout_deploy_from_active (FlatpakDir         *self,
+                             FlatpakDecomposed  *ref,
+                             GFile              *deploy_base,
+                             const char         *checksum,
+                             const char         *checkout_path,
+                             GCancellable       *cancellable,
+                             GError            **error)
+{
+  g_autofree char *old_active = NULL;
+  g_autoptr(GFile) old_checkout = NULL;
+  g_autoptr(GBytes) old_deploy_data = NULL;
+  const char *old_checksum;
+  gboolean have_old_commit = FALSE;
+
+  old_active = flatpak_dir_read_active (self, ref, cancellable);
+  if (old_active == NULL)
+    return FALSE;
+
+  old_checkout = g_file_get_child (deploy_base, old_active);
+  old_deploy_data = flatpak_load_deploy_data (old_checkout, ref, self->repo,
+                                              FLATPAK_DEPLOY_VERSION_ANY, cancellable, NULL);
+  if (old_deploy_data == NULL ||
+      flatpak_deploy_data_has_subpaths (old_deploy_data))
+    return FALSE;
+
+  old_checksum = flatpak_deploy_data_get_commit (old_deploy_data);
+  if (!ostree_repo_has_object (self->repo, OSTREE_OBJECT_TYPE_COMMIT, old_checksum,
+                               &have_old_commit, cancellable, NULL) ||
+      !have_old_commit)
+    return FALSE;
+
+  return checkout_commit_incremental (self, old_checksum,
+                                      flatpak_file_get_path_cached (old_checkout),
+                                      checksum, checkout_path,
+                                      deploy_regenerated_paths,
+                                      cancellable, error);
+}
+
+/* The dir lock taken by a deploy just before making the new deployment
+ * active, and the deployed index from before that, for the caller to
+ * finish the deploy with. */
+typedef struct {
+  GLnxLockFile dir_lock;
+  GVariant    *old_index;
+} DeployActivation;
+
+static void
+deploy_activation_clear (DeployActivation *activation)
+{
+  g_clear_pointer (&activation->old_index, g_variant_unref);
+  glnx_release_lock_file (&activation->dir_lock);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (DeployActivation, deploy_activation_clear)
+
+static gboolean
+flatpak_dir_deploy_real (FlatpakDir          *self,
+                         const char          *origin,
+                         FlatpakDecomposed   *ref,
+                         const char          *checksum_or_latest,
+                         const char * const * subpaths,
+                         const char * const * previous_ids,
+                         const char          *parental_controls_action_id,
+                         DeployActivation    *activation,
+                         GCancellable        *cancellable,
+                         GError             **error)
 {
   g_autofree char *resolved_ref = NULL;
   g_autofree char *ref_id = NULL;
@@ -9636,7 +13460,6 @@ flatpak_dir_deploy (FlatpakDir          *self,
   guint64 installed_size = 0;
   OstreeRepoCheckoutAtOptions options = { 0, };
   const char *checksum;
-  glnx_autofd int checkoutdir_dfd = -1;
   const char *xa_ref = NULL;
   g_autofree char *checkout_basename = NULL;
   gboolean created_extra_data = FALSE;
@@ -9646,6 +13469,7 @@ flatpak_dir_deploy (FlatpakDir          *self,
   g_autofree char *metadata_contents = NULL;
   gsize metadata_size = 0;
   const char *flatpak;
+  g_autofree char *export_checksum = NULL;
   g_auto(GLnxTmpDir) tmp_dir_handle = { 0, };
 
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
@@ -9720,22 +13544,46 @@ flatpak_dir_deploy (FlatpakDir          *self,
       return FALSE;
     }
 
-  if (!flatpak_repo_collect_sizes (self->repo, root, &installed_size, NULL, cancellable, error))
+  /* Commits made by build-export record the size, computed the same way,
+   * so only walk the whole tree for commits that don't */
+  if (g_variant_lookup (commit_metadata, "xa.installed-size", "t", &installed_size))
+    installed_size = GUINT64_FROM_BE (installed_size);
+  else if (!flatpak_repo_collect_sizes (self->repo, root, &installed_size, NULL, cancellable, error))
     return FALSE;
 
   options.mode = OSTREE_REPO_CHECKOUT_MODE_USER;
   options.overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES;
   options.enable_fsync = FALSE; /* We checkout to a temp dir and sync before moving it in place */
   options.bareuseronly_dirs = TRUE; /* https://github.com/ostreedev/ostree/pull/927 */
+  options.force_copy = flatpak_dir_checkout_uses_reflinks (self);
   checkoutdirpath = g_file_get_path (checkoutdir);
   checkoutdir_basename = tmp_dir_handle.path;  /* so checkoutdirpath = deploy_base_dfd / checkoutdir_basename */
 
+  FLATPAK_TRACE2 (checkout_start, flatpak_decomposed_get_ref (ref), checksum);
+
   if (subpaths == NULL || *subpaths == NULL)
     {
-      if (!ostree_repo_checkout_at (self->repo, &options,
-                                    deploy_base_dfd, checkoutdir_basename,
-                                    checksum,
-                                    cancellable, error))
+      g_autoptr(GError) local_error = NULL;
+      gboolean checked_out;
+
+      /* Updates usually change only a small part of the tree, so try to
+       * reuse the files of the active deployment and only check out what
+       * differs. */
+      checked_out = checkout_deploy_from_active (self, ref, deploy_base, checksum, checkoutdirpath,
+                                                 cancellable, &local_error);
+      if (!checked_out && local_error != NULL)
+        {
+          g_info ("Incremental checkout of %s failed, doing a full checkout: %s",
+                  checksum, local_error->message);
+
+          if (!glnx_shutil_rm_rf_at (deploy_base_dfd, checkoutdir_basename, cancellable, error) ||
+              !glnx_ensure_dir (deploy_base_dfd, checkoutdir_basename, 0755, error))
+            return FALSE;
+        }
+
+      if (!checked_out &&
+          !checkout_commit_parallel (self, root, checksum, checkoutdirpath, NULL,
+                                     cancellable, error))
         {
           g_prefix_error (error, _("While trying to checkout %s into %s: "), checksum, checkoutdirpath);
           return FALSE;
@@ -9744,6 +13592,7 @@ flatpak_dir_deploy (FlatpakDir          *self,
   else
     {
       g_autoptr(GFile) files = g_file_get_child (checkoutdir, "files");
+      g_autoptr(GPtrArray) checkout_subpaths = g_ptr_array_new_with_free_func (g_free);
       int i;
 
       if (!g_file_make_directory_with_parents (files, cancellable, error))
@@ -9763,9 +13612,6 @@ flatpak_dir_deploy (FlatpakDir          *self,
       for (i = 0; subpaths[i] != NULL; i++)
         {
           g_autofree char *subpath = g_build_filename ("files", subpaths[i], NULL);
-          g_autofree char *dstpath = g_build_filename (checkoutdirpath, "/files", subpaths[i], NULL);
-          g_autofree char *dstpath_parent = g_path_get_dirname (dstpath);
-          g_autofree char *dstpath_relative_to_deploy_base = g_build_filename (checkoutdir_basename, "/files", subpaths[i], NULL);
           g_autoptr(GFile) child = NULL;
 
           child = g_file_resolve_relative_path (root, subpath);
@@ -9776,24 +13622,21 @@ flatpak_dir_deploy (FlatpakDir          *self,
               continue;
             }
 
-          if (g_mkdir_with_parents (dstpath_parent, 0755))
-            {
-              glnx_set_error_from_errno (error);
-              return FALSE;
-            }
+          g_ptr_array_add (checkout_subpaths, g_steal_pointer (&subpath));
+        }
+      g_ptr_array_add (checkout_subpaths, NULL);
 
-          options.subpath = subpath;
-          if (!ostree_repo_checkout_at (self->repo, &options,
-                                        deploy_base_dfd, dstpath_relative_to_deploy_base,
-                                        checksum,
-                                        cancellable, error))
-            {
-              g_prefix_error (error, _("While trying to checkout subpath ‘%s’: "), subpath);
-              return FALSE;
-            }
+      if (!checkout_commit_parallel (self, root, checksum, checkoutdirpath,
+                                     (const char * const *) checkout_subpaths->pdata,
+                                     cancellable, error))
+        {
+          g_prefix_error (error, _("While trying to checkout subpaths: "));
+          return FALSE;
         }
     }
 
+  FLATPAK_TRACE2 (checkout_done, flatpak_decomposed_get_ref (ref), checksum);
+
   /* Extract any extra data */
   extradir = g_file_resolve_relative_path (checkoutdir, "files/extra");
   if (!flatpak_rm_rf (extradir, cancellable, error))
@@ -9955,17 +13798,26 @@ flatpak_dir_deploy (FlatpakDir          *self,
       g_autofree char *bin_data = NULL;
       int r;
 
-      if (!flatpak_mkdir_p (bindir, cancellable, error))
-        return FALSE;
-
-      if (!flatpak_rewrite_export_dir (ref_id, ref_branch, ref_arch,
-                                       keyfile, previous_ids, export,
-                                       cancellable,
-                                       error))
-        return FALSE;
       if ((flatpak = g_getenv ("FLATPAK_BINARY")) == NULL)
         flatpak = FLATPAK_BINDIR "/flatpak";
 
+      /* Updates often don't touch the exports at all, in which case the
+       * rewritten files of the active deployment can be used as they are */
+      export_checksum = compute_export_checksum (root, ref_id, ref_branch, ref_arch, flatpak,
+                                                 metadata_contents, previous_ids);
+      if (export_checksum == NULL ||
+          !reuse_active_export (self, ref, deploy_base, export_checksum, export, cancellable))
+        {
+          if (!flatpak_mkdir_p (bindir, cancellable, error))
+            return FALSE;
+
+          if (!flatpak_rewrite_export_dir (ref_id, ref_branch, ref_arch,
+                                           keyfile, previous_ids, export,
+                                           cancellable,
+                                           error))
+            return FALSE;
+        }
+
       bin_data = g_strdup_printf ("#!/bin/sh\nexec %s run --branch=%s --arch=%s %s \"$@\"\n",
                                   flatpak, escaped_branch, escaped_arch, escaped_app);
       if (!g_file_replace_contents (wrapper, bin_data, strlen (bin_data), NULL, FALSE,
@@ -9989,7 +13841,8 @@ flatpak_dir_deploy (FlatpakDir          *self,
                                              checksum,
                                              (char **) subpaths,
                                              installed_size,
-                                             previous_ids);
+                                             previous_ids,
+                                             export_checksum);
 
   /* Check the app is actually allowed to be used by this user. This can block
    * on getting authorisation. */
@@ -10002,28 +13855,120 @@ flatpak_dir_deploy (FlatpakDir          *self,
   if (!flatpak_bytes_save (deploy_data_file, deploy_data, cancellable, error))
     return FALSE;
 
-  if (!glnx_opendirat (deploy_base_dfd, checkoutdir_basename, TRUE, &checkoutdir_dfd, error))
+  if (!flatpak_dir_flush_checkout (self, deploy_base_dfd, checkoutdir_basename, cancellable, error))
     return FALSE;
 
-  if (syncfs (checkoutdir_dfd) != 0)
+  /* Only wait for other changes to the installation once the new
+   * deployment is ready to be made active */
+  if (activation != NULL)
     {
-      glnx_set_error_from_errno (error);
-      return FALSE;
+      if (!flatpak_dir_lock (self, &activation->dir_lock, cancellable, error))
+        return FALSE;
+
+      activation->old_index = flatpak_dir_take_deployed_index (self);
     }
 
-  if (!g_file_move (checkoutdir, real_checkoutdir, G_FILE_COPY_NO_FALLBACK_FOR_MOVE,
-                    cancellable, NULL, NULL, error))
-    return FALSE;
+  if (!g_file_move (checkoutdir, real_checkoutdir, G_FILE_COPY_NO_FALLBACK_FOR_MOVE,
+                    cancellable, NULL, NULL, error))
+    return FALSE;
+
+  glnx_tmpdir_unset (&tmp_dir_handle);
+
+  if (!flatpak_dir_set_active (self, ref, checkout_basename, cancellable, error))
+    return FALSE;
+
+  if (!flatpak_dir_update_deploy_ref (self, flatpak_decomposed_get_ref (ref), checksum, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+typedef struct {
+  FlatpakDir          *self;
+  const char          *origin;
+  FlatpakDecomposed   *ref;
+  const char          *checksum_or_latest;
+  const char * const * subpaths;
+  const char * const * previous_ids;
+  const char          *parental_controls_action_id;
+  DeployActivation    *activation;
+  GCancellable        *cancellable;
+  GError              *error;
+} BackgroundDeployData;
+
+static gpointer
+background_deploy_thread (gpointer user_data)
+{
+  BackgroundDeployData *data = user_data;
+  gboolean res;
+
+  flatpak_set_thread_background_priority ();
+
+  res = flatpak_dir_deploy_real (data->self, data->origin, data->ref,
+                                 data->checksum_or_latest, data->subpaths,
+                                 data->previous_ids,
+                                 data->parental_controls_action_id,
+                                 data->activation,
+                                 data->cancellable, &data->error);
+
+  return GINT_TO_POINTER (res);
+}
+
+/* If @activation is given, the caller only holds the ref lock, and the dir
+ * lock is taken into @activation when the deployment is made active. It is
+ * still held when this returns, so the caller can finish the deploy. */
+static gboolean
+flatpak_dir_deploy_full (FlatpakDir          *self,
+                         const char          *origin,
+                         FlatpakDecomposed   *ref,
+                         const char          *checksum_or_latest,
+                         const char * const * subpaths,
+                         const char * const * previous_ids,
+                         const char          *parental_controls_action_id,
+                         DeployActivation    *activation,
+                         GCancellable        *cancellable,
+                         GError             **error)
+{
+  BackgroundDeployData data = {
+    self, origin, ref, checksum_or_latest, subpaths, previous_ids,
+    parental_controls_action_id, activation, cancellable, NULL
+  };
+  GThread *thread;
+  gboolean res;
 
-  glnx_tmpdir_unset (&tmp_dir_handle);
+  if (!self->background_priority)
+    return flatpak_dir_deploy_real (self, origin, ref, checksum_or_latest,
+                                    subpaths, previous_ids,
+                                    parental_controls_action_id,
+                                    activation,
+                                    cancellable, error);
 
-  if (!flatpak_dir_set_active (self, ref, checkout_basename, cancellable, error))
-    return FALSE;
+  /* The lowered priority can't be raised again, so use a thread of its
+   * own rather than the caller's, which may be a shared worker. */
+  thread = g_thread_new ("flatpak-deploy", background_deploy_thread, &data);
+  res = GPOINTER_TO_INT (g_thread_join (thread));
 
-  if (!flatpak_dir_update_deploy_ref (self, flatpak_decomposed_get_ref (ref), checksum, error))
-    return FALSE;
+  if (!res)
+    g_propagate_error (error, data.error);
 
-  return TRUE;
+  return res;
+}
+
+gboolean
+flatpak_dir_deploy (FlatpakDir          *self,
+                    const char          *origin,
+                    FlatpakDecomposed   *ref,
+                    const char          *checksum_or_latest,
+                    const char * const * subpaths,
+                    const char * const * previous_ids,
+                    const char          *parental_controls_action_id,
+                    GCancellable        *cancellable,
+                    GError             **error)
+{
+  return flatpak_dir_deploy_full (self, origin, ref, checksum_or_latest,
+                                  subpaths, previous_ids,
+                                  parental_controls_action_id,
+                                  NULL, cancellable, error);
 }
 
 /* -origin remotes are deleted when the last ref referring to it is undeployed */
@@ -10068,7 +14013,9 @@ flatpak_dir_deploy_install (FlatpakDir        *self,
                             GCancellable      *cancellable,
                             GError           **error)
 {
+  g_auto(GLnxLockFile) ref_lock = { 0, };
   g_auto(GLnxLockFile) lock = { 0, };
+  g_auto(DeployActivation) activation = { { 0, }, };
   g_autoptr(GFile) deploy_base = NULL;
   g_autoptr(GFile) old_deploy_dir = NULL;
   gboolean created_deploy_base = FALSE;
@@ -10078,6 +14025,10 @@ flatpak_dir_deploy_install (FlatpakDir        *self,
   g_autofree char *commit = NULL;
   g_autofree char *old_active = NULL;
 
+  if (!flatpak_dir_lock_ref (self, ref, &ref_lock,
+                             cancellable, error))
+    goto out;
+
   if (!flatpak_dir_lock (self, &lock,
                          cancellable, error))
     goto out;
@@ -10101,6 +14052,10 @@ flatpak_dir_deploy_install (FlatpakDir        *self,
           if (strcmp (old_origin, origin) != 0)
             remove_ref_from_remote = g_strdup (old_origin);
 
+          /* Readers have to look at the deploy dirs until the new
+           * deployment is in the index */
+          flatpak_dir_drop_deployed_index (self);
+
           g_info ("Removing old deployment for reinstall");
           if (!flatpak_dir_undeploy (self, ref, old_active,
                                      TRUE, FALSE,
@@ -10130,10 +14085,16 @@ flatpak_dir_deploy_install (FlatpakDir        *self,
   /* After we create the deploy base we must goto out on errors */
   created_deploy_base = TRUE;
 
-  if (!flatpak_dir_deploy (self, origin, ref, NULL, (const char * const *) subpaths,
-                           previous_ids,
-                           "org.freedesktop.Flatpak.override-parental-controls",
-                           cancellable, error))
+  /* Let other refs be deployed while we check out this one. The dir lock
+   * is taken again, into @activation, before the deployment is made
+   * active. */
+  glnx_release_lock_file (&lock);
+
+  if (!flatpak_dir_deploy_full (self, origin, ref, NULL, (const char * const *) subpaths,
+                                previous_ids,
+                                "org.freedesktop.Flatpak.override-parental-controls",
+                                &activation,
+                                cancellable, error))
     goto out;
 
   if (flatpak_decomposed_is_app (ref))
@@ -10156,10 +14117,12 @@ flatpak_dir_deploy_install (FlatpakDir        *self,
       flatpak_dir_prune_origin_remote (self, remove_ref_from_remote);
     }
 
+  flatpak_dir_save_deployed_index (self, activation.old_index, ref, cancellable);
+
   /* Release lock before doing possibly slow prune */
-  glnx_release_lock_file (&lock);
+  deploy_activation_clear (&activation);
 
-  flatpak_dir_cleanup_removed (self, cancellable, NULL);
+  flatpak_dir_reap_removed (self);
 
   if (!flatpak_dir_mark_changed (self, error))
     goto out;
@@ -10204,7 +14167,8 @@ flatpak_dir_deploy_update (FlatpakDir        *self,
                            GError           **error)
 {
   g_autoptr(GBytes) old_deploy_data = NULL;
-  g_auto(GLnxLockFile) lock = { 0, };
+  g_auto(GLnxLockFile) ref_lock = { 0, };
+  g_auto(DeployActivation) activation = { { 0, }, };
   g_autofree const char **old_subpaths = NULL;
   g_autofree char *old_active = NULL;
   const char *old_origin;
@@ -10212,8 +14176,11 @@ flatpak_dir_deploy_update (FlatpakDir        *self,
   g_autofree const char **previous_ids = NULL;
   g_auto(GStrv) previous_ids_owned = NULL;
 
-  if (!flatpak_dir_lock (self, &lock,
-                         cancellable, error))
+  /* Only the deploys of this ref change its deploy data and active
+   * deployment, so the dir lock isn't needed until we make the new
+   * deployment active */
+  if (!flatpak_dir_lock_ref (self, ref, &ref_lock,
+                             cancellable, error))
     return FALSE;
 
   old_deploy_data = flatpak_dir_get_deploy_data (self, ref,
@@ -10236,14 +14203,15 @@ flatpak_dir_deploy_update (FlatpakDir        *self,
   else
     previous_ids_owned = g_strdupv ((char **) previous_ids);
 
-  if (!flatpak_dir_deploy (self,
-                           old_origin,
-                           ref,
-                           checksum_or_latest,
-                           opt_subpaths ? opt_subpaths : old_subpaths,
-                           (const char * const *) previous_ids_owned,
-                           "org.freedesktop.Flatpak.override-parental-controls-update",
-                           cancellable, error))
+  if (!flatpak_dir_deploy_full (self,
+                                old_origin,
+                                ref,
+                                checksum_or_latest,
+                                opt_subpaths ? opt_subpaths : old_subpaths,
+                                (const char * const *) previous_ids_owned,
+                                "org.freedesktop.Flatpak.override-parental-controls-update",
+                                &activation,
+                                cancellable, error))
     return FALSE;
 
   if (old_active &&
@@ -10260,13 +14228,15 @@ flatpak_dir_deploy_update (FlatpakDir        *self,
         return FALSE;
     }
 
+  flatpak_dir_save_deployed_index (self, activation.old_index, ref, cancellable);
+
   /* Release lock before doing possibly slow prune */
-  glnx_release_lock_file (&lock);
+  deploy_activation_clear (&activation);
 
   if (!flatpak_dir_mark_changed (self, error))
     return FALSE;
 
-  flatpak_dir_cleanup_removed (self, cancellable, NULL);
+  flatpak_dir_reap_removed (self);
 
   commit = flatpak_dir_read_active (self, ref, cancellable);
   flatpak_dir_log (self, "deploy update", old_origin, flatpak_decomposed_get_ref (ref), commit, old_active, NULL,
@@ -11780,11 +15750,13 @@ flatpak_dir_uninstall (FlatpakDir                 *self,
   gboolean was_deployed;
   g_autofree char *name = NULL;
   g_autofree char *old_active = NULL;
+  g_auto(GLnxLockFile) ref_lock = { 0, };
   g_auto(GLnxLockFile) lock = { 0, };
   g_autoptr(GBytes) deploy_data = NULL;
   gboolean keep_ref = flags & FLATPAK_HELPER_UNINSTALL_FLAGS_KEEP_REF;
   gboolean force_remove = flags & FLATPAK_HELPER_UNINSTALL_FLAGS_FORCE_REMOVE;
   gboolean update_preinstalled = flags & FLATPAK_HELPER_UNINSTALL_FLAGS_UPDATE_PREINSTALLED;
+  g_autoptr(GVariant) old_index = NULL;
 
   name = flatpak_decomposed_dup_id (ref);
 
@@ -11801,6 +15773,10 @@ flatpak_dir_uninstall (FlatpakDir                 *self,
       return TRUE;
     }
 
+  if (!flatpak_dir_lock_ref (self, ref, &ref_lock,
+                             cancellable, error))
+    return FALSE;
+
   if (!flatpak_dir_lock (self, &lock,
                          cancellable, error))
     return FALSE;
@@ -11845,6 +15821,8 @@ flatpak_dir_uninstall (FlatpakDir                 *self,
 
   old_active = g_strdup (flatpak_deploy_data_get_commit (deploy_data));
 
+  old_index = flatpak_dir_take_deployed_index (self);
+
   g_info ("dropping active ref");
   if (!flatpak_dir_set_active (self, ref, NULL, cancellable, error))
     return FALSE;
@@ -11874,21 +15852,28 @@ flatpak_dir_uninstall (FlatpakDir                 *self,
   /* Take this opportunity to clean up refs/mirrors/ since a prune will happen
    * after this uninstall operation. See
    * https://github.com/flatpak/flatpak/issues/3222
+   * This goes over all the refs in the repo, so when uninstalling many refs
+   * in a row it is left to flatpak_dir_flush_uninstall_cleanup().
    */
-  if (!flatpak_dir_delete_mirror_refs (self, FALSE, cancellable, error))
+  if (self->defer_uninstall_cleanup)
+    self->uninstall_cleanup_pending = TRUE;
+  else if (!flatpak_dir_delete_mirror_refs (self, FALSE, cancellable, error))
     return FALSE;
 
   if (flatpak_decomposed_is_app (ref) &&
       !flatpak_dir_update_exports (self, name, cancellable, error))
     return FALSE;
 
+  flatpak_dir_save_deployed_index (self, old_index, ref, cancellable);
+
   glnx_release_lock_file (&lock);
 
   flatpak_dir_prune_origin_remote (self, repository);
 
-  flatpak_dir_cleanup_removed (self, cancellable, NULL);
+  flatpak_dir_reap_removed (self);
 
-  if (!flatpak_dir_mark_changed (self, error))
+  if (!self->defer_uninstall_cleanup &&
+      !flatpak_dir_mark_changed (self, error))
     return FALSE;
 
   if (update_preinstalled &&
@@ -12236,15 +16221,20 @@ flatpak_dir_undeploy (FlatpakDir        *self,
   else
     change_file = g_file_resolve_relative_path (removed_subdir, "files/.removed");
 
+  /* A background reaper of this or another process may already be
+   * deleting it, which is fine. */
   if (!g_file_replace_contents (change_file, "", 0, NULL, FALSE,
-                                G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, &child_error))
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, &child_error) &&
+      !g_error_matches (child_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
     {
       g_autofree gchar *path = g_file_get_path (change_file);
       g_warning ("Unable to clear %s: %s", path, child_error->message);
-      g_clear_error (&child_error);
     }
+  g_clear_error (&child_error);
 
-  if (force_remove || !dir_is_locked (removed_subdir))
+  /* Deleting a large runtime takes a while, so unless we're forced to
+   * remove it while in use, leave that to flatpak_dir_reap_removed() */
+  if (force_remove)
     {
       g_autoptr(GError) tmp_error = NULL;
 
@@ -12376,48 +16366,114 @@ flatpak_dir_cleanup_removed (FlatpakDir   *self,
                              GCancellable *cancellable,
                              GError      **error)
 {
-  gboolean ret = FALSE;
   g_autoptr(GFile) removed_dir = NULL;
-  g_autoptr(GFileEnumerator) dir_enum = NULL;
-  g_autoptr(GFileInfo) child_info = NULL;
-  GError *temp_error = NULL;
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  g_autoptr(GError) local_error = NULL;
+  struct dirent *dent;
 
   removed_dir = flatpak_dir_get_removed_dir (self);
-  if (!g_file_query_exists (removed_dir, cancellable))
-    return TRUE;
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, flatpak_file_get_path_cached (removed_dir),
+                                    FALSE, &iter, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return TRUE;
 
-  dir_enum = g_file_enumerate_children (removed_dir, OSTREE_GIO_FAST_QUERYINFO,
-                                        G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                        cancellable,
-                                        error);
-  if (!dir_enum)
-    goto out;
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
 
-  while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
+  while (TRUE)
     {
-      const char *name = g_file_info_get_name (child_info);
-      g_autoptr(GFile) child = g_file_get_child (removed_dir, name);
+      g_autoptr(GFile) child = NULL;
+      g_autoptr(GError) tmp_error = NULL;
 
-      if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_DIRECTORY &&
-          !dir_is_locked (child))
-        {
-          g_autoptr(GError) tmp_error = NULL;
-          if (!flatpak_rm_rf (child, cancellable, &tmp_error))
-            g_warning ("Unable to remove old checkout: %s", tmp_error->message);
-        }
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, cancellable, error))
+        return FALSE;
 
-      g_clear_object (&child_info);
+      if (dent == NULL)
+        break;
+
+      if (dent->d_type != DT_DIR)
+        continue;
+
+      child = g_file_get_child (removed_dir, dent->d_name);
+      if (dir_is_locked (child))
+        continue;
+
+      /* Unlink relative to the open directory fds rather than by path */
+      if (!glnx_shutil_rm_rf_at (iter.fd, dent->d_name, cancellable, &tmp_error))
+        g_warning ("Unable to remove old checkout: %s", tmp_error->message);
     }
 
-  if (temp_error != NULL)
+  return TRUE;
+}
+
+G_LOCK_DEFINE_STATIC (removed_reapers);
+/* Installation path -> whether another pass was requested */
+static GHashTable *removed_reapers = NULL;
+
+static gpointer
+removed_reaper_thread (gpointer user_data)
+{
+  FlatpakDir *dir = user_data;
+  const char *path = flatpak_file_get_path_cached (dir->basedir);
+
+  flatpak_set_thread_background_priority ();
+
+  while (TRUE)
     {
-      g_propagate_error (error, temp_error);
-      goto out;
+      g_autoptr(GError) local_error = NULL;
+      gboolean again;
+
+      if (!flatpak_dir_cleanup_removed (dir, NULL, &local_error))
+        g_info ("Failed to clean up removed deployments in %s: %s", path, local_error->message);
+
+      G_LOCK (removed_reapers);
+      again = GPOINTER_TO_INT (g_hash_table_lookup (removed_reapers, path));
+      if (again)
+        g_hash_table_insert (removed_reapers, g_strdup (path), GINT_TO_POINTER (FALSE));
+      else
+        g_hash_table_remove (removed_reapers, path);
+      G_UNLOCK (removed_reapers);
+
+      if (!again)
+        break;
     }
 
-  ret = TRUE;
-out:
-  return ret;
+  g_object_unref (dir);
+
+  return NULL;
+}
+
+/* Deletes the deployments that flatpak_dir_undeploy() moved aside, in
+ * a low priority thread so that it doesn't hold up the caller. Nobody
+ * waits for it: if the process exits first, whatever is left over is
+ * picked up by the next call, such as the next transaction. */
+void
+flatpak_dir_reap_removed (FlatpakDir *self)
+{
+  const char *path = flatpak_file_get_path_cached (self->basedir);
+  g_autoptr(GFile) removed_dir = flatpak_dir_get_removed_dir (self);
+
+  if (!g_file_query_exists (removed_dir, NULL))
+    return;
+
+  G_LOCK (removed_reapers);
+  if (removed_reapers == NULL)
+    removed_reapers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  if (g_hash_table_contains (removed_reapers, path))
+    {
+      /* One is already running, make it look again once it's done */
+      g_hash_table_insert (removed_reapers, g_strdup (path), GINT_TO_POINTER (TRUE));
+    }
+  else
+    {
+      g_hash_table_insert (removed_reapers, g_strdup (path), GINT_TO_POINTER (FALSE));
+      g_thread_unref (g_thread_new ("flatpak-reaper", removed_reaper_thread,
+                                    flatpak_dir_clone (self)));
+    }
+  G_UNLOCK (removed_reapers);
 }
 
 gboolean
@@ -12635,9 +16691,9 @@ remote_filter_free (RemoteFilter *remote_filter)
   g_free (remote_filter->checksum);
   g_object_unref (remote_filter->path);
   if (remote_filter->allow)
-    g_regex_unref (remote_filter->allow);
+    flatpak_filter_unref (remote_filter->allow);
   if (remote_filter->deny)
-    g_regex_unref (remote_filter->deny);
+    flatpak_filter_unref (remote_filter->deny);
 
   g_free (remote_filter);
 }
@@ -12650,8 +16706,8 @@ remote_filter_load (GFile *path, GError **error)
   g_autofree char *data = NULL;
   gsize data_size;
   GTimeVal mtime;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
+  g_autoptr(FlatpakFilter) allow_refs = NULL;
+  g_autoptr(FlatpakFilter) deny_refs = NULL;
 
   /* Save mtime before loading to avoid races */
   if (!get_mtime (path, &mtime, NULL, error))
@@ -12690,8 +16746,8 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
                                   const char *name,
                                   gboolean    force_load,
                                   char      **checksum_out,
-                                  GRegex    **allow_regex,
-                                  GRegex    **deny_regex,
+                                  FlatpakFilter **allow_filter,
+                                  FlatpakFilter **deny_filter,
                                   GError **error)
 {
   RemoteFilter *filter = NULL;
@@ -12701,8 +16757,8 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
 
   if (checksum_out)
     *checksum_out = NULL;
-  *allow_regex = NULL;
-  *deny_regex = NULL;
+  *allow_filter = NULL;
+  *deny_filter = NULL;
 
   filter_path = flatpak_dir_get_remote_filter (self, name);
 
@@ -12748,9 +16804,9 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
       if (checksum_out)
         *checksum_out = g_strdup (filter->checksum);
       if (filter->allow)
-        *allow_regex = g_regex_ref (filter->allow);
+        *allow_filter = flatpak_filter_ref (filter->allow);
       if (filter->deny)
-        *deny_regex = g_regex_ref (filter->deny);
+        *deny_filter = flatpak_filter_ref (filter->deny);
     }
 
   G_UNLOCK (filters);
@@ -12773,9 +16829,9 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
   if (checksum_out)
     *checksum_out = g_strdup (filter->checksum);
   if (filter->allow)
-    *allow_regex = g_regex_ref (filter->allow);
+    *allow_filter = flatpak_filter_ref (filter->allow);
   if (filter->deny)
-    *deny_regex = g_regex_ref (filter->deny);
+    *deny_filter = flatpak_filter_ref (filter->deny);
 
   G_LOCK (filters);
   g_hash_table_replace (self->remote_filters, g_strdup (name), filter);
@@ -13120,9 +17176,54 @@ flatpak_dir_remote_clear_cached_summary (FlatpakDir   *self,
     return FALSE;
   if (!_flatpak_dir_remote_clear_cached_summary (self, remote, ".idx.sig", cancellable, error))
     return FALSE;
+  if (!_flatpak_dir_remote_clear_cached_summary (self, remote, ".idx.checked", cancellable, error))
+    return FALSE;
   return TRUE;
 }
 
+/* The cached summary index is shared by all the processes using the same
+ * cache dir (the CLI, software centers, the portal...). Whenever one of
+ * them checks it against the remote it leaves a stamp, with the url it
+ * checked as content and the time as mtime, so that the others can skip
+ * doing the same for a while. */
+static gboolean
+summary_index_checked_within (FlatpakDir *self,
+                              const char *remote,
+                              const char *url,
+                              gint64      max_age_sec)
+{
+  g_autofree char *filename = g_strconcat (remote, ".idx.checked", NULL);
+  g_autoptr(GFile) stamp_file = flatpak_build_file (self->cache_dir, "summaries", filename, NULL);
+  g_autofree char *contents = NULL;
+  struct stat stbuf;
+  gint64 age;
+
+  if (!g_file_get_contents (flatpak_file_get_path_cached (stamp_file), &contents, NULL, NULL) ||
+      strcmp (contents, url) != 0)
+    return FALSE;
+
+  if (stat (flatpak_file_get_path_cached (stamp_file), &stbuf) != 0)
+    return FALSE;
+
+  age = g_get_real_time () / G_USEC_PER_SEC - stbuf.st_mtime;
+  return age >= 0 && age < max_age_sec;
+}
+
+static void
+summary_index_mark_checked (FlatpakDir *self,
+                            const char *remote,
+                            const char *url)
+{
+  g_autofree char *filename = g_strconcat (remote, ".idx.checked", NULL);
+  g_autoptr(GFile) stamp_file = flatpak_build_file (self->cache_dir, "summaries", filename, NULL);
+  g_autoptr(GError) local_error = NULL;
+
+  /* Only an optimization, so errors are not fatal */
+  if (!g_file_replace_contents (stamp_file, url, strlen (url), NULL, FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, &local_error))
+    g_info ("Failed to write summary index stamp for remote %s: %s", remote, local_error->message);
+}
+
 
 static gboolean
 flatpak_dir_remote_save_cached_summary (FlatpakDir   *self,
@@ -13170,6 +17271,75 @@ flatpak_dir_remote_save_cached_summary (FlatpakDir   *self,
   return TRUE;
 }
 
+/* Subsummaries are named by their checksum and never change, so once root
+ * verified one and synced it to a root-owned cache we can trust it without
+ * hashing it (and thus reading all of it) again on every load. */
+static gboolean
+flatpak_dir_remote_save_cached_subsummary (FlatpakDir   *self,
+                                           const char   *basename,
+                                           const char   *checksum,
+                                           GBytes       *summary,
+                                           GCancellable *cancellable,
+                                           GError      **error)
+{
+  g_autofree char *file_name = g_strconcat (basename, ".sub", NULL);
+  g_autoptr(GFile) cache_dir = flatpak_build_file (self->cache_dir, "summaries", NULL);
+  g_auto(GLnxTmpfile) tmpfile = { 0, };
+  glnx_autofd int cache_dfd = -1;
+
+  if (!flatpak_mkdir_p (cache_dir, cancellable, error))
+    return FALSE;
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (cache_dir), TRUE, &cache_dfd, error))
+    return FALSE;
+
+  if (!glnx_open_tmpfile_linkable_at (cache_dfd, ".", O_WRONLY, &tmpfile, error))
+    return FALSE;
+
+  if (glnx_loop_write (tmpfile.fd, g_bytes_get_data (summary, NULL), g_bytes_get_size (summary)) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+
+  if (fdatasync (tmpfile.fd) != 0)
+    return glnx_throw_errno_prefix (error, "fdatasync");
+
+  /* This is only an optimization, so if we can't set it (no xattr
+   * support, or EPERM for root in a user namespace) we just keep
+   * verifying on load */
+  if (geteuid () == 0 &&
+      TEMP_FAILURE_RETRY (fsetxattr (tmpfile.fd, SUBSUMMARY_VERIFIED_XATTR,
+                                     checksum, strlen (checksum), 0)) < 0)
+    g_info ("Failed to mark cached subsummary %s as verified: %s",
+            file_name, g_strerror (errno));
+
+  if (!glnx_link_tmpfile_at (&tmpfile, GLNX_LINK_TMPFILE_REPLACE,
+                             cache_dfd, file_name, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+cached_summary_is_verified (int         fd,
+                            const char *checksum)
+{
+  struct stat stbuf;
+  char buf[65];
+  ssize_t len;
+
+  /* The attestation only covers the content if nobody but root could
+   * have changed it since */
+  if (!glnx_fstat (fd, &stbuf, NULL) ||
+      stbuf.st_uid != 0 || (stbuf.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+    return FALSE;
+
+  len = TEMP_FAILURE_RETRY (fgetxattr (fd, SUBSUMMARY_VERIFIED_XATTR, buf, sizeof (buf) - 1));
+  if (len < 0)
+    return FALSE;
+
+  buf[len] = 0;
+  return strcmp (buf, checksum) == 0;
+}
+
 static gboolean
 flatpak_dir_remote_load_cached_summary (FlatpakDir   *self,
                                         const char   *basename,
@@ -13189,8 +17359,10 @@ flatpak_dir_remote_load_cached_summary (FlatpakDir   *self,
   g_autoptr(GMappedFile) sig_mfile = NULL;
   g_autoptr(GBytes) mfile_bytes = NULL;
   g_autofree char *sha256 = NULL;
+  glnx_autofd int fd = -1;
 
-  mfile = g_mapped_file_new (flatpak_file_get_path_cached (main_cache_file), FALSE, NULL);
+  if (glnx_openat_rdonly (AT_FDCWD, flatpak_file_get_path_cached (main_cache_file), TRUE, &fd, NULL))
+    mfile = g_mapped_file_new_from_fd (fd, FALSE, NULL);
   if (mfile == NULL)
     {
       g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_CACHED,
@@ -13208,7 +17380,7 @@ flatpak_dir_remote_load_cached_summary (FlatpakDir   *self,
    * especially important since the variant-schema-compiler code assumes the
    * GVariant data is well formed and asserts otherwise.
    */
-  if (checksum != NULL)
+  if (checksum != NULL && !cached_summary_is_verified (fd, checksum))
     {
       sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, mfile_bytes);
       if (strcmp (sha256, checksum) != 0)
@@ -13418,7 +17590,9 @@ flatpak_dir_remote_fetch_summary_index (FlatpakDir   *self,
   g_autoptr(GBytes) cached_index_sig = NULL;
   g_autoptr(GBytes) index = NULL;
   g_autoptr(GBytes) index_sig = NULL;
+  g_auto(GLnxLockFile) index_lock = { 0, };
   gboolean gpg_verify_summary;
+  FlatpakHTTPFlags http_flags;
 
   ensure_http_session (self);
 
@@ -13443,15 +17617,39 @@ flatpak_dir_remote_fetch_summary_index (FlatpakDir   *self,
     }
 
   is_local = g_str_has_prefix (url, "file:");
+  http_flags = flatpak_dir_get_remote_http_flags (self, name_or_uri);
 
   /* Seems ostree asserts if this is NULL */
   if (error == NULL)
     error = &local_error;
 
+  /* Serialize the fetches between processes, so that the ones waiting can
+   * use the index the first one got */
+  if (!only_cached && !is_local)
+    {
+      g_autofree char *lock_name = g_strconcat (name_or_uri, ".idx.lock", NULL);
+      g_autoptr(GFile) cache_dir = flatpak_build_file (self->cache_dir, "summaries", NULL);
+      g_autoptr(GFile) lock_file = flatpak_build_file (cache_dir, lock_name, NULL);
+
+      if (flatpak_mkdir_p (cache_dir, cancellable, NULL))
+        glnx_make_lock_file (AT_FDCWD, flatpak_file_get_path_cached (lock_file),
+                             LOCK_EX, &index_lock, NULL);
+    }
+
   flatpak_dir_remote_load_cached_summary (self, name_or_uri, NULL, ".idx", ".idx.sig",
                                           &cached_index, &cached_index_sig, cancellable, &cache_error);
 
-  if (only_cached)
+  if (!only_cached && !is_local && cached_index != NULL &&
+      (!gpg_verify_summary || cached_index_sig != NULL) &&
+      summary_index_checked_within (self, name_or_uri, url, SHARED_SUMMARY_INDEX_TIMEOUT_SEC))
+    {
+      g_info ("Using recently checked summary index from cache for remote ‘%s’", name_or_uri);
+
+      index = g_steal_pointer (&cached_index);
+      if (gpg_verify_summary)
+        index_sig = g_steal_pointer (&cached_index_sig);
+    }
+  else if (only_cached)
     {
       if (cached_index == NULL)
         {
@@ -13472,7 +17670,7 @@ flatpak_dir_remote_fetch_summary_index (FlatpakDir   *self,
 
       g_info ("Fetching summary index file for remote ‘%s’", name_or_uri);
 
-      dl_index = flatpak_load_uri (self->http_session, index_url, 0, NULL,
+      dl_index = flatpak_load_uri (self->http_session, index_url, http_flags, NULL,
                                    NULL, NULL, NULL,
                                    cancellable, error);
       if (dl_index == NULL)
@@ -13501,7 +17699,7 @@ flatpak_dir_remote_fetch_summary_index (FlatpakDir   *self,
           g_autoptr(GError) dl_sig_error = NULL;
           g_autoptr (GBytes) dl_index_sig = NULL;
 
-          dl_index_sig = load_uri_with_fallback (self->http_session, index_sig_url, index_sig_url2, 0, NULL,
+          dl_index_sig = load_uri_with_fallback (self->http_session, index_sig_url, index_sig_url2, http_flags, NULL,
                                                  cancellable, &dl_sig_error);
           if (dl_index_sig == NULL)
             {
@@ -13511,41 +17709,183 @@ flatpak_dir_remote_fetch_summary_index (FlatpakDir   *self,
               else
                 g_propagate_error (error, g_steal_pointer (&dl_sig_error));
 
-              return FALSE;
-            }
+              return FALSE;
+            }
+
+          if (!remote_verify_signature (self->repo, name_or_uri,
+                                        index, dl_index_sig,
+                                        cancellable, error))
+            return FALSE;
+
+          index_sig = g_steal_pointer (&dl_index_sig);
+          used_download = TRUE;
+        }
+
+      g_assert (index != NULL);
+      if (gpg_verify_summary)
+        g_assert (index_sig != NULL);
+
+      /* Update cache on disk if we downloaded anything, but never cache for file: repos */
+      if (used_download && !is_local &&
+          !flatpak_dir_remote_save_cached_summary (self, name_or_uri, ".idx", ".idx.sig",
+                                                   index, index_sig, cancellable, error))
+        return FALSE;
+
+      if (!is_local)
+        summary_index_mark_checked (self, name_or_uri, url);
+    }
+
+  /* Cache in memory */
+  if (!is_local && !only_cached)
+    {
+      g_autofree char *cache_key = g_strconcat ("index-", name_or_uri, NULL);
+      flatpak_dir_cache_summary (self, index, index_sig, cache_key, url);
+    }
+
+  *out_index = g_steal_pointer (&index);
+  if (out_index_sig)
+    *out_index_sig = g_steal_pointer (&index_sig);
+
+  return TRUE;
+}
+
+/* When the cached subsummary is older than the history, catch up by taking
+ * the deltas of the delta chain one after the other, as long as that is
+ * cheaper than downloading the whole thing. Each step is verified. */
+static GBytes *
+fetch_indexed_summary_via_delta_chain (FlatpakDir      *self,
+                                       const char      *name_or_uri,
+                                       const char      *arch,
+                                       const char      *url,
+                                       FlatpakHTTPFlags http_flags,
+                                       VarSubsummaryRef subsummary_info,
+                                       const char      *checksum,
+                                       GCancellable    *cancellable)
+{
+  VarMetadataRef metadata = var_subsummary_get_metadata (subsummary_info);
+  VarArrayofChecksumRef history = var_subsummary_get_history (subsummary_info);
+  gsize history_len = var_arrayof_checksum_get_length (history);
+  guint64 full_size = var_metadata_lookup_uint64 (metadata, FLATPAK_SUBSUMMARY_KEY_COMPRESSED_SIZE, 0);
+  g_autoptr(GVariant) chain = NULL;
+  g_autoptr(GBytes) summary = NULL;
+  g_autofree char *current = NULL;
+  gsize start = 0;
+  guint64 cost = 0;
+  VarVariantRef v;
+
+  if (!var_metadata_lookup (metadata, FLATPAK_SUBSUMMARY_KEY_DELTA_CHAIN, NULL, &v))
+    return NULL;
+
+  {
+    g_autoptr(GVariant) vv = g_variant_ref_sink (var_variant_dup_to_gvariant (v));
+    chain = g_variant_get_child_value (vv, 0);
+  }
+  if (!g_variant_is_of_type (chain, G_VARIANT_TYPE ("a(ayayt)")))
+    return NULL;
+
+  /* Find the newest version we have cached. Links are newest first, and
+   * each goes to the version of the one before it */
+  for (start = 0; start < g_variant_n_children (chain); start++)
+    {
+      g_autoptr(GVariant) from_v = NULL;
+      g_autoptr(GVariant) to_v = NULL;
+      g_autofree char *cache_name = NULL;
+      guint64 size;
+
+      g_variant_get_child (chain, start, "(@ay@ayt)", &from_v, &to_v, &size);
+      if (g_variant_n_children (from_v) != OSTREE_SHA256_DIGEST_LEN)
+        return NULL;
+
+      cost += size;
+      current = ostree_checksum_from_bytes_v (from_v);
+      cache_name = g_strconcat (name_or_uri, "-", arch, "-", current, NULL);
+      if (flatpak_dir_remote_load_cached_summary (self, cache_name, current, ".sub", NULL,
+                                                  &summary, NULL, cancellable, NULL))
+        break;
+
+      g_clear_pointer (&current, g_free);
+    }
+
+  if (summary == NULL)
+    return NULL;
+
+  if (full_size != 0 && cost >= full_size)
+    {
+      g_info ("Delta chain for indexed summary of remote ‘%s’ costs more than the full file", name_or_uri);
+      return NULL;
+    }
+
+  for (gsize i = start + 1; i-- > 0; )
+    {
+      g_autoptr(GVariant) to_v = NULL;
+      g_autofree char *to = NULL;
+      g_autofree char *delta_filename = NULL;
+      g_autofree char *delta_url = NULL;
+      g_autofree char *sha256 = NULL;
+      g_autoptr(GBytes) delta = NULL;
+      g_autoptr(GBytes) applied = NULL;
+      g_autoptr(GError) local_error = NULL;
+      gboolean direct = FALSE;
+
+      /* Take a direct delta to the current version if there is one */
+      for (gsize j = 0; j < history_len && !direct; j++)
+        {
+          VarChecksumRef h = var_arrayof_checksum_get_at (history, j);
+          g_autofree char *h_checksum = NULL;
+
+          if (var_checksum_get_length (h) != OSTREE_SHA256_DIGEST_LEN)
+            continue;
+
+          h_checksum = ostree_checksum_from_bytes (var_checksum_peek (h));
+          direct = strcmp (h_checksum, current) == 0;
+        }
+
+      if (direct)
+        {
+          to = g_strdup (checksum);
+          i = 0;
+        }
+      else
+        {
+          g_variant_get_child (chain, i, "(@ay@ayt)", NULL, &to_v, NULL);
+          if (g_variant_n_children (to_v) != OSTREE_SHA256_DIGEST_LEN)
+            return NULL;
+          to = ostree_checksum_from_bytes_v (to_v);
+        }
+
+      delta_filename = g_strconcat (current, "-", to, ".delta", NULL);
+      delta_url = g_build_filename (url, "summaries", delta_filename, NULL);
 
-          if (!remote_verify_signature (self->repo, name_or_uri,
-                                        index, dl_index_sig,
-                                        cancellable, error))
-            return FALSE;
+      g_info ("Fetching indexed summary delta %s for remote ‘%s’ from delta chain", delta_filename, name_or_uri);
 
-          index_sig = g_steal_pointer (&dl_index_sig);
-          used_download = TRUE;
+      delta = flatpak_load_uri (self->http_session, delta_url, http_flags, NULL,
+                                NULL, NULL, NULL,
+                                cancellable, &local_error);
+      if (delta != NULL)
+        applied = flatpak_summary_apply_diff (summary, delta, &local_error);
+      if (applied == NULL)
+        {
+          g_info ("Failed to use delta chain, falling back: %s", local_error->message);
+          return NULL;
         }
 
-      g_assert (index != NULL);
-      if (gpg_verify_summary)
-        g_assert (index_sig != NULL);
+      sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, applied);
+      if (strcmp (sha256, to) != 0)
+        {
+          g_warning ("Applying delta %s gave wrong checksum, falling back", delta_filename);
+          return NULL;
+        }
 
-      /* Update cache on disk if we downloaded anything, but never cache for file: repos */
-      if (used_download && !is_local &&
-          !flatpak_dir_remote_save_cached_summary (self, name_or_uri, ".idx", ".idx.sig",
-                                                   index, index_sig, cancellable, error))
-        return FALSE;
-    }
+      g_bytes_unref (summary);
+      summary = g_steal_pointer (&applied);
+      g_free (current);
+      current = g_steal_pointer (&to);
 
-  /* Cache in memory */
-  if (!is_local && !only_cached)
-    {
-      g_autofree char *cache_key = g_strconcat ("index-", name_or_uri, NULL);
-      flatpak_dir_cache_summary (self, index, index_sig, cache_key, url);
+      if (strcmp (current, checksum) == 0)
+        return g_steal_pointer (&summary);
     }
 
-  *out_index = g_steal_pointer (&index);
-  if (out_index_sig)
-    *out_index_sig = g_steal_pointer (&index_sig);
-
-  return TRUE;
+  return NULL;
 }
 
 static gboolean
@@ -13569,9 +17909,12 @@ flatpak_dir_remote_fetch_indexed_summary (FlatpakDir   *self,
   const guchar *checksum_bytes;
   g_autofree char *checksum = NULL;
   g_autofree char *cache_name = NULL;
+  FlatpakHTTPFlags http_flags;
 
   ensure_http_session (self);
 
+  http_flags = flatpak_dir_get_remote_http_flags (self, name_or_uri);
+
   if (!ostree_repo_remote_get_url (self->repo, name_or_uri, &url, error))
     return FALSE;
 
@@ -13645,7 +17988,7 @@ flatpak_dir_remote_fetch_indexed_summary (FlatpakDir   *self,
 
           g_info ("Fetching indexed summary delta %s for remote ‘%s’", delta_filename, name_or_uri);
 
-          g_autoptr(GBytes) delta = flatpak_load_uri (self->http_session, delta_url, 0, NULL,
+          g_autoptr(GBytes) delta = flatpak_load_uri (self->http_session, delta_url, http_flags, NULL,
                                                       NULL, NULL, NULL,
                                                       cancellable, &delta_error);
           if (delta == NULL)
@@ -13666,13 +18009,16 @@ flatpak_dir_remote_fetch_indexed_summary (FlatpakDir   *self,
                 }
             }
         }
+      else
+        summary = fetch_indexed_summary_via_delta_chain (self, name_or_uri, arch, url, http_flags,
+                                                         subsummary_info, checksum, cancellable);
 
       if (summary == NULL)
         {
           g_autofree char *filename = g_strconcat (checksum, ".gz", NULL);
           g_info ("Fetching indexed summary file %s for remote ‘%s’", filename, name_or_uri);
           g_autofree char *subsummary_url = g_build_filename (url, "summaries", filename, NULL);
-          summary_z = flatpak_load_uri (self->http_session, subsummary_url, 0, NULL,
+          summary_z = flatpak_load_uri (self->http_session, subsummary_url, http_flags, NULL,
                                         NULL, NULL, NULL,
                                         cancellable, error);
           if (summary_z == NULL)
@@ -13691,11 +18037,20 @@ flatpak_dir_remote_fetch_indexed_summary (FlatpakDir   *self,
       /* Save to disk */
       if (!is_local)
         {
-          if (!flatpak_dir_remote_save_cached_summary (self, cache_name, ".sub", NULL,
-                                                       summary, NULL,
-                                                       cancellable, error))
+          g_autoptr(GBytes) mapped_summary = NULL;
+
+          if (!flatpak_dir_remote_save_cached_subsummary (self, cache_name, checksum, summary,
+                                                          cancellable, error))
             return FALSE;
 
+          /* Keep using the mapped file rather than the heap copy */
+          if (flatpak_dir_remote_load_cached_summary (self, cache_name, NULL, ".sub", NULL,
+                                                      &mapped_summary, NULL, cancellable, NULL))
+            {
+              g_bytes_unref (summary);
+              summary = g_steal_pointer (&mapped_summary);
+            }
+
           if (!flatpak_dir_gc_cached_digested_summaries (self, name_or_uri, cache_name,
                                                          cancellable, error))
             return FALSE;
@@ -13770,6 +18125,14 @@ _flatpak_dir_get_remote_state (FlatpakDir   *self,
       return g_steal_pointer (&state);
     }
 
+  if (!is_local && !only_cached)
+    {
+      g_auto(GStrv) peer_uris = flatpak_dir_get_sideload_peer_uris (self);
+
+      for (int i = 0; peer_uris[i] != NULL; i++)
+        flatpak_remote_state_add_sideload_peer (state, self, peer_uris[i]);
+    }
+
   if (opt_summary)
     {
       if (opt_summary_sig)
@@ -14028,6 +18391,94 @@ flatpak_dir_get_remote_state_optional (FlatpakDir   *self,
 }
 
 
+G_LOCK_DEFINE_STATIC (background_refreshes);
+static GPtrArray *background_refreshes = NULL;
+
+typedef struct {
+  FlatpakDir *dir;
+  char       *remote;
+} BackgroundRefreshData;
+
+static gpointer
+background_refresh_thread (gpointer user_data)
+{
+  BackgroundRefreshData *data = user_data;
+  g_autoptr(FlatpakRemoteState) state = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  state = flatpak_dir_get_remote_state_optional (data->dir, data->remote, FALSE, NULL, &local_error);
+  if (state == NULL ||
+      !flatpak_remote_state_ensure_subsummary (state, data->dir, flatpak_get_arch (), FALSE, NULL, &local_error))
+    g_info ("Background refresh of remote %s failed: %s", data->remote, local_error->message);
+
+  g_object_unref (data->dir);
+  g_free (data->remote);
+  g_free (data);
+
+  return NULL;
+}
+
+/* Like flatpak_dir_get_remote_state_optional() but for read-only queries
+ * that care more about latency than freshness: if the cached summary index
+ * was checked against the remote within the last day it is used as is, and
+ * refreshed in the background for the next time. */
+FlatpakRemoteState *
+flatpak_dir_get_remote_state_stale_ok (FlatpakDir   *self,
+                                       const char   *remote,
+                                       GCancellable *cancellable,
+                                       GError      **error)
+{
+  g_autofree char *url = NULL;
+  FlatpakRemoteState *state;
+  BackgroundRefreshData *data;
+
+  if (!flatpak_dir_ensure_repo (self, cancellable, error))
+    return NULL;
+
+  if (!ostree_repo_remote_get_url (self->repo, remote, &url, NULL) ||
+      g_str_has_prefix (url, "file:") ||
+      !summary_index_checked_within (self, remote, url, STALE_SUMMARY_INDEX_MAX_AGE_SEC))
+    return flatpak_dir_get_remote_state_optional (self, remote, FALSE, cancellable, error);
+
+  /* Recently checked by someone, so no need to revalidate */
+  if (summary_index_checked_within (self, remote, url, SHARED_SUMMARY_INDEX_TIMEOUT_SEC))
+    return flatpak_dir_get_remote_state_optional (self, remote, TRUE, cancellable, error);
+
+  state = flatpak_dir_get_remote_state_optional (self, remote, TRUE, cancellable, NULL);
+  if (state == NULL)
+    return flatpak_dir_get_remote_state_optional (self, remote, FALSE, cancellable, error);
+
+  g_info ("Using stale summary index for remote %s, refreshing it in the background", remote);
+
+  data = g_new0 (BackgroundRefreshData, 1);
+  data->dir = flatpak_dir_clone (self);
+  data->remote = g_strdup (remote);
+
+  G_LOCK (background_refreshes);
+  if (background_refreshes == NULL)
+    background_refreshes = g_ptr_array_new ();
+  g_ptr_array_add (background_refreshes,
+                   g_thread_new ("flatpak-refresh", background_refresh_thread, data));
+  G_UNLOCK (background_refreshes);
+
+  return state;
+}
+
+/* Waits for the refreshes started by flatpak_dir_get_remote_state_stale_ok(),
+ * so that short lived processes don't exit before they are done */
+void
+flatpak_dir_wait_background_refreshes (void)
+{
+  g_autoptr(GPtrArray) threads = NULL;
+
+  G_LOCK (background_refreshes);
+  threads = g_steal_pointer (&background_refreshes);
+  G_UNLOCK (background_refreshes);
+
+  for (guint i = 0; threads != NULL && i < threads->len; i++)
+    g_thread_join (g_ptr_array_index (threads, i));
+}
+
 /* This doesn't do any i/o at all, just keeps track of the local details like
    remote and collection-id. Useful when doing no-pull operations */
 FlatpakRemoteState *
@@ -14459,6 +18910,82 @@ flatpak_dir_get_remote_collection_id (FlatpakDir *self,
   return collection_id;
 }
 
+/* Finding refs by name happens a lot, so rather than decomposing every ref
+ * of every ref map for each lookup, keep the refs of the state around along
+ * with an index by id. */
+static gboolean
+flatpak_remote_state_ensure_all_refs (FlatpakDir         *self,
+                                      FlatpakRemoteState *state,
+                                      GCancellable       *cancellable,
+                                      GError            **error)
+{
+  guint n_subsummaries = g_hash_table_size (state->subsummaries);
+  g_autoptr(GHashTable) all_refs = NULL;
+  g_autoptr(GHashTable) by_id = NULL;
+
+  if (state->all_refs != NULL && state->all_refs_n_subsummaries == n_subsummaries)
+    return TRUE;
+
+  if (!flatpak_dir_list_all_remote_refs (self, state, &all_refs, cancellable, error))
+    return FALSE;
+
+  by_id = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+  GLNX_HASH_TABLE_FOREACH (all_refs, FlatpakDecomposed *, ref)
+    {
+      g_autofree char *id = flatpak_decomposed_dup_id (ref);
+      GPtrArray *refs = g_hash_table_lookup (by_id, id);
+
+      if (refs == NULL)
+        {
+          refs = g_ptr_array_new ();
+          g_hash_table_insert (by_id, g_steal_pointer (&id), refs);
+        }
+
+      g_ptr_array_add (refs, ref);
+    }
+
+  g_clear_pointer (&state->all_refs_by_id, g_hash_table_unref);
+  g_clear_pointer (&state->all_refs, g_hash_table_unref);
+  state->all_refs = g_steal_pointer (&all_refs);
+  state->all_refs_by_id = g_steal_pointer (&by_id);
+  state->all_refs_n_subsummaries = n_subsummaries;
+
+  return TRUE;
+}
+
+/* The refs of @state that can match @name, which is all of them for fuzzy
+ * matches, in the same form as flatpak_dir_list_all_remote_refs() */
+static GHashTable *
+flatpak_remote_state_get_candidate_refs (FlatpakDir           *self,
+                                         FlatpakRemoteState   *state,
+                                         const char           *name,
+                                         FindMatchingRefsFlags flags,
+                                         GCancellable         *cancellable,
+                                         GError              **error)
+{
+  GHashTable *candidates;
+  GPtrArray *refs;
+
+  if (!flatpak_remote_state_ensure_all_refs (self, state, cancellable, error))
+    return NULL;
+
+  if (name == NULL || (flags & FIND_MATCHING_REFS_FLAGS_FUZZY) != 0)
+    return g_hash_table_ref (state->all_refs);
+
+  candidates = g_hash_table_new_full ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal, (GDestroyNotify)flatpak_decomposed_unref, g_free);
+
+  refs = g_hash_table_lookup (state->all_refs_by_id, name);
+  for (guint i = 0; refs != NULL && i < refs->len; i++)
+    {
+      FlatpakDecomposed *ref = g_ptr_array_index (refs, i);
+
+      g_hash_table_insert (candidates, flatpak_decomposed_ref (ref),
+                           g_strdup (g_hash_table_lookup (state->all_refs, ref)));
+    }
+
+  return candidates;
+}
+
 /* This tries to find all available refs based on the specified name/arch/branch
  * triplet from  a remote. If arch is not specified, matches only on compatible arches.
 */
@@ -14483,8 +19010,9 @@ flatpak_dir_find_remote_refs (FlatpakDir           *self,
   if (opt_arch != NULL)
     valid_arches = opt_arches;
 
-  if (!flatpak_dir_list_all_remote_refs (self, state,
-                                         &remote_refs, cancellable, error))
+  remote_refs = flatpak_remote_state_get_candidate_refs (self, state, name, flags,
+                                                         cancellable, error);
+  if (remote_refs == NULL)
     return NULL;
 
   matched_refs = find_matching_refs (remote_refs,
@@ -14580,8 +19108,10 @@ flatpak_dir_find_remote_ref (FlatpakDir   *self,
   if (opt_branch != NULL && opt_arch != NULL && (kinds == FLATPAK_KINDS_APP || kinds == FLATPAK_KINDS_RUNTIME))
     return flatpak_decomposed_new_from_parts (kinds, name, opt_arch, opt_branch, error);
 
-  if (!flatpak_dir_list_all_remote_refs (self, state,
-                                         &remote_refs, cancellable, error))
+  remote_refs = flatpak_remote_state_get_candidate_refs (self, state, name,
+                                                         FIND_MATCHING_REFS_FLAGS_NONE,
+                                                         cancellable, error);
+  if (remote_refs == NULL)
     return NULL;
 
   remote_ref = find_ref_for_refs_set (remote_refs, name, opt_branch,
@@ -14946,8 +19476,14 @@ flatpak_dir_clone (FlatpakDir *self)
 
   clone = flatpak_dir_new_full (self->basedir, self->user, self->extra_data);
 
+  /* All clones share the repo pool of the original dir */
+  clone->clone_parent = g_object_ref (self->clone_parent ? self->clone_parent : self);
+
   flatpak_dir_set_no_system_helper (clone, self->no_system_helper);
   flatpak_dir_set_no_interaction (clone, self->no_interaction);
+  flatpak_dir_set_max_download_rate (clone, self->max_download_rate);
+  flatpak_dir_set_background_priority (clone, self->background_priority);
+  flatpak_dir_set_checkout_jobs (clone, self->checkout_jobs);
 
   return clone;
 }
@@ -15035,14 +19571,29 @@ flatpak_dir_get_system_by_id (const char   *id,
   return ret;
 }
 
+static GPtrArray *
+system_list_from_locations (GPtrArray *locations)
+{
+  g_autoptr(GPtrArray) result = NULL;
+  int i;
+
+  result = g_ptr_array_new_with_free_func (g_object_unref);
+  for (i = 0; i < locations->len; i++)
+    {
+      GFile *path = g_ptr_array_index (locations, i);
+      DirExtraData *extra_data = g_object_get_data (G_OBJECT (path), "extra-data");
+      g_ptr_array_add (result, flatpak_dir_new_full (path, FALSE, extra_data));
+    }
+
+  return g_steal_pointer (&result);
+}
+
 GPtrArray *
 flatpak_dir_get_system_list (GCancellable *cancellable,
                              GError      **error)
 {
-  g_autoptr(GPtrArray) result = NULL;
   g_autoptr(GError) local_error = NULL;
   GPtrArray *locations = NULL;
-  int i;
 
   /* An error in flatpak_get_system_base_dir_locations() will still return
    * return an empty array with the GError set, but we want to return NULL.
@@ -15054,15 +19605,27 @@ flatpak_dir_get_system_list (GCancellable *cancellable,
       return NULL;
     }
 
-  result = g_ptr_array_new_with_free_func (g_object_unref);
-  for (i = 0; i < locations->len; i++)
+  return system_list_from_locations (locations);
+}
+
+/* Like flatpak_dir_get_system_list(), but reads the configuration again
+ * rather than using what the process read the first time, so that long
+ * running processes can pick up changes to it. */
+GPtrArray *
+flatpak_dir_get_system_list_uncached (GCancellable *cancellable,
+                                      GError      **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GPtrArray) locations = NULL;
+
+  locations = get_system_locations (cancellable, &local_error);
+  if (local_error != NULL)
     {
-      GFile *path = g_ptr_array_index (locations, i);
-      DirExtraData *extra_data = g_object_get_data (G_OBJECT (path), "extra-data");
-      g_ptr_array_add (result, flatpak_dir_new_full (path, FALSE, extra_data));
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
     }
 
-  return g_steal_pointer (&result);
+  return system_list_from_locations (locations);
 }
 
 FlatpakDir *
@@ -15087,6 +19650,120 @@ flatpak_dir_get_repo_config (FlatpakDir *self)
   return ostree_repo_get_config (self->repo);
 }
 
+/* The options of a remote that are looked up often, parsed once */
+typedef struct
+{
+  int              prio;
+  gboolean         noenumerate;
+  gboolean         nodeps;
+  gboolean         disable;
+  gboolean         http3;
+  gint32           default_token_type;
+  char            *filter; /* canonical, NULL if unset or empty */
+  char            *subset; /* NULL if unset or empty */
+} RemoteConfig;
+
+/* What the accessors return for remotes that aren't in the config */
+static const RemoteConfig missing_remote_config = { 1, };
+
+static void
+remote_config_free (RemoteConfig *remote_config)
+{
+  g_free (remote_config->filter);
+  g_free (remote_config->subset);
+  g_free (remote_config);
+}
+
+static char *
+get_non_empty_string (GKeyFile   *config,
+                      const char *group,
+                      const char *key)
+{
+  g_autofree char *value = g_key_file_get_string (config, group, key, NULL);
+
+  if (value == NULL || *value == 0)
+    return NULL;
+
+  return g_steal_pointer (&value);
+}
+
+static GHashTable *
+parse_remote_configs (GKeyFile *config)
+{
+  g_autoptr(GHashTable) remote_configs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                                (GDestroyNotify) remote_config_free);
+  g_auto(GStrv) groups = g_key_file_get_groups (config, NULL);
+
+  for (int i = 0; groups[i] != NULL; i++)
+    {
+      const char *group = groups[i];
+      RemoteConfig *remote_config;
+      size_t len = strlen (group);
+
+      if (len < strlen ("remote \"\"") ||
+          !g_str_has_prefix (group, "remote \"") || !g_str_has_suffix (group, "\""))
+        continue;
+
+      remote_config = g_new0 (RemoteConfig, 1);
+      remote_config->prio = 1;
+      if (g_key_file_has_key (config, group, "xa.prio", NULL))
+        remote_config->prio = g_key_file_get_integer (config, group, "xa.prio", NULL);
+      remote_config->noenumerate = g_key_file_get_boolean (config, group, "xa.noenumerate", NULL);
+      remote_config->nodeps = g_key_file_get_boolean (config, group, "xa.nodeps", NULL);
+      remote_config->disable = g_key_file_get_boolean (config, group, "xa.disable", NULL);
+      remote_config->http3 = g_key_file_get_boolean (config, group, "xa.http3", NULL);
+      remote_config->default_token_type = (gint32) g_key_file_get_integer (config, group, "xa.default-token-type", NULL);
+      remote_config->filter = get_non_empty_string (config, group, "xa.filter");
+      remote_config->subset = get_non_empty_string (config, group, "xa.subset");
+
+      g_hash_table_replace (remote_configs,
+                            g_strndup (group + strlen ("remote \""), len - strlen ("remote \"\"")),
+                            remote_config);
+    }
+
+  return g_steal_pointer (&remote_configs);
+}
+
+/* Returns a reference to the parsed options of all remotes, or NULL if
+ * there is no repo. The table is never modified, so it can be used
+ * without holding the lock. */
+static GHashTable *
+flatpak_dir_ref_remote_configs (FlatpakDir *self)
+{
+  GKeyFile *config = flatpak_dir_get_repo_config (self);
+  GHashTable *remote_configs;
+
+  if (config == NULL)
+    return NULL;
+
+  G_LOCK (config_cache);
+
+  /* OstreeRepo replaces its keyfile when it reloads the config, and we
+   * hold a ref on the one we parsed so its address can't be reused */
+  if (self->remote_configs == NULL || self->remote_configs_keyfile != config)
+    {
+      g_clear_pointer (&self->remote_configs, g_hash_table_unref);
+      g_clear_pointer (&self->remote_configs_keyfile, g_key_file_unref);
+      self->remote_configs = parse_remote_configs (config);
+      self->remote_configs_keyfile = g_key_file_ref (config);
+    }
+
+  remote_configs = g_hash_table_ref (self->remote_configs);
+
+  G_UNLOCK (config_cache);
+
+  return remote_configs;
+}
+
+static const RemoteConfig *
+lookup_remote_config (GHashTable *remote_configs,
+                      const char *remote_name)
+{
+  const RemoteConfig *remote_config = g_hash_table_lookup (remote_configs, remote_name);
+
+  return remote_config ? remote_config : &missing_remote_config;
+}
+
 char **
 flatpak_dir_list_remote_config_keys (FlatpakDir *self,
                                      const char *remote_name)
@@ -15110,7 +19787,79 @@ flatpak_dir_get_sideload_repo_paths (FlatpakDir *self)
   add_sideload_subdirs (res, sideload_repos_dir, TRUE);
   add_sideload_subdirs (res, runtime_sideload_repos_dir, TRUE);
 
-  return g_steal_pointer (&res);
+  return g_steal_pointer (&res);
+}
+
+static void
+add_sideload_peer_uris (GPtrArray *res,
+                        GFile     *parent)
+{
+  g_autoptr(GFileEnumerator) dir_enum = NULL;
+
+  dir_enum = g_file_enumerate_children (parent,
+                                        G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                                        G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                                        G_FILE_QUERY_INFO_NONE,
+                                        NULL, NULL);
+  if (dir_enum == NULL)
+    return;
+
+  while (TRUE)
+    {
+      GFileInfo *info;
+      GFile *path;
+      g_autoptr(GKeyFile) keyfile = NULL;
+      g_autoptr(GError) local_error = NULL;
+      g_autofree char *uri = NULL;
+
+      if (!g_file_enumerator_iterate (dir_enum, &info, &path, NULL, NULL) ||
+          info == NULL)
+        break;
+
+      if (g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR ||
+          !g_str_has_suffix (g_file_info_get_name (info), SIDELOAD_PEER_FILE_EXT))
+        continue;
+
+      keyfile = g_key_file_new ();
+      if (!g_key_file_load_from_file (keyfile, flatpak_file_get_path_cached (path),
+                                      G_KEY_FILE_NONE, &local_error))
+        {
+          g_info ("Ignoring sideload peer %s: %s",
+                  flatpak_file_get_path_cached (path), local_error->message);
+          continue;
+        }
+
+      uri = g_key_file_get_string (keyfile, SIDELOAD_PEER_GROUP, SIDELOAD_PEER_URL_KEY, NULL);
+      if (uri == NULL ||
+          !(g_str_has_prefix (uri, "http://") || g_str_has_prefix (uri, "https://")))
+        {
+          g_info ("Ignoring sideload peer %s: No valid http url",
+                  flatpak_file_get_path_cached (path));
+          continue;
+        }
+
+      if (!flatpak_g_ptr_array_contains_string (res, uri))
+        g_ptr_array_add (res, g_steal_pointer (&uri));
+    }
+}
+
+/* Peer files are written by whatever does the discovery on the local
+ * network (same as how sideload-repos symlinks are managed for USB
+ * drives), and we just pick up the result here.
+ */
+char **
+flatpak_dir_get_sideload_peer_uris (FlatpakDir *self)
+{
+  g_autoptr(GFile) sideload_peers_dir = g_file_get_child (self->basedir, SIDELOAD_PEERS_DIR_NAME);
+  g_autoptr(GFile) run_dir = g_file_new_for_path (get_run_dir_location ());
+  g_autoptr(GFile) runtime_sideload_peers_dir = g_file_get_child (run_dir, SIDELOAD_PEERS_DIR_NAME);
+  g_autoptr(GPtrArray) res = g_ptr_array_new_with_free_func (g_free);
+
+  add_sideload_peer_uris (res, sideload_peers_dir);
+  add_sideload_peer_uris (res, runtime_sideload_peers_dir);
+
+  g_ptr_array_add (res, NULL);
+  return (char **) g_ptr_array_free (g_steal_pointer (&res), FALSE);
 }
 
 
@@ -15151,16 +19900,10 @@ char *
 flatpak_dir_get_remote_filter (FlatpakDir *self,
                                const char *remote_name)
 {
-  GKeyFile *config = flatpak_dir_get_repo_config (self);
-  g_autofree char *group = get_group (remote_name);
-
-  if (config)
-    {
-      g_autofree char *filter = g_key_file_get_string (config, group, "xa.filter", NULL);
+  g_autoptr(GHashTable) remote_configs = flatpak_dir_ref_remote_configs (self);
 
-      if (filter && *filter != 0)
-        return g_steal_pointer (&filter);
-    }
+  if (remote_configs)
+    return g_strdup (lookup_remote_config (remote_configs, remote_name)->filter);
 
   return NULL;
 }
@@ -15236,11 +19979,10 @@ gint32
 flatpak_dir_get_remote_default_token_type (FlatpakDir *self,
                                            const char *remote_name)
 {
-  GKeyFile *config = flatpak_dir_get_repo_config (self);
-  g_autofree char *group = get_group (remote_name);
+  g_autoptr(GHashTable) remote_configs = flatpak_dir_ref_remote_configs (self);
 
-  if (config)
-    return (gint32)g_key_file_get_integer (config, group, "xa.default-token-type", NULL);
+  if (remote_configs)
+    return lookup_remote_config (remote_configs, remote_name)->default_token_type;
 
   return 0;
 }
@@ -15275,11 +20017,10 @@ int
 flatpak_dir_get_remote_prio (FlatpakDir *self,
                              const char *remote_name)
 {
-  GKeyFile *config = flatpak_dir_get_repo_config (self);
-  g_autofree char *group = get_group (remote_name);
+  g_autoptr(GHashTable) remote_configs = flatpak_dir_ref_remote_configs (self);
 
-  if (config && g_key_file_has_key (config, group, "xa.prio", NULL))
-    return g_key_file_get_integer (config, group, "xa.prio", NULL);
+  if (remote_configs)
+    return lookup_remote_config (remote_configs, remote_name)->prio;
 
   return 1;
 }
@@ -15288,11 +20029,10 @@ gboolean
 flatpak_dir_get_remote_noenumerate (FlatpakDir *self,
                                     const char *remote_name)
 {
-  GKeyFile *config = flatpak_dir_get_repo_config (self);
-  g_autofree char *group = get_group (remote_name);
+  g_autoptr(GHashTable) remote_configs = flatpak_dir_ref_remote_configs (self);
 
-  if (config)
-    return g_key_file_get_boolean (config, group, "xa.noenumerate", NULL);
+  if (remote_configs)
+    return lookup_remote_config (remote_configs, remote_name)->noenumerate;
 
   return TRUE;
 }
@@ -15301,11 +20041,10 @@ gboolean
 flatpak_dir_get_remote_nodeps (FlatpakDir *self,
                                const char *remote_name)
 {
-  GKeyFile *config = flatpak_dir_get_repo_config (self);
-  g_autofree char *group = get_group (remote_name);
+  g_autoptr(GHashTable) remote_configs = flatpak_dir_ref_remote_configs (self);
 
-  if (config)
-    return g_key_file_get_boolean (config, group, "xa.nodeps", NULL);
+  if (remote_configs)
+    return lookup_remote_config (remote_configs, remote_name)->nodeps;
 
   return TRUE;
 }
@@ -15314,29 +20053,22 @@ char *
 flatpak_dir_get_remote_subset (FlatpakDir *self,
                                const char *remote_name)
 {
-  GKeyFile *config = flatpak_dir_get_repo_config (self);
-  g_autofree char *group = get_group (remote_name);
-  g_autofree char *subset = NULL;
+  g_autoptr(GHashTable) remote_configs = flatpak_dir_ref_remote_configs (self);
 
-  if (config == NULL)
-    return NULL;
-
-  subset = g_key_file_get_string (config, group, "xa.subset", NULL);
-  if (subset == NULL || *subset == 0)
+  if (remote_configs == NULL)
     return NULL;
 
-  return g_steal_pointer (&subset);
+  return g_strdup (lookup_remote_config (remote_configs, remote_name)->subset);
 }
 
 gboolean
 flatpak_dir_get_remote_disabled (FlatpakDir *self,
                                  const char *remote_name)
 {
-  GKeyFile *config = flatpak_dir_get_repo_config (self);
-  g_autofree char *group = get_group (remote_name);
+  g_autoptr(GHashTable) remote_configs = flatpak_dir_ref_remote_configs (self);
 
-  if (config &&
-      g_key_file_get_boolean (config, group, "xa.disable", NULL))
+  if (remote_configs &&
+      lookup_remote_config (remote_configs, remote_name)->disable)
     return TRUE;
 
   if (self->repo)
@@ -15372,6 +20104,21 @@ flatpak_dir_get_remote_signature_lookaside (FlatpakDir *self,
   return g_steal_pointer (&signature_lookaside);
 }
 
+/* The flags to use for our own http requests to the remote */
+static FlatpakHTTPFlags
+flatpak_dir_get_remote_http_flags (FlatpakDir *self,
+                                   const char *remote_name)
+{
+  g_autoptr(GHashTable) remote_configs = flatpak_dir_ref_remote_configs (self);
+  FlatpakHTTPFlags flags = FLATPAK_HTTP_FLAGS_NONE;
+
+  if (remote_configs != NULL &&
+      lookup_remote_config (remote_configs, remote_name)->http3)
+    flags |= FLATPAK_HTTP_FLAGS_HTTP3;
+
+  return flags;
+}
+
 static char *
 flatpak_dir_get_remote_install_authenticator_name (FlatpakDir *self,
                                                    const char *remote_name)
@@ -16692,10 +21439,28 @@ add_related (FlatpakDir        *self,
   g_ptr_array_add (related, rel);
 }
 
-static GRegex *
-flatpak_dir_get_mask_regexp (FlatpakDir *self)
+/* Compiles a ;-separated list of globs from the config, skipping any
+ * invalid ones */
+static FlatpakFilter *
+flatpak_dir_compile_config_patterns (const char *patterns_str,
+                                     gboolean    runtime_only)
+{
+  g_auto(GStrv) patterns = g_strsplit (patterns_str, ";", -1);
+  FlatpakFilter *filter = flatpak_filter_new ();
+
+  for (int i = 0; patterns[i] != NULL; i++)
+    {
+      if (*patterns[i] != 0)
+        flatpak_filter_add_glob (filter, patterns[i], runtime_only, NULL);
+    }
+
+  return filter;
+}
+
+static FlatpakFilter *
+flatpak_dir_get_mask_filter (FlatpakDir *self)
 {
-  GRegex *res = NULL;
+  FlatpakFilter *res = NULL;
 
   G_LOCK (config_cache);
 
@@ -16705,36 +21470,11 @@ flatpak_dir_get_mask_regexp (FlatpakDir *self)
 
       masked = flatpak_dir_get_config (self, "masked", NULL);
       if (masked)
-        {
-          g_auto(GStrv) patterns = g_strsplit (masked, ";", -1);
-          g_autoptr(GString) deny_regexp = g_string_new ("^(");
-          int i;
-
-          for (i = 0; patterns[i] != NULL; i++)
-            {
-              const char *pattern = patterns[i];
-
-              if (*pattern != 0)
-                {
-                  g_autofree char *regexp = NULL;
-
-                  regexp = flatpak_filter_glob_to_regexp (pattern, FALSE, NULL);
-                  if (regexp)
-                    {
-                      if (i != 0)
-                        g_string_append (deny_regexp, "|");
-                      g_string_append (deny_regexp, regexp);
-                    }
-                }
-            }
-
-          g_string_append (deny_regexp, ")$");
-          self->masked = g_regex_new (deny_regexp->str, G_REGEX_DOLLAR_ENDONLY|G_REGEX_RAW|G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, NULL);
-        }
+        self->masked = flatpak_dir_compile_config_patterns (masked, FALSE);
     }
 
   if (self->masked)
-    res = g_regex_ref (self->masked);
+    res = flatpak_filter_ref (self->masked);
 
   G_UNLOCK (config_cache);
 
@@ -16745,15 +21485,15 @@ gboolean
 flatpak_dir_ref_is_masked (FlatpakDir *self,
                            const char *ref)
 {
-  g_autoptr(GRegex) masked = flatpak_dir_get_mask_regexp (self);
+  g_autoptr(FlatpakFilter) masked = flatpak_dir_get_mask_filter (self);
 
   return !flatpak_filters_allow_ref (NULL, masked, ref);
 }
 
-static GRegex *
-flatpak_dir_get_pin_regexp (FlatpakDir *self)
+static FlatpakFilter *
+flatpak_dir_get_pin_filter (FlatpakDir *self)
 {
-  GRegex *res = NULL;
+  FlatpakFilter *res = NULL;
 
   G_LOCK (config_cache);
 
@@ -16763,38 +21503,12 @@ flatpak_dir_get_pin_regexp (FlatpakDir *self)
 
       pinned = flatpak_dir_get_config (self, "pinned", NULL);
       if (pinned)
-        {
-          g_auto(GStrv) patterns = g_strsplit (pinned, ";", -1);
-          g_autoptr(GString) deny_regexp = g_string_new ("^(");
-          int i;
-
-          for (i = 0; patterns[i] != NULL; i++)
-            {
-              const char *pattern = patterns[i];
-
-              if (*pattern != 0)
-                {
-                  g_autofree char *regexp = NULL;
-
-                  regexp = flatpak_filter_glob_to_regexp (pattern,
-                                                          TRUE, /* only match runtimes */
-                                                          NULL);
-                  if (regexp)
-                    {
-                      if (i != 0)
-                        g_string_append (deny_regexp, "|");
-                      g_string_append (deny_regexp, regexp);
-                    }
-                }
-            }
-
-          g_string_append (deny_regexp, ")$");
-          self->pinned = g_regex_new (deny_regexp->str, G_REGEX_DOLLAR_ENDONLY|G_REGEX_RAW|G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, NULL);
-        }
+        self->pinned = flatpak_dir_compile_config_patterns (pinned,
+                                                            TRUE /* only match runtimes */);
     }
 
   if (self->pinned)
-    res = g_regex_ref (self->pinned);
+    res = flatpak_filter_ref (self->pinned);
 
   G_UNLOCK (config_cache);
 
@@ -16805,7 +21519,7 @@ gboolean
 flatpak_dir_ref_is_pinned (FlatpakDir *self,
                            const char *ref)
 {
-  g_autoptr(GRegex) pinned = flatpak_dir_get_pin_regexp (self);
+  g_autoptr(FlatpakFilter) pinned = flatpak_dir_get_pin_filter (self);
 
   return !flatpak_filters_allow_ref (NULL, pinned, ref);
 }
@@ -16822,7 +21536,7 @@ flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
   g_autoptr(GPtrArray) related = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_related_free);
   g_autofree char *url = NULL;
   g_auto(GStrv) groups = NULL;
-  g_autoptr(GRegex) masked = NULL;
+  g_autoptr(FlatpakFilter) masked = NULL;
   g_autofree char *ref_arch = flatpak_decomposed_dup_arch (ref);
   g_autofree char *ref_branch = flatpak_decomposed_dup_branch (ref);
 
@@ -16835,7 +21549,7 @@ flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
   if (*url == 0)
     return g_steal_pointer (&related);  /* Empty url, silently disables updates */
 
-  masked = flatpak_dir_get_mask_regexp (self);
+  masked = flatpak_dir_get_mask_filter (self);
 
   groups = g_key_file_get_groups (metakey, NULL);
   for (i = 0; groups[i] != NULL; i++)
@@ -16920,6 +21634,91 @@ flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
   return g_steal_pointer (&related);
 }
 
+typedef struct
+{
+  char     *commit;
+  GKeyFile *metakey;
+} DeployedMetadata;
+
+static void
+deployed_metadata_free (DeployedMetadata *data)
+{
+  g_free (data->commit);
+  g_key_file_unref (data->metakey);
+  g_free (data);
+}
+
+/* Returns the parsed metadata of the deployed version of @ref, which is
+ * empty if the deploy has no metadata. Looking up related refs of the
+ * installed refs needs this over and over, so we keep it around for as
+ * long as the same commit is deployed. */
+static GKeyFile *
+flatpak_dir_load_deployed_metakey (FlatpakDir        *self,
+                                   FlatpakDecomposed *ref,
+                                   GBytes           **out_deploy_data,
+                                   GCancellable      *cancellable,
+                                   GError           **error)
+{
+  g_autoptr(GBytes) deploy_data = NULL;
+  g_autoptr(GFile) deploy_dir = NULL;
+  g_autoptr(GFile) metadata_file = NULL;
+  g_autofree char *metadata_contents = NULL;
+  g_autoptr(GKeyFile) metakey = NULL;
+  const char *commit;
+  DeployedMetadata *cached;
+
+  deploy_data = flatpak_dir_get_deploy_data (self, ref, FLATPAK_DEPLOY_VERSION_ANY, cancellable, error);
+  if (deploy_data == NULL)
+    return NULL;
+
+  commit = flatpak_deploy_data_get_commit (deploy_data);
+
+  G_LOCK (deployed_metadata);
+  cached = self->deployed_metadata ? g_hash_table_lookup (self->deployed_metadata, flatpak_decomposed_get_ref (ref)) : NULL;
+  if (cached != NULL && strcmp (cached->commit, commit) == 0)
+    metakey = g_key_file_ref (cached->metakey);
+  G_UNLOCK (deployed_metadata);
+
+  if (metakey == NULL)
+    {
+      metakey = g_key_file_new ();
+
+      deploy_dir = flatpak_dir_get_if_deployed (self, ref, NULL, cancellable);
+      if (deploy_dir == NULL)
+        {
+          g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED,
+                       _("%s not installed"), flatpak_decomposed_get_ref (ref));
+          return NULL;
+        }
+
+      metadata_file = g_file_get_child (deploy_dir, "metadata");
+      if (!g_file_load_contents (metadata_file, cancellable, &metadata_contents, NULL, NULL, NULL) ||
+          !g_key_file_load_from_data (metakey, metadata_contents, -1, 0, NULL))
+        {
+          /* No metadata => no related, but no error */
+          g_info ("No metadata in local deploy");
+          g_clear_pointer (&metakey, g_key_file_unref);
+          metakey = g_key_file_new ();
+        }
+
+      cached = g_new0 (DeployedMetadata, 1);
+      cached->commit = g_strdup (commit);
+      cached->metakey = g_key_file_ref (metakey);
+
+      G_LOCK (deployed_metadata);
+      if (self->deployed_metadata == NULL)
+        self->deployed_metadata = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                         (GDestroyNotify) deployed_metadata_free);
+      g_hash_table_replace (self->deployed_metadata, g_strdup (flatpak_decomposed_get_ref (ref)), cached);
+      G_UNLOCK (deployed_metadata);
+    }
+
+  if (out_deploy_data)
+    *out_deploy_data = g_steal_pointer (&deploy_data);
+
+  return g_steal_pointer (&metakey);
+}
+
 GPtrArray *
 flatpak_dir_find_remote_related (FlatpakDir         *self,
                                  FlatpakRemoteState *state,
@@ -16929,7 +21728,7 @@ flatpak_dir_find_remote_related (FlatpakDir         *self,
                                  GError            **error)
 {
   g_autofree char *metadata = NULL;
-  g_autoptr(GKeyFile) metakey = g_key_file_new ();
+  g_autoptr(GKeyFile) metakey = NULL;
   g_autoptr(GPtrArray) related = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_related_free);
   g_autofree char *url = NULL;
 
@@ -16947,36 +21746,21 @@ flatpak_dir_find_remote_related (FlatpakDir         *self,
 
   if (use_installed_metadata)
     {
-      g_autoptr(GFile) deploy_dir = NULL;
-      g_autoptr(GBytes) deploy_data = NULL;
-      g_autoptr(GFile) metadata_file = NULL;
-
-      deploy_dir = flatpak_dir_get_if_deployed (self, ref, NULL, cancellable);
-      if (deploy_dir == NULL)
-        {
-          g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED,
-                       _("%s not installed"), flatpak_decomposed_get_ref (ref));
-          return NULL;
-        }
-
-      deploy_data = flatpak_load_deploy_data (deploy_dir, ref, self->repo, FLATPAK_DEPLOY_VERSION_ANY, cancellable, error);
-      if (deploy_data == NULL)
+      metakey = flatpak_dir_load_deployed_metakey (self, ref, NULL, cancellable, error);
+      if (metakey == NULL)
         return NULL;
-
-      metadata_file = g_file_get_child (deploy_dir, "metadata");
-      if (!g_file_load_contents (metadata_file, cancellable, &metadata, NULL, NULL, NULL))
-        {
-          g_info ("No metadata in local deploy");
-          /* No metadata => no related, but no error */
-        }
     }
-  else
-    flatpak_remote_state_load_data (state, flatpak_decomposed_get_ref (ref),
-                                    NULL, NULL, &metadata,
-                                    NULL);
+  else if (flatpak_remote_state_load_data (state, flatpak_decomposed_get_ref (ref),
+                                           NULL, NULL, &metadata,
+                                           NULL) &&
+           metadata != NULL)
+    {
+      metakey = g_key_file_new ();
+      if (!g_key_file_load_from_data (metakey, metadata, -1, 0, NULL))
+        g_clear_pointer (&metakey, g_key_file_unref);
+    }
 
-  if (metadata != NULL &&
-      g_key_file_load_from_data (metakey, metadata, -1, 0, NULL))
+  if (metakey != NULL)
     {
       g_ptr_array_unref (related);
       related = flatpak_dir_find_remote_related_for_metadata (self, state, ref, metakey, cancellable, error);
@@ -17229,11 +22013,9 @@ flatpak_dir_find_local_related (FlatpakDir        *self,
                                 GCancellable      *cancellable,
                                 GError           **error)
 {
-  g_autoptr(GFile) deploy_dir = NULL;
   g_autoptr(GBytes) deploy_data = NULL;
-  g_autoptr(GFile) metadata = NULL;
   g_autofree char *metadata_contents = NULL;
-  g_autoptr(GKeyFile) metakey = g_key_file_new ();
+  g_autoptr(GKeyFile) metakey = NULL;
   g_autoptr(GPtrArray) related = NULL;
 
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
@@ -17241,27 +22023,13 @@ flatpak_dir_find_local_related (FlatpakDir        *self,
 
   if (deployed)
     {
-      deploy_dir = flatpak_dir_get_if_deployed (self, ref, NULL, cancellable);
-      if (deploy_dir == NULL)
-        {
-          g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED,
-                       _("%s not installed"), flatpak_decomposed_get_ref (ref));
-          return NULL;
-        }
-
-      deploy_data = flatpak_load_deploy_data (deploy_dir, ref, self->repo, FLATPAK_DEPLOY_VERSION_ANY, cancellable, error);
-      if (deploy_data == NULL)
+      metakey = flatpak_dir_load_deployed_metakey (self, ref, &deploy_data, cancellable, error);
+      if (metakey == NULL)
         return NULL;
 
-      if (flatpak_deploy_data_get_extension_of (deploy_data) == NULL)
-        {
-          metadata = g_file_get_child (deploy_dir, "metadata");
-          if (!g_file_load_contents (metadata, cancellable, &metadata_contents, NULL, NULL, NULL))
-            {
-              g_info ("No metadata in local deploy");
-              /* No metadata => no related, but no error */
-            }
-        }
+      /* Extensions don't have related refs of their own */
+      if (flatpak_deploy_data_get_extension_of (deploy_data) != NULL)
+        g_clear_pointer (&metakey, g_key_file_unref);
     }
   else
     {
@@ -17274,10 +22042,16 @@ flatpak_dir_find_local_related (FlatpakDir        *self,
           if (metadata_contents == NULL)
             g_info ("No xa.metadata in local commit %s ref %s", checksum, flatpak_decomposed_get_ref (ref));
         }
+
+      if (metadata_contents)
+        {
+          metakey = g_key_file_new ();
+          if (!g_key_file_load_from_data (metakey, metadata_contents, -1, 0, NULL))
+            g_clear_pointer (&metakey, g_key_file_unref);
+        }
     }
 
-  if (metadata_contents &&
-      g_key_file_load_from_data (metakey, metadata_contents, -1, 0, NULL))
+  if (metakey)
     related = flatpak_dir_find_local_related_for_metadata (self, ref, remote_name, metakey, cancellable, error);
   else
     related = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_related_free);
@@ -17464,12 +22238,15 @@ static void
                      const char *commit,
                      const char *old_commit,
                      const char *url,
+                     GVariant   *metrics,
                      const char *format,
                      ...)
 {
 #ifdef HAVE_LIBSYSTEMD
   const char *installation;
   g_autofree char *subject = NULL;
+  g_autoptr(GPtrArray) fields = g_ptr_array_new_with_free_func (g_free);
+  g_autofree struct iovec *iov = NULL;
   char message[1024];
   int len;
   va_list args;
@@ -17490,23 +22267,61 @@ static void
   /* See systemd.journal-fields(7) for the meaning of the
    * standard fields we use, in particular OBJECT_PID
    */
-  sd_journal_send ("MESSAGE_ID=" FLATPAK_MESSAGE_ID,
-                   "PRIORITY=5",
-                   "SUBJECT=%s", subject,
-                   "CODE_FILE=%s", file,
-                   "CODE_LINE=%d", line,
-                   "CODE_FUNC=%s", func,
-                   "MESSAGE=%s", message,
-                   /* custom fields below */
-                   "FLATPAK_VERSION=" PACKAGE_VERSION,
-                   "INSTALLATION=%s", installation,
-                   "OPERATION=%s", change,
-                   "REMOTE=%s", remote ? remote : "",
-                   "REF=%s", ref ? ref : "",
-                   "COMMIT=%s", commit ? commit : "",
-                   "OLD_COMMIT=%s", old_commit ? old_commit : "",
-                   "URL=%s", url ? url : "",
-                   NULL);
+  g_ptr_array_add (fields, g_strdup ("MESSAGE_ID=" FLATPAK_MESSAGE_ID));
+  g_ptr_array_add (fields, g_strdup ("PRIORITY=5"));
+  g_ptr_array_add (fields, g_strdup_printf ("SUBJECT=%s", subject));
+  g_ptr_array_add (fields, g_strdup_printf ("CODE_FILE=%s", file));
+  g_ptr_array_add (fields, g_strdup_printf ("CODE_LINE=%d", line));
+  g_ptr_array_add (fields, g_strdup_printf ("CODE_FUNC=%s", func));
+  g_ptr_array_add (fields, g_strdup_printf ("MESSAGE=%s", message));
+  /* custom fields below */
+  g_ptr_array_add (fields, g_strdup ("FLATPAK_VERSION=" PACKAGE_VERSION));
+  g_ptr_array_add (fields, g_strdup_printf ("INSTALLATION=%s", installation));
+  g_ptr_array_add (fields, g_strdup_printf ("OPERATION=%s", change));
+  g_ptr_array_add (fields, g_strdup_printf ("REMOTE=%s", remote ? remote : ""));
+  g_ptr_array_add (fields, g_strdup_printf ("REF=%s", ref ? ref : ""));
+  g_ptr_array_add (fields, g_strdup_printf ("COMMIT=%s", commit ? commit : ""));
+  g_ptr_array_add (fields, g_strdup_printf ("OLD_COMMIT=%s", old_commit ? old_commit : ""));
+  g_ptr_array_add (fields, g_strdup_printf ("URL=%s", url ? url : ""));
+
+  /* Each metric "foo-bar" is logged as METRIC_FOO_BAR */
+  if (metrics != NULL)
+    {
+      GVariantIter iter;
+      const char *key;
+      GVariant *value;
+
+      g_variant_iter_init (&iter, metrics);
+      while (g_variant_iter_loop (&iter, "{&sv}", &key, &value))
+        {
+          g_autofree char *name = g_ascii_strup (key, -1);
+          g_autofree char *str = NULL;
+
+          g_strdelimit (name, "-", '_');
+
+          if (g_variant_is_of_type (value, G_VARIANT_TYPE_UINT64))
+            str = g_strdup_printf ("%" G_GUINT64_FORMAT, g_variant_get_uint64 (value));
+          else if (g_variant_is_of_type (value, G_VARIANT_TYPE_INT64))
+            str = g_strdup_printf ("%" G_GINT64_FORMAT, g_variant_get_int64 (value));
+          else if (g_variant_is_of_type (value, G_VARIANT_TYPE_UINT32))
+            str = g_strdup_printf ("%u", g_variant_get_uint32 (value));
+          else if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
+            str = g_variant_dup_string (value, NULL);
+          else
+            continue;
+
+          g_ptr_array_add (fields, g_strdup_printf ("METRIC_%s=%s", name, str));
+        }
+    }
+
+  iov = g_new (struct iovec, fields->len);
+  for (guint i = 0; i < fields->len; i++)
+    {
+      iov[i].iov_base = fields->pdata[i];
+      iov[i].iov_len = strlen (fields->pdata[i]);
+    }
+
+  sd_journal_sendv (iov, fields->len);
 #endif
 }
 
@@ -17597,45 +22412,46 @@ flatpak_dir_delete_mirror_refs (FlatpakDir    *self,
 }
 
 
-static gboolean
-dir_get_metadata (FlatpakDir        *dir,
-                  FlatpakDecomposed *ref,
-                  GKeyFile         **out_metakey)
+/* Returns the deploy metadata of @ref in @dir, which has its dependencies */
+static GVariant *
+dir_get_dependencies (FlatpakDir        *dir,
+                      FlatpakDecomposed *ref)
 {
-  g_autoptr(GFile) deploy_dir = NULL;
-  g_autoptr(GKeyFile) metakey = NULL;
-  g_autoptr(GFile) metadata = NULL;
-  g_autofree char *metadata_contents = NULL;
-  gsize metadata_size;
+  g_autoptr(GBytes) deploy_data = NULL;
+  g_autoptr(GVariant) deploy_variant = NULL;
 
-  deploy_dir = flatpak_dir_get_if_deployed (dir, ref, NULL, NULL);
-  if (deploy_dir == NULL)
-    return FALSE;
+  /* Served from the deployed index, unless it is out of date */
+  deploy_data = flatpak_dir_get_deploy_data (dir, ref, FLATPAK_DEPLOY_VERSION_CURRENT, NULL, NULL);
+  if (deploy_data == NULL)
+    return NULL;
 
-  metadata = g_file_get_child (deploy_dir, "metadata");
-  if (!g_file_load_contents (metadata, NULL, &metadata_contents, &metadata_size, NULL, NULL))
-    return FALSE;
+  deploy_variant = g_variant_ref_sink (g_variant_new_from_bytes (FLATPAK_DEPLOY_DATA_GVARIANT_FORMAT,
+                                                                 deploy_data, FALSE));
+  return g_variant_get_child_value (deploy_variant, 4);
+}
 
-  metakey = g_key_file_new ();
-  if (!g_key_file_load_from_data (metakey, metadata_contents, metadata_size, 0, NULL))
-    return FALSE;
+static GVariant *
+metakey_get_dependencies (GKeyFile *metakey)
+{
+  g_auto(GVariantDict) metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
 
-  *out_metakey = g_steal_pointer (&metakey);
+  g_variant_dict_init (&metadata_dict, NULL);
+  add_metadata_to_deploy_data (&metadata_dict, metakey);
 
-  return TRUE;
+  return g_variant_ref_sink (g_variant_dict_end (&metadata_dict));
 }
 
 static gboolean
-maybe_get_metakey (FlatpakDir        *dir,
-                   FlatpakDir        *shadowing_dir,
-                   FlatpakDecomposed *ref,
-                   GHashTable        *metadata_injection,
-                   GKeyFile         **out_metakey,
-                   gboolean          *out_ref_is_shadowed,
-                   char             **out_dir_name)
+maybe_get_dependencies (FlatpakDir        *dir,
+                        FlatpakDir        *shadowing_dir,
+                        FlatpakDecomposed *ref,
+                        GHashTable        *metadata_injection,
+                        GVariant         **out_dependencies,
+                        gboolean          *out_ref_is_shadowed,
+                        char             **out_dir_name)
 {
   if (shadowing_dir &&
-      dir_get_metadata (shadowing_dir, ref, out_metakey))
+      (*out_dependencies = dir_get_dependencies (shadowing_dir, ref)) != NULL)
     {
       *out_ref_is_shadowed = TRUE;
       *out_dir_name = g_strdup_printf (" (%s)", flatpak_dir_get_name_cached (shadowing_dir));
@@ -17648,13 +22464,13 @@ maybe_get_metakey (FlatpakDir        *dir,
       if (injected_metakey != NULL)
         {
           *out_ref_is_shadowed = FALSE;
-          *out_metakey = g_key_file_ref (injected_metakey);
+          *out_dependencies = metakey_get_dependencies (injected_metakey);
           *out_dir_name = g_strdup ("");
           return TRUE;
         }
     }
 
-  if (dir_get_metadata (dir, ref, out_metakey))
+  if ((*out_dependencies = dir_get_dependencies (dir, ref)) != NULL)
     {
       *out_ref_is_shadowed = FALSE;
       *out_dir_name = g_strdup_printf (" (%s)", flatpak_dir_get_name_cached (dir));
@@ -17680,6 +22496,85 @@ queue_ref_for_analysis (FlatpakDecomposed *ref,
   g_queue_push_tail (refs_to_analyze, ref); /* owned by analyzed_refs */
 }
 
+static void
+queue_dependency_for_analysis (FlatpakDecomposed *ref,
+                               const char        *kind_of_dependency,
+                               FlatpakDecomposed *dependency,
+                               const char        *dir_name,
+                               const char        *arch,
+                               GHashTable        *analyzed_refs,
+                               GQueue            *refs_to_analyze)
+{
+  if (dependency == NULL || flatpak_decomposed_equal (dependency, ref))
+    return;
+
+  g_debug ("%s: Considering %s %s used by %s%s",
+           G_STRFUNC, kind_of_dependency, flatpak_decomposed_get_ref (dependency),
+           flatpak_decomposed_get_ref (ref), dir_name);
+  queue_ref_for_analysis (dependency, arch, analyzed_refs, refs_to_analyze);
+}
+
+/* Finds the deployed runtimes matching an extension point, the same way
+ * as flatpak_dir_find_local_related_for_metadata() does when looking at
+ * deployed refs only. @deployed_runtimes is sorted by ref, so the
+ * subdirectory matches are a range of it. */
+static void
+find_deployed_extensions (GPtrArray  *deployed_runtimes,
+                          GHashTable *deployed_runtimes_set,
+                          const char *extension,
+                          const char *arch,
+                          const char *branch,
+                          gboolean    subdirectories,
+                          GPtrArray  *matches)
+{
+  g_autoptr(FlatpakDecomposed) extension_ref = NULL;
+  g_autofree char *id_prefix = NULL;
+  g_autofree char *ref_prefix = NULL;
+  guint lo, hi;
+
+  extension_ref = flatpak_decomposed_new_from_parts (FLATPAK_KINDS_RUNTIME, extension, arch, branch, NULL);
+  if (extension_ref == NULL)
+    return;
+
+  if (g_hash_table_contains (deployed_runtimes_set, extension_ref))
+    {
+      g_ptr_array_add (matches, g_steal_pointer (&extension_ref));
+      return;
+    }
+
+  if (!subdirectories)
+    return;
+
+  id_prefix = g_strconcat (extension, ".", NULL);
+  ref_prefix = g_strconcat ("runtime/", id_prefix, NULL);
+
+  lo = 0;
+  hi = deployed_runtimes->len;
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+      FlatpakDecomposed *to_test = g_ptr_array_index (deployed_runtimes, mid);
+
+      if (strcmp (flatpak_decomposed_get_ref (to_test), ref_prefix) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  for (; lo < deployed_runtimes->len; lo++)
+    {
+      FlatpakDecomposed *to_test = g_ptr_array_index (deployed_runtimes, lo);
+
+      if (!g_str_has_prefix (flatpak_decomposed_get_ref (to_test), ref_prefix))
+        break;
+
+      if (flatpak_decomposed_is_arch (to_test, arch) &&
+          flatpak_decomposed_is_branch (to_test, branch) &&
+          flatpak_decomposed_id_has_prefix (to_test, id_prefix))
+        g_ptr_array_add (matches, flatpak_decomposed_ref (to_test));
+    }
+}
+
 /* This traverses from all the "root" refs and into for any recursive dependencies in @self
  * that they use. In the regular case we just consider the @self installation,
  * but we can also handle the case where another directory "shadows" self. For example
@@ -17688,6 +22583,11 @@ queue_ref_for_analysis (FlatpakDecomposed *ref,
  * from there instead of @self. So, analyzed refs from @shadowing_dir are *not* put
  * in @used_ref (although their dependencies may).
  *
+ * The dependencies of each deployed ref are stored in its deploy data, and
+ * so in the deployed index, when it is deployed (see
+ * add_dependencies_to_deploy_data()). This makes the traversal a walk of
+ * that graph, without loading the metadata of every ref.
+ *
  * Notes:
  *  The "root" refs come from @shadowing_dir if not %NULL and @self otherwise.
  *  refs_to_exclude, and metadata_injection both only affect @self, not @shadowing_dir
@@ -17705,6 +22605,8 @@ find_used_refs (FlatpakDir         *self,
 {
   g_autoptr(GPtrArray) root_app_refs = NULL;
   g_autoptr(GPtrArray) root_runtime_refs = NULL;
+  g_autoptr(GPtrArray) deployed_runtimes = NULL;
+  g_autoptr(GHashTable) deployed_runtimes_set = NULL;
   g_autoptr(GHashTable) analyzed_refs = NULL;
   g_autoptr(GQueue) refs_to_analyze = NULL;
   FlatpakDir *root_ref_dir;
@@ -17752,6 +22654,23 @@ find_used_refs (FlatpakDir         *self,
         }
     }
 
+  /* Extensions are always looked up in @self */
+  if (root_ref_dir == self)
+    deployed_runtimes = g_ptr_array_ref (root_runtime_refs);
+  else
+    {
+      deployed_runtimes = flatpak_dir_list_refs (self, FLATPAK_KINDS_RUNTIME, cancellable, error);
+      if (deployed_runtimes == NULL)
+        return NULL;
+    }
+
+  /* The roots were already queued, so this can sort them in place */
+  g_ptr_array_sort (deployed_runtimes, (GCompareFunc)flatpak_decomposed_strcmp_p);
+
+  deployed_runtimes_set = g_hash_table_new ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal);
+  for (int i = 0; i < deployed_runtimes->len; i++)
+    g_hash_table_add (deployed_runtimes_set, g_ptr_array_index (deployed_runtimes, i));
+
   /* Any injected refs are considered used, because this is used by transaction
    * to emulate installing a new ref, and we never want the new ref:s dependencies
    * seem unused. */
@@ -17771,15 +22690,16 @@ find_used_refs (FlatpakDir         *self,
 
   while ((ref_to_analyze = g_queue_pop_head (refs_to_analyze)) != NULL)
     {
-      g_autoptr(GKeyFile) metakey = NULL;
+      g_autoptr(GVariant) dependencies = NULL;
+      g_autoptr(GVariant) extension_points = NULL;
       gboolean ref_is_shadowed;
-      gboolean is_app;
-      g_autoptr(GPtrArray) related = NULL;
-      g_autofree char *sdk = NULL;
+      g_autofree char *ref_arch = NULL;
+      g_autofree char *ref_branch = NULL;
       g_autofree char *dir_name = NULL;
+      const char *runtime, *sdk, *extra_data_runtime;
 
-      if (!maybe_get_metakey (self, shadowing_dir, ref_to_analyze, metadata_injection,
-                              &metakey, &ref_is_shadowed, &dir_name))
+      if (!maybe_get_dependencies (self, shadowing_dir, ref_to_analyze, metadata_injection,
+                                   &dependencies, &ref_is_shadowed, &dir_name))
         continue; /* Something used something we could not find, that is fine and happens for instance with sdk dependencies */
 
       if (!ref_is_shadowed)
@@ -17803,77 +22723,73 @@ find_used_refs (FlatpakDir         *self,
        * Find all dependencies and queue for analysis *
        ***********************************************/
 
-      is_app = flatpak_decomposed_is_app (ref_to_analyze);
-
       /* App directly depends on its runtime */
-      if (is_app)
+      if (flatpak_decomposed_is_app (ref_to_analyze) &&
+          g_variant_lookup (dependencies, "runtime", "&s", &runtime))
         {
-          g_autofree char *runtime = g_key_file_get_string (metakey, "Application", "runtime", NULL);
-          if (runtime)
-            {
-              g_autoptr(FlatpakDecomposed) runtime_ref = flatpak_decomposed_new_from_pref (FLATPAK_KINDS_RUNTIME, runtime, NULL);
-              if (runtime_ref && !flatpak_decomposed_equal (runtime_ref, ref_to_analyze))
-                {
-                  g_debug ("%s: Considering runtime %s used by app %s%s",
-                           G_STRFUNC, flatpak_decomposed_get_ref (runtime_ref),
-                           flatpak_decomposed_get_ref (ref_to_analyze), dir_name);
-                  queue_ref_for_analysis (runtime_ref, arch, analyzed_refs, refs_to_analyze);
-                }
-            }
+          g_autoptr(FlatpakDecomposed) runtime_ref = flatpak_decomposed_new_from_pref (FLATPAK_KINDS_RUNTIME, runtime, NULL);
+          queue_dependency_for_analysis (ref_to_analyze, "runtime", runtime_ref, dir_name,
+                                         arch, analyzed_refs, refs_to_analyze);
         }
 
       /* Both apps and runtimes directly depends on its sdk, to avoid suddenly
        * uninstalling something you use to develop the app */
-      sdk = g_key_file_get_string (metakey, is_app ? "Application" : "Runtime", "sdk", NULL);
-      if (sdk)
+      if (g_variant_lookup (dependencies, "sdk", "&s", &sdk))
         {
           g_autoptr(FlatpakDecomposed) sdk_ref = flatpak_decomposed_new_from_pref (FLATPAK_KINDS_RUNTIME, sdk, NULL);
-          if (sdk_ref && !flatpak_decomposed_equal (sdk_ref, ref_to_analyze))
-            {
-              g_debug ("%s: Considering sdk %s used by %s%s",
-                       G_STRFUNC, flatpak_decomposed_get_ref (sdk_ref),
-                       flatpak_decomposed_get_ref (ref_to_analyze), dir_name);
-              queue_ref_for_analysis (sdk_ref, arch, analyzed_refs, refs_to_analyze);
-            }
+          queue_dependency_for_analysis (ref_to_analyze, "sdk", sdk_ref, dir_name,
+                                         arch, analyzed_refs, refs_to_analyze);
         }
 
       /* Extensions with extra data, that are not specially marked NoRuntime needs the runtime at install.
        * Lets keep it around to not re-download it next update */
-      if (!is_app &&
-          g_key_file_has_group (metakey, "Extra Data") &&
-          !g_key_file_get_boolean (metakey, "Extra Data", "NoRuntime", NULL))
+      if (!flatpak_decomposed_is_app (ref_to_analyze) &&
+          g_variant_lookup (dependencies, "extra-data-runtime", "&s", &extra_data_runtime))
         {
-          g_autofree char *extension_runtime_ref = g_key_file_get_string (metakey, "ExtensionOf", "runtime", NULL);
-          if (extension_runtime_ref != NULL)
-            {
-              g_autoptr(FlatpakDecomposed) d = flatpak_decomposed_new_from_ref (extension_runtime_ref, NULL);
-              if (d)
-                {
-                  g_debug ("%s: Considering runtime %s used by extra-data %s%s",
-                           G_STRFUNC, flatpak_decomposed_get_ref (d),
-                           flatpak_decomposed_get_ref (ref_to_analyze), dir_name);
-                  queue_ref_for_analysis (d, arch, analyzed_refs, refs_to_analyze);
-                }
-            }
+          g_autoptr(FlatpakDecomposed) d = flatpak_decomposed_new_from_ref (extra_data_runtime, NULL);
+          queue_dependency_for_analysis (ref_to_analyze, "extra-data runtime", d, dir_name,
+                                         arch, analyzed_refs, refs_to_analyze);
         }
 
-      /* We pass NULL for remote-name here, because we want to consider related refs from all remotes */
-      related = flatpak_dir_find_local_related_for_metadata (self, ref_to_analyze,
-                                                             NULL, metakey, NULL, NULL);
-      for (int i = 0; related != NULL && i < related->len; i++)
+      /* Related refs are the deployed extensions, from any remote, that match
+       * the extension points */
+      extension_points = g_variant_lookup_value (dependencies, "extension-points", G_VARIANT_TYPE ("a(sasbs)"));
+      if (extension_points == NULL)
+        continue;
+
+      ref_arch = flatpak_decomposed_dup_arch (ref_to_analyze);
+      ref_branch = flatpak_decomposed_dup_branch (ref_to_analyze);
+
+      for (gsize i = 0; i < g_variant_n_children (extension_points); i++)
         {
-          FlatpakRelated *rel = g_ptr_array_index (related, i);
+          const char *extension, *autoprune_unless;
+          g_autofree const char **versions = NULL;
+          const char *default_branches[] = { ref_branch, NULL };
+          const char **branches;
+          gboolean subdirectories;
 
-          if (!rel->auto_prune)
-            {
-              g_debug ("%s: Considering related ref %s used by %s%s",
-                       G_STRFUNC, flatpak_decomposed_get_ref (rel->ref),
-                       flatpak_decomposed_get_ref (ref_to_analyze), dir_name);
-              queue_ref_for_analysis (rel->ref, arch, analyzed_refs, refs_to_analyze);
-            }
-          else
+          g_variant_get_child (extension_points, i, "(&s^a&sb&s)",
+                               &extension, &versions, &subdirectories, &autoprune_unless);
+          branches = (versions != NULL && versions[0] != NULL) ? versions : default_branches;
+
+          for (int branch_i = 0; branches[branch_i] != NULL; branch_i++)
             {
-              g_hash_table_add (autopruned_refs, flatpak_decomposed_ref (rel->ref));
+              g_autoptr(GPtrArray) matches = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_decomposed_unref);
+
+              find_deployed_extensions (deployed_runtimes, deployed_runtimes_set, extension,
+                                        ref_arch, branches[branch_i], subdirectories, matches);
+
+              for (guint j = 0; j < matches->len; j++)
+                {
+                  FlatpakDecomposed *match = g_ptr_array_index (matches, j);
+                  g_autofree char *id = flatpak_decomposed_dup_id (match);
+
+                  if (flatpak_extension_matches_reason (id, autoprune_unless, TRUE))
+                    queue_dependency_for_analysis (ref_to_analyze, "related ref", match, dir_name,
+                                                   arch, analyzed_refs, refs_to_analyze);
+                  else
+                    g_hash_table_add (autopruned_refs, flatpak_decomposed_ref (match));
+                }
             }
         }
     }
@@ -159,8 +159,21 @@ struct _FlatpakExports
   int                   host_fd;
   FlatpakFilesystemMode host_root;
   FlatpakExportsTestFlags test_flags;
+
+  /* The same ancestors get looked at for most of the exported paths,
+   * so remember what we found out about them: path -> file type,
+   * and symlink -> resolved target */
+  GHashTable           *file_types;
+  GHashTable           *resolved_links;
 };
 
+static void
+flatpak_exports_clear_host_caches (FlatpakExports *exports)
+{
+  g_hash_table_remove_all (exports->file_types);
+  g_hash_table_remove_all (exports->resolved_links);
+}
+
 /*
  * When populating /run/host, pretend @fd was the root of the host
  * filesystem.
@@ -173,6 +186,8 @@ flatpak_exports_take_host_fd (FlatpakExports *exports,
 
   if (fd >= 0)
     exports->host_fd = fd;
+
+  flatpak_exports_clear_host_caches (exports);
 }
 
 void
@@ -254,12 +269,10 @@ flatpak_exports_open_in_host (FlatpakExports *exports,
 }
 
 static char *
-flatpak_exports_resolve_link_in_host (FlatpakExports *exports,
-                                      const char *abs_path,
-                                      GError **error)
+flatpak_exports_resolve_link_in_host_uncached (FlatpakExports *exports,
+                                               const char *abs_path,
+                                               GError **error)
 {
-  g_return_val_if_fail (abs_path[0] == '/', FALSE);
-
   if (exports->host_fd >= 0)
     {
       g_autofree char *fd_path = g_strdup_printf ("/proc/self/fd/%d/",
@@ -279,6 +292,51 @@ flatpak_exports_resolve_link_in_host (FlatpakExports *exports,
   return flatpak_resolve_link (abs_path, error);
 }
 
+static char *
+flatpak_exports_resolve_link_in_host (FlatpakExports *exports,
+                                      const char *abs_path,
+                                      GError **error)
+{
+  const char *cached;
+  char *resolved;
+
+  g_return_val_if_fail (abs_path[0] == '/', FALSE);
+
+  cached = g_hash_table_lookup (exports->resolved_links, abs_path);
+  if (cached != NULL)
+    return g_strdup (cached);
+
+  /* Failures are not cached, they are rare and need the error */
+  resolved = flatpak_exports_resolve_link_in_host_uncached (exports, abs_path, error);
+  if (resolved != NULL)
+    g_hash_table_insert (exports->resolved_links, g_strdup (abs_path), g_strdup (resolved));
+
+  return resolved;
+}
+
+/* Returns the S_IFMT bits of @abs_path without following a final
+ * symlink, or 0 if it can't be stat'ed */
+static mode_t
+flatpak_exports_file_type_in_host (FlatpakExports *exports,
+                                   const char *abs_path)
+{
+  gpointer cached;
+  struct stat s;
+  mode_t type;
+
+  if (g_hash_table_lookup_extended (exports->file_types, abs_path, NULL, &cached))
+    return GPOINTER_TO_UINT (cached);
+
+  /* Missing paths are not cached, because context setup can create
+   * directories between two lookups */
+  if (!flatpak_exports_stat_in_host (exports, abs_path, &s, AT_SYMLINK_NOFOLLOW, NULL))
+    return 0;
+
+  type = s.st_mode & S_IFMT;
+  g_hash_table_insert (exports->file_types, g_strdup (abs_path), GUINT_TO_POINTER (type));
+  return type;
+}
+
 static void
 exported_path_free (ExportedPath *exported_path)
 {
@@ -292,6 +350,8 @@ flatpak_exports_new (void)
   FlatpakExports *exports = g_new0 (FlatpakExports, 1);
 
   exports->hash = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GFreeFunc) exported_path_free);
+  exports->file_types = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  exports->resolved_links = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   exports->host_fd = -1;
   return exports;
 }
@@ -301,6 +361,8 @@ flatpak_exports_free (FlatpakExports *exports)
 {
   glnx_close_fd (&exports->host_fd);
   g_hash_table_destroy (exports->hash);
+  g_hash_table_destroy (exports->file_types);
+  g_hash_table_destroy (exports->resolved_links);
   g_free (exports);
 }
 
@@ -391,24 +453,14 @@ static gboolean
 path_is_dir (FlatpakExports *exports,
              const char *path)
 {
-  struct stat s;
-
-  if (!flatpak_exports_stat_in_host (exports, path, &s, AT_SYMLINK_NOFOLLOW, NULL))
-    return FALSE;
-
-  return S_ISDIR (s.st_mode);
+  return S_ISDIR (flatpak_exports_file_type_in_host (exports, path));
 }
 
 static gboolean
 path_is_symlink (FlatpakExports *exports,
                  const char *path)
 {
-  struct stat s;
-
-  if (!flatpak_exports_stat_in_host (exports, path, &s, AT_SYMLINK_NOFOLLOW, NULL))
-    return FALSE;
-
-  return S_ISLNK (s.st_mode);
+  return S_ISLNK (flatpak_exports_file_type_in_host (exports, path));
 }
 
 /*
@@ -27,7 +27,9 @@ struct FlatpakImageCollection
 {
   GObject parent;
 
-  GPtrArray *sources;
+  GPtrArray  *sources;
+  GHashTable *sources_by_ref;
+  GHashTable *sources_by_digest;
 };
 
 typedef struct
@@ -44,6 +46,8 @@ flatpak_image_collection_finalize (GObject *object)
   FlatpakImageCollection *self = FLATPAK_IMAGE_COLLECTION (object);
 
   g_ptr_array_free (self->sources, TRUE);
+  g_hash_table_unref (self->sources_by_ref);
+  g_hash_table_unref (self->sources_by_digest);
 
   G_OBJECT_CLASS (flatpak_image_collection_parent_class)->finalize (object);
 }
@@ -60,6 +64,26 @@ static void
 flatpak_image_collection_init (FlatpakImageCollection *self)
 {
   self->sources = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+  /* These point into the sources array, which owns the sources and
+   * their strings */
+  self->sources_by_ref = g_hash_table_new (g_str_hash, g_str_equal);
+  self->sources_by_digest = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+static void
+add_source (FlatpakImageCollection *self,
+            FlatpakImageSource     *image_source)
+{
+  const char *ref = flatpak_image_source_get_ref (image_source);
+  const char *digest = flatpak_image_source_get_digest (image_source);
+
+  g_ptr_array_add (self->sources, image_source);
+
+  /* If there are duplicates, the first one wins */
+  if (ref != NULL && !g_hash_table_contains (self->sources_by_ref, ref))
+    g_hash_table_insert (self->sources_by_ref, (char *) ref, image_source);
+  if (!g_hash_table_contains (self->sources_by_digest, digest))
+    g_hash_table_insert (self->sources_by_digest, (char *) digest, image_source);
 }
 
 FlatpakImageCollection *
@@ -113,7 +137,7 @@ flatpak_image_collection_new (const char   *location,
           continue;
         }
 
-      g_ptr_array_add (self->sources, g_steal_pointer (&image_source));
+      add_source (self, g_steal_pointer (&image_source));
     }
 
   return g_steal_pointer (&self);
@@ -123,28 +147,18 @@ FlatpakImageSource *
 flatpak_image_collection_lookup_ref (FlatpakImageCollection *self,
                                      const char             *ref)
 {
-  for (guint i = 0; i < self->sources->len; i++)
-    {
-      FlatpakImageSource *source = g_ptr_array_index (self->sources, i);
-      if (strcmp (flatpak_image_source_get_ref (source), ref) == 0)
-        return g_object_ref (source);
-    }
+  FlatpakImageSource *source = g_hash_table_lookup (self->sources_by_ref, ref);
 
-  return NULL;
+  return source ? g_object_ref (source) : NULL;
 }
 
 FlatpakImageSource *
 flatpak_image_collection_lookup_digest (FlatpakImageCollection *self,
                                         const char             *digest)
 {
-  for (guint i = 0; i < self->sources->len; i++)
-    {
-      FlatpakImageSource *source = g_ptr_array_index (self->sources, i);
-      if (strcmp (flatpak_image_source_get_digest (source), digest) == 0)
-        return g_object_ref (source);
-    }
+  FlatpakImageSource *source = g_hash_table_lookup (self->sources_by_digest, digest);
 
-  return NULL;
+  return source ? g_object_ref (source) : NULL;
 }
 
 GPtrArray *
@@ -454,6 +454,9 @@ flatpak_image_source_build_commit_metadata (FlatpakImageSource *self,
   GHashTableIter iter;
   const char *key;
   const char *value;
+  gboolean have_installed_size = FALSE;
+  gboolean have_download_size = FALSE;
+  const char *size_str;
 
   g_hash_table_iter_init (&iter, labels);
   while (g_hash_table_iter_next (&iter, (gpointer *)&key, (gpointer *)&value))
@@ -467,6 +470,11 @@ flatpak_image_source_build_commit_metadata (FlatpakImageSource *self,
 
       key += strlen ("org.flatpak.commit-metadata.");
 
+      if (strcmp (key, "xa.installed-size") == 0)
+        have_installed_size = TRUE;
+      else if (strcmp (key, "xa.download-size") == 0)
+        have_download_size = TRUE;
+
       bin = g_base64_decode (value, &bin_len);
       data = g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE ("v"),
                                                           bin,
@@ -476,6 +484,31 @@ flatpak_image_source_build_commit_metadata (FlatpakImageSource *self,
                                                           bin));
       g_variant_builder_add (metadata_builder, "{s@v}", key, data);
     }
+
+  /* Images not made from a build-export commit may still have the sizes
+   * in labels, record them the same way so nothing has to walk the
+   * tree to find them later */
+  size_str = g_hash_table_lookup (labels, "org.flatpak.installed-size");
+  if (!have_installed_size && size_str != NULL)
+    g_variant_builder_add (metadata_builder, "{s@v}", "xa.installed-size",
+                           g_variant_new_variant (g_variant_new_uint64 (GUINT64_TO_BE (g_ascii_strtoull (size_str, NULL, 10)))));
+
+  if (!have_download_size)
+    {
+      guint64 download_size = 0;
+
+      size_str = g_hash_table_lookup (labels, "org.flatpak.download-size");
+      if (size_str != NULL)
+        download_size = g_ascii_strtoull (size_str, NULL, 10);
+      else
+        {
+          for (int i = 0; self->manifest->layers[i] != NULL; i++)
+            download_size += self->manifest->layers[i]->size;
+        }
+
+      g_variant_builder_add (metadata_builder, "{s@v}", "xa.download-size",
+                             g_variant_new_variant (g_variant_new_uint64 (GUINT64_TO_BE (download_size))));
+    }
 }
 
 GVariant *
@@ -0,0 +1,282 @@
+/* vi:set et sw=2 sts=2 cin cino=t0,f0,(0,{s,>2s,n-s,^-s,e-s:
+ * Copyright © 2025 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "flatpak-installation-monitor-private.h"
+#include "flatpak-installed-ref.h"
+#include "flatpak-ref.h"
+#include "flatpak-utils-private.h"
+
+/**
+ * SECTION:flatpak-installation-monitor
+ * @Title: FlatpakInstallationMonitor
+ * @Short_description: Structured change notifications for an installation
+ *
+ * A FlatpakInstallationMonitor watches a #FlatpakInstallation and emits
+ * #FlatpakInstallationMonitor::changes with the refs that were installed,
+ * uninstalled or updated, so that clients can update their state
+ * incrementally instead of listing all installed refs on every change.
+ *
+ * A transaction touches the installation once per operation. The monitor
+ * waits until the installation has been quiet for a moment before looking
+ * at what changed, so a transaction normally results in a single change
+ * set. Change sets are always relative to the previous one, so a long
+ * transaction that is reported in several change sets is still reported
+ * accurately.
+ *
+ * Use flatpak_installation_create_changes_monitor() to get one.
+ *
+ * The FlatpakInstallationMonitor api was added in Flatpak 1.19.0.
+ */
+
+/* How long the installation has to be unchanged before we report a change set */
+#define CHANGES_QUIET_PERIOD_MS 1000
+
+typedef struct _FlatpakInstallationMonitorPrivate FlatpakInstallationMonitorPrivate;
+
+struct _FlatpakInstallationMonitorPrivate
+{
+  FlatpakInstallation *installation;
+  GFileMonitor        *file_monitor;
+  GMainContext        *context;
+  GSource             *quiet_source;
+
+  /* The installed refs we last reported, ref -> FlatpakInstalledRef */
+  GHashTable          *installed;
+};
+
+enum {
+  CHANGES,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+G_DEFINE_TYPE_WITH_PRIVATE (FlatpakInstallationMonitor, flatpak_installation_monitor, G_TYPE_OBJECT)
+
+static void
+clear_quiet_source (FlatpakInstallationMonitor *self)
+{
+  FlatpakInstallationMonitorPrivate *priv = flatpak_installation_monitor_get_instance_private (self);
+
+  if (priv->quiet_source)
+    {
+      g_source_destroy (priv->quiet_source);
+      g_clear_pointer (&priv->quiet_source, g_source_unref);
+    }
+}
+
+static void
+flatpak_installation_monitor_finalize (GObject *object)
+{
+  FlatpakInstallationMonitor *self = FLATPAK_INSTALLATION_MONITOR (object);
+  FlatpakInstallationMonitorPrivate *priv = flatpak_installation_monitor_get_instance_private (self);
+
+  clear_quiet_source (self);
+
+  if (priv->file_monitor)
+    g_signal_handlers_disconnect_by_data (priv->file_monitor, self);
+  g_clear_object (&priv->file_monitor);
+  g_clear_object (&priv->installation);
+  g_clear_pointer (&priv->context, g_main_context_unref);
+  g_clear_pointer (&priv->installed, g_hash_table_unref);
+
+  G_OBJECT_CLASS (flatpak_installation_monitor_parent_class)->finalize (object);
+}
+
+static void
+flatpak_installation_monitor_class_init (FlatpakInstallationMonitorClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = flatpak_installation_monitor_finalize;
+
+  /**
+   * FlatpakInstallationMonitor::changes:
+   * @object: A #FlatpakInstallationMonitor
+   * @added: (element-type FlatpakInstalledRef): the refs that were installed
+   * @removed: (element-type FlatpakInstalledRef): the refs that were uninstalled,
+   *   as they were last reported
+   * @updated: (element-type FlatpakInstalledRef): the refs that were deployed
+   *   at a different commit
+   *
+   * Emitted in the thread-default main context the monitor was created in,
+   * when the refs installed in the installation changed. At least one of
+   * the arrays is non-empty.
+   *
+   * Since: 1.19.0
+   */
+  signals[CHANGES] =
+    g_signal_new ("changes",
+                  G_TYPE_FROM_CLASS (object_class),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL, NULL,
+                  NULL,
+                  G_TYPE_NONE, 3, G_TYPE_PTR_ARRAY, G_TYPE_PTR_ARRAY, G_TYPE_PTR_ARRAY);
+}
+
+static void
+flatpak_installation_monitor_init (FlatpakInstallationMonitor *self)
+{
+}
+
+static GHashTable *
+list_installed (FlatpakInstallationMonitor *self,
+                GCancellable               *cancellable,
+                GError                    **error)
+{
+  FlatpakInstallationMonitorPrivate *priv = flatpak_installation_monitor_get_instance_private (self);
+  g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(GHashTable) installed = NULL;
+
+  refs = flatpak_installation_list_installed_refs (priv->installation, cancellable, error);
+  if (refs == NULL)
+    return NULL;
+
+  installed = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_object_unref);
+  for (guint i = 0; i < refs->len; i++)
+    {
+      FlatpakRef *ref = g_ptr_array_index (refs, i);
+
+      /* The key is owned by the ref */
+      g_hash_table_replace (installed, (char *) flatpak_ref_format_ref_cached (ref), g_object_ref (ref));
+    }
+
+  return g_steal_pointer (&installed);
+}
+
+static gboolean
+report_changes_cb (gpointer user_data)
+{
+  FlatpakInstallationMonitor *self = user_data;
+  FlatpakInstallationMonitorPrivate *priv = flatpak_installation_monitor_get_instance_private (self);
+  g_autoptr(GHashTable) installed = NULL;
+  g_autoptr(GPtrArray) added = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GPtrArray) updated = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GError) local_error = NULL;
+
+  g_clear_pointer (&priv->quiet_source, g_source_unref);
+
+  installed = list_installed (self, NULL, &local_error);
+  if (installed == NULL)
+    {
+      g_info ("Failed to list installed refs for monitor: %s", local_error->message);
+      return G_SOURCE_REMOVE;
+    }
+
+  GLNX_HASH_TABLE_FOREACH_KV (installed, const char *, ref, FlatpakInstalledRef *, installed_ref)
+    {
+      FlatpakInstalledRef *old_ref = g_hash_table_lookup (priv->installed, ref);
+
+      if (old_ref == NULL)
+        g_ptr_array_add (added, g_object_ref (installed_ref));
+      else if (g_strcmp0 (flatpak_ref_get_commit (FLATPAK_REF (old_ref)),
+                          flatpak_ref_get_commit (FLATPAK_REF (installed_ref))) != 0)
+        g_ptr_array_add (updated, g_object_ref (installed_ref));
+    }
+
+  GLNX_HASH_TABLE_FOREACH_KV (priv->installed, const char *, ref, FlatpakInstalledRef *, old_ref)
+    {
+      if (!g_hash_table_contains (installed, ref))
+        g_ptr_array_add (removed, g_object_ref (old_ref));
+    }
+
+  g_hash_table_unref (priv->installed);
+  priv->installed = g_steal_pointer (&installed);
+
+  if (added->len > 0 || removed->len > 0 || updated->len > 0)
+    {
+      g_autoptr(FlatpakInstallationMonitor) self_ref = g_object_ref (self);
+
+      g_signal_emit (self, signals[CHANGES], 0, added, removed, updated);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+changed_cb (GFileMonitor      *file_monitor,
+            GFile             *file,
+            GFile             *other_file,
+            GFileMonitorEvent  event_type,
+            gpointer           user_data)
+{
+  FlatpakInstallationMonitor *self = user_data;
+  FlatpakInstallationMonitorPrivate *priv = flatpak_installation_monitor_get_instance_private (self);
+
+  /* Restart the quiet period on every change */
+  clear_quiet_source (self);
+
+  priv->quiet_source = g_timeout_source_new (CHANGES_QUIET_PERIOD_MS);
+  g_source_set_callback (priv->quiet_source, report_changes_cb, self, NULL);
+  g_source_attach (priv->quiet_source, priv->context);
+}
+
+FlatpakInstallationMonitor *
+flatpak_installation_monitor_new (FlatpakInstallation *installation,
+                                  GFile               *changed_file,
+                                  GCancellable        *cancellable,
+                                  GError             **error)
+{
+  g_autoptr(FlatpakInstallationMonitor) self = g_object_new (FLATPAK_TYPE_INSTALLATION_MONITOR, NULL);
+  FlatpakInstallationMonitorPrivate *priv = flatpak_installation_monitor_get_instance_private (self);
+
+  priv->installation = g_object_ref (installation);
+  priv->context = g_main_context_ref_thread_default ();
+
+  priv->file_monitor = g_file_monitor_file (changed_file, G_FILE_MONITOR_NONE,
+                                            cancellable, error);
+  if (priv->file_monitor == NULL)
+    return NULL;
+
+  /* Take the initial state after starting to monitor, so we don't miss anything */
+  priv->installed = list_installed (self, cancellable, error);
+  if (priv->installed == NULL)
+    return NULL;
+
+  g_signal_connect (priv->file_monitor, "changed", G_CALLBACK (changed_cb), self);
+
+  return g_steal_pointer (&self);
+}
+
+/**
+ * flatpak_installation_monitor_cancel:
+ * @self: a #FlatpakInstallationMonitor
+ *
+ * Stops monitoring the installation. No further
+ * #FlatpakInstallationMonitor::changes signals are emitted.
+ *
+ * Since: 1.19.0
+ */
+void
+flatpak_installation_monitor_cancel (FlatpakInstallationMonitor *self)
+{
+  FlatpakInstallationMonitorPrivate *priv = flatpak_installation_monitor_get_instance_private (self);
+
+  g_return_if_fail (FLATPAK_IS_INSTALLATION_MONITOR (self));
+
+  clear_quiet_source (self);
+
+  if (priv->file_monitor)
+    {
+      g_signal_handlers_disconnect_by_data (priv->file_monitor, self);
+      g_file_monitor_cancel (priv->file_monitor);
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright © 2025 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(__FLATPAK_H_INSIDE__) && !defined(FLATPAK_COMPILATION)
+#error "Only <flatpak.h> can be included directly."
+#endif
+
+#ifndef __FLATPAK_INSTALLATION_MONITOR_H__
+#define __FLATPAK_INSTALLATION_MONITOR_H__
+
+typedef struct _FlatpakInstallationMonitor FlatpakInstallationMonitor;
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define FLATPAK_TYPE_INSTALLATION_MONITOR flatpak_installation_monitor_get_type ()
+#define FLATPAK_INSTALLATION_MONITOR(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), FLATPAK_TYPE_INSTALLATION_MONITOR, FlatpakInstallationMonitor))
+#define FLATPAK_IS_INSTALLATION_MONITOR(obj) (G_TYPE_CHECK_INSTANCE_TYPE ((obj), FLATPAK_TYPE_INSTALLATION_MONITOR))
+
+FLATPAK_EXTERN GType flatpak_installation_monitor_get_type (void);
+
+struct _FlatpakInstallationMonitor
+{
+  GObject parent;
+};
+
+typedef struct
+{
+  GObjectClass parent_class;
+} FlatpakInstallationMonitorClass;
+
+
+#ifdef G_DEFINE_AUTOPTR_CLEANUP_FUNC
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakInstallationMonitor, g_object_unref)
+#endif
+
+FLATPAK_EXTERN void flatpak_installation_monitor_cancel (FlatpakInstallationMonitor *self);
+
+G_END_DECLS
+
+#endif /* __FLATPAK_INSTALLATION_MONITOR_H__ */
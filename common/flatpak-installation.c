@@ -30,6 +30,7 @@
 #include "flatpak-dir-private.h"
 #include "flatpak-enum-types.h"
 #include "flatpak-error.h"
+#include "flatpak-installation-monitor-private.h"
 #include "flatpak-installation-private.h"
 #include "flatpak-installation.h"
 #include "flatpak-installed-ref-private.h"
@@ -740,9 +741,7 @@ get_ref (FlatpakDir        *dir,
   g_autoptr(GBytes) deploy_data = NULL;
   g_autofree const char **subpaths = NULL;
   g_autofree char *collection_id = NULL;
-  g_autoptr(GHashTable) content_rating = NULL;
   gboolean is_current = FALSE;
-  guint64 installed_size = 0;
 
   deploy_data = flatpak_dir_get_deploy_data (dir, ref, FLATPAK_DEPLOY_VERSION_CURRENT, cancellable, error);
   if (deploy_data == NULL)
@@ -751,7 +750,6 @@ get_ref (FlatpakDir        *dir,
   commit = flatpak_deploy_data_get_commit (deploy_data);
   alt_id = flatpak_deploy_data_get_alt_id (deploy_data);
   subpaths = flatpak_deploy_data_get_subpaths (deploy_data);
-  installed_size = flatpak_deploy_data_get_installed_size (deploy_data);
 
   deploy_dir = flatpak_dir_get_deploy_dir (dir, ref);
   deploy_subdirname = flatpak_dir_get_deploy_subdir (dir, commit, subpaths);
@@ -769,23 +767,14 @@ get_ref (FlatpakDir        *dir,
   latest_commit = flatpak_dir_read_latest (dir, origin, flatpak_decomposed_get_ref (ref), &latest_alt_id, NULL, NULL);
 
   collection_id = flatpak_dir_get_remote_collection_id (dir, origin);
-  content_rating = flatpak_deploy_data_get_appdata_content_rating (deploy_data);
 
   return flatpak_installed_ref_new (ref,
                                     alt_id ? alt_id : commit,
                                     latest_alt_id ? latest_alt_id : latest_commit,
-                                    origin, collection_id, subpaths,
+                                    origin, collection_id,
                                     deploy_path,
-                                    installed_size,
                                     is_current,
-                                    flatpak_deploy_data_get_eol (deploy_data),
-                                    flatpak_deploy_data_get_eol_rebase (deploy_data),
-                                    flatpak_deploy_data_get_appdata_name (deploy_data),
-                                    flatpak_deploy_data_get_appdata_summary (deploy_data),
-                                    flatpak_deploy_data_get_appdata_version (deploy_data),
-                                    flatpak_deploy_data_get_appdata_license (deploy_data),
-                                    flatpak_deploy_data_get_appdata_content_rating_type (deploy_data),
-                                    content_rating);
+                                    deploy_data);
 }
 
 /**
@@ -997,9 +986,9 @@ end_of_lifed_with_rebase (FlatpakTransaction *transaction,
   return TRUE;
 }
 
-static gboolean
-transaction_ready (FlatpakTransaction  *transaction,
-                   GHashTable         **related_to_ops)
+static void
+collect_related_to_ops (FlatpakTransaction *transaction,
+                        GHashTable         *related_to_ops)
 {
   GList *ops = flatpak_transaction_get_operations (transaction);
 
@@ -1019,15 +1008,12 @@ transaction_ready (FlatpakTransaction  *transaction,
           continue;
         }
 
-      g_hash_table_insert (*related_to_ops,
+      g_hash_table_insert (related_to_ops,
                            g_object_ref (op),
                            op_related_to_ops ? g_ptr_array_ref (op_related_to_ops) : NULL);
     }
 
   g_list_free_full (ops, g_object_unref);
-
-  /* Abort the transaction; we only wanted to know what it would do */
-  return FALSE;
 }
 
 static gint
@@ -1081,8 +1067,8 @@ flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
   if (installed_refs == NULL)
     return NULL;
 
-  /* Here we use a FlatpakTransaction to determine what needs updating, and
-   * abort it before actually doing the updates. This ensures we are consistent
+  /* Here we use a FlatpakTransaction to determine what needs updating, but
+   * only resolve it rather than running it. This ensures we are consistent
    * with the CLI update command.
    */
   transaction = flatpak_transaction_new_for_installation (self, cancellable, error);
@@ -1121,16 +1107,12 @@ flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
   related_to_ops = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, null_safe_g_ptr_array_unref);
 
   g_signal_connect (transaction, "end-of-lifed-with-rebase", G_CALLBACK (end_of_lifed_with_rebase), &eol_rebase_refs);
-  g_signal_connect (transaction, "ready-pre-auth", G_CALLBACK (transaction_ready), &related_to_ops);
 
-  flatpak_transaction_run (transaction, cancellable, &local_error);
-  g_assert (local_error != NULL);
-  if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_ABORTED))
-    {
-      g_propagate_error (error, g_steal_pointer (&local_error));
-      return NULL;
-    }
-  g_clear_error (&local_error);
+  /* We only want to know what the transaction would do, so just resolve it */
+  if (!flatpak_transaction_resolve_for_update_check (transaction, cancellable, error))
+    return NULL;
+
+  collect_related_to_ops (transaction, related_to_ops);
 
   installed_refs_for_update = g_ptr_array_new_with_free_func (g_object_unref);
   installed_refs_for_update_set = g_hash_table_new (g_str_hash, g_str_equal);
@@ -2369,6 +2351,138 @@ flatpak_installation_fetch_remote_metadata_sync (FlatpakInstallation *self,
   return g_bytes_new_take (g_steal_pointer (&res), len);
 }
 
+/**
+ * flatpak_installation_fetch_remote_size_multiple_sync:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @refs: (element-type FlatpakRef): the refs
+ * @out_download_sizes: (out) (optional) (transfer full) (element-type guint64): return
+ *   location for the (maximum) download sizes
+ * @out_installed_sizes: (out) (optional) (transfer full) (element-type guint64): return
+ *   location for the installed sizes
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Like flatpak_installation_fetch_remote_size_sync(), but for several refs
+ * from the same remote at once. The remote is only loaded once, which makes
+ * this much cheaper than calling flatpak_installation_fetch_remote_size_sync()
+ * for each ref. The returned arrays have one element per ref in @refs, in
+ * the same order.
+ *
+ * Returns: %TRUE, unless an error occurred
+ *
+ * Since: 1.19.0
+ */
+gboolean
+flatpak_installation_fetch_remote_size_multiple_sync (FlatpakInstallation *self,
+                                                      const char          *remote_name,
+                                                      GPtrArray           *refs,
+                                                      GArray             **out_download_sizes,
+                                                      GArray             **out_installed_sizes,
+                                                      GCancellable        *cancellable,
+                                                      GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = NULL;
+  g_autoptr(FlatpakRemoteState) state = NULL;
+  g_autoptr(GArray) download_sizes = NULL;
+  g_autoptr(GArray) installed_sizes = NULL;
+
+  dir = flatpak_installation_get_dir (self, error);
+  if (dir == NULL)
+    return FALSE;
+
+  state = flatpak_dir_get_remote_state_optional (dir, remote_name, FALSE, cancellable, error);
+  if (state == NULL)
+    return FALSE;
+
+  download_sizes = g_array_sized_new (FALSE, FALSE, sizeof (guint64), refs->len);
+  installed_sizes = g_array_sized_new (FALSE, FALSE, sizeof (guint64), refs->len);
+
+  for (guint i = 0; i < refs->len; i++)
+    {
+      FlatpakRef *ref = g_ptr_array_index (refs, i);
+      guint64 download_size, installed_size;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      if (!flatpak_remote_state_load_data (state, flatpak_ref_format_ref_cached (ref),
+                                           &download_size, &installed_size, NULL,
+                                           error))
+        return FALSE;
+
+      g_array_append_val (download_sizes, download_size);
+      g_array_append_val (installed_sizes, installed_size);
+    }
+
+  if (out_download_sizes)
+    *out_download_sizes = g_steal_pointer (&download_sizes);
+  if (out_installed_sizes)
+    *out_installed_sizes = g_steal_pointer (&installed_sizes);
+
+  return TRUE;
+}
+
+/**
+ * flatpak_installation_fetch_remote_metadata_multiple_sync:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @refs: (element-type FlatpakRef): the refs
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Like flatpak_installation_fetch_remote_metadata_sync(), but for several
+ * refs from the same remote at once. The remote is only loaded once, which
+ * makes this much cheaper than calling
+ * flatpak_installation_fetch_remote_metadata_sync() for each ref.
+ *
+ * Returns: (transfer container) (element-type GBytes): the flatpak metadata
+ *   file of each ref in @refs, in the same order, or %NULL if an error occurred
+ *
+ * Since: 1.19.0
+ */
+GPtrArray *
+flatpak_installation_fetch_remote_metadata_multiple_sync (FlatpakInstallation *self,
+                                                          const char          *remote_name,
+                                                          GPtrArray           *refs,
+                                                          GCancellable        *cancellable,
+                                                          GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = NULL;
+  g_autoptr(FlatpakRemoteState) state = NULL;
+  g_autoptr(GPtrArray) metadatas = NULL;
+
+  dir = flatpak_installation_get_dir (self, error);
+  if (dir == NULL)
+    return NULL;
+
+  state = flatpak_dir_get_remote_state_optional (dir, remote_name, FALSE, cancellable, error);
+  if (state == NULL)
+    return NULL;
+
+  metadatas = g_ptr_array_new_full (refs->len, (GDestroyNotify) g_bytes_unref);
+
+  for (guint i = 0; i < refs->len; i++)
+    {
+      FlatpakRef *ref = g_ptr_array_index (refs, i);
+      g_autofree char *res = NULL;
+      gsize len;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return NULL;
+
+      if (!flatpak_remote_state_load_data (state, flatpak_ref_format_ref_cached (ref),
+                                           NULL, NULL, &res,
+                                           error))
+        return NULL;
+
+      len = strlen (res);
+      g_ptr_array_add (metadatas, g_bytes_new_take (g_steal_pointer (&res), len));
+    }
+
+  return g_steal_pointer (&metadatas);
+}
+
 /**
  * flatpak_installation_list_remote_refs_sync:
  * @self: a #FlatpakInstallation
@@ -2675,6 +2789,38 @@ flatpak_installation_create_monitor (FlatpakInstallation *self,
                               cancellable, error);
 }
 
+/**
+ * flatpak_installation_create_changes_monitor:
+ * @self: a #FlatpakInstallation
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Gets a monitor for the installation that reports which refs were
+ * installed, uninstalled or updated, coalescing the changes made by a
+ * transaction. Unlike flatpak_installation_create_monitor(), this lets
+ * clients update their state incrementally instead of listing all the
+ * installed refs on every change.
+ *
+ * The #FlatpakInstallationMonitor::changes signal is emitted in the
+ * thread-default main context of the caller.
+ *
+ * Returns: (transfer full): a new #FlatpakInstallationMonitor instance, or %NULL on error
+ *
+ * Since: 1.19.0
+ */
+FlatpakInstallationMonitor *
+flatpak_installation_create_changes_monitor (FlatpakInstallation *self,
+                                             GCancellable        *cancellable,
+                                             GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir_maybe_no_repo (self);
+  g_autoptr(GFile) path = NULL;
+
+  path = flatpak_dir_get_changed_path (dir);
+
+  return flatpak_installation_monitor_new (self, path, cancellable, error);
+}
+
 /**
  * flatpak_installation_get_timestamp:
  * @self: a #FlatpakInstallation
@@ -29,6 +29,7 @@ typedef struct _FlatpakInstallation FlatpakInstallation;
 
 #include <gio/gio.h>
 #include <flatpak-installed-ref.h>
+#include <flatpak-installation-monitor.h>
 #include <flatpak-instance.h>
 #include <flatpak-remote.h>
 
@@ -236,6 +237,9 @@ FLATPAK_EXTERN gboolean             flatpak_installation_launch_full (FlatpakIns
 FLATPAK_EXTERN GFileMonitor        *flatpak_installation_create_monitor (FlatpakInstallation *self,
                                                                          GCancellable        *cancellable,
                                                                          GError             **error);
+FLATPAK_EXTERN FlatpakInstallationMonitor *flatpak_installation_create_changes_monitor (FlatpakInstallation *self,
+                                                                                        GCancellable        *cancellable,
+                                                                                        GError             **error);
 FLATPAK_EXTERN guint64              flatpak_installation_get_timestamp (FlatpakInstallation *self);
 FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs (FlatpakInstallation *self,
                                                                               GCancellable        *cancellable,
@@ -416,6 +420,18 @@ FLATPAK_EXTERN GBytes        *   flatpak_installation_fetch_remote_metadata_sync
                                                                                   FlatpakRef          *ref,
                                                                                   GCancellable        *cancellable,
                                                                                   GError             **error);
+FLATPAK_EXTERN gboolean          flatpak_installation_fetch_remote_size_multiple_sync (FlatpakInstallation *self,
+                                                                                       const char          *remote_name,
+                                                                                       GPtrArray           *refs,
+                                                                                       GArray             **out_download_sizes,
+                                                                                       GArray             **out_installed_sizes,
+                                                                                       GCancellable        *cancellable,
+                                                                                       GError             **error);
+FLATPAK_EXTERN GPtrArray    *    flatpak_installation_fetch_remote_metadata_multiple_sync (FlatpakInstallation *self,
+                                                                                           const char          *remote_name,
+                                                                                           GPtrArray           *refs,
+                                                                                           GCancellable        *cancellable,
+                                                                                           GError             **error);
 FLATPAK_EXTERN GPtrArray    *    flatpak_installation_list_remote_refs_sync (FlatpakInstallation *self,
                                                                              const char          *remote_or_uri,
                                                                              GCancellable        *cancellable,
@@ -55,6 +55,11 @@ struct _FlatpakInstalledRefPrivate
   char    *appdata_license;
   char    *appdata_content_rating_type;
   GHashTable *appdata_content_rating;  /* (element-type interned-utf8 interned-utf8) */
+  gboolean appdata_content_rating_set;
+
+  /* The end-of-life and appdata fields that weren't set explicitly are
+   * read from here when asked for */
+  GBytes  *deploy_data;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (FlatpakInstalledRef, flatpak_installed_ref, FLATPAK_TYPE_REF)
@@ -96,6 +101,7 @@ flatpak_installed_ref_finalize (GObject *object)
   g_free (priv->appdata_license);
   g_free (priv->appdata_content_rating_type);
   g_clear_pointer (&priv->appdata_content_rating, g_hash_table_unref);
+  g_clear_pointer (&priv->deploy_data, g_bytes_unref);
 
   G_OBJECT_CLASS (flatpak_installed_ref_parent_class)->finalize (object);
 }
@@ -177,6 +183,7 @@ flatpak_installed_ref_set_property (GObject      *object,
     case PROP_APPDATA_CONTENT_RATING:
       g_clear_pointer (&priv->appdata_content_rating, g_hash_table_unref);
       priv->appdata_content_rating = g_value_dup_boxed (value);
+      priv->appdata_content_rating_set = TRUE;
       break;
 
     default:
@@ -221,35 +228,35 @@ flatpak_installed_ref_get_property (GObject    *object,
       break;
 
     case PROP_EOL:
-      g_value_set_string (value, priv->eol);
+      g_value_set_string (value, flatpak_installed_ref_get_eol (self));
       break;
 
     case PROP_EOL_REBASE:
-      g_value_set_string (value, priv->eol_rebase);
+      g_value_set_string (value, flatpak_installed_ref_get_eol_rebase (self));
       break;
 
     case PROP_APPDATA_NAME:
-      g_value_set_string (value, priv->appdata_name);
+      g_value_set_string (value, flatpak_installed_ref_get_appdata_name (self));
       break;
 
     case PROP_APPDATA_SUMMARY:
-      g_value_set_string (value, priv->appdata_summary);
+      g_value_set_string (value, flatpak_installed_ref_get_appdata_summary (self));
       break;
 
     case PROP_APPDATA_VERSION:
-      g_value_set_string (value, priv->appdata_version);
+      g_value_set_string (value, flatpak_installed_ref_get_appdata_version (self));
       break;
 
     case PROP_APPDATA_LICENSE:
-      g_value_set_string (value, priv->appdata_license);
+      g_value_set_string (value, flatpak_installed_ref_get_appdata_license (self));
       break;
 
     case PROP_APPDATA_CONTENT_RATING_TYPE:
-      g_value_set_string (value, priv->appdata_content_rating_type);
+      g_value_set_string (value, flatpak_installed_ref_get_appdata_content_rating_type (self));
       break;
 
     case PROP_APPDATA_CONTENT_RATING:
-      g_value_set_boxed (value, priv->appdata_content_rating);
+      g_value_set_boxed (value, flatpak_installed_ref_get_appdata_content_rating (self));
       break;
 
     default:
@@ -557,6 +564,9 @@ flatpak_installed_ref_get_eol (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
+  if (priv->eol == NULL && priv->deploy_data != NULL)
+    return flatpak_deploy_data_get_eol (priv->deploy_data);
+
   return priv->eol;
 }
 
@@ -574,6 +584,9 @@ flatpak_installed_ref_get_eol_rebase (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
+  if (priv->eol_rebase == NULL && priv->deploy_data != NULL)
+    return flatpak_deploy_data_get_eol_rebase (priv->deploy_data);
+
   return priv->eol_rebase;
 }
 
@@ -594,6 +607,9 @@ flatpak_installed_ref_get_appdata_name (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
+  if (priv->appdata_name == NULL && priv->deploy_data != NULL)
+    return flatpak_deploy_data_get_appdata_name (priv->deploy_data);
+
   return priv->appdata_name;
 }
 
@@ -614,6 +630,9 @@ flatpak_installed_ref_get_appdata_summary (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
+  if (priv->appdata_summary == NULL && priv->deploy_data != NULL)
+    return flatpak_deploy_data_get_appdata_summary (priv->deploy_data);
+
   return priv->appdata_summary;
 }
 
@@ -632,6 +651,9 @@ flatpak_installed_ref_get_appdata_version (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
+  if (priv->appdata_version == NULL && priv->deploy_data != NULL)
+    return flatpak_deploy_data_get_appdata_version (priv->deploy_data);
+
   return priv->appdata_version;
 }
 
@@ -650,6 +672,9 @@ flatpak_installed_ref_get_appdata_license (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
+  if (priv->appdata_license == NULL && priv->deploy_data != NULL)
+    return flatpak_deploy_data_get_appdata_license (priv->deploy_data);
+
   return priv->appdata_license;
 }
 
@@ -669,6 +694,9 @@ flatpak_installed_ref_get_appdata_content_rating_type (FlatpakInstalledRef *self
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
+  if (priv->appdata_content_rating_type == NULL && priv->deploy_data != NULL)
+    return flatpak_deploy_data_get_appdata_content_rating_type (priv->deploy_data);
+
   return priv->appdata_content_rating_type;
 }
 
@@ -691,6 +719,12 @@ flatpak_installed_ref_get_appdata_content_rating (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
+  if (!priv->appdata_content_rating_set && priv->deploy_data != NULL)
+    {
+      priv->appdata_content_rating = flatpak_deploy_data_get_appdata_content_rating (priv->deploy_data);
+      priv->appdata_content_rating_set = TRUE;
+    }
+
   return priv->appdata_content_rating;
 }
 
@@ -700,24 +734,19 @@ flatpak_installed_ref_new (FlatpakDecomposed *decomposed,
                            const char  *latest_commit,
                            const char  *origin,
                            const char  *collection_id,
-                           const char **subpaths,
                            const char  *deploy_dir,
-                           guint64      installed_size,
                            gboolean     is_current,
-                           const char  *eol,
-                           const char  *eol_rebase,
-                           const char  *appdata_name,
-                           const char  *appdata_summary,
-                           const char  *appdata_version,
-                           const char  *appdata_license,
-                           const char  *appdata_content_rating_type,
-                           GHashTable  *appdata_content_rating)
+                           GBytes      *deploy_data)
 {
   FlatpakInstalledRef *ref;
+  FlatpakInstalledRefPrivate *priv;
+  g_autofree const char **subpaths = NULL;
+
+  subpaths = flatpak_deploy_data_get_subpaths (deploy_data);
 
   /* Canonicalize the "no subpaths" case */
   if (subpaths && *subpaths == NULL)
-    subpaths = NULL;
+    g_clear_pointer (&subpaths, g_free);
 
   ref = g_object_new (FLATPAK_TYPE_INSTALLED_REF,
                       "kind", flatpak_decomposed_get_kind (decomposed),
@@ -730,17 +759,14 @@ flatpak_installed_ref_new (FlatpakDecomposed *decomposed,
                       "collection-id", collection_id,
                       "subpaths", subpaths,
                       "is-current", is_current,
-                      "installed-size", installed_size,
+                      "installed-size", flatpak_deploy_data_get_installed_size (deploy_data),
                       "deploy-dir", deploy_dir,
-                      "end-of-life", eol,
-                      "end-of-life-rebase", eol_rebase,
-                      "appdata-name", appdata_name,
-                      "appdata-summary", appdata_summary,
-                      "appdata-version", appdata_version,
-                      "appdata-license", appdata_license,
-                      "appdata-content-rating-type", appdata_content_rating_type,
-                      "appdata-content-rating", appdata_content_rating,
                       NULL);
 
+  /* Most users only look at the ref, commit and size, so rather than
+   * copying the end-of-life and appdata fields, keep the deploy data */
+  priv = flatpak_installed_ref_get_instance_private (ref);
+  priv->deploy_data = g_bytes_ref (deploy_data);
+
   return ref;
 }
@@ -62,5 +62,7 @@ gboolean flatpak_instance_ensure_per_app_xdg_runtime_dir (const char *app_id,
 
 GStrv flatpak_instance_get_run_environ (FlatpakInstance *self, GError **error);
 
+int flatpak_instance_get_pidfd (FlatpakInstance *self);
+
 
 #endif /* __FLATPAK_INSTANCE_PRIVATE_H__ */
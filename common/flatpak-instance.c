@@ -20,8 +20,11 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 
 #include "flatpak-json-backports-private.h"
 #include "flatpak-metadata-private.h"
@@ -30,6 +33,7 @@
 #include "flatpak-instance.h"
 #include "flatpak-instance-private.h"
 #include "flatpak-enum-types.h"
+#include "flatpak-syscalls-private.h"
 
 #include <glib/gi18n-lib.h>
 
@@ -63,6 +67,8 @@ struct _FlatpakInstancePrivate
   char     *dir;
   char     *private_dir;
 
+  /* Loaded on demand, as e.g. "flatpak ps" doesn't need all of it */
+  gboolean  info_loaded;
   GKeyFile *info;
   char     *app;
   char     *arch;
@@ -73,10 +79,17 @@ struct _FlatpakInstancePrivate
 
   int       pid;
   int       child_pid;
+
+  /* A pidfd for pid, opened on demand, or -1 */
+  int       pidfd;
+  gboolean  pidfd_tried;
+  gboolean  exited; /* Found to have exited when opening the pidfd */
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (FlatpakInstance, flatpak_instance, G_TYPE_OBJECT)
 
+static void flatpak_instance_ensure_info (FlatpakInstance *self);
+
 static void
 flatpak_instance_finalize (GObject *object)
 {
@@ -96,6 +109,8 @@ flatpak_instance_finalize (GObject *object)
   if (priv->info)
     g_key_file_unref (priv->info);
 
+  glnx_close_fd (&priv->pidfd);
+
   G_OBJECT_CLASS (flatpak_instance_parent_class)->finalize (object);
 }
 
@@ -110,6 +125,9 @@ flatpak_instance_class_init (FlatpakInstanceClass *klass)
 static void
 flatpak_instance_init (FlatpakInstance *self)
 {
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  priv->pidfd = -1;
 }
 
 /**
@@ -148,6 +166,8 @@ flatpak_instance_get_app (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  flatpak_instance_ensure_info (self);
+
   return priv->app;
 }
 
@@ -166,6 +186,8 @@ flatpak_instance_get_arch (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  flatpak_instance_ensure_info (self);
+
   return priv->arch;
 }
 
@@ -184,6 +206,8 @@ flatpak_instance_get_branch (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  flatpak_instance_ensure_info (self);
+
   return priv->branch;
 }
 
@@ -202,6 +226,8 @@ flatpak_instance_get_commit (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  flatpak_instance_ensure_info (self);
+
   return priv->commit;
 }
 
@@ -220,6 +246,8 @@ flatpak_instance_get_runtime (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  flatpak_instance_ensure_info (self);
+
   return priv->runtime;
 }
 
@@ -238,6 +266,8 @@ flatpak_instance_get_runtime_commit (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  flatpak_instance_ensure_info (self);
+
   return priv->runtime_commit;
 }
 
@@ -310,6 +340,8 @@ flatpak_instance_get_info (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
+  flatpak_instance_ensure_info (self);
+
   return priv->info;
 }
 
@@ -341,6 +373,17 @@ get_instance_info (const char *dir)
   g_autoptr(GKeyFile) key_file = NULL;
   g_autoptr(GError) error = NULL;
 
+  file = g_build_filename (dir, "info.variant", NULL);
+  key_file = flatpak_keyfile_load_variant_file (file, &error);
+  if (key_file != NULL)
+    return g_steal_pointer (&key_file);
+
+  /* Written by older versions, or we failed to write it */
+  if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+    g_info ("Failed to load instance info file '%s': %s", file, error->message);
+  g_clear_error (&error);
+  g_clear_pointer (&file, g_free);
+
   file = g_build_filename (dir, "info", NULL);
 
   key_file = g_key_file_new ();
@@ -409,18 +452,15 @@ get_pid (const char *dir)
   return (int) g_ascii_strtoll (contents, NULL, 10);
 }
 
-FlatpakInstance *
-flatpak_instance_new (const char *dir)
+static void
+flatpak_instance_ensure_info (FlatpakInstance *self)
 {
-  FlatpakInstance *self = g_object_new (flatpak_instance_get_type (), NULL);
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
 
-  priv->dir = g_strdup (dir);
-  priv->private_dir = g_strdup_printf ("%s-private", dir);
-  priv->id = g_path_get_basename (dir);
+  if (priv->info_loaded)
+    return;
 
-  priv->pid = get_pid (priv->dir);
-  priv->child_pid = get_child_pid (priv->dir);
+  priv->info_loaded = TRUE;
   priv->info = get_instance_info (priv->dir);
 
   if (priv->info)
@@ -447,6 +487,22 @@ flatpak_instance_new (const char *dir)
       priv->runtime_commit = g_key_file_get_string (priv->info,
                                                     FLATPAK_METADATA_GROUP_INSTANCE, FLATPAK_METADATA_KEY_RUNTIME_COMMIT, NULL);
     }
+}
+
+/* Only the pid is read here. The info and the child pid are read when
+ * first needed, so listing instances doesn't parse files for data that
+ * is never looked at. */
+FlatpakInstance *
+flatpak_instance_new (const char *dir)
+{
+  FlatpakInstance *self = g_object_new (flatpak_instance_get_type (), NULL);
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+
+  priv->dir = g_strdup (dir);
+  priv->private_dir = g_strdup_printf ("%s-private", dir);
+  priv->id = g_path_get_basename (dir);
+
+  priv->pid = get_pid (priv->dir);
 
   return self;
 }
@@ -758,6 +814,36 @@ flatpak_instance_create_lock_file (const char *instance_dir)
   return g_steal_fd (&lock_fd);
 }
 
+/* Launching only garbage-collects stale instances if this long has
+ * passed since the last time, so that its cost doesn't grow with the
+ * number of instances. Listing instances always does it. */
+#define INSTANCE_GC_INTERVAL_SECS 60
+#define INSTANCE_GC_STAMP ".gc-stamp"
+
+static gboolean
+instance_gc_is_due (const char *base_dir)
+{
+  g_autofree char *stamp = g_build_filename (base_dir, INSTANCE_GC_STAMP, NULL);
+  glnx_autofd int fd = -1;
+  struct stat statbuf;
+
+  fd = open (stamp, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+  if (fd == -1 || fstat (fd, &statbuf) != 0)
+    return TRUE;
+
+  /* A freshly created stamp has an mtime of now, so also check the size */
+  if (statbuf.st_size != 0 &&
+      statbuf.st_mtime + INSTANCE_GC_INTERVAL_SECS > time (NULL))
+    return FALSE;
+
+  if (statbuf.st_size == 0)
+    (void) glnx_loop_write (fd, "\n", 1);
+  else
+    (void) futimens (fd, NULL);
+
+  return TRUE;
+}
+
 /*
  * @host_dir_out: (not optional): used to return the directory on the host
  *  system representing this instance
@@ -782,7 +868,8 @@ flatpak_instance_allocate_id (char **host_dir_out,
   if (g_mkdir_with_parents (base_dir, 0755) != 0)
     return NULL;
 
-  flatpak_instance_iterate_all_and_gc (NULL);
+  if (instance_gc_is_due (base_dir))
+    flatpak_instance_iterate_all_and_gc (NULL);
 
   for (count = 0; count < 1000; count++)
     {
@@ -1184,6 +1271,74 @@ flatpak_instance_get_all (void)
   return g_steal_pointer (&instances);
 }
 
+/* Returns TRUE if someone (normally bwrap) still holds the read lock on
+ * the .ref file of the instance, which means it is in use */
+static gboolean
+instance_lock_is_held (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+  g_autofree char *ref_file = g_build_filename (priv->dir, ".ref", NULL);
+  glnx_autofd int lock_fd = -1;
+  struct flock l = {
+    .l_type = F_WRLCK,
+    .l_whence = SEEK_SET,
+    .l_start = 0,
+    .l_len = 0
+  };
+
+  lock_fd = open (ref_file, O_RDWR | O_CLOEXEC);
+  if (lock_fd == -1 || fcntl (lock_fd, F_GETLK, &l) != 0)
+    return FALSE;
+
+  return l.l_type != F_UNLCK;
+}
+
+/*
+ * flatpak_instance_get_pidfd:
+ * @self: a #FlatpakInstance
+ *
+ * Gets a pidfd for the outermost process of the instance, which becomes
+ * readable when the sandbox exits, so it can be polled instead of
+ * probing the pid repeatedly.
+ *
+ * Returns: a pidfd owned by @self, or -1 if the kernel doesn't support
+ *  pidfds or the instance is no longer running
+ */
+int
+flatpak_instance_get_pidfd (FlatpakInstance *self)
+{
+  FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+  glnx_autofd int pidfd = -1;
+
+  if (priv->pidfd_tried)
+    return priv->pidfd;
+
+  priv->pidfd_tried = TRUE;
+
+  if (priv->pid <= 0)
+    return -1;
+
+  pidfd = syscall (__NR_pidfd_open, priv->pid, 0);
+  if (pidfd < 0)
+    {
+      if (errno != ENOSYS)
+        g_info ("Failed to open pidfd for instance %s: %s", priv->id, g_strerror (errno));
+      return -1;
+    }
+
+  /* The pid might have been reused after the instance exited, but if the
+   * instance lock is still held once we have the pidfd, then the process
+   * it refers to is the one that was started for the instance. */
+  if (!instance_lock_is_held (self))
+    {
+      priv->exited = TRUE;
+      return -1;
+    }
+
+  priv->pidfd = g_steal_fd (&pidfd);
+  return priv->pidfd;
+}
+
 /**
  * flatpak_instance_is_running:
  * @self: a #FlatpakInstance
@@ -1196,6 +1351,19 @@ gboolean
 flatpak_instance_is_running (FlatpakInstance *self)
 {
   FlatpakInstancePrivate *priv = flatpak_instance_get_instance_private (self);
+  int pidfd;
+
+  pidfd = flatpak_instance_get_pidfd (self);
+  if (priv->exited)
+    return FALSE;
+
+  if (pidfd >= 0)
+    {
+      struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+
+      /* The pidfd becomes readable when the process exits */
+      return poll (&pfd, 1, 0) == 0;
+    }
 
   if (kill (priv->pid, 0) == 0)
     return TRUE;
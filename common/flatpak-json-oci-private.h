@@ -36,6 +36,10 @@ G_BEGIN_DECLS
 
 #define FLATPAK_OCI_SIGNATURE_TYPE_FLATPAK "flatpak oci image signature"
 
+/* Layer annotations for zstd:chunked layers, as created by containers/storage */
+#define FLATPAK_OCI_ANNOTATION_ZSTD_CHUNKED_MANIFEST_CHECKSUM "io.github.containers.zstd-chunked.manifest-checksum"
+#define FLATPAK_OCI_ANNOTATION_ZSTD_CHUNKED_MANIFEST_POSITION "io.github.containers.zstd-chunked.manifest-position"
+
 const char * flatpak_arch_to_oci_arch (const char *flatpak_arch);
 void flatpak_oci_export_labels (GHashTable *source,
                                 GHashTable *dest);
@@ -335,4 +339,42 @@ struct _FlatpakOciIndexResponseClass
   FlatpakJsonClass parent_class;
 };
 
+/* FlatpakOciZstdChunkedToc is the table of contents of a zstd:chunked
+ * layer. Each file is compressed into separate zstd frames, at the given
+ * offsets in the layer blob, so they can be fetched individually. See:
+ * https://github.com/containers/storage/blob/main/docs/containers-storage-zstd-chunked.md
+ */
+
+#define FLATPAK_TYPE_OCI_ZSTD_CHUNKED_TOC flatpak_oci_zstd_chunked_toc_get_type ()
+G_DECLARE_FINAL_TYPE (FlatpakOciZstdChunkedToc, flatpak_oci_zstd_chunked_toc, FLATPAK, OCI_ZSTD_CHUNKED_TOC, FlatpakJson)
+
+typedef struct
+{
+  char       *type;
+  char       *name;
+  char       *link_name;
+  gint64      mode;
+  gint64      size;
+  gint64      uid;
+  gint64      gid;
+  char       *digest;
+  gint64      offset;
+  gint64      end_offset;
+  char       *chunk_type;
+  GHashTable *xattrs; /* base64 encoded values */
+} FlatpakOciZstdChunkedTocEntry;
+
+struct _FlatpakOciZstdChunkedToc
+{
+  FlatpakJson                     parent;
+
+  gint64                          version;
+  FlatpakOciZstdChunkedTocEntry **entries;
+};
+
+struct _FlatpakOciZstdChunkedTocClass
+{
+  FlatpakJsonClass parent_class;
+};
+
 #endif /* __FLATPAK_JSON_OCI_H__ */
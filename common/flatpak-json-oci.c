@@ -184,23 +184,16 @@ flatpak_oci_versioned_from_json (GBytes *bytes,
                                  const char *content_type,
                                  GError **error)
 {
-  g_autoptr(JsonParser) parser = NULL;
-  JsonNode *root = NULL;
+  g_autoptr(FlatpakOciVersioned) versioned = NULL;
   const gchar *mediatype = NULL;
-  JsonObject *object;
 
-  parser = json_parser_new ();
-  if (!json_parser_load_from_data (parser,
-                                   g_bytes_get_data (bytes, NULL),
-                                   g_bytes_get_size (bytes),
-                                   error))
+  /* Only picks out the mediaType, the rest is skipped over */
+  versioned = (FlatpakOciVersioned *) flatpak_json_from_bytes_direct (bytes, FLATPAK_TYPE_OCI_VERSIONED, error);
+  if (versioned == NULL)
     return NULL;
 
-  root = json_parser_get_root (parser);
-  object = json_node_get_object (root);
-
-  if (json_object_has_member (object, "mediaType"))
-    mediatype = json_object_get_string_member (object, "mediaType");
+  if (versioned->mediatype != NULL)
+    mediatype = versioned->mediatype;
   else
     mediatype = content_type;
 
@@ -214,10 +207,10 @@ flatpak_oci_versioned_from_json (GBytes *bytes,
   /* The docker v2 image manifest is similar enough that we can just load it, it does not have the annotation field though */
   if (strcmp (mediatype, FLATPAK_OCI_MEDIA_TYPE_IMAGE_MANIFEST) == 0 ||
       strcmp (mediatype, FLATPAK_DOCKER_MEDIA_TYPE_IMAGE_MANIFEST2) == 0)
-    return (FlatpakOciVersioned *) flatpak_json_from_node (root, FLATPAK_TYPE_OCI_MANIFEST, error);
+    return (FlatpakOciVersioned *) flatpak_json_from_bytes_direct (bytes, FLATPAK_TYPE_OCI_MANIFEST, error);
 
   if (strcmp (mediatype, FLATPAK_OCI_MEDIA_TYPE_IMAGE_INDEX) == 0)
-    return (FlatpakOciVersioned *) flatpak_json_from_node (root, FLATPAK_TYPE_OCI_INDEX, error);
+    return (FlatpakOciVersioned *) flatpak_json_from_bytes_direct (bytes, FLATPAK_TYPE_OCI_INDEX, error);
 
   g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
                "Unsupported media type %s", mediatype);
@@ -228,19 +221,7 @@ FlatpakOciImage *
 flatpak_oci_image_from_json (GBytes *bytes,
                              GError **error)
 {
-  g_autoptr(JsonParser) parser = NULL;
-  JsonNode *root = NULL;
-
-  parser = json_parser_new ();
-  if (!json_parser_load_from_data (parser,
-                                   g_bytes_get_data (bytes, NULL),
-                                   g_bytes_get_size (bytes),
-                                   error))
-    return NULL;
-
-  root = json_parser_get_root (parser);
-
-  return (FlatpakOciImage *) flatpak_json_from_node (root, FLATPAK_TYPE_OCI_IMAGE, error);
+  return (FlatpakOciImage *) flatpak_json_from_bytes_direct (bytes, FLATPAK_TYPE_OCI_IMAGE, error);
 }
 
 
@@ -1126,3 +1107,66 @@ static void
 flatpak_oci_index_response_init (FlatpakOciIndexResponse *self)
 {
 }
+
+G_DEFINE_TYPE (FlatpakOciZstdChunkedToc, flatpak_oci_zstd_chunked_toc, FLATPAK_TYPE_JSON);
+
+static void
+flatpak_oci_zstd_chunked_toc_entry_free (FlatpakOciZstdChunkedTocEntry *self)
+{
+  g_free (self->type);
+  g_free (self->name);
+  g_free (self->link_name);
+  g_free (self->digest);
+  g_free (self->chunk_type);
+  if (self->xattrs)
+    g_hash_table_destroy (self->xattrs);
+  g_free (self);
+}
+
+static void
+flatpak_oci_zstd_chunked_toc_finalize (GObject *object)
+{
+  FlatpakOciZstdChunkedToc *self = (FlatpakOciZstdChunkedToc *) object;
+  int i;
+
+  for (i = 0; self->entries != NULL && self->entries[i] != NULL; i++)
+    flatpak_oci_zstd_chunked_toc_entry_free (self->entries[i]);
+  g_free (self->entries);
+
+  G_OBJECT_CLASS (flatpak_oci_zstd_chunked_toc_parent_class)->finalize (object);
+}
+
+static void
+flatpak_oci_zstd_chunked_toc_class_init (FlatpakOciZstdChunkedTocClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  FlatpakJsonClass *json_class = FLATPAK_JSON_CLASS (klass);
+  static FlatpakJsonProp entry_props[] = {
+    FLATPAK_JSON_MANDATORY_STRING_PROP (FlatpakOciZstdChunkedTocEntry, type, "type"),
+    FLATPAK_JSON_STRING_PROP (FlatpakOciZstdChunkedTocEntry, name, "name"),
+    FLATPAK_JSON_STRING_PROP (FlatpakOciZstdChunkedTocEntry, link_name, "linkName"),
+    FLATPAK_JSON_INT64_PROP (FlatpakOciZstdChunkedTocEntry, mode, "mode"),
+    FLATPAK_JSON_INT64_PROP (FlatpakOciZstdChunkedTocEntry, size, "size"),
+    FLATPAK_JSON_INT64_PROP (FlatpakOciZstdChunkedTocEntry, uid, "uid"),
+    FLATPAK_JSON_INT64_PROP (FlatpakOciZstdChunkedTocEntry, gid, "gid"),
+    FLATPAK_JSON_STRING_PROP (FlatpakOciZstdChunkedTocEntry, digest, "digest"),
+    FLATPAK_JSON_INT64_PROP (FlatpakOciZstdChunkedTocEntry, offset, "offset"),
+    FLATPAK_JSON_INT64_PROP (FlatpakOciZstdChunkedTocEntry, end_offset, "endOffset"),
+    FLATPAK_JSON_STRING_PROP (FlatpakOciZstdChunkedTocEntry, chunk_type, "chunkType"),
+    FLATPAK_JSON_STRMAP_PROP (FlatpakOciZstdChunkedTocEntry, xattrs, "xattrs"),
+    FLATPAK_JSON_LAST_PROP
+  };
+  static FlatpakJsonProp props[] = {
+    FLATPAK_JSON_MANDATORY_INT64_PROP (FlatpakOciZstdChunkedToc, version, "version"),
+    FLATPAK_JSON_MANDATORY_STRUCTV_PROP (FlatpakOciZstdChunkedToc, entries, "entries", entry_props),
+    FLATPAK_JSON_LAST_PROP
+  };
+
+  object_class->finalize = flatpak_oci_zstd_chunked_toc_finalize;
+  json_class->props = props;
+}
+
+static void
+flatpak_oci_zstd_chunked_toc_init (FlatpakOciZstdChunkedToc *self)
+{
+}
@@ -118,6 +118,13 @@ FlatpakJson *flatpak_json_from_stream (GInputStream *stream,
                                        GType         type,
                                        GCancellable *cancellable,
                                        GError      **error);
+FlatpakJson *flatpak_json_from_bytes_direct (GBytes  *bytes,
+                                             GType    type,
+                                             GError **error);
+FlatpakJson *flatpak_json_from_stream_direct (GInputStream *stream,
+                                              GType         type,
+                                              GCancellable *cancellable,
+                                              GError      **error);
 GBytes     *flatpak_json_to_bytes (FlatpakJson *self);
 
 G_END_DECLS
@@ -20,6 +20,7 @@
 
 #include "config.h"
 #include "string.h"
+#include <errno.h>
 
 #include "flatpak-json-private.h"
 #include "flatpak-utils-private.h"
@@ -397,6 +398,881 @@ flatpak_json_from_stream (GInputStream *stream,
   return flatpak_json_from_node (root, type, error);
 }
 
+/* The direct deserializer below fills in the structs straight from the
+ * JSON text in a single pass, without building a JsonNode tree first.
+ * That is a lot faster and uses much less memory for big documents like
+ * the OCI index. It follows the same rules as demarshal(), except that
+ * a property that appears twice in the same object is an error, since we
+ * can't free the first value in general. */
+
+#define DIRECT_MAX_DEPTH 128
+
+typedef struct
+{
+  const char *start;
+  const char *p;
+  const char *end;
+  guint       depth;
+} DirectParser;
+
+typedef struct
+{
+  const FlatpakJsonProp *prop;
+  gpointer               dest;
+  gboolean               seen;
+} DirectField;
+
+static gboolean direct_parse_object (DirectParser          *parser,
+                                     const FlatpakJsonProp *props,
+                                     DirectField           *extra_fields,
+                                     guint                  n_extra_fields,
+                                     gpointer               dest,
+                                     GError               **error);
+
+static gboolean
+direct_fail (DirectParser *parser,
+             GError      **error,
+             const char   *message)
+{
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "Invalid JSON at offset %" G_GSIZE_FORMAT ": %s",
+               (gsize) (parser->p - parser->start), message);
+  return FALSE;
+}
+
+static void
+direct_skip_whitespace (DirectParser *parser)
+{
+  while (parser->p < parser->end &&
+         (*parser->p == ' ' || *parser->p == '\t' ||
+          *parser->p == '\n' || *parser->p == '\r'))
+    parser->p++;
+}
+
+/* Returns the next non-whitespace character without consuming it, or 0
+ * at the end of the input */
+static char
+direct_peek (DirectParser *parser)
+{
+  direct_skip_whitespace (parser);
+  if (parser->p == parser->end)
+    return 0;
+  return *parser->p;
+}
+
+static gboolean
+direct_expect (DirectParser *parser,
+               char          c,
+               GError      **error)
+{
+  if (direct_peek (parser) != c)
+    {
+      g_autofree char *msg = g_strdup_printf ("Expected '%c'", c);
+      return direct_fail (parser, error, msg);
+    }
+
+  parser->p++;
+  return TRUE;
+}
+
+static gboolean
+direct_parse_literal (DirectParser *parser,
+                      const char   *literal,
+                      GError      **error)
+{
+  gsize len = strlen (literal);
+
+  if ((gsize) (parser->end - parser->p) < len ||
+      memcmp (parser->p, literal, len) != 0)
+    return direct_fail (parser, error, "Unexpected token");
+
+  parser->p += len;
+  return TRUE;
+}
+
+static int
+direct_parse_hex4 (const char *s)
+{
+  int i, val = 0;
+
+  for (i = 0; i < 4; i++)
+    {
+      int digit = g_ascii_xdigit_value (s[i]);
+      if (digit < 0)
+        return -1;
+      val = (val << 4) | digit;
+    }
+
+  return val;
+}
+
+static char *
+direct_parse_string (DirectParser *parser,
+                     GError      **error)
+{
+  g_autoptr(GString) str = NULL;
+  const char *chunk;
+
+  if (!direct_expect (parser, '"', error))
+    return NULL;
+
+  /* Fast path, no escapes */
+  chunk = parser->p;
+  while (parser->p < parser->end && *parser->p != '"' && *parser->p != '\\' &&
+         (guchar) *parser->p >= 0x20)
+    parser->p++;
+
+  if (parser->p < parser->end && *parser->p == '"')
+    {
+      gsize len = parser->p - chunk;
+
+      if (!g_utf8_validate (chunk, len, NULL))
+        {
+          direct_fail (parser, error, "Invalid UTF-8 in string");
+          return NULL;
+        }
+
+      parser->p++;
+      return g_strndup (chunk, len);
+    }
+
+  str = g_string_new_len (chunk, parser->p - chunk);
+
+  while (TRUE)
+    {
+      char c;
+
+      if (parser->p == parser->end)
+        {
+          direct_fail (parser, error, "Unterminated string");
+          return NULL;
+        }
+
+      c = *parser->p;
+      if (c == '"')
+        break;
+
+      if ((guchar) c < 0x20)
+        {
+          direct_fail (parser, error, "Control character in string");
+          return NULL;
+        }
+
+      if (c != '\\')
+        {
+          g_string_append_c (str, c);
+          parser->p++;
+          continue;
+        }
+
+      parser->p++;
+      if (parser->p == parser->end)
+        {
+          direct_fail (parser, error, "Unterminated string");
+          return NULL;
+        }
+
+      c = *parser->p++;
+      switch (c)
+        {
+        case '"':
+        case '\\':
+        case '/':
+          g_string_append_c (str, c);
+          break;
+
+        case 'b':
+          g_string_append_c (str, '\b');
+          break;
+
+        case 'f':
+          g_string_append_c (str, '\f');
+          break;
+
+        case 'n':
+          g_string_append_c (str, '\n');
+          break;
+
+        case 'r':
+          g_string_append_c (str, '\r');
+          break;
+
+        case 't':
+          g_string_append_c (str, '\t');
+          break;
+
+        case 'u':
+          {
+            int ch;
+
+            if (parser->end - parser->p < 4 ||
+                (ch = direct_parse_hex4 (parser->p)) < 0)
+              {
+                direct_fail (parser, error, "Invalid unicode escape");
+                return NULL;
+              }
+            parser->p += 4;
+
+            if (ch >= 0xd800 && ch < 0xdc00)
+              {
+                int low;
+
+                if (parser->end - parser->p < 6 ||
+                    parser->p[0] != '\\' || parser->p[1] != 'u' ||
+                    (low = direct_parse_hex4 (parser->p + 2)) < 0xdc00 ||
+                    low >= 0xe000)
+                  {
+                    direct_fail (parser, error, "Invalid unicode surrogate pair");
+                    return NULL;
+                  }
+                parser->p += 6;
+
+                ch = 0x10000 + ((ch - 0xd800) << 10) + (low - 0xdc00);
+              }
+            else if ((ch >= 0xdc00 && ch < 0xe000) || ch == 0)
+              {
+                direct_fail (parser, error, "Invalid unicode escape");
+                return NULL;
+              }
+
+            g_string_append_unichar (str, ch);
+          }
+          break;
+
+        default:
+          direct_fail (parser, error, "Invalid escape in string");
+          return NULL;
+        }
+    }
+
+  if (!g_utf8_validate (str->str, str->len, NULL))
+    {
+      direct_fail (parser, error, "Invalid UTF-8 in string");
+      return NULL;
+    }
+
+  parser->p++;
+  return g_string_free (g_steal_pointer (&str), FALSE);
+}
+
+/* Scans a number. If it is an integer that fits in a gint64 it is
+ * returned in @out_int and @out_is_int is set. */
+static gboolean
+direct_parse_number (DirectParser *parser,
+                     gint64       *out_int,
+                     gboolean     *out_is_int,
+                     GError      **error)
+{
+  const char *start = parser->p;
+  gboolean is_int = TRUE;
+  char buf[32];
+  char *endptr;
+  gsize len;
+
+  if (parser->p < parser->end && *parser->p == '-')
+    parser->p++;
+
+  if (parser->p == parser->end || !g_ascii_isdigit (*parser->p))
+    return direct_fail (parser, error, "Invalid number");
+
+  while (parser->p < parser->end && g_ascii_isdigit (*parser->p))
+    parser->p++;
+
+  if (parser->p < parser->end && *parser->p == '.')
+    {
+      is_int = FALSE;
+      parser->p++;
+      if (parser->p == parser->end || !g_ascii_isdigit (*parser->p))
+        return direct_fail (parser, error, "Invalid number");
+      while (parser->p < parser->end && g_ascii_isdigit (*parser->p))
+        parser->p++;
+    }
+
+  if (parser->p < parser->end && (*parser->p == 'e' || *parser->p == 'E'))
+    {
+      is_int = FALSE;
+      parser->p++;
+      if (parser->p < parser->end && (*parser->p == '+' || *parser->p == '-'))
+        parser->p++;
+      if (parser->p == parser->end || !g_ascii_isdigit (*parser->p))
+        return direct_fail (parser, error, "Invalid number");
+      while (parser->p < parser->end && g_ascii_isdigit (*parser->p))
+        parser->p++;
+    }
+
+  len = parser->p - start;
+  if (is_int && len < sizeof (buf))
+    {
+      memcpy (buf, start, len);
+      buf[len] = 0;
+
+      errno = 0;
+      *out_int = g_ascii_strtoll (buf, &endptr, 10);
+      if (errno != 0 || *endptr != 0)
+        is_int = FALSE;
+    }
+  else
+    is_int = FALSE;
+
+  *out_is_int = is_int;
+  return TRUE;
+}
+
+static gboolean
+direct_skip_value (DirectParser *parser,
+                   GError      **error)
+{
+  gboolean res = TRUE;
+
+  switch (direct_peek (parser))
+    {
+    case '"':
+      {
+        g_autofree char *str = direct_parse_string (parser, error);
+        return str != NULL;
+      }
+
+    case '{':
+    case '[':
+      {
+        char close = *parser->p == '{' ? '}' : ']';
+
+        if (++parser->depth > DIRECT_MAX_DEPTH)
+          return direct_fail (parser, error, "Too deeply nested");
+
+        parser->p++;
+        if (direct_peek (parser) == close)
+          parser->p++;
+        else
+          {
+            while (res)
+              {
+                if (close == '}')
+                  {
+                    g_autofree char *key = direct_parse_string (parser, error);
+
+                    res = key != NULL && direct_expect (parser, ':', error);
+                    if (!res)
+                      break;
+                  }
+
+                if (!direct_skip_value (parser, error))
+                  res = FALSE;
+                else if (direct_peek (parser) == ',')
+                  parser->p++;
+                else
+                  {
+                    res = direct_expect (parser, close, error);
+                    break;
+                  }
+              }
+          }
+
+        parser->depth--;
+        return res;
+      }
+
+    case 't':
+      return direct_parse_literal (parser, "true", error);
+
+    case 'f':
+      return direct_parse_literal (parser, "false", error);
+
+    case 'n':
+      return direct_parse_literal (parser, "null", error);
+
+    case '-':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      {
+        gint64 ignored_int;
+        gboolean ignored_is_int;
+
+        return direct_parse_number (parser, &ignored_int, &ignored_is_int, error);
+      }
+
+    default:
+      return direct_fail (parser, error, "Unexpected token");
+    }
+}
+
+/* Calls @member_func for each member of the object at the current
+ * position, with the parser positioned at the start of the value. */
+typedef gboolean (*DirectMemberFunc) (DirectParser *parser,
+                                      const char   *name,
+                                      gpointer      user_data,
+                                      GError      **error);
+
+static gboolean
+direct_parse_members (DirectParser    *parser,
+                      DirectMemberFunc member_func,
+                      gpointer         user_data,
+                      GError         **error)
+{
+  gboolean res = TRUE;
+
+  if (!direct_expect (parser, '{', error))
+    return FALSE;
+
+  if (++parser->depth > DIRECT_MAX_DEPTH)
+    return direct_fail (parser, error, "Too deeply nested");
+
+  if (direct_peek (parser) == '}')
+    parser->p++;
+  else
+    {
+      while (TRUE)
+        {
+          g_autofree char *key = direct_parse_string (parser, error);
+
+          if (key == NULL ||
+              !direct_expect (parser, ':', error) ||
+              !member_func (parser, key, user_data, error))
+            {
+              res = FALSE;
+              break;
+            }
+
+          if (direct_peek (parser) == ',')
+            parser->p++;
+          else
+            {
+              res = direct_expect (parser, '}', error);
+              break;
+            }
+        }
+    }
+
+  parser->depth--;
+  return res;
+}
+
+static gboolean
+direct_strmap_member (DirectParser *parser,
+                      const char   *name,
+                      gpointer      user_data,
+                      GError      **error)
+{
+  GHashTable *h = user_data;
+  char *val;
+
+  if (direct_peek (parser) != '"')
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Wrong type for string member %s", name);
+      return FALSE;
+    }
+
+  val = direct_parse_string (parser, error);
+  if (val == NULL)
+    return FALSE;
+
+  g_hash_table_insert (h, g_strdup (name), val);
+  return TRUE;
+}
+
+static gboolean
+direct_boolmap_member (DirectParser *parser,
+                       const char   *name,
+                       gpointer      user_data,
+                       GError      **error)
+{
+  GPtrArray *res = user_data;
+
+  if (!g_ptr_array_find_with_equal_func (res, name, g_str_equal, NULL))
+    g_ptr_array_add (res, g_strdup (name));
+
+  return direct_skip_value (parser, error);
+}
+
+/* Parses the value at the current position into @dest according to @prop.
+ * A null value is skipped, and @out_is_null is set. */
+static gboolean
+direct_parse_prop (DirectParser          *parser,
+                   const FlatpakJsonProp *prop,
+                   gpointer               dest,
+                   gboolean              *out_is_null,
+                   GError               **error)
+{
+  const char *name = prop->name;
+  char c = direct_peek (parser);
+
+  *out_is_null = FALSE;
+
+  if (c == 'n')
+    {
+      *out_is_null = TRUE;
+      return direct_parse_literal (parser, "null", error);
+    }
+
+  switch (prop->type)
+    {
+    case FLATPAK_JSON_PROP_TYPE_STRING:
+      if (c != '"')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting string for property %s", name);
+          return FALSE;
+        }
+      *(char **) dest = direct_parse_string (parser, error);
+      return *(char **) dest != NULL;
+
+    case FLATPAK_JSON_PROP_TYPE_INT64:
+      {
+        gboolean is_int = FALSE;
+
+        if (c != '-' && !g_ascii_isdigit (c))
+          is_int = FALSE;
+        else if (!direct_parse_number (parser, (gint64 *) dest, &is_int, error))
+          return FALSE;
+
+        if (!is_int)
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Expecting int64 for property %s", name);
+            return FALSE;
+          }
+      }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_BOOL:
+      if (c == 't' && direct_parse_literal (parser, "true", NULL))
+        *(gboolean *) dest = TRUE;
+      else if (c == 'f' && direct_parse_literal (parser, "false", NULL))
+        *(gboolean *) dest = FALSE;
+      else
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting bool for property %s", name);
+          return FALSE;
+        }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_STRV:
+      if (c != '[')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting array for property %s", name);
+          return FALSE;
+        }
+      {
+        g_autoptr(GPtrArray) str_array = g_ptr_array_new_with_free_func (g_free);
+
+        parser->p++;
+        if (direct_peek (parser) == ']')
+          parser->p++;
+        else
+          {
+            while (TRUE)
+              {
+                /* Like demarshal(), ignore non-string elements */
+                if (direct_peek (parser) == '"')
+                  {
+                    char *str = direct_parse_string (parser, error);
+                    if (str == NULL)
+                      return FALSE;
+                    g_ptr_array_add (str_array, str);
+                  }
+                else if (!direct_skip_value (parser, error))
+                  return FALSE;
+
+                if (direct_peek (parser) == ',')
+                  parser->p++;
+                else if (!direct_expect (parser, ']', error))
+                  return FALSE;
+                else
+                  break;
+              }
+          }
+
+        g_ptr_array_set_free_func (str_array, NULL);
+        g_ptr_array_add (str_array, NULL);
+        *(char ***) dest = (char **) g_ptr_array_free (g_steal_pointer (&str_array), FALSE);
+      }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_STRUCT:
+      if (c != '{')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting object for property %s", name);
+          return FALSE;
+        }
+      return direct_parse_object (parser, prop->type_data, NULL, 0, dest, error);
+
+    case FLATPAK_JSON_PROP_TYPE_STRUCTV:
+      if (c != '[')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting array for property %s", name);
+          return FALSE;
+        }
+      {
+        g_autoptr(GPtrArray) obj_array = g_ptr_array_new ();
+        gboolean res = TRUE;
+
+        parser->p++;
+        if (direct_peek (parser) == ']')
+          parser->p++;
+        else
+          {
+            while (res)
+              {
+                gpointer new_element;
+
+                if (direct_peek (parser) != '{')
+                  {
+                    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                 "Expecting object element for property %s", name);
+                    res = FALSE;
+                    break;
+                  }
+
+                new_element = g_malloc0 ((gsize) prop->type_data2);
+                g_ptr_array_add (obj_array, new_element);
+
+                if (!direct_parse_object (parser, prop->type_data, NULL, 0, new_element, error))
+                  res = FALSE;
+                else if (direct_peek (parser) == ',')
+                  parser->p++;
+                else
+                  {
+                    res = direct_expect (parser, ']', error);
+                    break;
+                  }
+              }
+          }
+
+        /* NULL terminate */
+        g_ptr_array_add (obj_array, NULL);
+
+        /* We always set the array, even if it is partial, because we don't know how
+           to free what we demarshalled so far */
+        *(gpointer *) dest = (gpointer *) g_ptr_array_free (g_steal_pointer (&obj_array), FALSE);
+        return res;
+      }
+
+    case FLATPAK_JSON_PROP_TYPE_STRMAP:
+      if (c != '{')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting object for property %s", name);
+          return FALSE;
+        }
+      {
+        g_autoptr(GHashTable) h = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        if (!direct_parse_members (parser, direct_strmap_member, h, error))
+          return FALSE;
+
+        *(GHashTable **) dest = g_steal_pointer (&h);
+      }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_BOOLMAP:
+      if (c != '{')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting object for property %s", name);
+          return FALSE;
+        }
+      {
+        g_autoptr(GPtrArray) res = g_ptr_array_new_with_free_func (g_free);
+
+        if (!direct_parse_members (parser, direct_boolmap_member, res, error))
+          return FALSE;
+
+        g_ptr_array_set_free_func (res, NULL);
+        g_ptr_array_add (res, NULL);
+        *(char ***) dest = (char **) g_ptr_array_free (g_steal_pointer (&res), FALSE);
+      }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_PARENT:
+    default:
+      g_assert_not_reached ();
+    }
+
+  return TRUE;
+}
+
+/* Flattens @props into @fields, so that the members of parent props are
+ * looked up in the same object as the other props */
+static void
+direct_collect_fields (GArray                *fields,
+                       const FlatpakJsonProp *props,
+                       gpointer               dest)
+{
+  int i;
+
+  for (i = 0; props[i].name != NULL; i++)
+    {
+      if (props[i].type == FLATPAK_JSON_PROP_TYPE_PARENT)
+        direct_collect_fields (fields, props[i].type_data,
+                               G_STRUCT_MEMBER_P (dest, props[i].offset));
+      else
+        {
+          DirectField field = { &props[i], G_STRUCT_MEMBER_P (dest, props[i].offset), FALSE };
+          g_array_append_val (fields, field);
+        }
+    }
+}
+
+typedef struct
+{
+  GArray  *fields;
+  gboolean strict;
+} DirectObjectData;
+
+static gboolean
+direct_object_member (DirectParser *parser,
+                      const char   *name,
+                      gpointer      user_data,
+                      GError      **error)
+{
+  DirectObjectData *data = user_data;
+  DirectField *field = NULL;
+  gboolean is_null;
+  guint i;
+
+  for (i = 0; i < data->fields->len; i++)
+    {
+      DirectField *f = &g_array_index (data->fields, DirectField, i);
+      if (strcmp (f->prop->name, name) == 0)
+        {
+          field = f;
+          break;
+        }
+    }
+
+  if (field == NULL)
+    {
+      if (data->strict)
+        return flatpak_fail (error, "Unknown property named %s", name);
+
+      return direct_skip_value (parser, error);
+    }
+
+  if (field->seen)
+    return flatpak_fail (error, "Duplicate property %s", name);
+
+  if (!direct_parse_prop (parser, field->prop, field->dest, &is_null, error))
+    return FALSE;
+
+  field->seen = !is_null;
+  return TRUE;
+}
+
+static gboolean
+direct_parse_object (DirectParser          *parser,
+                     const FlatpakJsonProp *props,
+                     DirectField           *extra_fields,
+                     guint                  n_extra_fields,
+                     gpointer               dest,
+                     GError               **error)
+{
+  g_autoptr(GArray) fields = g_array_new (FALSE, FALSE, sizeof (DirectField));
+  DirectObjectData data = { fields, FALSE };
+  guint i;
+
+  if (extra_fields)
+    g_array_append_vals (fields, extra_fields, n_extra_fields);
+  if (props)
+    {
+      direct_collect_fields (fields, props, dest);
+      /* Same check as in demarshal() */
+      data.strict = (props->flags & FLATPAK_JSON_PROP_FLAGS_STRICT) != 0;
+    }
+
+  if (!direct_parse_members (parser, direct_object_member, &data, error))
+    return FALSE;
+
+  for (i = 0; i < fields->len; i++)
+    {
+      DirectField *f = &g_array_index (fields, DirectField, i);
+
+      if (!f->seen && (f->prop->flags & FLATPAK_JSON_PROP_FLAGS_MANDATORY) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "No value for mandatory property %s", f->prop->name);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Like flatpak_json_from_bytes(), but uses the direct deserializer. Use
+ * this for large documents. */
+FlatpakJson *
+flatpak_json_from_bytes_direct (GBytes  *bytes,
+                                GType    type,
+                                GError **error)
+{
+  g_autoptr(FlatpakJson) json = NULL;
+  g_autoptr(GArray) fields = g_array_new (FALSE, FALSE, sizeof (DirectField));
+  DirectParser parser;
+  gsize size;
+  gpointer class;
+
+  parser.start = g_bytes_get_data (bytes, &size);
+  parser.p = parser.start;
+  parser.end = parser.start + size;
+  parser.depth = 0;
+
+  /* Allow a trailing nul, as from flatpak_read_stream() */
+  if (size > 0 && parser.end[-1] == 0)
+    parser.end--;
+
+  if (direct_peek (&parser) != '{')
+    {
+      direct_fail (&parser, error, "Expecting a JSON object");
+      return NULL;
+    }
+
+  json = g_object_new (type, NULL);
+
+  class = FLATPAK_JSON_GET_CLASS (json);
+  while (FLATPAK_JSON_CLASS (class)->props != NULL)
+    {
+      direct_collect_fields (fields, FLATPAK_JSON_CLASS (class)->props, json);
+      class = g_type_class_peek_parent (class);
+    }
+
+  if (!direct_parse_object (&parser, NULL,
+                            (DirectField *) fields->data, fields->len,
+                            json, error))
+    return NULL;
+
+  if (direct_peek (&parser) != 0)
+    {
+      direct_fail (&parser, error, "Trailing data after JSON object");
+      return NULL;
+    }
+
+  return g_steal_pointer (&json);
+}
+
+/* Like flatpak_json_from_stream(), but uses the direct deserializer */
+FlatpakJson *
+flatpak_json_from_stream_direct (GInputStream *stream,
+                                 GType         type,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  g_autoptr(GOutputStream) mem_stream = g_memory_output_stream_new_resizable ();
+  g_autoptr(GBytes) bytes = NULL;
+
+  if (g_output_stream_splice (mem_stream, stream,
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                              cancellable, error) < 0)
+    return NULL;
+
+  bytes = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (mem_stream));
+
+  return flatpak_json_from_bytes_direct (bytes, type, error);
+}
+
 static JsonNode *
 marshal (JsonObject          *parent,
          const char          *name,
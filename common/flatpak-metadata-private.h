@@ -70,6 +70,7 @@ G_BEGIN_DECLS
 #define FLATPAK_METADATA_GROUP_A11Y_BUS_POLICY "Accessibility Bus Policy"
 #define FLATPAK_METADATA_GROUP_PREFIX_POLICY "Policy "
 #define FLATPAK_METADATA_GROUP_ENVIRONMENT "Environment"
+#define FLATPAK_METADATA_GROUP_RESOURCES "Resources"
 
 #define FLATPAK_METADATA_GROUP_PREFIX_EXTENSION "Extension "
 #define FLATPAK_METADATA_KEY_ADD_LD_PATH "add-ld-path"
@@ -61,6 +61,10 @@ FlatpakOciRegistry *   flatpak_oci_registry_new_for_archive (GFile        *archi
                                                              GError      **error);
 void                   flatpak_oci_registry_set_token (FlatpakOciRegistry *self,
                                                        const char *token);
+void                   flatpak_oci_registry_set_max_download_rate (FlatpakOciRegistry *self,
+                                                                   guint64             bytes_per_sec);
+void                   flatpak_oci_registry_set_http3 (FlatpakOciRegistry *self,
+                                                       gboolean            enable);
 void                   flatpak_oci_registry_set_signature_lookaside (FlatpakOciRegistry *self,
                                                                      const char         *signature_lookaside);
 gboolean               flatpak_oci_registry_is_local (FlatpakOciRegistry *self);
@@ -135,6 +139,8 @@ typedef enum {
 
 FlatpakOciLayerWriter *flatpak_oci_registry_write_layer (FlatpakOciRegistry        *self,
                                                          FlatpakOciWriteLayerFlags  flags,
+                                                         int                        compression_level,
+                                                         int                        n_jobs,
                                                          GCancellable              *cancellable,
                                                          GError                   **error);
 
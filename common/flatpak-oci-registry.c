@@ -20,6 +20,8 @@
 
 #include "config.h"
 
+#include <sys/socket.h>
+
 #include <glib/gi18n-lib.h>
 #include <gio/gunixoutputstream.h>
 #include <gio/gunixinputstream.h>
@@ -32,6 +34,7 @@
 #include "flatpak-oci-registry-private.h"
 #include "flatpak-oci-signatures-private.h"
 #include "flatpak-repo-utils-private.h"
+#include "flatpak-trace-private.h"
 #include "flatpak-utils-base-private.h"
 #include "flatpak-utils-private.h"
 #include "flatpak-uri-private.h"
@@ -291,6 +294,23 @@ flatpak_oci_registry_set_token (FlatpakOciRegistry *self,
                                          0, NULL, NULL);
 }
 
+void
+flatpak_oci_registry_set_max_download_rate (FlatpakOciRegistry *self,
+                                            guint64             bytes_per_sec)
+{
+  /* Local registries don't download anything */
+  if (self->http_session)
+    flatpak_http_session_set_max_recv_speed (self->http_session, bytes_per_sec);
+}
+
+void
+flatpak_oci_registry_set_http3 (FlatpakOciRegistry *self,
+                                gboolean            enable)
+{
+  if (self->http_session)
+    flatpak_http_session_set_http3 (self->http_session, enable);
+}
+
 void
 flatpak_oci_registry_set_signature_lookaside (FlatpakOciRegistry *self,
                                               const char         *signature_lookaside)
@@ -360,6 +380,54 @@ choose_alt_uri (GUri        *base_uri,
   return NULL;
 }
 
+/* Returns the uris to get a file from, in the order to try them: the
+ * http ones of @alt_uris, and then @subpath in the registry. This way a
+ * failing mirror isn't fatal. */
+static GPtrArray *
+get_file_uris (GUri        *base_uri,
+               const char **alt_uris,
+               const char  *subpath,
+               GError     **error)
+{
+  g_autoptr(GPtrArray) uris = g_ptr_array_new_with_free_func (g_free);
+  char *uri_s;
+  int i;
+
+  for (i = 0; alt_uris != NULL && alt_uris[i] != NULL; i++)
+    {
+      const char *alt_uri = alt_uris[i];
+      if (g_str_has_prefix (alt_uri, "http:") || g_str_has_prefix (alt_uri, "https:"))
+        g_ptr_array_add (uris, g_strdup (alt_uri));
+    }
+
+  uri_s = parse_relative_uri (base_uri, subpath, error);
+  if (uri_s == NULL)
+    return NULL;
+
+  g_ptr_array_add (uris, uri_s);
+
+  return g_steal_pointer (&uris);
+}
+
+/* Whether to try the next uri of a file after failing to get it with
+ * @error. The retries for transient errors are already done. */
+static gboolean
+should_try_next_uri (GPtrArray    *uris,
+                     guint         i,
+                     const GError *error)
+{
+  if (i + 1 >= uris->len ||
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return FALSE;
+
+  g_info ("Failed to get %s, trying %s: %s",
+          (char *) g_ptr_array_index (uris, i),
+          (char *) g_ptr_array_index (uris, i + 1),
+          error->message);
+
+  return TRUE;
+}
+
 static GBytes *
 remote_load_file (FlatpakOciRegistry *self,
                   const char         *subpath,
@@ -369,23 +437,39 @@ remote_load_file (FlatpakOciRegistry *self,
                   GError            **error)
 {
   g_autoptr(GBytes) bytes = NULL;
-  g_autofree char *uri_s = NULL;
+  g_autoptr(GPtrArray) uris = NULL;
+  g_autoptr(GError) first_error = NULL;
+  guint i;
 
-  uri_s = choose_alt_uri (self->base_uri, alt_uris);
-  if (uri_s == NULL)
+  uris = get_file_uris (self->base_uri, alt_uris, subpath, error);
+  if (uris == NULL)
+    return NULL;
+
+  for (i = 0; bytes == NULL; i++)
     {
-      uri_s = parse_relative_uri (self->base_uri, subpath, error);
-      if (uri_s == NULL)
-        return NULL;
-    }
+      g_autoptr(GError) local_error = NULL;
 
-  bytes = flatpak_load_uri_full (self->http_session,
-                                 uri_s, self->certificates, FLATPAK_HTTP_FLAGS_ACCEPT_OCI,
-                                 NULL, self->token,
-                                 NULL, NULL, NULL, out_content_type, NULL,
-                                 cancellable, error);
-  if (bytes == NULL)
-    return NULL;
+      bytes = flatpak_load_uri_full (self->http_session,
+                                     g_ptr_array_index (uris, i), self->certificates,
+                                     FLATPAK_HTTP_FLAGS_ACCEPT_OCI,
+                                     NULL, self->token,
+                                     NULL, NULL, NULL, out_content_type, NULL,
+                                     cancellable, &local_error);
+      if (bytes == NULL)
+        {
+          gboolean try_next = should_try_next_uri (uris, i, local_error);
+
+          /* The first uri is the preferred one, so its error is the one to report */
+          if (first_error == NULL)
+            first_error = g_steal_pointer (&local_error);
+
+          if (!try_next)
+            {
+              g_propagate_error (error, g_steal_pointer (&first_error));
+              return NULL;
+            }
+        }
+    }
 
   return g_steal_pointer (&bytes);
 }
@@ -812,7 +896,7 @@ flatpak_oci_registry_load_index (FlatpakOciRegistry *self,
       return NULL;
     }
 
-  return (FlatpakOciIndex *) flatpak_json_from_bytes (bytes, FLATPAK_TYPE_OCI_INDEX, error);
+  return (FlatpakOciIndex *) flatpak_json_from_bytes_direct (bytes, FLATPAK_TYPE_OCI_INDEX, error);
 }
 
 gboolean
@@ -962,6 +1046,96 @@ checksum_fd (int fd, GCancellable *cancellable, GError **error)
   return g_strdup (g_checksum_get_string (checksum));
 }
 
+static char *
+get_blob_uri (FlatpakOciRegistry *self,
+              const char         *repository,
+              gboolean            manifest,
+              const char         *digest,
+              const char        **alt_uris,
+              GError            **error)
+{
+  g_autofree char *subpath = NULL;
+  char *uri_s;
+
+  g_assert (self->dfd == -1);
+
+  subpath = get_digest_subpath (self, repository, manifest, FALSE, digest, error);
+  if (subpath == NULL)
+    return NULL;
+
+  uri_s = choose_alt_uri (self->base_uri, alt_uris);
+  if (uri_s == NULL)
+    uri_s = parse_relative_uri (self->base_uri, subpath, error);
+
+  return uri_s;
+}
+
+/* Downloads a blob from a remote registry into @out_stream. This doesn't
+ * verify the digest, that is up to the caller. */
+static gboolean
+download_blob_to_stream (FlatpakOciRegistry    *self,
+                         const char            *repository,
+                         gboolean               manifest,
+                         const char            *digest,
+                         const char           **alt_uris,
+                         GOutputStream         *out_stream,
+                         FlatpakLoadUriProgress progress_cb,
+                         gpointer               user_data,
+                         GCancellable          *cancellable,
+                         GError               **error)
+{
+  g_autofree char *subpath = NULL;
+  g_autoptr(GPtrArray) uris = NULL;
+  g_autoptr(GError) first_error = NULL;
+  guint i;
+
+  g_assert (self->dfd == -1);
+
+  subpath = get_digest_subpath (self, repository, manifest, FALSE, digest, error);
+  if (subpath == NULL)
+    return FALSE;
+
+  uris = get_file_uris (self->base_uri, alt_uris, subpath, error);
+  if (uris == NULL)
+    return FALSE;
+
+  for (i = 0; i < uris->len; i++)
+    {
+      g_autoptr(GError) local_error = NULL;
+      gboolean try_next;
+
+      /* The reader of the stream is the import, which can be a lot slower
+       * than the network */
+      if (flatpak_download_http_uri (self->http_session, g_ptr_array_index (uris, i),
+                                     self->certificates,
+                                     FLATPAK_HTTP_FLAGS_ACCEPT_OCI | FLATPAK_HTTP_FLAGS_NO_MULTIPLEX,
+                                     out_stream,
+                                     self->token,
+                                     progress_cb, user_data,
+                                     cancellable, &local_error))
+        return TRUE;
+
+      try_next = should_try_next_uri (uris, i, local_error);
+
+      /* We can only start over if we can take back what was written */
+      if (try_next && G_IS_SEEKABLE (out_stream) &&
+          g_seekable_tell (G_SEEKABLE (out_stream)) != 0)
+        try_next = (g_seekable_truncate (G_SEEKABLE (out_stream), 0, cancellable, NULL) &&
+                    g_seekable_seek (G_SEEKABLE (out_stream), 0, G_SEEK_SET, cancellable, NULL));
+      else if (try_next && !G_IS_SEEKABLE (out_stream))
+        try_next = FALSE;
+
+      if (first_error == NULL)
+        first_error = g_steal_pointer (&local_error);
+
+      if (!try_next)
+        break;
+    }
+
+  g_propagate_error (error, g_steal_pointer (&first_error));
+  return FALSE;
+}
+
 int
 flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
                                     const char            *repository,
@@ -973,17 +1147,18 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
                                     GCancellable          *cancellable,
                                     GError               **error)
 {
-  g_autofree char *subpath = NULL;
   glnx_autofd int fd = -1;
 
   g_assert (self->valid);
 
-  subpath = get_digest_subpath (self, repository, manifest, FALSE, digest, error);
-  if (subpath == NULL)
-    return -1;
-
   if (self->dfd != -1)
     {
+      g_autofree char *subpath = NULL;
+
+      subpath = get_digest_subpath (self, repository, manifest, FALSE, digest, error);
+      if (subpath == NULL)
+        return -1;
+
       /* Local case, trust checksum */
       fd = flatpak_open_file_at (self->dfd, subpath, NULL, cancellable, error);
       if (fd == -1)
@@ -991,21 +1166,12 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
     }
   else
     {
-      g_autofree char *uri_s = NULL;
       g_autofree char *checksum = NULL;
       g_autofree char *tmpfile_name = g_strdup_printf ("oci-layer-XXXXXX");
       g_autoptr(GOutputStream) out_stream = NULL;
 
       /* remote case, download and verify */
 
-      uri_s = choose_alt_uri (self->base_uri, alt_uris);
-      if (uri_s == NULL)
-        {
-          uri_s = parse_relative_uri (self->base_uri, subpath, error);
-          if (uri_s == NULL)
-            return -1;
-        }
-
       if (!flatpak_open_in_tmpdir_at (self->tmp_dfd, 0600, tmpfile_name,
                                       &out_stream, cancellable, error))
         return -1;
@@ -1016,13 +1182,9 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
       if (fd == -1)
         return -1;
 
-      if (!flatpak_download_http_uri (self->http_session, uri_s,
-                                      self->certificates,
-                                      FLATPAK_HTTP_FLAGS_ACCEPT_OCI,
-                                      out_stream,
-                                      self->token,
-                                      progress_cb, user_data,
-                                      cancellable, error))
+      if (!download_blob_to_stream (self, repository, manifest, digest, alt_uris,
+                                    out_stream, progress_cb, user_data,
+                                    cancellable, error))
         return -1;
 
       if (!g_output_stream_close (out_stream, cancellable, error))
@@ -1045,6 +1207,53 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
   return g_steal_fd (&fd);
 }
 
+/* Blobs never change and are named by their digest, so when mirroring
+ * from a local registry on the same filesystem we can hardlink them
+ * instead of copying. *out_linked is left FALSE if that isn't possible,
+ * and the caller should copy the blob instead. */
+static gboolean
+link_local_blob (FlatpakOciRegistry *self,
+                 FlatpakOciRegistry *source_registry,
+                 const char         *src_subpath,
+                 const char         *dst_subpath,
+                 const char         *digest,
+                 gboolean           *out_linked,
+                 GCancellable       *cancellable,
+                 GError            **error)
+{
+  glnx_autofd int src_fd = -1;
+  g_autofree char *checksum = NULL;
+
+  *out_linked = FALSE;
+
+  src_fd = flatpak_open_file_at (source_registry->dfd, src_subpath, NULL, cancellable, error);
+  if (src_fd == -1)
+    return FALSE;
+
+  checksum = checksum_fd (src_fd, cancellable, error);
+  if (checksum == NULL)
+    return FALSE;
+
+  if (strcmp (checksum, digest + strlen ("sha256:")) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Checksum digest did not match (%s != %s)", digest, checksum);
+      return FALSE;
+    }
+
+  if (linkat (source_registry->dfd, src_subpath, self->dfd, dst_subpath, 0) == 0 ||
+      errno == EEXIST)
+    {
+      *out_linked = TRUE;
+      return TRUE;
+    }
+
+  if (errno == EXDEV || errno == EPERM || errno == EMLINK || errno == ENOTSUP)
+    return TRUE;
+
+  return glnx_throw_errno_prefix (error, "linkat");
+}
+
 gboolean
 flatpak_oci_registry_mirror_blob (FlatpakOciRegistry    *self,
                                   FlatpakOciRegistry    *source_registry,
@@ -1085,6 +1294,18 @@ flatpak_oci_registry_mirror_blob (FlatpakOciRegistry    *self,
   if (fstatat (self->dfd, dst_subpath, &stbuf, AT_SYMLINK_NOFOLLOW) == 0)
     return TRUE;
 
+  if (source_registry->dfd != -1)
+    {
+      gboolean linked;
+
+      if (!link_local_blob (self, source_registry, src_subpath, dst_subpath, digest,
+                            &linked, cancellable, error))
+        return FALSE;
+
+      if (linked)
+        return TRUE;
+    }
+
   if (!glnx_open_tmpfile_linkable_at (self->dfd, "blobs/sha256",
                                       O_RDWR | O_CLOEXEC | O_NOCTTY,
                                       &tmpf, error))
@@ -1173,11 +1394,103 @@ object_find_error_string (JsonNode *json)
   return error_detail;
 }
 
+/* Bearer tokens are cached for the whole process, keyed on the registry,
+ * repository and credentials. This way pulling several refs from the
+ * same repository, or several transactions handled by the same
+ * oci-authenticator, don't all start with a 401 round trip and a new
+ * token request. */
+
+/* The default lifetime from the Docker token spec, used if the token
+ * response has no expires_in */
+#define TOKEN_CACHE_DEFAULT_LIFETIME_SECS 60
+/* Stop using a token a bit before it expires, to allow for it being used
+ * to start a long pull */
+#define TOKEN_CACHE_EXPIRY_MARGIN_SECS 15
+
+typedef struct
+{
+  char  *token;
+  gint64 expires; /* monotonic */
+} CachedToken;
+
+G_LOCK_DEFINE_STATIC (token_cache);
+static GHashTable *token_cache = NULL;
+
+static void
+cached_token_free (CachedToken *cached)
+{
+  g_free (cached->token);
+  g_free (cached);
+}
+
+static char *
+get_token_cache_key (FlatpakOciRegistry *self,
+                     const char         *repository,
+                     const char         *basic_auth)
+{
+  g_autofree char *uri_s = g_uri_to_string_partial (self->base_uri, G_URI_HIDE_PASSWORD);
+  g_autofree char *auth_checksum = NULL;
+
+  /* Don't keep the credentials themselves around */
+  if (basic_auth)
+    auth_checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, basic_auth, -1);
+
+  return g_strdup_printf ("%s\n%s\n%s", uri_s, repository,
+                          auth_checksum ? auth_checksum : "");
+}
+
+static char *
+lookup_cached_token (const char *key)
+{
+  CachedToken *cached;
+  char *res = NULL;
+
+  G_LOCK (token_cache);
+  if (token_cache != NULL)
+    {
+      cached = g_hash_table_lookup (token_cache, key);
+      if (cached != NULL)
+        {
+          if (cached->expires > g_get_monotonic_time ())
+            res = g_strdup (cached->token);
+          else
+            g_hash_table_remove (token_cache, key);
+        }
+    }
+  G_UNLOCK (token_cache);
+
+  return res;
+}
+
+static void
+cache_token (const char *key,
+             const char *token,
+             gint64      lifetime_secs)
+{
+  CachedToken *cached;
+
+  if (lifetime_secs <= TOKEN_CACHE_EXPIRY_MARGIN_SECS)
+    return;
+
+  cached = g_new0 (CachedToken, 1);
+  cached->token = g_strdup (token);
+  cached->expires = g_get_monotonic_time () +
+                    (lifetime_secs - TOKEN_CACHE_EXPIRY_MARGIN_SECS) * G_USEC_PER_SEC;
+
+  G_LOCK (token_cache);
+  if (token_cache == NULL)
+    token_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, (GDestroyNotify) cached_token_free);
+  g_hash_table_replace (token_cache, g_strdup (key), cached);
+  G_UNLOCK (token_cache);
+}
+
 static char *
 get_token_for_www_auth (FlatpakOciRegistry *self,
                         const char    *repository,
                         const char    *www_authenticate,
                         const char    *auth,
+                        gint64        *lifetime_secs_out,
                         GCancellable  *cancellable,
                         GError        **error)
 {
@@ -1301,6 +1614,16 @@ get_token_for_www_auth (FlatpakOciRegistry *self,
       return NULL;
     }
 
+  *lifetime_secs_out = TOKEN_CACHE_DEFAULT_LIFETIME_SECS;
+  if (JSON_NODE_HOLDS_OBJECT (json))
+    {
+      JsonNode *expires_in = json_object_get_member (json_node_get_object (json), "expires_in");
+
+      if (expires_in != NULL && JSON_NODE_HOLDS_VALUE (expires_in) &&
+          json_node_get_value_type (expires_in) == G_TYPE_INT64)
+        *lifetime_secs_out = json_node_get_int (expires_in);
+    }
+
   return g_strdup (token);
 }
 
@@ -1316,7 +1639,9 @@ flatpak_oci_registry_get_token (FlatpakOciRegistry *self,
   g_autofree char *uri_s = NULL;
   g_autofree char *www_authenticate = NULL;
   g_autofree char *token = NULL;
+  g_autofree char *cache_key = NULL;
   g_autoptr(GBytes) body = NULL;
+  gint64 lifetime_secs;
   int http_status;
 
   g_assert (self->valid);
@@ -1328,6 +1653,14 @@ flatpak_oci_registry_get_token (FlatpakOciRegistry *self,
   if (self->dfd != -1)
     return g_strdup (""); // No tokens for local repos
 
+  cache_key = get_token_cache_key (self, repository, basic_auth);
+  token = lookup_cached_token (cache_key);
+  if (token != NULL)
+    {
+      g_info ("Reusing cached token for %s", repository);
+      return g_steal_pointer (&token);
+    }
+
   uri_s = parse_relative_uri (self->base_uri, subpath, error);
   if (uri_s == NULL)
     return NULL;
@@ -1342,7 +1675,11 @@ flatpak_oci_registry_get_token (FlatpakOciRegistry *self,
     return NULL;
 
   if (http_status >= 200 && http_status < 300)
-    return g_strdup ("");
+    {
+      /* No token needed, remember that too */
+      cache_token (cache_key, "", TOKEN_CACHE_DEFAULT_LIFETIME_SECS);
+      return g_strdup ("");
+    }
 
   if (http_status != 401 /* UNAUTHORIZED */)
     {
@@ -1357,10 +1694,13 @@ flatpak_oci_registry_get_token (FlatpakOciRegistry *self,
       return NULL;
     }
 
-  token = get_token_for_www_auth (self, repository, www_authenticate, basic_auth, cancellable, error);
+  token = get_token_for_www_auth (self, repository, www_authenticate, basic_auth,
+                                  &lifetime_secs, cancellable, error);
   if (token == NULL)
     return NULL;
 
+  cache_token (cache_key, token, lifetime_secs);
+
   return g_steal_pointer (&token);
 }
 
@@ -1484,6 +1824,111 @@ flatpak_oci_registry_load_image_config (FlatpakOciRegistry *self,
   return flatpak_oci_image_from_json (bytes, error);
 }
 
+/* libarchive hands the tar stream to the writer in blocks of this size,
+ * while still padding the end of the stream to the usual 10k tar records,
+ * so the output is the same as with its defaults */
+#define LAYER_WRITER_BLOCK_SIZE (1024 * 1024)
+#define LAYER_WRITER_RECORD_SIZE 10240
+#define LAYER_WRITER_COMPRESSED_BUFFER_SIZE (256 * 1024)
+
+/* Checksums the uncompressed blocks on a second thread while the writer
+ * compresses the same block, without copying it */
+typedef struct
+{
+  GThread      *thread;
+  GMutex        mutex;
+  GCond         cond;
+  GChecksum    *checksum;
+  const guchar *data;
+  gsize         len;
+  gboolean      quit;
+} ChecksumThread;
+
+static gpointer
+checksum_thread_func (gpointer user_data)
+{
+  ChecksumThread *ct = user_data;
+
+  g_mutex_lock (&ct->mutex);
+  while (TRUE)
+    {
+      const guchar *data;
+      gsize len;
+
+      while (ct->data == NULL && !ct->quit)
+        g_cond_wait (&ct->cond, &ct->mutex);
+
+      if (ct->data == NULL)
+        break;
+
+      data = ct->data;
+      len = ct->len;
+      g_mutex_unlock (&ct->mutex);
+
+      g_checksum_update (ct->checksum, data, len);
+
+      g_mutex_lock (&ct->mutex);
+      ct->data = NULL;
+      g_cond_broadcast (&ct->cond);
+    }
+  g_mutex_unlock (&ct->mutex);
+
+  return NULL;
+}
+
+static void
+checksum_thread_start (ChecksumThread *ct,
+                       GChecksum      *checksum)
+{
+  g_mutex_init (&ct->mutex);
+  g_cond_init (&ct->cond);
+  ct->checksum = checksum;
+  ct->data = NULL;
+  ct->quit = FALSE;
+  ct->thread = g_thread_new ("flatpak-oci-checksum", checksum_thread_func, ct);
+}
+
+/* @data must stay valid until checksum_thread_wait() returns */
+static void
+checksum_thread_update (ChecksumThread *ct,
+                        const void     *data,
+                        gsize           len)
+{
+  if (len == 0)
+    return;
+
+  g_mutex_lock (&ct->mutex);
+  ct->data = data;
+  ct->len = len;
+  g_cond_broadcast (&ct->cond);
+  g_mutex_unlock (&ct->mutex);
+}
+
+static void
+checksum_thread_wait (ChecksumThread *ct)
+{
+  g_mutex_lock (&ct->mutex);
+  while (ct->data != NULL)
+    g_cond_wait (&ct->cond, &ct->mutex);
+  g_mutex_unlock (&ct->mutex);
+}
+
+static void
+checksum_thread_stop (ChecksumThread *ct)
+{
+  if (ct->thread == NULL)
+    return;
+
+  g_mutex_lock (&ct->mutex);
+  ct->quit = TRUE;
+  g_cond_broadcast (&ct->cond);
+  g_mutex_unlock (&ct->mutex);
+
+  g_thread_join (g_steal_pointer (&ct->thread));
+  g_mutex_clear (&ct->mutex);
+  g_cond_clear (&ct->cond);
+}
+
 struct FlatpakOciLayerWriter
 {
   GObject             parent;
@@ -1493,6 +1938,8 @@ struct FlatpakOciLayerWriter
 
   GChecksum          *uncompressed_checksum;
   GChecksum          *compressed_checksum;
+  ChecksumThread      uncompressed_checksum_thread;
+  guchar             *compressed_buffer;
   struct archive     *archive;
   GConverter         *compressor;
   guint64             uncompressed_size;
@@ -1531,6 +1978,8 @@ flatpak_oci_layer_writer_finalize (GObject *object)
 
   flatpak_oci_layer_writer_reset (self);
 
+  checksum_thread_stop (&self->uncompressed_checksum_thread);
+  g_free (self->compressed_buffer);
   g_checksum_free (self->compressed_checksum);
   g_checksum_free (self->uncompressed_checksum);
   glnx_tmpfile_clear (&self->tmpf);
@@ -1553,6 +2002,7 @@ flatpak_oci_layer_writer_init (FlatpakOciLayerWriter *self)
 {
   self->uncompressed_checksum = g_checksum_new (G_CHECKSUM_SHA256);
   self->compressed_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  self->compressed_buffer = g_malloc (LAYER_WRITER_COMPRESSED_BUFFER_SIZE);
 }
 
 static int
@@ -1562,13 +2012,14 @@ flatpak_oci_layer_writer_open_cb (struct archive *archive,
   return ARCHIVE_OK;
 }
 
+/* Compresses all of @buffer, the uncompressed checksum is left to the
+ * caller */
 static gssize
 flatpak_oci_layer_writer_compress (FlatpakOciLayerWriter *self,
                                    const void            *buffer,
                                    size_t                 length,
                                    gboolean               at_end)
 {
-  guchar compressed_buffer[8192];
   GConverterResult res;
   gsize total_bytes_read, bytes_read, bytes_written, to_write_len;
   guchar *to_write;
@@ -1584,8 +2035,9 @@ flatpak_oci_layer_writer_compress (FlatpakOciLayerWriter *self,
   do
     {
       res = g_converter_convert (self->compressor,
-                                 buffer, length,
-                                 compressed_buffer, sizeof (compressed_buffer),
+                                 (const guchar *) buffer + total_bytes_read,
+                                 length - total_bytes_read,
+                                 self->compressed_buffer, LAYER_WRITER_COMPRESSED_BUFFER_SIZE,
                                  flags, &bytes_read, &bytes_written,
                                  &local_error);
       if (res == G_CONVERTER_ERROR)
@@ -1594,13 +2046,12 @@ flatpak_oci_layer_writer_compress (FlatpakOciLayerWriter *self,
           return -1;
         }
 
-      g_checksum_update (self->uncompressed_checksum, buffer, bytes_read);
-      g_checksum_update (self->compressed_checksum, compressed_buffer, bytes_written);
+      g_checksum_update (self->compressed_checksum, self->compressed_buffer, bytes_written);
       self->uncompressed_size += bytes_read;
       self->compressed_size += bytes_written;
 
       to_write_len = bytes_written;
-      to_write = compressed_buffer;
+      to_write = self->compressed_buffer;
       while (to_write_len > 0)
         {
           ssize_t result = write (self->tmpf.fd, to_write, to_write_len);
@@ -1618,7 +2069,7 @@ flatpak_oci_layer_writer_compress (FlatpakOciLayerWriter *self,
 
       total_bytes_read += bytes_read;
     }
-  while ((length > 0 && bytes_read == 0) || /* Repeat if we consumed nothing */
+  while (total_bytes_read < length || /* Repeat until all input is consumed */
          (at_end && res != G_CONVERTER_FINISHED)); /* Or until finished if at_end */
 
   return total_bytes_read;
@@ -1631,8 +2082,15 @@ flatpak_oci_layer_writer_write_cb (struct archive *archive,
                                    size_t          length)
 {
   FlatpakOciLayerWriter *self = FLATPAK_OCI_LAYER_WRITER (client_data);
+  gssize res;
 
-  return flatpak_oci_layer_writer_compress (self, buffer, length, FALSE);
+  /* The block belongs to libarchive, so wait for the checksum before
+   * returning, even on errors */
+  checksum_thread_update (&self->uncompressed_checksum_thread, buffer, length);
+  res = flatpak_oci_layer_writer_compress (self, buffer, length, FALSE);
+  checksum_thread_wait (&self->uncompressed_checksum_thread);
+
+  return res;
 }
 
 static int
@@ -1650,9 +2108,13 @@ flatpak_oci_layer_writer_close_cb (struct archive *archive,
   return ARCHIVE_OK;
 }
 
+/* A @compression_level of 0 or less uses the default for the format, and
+ * @n_jobs > 1 compresses zstd layers on that many threads. */
 FlatpakOciLayerWriter *
 flatpak_oci_registry_write_layer (FlatpakOciRegistry         *self,
                                   FlatpakOciWriteLayerFlags  flags,
+                                  int                        compression_level,
+                                  int                        n_jobs,
                                   GCancellable               *cancellable,
                                   GError                    **error)
 {
@@ -1688,7 +2150,9 @@ flatpak_oci_registry_write_layer (FlatpakOciRegistry         *self,
 
   a = archive_write_new ();
   if (archive_write_set_format_pax (a) != ARCHIVE_OK ||
-      archive_write_add_filter_none (a) != ARCHIVE_OK)
+      archive_write_add_filter_none (a) != ARCHIVE_OK ||
+      archive_write_set_bytes_per_block (a, LAYER_WRITER_BLOCK_SIZE) != ARCHIVE_OK ||
+      archive_write_set_bytes_in_last_block (a, LAYER_WRITER_RECORD_SIZE) != ARCHIVE_OK)
     {
       propagate_libarchive_error (error, a);
       return NULL;
@@ -1704,6 +2168,8 @@ flatpak_oci_registry_write_layer (FlatpakOciRegistry         *self,
     }
 
   flatpak_oci_layer_writer_reset (oci_layer_writer);
+  checksum_thread_start (&oci_layer_writer->uncompressed_checksum_thread,
+                         oci_layer_writer->uncompressed_checksum);
 
   oci_layer_writer->archive = g_steal_pointer (&a);
   /* Transfer ownership of the tmpfile */
@@ -1725,7 +2191,8 @@ flatpak_oci_registry_write_layer (FlatpakOciRegistry         *self,
        */
 #ifdef HAVE_ZSTD
       oci_layer_writer->compressor =
-        G_CONVERTER (flatpak_zstd_compressor_new (9));
+        G_CONVERTER (flatpak_zstd_compressor_new (compression_level > 0 ? compression_level : 9,
+                                                  n_jobs > 1 ? n_jobs : 0));
 #else
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
                    _("Flatpak was compiled without zstd support"));
@@ -1735,7 +2202,8 @@ flatpak_oci_registry_write_layer (FlatpakOciRegistry         *self,
   else
     {
       oci_layer_writer->compressor =
-        G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+        G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP,
+                                            compression_level > 0 ? compression_level : -1));
     }
 
   return g_steal_pointer (&oci_layer_writer);
@@ -1789,10 +2257,14 @@ flatpak_oci_layer_writer_get_archive (FlatpakOciLayerWriter *self)
 
 typedef struct
 {
-  int        fd;
-  GChecksum *checksum;
-  char       buffer[16 * 1024];
-  gboolean   at_end;
+  int                    fd;
+  GChecksum             *checksum;
+  char                   buffer[16 * 1024];
+  gboolean               at_end;
+  FlatpakLoadUriProgress progress_cb;
+  gpointer               progress_data;
+  guint64                bytes_read;
+  gint64                 last_progress;
 } FlatpakArchiveReadWithChecksum;
 
 static int
@@ -1823,6 +2295,18 @@ checksum_read_cb (struct archive *a, void *user_data, const void **buff)
 
   g_checksum_update (data->checksum, (guchar *) data->buffer, bytes_read);
 
+  data->bytes_read += bytes_read;
+  if (data->progress_cb)
+    {
+      gint64 now = g_get_monotonic_time ();
+
+      if (now - data->last_progress >= 100 * G_TIME_SPAN_MILLISECOND)
+        {
+          data->last_progress = now;
+          data->progress_cb (data->bytes_read, data->progress_data);
+        }
+    }
+
   return bytes_read;
 }
 
@@ -1836,6 +2320,10 @@ checksum_skip_cb (struct archive *a, void *user_data, int64_t request)
       ((new_offset = lseek (data->fd, request, SEEK_CUR)) >= 0))
     return new_offset - old_offset;
 
+  /* Not seekable (i.e. a streamed layer), let libarchive read instead */
+  if (errno == ESPIPE)
+    return 0;
+
   archive_set_error (a, errno, "Error seeking");
   return -1;
 }
@@ -1867,16 +2355,20 @@ checksum_close_cb (struct archive *a, void *user_data)
   return ARCHIVE_OK;
 }
 
-gboolean
-flatpak_archive_read_open_fd_with_checksum (struct archive *a,
-                                            int             fd,
-                                            GChecksum      *checksum,
-                                            GError        **error)
+static gboolean
+archive_read_open_fd_with_checksum_full (struct archive        *a,
+                                         int                    fd,
+                                         GChecksum             *checksum,
+                                         FlatpakLoadUriProgress progress_cb,
+                                         gpointer               progress_data,
+                                         GError               **error)
 {
   FlatpakArchiveReadWithChecksum *data = g_new0 (FlatpakArchiveReadWithChecksum, 1);
 
   data->fd = fd;
   data->checksum = checksum;
+  data->progress_cb = progress_cb;
+  data->progress_data = progress_data;
 
   if (archive_read_open2 (a, data,
                           checksum_open_cb,
@@ -1888,6 +2380,15 @@ flatpak_archive_read_open_fd_with_checksum (struct archive *a,
   return TRUE;
 }
 
+gboolean
+flatpak_archive_read_open_fd_with_checksum (struct archive *a,
+                                            int             fd,
+                                            GChecksum      *checksum,
+                                            GError        **error)
+{
+  return archive_read_open_fd_with_checksum_full (a, fd, checksum, NULL, NULL, error);
+}
+
 enum {
       DELTA_OP_DATA = 0,
       DELTA_OP_OPEN = 1,
@@ -2101,8 +2602,8 @@ flatpak_oci_registry_apply_delta_stream (FlatpakOciRegistry    *self,
                                          GError               **error)
 {
   g_autoptr(GInputStream) in_raw = g_unix_input_stream_new (delta_fd, FALSE);
+  g_autoptr(GInputStream) zstd_in = NULL;
   g_autoptr(GInputStream) in = NULL;
-  FlatpakZstdDecompressor *zstd;
   char header[8];
   g_autofree guchar *buffer1 = g_malloc (DELTA_BUFFER_SIZE);
   g_autofree guchar *buffer2 = g_malloc (DELTA_BUFFER_SIZE);
@@ -2114,9 +2615,9 @@ flatpak_oci_registry_apply_delta_stream (FlatpakOciRegistry    *self,
   if (memcmp (header, DELTA_HEADER, DELTA_HEADER_LEN) != 0)
     return flatpak_fail (error, _("Invalid delta file format"));
 
-  zstd = flatpak_zstd_decompressor_new ();
-  in = g_converter_input_stream_new (in_raw, G_CONVERTER (zstd));
-  g_object_unref (zstd);
+  /* The operations are read a byte at a time, so buffer the output too */
+  zstd_in = flatpak_zstd_input_stream_new (in_raw);
+  in = g_buffered_input_stream_new_sized (zstd_in, DELTA_BUFFER_SIZE);
 
   while (TRUE)
     {
@@ -2473,10 +2974,30 @@ compare_image_by_ref (ImageInfo *a,
   return g_strcmp0 (a_ref, b_ref);
 }
 
-gboolean
-flatpak_oci_index_ensure_cached (FlatpakHttpSession *http_session,
-                                 const char         *uri,
-                                 GFile              *index,
+/* Returns the sha256 of the cached index file at @path, or %NULL if
+ * there is no (readable) cached file. */
+static char *
+checksum_cached_index (const char  *path,
+                       struct stat *stbuf_out)
+{
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+
+  if (stat (path, stbuf_out) != 0)
+    return NULL;
+
+  mfile = g_mapped_file_new (path, FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  return g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
+}
+
+gboolean
+flatpak_oci_index_ensure_cached (FlatpakHttpSession *http_session,
+                                 const char         *uri,
+                                 GFile              *index,
                                  char              **index_uri_out,
                                  GCancellable       *cancellable,
                                  GError            **error)
@@ -2492,6 +3013,8 @@ flatpak_oci_index_ensure_cached (FlatpakHttpSession *http_session,
   gboolean success = FALSE;
   g_autoptr(FlatpakCertificates) certificates = NULL;
   g_autoptr(GError) local_error = NULL;
+  g_autofree char *old_checksum = NULL;
+  struct stat old_stbuf;
   GUri *tmp_uri;
 
   if (!g_str_has_prefix (uri, "oci+http:") && !g_str_has_prefix (uri, "oci+https:"))
@@ -2581,6 +3104,8 @@ flatpak_oci_index_ensure_cached (FlatpakHttpSession *http_session,
       return FALSE;
     }
 
+  old_checksum = checksum_cached_index (index_path, &old_stbuf);
+
   success = flatpak_cache_http_uri (http_session,
                                     query_uri_s,
                                     certificates,
@@ -2589,6 +3114,32 @@ flatpak_oci_index_ensure_cached (FlatpakHttpSession *http_session,
                                     NULL, NULL,
                                     cancellable, &local_error);
 
+  /* Many registries serve the index without an ETag or Last-Modified
+   * header, so we get the full index back even if nothing changed. The
+   * summary and appstream generated from the index are only redone when
+   * the index is newer than them, so if the content is the same, put back
+   * the old mtime and treat it like a 304 to avoid re-parsing it all. */
+  if (success && old_checksum != NULL)
+    {
+      g_autofree char *new_checksum = NULL;
+      struct stat new_stbuf;
+
+      new_checksum = checksum_cached_index (index_path, &new_stbuf);
+      if (g_strcmp0 (old_checksum, new_checksum) == 0)
+        {
+          struct timespec times[2] = { old_stbuf.st_atim, old_stbuf.st_mtim };
+
+          if (utimensat (AT_FDCWD, index_path, times, 0) == 0)
+            {
+              g_info ("OCI index %s is unchanged", query_uri_s);
+              g_set_error (&local_error, FLATPAK_HTTP_ERROR,
+                           FLATPAK_HTTP_ERROR_NOT_CHANGED,
+                           "Index unchanged");
+              success = FALSE;
+            }
+        }
+    }
+
   if (success ||
       g_error_matches (local_error, FLATPAK_HTTP_ERROR, FLATPAK_HTTP_ERROR_NOT_CHANGED))
     {
@@ -2625,8 +3176,8 @@ load_oci_index (GFile        *index,
   decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
   converter = g_converter_input_stream_new (G_INPUT_STREAM (in), G_CONVERTER (decompressor));
 
-  json = flatpak_json_from_stream (G_INPUT_STREAM (converter), FLATPAK_TYPE_OCI_INDEX_RESPONSE,
-                                   cancellable, error);
+  json = flatpak_json_from_stream_direct (G_INPUT_STREAM (converter), FLATPAK_TYPE_OCI_INDEX_RESPONSE,
+                                          cancellable, error);
   if (json == NULL)
     return NULL;
 
@@ -2817,18 +3368,134 @@ flatpak_oci_index_make_summary (GFile        *index,
   return g_steal_pointer (&summary);
 }
 
+/* How many icons we download at the same time when making the appstream */
+#define MAX_PARALLEL_ICON_DOWNLOADS 8
+
+typedef struct
+{
+  FlatpakHttpSession  *http_session;
+  FlatpakCertificates *certificates;
+  int                  icons_dfd;
+  GHashTable          *used_icons;
+  GCancellable        *cancellable;
+  GMainContext        *context;
+  GQueue               queued;    /* IconDownload */
+  guint                n_running;
+} IconDownloads;
+
+typedef struct
+{
+  IconDownloads *downloads;
+  char          *repository_name;
+  char          *subdir;
+  char          *uri;
+  char          *icon_path;
+} IconDownload;
+
+static void
+icon_download_free (IconDownload *download)
+{
+  g_free (download->repository_name);
+  g_free (download->subdir);
+  g_free (download->uri);
+  g_free (download->icon_path);
+  g_free (download);
+}
+
+static void icon_downloads_start_queued (IconDownloads *downloads);
+
+static void
+icon_download_cb (GObject      *source,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  IconDownload *download = user_data;
+  IconDownloads *downloads = download->downloads;
+  g_autoptr(GError) local_error = NULL;
+
+  if (flatpak_cache_http_uri_finish (result, &local_error) ||
+      g_error_matches (local_error, FLATPAK_HTTP_ERROR, FLATPAK_HTTP_ERROR_NOT_CHANGED))
+    g_hash_table_replace (downloads->used_icons, g_steal_pointer (&download->icon_path), GUINT_TO_POINTER (1));
+  else
+    g_print ("%s: Failed to add %s icon: %s\n",
+             download->repository_name,
+             download->subdir,
+             local_error->message);
+
+  icon_download_free (download);
+
+  downloads->n_running--;
+  icon_downloads_start_queued (downloads);
+}
+
+static void
+icon_downloads_start_queued (IconDownloads *downloads)
+{
+  while (downloads->n_running < MAX_PARALLEL_ICON_DOWNLOADS &&
+         !g_queue_is_empty (&downloads->queued))
+    {
+      IconDownload *download = g_queue_pop_head (&downloads->queued);
+
+      downloads->n_running++;
+      flatpak_cache_http_uri_async (downloads->http_session, download->uri, downloads->certificates,
+                                    0 /* flags */,
+                                    downloads->icons_dfd, download->icon_path,
+                                    NULL, NULL,
+                                    downloads->cancellable,
+                                    icon_download_cb, download);
+    }
+}
+
+/* Downloads all the queued icons, a few at a time. The http cache
+ * revalidates icons we already have, so unchanged ones aren't downloaded
+ * again. */
+static void
+icon_downloads_run (IconDownloads *downloads)
+{
+  g_main_context_push_thread_default (downloads->context);
+
+  icon_downloads_start_queued (downloads);
+  while (downloads->n_running > 0)
+    g_main_context_iteration (downloads->context, TRUE);
+
+  g_main_context_pop_thread_default (downloads->context);
+}
+
+/* Whether the file at @path already has the given contents */
+static gboolean
+file_has_contents_at (int           dfd,
+                      const char   *path,
+                      const guint8 *data,
+                      gsize         data_size)
+{
+  glnx_autofd int fd = -1;
+  struct stat stbuf;
+  g_autoptr(GBytes) contents = NULL;
+
+  if (!glnx_openat_rdonly (dfd, path, TRUE, &fd, NULL) ||
+      fstat (fd, &stbuf) != 0 ||
+      (gsize) stbuf.st_size != data_size)
+    return FALSE;
+
+  contents = glnx_fd_readall_bytes (fd, NULL, NULL);
+  if (contents == NULL)
+    return FALSE;
+
+  return g_bytes_get_size (contents) == data_size &&
+         memcmp (g_bytes_get_data (contents, NULL), data, data_size) == 0;
+}
+
 static gboolean
-add_icon_image (FlatpakHttpSession  *http_session,
+add_icon_image (IconDownloads       *downloads,
                 const char          *index_uri,
-                FlatpakCertificates *certificates,
-                int                  icons_dfd,
-                GHashTable          *used_icons,
+                const char          *repository_name,
                 const char          *subdir,
                 const char          *id,
                 const char          *icon_data,
-                GCancellable        *cancellable,
                 GError             **error)
 {
+  int icons_dfd = downloads->icons_dfd;
+  GCancellable *cancellable = downloads->cancellable;
   g_autofree char *icon_name = g_strconcat (id, ".png", NULL);
   g_autofree char *icon_path = g_build_filename (subdir, icon_name, NULL);
 
@@ -2845,12 +3512,14 @@ add_icon_image (FlatpakHttpSession  *http_session,
           gsize decoded_size;
           g_autofree guint8 *decoded = g_base64_decode (base64_data, &decoded_size);
 
-          if (!glnx_file_replace_contents_at (icons_dfd, icon_path,
+          /* Most icons don't change between updates, avoid rewriting them */
+          if (!file_has_contents_at (icons_dfd, icon_path, decoded, decoded_size) &&
+              !glnx_file_replace_contents_at (icons_dfd, icon_path,
                                               decoded, decoded_size,
                                               0 /* flags */, cancellable, error))
             return FALSE;
 
-          g_hash_table_replace (used_icons, g_steal_pointer (&icon_path), GUINT_TO_POINTER (1));
+          g_hash_table_replace (downloads->used_icons, g_steal_pointer (&icon_path), GUINT_TO_POINTER (1));
 
           return TRUE;
         }
@@ -2865,36 +3534,29 @@ add_icon_image (FlatpakHttpSession  *http_session,
     {
       g_autoptr(GUri) base_uri = g_uri_parse (index_uri, FLATPAK_HTTP_URI_FLAGS | G_URI_FLAGS_PARSE_RELAXED, NULL);
       g_autofree char *icon_uri_s = NULL;
-      g_autoptr(GError) local_error = NULL;
+      IconDownload *download;
 
       icon_uri_s = parse_relative_uri (base_uri, icon_data, error);
       if (icon_uri_s == NULL)
         return FALSE;
 
-      if (!flatpak_cache_http_uri (http_session, icon_uri_s, certificates,
-                                   0 /* flags */,
-                                   icons_dfd, icon_path,
-                                   NULL, NULL,
-                                   cancellable, &local_error) &&
-          !g_error_matches (local_error, FLATPAK_HTTP_ERROR, FLATPAK_HTTP_ERROR_NOT_CHANGED))
-        {
-          g_propagate_error (error, g_steal_pointer (&local_error));
-          return FALSE;
-        }
-
-      g_hash_table_replace (used_icons, g_steal_pointer (&icon_path), GUINT_TO_POINTER (1));
+      /* The icon is marked as used once it has been downloaded */
+      download = g_new0 (IconDownload, 1);
+      download->downloads = downloads;
+      download->repository_name = g_strdup (repository_name);
+      download->subdir = g_strdup (subdir);
+      download->uri = g_steal_pointer (&icon_uri_s);
+      download->icon_path = g_steal_pointer (&icon_path);
+      g_queue_push_tail (&downloads->queued, download);
 
       return TRUE;
     }
 }
 
 static void
-add_image_to_appstream (FlatpakHttpSession        *http_session,
+add_image_to_appstream (IconDownloads             *downloads,
                         const char                *index_uri,
-                        FlatpakCertificates       *certificates,
                         FlatpakXml                *appstream_root,
-                        int                        icons_dfd,
-                        GHashTable                *used_icons,
                         FlatpakOciIndexRepository *repository,
                         FlatpakOciIndexImage      *image,
                         GCancellable              *cancellable)
@@ -2981,13 +3643,11 @@ add_image_to_appstream (FlatpakHttpSession        *http_session,
       const char *icon_data = get_image_metadata (image, icon_sizes[i].label);
       if (icon_data)
         {
-          if (!add_icon_image (http_session,
+          if (!add_icon_image (downloads,
                                index_uri,
-                               certificates,
-                               icons_dfd,
-                               used_icons,
+                               repository->name,
                                icon_sizes[i].subdir, id, icon_data,
-                               cancellable, &error))
+                               &error))
             {
               g_print ("%s: Failed to add %s icon: %s\n",
                        repository->name,
@@ -3080,7 +3740,9 @@ flatpak_oci_index_make_appstream (FlatpakHttpSession *http_session,
   g_autoptr(GBytes) bytes = NULL;
   g_autoptr(GHashTable) used_icons = NULL;
   g_autoptr(FlatpakCertificates) certificates = NULL;
+  g_autoptr(GMainContext) context = NULL;
   g_autoptr(GError) local_error = NULL;
+  IconDownloads downloads = { 0, };
   int i;
 
   const char *oci_arch = flatpak_arch_to_oci_arch (arch);
@@ -3102,6 +3764,16 @@ flatpak_oci_index_make_appstream (FlatpakHttpSession *http_session,
       g_clear_error (&local_error);
     }
 
+  context = g_main_context_new ();
+
+  downloads.http_session = http_session;
+  downloads.certificates = certificates;
+  downloads.icons_dfd = icons_dfd;
+  downloads.used_icons = used_icons;
+  downloads.cancellable = cancellable;
+  downloads.context = context;
+  g_queue_init (&downloads.queued);
+
   for (i = 0; response->results != NULL && response->results[i] != NULL; i++)
     {
       FlatpakOciIndexRepository *r = response->results[i];
@@ -3111,9 +3783,8 @@ flatpak_oci_index_make_appstream (FlatpakHttpSession *http_session,
         {
           FlatpakOciIndexImage *image = r->images[j];
           if (g_strcmp0 (image->architecture, oci_arch) == 0)
-            add_image_to_appstream (http_session,
-                                    index_uri, certificates,
-                                    appstream_root, icons_dfd, used_icons,
+            add_image_to_appstream (&downloads, index_uri,
+                                    appstream_root,
                                     r, image,
                                     cancellable);
         }
@@ -3127,15 +3798,16 @@ flatpak_oci_index_make_appstream (FlatpakHttpSession *http_session,
             {
               FlatpakOciIndexImage *image = list->images[k];
               if (g_strcmp0 (image->architecture, oci_arch) == 0)
-                add_image_to_appstream (http_session,
-                                        index_uri, certificates,
-                                        appstream_root, icons_dfd, used_icons,
+                add_image_to_appstream (&downloads, index_uri,
+                                        appstream_root,
                                         r, image,
                                         cancellable);
             }
         }
     }
 
+  icon_downloads_run (&downloads);
+
   if (g_cancellable_set_error_if_cancelled (cancellable, error))
     return NULL;
 
@@ -3171,6 +3843,348 @@ oci_layer_progress (guint64  downloaded_bytes,
                                 progress_data->progress_user_data);
 }
 
+/* The most layer blobs downloaded at the same time */
+#define MAX_PARALLEL_OCI_LAYER_DOWNLOADS 4
+
+/* Layers at least this big are streamed into the import instead of being
+ * downloaded to a temporary file first */
+#define OCI_LAYER_STREAM_MIN_SIZE (64 * 1024 * 1024)
+
+typedef enum {
+  OCI_LAYER_DOWNLOAD, /* Download to a temporary fd, ahead of time */
+  OCI_LAYER_MIRROR,   /* Mirror into pull->dst_registry, ahead of time */
+  OCI_LAYER_STREAM,   /* Stream into a socket when the caller gets to it */
+} OciLayerMode;
+
+typedef struct OciLayerPull OciLayerPull;
+
+typedef struct {
+  OciLayerPull *pull;
+  const char   *digest;
+  const char  **urls;
+  OciLayerMode  mode;
+  guint64       size;
+  guint64       downloaded; /* protected by pull->lock */
+  gboolean      done;       /* protected by pull->lock */
+  int           fd;
+  GError       *error;
+  GThread      *stream_thread;
+  GIOStream    *stream_connection;
+} OciLayerDownload;
+
+struct OciLayerPull {
+  FlatpakOciRegistry *registry;
+  FlatpakOciRegistry *dst_registry;
+  const char         *repository;
+  GCancellable       *cancellable;
+  GCancellable       *parent_cancellable;
+  gulong              cancelled_id;
+  GMutex              lock;
+  GCond               cond;
+  GThreadPool        *pool;
+  OciLayerDownload   *downloads;
+  guint               n_downloads;
+};
+
+static void
+oci_layer_download_progress (guint64  downloaded_bytes,
+                             gpointer user_data)
+{
+  OciLayerDownload *download = user_data;
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&download->pull->lock);
+
+  download->downloaded = downloaded_bytes;
+}
+
+static void
+oci_layer_download_thread_func (gpointer data,
+                                gpointer user_data)
+{
+  OciLayerDownload *download = data;
+  OciLayerPull *pull = user_data;
+  g_autoptr(GMutexLocker) locker = NULL;
+  GError *local_error = NULL;
+  int fd = -1;
+
+  FLATPAK_TRACE1 (oci_layer_start, download->digest);
+
+  if (!g_cancellable_set_error_if_cancelled (pull->cancellable, &local_error))
+    {
+      if (download->mode == OCI_LAYER_MIRROR)
+        flatpak_oci_registry_mirror_blob (pull->dst_registry, pull->registry, pull->repository, FALSE,
+                                          download->digest, download->urls,
+                                          oci_layer_download_progress, download,
+                                          pull->cancellable, &local_error);
+      else
+        fd = flatpak_oci_registry_download_blob (pull->registry, pull->repository, FALSE,
+                                                 download->digest, download->urls,
+                                                 oci_layer_download_progress, download,
+                                                 pull->cancellable, &local_error);
+    }
+
+  locker = g_mutex_locker_new (&pull->lock);
+  download->fd = fd;
+  download->error = local_error;
+  download->done = TRUE;
+  FLATPAK_TRACE3 (oci_layer_done, download->digest, local_error == NULL, download->downloaded);
+  g_cond_signal (&pull->cond);
+}
+
+static gpointer
+oci_layer_stream_thread_func (gpointer data)
+{
+  OciLayerDownload *download = data;
+  OciLayerPull *pull = download->pull;
+  GOutputStream *out = g_io_stream_get_output_stream (download->stream_connection);
+  g_autoptr(GMutexLocker) locker = NULL;
+  GError *local_error = NULL;
+
+  FLATPAK_TRACE1 (oci_layer_start, download->digest);
+
+  /* GSocket sends with MSG_NOSIGNAL, so if the reading side goes away
+   * early this fails with EPIPE rather than killing us with SIGPIPE */
+  download_blob_to_stream (pull->registry, pull->repository, FALSE,
+                           download->digest, download->urls, out,
+                           oci_layer_download_progress, download,
+                           pull->cancellable, &local_error);
+
+  /* Closing our end is what signals EOF to the reader */
+  g_io_stream_close (download->stream_connection, NULL, NULL);
+
+  locker = g_mutex_locker_new (&pull->lock);
+  download->error = local_error;
+  download->done = TRUE;
+  FLATPAK_TRACE3 (oci_layer_done, download->digest, local_error == NULL, download->downloaded);
+  g_cond_signal (&pull->cond);
+
+  return NULL;
+}
+
+static int
+oci_layer_pull_start_stream (OciLayerPull     *pull,
+                             OciLayerDownload *download,
+                             GError          **error)
+{
+  g_autoptr(GSocket) socket = NULL;
+  int sv[2];
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+    {
+      glnx_set_error_from_errno (error);
+      return -1;
+    }
+
+  socket = g_socket_new_from_fd (sv[1], error);
+  if (socket == NULL)
+    {
+      close (sv[0]);
+      close (sv[1]);
+      return -1;
+    }
+
+  download->stream_connection = G_IO_STREAM (g_socket_connection_factory_create_connection (socket));
+  download->stream_thread = g_thread_new ("oci-layer-stream", oci_layer_stream_thread_func, download);
+
+  return sv[0];
+}
+
+static void
+cancel_oci_layer_pull_cb (GCancellable *cancellable,
+                          GCancellable *pull_cancellable)
+{
+  g_cancellable_cancel (pull_cancellable);
+}
+
+/* Downloads the layer blobs of an image on a few worker threads, while the
+ * caller consumes them one at a time, in layer order, with
+ * oci_layer_pull_wait(). Call oci_layer_pull_add() for every layer, in
+ * order, then oci_layer_pull_start(). */
+static OciLayerPull *
+oci_layer_pull_new (FlatpakOciRegistry *registry,
+                    FlatpakOciRegistry *dst_registry,
+                    const char         *repository,
+                    guint               n_layers,
+                    GCancellable       *cancellable)
+{
+  OciLayerPull *pull = g_new0 (OciLayerPull, 1);
+
+  pull->registry = registry;
+  pull->dst_registry = dst_registry;
+  pull->repository = repository;
+  pull->cancellable = g_cancellable_new ();
+  pull->downloads = g_new0 (OciLayerDownload, n_layers);
+  g_mutex_init (&pull->lock);
+  g_cond_init (&pull->cond);
+
+  if (cancellable)
+    {
+      pull->parent_cancellable = g_object_ref (cancellable);
+      pull->cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (cancel_oci_layer_pull_cb),
+                                                  pull->cancellable, NULL);
+    }
+
+  return pull;
+}
+
+static void
+oci_layer_pull_add (OciLayerPull *pull,
+                    const char   *digest,
+                    const char  **urls,
+                    guint64       size,
+                    OciLayerMode  mode)
+{
+  OciLayerDownload *download = &pull->downloads[pull->n_downloads++];
+
+  /* Streaming only makes sense from an actual remote */
+  if (mode == OCI_LAYER_STREAM && flatpak_oci_registry_is_local (pull->registry))
+    mode = OCI_LAYER_DOWNLOAD;
+
+  download->pull = pull;
+  download->digest = digest;
+  download->urls = urls;
+  download->size = size;
+  download->mode = mode;
+  download->fd = -1;
+}
+
+static void
+oci_layer_pull_start (OciLayerPull *pull)
+{
+  pull->pool = g_thread_pool_new (oci_layer_download_thread_func, pull,
+                                  CLAMP (pull->n_downloads, 1, MAX_PARALLEL_OCI_LAYER_DOWNLOADS),
+                                  FALSE, NULL);
+
+  /* The pool runs the jobs in the order they are pushed, so the first
+   * layers are always the first ones to be downloaded. Streamed layers
+   * only start once the caller is ready to read them. */
+  for (guint i = 0; i < pull->n_downloads; i++)
+    {
+      if (pull->downloads[i].mode != OCI_LAYER_STREAM)
+        g_thread_pool_push (pull->pool, &pull->downloads[i], NULL);
+    }
+}
+
+/* Waits for layer @i, reporting the combined progress of all the
+ * downloads meanwhile. Progress is only reported from the calling thread.
+ * Returns the fd of the downloaded blob, or 0 for mirrored ones.
+ *
+ * For streamed layers this returns right away with the reading end of a
+ * socket, and the digest of what is read from it is not verified. The
+ * caller has to read it to EOF (or close it) and then get the result of
+ * the download with oci_layer_pull_finish(). */
+static int
+oci_layer_pull_wait (OciLayerPull               *pull,
+                     guint                       i,
+                     FlatpakOciPullProgressData *progress_data,
+                     GError                    **error)
+{
+  OciLayerDownload *download = &pull->downloads[i];
+  int fd;
+
+  if (download->mode == OCI_LAYER_STREAM)
+    return oci_layer_pull_start_stream (pull, download, error);
+
+  g_mutex_lock (&pull->lock);
+  while (!download->done)
+    {
+      guint64 in_flight = 0;
+
+      g_cond_wait_until (&pull->cond, &pull->lock,
+                         g_get_monotonic_time () + 100 * G_TIME_SPAN_MILLISECOND);
+
+      for (guint j = i; j < pull->n_downloads; j++)
+        in_flight += pull->downloads[j].done ? pull->downloads[j].size : pull->downloads[j].downloaded;
+
+      g_mutex_unlock (&pull->lock);
+
+      if (progress_data->progress_cb)
+        progress_data->progress_cb (progress_data->total_size, progress_data->previous_layers_size + in_flight,
+                                    progress_data->n_layers, progress_data->pulled_layers,
+                                    progress_data->progress_user_data);
+
+      g_mutex_lock (&pull->lock);
+    }
+  g_mutex_unlock (&pull->lock);
+
+  if (download->error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&download->error));
+      return -1;
+    }
+
+  if (download->mode == OCI_LAYER_MIRROR)
+    return 0;
+
+  fd = download->fd;
+  download->fd = -1;
+  return fd;
+}
+
+static gboolean
+oci_layer_pull_is_streamed (OciLayerPull *pull,
+                            guint         i)
+{
+  return pull->downloads[i].mode == OCI_LAYER_STREAM;
+}
+
+static gboolean
+oci_layer_pull_finish (OciLayerPull *pull,
+                       guint         i,
+                       GError      **error)
+{
+  OciLayerDownload *download = &pull->downloads[i];
+
+  if (download->stream_thread == NULL)
+    return TRUE;
+
+  g_thread_join (g_steal_pointer (&download->stream_thread));
+
+  if (download->error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&download->error));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+oci_layer_pull_free (OciLayerPull *pull)
+{
+  /* Abort whatever is still running, and drop what never started */
+  g_cancellable_cancel (pull->cancellable);
+  if (pull->pool)
+    g_thread_pool_free (pull->pool, TRUE, TRUE);
+
+  /* By now the reading ends are closed, so these don't block for long */
+  for (guint i = 0; i < pull->n_downloads; i++)
+    {
+      if (pull->downloads[i].stream_thread)
+        g_thread_join (pull->downloads[i].stream_thread);
+    }
+
+  if (pull->cancelled_id != 0)
+    g_cancellable_disconnect (pull->parent_cancellable, pull->cancelled_id);
+  g_clear_object (&pull->parent_cancellable);
+  g_clear_object (&pull->cancellable);
+
+  for (guint i = 0; i < pull->n_downloads; i++)
+    {
+      OciLayerDownload *download = &pull->downloads[i];
+
+      g_clear_object (&download->stream_connection);
+      glnx_close_fd (&download->fd);
+      g_clear_error (&download->error);
+    }
+
+  g_free (pull->downloads);
+  g_mutex_clear (&pull->lock);
+  g_cond_clear (&pull->cond);
+  g_free (pull);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (OciLayerPull, oci_layer_pull_free)
+
 gboolean
 flatpak_mirror_image_from_oci (FlatpakOciRegistry    *dst_registry,
                                FlatpakImageSource    *image_source,
@@ -3198,6 +4212,7 @@ flatpak_mirror_image_from_oci (FlatpakOciRegistry    *dst_registry,
   g_autofree char *old_diffid = NULL;
   g_autoptr(FlatpakOciIndex) index = NULL;
   g_autoptr(FlatpakOciSignatures) signatures = NULL;
+  g_autoptr(OciLayerPull) layer_pull = NULL;
   int n_layers;
   int i;
 
@@ -3248,6 +4263,23 @@ flatpak_mirror_image_from_oci (FlatpakOciRegistry    *dst_registry,
                  progress_data.n_layers, progress_data.pulled_layers,
                  progress_user_data);
 
+  /* Download all the layers in parallel, but apply the deltas in order */
+  layer_pull = oci_layer_pull_new (registry, dst_registry, oci_repository, n_layers, cancellable);
+  for (i = 0; manifest->layers[i] != NULL; i++)
+    {
+      FlatpakOciDescriptor *layer = manifest->layers[i];
+      FlatpakOciDescriptor *delta_layer = NULL;
+
+      if (delta_manifest)
+        delta_layer = flatpak_oci_manifest_find_delta_for (delta_manifest, old_diffid, image_config->rootfs.diff_ids[i]);
+
+      if (delta_layer)
+        oci_layer_pull_add (layer_pull, delta_layer->digest, (const char **)delta_layer->urls, delta_layer->size, OCI_LAYER_DOWNLOAD);
+      else
+        oci_layer_pull_add (layer_pull, layer->digest, (const char **)layer->urls, layer->size, OCI_LAYER_MIRROR);
+    }
+  oci_layer_pull_start (layer_pull);
+
   for (i = 0; manifest->layers[i] != NULL; i++)
     {
       FlatpakOciDescriptor *layer = manifest->layers[i];
@@ -3260,10 +4292,7 @@ flatpak_mirror_image_from_oci (FlatpakOciRegistry    *dst_registry,
         {
           g_info ("Using OCI delta %s for layer %s", delta_layer->digest, layer->digest);
           g_autofree char *delta_digest = NULL;
-          glnx_autofd int delta_fd = flatpak_oci_registry_download_blob (registry, oci_repository, FALSE,
-                                                                         delta_layer->digest, (const char **)delta_layer->urls,
-                                                                         oci_layer_progress, &progress_data,
-                                                                         cancellable, error);
+          glnx_autofd int delta_fd = oci_layer_pull_wait (layer_pull, i, &progress_data, error);
           if (delta_fd == -1)
             return FALSE;
 
@@ -3276,9 +4305,7 @@ flatpak_mirror_image_from_oci (FlatpakOciRegistry    *dst_registry,
         }
       else
         {
-          if (!flatpak_oci_registry_mirror_blob (dst_registry, registry, oci_repository, FALSE, layer->digest, (const char **)layer->urls,
-                                                 oci_layer_progress, &progress_data,
-                                                 cancellable, error))
+          if (oci_layer_pull_wait (layer_pull, i, &progress_data, error) == -1)
             return FALSE;
         }
 
@@ -3308,65 +4335,1077 @@ flatpak_mirror_image_from_oci (FlatpakOciRegistry    *dst_registry,
   return TRUE;
 }
 
-char *
-flatpak_pull_from_oci (OstreeRepo            *repo,
-                       FlatpakImageSource    *image_source,
-                       const char            *opt_sigcheck_repository,
-                       const char            *opt_sigcheck_registry_uri,
-                       const char            *remote,
-                       const char            *ref,
-                       FlatpakPullFlags       flags,
-                       FlatpakOciPullProgress progress_cb,
-                       gpointer               progress_user_data,
-                       GCancellable          *cancellable,
-                       GError               **error)
-{
-  FlatpakOciRegistry *registry = flatpak_image_source_get_registry (image_source);
-  const char *oci_repository = flatpak_image_source_get_oci_repository (image_source);
-  const char *digest = flatpak_image_source_get_digest (image_source);
-  FlatpakOciManifest *manifest = flatpak_image_source_get_manifest (image_source);
-  const char *delta_url = flatpak_image_source_get_delta_url (image_source);
-  FlatpakOciImage *image_config = flatpak_image_source_get_image_config (image_source);
-  gboolean force_disable_deltas = (flags & FLATPAK_PULL_FLAGS_NO_STATIC_DELTAS) != 0;
-  g_autoptr(OstreeMutableTree) archive_mtree = NULL;
-  g_autoptr(GFile) archive_root = NULL;
-  g_autoptr(FlatpakOciManifest) delta_manifest = NULL;
-  g_autofree char *old_checksum = NULL;
-  g_autoptr(GVariant) old_commit = NULL;
-  g_autoptr(GFile) old_root = NULL;
-  OstreeRepoCommitState old_state = 0;
-  g_autofree char *old_diffid = NULL;
-  g_autofree char *commit_checksum = NULL;
-  const char *parent = NULL;
-  const char *manifest_ref = NULL;
-  g_autofree char *full_ref = NULL;
-  const char *diffid;
-  FlatpakOciPullProgressData progress_data = { progress_cb, progress_user_data };
-  g_autoptr(GVariantBuilder) metadata_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
-  g_autoptr(GVariant) metadata = NULL;
-  g_autoptr(FlatpakOciSignatures) signatures = NULL;
-  const char *sigcheck_registry_uri = opt_sigcheck_registry_uri ? opt_sigcheck_registry_uri : registry->uri;
-  const char *sigcheck_repository = opt_sigcheck_repository ? opt_sigcheck_repository : oci_repository;
-  int n_layers;
-  int i;
+/* zstd:chunked layers have a table of contents listing the compressed
+ * range of every file in the layer blob. With that we can use range
+ * requests to fetch just the files that changed since the commit we
+ * already have. */
 
-  g_assert (g_str_has_prefix (digest, "sha256:"));
+/* The most we accept for the table of contents, compressed or not */
+#define ZSTD_CHUNKED_MAX_TOC_SIZE (64 * 1024 * 1024)
 
-  signatures = load_signatures (image_source, cancellable, error);
-  if (!signatures)
-    return FALSE;
+/* Files up to this size are decompressed in memory, and fetched together
+ * with their neighbours in the blob using a single request */
+#define ZSTD_CHUNKED_MAX_IN_MEMORY (4 * 1024 * 1024)
 
-  if (!flatpak_oci_signatures_verify (signatures, repo, remote,
-                                      sigcheck_registry_uri,
-                                      sigcheck_repository,
-                                      digest,
-                                      error))
-    return FALSE;
+/* The most we fetch and throw away to get two files in one request. The
+ * tar headers between files are in the blob too, so there is always a gap */
+#define ZSTD_CHUNKED_MAX_GAP (16 * 1024)
 
-  manifest_ref = flatpak_image_source_get_ref (image_source);
-  if (manifest_ref == NULL)
-    {
-      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("No ref specified for OCI image %s"), digest);
+typedef struct {
+  FlatpakOciZstdChunkedTocEntry *entry;
+  char                         **components;
+  char                          *path;
+  guint64                        start;      /* Compressed range of the content */
+  guint64                        end;
+  GArray                        *frame_ends; /* Each chunk is a separate zstd frame */
+  char                          *old_checksum;
+} ZstdChunkedFile;
+
+static void
+zstd_chunked_file_free (ZstdChunkedFile *file)
+{
+  g_strfreev (file->components);
+  g_free (file->path);
+  g_array_unref (file->frame_ends);
+  g_free (file->old_checksum);
+  g_free (file);
+}
+
+typedef struct {
+  OstreeRepo                 *repo;
+  FlatpakOciRegistry         *registry;
+  OstreeMutableTree          *mtree;
+  FlatpakOciPullProgressData *progress_data;
+  char                       *uri;
+  char                       *default_dirmeta;
+  guint64                     fetched;
+  /* The compressed data we fetched last */
+  GBytes                     *data;
+  guint64                     data_start;
+  guint64                     data_end;
+} ZstdChunkedImport;
+
+static void
+zstd_chunked_import_clear (ZstdChunkedImport *import)
+{
+  g_clear_pointer (&import->uri, g_free);
+  g_clear_pointer (&import->default_dirmeta, g_free);
+  g_clear_pointer (&import->data, g_bytes_unref);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (ZstdChunkedImport, zstd_chunked_import_clear)
+
+static gboolean zstd_chunked_not_supported (GError     **error,
+                                            const char  *format,
+                                            ...) G_GNUC_PRINTF (2, 3);
+
+static gboolean
+zstd_chunked_not_supported (GError    **error,
+                            const char *format,
+                            ...)
+{
+  va_list args;
+
+  va_start (args, format);
+  g_set_error_valist (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, format, args);
+  va_end (args);
+
+  return FALSE;
+}
+
+static gboolean
+layer_is_zstd_chunked (FlatpakOciDescriptor *layer)
+{
+  return layer->annotations != NULL &&
+         g_hash_table_contains (layer->annotations, FLATPAK_OCI_ANNOTATION_ZSTD_CHUNKED_MANIFEST_POSITION);
+}
+
+static gboolean
+parse_zstd_chunked_manifest_position (const char *position,
+                                      guint64    *out_offset,
+                                      guint64    *out_length,
+                                      guint64    *out_uncompressed_length)
+{
+  g_auto(GStrv) parts = g_strsplit (position, ":", -1);
+  guint64 values[4];
+
+  if (g_strv_length (parts) != G_N_ELEMENTS (values))
+    return FALSE;
+
+  for (guint i = 0; i < G_N_ELEMENTS (values); i++)
+    {
+      if (!g_ascii_string_to_unsigned (parts[i], 10, 0, G_MAXUINT64, &values[i], NULL))
+        return FALSE;
+    }
+
+  /* Type 1 is the JSON table of contents, the only one there is so far */
+  if (values[3] != 1)
+    return FALSE;
+
+  *out_offset = values[0];
+  *out_length = values[1];
+  *out_uncompressed_length = values[2];
+  return TRUE;
+}
+
+/* Splits a path from the table of contents into its components, with
+ * an empty array for the root. Returns NULL for paths we don't want. */
+static char **
+split_zstd_chunked_path (const char *name)
+{
+  g_auto(GStrv) parts = NULL;
+  g_autoptr(GPtrArray) components = g_ptr_array_new_with_free_func (g_free);
+
+  if (name == NULL)
+    return NULL;
+
+  parts = g_strsplit (name, "/", -1);
+  for (guint i = 0; parts[i] != NULL; i++)
+    {
+      if (*parts[i] == '\0' || strcmp (parts[i], ".") == 0)
+        continue;
+
+      if (strcmp (parts[i], "..") == 0)
+        return NULL;
+
+      g_ptr_array_add (components, g_strdup (parts[i]));
+    }
+
+  g_ptr_array_add (components, NULL);
+  return (char **) g_ptr_array_free (g_steal_pointer (&components), FALSE);
+}
+
+static gboolean
+zstd_chunked_file_is_large (ZstdChunkedFile *file)
+{
+  return file->end - file->start > ZSTD_CHUNKED_MAX_IN_MEMORY ||
+         file->entry->size > ZSTD_CHUNKED_MAX_IN_MEMORY;
+}
+
+static gboolean
+zstd_chunked_file_needs_fetch (ZstdChunkedFile *file)
+{
+  return strcmp (file->entry->type, "reg") == 0 &&
+         file->entry->size > 0 &&
+         file->old_checksum == NULL;
+}
+
+/* Returns the checksum of a file in @old_root with the same path and
+ * content as @file, if there is one */
+static char *
+find_old_zstd_chunked_file (OstreeRepo      *repo,
+                            GFile           *old_root,
+                            ZstdChunkedFile *file,
+                            GCancellable    *cancellable)
+{
+  g_autoptr(GFile) old_file = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_autoptr(GChecksum) checksum = NULL;
+  const char *old_checksum;
+
+  if (file->entry->digest == NULL ||
+      !g_str_has_prefix (file->entry->digest, "sha256:"))
+    return NULL;
+
+  old_file = g_file_resolve_relative_path (old_root, file->path);
+  info = g_file_query_info (old_file, "standard::type,standard::size",
+                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                            cancellable, NULL);
+  if (info == NULL ||
+      g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR ||
+      g_file_info_get_size (info) != file->entry->size)
+    return NULL;
+
+  old_checksum = ostree_repo_file_get_checksum (OSTREE_REPO_FILE (old_file));
+  if (!ostree_repo_load_file (repo, old_checksum, &in, NULL, NULL, cancellable, NULL))
+    return NULL;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  if (!splice_update_checksum (NULL, in, checksum, cancellable, NULL))
+    return NULL;
+
+  if (strcmp (file->entry->digest + strlen ("sha256:"), g_checksum_get_string (checksum)) != 0)
+    return NULL;
+
+  return g_strdup (old_checksum);
+}
+
+/* Checks that we can import everything in @toc and works out what we
+ * already have. */
+static gboolean
+collect_zstd_chunked_files (FlatpakOciZstdChunkedToc *toc,
+                            OstreeRepo               *repo,
+                            GFile                    *old_root,
+                            GPtrArray               **out_files,
+                            guint64                  *out_needed_size,
+                            GCancellable             *cancellable,
+                            GError                  **error)
+{
+  const char *supported_types[] = { "reg", "dir", "symlink", "hardlink", "char", "block", "fifo", NULL };
+  g_autoptr(GPtrArray) files = g_ptr_array_new_with_free_func ((GDestroyNotify) zstd_chunked_file_free);
+  g_autoptr(GHashTable) seen_files = g_hash_table_new (g_str_hash, g_str_equal);
+  ZstdChunkedFile *last_regular = NULL;
+  guint64 needed_size = 0;
+
+  if (toc->version != 1)
+    return zstd_chunked_not_supported (error, "Unsupported zstd:chunked version %" G_GINT64_FORMAT, toc->version);
+
+  for (guint i = 0; toc->entries[i] != NULL; i++)
+    {
+      FlatpakOciZstdChunkedTocEntry *entry = toc->entries[i];
+      ZstdChunkedFile *file;
+
+      /* Other types, like runs of zeros, mean that not all chunks are zstd frames */
+      if (entry->chunk_type != NULL && *entry->chunk_type != '\0')
+        return zstd_chunked_not_supported (error, "Unsupported zstd:chunked chunk type %s", entry->chunk_type);
+
+      if (strcmp (entry->type, "chunk") == 0)
+        {
+          guint64 end_offset = entry->end_offset;
+
+          if (last_regular == NULL ||
+              entry->offset != last_regular->end ||
+              entry->end_offset <= entry->offset)
+            return zstd_chunked_not_supported (error, "Invalid zstd:chunked chunk");
+
+          g_array_append_val (last_regular->frame_ends, end_offset);
+          last_regular->end = end_offset;
+          continue;
+        }
+
+      last_regular = NULL;
+
+      if (!g_strv_contains (supported_types, entry->type))
+        return zstd_chunked_not_supported (error, "Unsupported zstd:chunked entry type %s", entry->type);
+
+      file = g_new0 (ZstdChunkedFile, 1);
+      file->entry = entry;
+      file->frame_ends = g_array_new (FALSE, FALSE, sizeof (guint64));
+      file->components = split_zstd_chunked_path (entry->name);
+      g_ptr_array_add (files, file);
+
+      if (file->components == NULL)
+        return zstd_chunked_not_supported (error, "Invalid path %s in zstd:chunked layer", entry->name);
+
+      file->path = g_strjoinv ("/", file->components);
+
+      if (strcmp (entry->type, "dir") == 0)
+        continue;
+
+      if (*file->path == '\0')
+        return zstd_chunked_not_supported (error, "Invalid root in zstd:chunked layer");
+
+      if (strcmp (entry->type, "reg") == 0)
+        {
+          if (entry->size < 0)
+            return zstd_chunked_not_supported (error, "Invalid size for %s in zstd:chunked layer", entry->name);
+
+          if (entry->size > 0)
+            {
+              guint64 end_offset = entry->end_offset;
+
+              if (entry->offset < 0 || entry->end_offset <= entry->offset)
+                return zstd_chunked_not_supported (error, "Invalid offset for %s in zstd:chunked layer", entry->name);
+
+              if (entry->digest == NULL || !g_str_has_prefix (entry->digest, "sha256:"))
+                return zstd_chunked_not_supported (error, "Unsupported digest for %s in zstd:chunked layer", entry->name);
+
+              file->start = entry->offset;
+              file->end = end_offset;
+              g_array_append_val (file->frame_ends, end_offset);
+              last_regular = file;
+            }
+        }
+      else if (strcmp (entry->type, "hardlink") == 0)
+        {
+          g_auto(GStrv) target = split_zstd_chunked_path (entry->link_name);
+          g_autofree char *target_path = target ? g_strjoinv ("/", target) : NULL;
+
+          /* We resolve links in the tree we are building, so the target has to come first */
+          if (target_path == NULL || !g_hash_table_contains (seen_files, target_path))
+            return zstd_chunked_not_supported (error, "Unsupported hardlink %s in zstd:chunked layer", entry->name);
+        }
+      else if (strcmp (entry->type, "symlink") == 0)
+        {
+          if (entry->link_name == NULL)
+            return zstd_chunked_not_supported (error, "Invalid symlink %s in zstd:chunked layer", entry->name);
+        }
+
+      g_hash_table_add (seen_files, file->path);
+    }
+
+  /* Only now that all the chunks are known */
+  for (guint i = 0; i < files->len; i++)
+    {
+      ZstdChunkedFile *file = g_ptr_array_index (files, i);
+
+      if (strcmp (file->entry->type, "reg") != 0 || file->entry->size == 0)
+        continue;
+
+      if (old_root != NULL)
+        file->old_checksum = find_old_zstd_chunked_file (repo, old_root, file, cancellable);
+
+      if (file->old_checksum == NULL)
+        needed_size += file->end - file->start;
+    }
+
+  *out_files = g_steal_pointer (&files);
+  *out_needed_size = needed_size;
+  return TRUE;
+}
+
+static void
+zstd_chunked_fetch_progress (guint64  downloaded_bytes,
+                             gpointer user_data)
+{
+  ZstdChunkedImport *import = user_data;
+
+  oci_layer_progress (import->fetched + downloaded_bytes, import->progress_data);
+}
+
+static gboolean
+zstd_chunked_fetch (ZstdChunkedImport *import,
+                    guint64            offset,
+                    guint64            length,
+                    GOutputStream     *out,
+                    GCancellable      *cancellable,
+                    GError           **error)
+{
+  if (!flatpak_download_http_uri_range (import->registry->http_session, import->uri,
+                                        import->registry->certificates,
+                                        FLATPAK_HTTP_FLAGS_NONE,
+                                        offset, length, out,
+                                        import->registry->token,
+                                        zstd_chunked_fetch_progress, import,
+                                        cancellable, error))
+    return FALSE;
+
+  if (!g_output_stream_close (out, cancellable, error))
+    return FALSE;
+
+  import->fetched += length;
+  return TRUE;
+}
+
+static GBytes *
+zstd_chunked_fetch_bytes (ZstdChunkedImport *import,
+                          guint64            offset,
+                          guint64            length,
+                          GCancellable      *cancellable,
+                          GError           **error)
+{
+  g_autoptr(GOutputStream) out = g_memory_output_stream_new_resizable ();
+
+  if (!zstd_chunked_fetch (import, offset, length, out, cancellable, error))
+    return NULL;
+
+  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (out));
+}
+
+/* Fetches the content of file @first, and if it is small, that of the
+ * small files close after it in the blob that we also need. */
+static gboolean
+zstd_chunked_fetch_data (ZstdChunkedImport *import,
+                         GPtrArray         *files,
+                         guint              first,
+                         GCancellable      *cancellable,
+                         GError           **error)
+{
+  ZstdChunkedFile *file = g_ptr_array_index (files, first);
+  guint64 end = file->end;
+
+  g_clear_pointer (&import->data, g_bytes_unref);
+
+  if (zstd_chunked_file_is_large (file))
+    {
+      g_auto(GLnxTmpfile) tmpf = { 0 };
+      g_autoptr(GOutputStream) out = NULL;
+      g_autoptr(GMappedFile) mfile = NULL;
+
+      if (!glnx_open_tmpfile_linkable_at (import->registry->tmp_dfd, ".",
+                                          O_RDWR | O_CLOEXEC, &tmpf, error))
+        return FALSE;
+
+      out = g_unix_output_stream_new (tmpf.fd, FALSE);
+      if (!zstd_chunked_fetch (import, file->start, file->end - file->start, out, cancellable, error))
+        return FALSE;
+
+      mfile = g_mapped_file_new_from_fd (tmpf.fd, FALSE, error);
+      if (mfile == NULL)
+        return FALSE;
+
+      import->data = g_mapped_file_get_bytes (mfile);
+    }
+  else
+    {
+      for (guint i = first + 1; i < files->len; i++)
+        {
+          ZstdChunkedFile *next = g_ptr_array_index (files, i);
+
+          /* Anything we don't need is just part of the gap to the next one */
+          if (!zstd_chunked_file_needs_fetch (next))
+            continue;
+
+          if (zstd_chunked_file_is_large (next) ||
+              next->start < end ||
+              next->start - end > ZSTD_CHUNKED_MAX_GAP ||
+              next->end - file->start > ZSTD_CHUNKED_MAX_IN_MEMORY)
+            break;
+
+          end = next->end;
+        }
+
+      import->data = zstd_chunked_fetch_bytes (import, file->start, end - file->start, cancellable, error);
+      if (import->data == NULL)
+        return FALSE;
+    }
+
+  import->data_start = file->start;
+  import->data_end = file->start + g_bytes_get_size (import->data);
+  return TRUE;
+}
+
+/* Decompresses the frames of @file from the fetched data into @out, and
+ * checks that the result matches the size and digest in the table of
+ * contents. This never writes more than the expected size. */
+static gboolean
+zstd_chunked_decompress_file (ZstdChunkedImport *import,
+                              ZstdChunkedFile   *file,
+                              GOutputStream     *out,
+                              GCancellable      *cancellable,
+                              GError           **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  guint64 frame_start = file->start;
+  guint64 total = 0;
+  char buffer[16 * 1024];
+
+  g_assert (import->data != NULL);
+  g_assert (file->start >= import->data_start && file->end <= import->data_end);
+
+  for (guint i = 0; i < file->frame_ends->len; i++)
+    {
+      guint64 frame_end = g_array_index (file->frame_ends, guint64, i);
+      g_autoptr(GBytes) frame = g_bytes_new_from_bytes (import->data, frame_start - import->data_start,
+                                                        frame_end - frame_start);
+      g_autoptr(GInputStream) frame_in = g_memory_input_stream_new_from_bytes (frame);
+      g_autoptr(FlatpakZstdDecompressor) zstd = flatpak_zstd_decompressor_new ();
+      g_autoptr(GInputStream) in = g_converter_input_stream_new (frame_in, G_CONVERTER (zstd));
+      gsize bytes_read;
+
+      do
+        {
+          if (!g_input_stream_read_all (in, buffer, sizeof (buffer), &bytes_read, cancellable, error))
+            return FALSE;
+
+          total += bytes_read;
+          if (total > (guint64) file->entry->size)
+            return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                                       _("Wrong size for %s in layer"), file->entry->name);
+
+          g_checksum_update (checksum, (guchar *) buffer, bytes_read);
+          if (!g_output_stream_write_all (out, buffer, bytes_read, NULL, cancellable, error))
+            return FALSE;
+        }
+      while (bytes_read > 0);
+
+      frame_start = frame_end;
+    }
+
+  if (total != (guint64) file->entry->size)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                               _("Wrong size for %s in layer"), file->entry->name);
+
+  if (strcmp (file->entry->digest + strlen ("sha256:"), g_checksum_get_string (checksum)) != 0)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                               _("Wrong checksum for %s in layer"), file->entry->name);
+
+  return g_output_stream_close (out, cancellable, error);
+}
+
+static GFileInfo *
+zstd_chunked_file_info_new (FlatpakOciZstdChunkedTocEntry *entry,
+                            GFileType                      type,
+                            guint32                        type_mode)
+{
+  GFileInfo *info = g_file_info_new ();
+
+  g_file_info_set_file_type (info, type);
+  g_file_info_set_attribute_uint32 (info, "unix::uid", entry->uid);
+  g_file_info_set_attribute_uint32 (info, "unix::gid", entry->gid);
+  g_file_info_set_attribute_uint32 (info, "unix::mode", type_mode | (entry->mode & 07777));
+
+  return info;
+}
+
+static GVariant *
+zstd_chunked_entry_get_xattrs (FlatpakOciZstdChunkedTocEntry *entry)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GList) names = NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ayay)"));
+
+  if (entry->xattrs != NULL)
+    names = g_list_sort (g_hash_table_get_keys (entry->xattrs), (GCompareFunc) strcmp);
+
+  for (GList *l = names; l != NULL; l = l->next)
+    {
+      const char *name = l->data;
+      gsize len;
+      guchar *value = g_base64_decode (g_hash_table_lookup (entry->xattrs, name), &len);
+
+      g_variant_builder_add (&builder, "(@ay@ay)",
+                             g_variant_new_bytestring (name),
+                             g_variant_new_from_data (G_VARIANT_TYPE_BYTESTRING, value, len,
+                                                      TRUE, g_free, value));
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static gboolean
+zstd_chunked_same_metadata (GFileInfo *info,
+                            GVariant  *xattrs,
+                            GFileInfo *old_info,
+                            GVariant  *old_xattrs)
+{
+  const char *attributes[] = { "unix::uid", "unix::gid", "unix::mode" };
+
+  for (guint i = 0; i < G_N_ELEMENTS (attributes); i++)
+    {
+      if (g_file_info_get_attribute_uint32 (info, attributes[i]) !=
+          g_file_info_get_attribute_uint32 (old_info, attributes[i]))
+        return FALSE;
+    }
+
+  if (old_xattrs == NULL)
+    return g_variant_n_children (xattrs) == 0;
+
+  return g_variant_equal (xattrs, old_xattrs);
+}
+
+static gboolean
+zstd_chunked_write_content (ZstdChunkedImport *import,
+                            GInputStream      *in,
+                            GFileInfo         *info,
+                            GVariant          *xattrs,
+                            char             **out_checksum,
+                            GCancellable      *cancellable,
+                            GError           **error)
+{
+  g_autoptr(GInputStream) content_stream = NULL;
+  g_autofree guchar *raw_checksum = NULL;
+  guint64 length;
+
+  if (!ostree_raw_file_to_content_stream (in, info, xattrs,
+                                          &content_stream, &length,
+                                          cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_write_content (import->repo, NULL, content_stream, length,
+                                  &raw_checksum, cancellable, error))
+    return FALSE;
+
+  *out_checksum = ostree_checksum_from_bytes (raw_checksum);
+  return TRUE;
+}
+
+static gboolean
+zstd_chunked_write_regular (ZstdChunkedImport *import,
+                            GPtrArray         *files,
+                            guint              i,
+                            char             **out_checksum,
+                            GCancellable      *cancellable,
+                            GError           **error)
+{
+  ZstdChunkedFile *file = g_ptr_array_index (files, i);
+  g_autoptr(GFileInfo) info = zstd_chunked_file_info_new (file->entry, G_FILE_TYPE_REGULAR, S_IFREG);
+  g_autoptr(GVariant) xattrs = zstd_chunked_entry_get_xattrs (file->entry);
+  g_autoptr(GInputStream) in = NULL;
+  g_auto(GLnxTmpfile) tmpf = { 0 };
+
+  g_file_info_set_size (info, file->entry->size);
+
+  if (file->old_checksum != NULL)
+    {
+      g_autoptr(GFileInfo) old_info = NULL;
+      g_autoptr(GVariant) old_xattrs = NULL;
+
+      if (!ostree_repo_load_file (import->repo, file->old_checksum, &in, &old_info, &old_xattrs,
+                                  cancellable, error))
+        return FALSE;
+
+      /* Same content and metadata, so the same object */
+      if (zstd_chunked_same_metadata (info, xattrs, old_info, old_xattrs))
+        {
+          *out_checksum = g_strdup (file->old_checksum);
+          return TRUE;
+        }
+    }
+  else if (file->entry->size == 0)
+    {
+      in = g_memory_input_stream_new ();
+    }
+  else
+    {
+      if (import->data == NULL ||
+          file->start < import->data_start || file->end > import->data_end)
+        {
+          if (!zstd_chunked_fetch_data (import, files, i, cancellable, error))
+            return FALSE;
+        }
+
+      if (zstd_chunked_file_is_large (file))
+        {
+          g_autoptr(GOutputStream) out = NULL;
+
+          if (!glnx_open_tmpfile_linkable_at (import->registry->tmp_dfd, ".",
+                                              O_RDWR | O_CLOEXEC, &tmpf, error))
+            return FALSE;
+
+          out = g_unix_output_stream_new (tmpf.fd, FALSE);
+          if (!zstd_chunked_decompress_file (import, file, out, cancellable, error))
+            return FALSE;
+
+          /* Nothing else is in there */
+          g_clear_pointer (&import->data, g_bytes_unref);
+
+          if (lseek (tmpf.fd, 0, SEEK_SET) < 0)
+            return glnx_throw_errno_prefix (error, "lseek");
+
+          in = g_unix_input_stream_new (tmpf.fd, FALSE);
+        }
+      else
+        {
+          g_autoptr(GOutputStream) out = g_memory_output_stream_new_resizable ();
+          g_autoptr(GBytes) content = NULL;
+
+          if (!zstd_chunked_decompress_file (import, file, out, cancellable, error))
+            return FALSE;
+
+          content = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (out));
+          in = g_memory_input_stream_new_from_bytes (content);
+        }
+    }
+
+  return zstd_chunked_write_content (import, in, info, xattrs, out_checksum, cancellable, error);
+}
+
+static gboolean
+zstd_chunked_set_dirmeta (ZstdChunkedImport             *import,
+                          OstreeMutableTree             *dir,
+                          FlatpakOciZstdChunkedTocEntry *entry,
+                          GCancellable                  *cancellable,
+                          GError                       **error)
+{
+  g_autoptr(GFileInfo) info = zstd_chunked_file_info_new (entry, G_FILE_TYPE_DIRECTORY, S_IFDIR);
+  g_autoptr(GVariant) xattrs = zstd_chunked_entry_get_xattrs (entry);
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *raw_checksum = NULL;
+  g_autofree char *checksum = NULL;
+
+  dirmeta = ostree_create_directory_metadata (info, xattrs);
+  if (!ostree_repo_write_metadata (import->repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   dirmeta, &raw_checksum, cancellable, error))
+    return FALSE;
+
+  checksum = ostree_checksum_from_bytes (raw_checksum);
+  ostree_mutable_tree_set_metadata_checksum (dir, checksum);
+
+  return TRUE;
+}
+
+static char *
+zstd_chunked_lookup_file (OstreeMutableTree *mtree,
+                          char             **components,
+                          GError           **error)
+{
+  g_autoptr(OstreeMutableTree) dir = g_object_ref (mtree);
+  guint n_components = g_strv_length (components);
+
+  for (guint i = 0; i < n_components; i++)
+    {
+      g_autofree char *file_checksum = NULL;
+      g_autoptr(OstreeMutableTree) subdir = NULL;
+
+      if (!ostree_mutable_tree_lookup (dir, components[i], &file_checksum, &subdir, error))
+        return NULL;
+
+      if (i + 1 == n_components && file_checksum != NULL)
+        return g_steal_pointer (&file_checksum);
+
+      if (subdir == NULL)
+        break;
+
+      g_set_object (&dir, subdir);
+    }
+
+  flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid hardlink in layer"));
+  return NULL;
+}
+
+static gboolean
+zstd_chunked_import_file (ZstdChunkedImport *import,
+                          GPtrArray         *files,
+                          guint              i,
+                          GCancellable      *cancellable,
+                          GError           **error)
+{
+  ZstdChunkedFile *file = g_ptr_array_index (files, i);
+  FlatpakOciZstdChunkedTocEntry *entry = file->entry;
+  g_autoptr(GPtrArray) split_path = g_ptr_array_new ();
+  g_autoptr(OstreeMutableTree) parent = NULL;
+  g_autofree char *checksum = NULL;
+  const char *name;
+
+  if (*file->path == '\0')
+    return zstd_chunked_set_dirmeta (import, import->mtree, entry, cancellable, error);
+
+  for (guint j = 0; file->components[j] != NULL; j++)
+    g_ptr_array_add (split_path, file->components[j]);
+  name = g_ptr_array_index (split_path, split_path->len - 1);
+
+  if (!ostree_mutable_tree_ensure_parent_dirs (import->mtree, split_path, import->default_dirmeta,
+                                               &parent, error))
+    return FALSE;
+
+  if (strcmp (entry->type, "dir") == 0)
+    {
+      g_autoptr(OstreeMutableTree) dir = NULL;
+
+      if (!ostree_mutable_tree_ensure_dir (parent, name, &dir, error))
+        return FALSE;
+
+      return zstd_chunked_set_dirmeta (import, dir, entry, cancellable, error);
+    }
+  else if (strcmp (entry->type, "reg") == 0)
+    {
+      if (!zstd_chunked_write_regular (import, files, i, &checksum, cancellable, error))
+        return FALSE;
+    }
+  else if (strcmp (entry->type, "symlink") == 0)
+    {
+      g_autoptr(GFileInfo) info = zstd_chunked_file_info_new (entry, G_FILE_TYPE_SYMBOLIC_LINK, S_IFLNK);
+      g_autoptr(GVariant) xattrs = zstd_chunked_entry_get_xattrs (entry);
+
+      g_file_info_set_size (info, 0);
+      g_file_info_set_attribute_boolean (info, "standard::is-symlink", TRUE);
+      g_file_info_set_attribute_byte_string (info, "standard::symlink-target", entry->link_name);
+
+      if (!zstd_chunked_write_content (import, NULL, info, xattrs, &checksum, cancellable, error))
+        return FALSE;
+    }
+  else if (strcmp (entry->type, "hardlink") == 0)
+    {
+      g_auto(GStrv) target = split_zstd_chunked_path (entry->link_name);
+
+      checksum = zstd_chunked_lookup_file (import->mtree, target, error);
+      if (checksum == NULL)
+        return FALSE;
+    }
+  else
+    {
+      /* Devices and fifos, skipped like ignore_unsupported_content does */
+      return TRUE;
+    }
+
+  return ostree_mutable_tree_replace_file (parent, name, checksum, error);
+}
+
+/* Imports a zstd:chunked layer into @mtree, fetching only the files that
+ * are not already in @old_root. We never see the whole blob, so rather
+ * than the layer digest we check the table of contents against the
+ * checksum in the (verified) manifest, and then each file against the
+ * digest in the table of contents.
+ *
+ * This fails with %G_IO_ERROR_NOT_SUPPORTED, before changing anything, if
+ * the layer can't be imported like this or it wouldn't save much. */
+static gboolean
+import_zstd_chunked_layer (OstreeRepo                 *repo,
+                           FlatpakOciRegistry         *registry,
+                           const char                 *repository,
+                           FlatpakOciDescriptor       *layer,
+                           GFile                      *old_root,
+                           OstreeMutableTree          *mtree,
+                           FlatpakOciPullProgressData *progress_data,
+                           GCancellable               *cancellable,
+                           GError                    **error)
+{
+  g_auto(ZstdChunkedImport) import = { repo, registry, mtree, progress_data };
+  const char *toc_digest = NULL;
+  const char *toc_position = NULL;
+  guint64 toc_offset, toc_length, toc_uncompressed_length;
+  g_autoptr(GBytes) toc_compressed = NULL;
+  g_autoptr(GBytes) toc_bytes = NULL;
+  g_autoptr(FlatpakOciZstdChunkedToc) toc = NULL;
+  g_autoptr(GPtrArray) files = NULL;
+  g_autoptr(OstreeMutableTree) default_dir = NULL;
+  g_autoptr(GInputStream) toc_compressed_in = NULL;
+  g_autoptr(FlatpakZstdDecompressor) zstd = NULL;
+  g_autoptr(GInputStream) toc_in = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *toc_checksum = NULL;
+  guint64 needed_size;
+
+  if (layer->annotations != NULL)
+    {
+      toc_digest = g_hash_table_lookup (layer->annotations, FLATPAK_OCI_ANNOTATION_ZSTD_CHUNKED_MANIFEST_CHECKSUM);
+      toc_position = g_hash_table_lookup (layer->annotations, FLATPAK_OCI_ANNOTATION_ZSTD_CHUNKED_MANIFEST_POSITION);
+    }
+
+  if (toc_digest == NULL || !g_str_has_prefix (toc_digest, "sha256:") ||
+      toc_position == NULL ||
+      !parse_zstd_chunked_manifest_position (toc_position, &toc_offset, &toc_length, &toc_uncompressed_length))
+    return zstd_chunked_not_supported (error, "Layer %s is not zstd:chunked", layer->digest);
+
+  if (toc_length == 0 ||
+      toc_length > ZSTD_CHUNKED_MAX_TOC_SIZE ||
+      toc_uncompressed_length > ZSTD_CHUNKED_MAX_TOC_SIZE)
+    return zstd_chunked_not_supported (error, "Unsupported zstd:chunked table of contents size");
+
+  import.uri = get_blob_uri (registry, repository, FALSE, layer->digest, (const char **) layer->urls, error);
+  if (import.uri == NULL)
+    return FALSE;
+
+  toc_compressed = zstd_chunked_fetch_bytes (&import, toc_offset, toc_length, cancellable, error);
+  if (toc_compressed == NULL)
+    return FALSE;
+
+  toc_checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, toc_compressed);
+  if (strcmp (toc_digest + strlen ("sha256:"), toc_checksum) != 0)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                               _("Wrong zstd:chunked table of contents checksum, expected %s, was %s"),
+                               toc_digest, toc_checksum);
+
+  toc_compressed_in = g_memory_input_stream_new_from_bytes (toc_compressed);
+  zstd = flatpak_zstd_decompressor_new ();
+  toc_in = g_converter_input_stream_new (toc_compressed_in, G_CONVERTER (zstd));
+
+  toc_bytes = flatpak_read_stream (toc_in, FALSE, error);
+  if (toc_bytes == NULL)
+    return FALSE;
+
+  if (g_bytes_get_size (toc_bytes) != toc_uncompressed_length)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                               _("Invalid zstd:chunked table of contents"));
+
+  toc = (FlatpakOciZstdChunkedToc *) flatpak_json_from_bytes_direct (toc_bytes, FLATPAK_TYPE_OCI_ZSTD_CHUNKED_TOC, &local_error);
+  if (toc == NULL)
+    return zstd_chunked_not_supported (error, "Can't parse zstd:chunked table of contents: %s", local_error->message);
+
+  if (!collect_zstd_chunked_files (toc, repo, old_root, &files, &needed_size, cancellable, error))
+    return FALSE;
+
+  /* Ranges have some overhead, and we can't use the parallel download, so
+   * only do this when we save a good part of the layer */
+  if (needed_size > (guint64) layer->size / 2)
+    return zstd_chunked_not_supported (error, "Most of layer %s changed", layer->digest);
+
+  g_info ("Fetching %" G_GUINT64_FORMAT " of %" G_GINT64_FORMAT " bytes of zstd:chunked layer %s",
+          needed_size, layer->size, layer->digest);
+
+  /* The same as what ostree uses for parent directories that aren't in the archive */
+  default_dir = ostree_mutable_tree_new ();
+  if (!flatpak_mtree_ensure_dir_metadata (repo, default_dir, cancellable, error))
+    return FALSE;
+  import.default_dirmeta = g_strdup (ostree_mutable_tree_get_metadata_checksum (default_dir));
+
+  for (guint i = 0; i < files->len; i++)
+    {
+      if (!zstd_chunked_import_file (&import, files, i, cancellable, &local_error))
+        {
+          /* It is too late for the caller to fall back now */
+          if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+            local_error->code = G_IO_ERROR_FAILED;
+
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Signatures are fetched on a thread while the layers download, as the
+ * lookaside server is typically separate from the registry and fetching
+ * each signature is a round trip. They are still verified before any
+ * layer is imported. */
+typedef struct {
+  FlatpakImageSource   *image_source;
+  GCancellable         *cancellable;
+  GCancellable         *parent_cancellable;
+  gulong                cancelled_id;
+  GThread              *thread;
+  FlatpakOciSignatures *signatures;
+  GError               *error;
+} OciSignatureLoad;
+
+static gpointer
+oci_signature_load_thread_func (gpointer data)
+{
+  OciSignatureLoad *load = data;
+
+  load->signatures = load_signatures (load->image_source, load->cancellable, &load->error);
+
+  return NULL;
+}
+
+static OciSignatureLoad *
+oci_signature_load_start (FlatpakImageSource *image_source,
+                          GCancellable       *cancellable)
+{
+  OciSignatureLoad *load = g_new0 (OciSignatureLoad, 1);
+
+  load->image_source = image_source;
+  load->cancellable = g_cancellable_new ();
+
+  if (cancellable)
+    {
+      load->parent_cancellable = g_object_ref (cancellable);
+      load->cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (cancel_oci_layer_pull_cb),
+                                                  load->cancellable, NULL);
+    }
+
+  load->thread = g_thread_new ("oci-signatures", oci_signature_load_thread_func, load);
+
+  return load;
+}
+
+static FlatpakOciSignatures *
+oci_signature_load_finish (OciSignatureLoad *load,
+                           GError          **error)
+{
+  g_thread_join (g_steal_pointer (&load->thread));
+
+  if (load->signatures == NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&load->error));
+      return NULL;
+    }
+
+  return g_steal_pointer (&load->signatures);
+}
+
+static void
+oci_signature_load_free (OciSignatureLoad *load)
+{
+  if (load->thread)
+    {
+      g_cancellable_cancel (load->cancellable);
+      g_thread_join (load->thread);
+    }
+
+  if (load->cancelled_id != 0)
+    g_cancellable_disconnect (load->parent_cancellable, load->cancelled_id);
+  g_clear_object (&load->parent_cancellable);
+  g_clear_object (&load->cancellable);
+  g_clear_pointer (&load->signatures, flatpak_oci_signatures_free);
+  g_clear_error (&load->error);
+  g_free (load);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (OciSignatureLoad, oci_signature_load_free)
+
+/* Manifest digests whose signatures were already verified in this
+ * process, so pulling the same image again doesn't redo the fetching and
+ * the GPG verification */
+G_LOCK_DEFINE_STATIC (verified_signatures);
+static GHashTable *verified_signatures = NULL;
+
+static char *
+get_verified_signatures_key (OstreeRepo *repo,
+                             const char *remote,
+                             const char *registry_uri,
+                             const char *repository,
+                             const char *digest)
+{
+  return g_strdup_printf ("%s\n%s\n%s\n%s\n%s",
+                          flatpak_file_get_path_cached (ostree_repo_get_path (repo)),
+                          remote, registry_uri, repository, digest);
+}
+
+static gboolean
+signatures_are_verified (const char *key)
+{
+  gboolean res;
+
+  G_LOCK (verified_signatures);
+  res = verified_signatures != NULL && g_hash_table_contains (verified_signatures, key);
+  G_UNLOCK (verified_signatures);
+
+  return res;
+}
+
+static void
+mark_signatures_verified (const char *key)
+{
+  G_LOCK (verified_signatures);
+  if (verified_signatures == NULL)
+    verified_signatures = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_hash_table_add (verified_signatures, g_strdup (key));
+  G_UNLOCK (verified_signatures);
+}
+
+char *
+flatpak_pull_from_oci (OstreeRepo            *repo,
+                       FlatpakImageSource    *image_source,
+                       const char            *opt_sigcheck_repository,
+                       const char            *opt_sigcheck_registry_uri,
+                       const char            *remote,
+                       const char            *ref,
+                       FlatpakPullFlags       flags,
+                       FlatpakOciPullProgress progress_cb,
+                       gpointer               progress_user_data,
+                       GCancellable          *cancellable,
+                       GError               **error)
+{
+  FlatpakOciRegistry *registry = flatpak_image_source_get_registry (image_source);
+  const char *oci_repository = flatpak_image_source_get_oci_repository (image_source);
+  const char *digest = flatpak_image_source_get_digest (image_source);
+  FlatpakOciManifest *manifest = flatpak_image_source_get_manifest (image_source);
+  const char *delta_url = flatpak_image_source_get_delta_url (image_source);
+  FlatpakOciImage *image_config = flatpak_image_source_get_image_config (image_source);
+  gboolean force_disable_deltas = (flags & FLATPAK_PULL_FLAGS_NO_STATIC_DELTAS) != 0;
+  g_autoptr(OstreeMutableTree) archive_mtree = NULL;
+  g_autoptr(GFile) archive_root = NULL;
+  g_autoptr(FlatpakOciManifest) delta_manifest = NULL;
+  g_autofree char *old_checksum = NULL;
+  g_autoptr(GVariant) old_commit = NULL;
+  g_autoptr(GFile) old_root = NULL;
+  OstreeRepoCommitState old_state = 0;
+  g_autofree char *old_diffid = NULL;
+  g_autofree char *commit_checksum = NULL;
+  const char *parent = NULL;
+  const char *manifest_ref = NULL;
+  g_autofree char *full_ref = NULL;
+  const char *diffid;
+  FlatpakOciPullProgressData progress_data = { progress_cb, progress_user_data };
+  g_autoptr(GVariantBuilder) metadata_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(FlatpakOciSignatures) signatures = NULL;
+  g_autoptr(OciSignatureLoad) signature_load = NULL;
+  g_autofree char *verified_key = NULL;
+  g_autoptr(OciLayerPull) layer_pull = NULL;
+  const char *sigcheck_registry_uri = opt_sigcheck_registry_uri ? opt_sigcheck_registry_uri : registry->uri;
+  const char *sigcheck_repository = opt_sigcheck_repository ? opt_sigcheck_repository : oci_repository;
+  int n_layers;
+  int i;
+
+  g_assert (g_str_has_prefix (digest, "sha256:"));
+
+  verified_key = get_verified_signatures_key (repo, remote, sigcheck_registry_uri,
+                                              sigcheck_repository, digest);
+  if (signatures_are_verified (verified_key))
+    g_info ("Signatures for %s already verified", digest);
+  else
+    signature_load = oci_signature_load_start (image_source, cancellable);
+
+  manifest_ref = flatpak_image_source_get_ref (image_source);
+  if (manifest_ref == NULL)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("No ref specified for OCI image %s"), digest);
       return NULL;
     }
 
@@ -3446,6 +5485,45 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
                  progress_data.n_layers, progress_data.pulled_layers,
                  progress_user_data);
 
+  /* Download all the layers in parallel, but import them in order */
+  layer_pull = oci_layer_pull_new (registry, NULL, oci_repository, n_layers, cancellable);
+  for (i = 0; manifest->layers[i] != NULL; i++)
+    {
+      FlatpakOciDescriptor *layer = manifest->layers[i];
+      FlatpakOciDescriptor *delta_layer = NULL;
+
+      if (delta_manifest)
+        delta_layer = flatpak_oci_manifest_find_delta_for (delta_manifest, old_diffid, image_config->rootfs.diff_ids[i]);
+
+      if (delta_layer)
+        oci_layer_pull_add (layer_pull, delta_layer->digest, (const char **)delta_layer->urls, delta_layer->size, OCI_LAYER_DOWNLOAD);
+      else if (layer->size >= OCI_LAYER_STREAM_MIN_SIZE ||
+               (old_root != NULL && layer_is_zstd_chunked (layer)))
+        /* Streamed layers are not prefetched, which is what we want for
+         * zstd:chunked ones as they only need parts of the blob */
+        oci_layer_pull_add (layer_pull, layer->digest, (const char **)layer->urls, layer->size, OCI_LAYER_STREAM);
+      else
+        oci_layer_pull_add (layer_pull, layer->digest, (const char **)layer->urls, layer->size, OCI_LAYER_DOWNLOAD);
+    }
+  oci_layer_pull_start (layer_pull);
+
+  /* Nothing from the layers is looked at before this */
+  if (signature_load != NULL)
+    {
+      signatures = oci_signature_load_finish (signature_load, error);
+      if (signatures == NULL)
+        goto error;
+
+      if (!flatpak_oci_signatures_verify (signatures, repo, remote,
+                                          sigcheck_registry_uri,
+                                          sigcheck_repository,
+                                          digest,
+                                          error))
+        goto error;
+
+      mark_signatures_verified (verified_key);
+    }
+
   for (i = 0; manifest->layers[i] != NULL; i++)
     {
       FlatpakOciDescriptor *layer = manifest->layers[i];
@@ -3476,11 +5554,27 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
           expected_digest = layer->digest;
         }
 
-      blob_fd = flatpak_oci_registry_download_blob (registry, oci_repository, FALSE,
-                                                    delta_layer ? delta_layer->digest : layer->digest,
-                                                    (const char **)(delta_layer ? delta_layer->urls : layer->urls),
-                                                    oci_layer_progress, &progress_data,
-                                                    cancellable, &local_error);
+      if (delta_layer == NULL && old_root != NULL && layer_is_zstd_chunked (layer))
+        {
+          if (import_zstd_chunked_layer (repo, registry, oci_repository, layer, old_root,
+                                         archive_mtree, &progress_data, cancellable, &local_error))
+            {
+              progress_data.pulled_layers++;
+              progress_data.previous_layers_size += layer->size;
+              continue;
+            }
+
+          if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              goto error;
+            }
+
+          g_info ("Not using zstd:chunked for layer %s: %s", layer->digest, local_error->message);
+          g_clear_error (&local_error);
+        }
+
+      blob_fd = oci_layer_pull_wait (layer_pull, i, &progress_data, &local_error);
 
       if (blob_fd == -1 && delta_layer == NULL &&
           flatpak_oci_registry_is_local (registry) &&
@@ -3522,16 +5616,50 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
 #endif
       archive_read_support_format_all (a);
 
-      if (!flatpak_archive_read_open_fd_with_checksum (a, layer_fd, checksum, error))
-        goto error;
+      if (oci_layer_pull_is_streamed (layer_pull, i))
+        {
+          gboolean imported;
 
-      if (!ostree_repo_import_archive_to_mtree (repo, &opts, a, archive_mtree, NULL, cancellable, error))
-        goto error;
+          /* The compressed bytes we read are the downloaded ones, so
+           * report progress from here. The digest is checked below,
+           * before anything gets committed. */
+          imported = archive_read_open_fd_with_checksum_full (a, layer_fd, checksum,
+                                                              oci_layer_progress, &progress_data,
+                                                              &local_error) &&
+                     ostree_repo_import_archive_to_mtree (repo, &opts, a, archive_mtree, NULL, cancellable, &local_error);
+
+          if (archive_read_close (a) != ARCHIVE_OK && imported)
+            {
+              propagate_libarchive_error (&local_error, a);
+              imported = FALSE;
+            }
+
+          /* Closing our end makes the download stop if it is still going */
+          glnx_close_fd (&layer_fd);
+
+          /* A failed download usually explains a failed import, so prefer its error */
+          if (!oci_layer_pull_finish (layer_pull, i, error))
+            goto error;
 
-      if (archive_read_close (a) != ARCHIVE_OK)
+          if (!imported)
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              goto error;
+            }
+        }
+      else
         {
-          propagate_libarchive_error (error, a);
-          goto error;
+          if (!flatpak_archive_read_open_fd_with_checksum (a, layer_fd, checksum, error))
+            goto error;
+
+          if (!ostree_repo_import_archive_to_mtree (repo, &opts, a, archive_mtree, NULL, cancellable, error))
+            goto error;
+
+          if (archive_read_close (a) != ARCHIVE_OK)
+            {
+              propagate_libarchive_error (error, a);
+              goto error;
+            }
         }
 
       layer_checksum = g_checksum_get_string (checksum);
@@ -3553,6 +5681,24 @@ flatpak_pull_from_oci (OstreeRepo            *repo,
     goto error;
 
   metadata = g_variant_ref_sink (g_variant_builder_end (metadata_builder));
+
+  /* Record the installed size like build-export does, so that it is known
+   * without walking the tree when the commit is resolved or deployed */
+  if (!g_variant_lookup (metadata, "xa.installed-size", "t", NULL))
+    {
+      g_auto(GVariantDict) metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
+      guint64 installed_size = 0;
+
+      if (!flatpak_repo_collect_sizes (repo, archive_root, &installed_size, NULL, cancellable, error))
+        goto error;
+
+      g_variant_dict_init (&metadata_dict, metadata);
+      g_variant_dict_insert_value (&metadata_dict, "xa.installed-size",
+                                   g_variant_new_uint64 (GUINT64_TO_BE (installed_size)));
+      g_clear_pointer (&metadata, g_variant_unref);
+      metadata = g_variant_ref_sink (g_variant_dict_end (&metadata_dict));
+    }
+
   if (!ostree_repo_write_commit_with_time (repo,
                                            parent,
                                            flatpak_image_source_get_commit_subject (image_source),
@@ -74,8 +74,11 @@ void flatpak_progress_set_update_interval (FlatpakProgress *self,
 guint64 flatpak_progress_get_bytes_transferred (FlatpakProgress *self);
 guint64 flatpak_progress_get_transferred_extra_data_bytes (FlatpakProgress *self);
 guint64 flatpak_progress_get_start_time (FlatpakProgress *self);
+GVariant *flatpak_progress_get_metrics (FlatpakProgress *self);
 guint64 flatpak_progress_get_bytes_per_second (FlatpakProgress *self);
 const char *flatpak_progress_get_status (FlatpakProgress *self);
+void flatpak_progress_set_lazy_status (FlatpakProgress *self,
+                                       gboolean         lazy_status);
 int flatpak_progress_get_progress (FlatpakProgress *self);
 gboolean flatpak_progress_get_estimating (FlatpakProgress *self);
 
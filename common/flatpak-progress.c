@@ -70,6 +70,14 @@ flatpak_progress_init_main_context (FlatpakProgress    *maybe_progress,
     context->ostree_progress = ostree_async_progress_new ();
 }
 
+typedef enum {
+  FLATPAK_PROGRESS_STATUS_OSTREE,
+  FLATPAK_PROGRESS_STATUS_METADATA,
+  FLATPAK_PROGRESS_STATUS_DELTAS,
+  FLATPAK_PROGRESS_STATUS_EXTRA_DATA,
+  FLATPAK_PROGRESS_STATUS_FILES,
+} FlatpakProgressStatusKind;
+
 struct _FlatpakProgress
 {
   GObject parent;
@@ -115,6 +123,13 @@ struct _FlatpakProgress
   guint   last_total;
   guint64 bytes_per_second;
 
+  /* What the status string is made from, see ensure_status() */
+  FlatpakProgressStatusKind status_kind;
+  guint64 status_transferred;
+  guint64 status_total;
+  guint   status_fetched;
+  guint   status_requested;
+
   guint32 update_interval;
 
   /* Flags */
@@ -124,6 +139,9 @@ struct _FlatpakProgress
   guint last_was_metadata      : 1;
   guint done                   : 1;
   guint reported_overflow      : 1;
+  guint status_dirty           : 1;
+  guint status_show_rate       : 1;
+  guint lazy_status            : 1;
 };
 
 G_DEFINE_TYPE (FlatpakProgress, flatpak_progress, G_TYPE_OBJECT);
@@ -178,14 +196,13 @@ get_write_progress (guint outstanding_writes)
 static void
 update_status_progress_and_estimating (FlatpakProgress *self)
 {
-  GString *buf;
   guint64 total = 0;
   guint64 elapsed_time;
   guint new_progress = 0;
   gboolean estimating = FALSE;
-  guint64 total_transferred;
+  guint64 total_transferred = 0;
   gboolean last_was_metadata = self->last_was_metadata;
-  g_autofree gchar *formatted_bytes_total_transferred = NULL;
+  FlatpakProgressStatusKind status_kind;
 
   /* We get some extra calls before we've really started due to the initialization of the
      extra data, so ignore those */
@@ -195,8 +212,6 @@ update_status_progress_and_estimating (FlatpakProgress *self)
       return;
     }
 
-  buf = g_string_new ("");
-
   /* The heuristic here goes as follows:
    *  - While fetching metadata, grow up to 5%
    *  - Download goes up to 97%
@@ -204,19 +219,19 @@ update_status_progress_and_estimating (FlatpakProgress *self)
    */
 
   elapsed_time = (g_get_monotonic_time () - self->start_time) / G_USEC_PER_SEC;
+  self->status_show_rate = FALSE;
 
   /* When we receive the status, it means that the ostree pull operation is
    * finished. We only have to be careful about the extra-data fields. */
   if (*self->ostree_status && self->total_extra_data_bytes == 0)
     {
-      g_string_append (buf, self->ostree_status);
+      status_kind = FLATPAK_PROGRESS_STATUS_OSTREE;
       new_progress = 100;
       self->bytes_per_second = 0;
       goto out;
     }
 
   total_transferred = self->bytes_transferred + self->transferred_extra_data_bytes;
-  formatted_bytes_total_transferred =  g_format_size_full (total_transferred, 0);
 
   self->last_was_metadata = FALSE;
 
@@ -235,9 +250,7 @@ update_status_progress_and_estimating (FlatpakProgress *self)
        * all objects are scanned. */
 
       estimating = TRUE;
-
-      g_string_append_printf (buf, _("Downloading metadata: %u/(estimating) %s"),
-                              self->fetched, formatted_bytes_total_transferred);
+      status_kind = FLATPAK_PROGRESS_STATUS_METADATA;
 
       /* Go up to 5% until the metadata is all fetched */
       new_progress = 0;
@@ -248,8 +261,6 @@ update_status_progress_and_estimating (FlatpakProgress *self)
     {
       if (self->total_delta_parts > 0)
         {
-          g_autofree gchar *formatted_bytes_total = NULL;
-
           /* We're only using deltas, so we can ignore regular objects
            * and get perfect sizes.
            *
@@ -258,11 +269,7 @@ update_status_progress_and_estimating (FlatpakProgress *self)
            * available at the start and need not be downloaded.
            */
           total = self->total_delta_part_size - self->fetched_delta_part_size + self->total_extra_data_bytes;
-          formatted_bytes_total = g_format_size_full (total, 0);
-
-          g_string_append_printf (buf, _("Downloading: %s/%s"),
-                                  formatted_bytes_total_transferred,
-                                  formatted_bytes_total);
+          status_kind = FLATPAK_PROGRESS_STATUS_DELTAS;
         }
       else
         {
@@ -278,15 +285,9 @@ update_status_progress_and_estimating (FlatpakProgress *self)
           total = average_object_size * self->requested + self->total_extra_data_bytes;
 
           if (self->downloading_extra_data)
-            {
-              g_autofree gchar *formatted_bytes_total = g_format_size_full (total, 0);
-              g_string_append_printf (buf, _("Downloading extra data: %s/%s"),
-                                      formatted_bytes_total_transferred,
-                                      formatted_bytes_total);
-            }
+            status_kind = FLATPAK_PROGRESS_STATUS_EXTRA_DATA;
           else
-            g_string_append_printf (buf, _("Downloading files: %d/%d %s"),
-                                    self->fetched, self->requested, formatted_bytes_total_transferred);
+            status_kind = FLATPAK_PROGRESS_STATUS_FILES;
         }
 
       /* The download progress goes up to 97% */
@@ -305,10 +306,8 @@ update_status_progress_and_estimating (FlatpakProgress *self)
 
   if (elapsed_time > 0) // Ignore first second
     {
-      g_autofree gchar *formatted_bytes_sec = NULL;
       self->bytes_per_second = total_transferred / elapsed_time;
-      formatted_bytes_sec = g_format_size (self->bytes_per_second);
-      g_string_append_printf (buf, " (%s/s)", formatted_bytes_sec);
+      self->status_show_rate = TRUE;
     }
   else
     {
@@ -328,12 +327,85 @@ out:
       new_progress = 100;
     }
 
-  g_free (self->status);
-  self->status = g_string_free (buf, FALSE);
+  /* The status string is only formatted when someone asks for it */
+  self->status_kind = status_kind;
+  self->status_transferred = total_transferred;
+  self->status_total = total;
+  self->status_fetched = self->fetched;
+  self->status_requested = self->requested;
+  self->status_dirty = TRUE;
   self->progress = new_progress;
   self->estimating = estimating;
 }
 
+static void
+ensure_status (FlatpakProgress *self)
+{
+  GString *buf;
+  g_autofree gchar *formatted_bytes_total_transferred = NULL;
+  g_autofree gchar *formatted_bytes_total = NULL;
+
+  if (!self->status_dirty)
+    return;
+
+  buf = g_string_new ("");
+
+  if (self->status_kind != FLATPAK_PROGRESS_STATUS_OSTREE)
+    formatted_bytes_total_transferred = g_format_size_full (self->status_transferred, 0);
+
+  switch (self->status_kind)
+    {
+    case FLATPAK_PROGRESS_STATUS_OSTREE:
+      g_string_append (buf, self->ostree_status);
+      break;
+
+    case FLATPAK_PROGRESS_STATUS_METADATA:
+      g_string_append_printf (buf, _("Downloading metadata: %u/(estimating) %s"),
+                              self->status_fetched, formatted_bytes_total_transferred);
+      break;
+
+    case FLATPAK_PROGRESS_STATUS_DELTAS:
+      formatted_bytes_total = g_format_size_full (self->status_total, 0);
+      g_string_append_printf (buf, _("Downloading: %s/%s"),
+                              formatted_bytes_total_transferred,
+                              formatted_bytes_total);
+      break;
+
+    case FLATPAK_PROGRESS_STATUS_EXTRA_DATA:
+      formatted_bytes_total = g_format_size_full (self->status_total, 0);
+      g_string_append_printf (buf, _("Downloading extra data: %s/%s"),
+                              formatted_bytes_total_transferred,
+                              formatted_bytes_total);
+      break;
+
+    case FLATPAK_PROGRESS_STATUS_FILES:
+    default:
+      g_string_append_printf (buf, _("Downloading files: %d/%d %s"),
+                              self->status_fetched, self->status_requested, formatted_bytes_total_transferred);
+      break;
+    }
+
+  if (self->status_show_rate)
+    {
+      g_autofree gchar *formatted_bytes_sec = g_format_size (self->bytes_per_second);
+      g_string_append_printf (buf, " (%s/s)", formatted_bytes_sec);
+    }
+
+  g_free (self->status);
+  self->status = g_string_free (buf, FALSE);
+  self->status_dirty = FALSE;
+}
+
+static void
+call_callback (FlatpakProgress *self)
+{
+  if (!self->lazy_status)
+    ensure_status (self);
+
+  self->callback (self->lazy_status ? NULL : self->status,
+                  self->progress, self->estimating, self->user_data);
+}
+
 void
 flatpak_progress_init_extra_data (FlatpakProgress *self,
                                   guint64          n_extra_data,
@@ -384,7 +456,7 @@ flatpak_progress_update_extra_data (FlatpakProgress *self,
   self->transferred_extra_data_bytes = self->extra_data_previous_dl + downloaded_bytes;
   update_status_progress_and_estimating (self);
 
-  self->callback (self->status, self->progress, self->estimating, self->user_data);
+  call_callback (self);
 }
 
 void
@@ -455,7 +527,7 @@ flatpak_progress_update_oci_pull (FlatpakProgress *self,
   self->total_delta_superblocks = 0;
   update_status_progress_and_estimating (self);
 
-  self->callback (self->status, self->progress, self->estimating, self->user_data);
+  call_callback (self);
 }
 
 guint32
@@ -491,6 +563,30 @@ flatpak_progress_get_start_time (FlatpakProgress *self)
   return self->start_time;
 }
 
+/* The counters of what was pulled so far, as an a{sv} for the metrics
+ * in the journal and in flatpak_transaction_operation_get_metrics() */
+GVariant *
+flatpak_progress_get_metrics (FlatpakProgress *self)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "bytes-transferred",
+                         g_variant_new_uint64 (self->bytes_transferred));
+  g_variant_builder_add (&builder, "{sv}", "delta-bytes",
+                         g_variant_new_uint64 (self->fetched_delta_part_size));
+  g_variant_builder_add (&builder, "{sv}", "delta-parts-fetched",
+                         g_variant_new_uint32 (self->fetched_delta_parts));
+  g_variant_builder_add (&builder, "{sv}", "objects-fetched",
+                         g_variant_new_uint32 (self->fetched));
+  g_variant_builder_add (&builder, "{sv}", "metadata-fetched",
+                         g_variant_new_uint32 (self->metadata_fetched));
+  g_variant_builder_add (&builder, "{sv}", "extra-data-bytes",
+                         g_variant_new_uint64 (self->transferred_extra_data_bytes));
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
 guint64
 flatpak_progress_get_bytes_per_second (FlatpakProgress *self)
 {
@@ -500,9 +596,20 @@ flatpak_progress_get_bytes_per_second (FlatpakProgress *self)
 const char *
 flatpak_progress_get_status (FlatpakProgress *self)
 {
+  ensure_status (self);
   return self->status;
 }
 
+/* With a lazy status, the status string is only formatted when
+ * flatpak_progress_get_status() is called, and the callback gets %NULL
+ * for it. */
+void
+flatpak_progress_set_lazy_status (FlatpakProgress *self,
+                                  gboolean         lazy_status)
+{
+  self->lazy_status = !!lazy_status;
+}
+
 int
 flatpak_progress_get_progress (FlatpakProgress *self)
 {
@@ -563,7 +670,7 @@ invoke_callback (OstreeAsyncProgress *ostree_progress,
                  FlatpakProgress     *progress)
 {
   copy_ostree_progress_state (ostree_progress, progress);
-  progress->callback (progress->status, progress->progress, progress->estimating, progress->user_data);
+  call_callback (progress);
 }
 
 static OstreeAsyncProgress *
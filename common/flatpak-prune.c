@@ -85,6 +85,10 @@
  * with an exclusive lock. The second scan will be faster because it can ignore
  * all the commits we scanned with the shared lock held, meaning we spend less
  * time with an exclusive lock (during which no new commits can be added to the repo).
+ * The candidates for deletion are also collected with only the shared lock held,
+ * so that the exclusive phase just re-checks those against the final reachable
+ * set and deletes them, rather than scanning the whole repo. Objects written after
+ * the scan are never candidates, so they are left for the next prune.
  *
  * Upgrading the shared lock to an exclusive lock is deadlock prune, as two prune
  * operations could be holding the shared lock and both blocking forever to get the
@@ -371,54 +375,60 @@ flatpak_ostree_name_compare (const FlatpakOstreeObjectName *name_a,
   return memcmp (name_a, name_b, sizeof (FlatpakOstreeObjectName));
 }
 
-static guint
-flatpak_ostree_object_name_hash (gconstpointer a)
-{
-  const FlatpakOstreeObjectName *name = a;
-  const guint8 *data = &(*name)[0];
+/* This is a set of FlatpakOstreeObjectNames, stored inline in an open-addressing
+ * hashtable with linear probing. Storing the names directly in one array like this
+ * means there is no per-name allocation or pointer overhead, which is important as
+ * we can have millions of object names in a repo, and it keeps lookups cache friendly.
+ * Object type 0 is not a valid OstreeObjectType, so it marks an unused slot.
+ */
 
-  /* The checksum is essentially all random, so any 4 bytes of it should
-     be a good hash value. However, we avoid using the first ones, because
-     those are the ones that will be first compared on a hash collision,
-     so if they were always the same that would waste 4 comparisons. */
-  return
-    ((guint32) data[32]) |
-    ((guint32) data[31]) << 8 |
-    ((guint32) data[30]) << 16 |
-    ((guint32) data[29]) << 24;
+#define BAG_INITIAL_N_SLOTS 4096 /* must be a power of 2 */
+
+typedef struct {
+  FlatpakOstreeObjectName *slots;
+  gsize n_slots;
+  gsize n_names;
+} FlatpakOstreeObjectNameBag;
+
+static inline gboolean
+object_name_is_unused (const FlatpakOstreeObjectName *name)
+{
+  return (*name)[32] == 0;
 }
 
-static gboolean
-flatpak_ostree_object_name_equal (gconstpointer a,
-                                  gconstpointer b)
+static inline gsize
+object_name_bag_hash (const FlatpakOstreeObjectName *name)
 {
-  const FlatpakOstreeObjectName *name_a = a;
-  const FlatpakOstreeObjectName *name_b = b;
+  guint64 hash;
 
-  return flatpak_ostree_name_compare (name_a, name_b) == 0;
+  /* The checksum is essentially all random, so any part of it is a good
+     hash value. */
+  memcpy (&hash, &(*name)[24], sizeof (hash));
+  return (gsize) hash;
 }
 
-/* This is a container for allocating FlatpakOstreeObjectNames in chunks without relocations so
- * that the resulting pointers are stable and can be stored in e.g. a hashtable.
- * Storing the names in chunks like this means we avoid fragmentation and overhead related to
- * each individual name which is important as we can have millions of object names in a repo.
- */
+static gsize
+object_name_bag_lookup_slot (const FlatpakOstreeObjectName *slots,
+                             gsize                          n_slots,
+                             const FlatpakOstreeObjectName *name)
+{
+  gsize mask = n_slots - 1;
+  gsize i = object_name_bag_hash (name) & mask;
 
-#define BAG_CHUNK_SIZE 1985 /* nr of objects per chunk in bag, makes chunk fit in 64k with some spare for overhead */
-typedef struct {
-  FlatpakOstreeObjectName *current_chunk; /* Null if non started */
-  gsize current_chunk_used; /* number of used objects in current chunk */
-  GSList *chunks; /* List of allocated chunks */
-  GHashTable *hash; /* (element-type FlatpakOstreeObjectName) */
-} FlatpakOstreeObjectNameBag;
+  while (!object_name_is_unused (&slots[i]) &&
+         flatpak_ostree_name_compare (&slots[i], name) != 0)
+    i = (i + 1) & mask;
+
+  return i;
+}
 
 static FlatpakOstreeObjectNameBag *
 object_name_bag_new (void)
 {
   FlatpakOstreeObjectNameBag *bag = g_new0 (FlatpakOstreeObjectNameBag, 1);
 
-  bag->hash = g_hash_table_new_full (flatpak_ostree_object_name_hash, flatpak_ostree_object_name_equal,
-                                     NULL, NULL);
+  bag->n_slots = BAG_INITIAL_N_SLOTS;
+  bag->slots = g_new0 (FlatpakOstreeObjectName, bag->n_slots);
 
   return bag;
 }
@@ -426,48 +436,218 @@ object_name_bag_new (void)
 static void
 object_name_bag_free (FlatpakOstreeObjectNameBag *bag)
 {
-  g_hash_table_unref (bag->hash);
-  g_slist_free_full (bag->chunks, g_free);
+  g_free (bag->slots);
   g_free (bag);
 }
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakOstreeObjectNameBag, object_name_bag_free)
 
+static gsize
+object_name_bag_size (FlatpakOstreeObjectNameBag *bag)
+{
+  return bag->n_names;
+}
+
 static gboolean
 object_name_bag_contains (FlatpakOstreeObjectNameBag *bag,
                           const FlatpakOstreeObjectName *name)
 {
-  return g_hash_table_contains (bag->hash, name);
+  gsize i = object_name_bag_lookup_slot (bag->slots, bag->n_slots, name);
+
+  return !object_name_is_unused (&bag->slots[i]);
+}
+
+static void
+object_name_bag_grow (FlatpakOstreeObjectNameBag *bag)
+{
+  gsize new_n_slots = bag->n_slots * 2;
+  FlatpakOstreeObjectName *new_slots = g_new0 (FlatpakOstreeObjectName, new_n_slots);
+
+  for (gsize i = 0; i < bag->n_slots; i++)
+    {
+      gsize j;
+
+      if (object_name_is_unused (&bag->slots[i]))
+        continue;
+
+      j = object_name_bag_lookup_slot (new_slots, new_n_slots, &bag->slots[i]);
+      memcpy (&new_slots[j], &bag->slots[i], sizeof (FlatpakOstreeObjectName));
+    }
+
+  g_free (bag->slots);
+  bag->slots = new_slots;
+  bag->n_slots = new_n_slots;
 }
 
 static void
 object_name_bag_insert (FlatpakOstreeObjectNameBag *bag,
                         const FlatpakOstreeObjectName *name)
 {
-  FlatpakOstreeObjectName *res;
+  gsize i;
+
+  g_assert (!object_name_is_unused (name));
 
-  if (g_hash_table_contains (bag->hash, name))
+  i = object_name_bag_lookup_slot (bag->slots, bag->n_slots, name);
+  if (!object_name_is_unused (&bag->slots[i]))
     return;
 
-  if (bag->current_chunk == NULL)
+  memcpy (&bag->slots[i], name, sizeof (FlatpakOstreeObjectName));
+  bag->n_names++;
+
+  /* Keep the load factor below 3/4 so probe sequences stay short */
+  if (bag->n_names * 4 >= bag->n_slots * 3)
+    object_name_bag_grow (bag);
+}
+
+static void
+object_name_bag_insert_all (FlatpakOstreeObjectNameBag *bag,
+                            FlatpakOstreeObjectNameBag *other)
+{
+  for (gsize i = 0; i < other->n_slots; i++)
+    {
+      if (!object_name_is_unused (&other->slots[i]))
+        object_name_bag_insert (bag, &other->slots[i]);
+    }
+}
+
+/* Prune is mostly I/O bound, so this doesn't need to scale much with cores */
+#define PRUNE_MAX_THREADS 16
+
+static guint
+prune_n_threads (void)
+{
+  return CLAMP (g_get_num_processors (), 1, PRUNE_MAX_THREADS);
+}
+
+/* Returns the set of objects reachable from the commit, as an array of
+ * FlatpakOstreeObjectName. This is cached in the extra commitmeta for
+ * complete commits, and computed (and saved) if missing. */
+static GVariant *
+load_commit_reachable (OstreeRepo    *repo,
+                       const char    *checksum,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  g_autoptr(GVariant) extra_commitmeta = NULL;
+  g_autoptr(GVariant) commit_reachable = NULL;
+  g_autoptr(GHashTable) commit_reachable_ht = NULL;
+  g_autoptr(GVariant) new_extra_commitmeta = NULL;
+  g_autofree FlatpakOstreeObjectName *commit_reachable_raw = NULL;
+  FlatpakOstreeObjectName *next_commit_reachable_raw;
+  g_auto(GVariantDict) extra_commitmeta_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  OstreeRepoCommitState commitstate = 0;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!load_extra_commitmeta (repo, checksum, &extra_commitmeta, cancellable, error))
+    return NULL;
+
+  if (extra_commitmeta)
+    commit_reachable = g_variant_lookup_value (extra_commitmeta, "xa.reachable", G_VARIANT_TYPE ("a" FLATPAK_OSTREE_OBJECT_NAME_ELEMENT_TYPE));
+
+  if (commit_reachable != NULL)
+    return g_steal_pointer (&commit_reachable);
+
+  if (!ostree_repo_load_commit (repo, checksum, NULL, &commitstate, &local_error) &&
+      !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
     {
-      bag->current_chunk = g_new (FlatpakOstreeObjectName, BAG_CHUNK_SIZE);
-      bag->current_chunk_used = 0;
-      bag->chunks = g_slist_prepend (bag->chunks, bag->current_chunk);
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
     }
 
-  res = &bag->current_chunk[bag->current_chunk_used++];
-  memcpy (res, name, sizeof (FlatpakOstreeObjectName));
+  commit_reachable_ht = reachable_commits_new ();
+  if (!ostree_repo_traverse_commit_union (repo, checksum, 0, commit_reachable_ht,
+                                          cancellable, error))
+    return NULL;
+
+  commit_reachable_raw = g_new (FlatpakOstreeObjectName, g_hash_table_size (commit_reachable_ht));
+
+  next_commit_reachable_raw = &commit_reachable_raw[0];
+  GLNX_HASH_TABLE_FOREACH_V (commit_reachable_ht, GVariant *, reachable_commit)
+    {
+      VarObjectNameRef ref = var_object_name_from_gvariant ((GVariant *)reachable_commit);
+
+      flatpak_ostree_object_name_serialize (next_commit_reachable_raw,
+                                            var_object_name_get_checksum (ref),
+                                            var_object_name_get_objtype (ref));
+      next_commit_reachable_raw++;
+    }
+
+  commit_reachable = g_variant_ref_sink (g_variant_new_fixed_array (G_VARIANT_TYPE (FLATPAK_OSTREE_OBJECT_NAME_ELEMENT_TYPE),
+                                                                    commit_reachable_raw,
+                                                                    g_hash_table_size (commit_reachable_ht),
+                                                                    sizeof(FlatpakOstreeObjectName)));
+
+  /* Don't save the reachable set for later reuse if the commit is partial, as it may not be complete */
+  if ((commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL) == 0)
+    {
+      g_variant_dict_init (&extra_commitmeta_builder, extra_commitmeta);
+      g_variant_dict_insert_value (&extra_commitmeta_builder, "xa.reachable", commit_reachable);
+
+      new_extra_commitmeta = g_variant_ref_sink (g_variant_dict_end (&extra_commitmeta_builder));
+      if (!save_extra_commitmeta (repo, checksum, new_extra_commitmeta, cancellable, error))
+        return NULL;
+    }
+
+  return g_steal_pointer (&commit_reachable);
+}
+
+typedef struct {
+  OstreeRepo *repo;
+  FlatpakOstreeObjectNameBag *reachable;
+  GCancellable *cancellable;
+  GMutex lock; /* Protects reachable and error */
+  GError *error;
+} TraverseData;
+
+static void
+traverse_commit_thread_func (gpointer data,
+                             gpointer user_data)
+{
+  g_autofree char *checksum = data;
+  TraverseData *traverse = user_data;
+  g_autoptr(GVariant) commit_reachable = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&traverse->lock);
+  failed = traverse->error != NULL;
+  g_mutex_unlock (&traverse->lock);
+
+  if (failed)
+    return;
+
+  g_debug ("Finding objects to keep for commit %s", checksum);
+
+  commit_reachable = load_commit_reachable (traverse->repo, checksum,
+                                            traverse->cancellable, &local_error);
 
-  if (bag->current_chunk_used == BAG_CHUNK_SIZE)
-    bag->current_chunk = NULL; /* Need new chunk */
+  g_mutex_lock (&traverse->lock);
 
-  g_hash_table_add (bag->hash, res);
+  if (commit_reachable == NULL)
+    {
+      if (traverse->error == NULL)
+        traverse->error = g_steal_pointer (&local_error);
+    }
+  else
+    {
+      gsize n_reachable, i;
+      const FlatpakOstreeObjectName *reachable_objects =
+        g_variant_get_fixed_array (commit_reachable, &n_reachable,
+                                   sizeof(FlatpakOstreeObjectName));
+
+      for (i = 0; i < n_reachable; i++)
+        object_name_bag_insert (traverse->reachable, &reachable_objects[i]);
+    }
+
+  g_mutex_unlock (&traverse->lock);
 }
 
 /* Find all reachable commit objects starting from any ref in the repo
  * optionally limiting the number of parent commits.
  *
+ * The reachable sets of the commits are loaded (or computed) in parallel,
+ * as that is where most of the time goes on large repos.
+ *
  * This doesn't do any locking, so need something else to have an exclusive lock
  * on the repo to avoid races with other processes modifying the repo.
  */
@@ -475,12 +655,15 @@ static gboolean
 traverse_reachable_refs_unlocked (OstreeRepo                  *repo,
                                   guint                        depth,
                                   FlatpakOstreeObjectNameBag  *reachable,
+                                  GHashTable                 **out_commits,
                                   GCancellable                *cancellable,
                                   GError                     **error)
 {
   g_autoptr(GHashTable) all_refs = NULL;  /* (element-type utf8 utf8) */
   g_autoptr(GHashTable) all_collection_refs = NULL;  /* (element-type OstreeChecksumRef utf8) */
   g_autoptr(GHashTable) checksums = NULL;  /* (element-type const char *) */
+  TraverseData traverse = { repo, reachable, cancellable };
+  GThreadPool *pool;
 
   checksums = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
@@ -506,98 +689,62 @@ traverse_reachable_refs_unlocked (OstreeRepo                  *repo,
         return FALSE;
     }
 
+  g_mutex_init (&traverse.lock);
+
+  pool = g_thread_pool_new (traverse_commit_thread_func, &traverse,
+                            prune_n_threads (), FALSE, error);
+  if (pool == NULL)
+    {
+      g_mutex_clear (&traverse.lock);
+      return FALSE;
+    }
+
   /* Find reachable objects from each commit checksum */
   GLNX_HASH_TABLE_FOREACH_V (checksums, const char*, checksum)
     {
-      g_autoptr(GVariant) extra_commitmeta = NULL;
-      g_autoptr(GVariant) commit_reachable = NULL;
       FlatpakOstreeObjectName commit_name;
+      gboolean scanned;
 
       /* Early bail-out if we already scanned this commit in the first phase (or via some other branch) */
       flatpak_ostree_object_name_serialize (&commit_name, checksum, OSTREE_OBJECT_TYPE_COMMIT);
-      if (object_name_bag_contains (reachable, &commit_name))
+      g_mutex_lock (&traverse.lock);
+      scanned = object_name_bag_contains (reachable, &commit_name);
+      g_mutex_unlock (&traverse.lock);
+      if (scanned)
         continue;
 
-      g_debug ("Finding objects to keep for commit %s", checksum);
-
-      if (!load_extra_commitmeta (repo, checksum, &extra_commitmeta, cancellable, error))
-        return FALSE;
-
-      if (extra_commitmeta)
-        commit_reachable = g_variant_lookup_value (extra_commitmeta, "xa.reachable", G_VARIANT_TYPE ("a" FLATPAK_OSTREE_OBJECT_NAME_ELEMENT_TYPE));
-
-      if (commit_reachable == NULL)
-        {
-          g_autoptr(GHashTable) commit_reachable_ht = reachable_commits_new ();
-          g_autoptr(GVariant) new_extra_commitmeta = NULL;
-          g_autofree FlatpakOstreeObjectName *commit_reachable_raw = NULL;
-          FlatpakOstreeObjectName *next_commit_reachable_raw;
-          g_auto(GVariantDict) extra_commitmeta_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
-          OstreeRepoCommitState commitstate = 0;
-          g_autoptr(GError) local_error = NULL;
-
-          if (!ostree_repo_load_commit (repo, checksum, NULL, &commitstate, &local_error) &&
-              !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-            {
-              g_propagate_error (error, g_steal_pointer (&local_error));
-              return FALSE;
-            }
-
-          if (!ostree_repo_traverse_commit_union (repo, checksum, 0, commit_reachable_ht,
-                                                  cancellable, error))
-            return FALSE;
-
-          commit_reachable_raw = g_new (FlatpakOstreeObjectName, g_hash_table_size (commit_reachable_ht));
-
-          next_commit_reachable_raw = &commit_reachable_raw[0];
-          GLNX_HASH_TABLE_FOREACH_V (commit_reachable_ht, GVariant *, reachable_commit)
-            {
-              VarObjectNameRef ref = var_object_name_from_gvariant ((GVariant *)reachable_commit);
-
-              flatpak_ostree_object_name_serialize (next_commit_reachable_raw,
-                                                    var_object_name_get_checksum (ref),
-                                                    var_object_name_get_objtype (ref));
-              next_commit_reachable_raw++;
-            }
-
-          commit_reachable = g_variant_ref_sink (g_variant_new_fixed_array (G_VARIANT_TYPE (FLATPAK_OSTREE_OBJECT_NAME_ELEMENT_TYPE),
-                                                                            commit_reachable_raw,
-                                                                            g_hash_table_size (commit_reachable_ht),
-                                                                            sizeof(FlatpakOstreeObjectName)));
-
-          /* Don't save the reachable set for later reuse if the commit is partial, as it may not be complete */
-          if ((commitstate & OSTREE_REPO_COMMIT_STATE_PARTIAL) == 0)
-            {
-              g_variant_dict_init (&extra_commitmeta_builder, extra_commitmeta);
-              g_variant_dict_insert_value (&extra_commitmeta_builder, "xa.reachable", commit_reachable);
-
-              new_extra_commitmeta = g_variant_ref_sink (g_variant_dict_end (&extra_commitmeta_builder));
-              if (!save_extra_commitmeta (repo, checksum, new_extra_commitmeta, cancellable, error))
-                return FALSE;
-            }
-        }
+      g_thread_pool_push (pool, g_strdup (checksum), NULL);
+    }
 
-      {
-        gsize n_reachable, i;
-        const FlatpakOstreeObjectName *reachable_objects =
-          g_variant_get_fixed_array (commit_reachable, &n_reachable,
-                                     sizeof(FlatpakOstreeObjectName));
+  /* Waits for all queued commits */
+  g_thread_pool_free (pool, FALSE, TRUE);
+  g_mutex_clear (&traverse.lock);
 
-        for (i = 0; i < n_reachable; i++)
-          object_name_bag_insert (reachable, &reachable_objects[i]);
-      }
+  if (traverse.error != NULL)
+    {
+      g_propagate_error (error, traverse.error);
+      return FALSE;
     }
 
+  if (out_commits)
+    *out_commits = g_steal_pointer (&checksums);
+
   return TRUE;
 }
 
 typedef struct {
   OstreeRepo *repo;
   FlatpakOstreeObjectNameBag *reachable;
+  FlatpakOstreeObjectNameBag *unreachable; /* Candidates for deletion */
   gboolean dont_prune;
   guint n_reachable;
   guint n_unreachable;
   guint64 freed_bytes;
+
+  /* For the parallel sweep, protects the above counters, unreachable and error */
+  GCancellable *cancellable;
+  GMutex lock;
+  GError *error;
 } OtPruneData;
 
 static gboolean
@@ -639,12 +786,12 @@ prune_loose_object (OtPruneData          *data,
 }
 
 static gboolean
-prune_unreachable_loose_objects_at (OstreeRepo             *self,
-                                    OtPruneData            *data,
-                                    int                     dfd,
-                                    const char             *prefix,
-                                    GCancellable           *cancellable,
-                                    GError                **error)
+find_unreachable_loose_objects_at (OstreeRepo             *self,
+                                   OtPruneData            *data,
+                                   int                     dfd,
+                                   const char             *prefix,
+                                   GCancellable           *cancellable,
+                                   GError                **error)
 {
 
   g_auto(GLnxDirFdIterator) dfd_iter = { 0, };
@@ -703,37 +850,287 @@ prune_unreachable_loose_objects_at (OstreeRepo             *self,
           continue;
         }
 
-      if (!prune_loose_object (data, buf, objtype, cancellable, error))
-        return FALSE;
+      object_name_bag_insert (data->unreachable, &key);
     }
 
   return TRUE;
 }
 
+static void
+find_unreachable_prefix_thread_func (gpointer data,
+                                     gpointer user_data)
+{
+  static const gchar hexchars[] = "0123456789abcdef";
+  guint c = GPOINTER_TO_UINT (data) - 1;
+  OtPruneData *shared = user_data;
+  g_autoptr(FlatpakOstreeObjectNameBag) unreachable = object_name_bag_new ();
+  OtPruneData local = { shared->repo, shared->reachable, unreachable, shared->dont_prune };
+  g_autoptr(GError) local_error = NULL;
+  char buf[] = "objects/XX";
+  gboolean failed;
+
+  g_mutex_lock (&shared->lock);
+  failed = shared->error != NULL;
+  g_mutex_unlock (&shared->lock);
+
+  if (failed)
+    return;
+
+  buf[8] = hexchars[c >> 4];
+  buf[9] = hexchars[c & 0xF];
+
+  /* The reachable bag is not modified during the sweep, so it is safe to
+   * look up from all threads without locking. */
+  if (!find_unreachable_loose_objects_at (shared->repo, &local,
+                                          ostree_repo_get_dfd (shared->repo), buf,
+                                          shared->cancellable, &local_error))
+    {
+      g_mutex_lock (&shared->lock);
+      if (shared->error == NULL)
+        shared->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&shared->lock);
+    }
+
+  g_mutex_lock (&shared->lock);
+  shared->n_reachable += local.n_reachable;
+  object_name_bag_insert_all (shared->unreachable, unreachable);
+  g_mutex_unlock (&shared->lock);
+}
+
+/* Collects all loose objects not in data->reachable into data->unreachable.
+ * Each of the 256 object prefix directories is swept by the thread pool */
 static gboolean
-prune_unreachable_loose_objects (OstreeRepo                  *self,
-                                 OtPruneData                 *data,
-                                 GCancellable                *cancellable,
-                                 GError                     **error)
+find_unreachable_loose_objects (OstreeRepo                  *self,
+                                OtPruneData                 *data,
+                                GCancellable                *cancellable,
+                                GError                     **error)
 {
- static const gchar hexchars[] = "0123456789abcdef";
- int dfd = ostree_repo_get_dfd (self);
+ GThreadPool *pool;
 
  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
- for (guint c = 0; c < 256; c++)
+ data->cancellable = cancellable;
+ g_mutex_init (&data->lock);
+
+ pool = g_thread_pool_new (find_unreachable_prefix_thread_func, data,
+                           prune_n_threads (), FALSE, error);
+ if (pool == NULL)
    {
-     char buf[] = "objects/XX";
-     buf[8] = hexchars[c >> 4];
-     buf[9] = hexchars[c & 0xF];
+     g_mutex_clear (&data->lock);
+     return FALSE;
+   }
+
+ for (guint c = 0; c < 256; c++)
+   g_thread_pool_push (pool, GUINT_TO_POINTER (c + 1), NULL);
+
+ /* Waits for all prefixes */
+ g_thread_pool_free (pool, FALSE, TRUE);
+ g_mutex_clear (&data->lock);
 
-     if (!prune_unreachable_loose_objects_at (self, data, dfd, buf, cancellable, error))
-       return FALSE;
+ if (data->error != NULL)
+   {
+     g_propagate_error (error, g_steal_pointer (&data->error));
+     return FALSE;
    }
 
  return TRUE;
 }
 
+/* To avoid sweeping the entire repo every time, each prune records the set
+ * of commits that were reachable (its "generation"). The next prune then
+ * only needs to look at objects reachable from the commits that dropped out
+ * since, using their cached xa.reachable sets. This misses objects that were
+ * added and became unreachable between two prunes (e.g. a commit that was
+ * added and removed again), so we still do a full sweep now and then. */
+#define PRUNE_GENERATION_FILE ".flatpak-prune-generation"
+#define PRUNE_GENERATION_TYPE "(xas)" /* (last full sweep time, reachable commits) */
+#define PRUNE_FULL_SWEEP_INTERVAL_SECS (7 * 24 * 60 * 60)
+
+static gboolean
+load_prune_generation (OstreeRepo    *repo,
+                       gint64        *out_last_full_sweep,
+                       GHashTable   **out_commits,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  glnx_autofd int fd = -1;
+  g_autoptr(GBytes) content = NULL;
+  g_autoptr(GVariant) generation = NULL;
+  g_autoptr(GHashTable) commits = NULL;
+  g_autofree const char **commits_strv = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gint64 last_full_sweep;
+
+  *out_commits = NULL;
+
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), PRUNE_GENERATION_FILE, FALSE, &fd, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        return TRUE;
+
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  content = glnx_fd_readall_bytes (fd, cancellable, error);
+  if (content == NULL)
+    return FALSE;
+
+  generation = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (PRUNE_GENERATION_TYPE), content, FALSE));
+  g_variant_get (generation, "(x^a&s)", &last_full_sweep, &commits_strv);
+
+  commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (gsize i = 0; commits_strv[i] != NULL; i++)
+    g_hash_table_add (commits, g_strdup (commits_strv[i]));
+
+  *out_last_full_sweep = last_full_sweep;
+  *out_commits = g_steal_pointer (&commits);
+  return TRUE;
+}
+
+static gboolean
+save_prune_generation (OstreeRepo    *repo,
+                       gint64         last_full_sweep,
+                       GHashTable    *commits,
+                       GCancellable  *cancellable,
+                       GError       **error)
+{
+  g_autofree const char **commits_strv = (const char **) g_hash_table_get_keys_as_array (commits, NULL);
+  g_autoptr(GVariant) generation = NULL;
+
+  generation = g_variant_ref_sink (g_variant_new ("(x^as)", last_full_sweep, commits_strv));
+
+  return glnx_file_replace_contents_at (ostree_repo_get_dfd (repo), PRUNE_GENERATION_FILE,
+                                        g_variant_get_data (generation),
+                                        g_variant_get_size (generation),
+                                        GLNX_FILE_REPLACE_DATASYNC_NEW,
+                                        cancellable, error);
+}
+
+static void
+add_unreachable_commit_objects (OstreeRepo    *repo,
+                                OtPruneData   *data,
+                                GVariant      *commit_reachable)
+{
+  gsize n_objects;
+  const FlatpakOstreeObjectName *objects =
+    g_variant_get_fixed_array (commit_reachable, &n_objects,
+                               sizeof(FlatpakOstreeObjectName));
+
+  for (gsize i = 0; i < n_objects; i++)
+    {
+      if (!object_name_bag_contains (data->reachable, &objects[i]))
+        object_name_bag_insert (data->unreachable, &objects[i]);
+    }
+}
+
+/* Collects only the objects reachable from commits that were reachable at the
+ * last prune but aren't anymore. Sets *out_incremental to FALSE if this is
+ * not possible and the caller needs to do a full sweep. */
+static gboolean
+find_unreachable_since_last_generation (OstreeRepo    *repo,
+                                        OtPruneData   *data,
+                                        GHashTable    *commits,
+                                        gboolean      *out_incremental,
+                                        gint64        *out_last_full_sweep,
+                                        GCancellable  *cancellable,
+                                        GError       **error)
+{
+  g_autoptr(GHashTable) old_commits = NULL;
+  g_autoptr(GPtrArray) dead_reachables = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  gint64 last_full_sweep = 0;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+  *out_incremental = FALSE;
+
+  if (!load_prune_generation (repo, &last_full_sweep, &old_commits, cancellable, error))
+    return FALSE;
+
+  if (old_commits == NULL)
+    return TRUE;
+
+  if (last_full_sweep > now || now - last_full_sweep >= PRUNE_FULL_SWEEP_INTERVAL_SECS)
+    {
+      g_info ("Last full prune is too old, sweeping all objects");
+      return TRUE;
+    }
+
+  /* Load everything first so we don't collect anything if we then have to
+   * fall back to a full sweep anyway */
+  GLNX_HASH_TABLE_FOREACH (old_commits, const char *, checksum)
+    {
+      g_autoptr(GVariant) extra_commitmeta = NULL;
+      GVariant *commit_reachable = NULL;
+
+      if (g_hash_table_contains (commits, checksum))
+        continue;
+
+      if (!load_extra_commitmeta (repo, checksum, &extra_commitmeta, cancellable, error))
+        return FALSE;
+
+      if (extra_commitmeta)
+        commit_reachable = g_variant_lookup_value (extra_commitmeta, "xa.reachable", G_VARIANT_TYPE ("a" FLATPAK_OSTREE_OBJECT_NAME_ELEMENT_TYPE));
+
+      if (commit_reachable == NULL)
+        {
+          g_info ("No cached reachable objects for removed commit %s, sweeping all objects", checksum);
+          return TRUE;
+        }
+
+      g_ptr_array_add (dead_reachables, commit_reachable);
+    }
+
+  g_info ("Finding objects of %u unreachable commits", dead_reachables->len);
+
+  for (guint i = 0; i < dead_reachables->len; i++)
+    add_unreachable_commit_objects (repo, data, g_ptr_array_index (dead_reachables, i));
+
+  *out_incremental = TRUE;
+  *out_last_full_sweep = last_full_sweep;
+  return TRUE;
+}
+
+/* Deletes the previously collected candidates that are still unreachable
+ * and exist. Must be called with the exclusive lock held, after the
+ * reachable set has been updated under that lock. */
+static gboolean
+prune_unreachable_candidates (OstreeRepo    *repo,
+                              OtPruneData   *data,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  FlatpakOstreeObjectNameBag *candidates = data->unreachable;
+
+  for (gsize i = 0; i < candidates->n_slots; i++)
+    {
+      const FlatpakOstreeObjectName *name = &candidates->slots[i];
+      char checksum[OSTREE_SHA256_STRING_LEN+1];
+      OstreeObjectType objtype = (*name)[32];
+      gboolean has_object;
+
+      if (object_name_is_unused (name))
+        continue;
+
+      /* Made reachable again by a commit since the unlocked scan */
+      if (object_name_bag_contains (data->reachable, name))
+        {
+          data->n_reachable++;
+          continue;
+        }
+
+      ostree_checksum_inplace_from_bytes (&(*name)[0], checksum);
+
+      if (!ostree_repo_has_object (repo, objtype, checksum, &has_object, cancellable, error))
+        return FALSE;
+
+      if (has_object &&
+          !prune_loose_object (data, checksum, objtype, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 gboolean
 flatpak_repo_prune (OstreeRepo    *repo,
                     int            depth,
@@ -745,8 +1142,13 @@ flatpak_repo_prune (OstreeRepo    *repo,
                     GError       **error)
 {
   g_autoptr(FlatpakOstreeObjectNameBag) reachable = object_name_bag_new ();
+  g_autoptr(FlatpakOstreeObjectNameBag) unreachable = object_name_bag_new ();
+  g_autoptr(GHashTable) commits = NULL;
+  g_autoptr(GHashTable) locked_commits = NULL;
   OtPruneData data = { 0, };
   g_autoptr(GTimer) timer = NULL;
+  gboolean incremental = FALSE;
+  gint64 last_full_sweep = 0;
 
   /* This version only handles archive repos, if called for something else call ostree */
   if (ostree_repo_get_mode (repo) != OSTREE_REPO_MODE_ARCHIVE)
@@ -760,6 +1162,11 @@ flatpak_repo_prune (OstreeRepo    *repo,
                                 cancellable, error);
     }
 
+  data.repo = repo;
+  data.reachable = reachable;
+  data.unreachable = unreachable;
+  data.dont_prune = dry_run;
+
   {
     /* shared lock in this region, see locking strategy above */
     glnx_autofd int lock_fd = -1;
@@ -771,12 +1178,36 @@ flatpak_repo_prune (OstreeRepo    *repo,
     g_info ("Finding reachable objects, unlocked (depth=%d)", depth);
     g_timer_start (timer);
 
-    if (!traverse_reachable_refs_unlocked (repo, depth, reachable, cancellable, error))
+    if (!traverse_reachable_refs_unlocked (repo, depth, reachable, &commits, cancellable, error))
       return FALSE;
 
     g_timer_stop (timer);
     g_info ("Elapsed time: %.1f sec",  g_timer_elapsed (timer, NULL));
-    g_clear_pointer (&timer, g_timer_destroy);
+
+    /* Also find the candidates for deletion with only the shared lock held,
+     * so that the exclusive region only has to recheck and delete those. */
+    if (!dry_run)
+      {
+        g_timer_start (timer);
+
+        if (!find_unreachable_since_last_generation (repo, &data, commits,
+                                                     &incremental, &last_full_sweep,
+                                                     cancellable, error))
+          return FALSE;
+
+        if (!incremental)
+          {
+            g_info ("Finding unreachable objects, unlocked");
+
+            if (!find_unreachable_loose_objects (repo, &data, cancellable, error))
+              return FALSE;
+
+            last_full_sweep = g_get_real_time () / G_USEC_PER_SEC;
+          }
+
+        g_timer_stop (timer);
+        g_info ("Elapsed time: %.1f sec",  g_timer_elapsed (timer, NULL));
+      }
   }
 
   if (!dry_run)
@@ -787,16 +1218,36 @@ flatpak_repo_prune (OstreeRepo    *repo,
       if (!get_repo_lock (repo, LOCK_EX, &lock_fd, cancellable, error))
         return FALSE;
 
-      timer = g_timer_new ();
       g_info ("Finding reachable objects, locked (depth=%d)", depth);
       g_timer_start (timer);
 
-      if (!traverse_reachable_refs_unlocked (repo, depth, reachable, cancellable, error))
+      if (!traverse_reachable_refs_unlocked (repo, depth, reachable, &locked_commits, cancellable, error))
         return FALSE;
 
-      data.repo = repo;
-      data.reachable = reachable;
-      data.dont_prune = dry_run;
+      /* Objects of commits that became unreachable between the two phases
+       * were not collected above. Their reachable sets were cached by the
+       * unlocked traversal. */
+      GLNX_HASH_TABLE_FOREACH (commits, const char *, checksum)
+        {
+          g_autoptr(GVariant) commit_reachable = NULL;
+          g_autoptr(GError) local_error = NULL;
+
+          if (g_hash_table_contains (locked_commits, checksum))
+            continue;
+
+          /* If it is gone entirely, someone else already pruned it */
+          commit_reachable = load_commit_reachable (repo, checksum, cancellable, &local_error);
+          if (commit_reachable == NULL)
+            {
+              if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+                continue;
+
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return FALSE;
+            }
+
+          add_unreachable_commit_objects (repo, &data, commit_reachable);
+        }
 
       g_timer_stop (timer);
       g_info ("Elapsed time: %.1f sec",  g_timer_elapsed (timer, NULL));
@@ -805,12 +1256,19 @@ flatpak_repo_prune (OstreeRepo    *repo,
         g_info ("Pruning unreachable objects");
         g_timer_start (timer);
 
-        if (!prune_unreachable_loose_objects (repo, &data, cancellable, error))
+        if (!prune_unreachable_candidates (repo, &data, cancellable, error))
           return FALSE;
 
+        /* We didn't look at every object, so all we know is what's reachable */
+        if (incremental)
+          data.n_reachable = object_name_bag_size (reachable);
+
         g_timer_stop (timer);
         g_info ("Elapsed time: %.1f sec",  g_timer_elapsed (timer, NULL));
       }
+
+      if (!save_prune_generation (repo, last_full_sweep, locked_commits, cancellable, error))
+        return FALSE;
     }
 
   /* Prune static deltas outside lock to avoid conflict with its exclusive lock */
@@ -831,4 +1289,3 @@ flatpak_repo_prune (OstreeRepo    *repo,
   *out_pruned_object_size_total = data.freed_bytes;
   return TRUE;
 }
-
@@ -42,21 +42,72 @@ flatpak_kinds_from_kind (FlatpakRefKind kind)
   return FLATPAK_KINDS_APP;
 }
 
+/* Character classes of the ASCII characters allowed in the parts of a
+ * ref, so validating them is a table lookup per character */
+enum {
+  REF_CHAR_ALPHA = 1 << 0, /* [A-Za-z_] */
+  REF_CHAR_DIGIT = 1 << 1,
+  REF_CHAR_DASH  = 1 << 2,
+  REF_CHAR_DOT   = 1 << 3,
+};
+
+static guint8 ref_char_classes[256];
+
+static const guint8 *
+get_ref_char_classes (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized))
+    {
+      int c;
+
+      for (c = 'A'; c <= 'Z'; c++)
+        ref_char_classes[c] = REF_CHAR_ALPHA;
+      for (c = 'a'; c <= 'z'; c++)
+        ref_char_classes[c] = REF_CHAR_ALPHA;
+      for (c = '0'; c <= '9'; c++)
+        ref_char_classes[c] = REF_CHAR_DIGIT;
+      ref_char_classes['_'] = REF_CHAR_ALPHA;
+      ref_char_classes['-'] = REF_CHAR_DASH;
+      ref_char_classes['.'] = REF_CHAR_DOT;
+
+      g_once_init_leave (&initialized, 1);
+    }
+
+  return ref_char_classes;
+}
+
+static inline gboolean
+ref_char_has_class (gint c, guint8 classes)
+{
+  return (get_ref_char_classes ()[(guchar) c] & classes) != 0;
+}
+
+/* Returns the first character in [s, end) that isn't in one of @classes */
+static inline const char *
+skip_ref_chars (const char *s,
+                const char *end,
+                guint8      classes)
+{
+  const guint8 *table = get_ref_char_classes ();
+
+  while (s != end && (table[(guchar) *s] & classes) != 0)
+    s++;
+
+  return s;
+}
+
 static gboolean
 is_valid_initial_name_character (gint c, gboolean allow_dash)
 {
-  return
-    (c >= 'A' && c <= 'Z') ||
-    (c >= 'a' && c <= 'z') ||
-    (c == '_') || (allow_dash && c == '-');
+  return ref_char_has_class (c, REF_CHAR_ALPHA | (allow_dash ? REF_CHAR_DASH : 0));
 }
 
 static gboolean
 is_valid_name_character (gint c, gboolean allow_dash)
 {
-  return
-    is_valid_initial_name_character (c, allow_dash) ||
-    (c >= '0' && c <= '9');
+  return ref_char_has_class (c, REF_CHAR_ALPHA | REF_CHAR_DIGIT | (allow_dash ? REF_CHAR_DASH : 0));
 }
 
 static const char *
@@ -153,6 +204,11 @@ flatpak_is_valid_name (const char *string,
   dot_count = 0;
   while (s != end)
     {
+      /* Skip over the common case of valid characters in bulk */
+      s = skip_ref_chars (s, end, REF_CHAR_ALPHA | REF_CHAR_DIGIT | (last_element ? REF_CHAR_DASH : 0));
+      if (s == end)
+        break;
+
       if (*s == '.')
         {
           if (s == last_dot)
@@ -286,16 +342,6 @@ flatpak_name_matches_one_wildcard_prefix (const char         *name,
 }
 
 
-static gboolean
-is_valid_arch_character (char c)
-{
-  return
-    (c >= 'A' && c <= 'Z') ||
-    (c >= 'a' && c <= 'z') ||
-    (c >= '0' && c <= '9') ||
-    (c == '_');
-}
-
 gboolean
 flatpak_is_valid_arch (const char *string,
                        gssize      len,
@@ -315,15 +361,12 @@ flatpak_is_valid_arch (const char *string,
 
   end = string + len;
 
-  while (string != end)
+  string = skip_ref_chars (string, end, REF_CHAR_ALPHA | REF_CHAR_DIGIT);
+  if (G_UNLIKELY (string != end))
     {
-      if (G_UNLIKELY (!is_valid_arch_character (*string)))
-        {
-          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_NAME,
-                              _("Arch can't contain %c"), *string);
-          return FALSE;
-        }
-      string += 1;
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_NAME,
+                          _("Arch can't contain %c"), *string);
+      return FALSE;
     }
 
   return TRUE;
@@ -333,20 +376,7 @@ flatpak_is_valid_arch (const char *string,
 static gboolean
 is_valid_initial_branch_character (gint c)
 {
-  return
-    (c >= '0' && c <= '9') ||
-    (c >= 'A' && c <= 'Z') ||
-    (c >= 'a' && c <= 'z') ||
-    (c == '_') ||
-    (c == '-');
-}
-
-static gboolean
-is_valid_branch_character (gint c)
-{
-  return
-    is_valid_initial_branch_character (c) ||
-    (c == '.');
+  return ref_char_has_class (c, REF_CHAR_ALPHA | REF_CHAR_DIGIT | REF_CHAR_DASH);
 }
 
 /**
@@ -396,16 +426,12 @@ flatpak_is_valid_branch (const char *string,
       goto out;
     }
 
-  s += 1;
-  while (s != end)
+  s = skip_ref_chars (s + 1, end, REF_CHAR_ALPHA | REF_CHAR_DIGIT | REF_CHAR_DASH | REF_CHAR_DOT);
+  if (G_UNLIKELY (s != end))
     {
-      if (G_UNLIKELY (!is_valid_branch_character (*s)))
-        {
-          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_NAME,
-                              _("Branch can't contain %c"), *s);
-          goto out;
-        }
-      s += 1;
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_NAME,
+                          _("Branch can't contain %c"), *s);
+      goto out;
     }
 
   ret = TRUE;
@@ -540,6 +566,8 @@ struct _FlatpakDecomposed {
   guint16 id_offset;
   guint16 arch_offset;
   guint16 branch_offset;
+  guint hash;
+  gboolean interned;
   char *data;
 
   /* This is only used when we're directly manipulating sideload repos, by giving
@@ -592,10 +620,64 @@ is_valid_remote_name (const char *remote,
 }
 
 
+/* Refs parsed from strings are interned, so that the same ref seen over
+ * and over (like when listing remotes or resolving large transactions)
+ * is only validated once, and shares a single immutable instance. The
+ * table doesn't own a reference, instances remove themselves when the
+ * last reference is dropped. Protected by the interned_refs lock. */
+static GHashTable *interned_refs = NULL;
+G_LOCK_DEFINE_STATIC (interned_refs);
+
+static FlatpakDecomposed *
+lookup_interned_ref (const char *ref)
+{
+  FlatpakDecomposed *decomposed = NULL;
+
+  G_LOCK (interned_refs);
+  if (interned_refs != NULL)
+    decomposed = g_hash_table_lookup (interned_refs, ref);
+  if (decomposed != NULL)
+    g_atomic_int_inc (&decomposed->ref_count);
+  G_UNLOCK (interned_refs);
+
+  return decomposed;
+}
+
+/* Returns the already interned instance instead of @decomposed, if some
+ * other thread interned the same ref in the meantime */
+static FlatpakDecomposed *
+intern_ref (FlatpakDecomposed *decomposed)
+{
+  FlatpakDecomposed *existing;
+
+  G_LOCK (interned_refs);
+  if (interned_refs == NULL)
+    interned_refs = g_hash_table_new (g_str_hash, g_str_equal);
+
+  existing = g_hash_table_lookup (interned_refs, decomposed->data);
+  if (existing != NULL)
+    g_atomic_int_inc (&existing->ref_count);
+  else
+    {
+      decomposed->interned = TRUE;
+      g_hash_table_insert (interned_refs, decomposed->data, decomposed);
+    }
+  G_UNLOCK (interned_refs);
+
+  if (existing != NULL)
+    {
+      flatpak_decomposed_unref (decomposed);
+      return existing;
+    }
+
+  return decomposed;
+}
+
 static FlatpakDecomposed *
 _flatpak_decomposed_new (char            *ref,
                          gboolean         allow_refspec,
                          gboolean         take,
+                         gboolean         intern,
                          GError         **error)
 {
   g_autoptr(GError) local_error = NULL;
@@ -608,6 +690,17 @@ _flatpak_decomposed_new (char            *ref,
   gsize len;
   FlatpakDecomposed *decomposed;
 
+  if (intern)
+    {
+      decomposed = lookup_interned_ref (ref);
+      if (decomposed != NULL)
+        {
+          if (take)
+            g_free (ref);
+          return decomposed;
+        }
+    }
+
   /* We want to use uint16 to store offset, so fail on uselessly large refs */
   len = strlen (ref);
   if (len > 0xffff)
@@ -712,6 +805,11 @@ _flatpak_decomposed_new (char            *ref,
   decomposed->id_offset = (guint16)id_offset;
   decomposed->arch_offset = (guint16)arch_offset;
   decomposed->branch_offset = (guint16)branch_offset;
+  decomposed->hash = g_str_hash (decomposed->data);
+  decomposed->interned = FALSE;
+
+  if (intern)
+    return intern_ref (decomposed);
 
   return decomposed;
 }
@@ -720,28 +818,28 @@ FlatpakDecomposed *
 flatpak_decomposed_new_from_ref (const char         *ref,
                                  GError            **error)
 {
-  return _flatpak_decomposed_new ((char *)ref, FALSE, FALSE, error);
+  return _flatpak_decomposed_new ((char *)ref, FALSE, FALSE, TRUE, error);
 }
 
 FlatpakDecomposed *
 flatpak_decomposed_new_from_refspec (const char         *refspec,
                                      GError            **error)
 {
-  return _flatpak_decomposed_new ((char *)refspec, TRUE, FALSE, error);
+  return _flatpak_decomposed_new ((char *)refspec, TRUE, FALSE, TRUE, error);
 }
 
 FlatpakDecomposed *
 flatpak_decomposed_new_from_ref_take (char         *ref,
                                       GError      **error)
 {
-  return _flatpak_decomposed_new (ref, FALSE, TRUE, error);
+  return _flatpak_decomposed_new (ref, FALSE, TRUE, TRUE, error);
 }
 
 FlatpakDecomposed *
 flatpak_decomposed_new_from_refspec_take (char         *refspec,
                                           GError       **error)
 {
-  return _flatpak_decomposed_new (refspec, TRUE, TRUE, error);
+  return _flatpak_decomposed_new (refspec, TRUE, TRUE, TRUE, error);
 }
 
 FlatpakDecomposed *
@@ -755,11 +853,16 @@ flatpak_decomposed_new_from_col_ref      (const char         *ref,
       !ostree_validate_collection_id (collection_id, error))
     return FALSE;
 
-  decomposed = flatpak_decomposed_new_from_ref (ref, error);
+  if (collection_id == NULL)
+    return flatpak_decomposed_new_from_ref (ref, error);
+
+  /* We modify this one, so it can't be shared */
+  decomposed = _flatpak_decomposed_new ((char *)ref, FALSE, FALSE, FALSE, error);
   if (decomposed == NULL)
     return FALSE;
 
   decomposed->collection_id = g_strdup (collection_id);
+  decomposed->hash |= g_str_hash (collection_id);
 
   return g_steal_pointer (&decomposed);
 }
@@ -873,6 +976,7 @@ _flatpak_decomposed_new_from_decomposed (FlatpakDecomposed  *old,
   decomposed->ref_count = 1;
   decomposed->data = inline_data;
   decomposed->collection_id = NULL;
+  decomposed->interned = FALSE;
 
   ref = inline_data;
   offset = 0;
@@ -905,7 +1009,9 @@ _flatpak_decomposed_new_from_decomposed (FlatpakDecomposed  *old,
   g_assert (offset == ref_len);
   *(ref + offset) = 0;
 
-  return decomposed;
+  decomposed->hash = g_str_hash (decomposed->data);
+
+  return intern_ref (decomposed);
 }
 
 FlatpakDecomposed *
@@ -993,17 +1099,50 @@ flatpak_decomposed_ref (FlatpakDecomposed  *ref)
   return ref;
 }
 
+static void
+flatpak_decomposed_free (FlatpakDecomposed  *ref)
+{
+  char *inline_data = (char *)ref + sizeof (FlatpakDecomposed);
+
+  if (ref->data != inline_data)
+    g_free (ref->data);
+  g_free (ref->collection_id);
+  g_free (ref);
+}
+
 void
 flatpak_decomposed_unref (FlatpakDecomposed  *ref)
 {
-  if (g_atomic_int_dec_and_test (&ref->ref_count))
+  if (ref->interned)
     {
-      char *inline_data = (char *)ref + sizeof (FlatpakDecomposed);
-      if (ref->data != inline_data)
-        g_free (ref->data);
-      g_free (ref->collection_id);
-      g_free (ref);
+      int old_count;
+
+      /* Only take the lock for the last reference, as a lookup may be
+       * reviving the instance concurrently */
+      do
+        {
+          old_count = g_atomic_int_get (&ref->ref_count);
+          if (old_count == 1)
+            break;
+        }
+      while (!g_atomic_int_compare_and_exchange (&ref->ref_count, old_count, old_count - 1));
+
+      if (old_count > 1)
+        return;
+
+      G_LOCK (interned_refs);
+      if (!g_atomic_int_dec_and_test (&ref->ref_count))
+        {
+          G_UNLOCK (interned_refs);
+          return;
+        }
+      g_hash_table_remove (interned_refs, ref->data);
+      G_UNLOCK (interned_refs);
+
+      flatpak_decomposed_free (ref);
     }
+  else if (g_atomic_int_dec_and_test (&ref->ref_count))
+    flatpak_decomposed_free (ref);
 }
 
 const char *
@@ -1067,7 +1206,15 @@ gboolean
 flatpak_decomposed_equal (FlatpakDecomposed  *ref_a,
                           FlatpakDecomposed  *ref_b)
 {
-  return strcmp (ref_a->data, ref_b->data) == 0 &&
+  if (ref_a == ref_b)
+    return TRUE;
+
+  /* Interned refs are unique */
+  if (ref_a->interned && ref_b->interned)
+    return FALSE;
+
+  return ref_a->hash == ref_b->hash &&
+    strcmp (ref_a->data, ref_b->data) == 0 &&
     g_strcmp0 (ref_a->collection_id, ref_b->collection_id) == 0;
 }
 
@@ -1113,12 +1260,7 @@ flatpak_decomposed_equal_except_arch (FlatpakDecomposed  *ref_a,
 guint
 flatpak_decomposed_hash (FlatpakDecomposed  *ref)
 {
-  guint h = g_str_hash (ref->data);
-
-  if (ref->collection_id)
-    h |= g_str_hash (ref->collection_id);
-
-  return h;
+  return ref->hash;
 }
 
 gboolean
@@ -1353,7 +1495,7 @@ flatpak_decomposed_is_id_fuzzy (FlatpakDecomposed  *ref,
   if (slashed_str_strcasestr (ref_id, ref_id_len, id))
     return TRUE;
 
-  return flatpak_levenshtein_distance (id, -1, ref_id, ref_id_len) <= 2;
+  return flatpak_levenshtein_distance_bounded (id, -1, ref_id, ref_id_len, 2) <= 2;
 }
 
 gboolean
@@ -84,6 +84,14 @@
 
 #define FLATPAK_SUMMARY_HISTORY_LENGTH_DEFAULT 16
 
+/* Subsummary metadata in the summary index. The delta chain, of type
+ * a(ayayt), lists (from, to, delta size) for the deltas between successive
+ * versions of the subsummary, newest first, so clients older than the
+ * history can catch up in several steps. */
+#define FLATPAK_SUBSUMMARY_KEY_DELTA_CHAIN "xa.delta-chain"
+#define FLATPAK_SUBSUMMARY_KEY_COMPRESSED_SIZE "xa.compressed-size"
+#define FLATPAK_SUMMARY_DELTA_CHAIN_LENGTH_MAX 64
+
 gboolean flatpak_repo_set_title (OstreeRepo *repo,
                                  const char *title,
                                  GError    **error);
@@ -159,6 +167,13 @@ GVariant *flatpak_repo_load_digested_summary (OstreeRepo *repo,
                                               const char *digest,
                                               GError    **error);
 
+char *flatpak_repo_get_static_delta_superblock_path (const char *from,
+                                                     const char *to);
+char *flatpak_repo_get_static_delta_index_path (const char *to);
+void flatpak_repo_parse_static_delta_name (const char *delta_name,
+                                           char      **out_from,
+                                           char      **out_to);
+
 GBytes *flatpak_summary_apply_diff (GBytes *old,
                                     GBytes *diff,
                                     GError **error);
@@ -175,6 +190,13 @@ gboolean flatpak_repo_update (OstreeRepo            *repo,
                               const char            *gpg_homedir,
                               GCancellable          *cancellable,
                               GError               **error);
+gboolean flatpak_repo_update_full (OstreeRepo            *repo,
+                                   FlatpakRepoUpdateFlags flags,
+                                   int                    n_jobs,
+                                   const char           **gpg_key_ids,
+                                   const char            *gpg_homedir,
+                                   GCancellable          *cancellable,
+                                   GError               **error);
 
 GPtrArray *flatpak_summary_match_subrefs (GVariant   *summary,
                                           const char *collection_id,
@@ -318,7 +318,10 @@ flatpak_repo_get_summary_history_length (OstreeRepo *repo)
   GKeyFile *config = ostree_repo_get_config (repo);
   int length;
 
-  length = g_key_file_get_integer (config, "flatpak", "sumary-history-length", NULL);
+  length = g_key_file_get_integer (config, "flatpak", "summary-history-length", NULL);
+  /* This used to be read with a typo */
+  if (length <= 0)
+    length = g_key_file_get_integer (config, "flatpak", "sumary-history-length", NULL);
 
   if (length <= 0)
     return FLATPAK_SUMMARY_HISTORY_LENGTH_DEFAULT;
@@ -1115,6 +1118,127 @@ read_commit_data (OstreeRepo   *repo,
   return rev_data;
 }
 
+/* The commit data of all the refs is also kept in the repo between runs, so
+ * that a missing or unusable summary index doesn't mean having to read (and
+ * possibly walk, for the sizes) every commit again. Entries are
+ * (installed size, download size, metadata, subsets, sparse data,
+ * commit size, timestamp) keyed by commit. */
+#define COMMIT_DATA_CACHE_FILE "tmp/cache/flatpak-commit-data.gvariant"
+#define COMMIT_DATA_CACHE_FORMAT "(ua{s(ttsasa{sv}tt)})"
+
+static void
+load_commit_data_cache_file (OstreeRepo *repo,
+                             GHashTable *commit_data_cache)
+{
+  glnx_autofd int fd = -1;
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) cache_v = NULL;
+  g_autoptr(GVariantIter) entries = NULL;
+  const char *rev;
+  GVariant *entry;
+  guint32 version;
+  guint n_loaded = 0;
+
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), COMMIT_DATA_CACHE_FILE, TRUE, &fd, NULL))
+    return;
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+  if (mfile == NULL)
+    return;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  cache_v = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (COMMIT_DATA_CACHE_FORMAT), bytes, FALSE));
+
+  g_variant_get (cache_v, "(ua{s@(ttsasa{sv}tt)})", &version, &entries);
+  if (version != FLATPAK_XA_CACHE_VERSION)
+    {
+      g_info ("Old commit data cache version %d, not using it", version);
+      return;
+    }
+
+  while (g_variant_iter_loop (entries, "{&s@(ttsasa{sv}tt)}", &rev, &entry))
+    {
+      g_autoptr(GVariantIter) subsets_iter = NULL;
+      g_autoptr(GVariant) sparse_data = NULL;
+      const char *subset;
+      CommitData *rev_data;
+      guint64 commit_size;
+
+      if (g_hash_table_contains (commit_data_cache, rev))
+        continue;
+
+      rev_data = g_new0 (CommitData, 1);
+      g_variant_get (entry, "(tts@as@a{sv}tt)",
+                     &rev_data->installed_size, &rev_data->download_size,
+                     &rev_data->metadata_contents, NULL, &sparse_data,
+                     &commit_size, &rev_data->commit_timestamp);
+      rev_data->commit_size = commit_size;
+
+      g_variant_get_child (entry, 3, "as", &subsets_iter);
+      while (g_variant_iter_next (subsets_iter, "&s", &subset))
+        {
+          if (rev_data->subsets == NULL)
+            rev_data->subsets = g_ptr_array_new_with_free_func (g_free);
+          g_ptr_array_add (rev_data->subsets, g_strdup (subset));
+        }
+
+      if (g_variant_n_children (sparse_data) > 0)
+        rev_data->sparse_data = g_steal_pointer (&sparse_data);
+
+      g_hash_table_insert (commit_data_cache, g_strdup (rev), rev_data);
+      n_loaded++;
+    }
+
+  g_info ("Loaded %u entries from the commit data cache", n_loaded);
+}
+
+/* Saves the commit data of the current @refs, dropping everything else */
+static void
+save_commit_data_cache_file (OstreeRepo *repo,
+                             GHashTable *refs,
+                             GHashTable *commit_data_cache)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GHashTable) saved = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GVariant) cache_v = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(ttsasa{sv}tt)}"));
+
+  GLNX_HASH_TABLE_FOREACH_V (refs, const char *, rev)
+    {
+      const CommitData *rev_data = g_hash_table_lookup (commit_data_cache, rev);
+      g_auto(GVariantBuilder) subsets_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+
+      if (rev_data == NULL || g_hash_table_contains (saved, rev))
+        continue;
+
+      g_hash_table_add (saved, (char *) rev);
+
+      g_variant_builder_init (&subsets_builder, G_VARIANT_TYPE_STRING_ARRAY);
+      for (guint i = 0; rev_data->subsets != NULL && i < rev_data->subsets->len; i++)
+        g_variant_builder_add (&subsets_builder, "s", (const char *) g_ptr_array_index (rev_data->subsets, i));
+
+      g_variant_builder_add (&builder, "{s(tts@as@a{sv}tt)}", rev,
+                             rev_data->installed_size, rev_data->download_size,
+                             rev_data->metadata_contents,
+                             g_variant_builder_end (&subsets_builder),
+                             rev_data->sparse_data ? rev_data->sparse_data : g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0),
+                             (guint64) rev_data->commit_size, rev_data->commit_timestamp);
+    }
+
+  cache_v = g_variant_ref_sink (g_variant_new ("(u@a{s(ttsasa{sv}tt)})", FLATPAK_XA_CACHE_VERSION,
+                                               g_variant_builder_end (&builder)));
+
+  /* This is just a cache, so no need to sync it */
+  if (!glnx_shutil_mkdir_p_at (ostree_repo_get_dfd (repo), "tmp/cache", 0755, NULL, &local_error) ||
+      !glnx_file_replace_contents_at (ostree_repo_get_dfd (repo), COMMIT_DATA_CACHE_FILE,
+                                      g_variant_get_data (cache_v), g_variant_get_size (cache_v),
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error))
+    g_info ("Failed to save commit data cache: %s", local_error->message);
+}
+
 static void
 _ostree_parse_delta_name (const char *delta_name,
                           char      **out_from,
@@ -1197,6 +1321,33 @@ _ostree_get_relative_static_delta_superblock_path (const char        *from,
   return _ostree_get_relative_static_delta_path (from, to, "superblock");
 }
 
+/* Relative paths of static delta files in a repo, for fetching them from a
+ * remote; @from may be %NULL for a from-scratch delta */
+char *
+flatpak_repo_get_static_delta_superblock_path (const char *from,
+                                               const char *to)
+{
+  return _ostree_get_relative_static_delta_superblock_path (from, to);
+}
+
+char *
+flatpak_repo_get_static_delta_index_path (const char *to)
+{
+  GString *ret = static_delta_path_base ("delta-indexes/", NULL, to);
+
+  g_string_append (ret, ".index");
+
+  return g_string_free (ret, FALSE);
+}
+
+void
+flatpak_repo_parse_static_delta_name (const char *delta_name,
+                                      char      **out_from,
+                                      char      **out_to)
+{
+  _ostree_parse_delta_name (delta_name, out_from, out_to);
+}
+
 static GVariant *
 _ostree_repo_static_delta_superblock_digest (OstreeRepo    *repo,
                                              const char    *from,
@@ -2126,12 +2277,106 @@ add_to_history (OstreeRepo      *repo,
   return TRUE;
 }
 
+static guint64
+get_summaries_file_size (OstreeRepo *repo,
+                         const char *filename)
+{
+  g_autofree char *path = g_build_filename ("summaries", filename, NULL);
+  struct stat stbuf;
+
+  if (fstatat (ostree_repo_get_dfd (repo), path, &stbuf, 0) != 0)
+    return 0;
+
+  return stbuf.st_size;
+}
+
+static gboolean
+add_to_delta_chain (OstreeRepo      *repo,
+                    GVariantBuilder *chain_builder,
+                    GVariant        *from_v,
+                    GVariant        *to_v,
+                    guint64          recorded_size, /* 0 if new */
+                    GHashTable      *chain_deltas)
+{
+  g_autofree char *from = ostree_checksum_from_bytes_v (from_v);
+  g_autofree char *to = ostree_checksum_from_bytes_v (to_v);
+  g_autofree char *filename = g_strconcat (from, "-", to, ".delta", NULL);
+  guint64 size = get_summaries_file_size (repo, filename);
+
+  if (size == 0 || (recorded_size != 0 && size != recorded_size))
+    return FALSE;
+
+  g_variant_builder_add (chain_builder, "(@ay@ayt)", from_v, to_v, size);
+  g_hash_table_add (chain_deltas, g_steal_pointer (&filename));
+
+  return TRUE;
+}
+
+/* Extends the delta chain of the previous version of a subsummary with the
+ * delta from it to the current one. Links are only kept as long as taking
+ * all of them is cheaper than downloading the subsummary in full. */
+static GVariant *
+generate_delta_chain (OstreeRepo     *repo,
+                      VarSubsummaryRef old_subsummary,
+                      GVariant        *digest_v,
+                      guint64          full_size,
+                      GHashTable      *chain_deltas)
+{
+  g_autoptr(GVariantBuilder) chain_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayayt)"));
+  g_autoptr(GVariant) parent_v = g_variant_ref_sink (var_checksum_dup_to_gvariant (var_subsummary_get_checksum (old_subsummary)));
+  g_autoptr(GVariant) old_chain = NULL;
+  VarMetadataRef old_metadata = var_subsummary_get_metadata (old_subsummary);
+  VarVariantRef v;
+  guint64 total_size = 0;
+  guint n_links = 0;
+
+  if (var_metadata_lookup (old_metadata, FLATPAK_SUBSUMMARY_KEY_DELTA_CHAIN, NULL, &v))
+    {
+      g_autoptr(GVariant) vv = g_variant_ref_sink (var_variant_dup_to_gvariant (v));
+      g_autoptr(GVariant) child = g_variant_get_child_value (vv, 0);
+
+      if (g_variant_is_of_type (child, G_VARIANT_TYPE ("a(ayayt)")))
+        old_chain = g_steal_pointer (&child);
+    }
+
+  if (!g_variant_equal (parent_v, digest_v))
+    {
+      /* Without a delta from the previous version the old links lead nowhere */
+      if (!add_to_delta_chain (repo, chain_builder, parent_v, digest_v, 0, chain_deltas))
+        return g_variant_ref_sink (g_variant_builder_end (chain_builder));
+
+      n_links++;
+    }
+
+  for (gsize i = 0; old_chain != NULL && i < g_variant_n_children (old_chain); i++)
+    {
+      g_autoptr(GVariant) from_v = NULL;
+      g_autoptr(GVariant) to_v = NULL;
+      guint64 size;
+
+      g_variant_get_child (old_chain, i, "(@ay@ayt)", &from_v, &to_v, &size);
+
+      total_size += size;
+      if (n_links >= FLATPAK_SUMMARY_DELTA_CHAIN_LENGTH_MAX ||
+          (full_size != 0 && total_size >= full_size))
+        break;
+
+      if (!add_to_delta_chain (repo, chain_builder, from_v, to_v, size, chain_deltas))
+        break;
+
+      n_links++;
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (chain_builder));
+}
+
 static GVariant *
 generate_summary_index (OstreeRepo   *repo,
                         GVariant     *old_index_v,
                         GHashTable   *summaries,
                         GHashTable   *digested_summaries,
                         GHashTable   *digested_summary_cache,
+                        GHashTable   *chain_deltas,
                         const char  **gpg_key_ids,
                         const char   *gpg_homedir,
                         GCancellable *cancellable,
@@ -2157,6 +2402,9 @@ generate_summary_index (OstreeRepo   *repo,
       g_autoptr(GVariant) digest_v = g_variant_ref_sink (ostree_checksum_to_bytes_v (digest));
       g_autoptr(GVariantBuilder) history_builder = g_variant_builder_new (G_VARIANT_TYPE ("aay"));
       g_autoptr(GVariant) subsummary_content = NULL;
+      g_autoptr(GVariant) delta_chain = NULL;
+      g_autofree char *gz_filename = g_strconcat (digest, ".gz", NULL);
+      guint64 full_size = get_summaries_file_size (repo, gz_filename);
 
       subsummary_content = read_digested_summary (repo, digest, digested_summary_cache, cancellable, error);
       if  (subsummary_content == NULL)
@@ -2188,10 +2436,18 @@ generate_summary_index (OstreeRepo   *repo,
                                        &history_len, max_history_length, cancellable, error))
                     return FALSE;
                 }
+
+              delta_chain = generate_delta_chain (repo, old_subsummary, digest_v, full_size, chain_deltas);
             }
         }
 
       g_variant_dict_init (&subsummary_metadata_builder, NULL);
+      if (full_size != 0)
+        g_variant_dict_insert (&subsummary_metadata_builder, FLATPAK_SUBSUMMARY_KEY_COMPRESSED_SIZE,
+                               "t", full_size);
+      if (delta_chain != NULL && g_variant_n_children (delta_chain) > 0)
+        g_variant_dict_insert_value (&subsummary_metadata_builder, FLATPAK_SUBSUMMARY_KEY_DELTA_CHAIN,
+                                     delta_chain);
       g_variant_builder_add (subsummary_builder, "{s(@ay@aay@a{sv})}",
                              subsummary,
                              digest_v,
@@ -2213,6 +2469,7 @@ flatpak_repo_gc_digested_summaries (OstreeRepo *repo,
                                     const char *old_index_digest,       /* The digest of the previous index (if any) */
                                     GHashTable *digested_summaries,     /* generated */
                                     GHashTable *digested_summary_cache, /* generated + referenced */
+                                    GHashTable *chain_deltas,           /* referenced by delta chains */
                                     GCancellable *cancellable,
                                     GError **error)
 {
@@ -2274,6 +2531,11 @@ flatpak_repo_gc_digested_summaries (OstreeRepo *repo,
                       g_info ("Keeping delta to generated summary %s", dent->d_name);
                       continue;
                     }
+                  if (g_hash_table_contains (chain_deltas, dent->d_name))
+                    {
+                      g_info ("Keeping delta in delta chain %s", dent->d_name);
+                      continue;
+                    }
                   /* Remove rest */
                   remove = TRUE;
                 }
@@ -2322,6 +2584,53 @@ flatpak_repo_gc_digested_summaries (OstreeRepo *repo,
  * deployment of collection-based repositories. Clients will only update their
  * configuration from an unset to a set collection ID once (otherwise the
  * security properties of collection IDs are broken). */
+typedef struct
+{
+  OstreeRepo   *repo;
+  GHashTable   *refs;
+  GHashTable   *commit_data_cache;
+  const char   *subset;
+  const char   *arch;
+  char         *name;
+  GCancellable *cancellable;
+  GVariant     *summary;
+  char         *digest;
+  GError       *error;
+} SubsummaryGeneration;
+
+static void
+subsummary_generation_free (SubsummaryGeneration *generation)
+{
+  g_free (generation->name);
+  g_clear_pointer (&generation->summary, g_variant_unref);
+  g_free (generation->digest);
+  g_clear_error (&generation->error);
+  g_free (generation);
+}
+
+static void
+subsummary_generation_thread_func (gpointer data,
+                                   gpointer user_data)
+{
+  SubsummaryGeneration *generation = data;
+  const char *arch_v[] = { generation->arch, NULL };
+
+  if (g_cancellable_set_error_if_cancelled (generation->cancellable, &generation->error))
+    return;
+
+  generation->summary = generate_summary (generation->repo, FALSE, generation->refs,
+                                          generation->commit_data_cache, NULL,
+                                          generation->subset, arch_v,
+                                          generation->cancellable, &generation->error);
+  if (generation->summary == NULL)
+    return;
+
+  generation->digest = flatpak_repo_save_digested_summary (generation->repo, generation->name,
+                                                           generation->summary,
+                                                           generation->cancellable,
+                                                           &generation->error);
+}
+
 gboolean
 flatpak_repo_update (OstreeRepo   *repo,
                      FlatpakRepoUpdateFlags flags,
@@ -2329,6 +2638,20 @@ flatpak_repo_update (OstreeRepo   *repo,
                      const char   *gpg_homedir,
                      GCancellable *cancellable,
                      GError      **error)
+{
+  return flatpak_repo_update_full (repo, flags, 0, gpg_key_ids, gpg_homedir, cancellable, error);
+}
+
+/* Like flatpak_repo_update(), but generates up to @n_jobs subsummaries in
+ * parallel, or one per CPU if @n_jobs is 0. */
+gboolean
+flatpak_repo_update_full (OstreeRepo   *repo,
+                          FlatpakRepoUpdateFlags flags,
+                          int           n_jobs,
+                          const char  **gpg_key_ids,
+                          const char   *gpg_homedir,
+                          GCancellable *cancellable,
+                          GError      **error)
 {
   g_autoptr(GHashTable) commit_data_cache = NULL;
   g_autoptr(GVariant) compat_summary = NULL;
@@ -2342,6 +2665,7 @@ flatpak_repo_update (OstreeRepo   *repo,
   g_autoptr(GHashTable) summaries = NULL;
   g_autoptr(GHashTable) digested_summaries = NULL;
   g_autoptr(GHashTable) digested_summary_cache = NULL;
+  g_autoptr(GHashTable) chain_deltas = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   g_autoptr(GBytes) index_sig = NULL;
   time_t old_compat_sig_mtime;
   GKeyFile *config;
@@ -2363,6 +2687,9 @@ flatpak_repo_update (OstreeRepo   *repo,
   if (commit_data_cache == NULL) /* No index or failed to load it */
     commit_data_cache = commit_data_cache_new ();
 
+  /* Fill in whatever the index didn't have from the last run */
+  load_commit_data_cache_file (repo, commit_data_cache);
+
   if (!ostree_repo_list_static_delta_names (repo, &delta_names, cancellable, error))
     return FALSE;
 
@@ -2410,6 +2737,8 @@ flatpak_repo_update (OstreeRepo   *repo,
         }
     }
 
+  save_commit_data_cache_file (repo, refs, commit_data_cache);
+
   compat_summary = generate_summary (repo, TRUE, refs, commit_data_cache, delta_names,
                                      "", (const char **)summary_arches,
                                      cancellable, error);
@@ -2418,37 +2747,61 @@ flatpak_repo_update (OstreeRepo   *repo,
 
   if (!disable_index)
     {
+      g_autoptr(GPtrArray) generations = g_ptr_array_new_with_free_func ((GDestroyNotify) subsummary_generation_free);
+      GThreadPool *pool;
+
+      if (n_jobs <= 0)
+        n_jobs = g_get_num_processors ();
+
+      /* The subsummaries are independent of each other, and only read the
+       * commit data cache, so generate them in parallel */
+      pool = g_thread_pool_new (subsummary_generation_thread_func, NULL,
+                                MAX (1, MIN (n_jobs, g_hash_table_size (subsets) * g_hash_table_size (arches))),
+                                FALSE, NULL);
+
       GLNX_HASH_TABLE_FOREACH (subsets, const char *, subset)
         {
           GLNX_HASH_TABLE_FOREACH (arches, const char *, arch)
             {
-              const char *arch_v[] = { arch, NULL };
-              g_autofree char *name = NULL;
-              g_autofree char *digest = NULL;
+              SubsummaryGeneration *generation = g_new0 (SubsummaryGeneration, 1);
+
+              generation->repo = repo;
+              generation->refs = refs;
+              generation->commit_data_cache = commit_data_cache;
+              generation->subset = subset;
+              generation->arch = arch;
+              generation->cancellable = cancellable;
 
               if (*subset == 0)
-                name = g_strdup (arch);
+                generation->name = g_strdup (arch);
               else
-                name = g_strconcat (subset, "-", arch, NULL);
+                generation->name = g_strconcat (subset, "-", arch, NULL);
 
-              g_autoptr(GVariant) arch_summary = generate_summary (repo, FALSE, refs, commit_data_cache, NULL, subset, arch_v,
-                                                                   cancellable, error);
-              if (arch_summary == NULL)
-                return FALSE;
+              g_ptr_array_add (generations, generation);
+              g_thread_pool_push (pool, generation, NULL);
+            }
+        }
 
-              digest = flatpak_repo_save_digested_summary (repo, name, arch_summary, cancellable, error);
-              if (digest == NULL)
-                return FALSE;
+      g_thread_pool_free (pool, FALSE, TRUE);
 
-              g_hash_table_insert (digested_summaries, g_strdup (digest), g_variant_ref (arch_summary));
-              /* Prime summary cache with generated summaries */
-              g_hash_table_insert (digested_summary_cache, g_strdup (digest), g_variant_ref (arch_summary));
-              g_hash_table_insert (summaries, g_steal_pointer (&name), g_steal_pointer (&digest));
+      for (guint i = 0; i < generations->len; i++)
+        {
+          SubsummaryGeneration *generation = g_ptr_array_index (generations, i);
+
+          if (generation->error != NULL)
+            {
+              g_propagate_error (error, g_steal_pointer (&generation->error));
+              return FALSE;
             }
+
+          g_hash_table_insert (digested_summaries, g_strdup (generation->digest), g_variant_ref (generation->summary));
+          /* Prime summary cache with generated summaries */
+          g_hash_table_insert (digested_summary_cache, g_strdup (generation->digest), g_variant_ref (generation->summary));
+          g_hash_table_insert (summaries, g_steal_pointer (&generation->name), g_steal_pointer (&generation->digest));
         }
 
       summary_index = generate_summary_index (repo, old_index, summaries, digested_summaries, digested_summary_cache,
-                                              gpg_key_ids, gpg_homedir,
+                                              chain_deltas, gpg_key_ids, gpg_homedir,
                                               cancellable, error);
       if (summary_index == NULL)
         return FALSE;
@@ -2516,7 +2869,7 @@ flatpak_repo_update (OstreeRepo   *repo,
     }
 
   if (!disable_index &&
-      !flatpak_repo_gc_digested_summaries (repo, index_digest, old_index_digest, digested_summaries, digested_summary_cache, cancellable, error))
+      !flatpak_repo_gc_digested_summaries (repo, index_digest, old_index_digest, digested_summaries, digested_summary_cache, chain_deltas, cancellable, error))
     return FALSE;
 
   return TRUE;
@@ -3095,39 +3448,40 @@ flatpak_mtree_ensure_dir_metadata (OstreeRepo        *repo,
   return TRUE;
 }
 
-static gboolean
-copy_icon (const char        *id,
-           GFile             *icons_dir,
-           OstreeRepo        *repo,
-           OstreeMutableTree *size_mtree,
-           const char        *size,
-           GError           **error)
+/* The appstream extracted from each commit is cached in the repo, keyed by
+ * the commit checksum, so build-update-repo only has to look at new commits.
+ * Entries are (version, ref, error or "", serialized components,
+ * [(icon size, icon name, content checksum)]). */
+#define APPSTREAM_EXTRACT_CACHE_DIR "tmp/cache/flatpak-appstream"
+#define APPSTREAM_EXTRACT_CACHE_VERSION 1
+#define APPSTREAM_EXTRACT_CACHE_FORMAT "(ussa(issa(ss))a(sss))"
+
+static const char *appstream_icon_sizes[] = { "64x64", "128x128" };
+
+static void
+collect_icon (const char      *id,
+              GFile           *icons_dir,
+              const char      *size,
+              GVariantBuilder *icons_builder)
 {
   g_autofree char *icon_name = g_strconcat (id, ".png", NULL);
   g_autoptr(GFile) size_dir = g_file_get_child (icons_dir, size);
   g_autoptr(GFile) icon_file = g_file_get_child (size_dir, icon_name);
-  const char *checksum;
 
   if (!ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE(icon_file), NULL))
     {
       g_info ("No icon at size %s for %s", size, id);
-      return TRUE;
+      return;
     }
 
-  checksum = ostree_repo_file_get_checksum (OSTREE_REPO_FILE(icon_file));
-  if (!ostree_mutable_tree_replace_file (size_mtree, icon_name, checksum, error))
-    return FALSE;
-
-  return TRUE;
+  g_variant_builder_add (icons_builder, "(sss)", size, icon_name,
+                         ostree_repo_file_get_checksum (OSTREE_REPO_FILE(icon_file)));
 }
 
-static gboolean
+static GVariant *
 extract_appstream (OstreeRepo        *repo,
-                   FlatpakXml        *appstream_root,
                    FlatpakDecomposed *ref,
-                   const char        *id,
-                   OstreeMutableTree *size1_mtree,
-                   OstreeMutableTree *size2_mtree,
+                   const char        *checksum,
                    GCancellable       *cancellable,
                    GError            **error)
 {
@@ -3138,12 +3492,15 @@ extract_appstream (OstreeRepo        *repo,
   g_autoptr(GFile) appstream_file = NULL;
   g_autoptr(GFile) metadata = NULL;
   g_autofree char *appstream_basename = NULL;
+  g_autofree char *id = flatpak_decomposed_dup_id (ref);
   g_autoptr(GInputStream) in = NULL;
   g_autoptr(FlatpakXml) xml_root = NULL;
+  g_autoptr(FlatpakXml) appstream_root = NULL;
   g_autoptr(GKeyFile) keyfile = NULL;
+  g_auto(GVariantBuilder) icons_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
 
-  if (!ostree_repo_read_commit (repo, flatpak_decomposed_get_ref (ref), &root, NULL, NULL, error))
-    return FALSE;
+  if (!ostree_repo_read_commit (repo, checksum, &root, NULL, NULL, error))
+    return NULL;
 
   keyfile = g_key_file_new ();
   metadata = g_file_get_child (root, "metadata");
@@ -3153,10 +3510,10 @@ extract_appstream (OstreeRepo        *repo,
       gsize len;
 
       if (!g_file_load_contents (metadata, cancellable, &content, &len, NULL, error))
-        return FALSE;
+        return NULL;
 
       if (!g_key_file_load_from_data (keyfile, content, len, G_KEY_FILE_NONE, error))
-        return FALSE;
+        return NULL;
     }
 
   app_info_dir = g_file_resolve_relative_path (root, "files/share/app-info");
@@ -3169,16 +3526,21 @@ extract_appstream (OstreeRepo        *repo,
 
   in = (GInputStream *) g_file_read (appstream_file, cancellable, error);
   if (!in)
-    return FALSE;
+    return NULL;
 
   xml_root = flatpak_xml_parse (in, TRUE, cancellable, error);
   if (xml_root == NULL)
-    return FALSE;
+    return NULL;
+
+  g_variant_builder_init (&icons_builder, G_VARIANT_TYPE ("a(sss)"));
+
+  /* Migrate into a root of our own, so the result only depends on this commit */
+  appstream_root = flatpak_appstream_xml_new ();
+  flatpak_xml_free (flatpak_xml_unlink (appstream_root->first_child->first_child, NULL));
 
   if (flatpak_appstream_xml_migrate (xml_root, appstream_root,
                                      flatpak_decomposed_get_ref (ref), id, keyfile))
     {
-      g_autoptr(GError) my_error = NULL;
       FlatpakXml *components = appstream_root->first_child;
       FlatpakXml *component = components->first_child;
 
@@ -3212,24 +3574,236 @@ extract_appstream (OstreeRepo        *repo,
               continue;
             }
 
-          if (!copy_icon (component_id_text, icons_dir, repo, size1_mtree, "64x64", &my_error))
-            {
-              g_print (_("Error copying 64x64 icon for component %s: %s\n"), component_id_text, my_error->message);
-              g_clear_error (&my_error);
-            }
-
-          if (!copy_icon (component_id_text, icons_dir, repo, size2_mtree, "128x128", &my_error))
-             {
-               g_print (_("Error copying 128x128 icon for component %s: %s\n"), component_id_text, my_error->message);
-               g_clear_error (&my_error);
-             }
-
+          for (gsize i = 0; i < G_N_ELEMENTS (appstream_icon_sizes); i++)
+            collect_icon (component_id_text, icons_dir, appstream_icon_sizes[i], &icons_builder);
 
           /* We might match other prefixes, so keep on going */
           component = component->next_sibling;
         }
     }
 
+  return g_variant_ref_sink (g_variant_new ("(uss@a(issa(ss))a(sss))",
+                                            APPSTREAM_EXTRACT_CACHE_VERSION,
+                                            flatpak_decomposed_get_ref (ref), "",
+                                            flatpak_xml_children_to_variant (appstream_root->first_child),
+                                            &icons_builder));
+}
+
+static GVariant *
+load_cached_appstream (OstreeRepo        *repo,
+                       FlatpakDecomposed *ref,
+                       const char        *checksum)
+{
+  g_autofree char *path = g_strconcat (APPSTREAM_EXTRACT_CACHE_DIR "/", checksum, ".gvariant", NULL);
+  glnx_autofd int fd = -1;
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) cached = NULL;
+  const char *cached_ref;
+  guint32 version;
+
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), path, TRUE, &fd, NULL))
+    return NULL;
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  cached = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (APPSTREAM_EXTRACT_CACHE_FORMAT),
+                                                         bytes, FALSE));
+
+  /* The same commit may be under another ref, which changes the bundle */
+  g_variant_get (cached, "(u&s&s@a(issa(ss))@a(sss))", &version, &cached_ref, NULL, NULL, NULL);
+  if (version != APPSTREAM_EXTRACT_CACHE_VERSION ||
+      strcmp (cached_ref, flatpak_decomposed_get_ref (ref)) != 0)
+    return NULL;
+
+  return g_steal_pointer (&cached);
+}
+
+static void
+save_cached_appstream (OstreeRepo *repo,
+                       const char *checksum,
+                       GVariant   *extracted)
+{
+  g_autofree char *path = g_strconcat (APPSTREAM_EXTRACT_CACHE_DIR "/", checksum, ".gvariant", NULL);
+  g_autoptr(GError) local_error = NULL;
+
+  /* This is just a cache, so no need to sync it */
+  if (!glnx_shutil_mkdir_p_at (ostree_repo_get_dfd (repo), APPSTREAM_EXTRACT_CACHE_DIR, 0755, NULL, &local_error) ||
+      !glnx_file_replace_contents_at (ostree_repo_get_dfd (repo), path,
+                                      g_variant_get_data (extracted),
+                                      g_variant_get_size (extracted),
+                                      GLNX_FILE_REPLACE_NODATASYNC,
+                                      NULL, &local_error))
+    g_info ("Failed to cache appstream for %s: %s", checksum, local_error->message);
+}
+
+typedef struct
+{
+  OstreeRepo        *repo;
+  FlatpakDecomposed *ref;
+  const char        *checksum;
+  GCancellable      *cancellable;
+  GVariant          *result;
+} AppstreamExtraction;
+
+static void
+appstream_extraction_thread_func (gpointer data,
+                                  gpointer user_data)
+{
+  AppstreamExtraction *extraction = data;
+  g_autoptr(GError) local_error = NULL;
+
+  if (g_cancellable_is_cancelled (extraction->cancellable))
+    return;
+
+  extraction->result = load_cached_appstream (extraction->repo, extraction->ref, extraction->checksum);
+  if (extraction->result != NULL)
+    return;
+
+  extraction->result = extract_appstream (extraction->repo, extraction->ref, extraction->checksum,
+                                          extraction->cancellable, &local_error);
+  if (extraction->result == NULL)
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      /* Missing appstream data is a property of the commit too, so cache that */
+      extraction->result = g_variant_ref_sink (g_variant_new (APPSTREAM_EXTRACT_CACHE_FORMAT,
+                                                              APPSTREAM_EXTRACT_CACHE_VERSION,
+                                                              flatpak_decomposed_get_ref (extraction->ref),
+                                                              local_error->message,
+                                                              NULL, NULL));
+    }
+
+  save_cached_appstream (extraction->repo, extraction->checksum, extraction->result);
+}
+
+/* Removes cache entries for commits that are not referenced anymore */
+static void
+prune_cached_appstream (OstreeRepo *repo,
+                        GHashTable *all_refs)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  g_autoptr(GHashTable) checksums = g_hash_table_new (g_str_hash, g_str_equal);
+
+  GLNX_HASH_TABLE_FOREACH_V (all_refs, const char *, checksum)
+    g_hash_table_add (checksums, (char *) checksum);
+
+  if (!glnx_dirfd_iterator_init_at (ostree_repo_get_dfd (repo), APPSTREAM_EXTRACT_CACHE_DIR,
+                                    FALSE, &iter, NULL))
+    return;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      g_autofree char *checksum = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, NULL) || dent == NULL)
+        break;
+
+      if (!g_str_has_suffix (dent->d_name, ".gvariant"))
+        continue;
+
+      checksum = g_strndup (dent->d_name, strlen (dent->d_name) - strlen (".gvariant"));
+      if (!g_hash_table_contains (checksums, checksum))
+        (void) unlinkat (iter.fd, dent->d_name, 0);
+    }
+}
+
+/* Extracts the appstream of all @refs (ref -> commit checksum) in parallel,
+ * returning a hash table from ref to the extracted data. */
+static GHashTable *
+extract_all_appstream (OstreeRepo   *repo,
+                       GHashTable   *refs,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_autoptr(GHashTable) extracted = NULL;
+  g_autofree AppstreamExtraction *extractions = NULL;
+  guint n_extractions = g_hash_table_size (refs);
+  GThreadPool *pool;
+  guint i = 0;
+
+  extractions = g_new0 (AppstreamExtraction, n_extractions);
+  pool = g_thread_pool_new (appstream_extraction_thread_func, NULL,
+                            MAX (1, MIN (n_extractions, g_get_num_processors ())),
+                            FALSE, NULL);
+
+  GLNX_HASH_TABLE_FOREACH_KV (refs, FlatpakDecomposed *, ref, const char *, checksum)
+    {
+      extractions[i].repo = repo;
+      extractions[i].ref = ref;
+      extractions[i].checksum = checksum;
+      extractions[i].cancellable = cancellable;
+      g_thread_pool_push (pool, &extractions[i], NULL);
+      i++;
+    }
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  extracted = g_hash_table_new_full ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal,
+                                     (GDestroyNotify)flatpak_decomposed_unref, (GDestroyNotify)g_variant_unref);
+  for (i = 0; i < n_extractions; i++)
+    {
+      if (extractions[i].result != NULL)
+        g_hash_table_insert (extracted, flatpak_decomposed_ref (extractions[i].ref), extractions[i].result);
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return NULL;
+
+  return g_steal_pointer (&extracted);
+}
+
+static gboolean
+add_extracted_appstream (OstreeRepo         *repo,
+                         FlatpakXml         *appstream_root,
+                         FlatpakDecomposed  *ref,
+                         GVariant           *extracted,
+                         OstreeMutableTree **size_mtrees,
+                         GError            **error)
+{
+  g_autoptr(GVariant) components = NULL;
+  g_autoptr(GVariant) icons = NULL;
+  const char *extract_error;
+  gsize n_icons;
+
+  g_variant_get (extracted, "(u&s&s@a(issa(ss))@a(sss))", NULL, NULL, &extract_error, &components, &icons);
+
+  if (*extract_error != 0)
+    {
+      if (flatpak_decomposed_is_app (ref))
+        g_print (_("No appstream data for %s: %s\n"), flatpak_decomposed_get_ref (ref), extract_error);
+      return TRUE;
+    }
+
+  if (!flatpak_xml_add_children_from_variant (appstream_root->first_child, components, error))
+    return FALSE;
+
+  n_icons = g_variant_n_children (icons);
+  for (gsize i = 0; i < n_icons; i++)
+    {
+      g_autoptr(GError) my_error = NULL;
+      const char *size, *icon_name, *checksum;
+
+      g_variant_get_child (icons, i, "(&s&s&s)", &size, &icon_name, &checksum);
+
+      for (gsize j = 0; j < G_N_ELEMENTS (appstream_icon_sizes); j++)
+        {
+          if (strcmp (size, appstream_icon_sizes[j]) != 0)
+            continue;
+
+          if (!ostree_mutable_tree_replace_file (size_mtrees[j], icon_name, checksum, &my_error))
+            {
+              g_print (_("Error copying %s icon for component %s: %s\n"), size, icon_name, my_error->message);
+              g_clear_error (&my_error);
+            }
+        }
+    }
+
   return TRUE;
 }
 
@@ -3277,6 +3851,7 @@ _flatpak_repo_generate_appstream (OstreeRepo   *repo,
                                   FlatpakDecomposed **all_refs_keys,
                                   guint         n_keys,
                                   GHashTable   *all_commits,
+                                  GHashTable   *extracted_appstream,
                                   const char   *arch,
                                   const char   *subset,
                                   guint64       timestamp,
@@ -3291,6 +3866,7 @@ _flatpak_repo_generate_appstream (OstreeRepo   *repo,
   g_autoptr(OstreeMutableTree) icons_flatpak_mtree = NULL;
   g_autoptr(OstreeMutableTree) size1_mtree = NULL;
   g_autoptr(OstreeMutableTree) size2_mtree = NULL;
+  OstreeMutableTree *size_mtrees[G_N_ELEMENTS (appstream_icon_sizes)];
   const char *compat_arch;
   compat_arch = flatpak_get_compat_arch (arch);
   const char *branch_names[] = { "appstream", "appstream2" };
@@ -3315,6 +3891,9 @@ _flatpak_repo_generate_appstream (OstreeRepo   *repo,
   if (!flatpak_mtree_create_dir (repo, icons_mtree, "128x128", &size2_mtree, error))
     return FALSE;
 
+  size_mtrees[0] = size1_mtree;
+  size_mtrees[1] = size2_mtree;
+
   /* For compatibility with libappstream we create a $origin ("flatpak") subdirectory with symlinks
    * to the size directories thus matching the standard merged appstream layout if we assume the
    * appstream has origin=flatpak, which flatpak-builder creates.
@@ -3335,8 +3914,7 @@ _flatpak_repo_generate_appstream (OstreeRepo   *repo,
       FlatpakDecomposed *ref = all_refs_keys[i];
       GVariant *commit_v = NULL;
       VarMetadataRef commit_metadata;
-      g_autoptr(GError) my_error = NULL;
-      g_autofree char *id = NULL;
+      GVariant *extracted = NULL;
 
       if (!flatpak_decomposed_is_arch (ref, arch))
         {
@@ -3388,15 +3966,11 @@ _flatpak_repo_generate_appstream (OstreeRepo   *repo,
             continue;
         }
 
-      id = flatpak_decomposed_dup_id (ref);
-      if (!extract_appstream (repo, appstream_root,
-                              ref, id, size1_mtree, size2_mtree,
-                              cancellable, &my_error))
-        {
-          if (flatpak_decomposed_is_app (ref))
-            g_print (_("No appstream data for %s: %s\n"), flatpak_decomposed_get_ref (ref), my_error->message);
-          continue;
-        }
+      extracted = g_hash_table_lookup (extracted_appstream, ref);
+      g_assert (extracted != NULL);
+
+      if (!add_extracted_appstream (repo, appstream_root, ref, extracted, size_mtrees, error))
+        return FALSE;
     }
 
   if (!flatpak_appstream_xml_root_to_data (appstream_root, &xml_data, &xml_gz_data, error))
@@ -3528,6 +4102,8 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
 {
   g_autoptr(GHashTable) all_refs = NULL;
   g_autoptr(GHashTable) all_commits = NULL;
+  g_autoptr(GHashTable) live_refs = NULL;
+  g_autoptr(GHashTable) extracted_appstream = NULL;
   g_autofree FlatpakDecomposed **all_refs_keys = NULL;
   guint n_keys;
   g_autoptr(GPtrArray) arches = NULL;  /* (element-type utf8 utf8) */
@@ -3545,6 +4121,7 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
     return FALSE;
 
   all_commits = g_hash_table_new_full ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal, (GDestroyNotify)flatpak_decomposed_unref, (GDestroyNotify)g_variant_unref);
+  live_refs = g_hash_table_new ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal);
 
   GLNX_HASH_TABLE_FOREACH_KV (all_refs, FlatpakDecomposed *, ref, const char *, commit)
     {
@@ -3564,6 +4141,11 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
 
       /* Compute list of subsets */
       commit_metadata = var_commit_get_metadata (var_commit_from_gvariant (commit_v));
+
+      /* End-of-life refs are never included, so don't extract those */
+      if (!var_metadata_lookup (commit_metadata, OSTREE_COMMIT_META_KEY_ENDOFLIFE, NULL, NULL) &&
+          !var_metadata_lookup (commit_metadata, OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE, NULL, NULL))
+        g_hash_table_insert (live_refs, ref, (char *) commit);
       if (var_metadata_lookup (commit_metadata, "xa.subsets", NULL, &xa_subsets_v))
         {
           VarArrayofstringRef xa_subsets = var_arrayofstring_from_variant (xa_subsets_v);
@@ -3600,6 +4182,13 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
   qsort (all_refs_keys, n_keys, sizeof (FlatpakDecomposed *),
          (GCompareFunc) flatpak_decomposed_strcmp_p);
 
+  /* Each ref is extracted once and shared by all the arches and subsets it's in */
+  extracted_appstream = extract_all_appstream (repo, live_refs, cancellable, error);
+  if (extracted_appstream == NULL)
+    return FALSE;
+
+  prune_cached_appstream (repo, all_refs);
+
   transaction = flatpak_repo_transaction_start (repo, cancellable, error);
   if (transaction == NULL)
     return FALSE;
@@ -3618,6 +4207,7 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
                                                  all_refs_keys,
                                                  n_keys,
                                                  all_commits,
+                                                 extracted_appstream,
                                                  arch,
                                                  subset,
                                                  timestamp,
@@ -3829,6 +4419,7 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
   gboolean metadata_valid;
   g_autofree char *remote_collection_id = NULL;
   g_autofree char *collection_id = NULL;
+  g_autoptr(FlatpakRepoTransaction) transaction = NULL;
 
   metadata = flatpak_bundle_load (file, &to_checksum, NULL, NULL, NULL, &metadata_contents, NULL, NULL, &collection_id, error);
   if (metadata == NULL)
@@ -3846,7 +4437,10 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
     return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Collection ‘%s’ of bundle doesn’t match collection ‘%s’ of remote"),
                                collection_id, remote_collection_id);
 
-  if (!ostree_repo_prepare_transaction (repo, NULL, cancellable, error))
+  /* The static delta is applied straight into the staging directory of the
+   * transaction, and nothing is committed unless the commit checks out. */
+  transaction = flatpak_repo_transaction_start (repo, cancellable, error);
+  if (transaction == NULL)
     return FALSE;
 
   /* Don’t need to set the collection ID here, since the remote binds this ref to the collection. */
@@ -3889,9 +4483,6 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
   if (!ostree_repo_read_commit (repo, to_checksum, &root, NULL, NULL, error))
     return FALSE;
 
-  if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
-    return FALSE;
-
   /* We ensure that the actual installed metadata matches the one in the
      header, because you may have made decisions on whether to install it or not
      based on that data. */
@@ -3916,12 +4507,12 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
       metadata_valid = (metadata_contents == NULL);
     }
 
+  /* Never commit a broken bundle, the transaction is aborted on return */
   if (!metadata_valid)
-    {
-      /* Immediately remove this broken commit */
-      ostree_repo_set_ref_immediate (repo, remote, ref, NULL, cancellable, error);
-      return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Metadata in header and app are inconsistent"));
-    }
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Metadata in header and app are inconsistent"));
+
+  if (!ostree_repo_commit_transaction (repo, NULL, cancellable, error))
+    return FALSE;
 
   return TRUE;
 }
@@ -28,6 +28,8 @@
 
 G_BEGIN_DECLS
 
+gboolean flatpak_run_has_session_bus (void);
+
 gboolean flatpak_run_add_session_dbus_args (FlatpakBwrap          *app_bwrap,
                                             FlatpakBwrap          *proxy_arg_bwrap,
                                             FlatpakContextSockets  sockets,
@@ -51,5 +53,7 @@ gboolean flatpak_run_maybe_start_dbus_proxy (FlatpakBwrap *app_bwrap,
                                              FlatpakBwrap *proxy_arg_bwrap,
                                              const char   *app_info_path,
                                              GError      **error);
+gboolean flatpak_run_wait_dbus_proxy        (FlatpakBwrap *app_bwrap,
+                                             GError      **error);
 
 G_END_DECLS
@@ -116,7 +116,6 @@ flatpak_run_maybe_start_dbus_proxy (FlatpakBwrap *app_bwrap,
                                     const char   *app_info_path,
                                     GError      **error)
 {
-  char x = 'x';
   const char *proxy;
   g_autofree char *commandline = NULL;
   g_autoptr(FlatpakBwrap) proxy_bwrap = NULL;
@@ -174,12 +173,32 @@ flatpak_run_maybe_start_dbus_proxy (FlatpakBwrap *app_bwrap,
                       NULL, error))
     return FALSE;
 
-  /* The write end can be closed now, otherwise the read below will hang of xdg-dbus-proxy
-     fails to start. */
+  /* The write end can be closed now, otherwise the read in
+     flatpak_run_wait_dbus_proxy() will hang if xdg-dbus-proxy fails to start. */
   g_clear_pointer (&proxy_bwrap, flatpak_bwrap_free);
 
-  /* Sync with proxy, i.e. wait until its listening on the sockets */
-  if (read (app_bwrap->sync_fds[0], &x, 1) != 1)
+  /* The rest of the sandbox setup doesn't depend on the proxy, so only
+   * wait for it right before bwrap needs its sockets */
+  app_bwrap->sync_pending = TRUE;
+
+  return TRUE;
+}
+
+/* Sync with the proxy started by flatpak_run_maybe_start_dbus_proxy(),
+ * i.e. wait until it's listening on the sockets that bwrap will bind
+ * into the sandbox. Does nothing if no proxy was started. */
+gboolean
+flatpak_run_wait_dbus_proxy (FlatpakBwrap *app_bwrap,
+                             GError      **error)
+{
+  char x = 'x';
+
+  if (!app_bwrap->sync_pending)
+    return TRUE;
+
+  app_bwrap->sync_pending = FALSE;
+
+  if (TEMP_FAILURE_RETRY (read (app_bwrap->sync_fds[0], &x, 1)) != 1)
     {
       g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errno),
                            _("Failed to sync with dbus proxy"));
@@ -231,6 +250,38 @@ create_proxy_socket (const char *template)
   return g_steal_pointer (&proxy_socket);
 }
 
+/* The socket that a session bus without an explicit address listens on */
+static char *
+get_default_session_bus_socket (void)
+{
+  g_autofree char *user_runtime_dir = flatpak_get_real_xdg_runtime_dir ();
+  g_autofree char *dbus_session_socket = NULL;
+  struct stat statbuf;
+
+  dbus_session_socket = g_build_filename (user_runtime_dir, "bus", NULL);
+
+  if (stat (dbus_session_socket, &statbuf) < 0
+      || (statbuf.st_mode & S_IFMT) != S_IFSOCK
+      || statbuf.st_uid != getuid ())
+    return NULL;
+
+  return g_steal_pointer (&dbus_session_socket);
+}
+
+/* Whether there is a session bus to talk to at all. Without one, GDBus
+ * would still try to autolaunch one before giving up, which is slow. */
+gboolean
+flatpak_run_has_session_bus (void)
+{
+  g_autofree char *dbus_session_socket = NULL;
+
+  if (g_getenv ("DBUS_SESSION_BUS_ADDRESS") != NULL)
+    return TRUE;
+
+  dbus_session_socket = get_default_session_bus_socket ();
+  return dbus_session_socket != NULL;
+}
+
 gboolean
 flatpak_run_add_session_dbus_args (FlatpakBwrap          *app_bwrap,
                                    FlatpakBwrap          *proxy_arg_bwrap,
@@ -253,14 +304,8 @@ flatpak_run_add_session_dbus_args (FlatpakBwrap          *app_bwrap,
     }
   else
     {
-      g_autofree char *user_runtime_dir = flatpak_get_real_xdg_runtime_dir ();
-      struct stat statbuf;
-
-      dbus_session_socket = g_build_filename (user_runtime_dir, "bus", NULL);
-
-      if (stat (dbus_session_socket, &statbuf) < 0
-          || (statbuf.st_mode & S_IFMT) != S_IFSOCK
-          || statbuf.st_uid != getuid ())
+      dbus_session_socket = get_default_session_bus_socket ();
+      if (dbus_session_socket == NULL)
         return FALSE;
     }
 
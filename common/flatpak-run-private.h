@@ -35,9 +35,10 @@
 
 #define FLATPAK_RUN_APP_DEPLOY_USR_ORIGINAL (-2)
 
-gboolean flatpak_run_in_transient_unit (const char *app_id,
-                                        const char *instance_id,
-                                        GError    **error);
+gboolean flatpak_run_in_transient_unit (const char      *app_id,
+                                        const char      *instance_id,
+                                        FlatpakContext  *context,
+                                        GError         **error);
 
 void     flatpak_run_extend_ld_path       (FlatpakBwrap       *bwrap,
                                            const char         *prepend,
@@ -49,8 +50,11 @@ gboolean flatpak_run_add_extension_args   (FlatpakBwrap       *bwrap,
                                            const char         *target_path,
                                            char              **extensions_out,
                                            char              **ld_path_out,
+                                           gboolean           *affects_ld_cache_out,
                                            GCancellable       *cancellable,
                                            GError            **error);
+typedef struct _FlatpakRunRequests FlatpakRunRequests;
+
 gboolean flatpak_run_add_environment_args (FlatpakBwrap           *bwrap,
                                            const char             *app_info_path,
                                            FlatpakRunFlags         flags,
@@ -64,6 +68,7 @@ gboolean flatpak_run_add_environment_args (FlatpakBwrap           *bwrap,
                                            GPtrArray              *previous_app_id_dirs,
                                            int                     per_app_dir_lock_fd,
                                            const char             *instance_id,
+                                           FlatpakRunRequests     *requests,
                                            FlatpakExports        **exports_out,
                                            GCancellable           *cancellable,
                                            GError                **error);
@@ -139,6 +139,104 @@ connect_to_wayland_display (const char *wayland_display)
   return wl_display_connect_to_fd (g_steal_fd (&fd));
 }
 
+/* Processes that launch several apps, like those using libflatpak, keep
+ * the connection to the compositor and its security context manager
+ * around, so each launch only needs one roundtrip to the compositor.
+ * The security contexts themselves can't be shared, they belong to a
+ * single instance and go away when it exits. */
+typedef struct
+{
+  char                                  *wayland_display;
+  struct wl_display                     *display;
+  struct wp_security_context_manager_v1 *manager; /* NULL if unsupported */
+} WaylandConnection;
+
+G_LOCK_DEFINE_STATIC (wayland_connection);
+static WaylandConnection wayland_connection;
+
+static void
+wayland_connection_clear (WaylandConnection *connection)
+{
+  if (connection->manager)
+    wp_security_context_manager_v1_destroy (connection->manager);
+  connection->manager = NULL;
+  if (connection->display)
+    wl_display_disconnect (connection->display);
+  connection->display = NULL;
+  g_clear_pointer (&connection->wayland_display, g_free);
+}
+
+/* Must be called with the wayland_connection lock held */
+static WaylandConnection *
+get_wayland_connection (const char *wayland_display,
+                        gboolean   *reused_out)
+{
+  WaylandConnection *connection = &wayland_connection;
+  struct wl_registry *registry;
+  int ret;
+
+  *reused_out = FALSE;
+
+  if (connection->display != NULL &&
+      g_strcmp0 (connection->wayland_display, wayland_display) == 0)
+    {
+      *reused_out = TRUE;
+      return connection;
+    }
+
+  wayland_connection_clear (connection);
+
+  /* We don't use wl_display_connect () here, for two reasons:
+   * 1. It would unsetenv ("WAYLAND_SOCKET"), which is not thread-safe.
+   * 2. If the compositor has set WAYLAND_SOCKET to a special, higher-privileged
+   *    socket, the application should be able to get those privileges for its first
+   *    connection; but that fd can only be used once, so having flatpak itself
+   *    do that first connection would defeat that mechanism.
+   *
+   * We still set up a security context for the second and subsequent connections
+   * to Wayland from within the sandbox.
+   */
+  connection->display = connect_to_wayland_display (wayland_display);
+  if (!connection->display)
+    return NULL;
+
+  registry = wl_display_get_registry (connection->display);
+  wl_registry_add_listener (registry, &registry_listener,
+                            &connection->manager);
+  ret = wl_display_roundtrip (connection->display);
+  wl_registry_destroy (registry);
+  if (ret < 0)
+    {
+      wayland_connection_clear (connection);
+      return NULL;
+    }
+
+  connection->wayland_display = g_strdup (wayland_display);
+
+  return connection;
+}
+
+static gboolean
+register_security_context (WaylandConnection *connection,
+                           int                listen_fd,
+                           int                sync_fd,
+                           const char        *app_id,
+                           const char        *instance_id)
+{
+  struct wp_security_context_v1 *security_context;
+
+  security_context = wp_security_context_manager_v1_create_listener (connection->manager,
+                                                                     listen_fd,
+                                                                     sync_fd);
+  wp_security_context_v1_set_sandbox_engine (security_context, "org.flatpak");
+  wp_security_context_v1_set_app_id (security_context, app_id);
+  wp_security_context_v1_set_instance_id (security_context, instance_id);
+  wp_security_context_v1_commit (security_context);
+  wp_security_context_v1_destroy (security_context);
+
+  return wl_display_roundtrip (connection->display) >= 0;
+}
+
 static char *
 create_wl_socket (char *template)
 {
@@ -168,40 +266,22 @@ flatpak_run_create_wayland_security_context (FlatpakBwrap *bwrap,
                                              gchar       **socket_path_out)
 {
   gboolean res = FALSE;
-  struct wl_display *display;
-  struct wl_registry *registry;
-  struct wp_security_context_manager_v1 *security_context_manager = NULL;
-  struct wp_security_context_v1 *security_context;
+  WaylandConnection *connection;
+  gboolean reused;
   struct sockaddr_un sockaddr = {0};
   g_autofree char *socket_path = NULL;
-  int listen_fd = -1, sync_fd, ret;
+  int listen_fd = -1, sync_fd;
 
   *available_out = TRUE;
   *socket_path_out = NULL;
 
-  /* We don't use wl_display_connect () here, for two reasons:
-   * 1. It would unsetenv ("WAYLAND_SOCKET"), which is not thread-safe.
-   * 2. If the compositor has set WAYLAND_SOCKET to a special, higher-privileged
-   *    socket, the application should be able to get those privileges for its first
-   *    connection; but that fd can only be used once, so having flatpak itself
-   *    do that first connection would defeat that mechanism.
-   *
-   * We still set up a security context for the second and subsequent connections
-   * to Wayland from within the sandbox.
-   */
-  display = connect_to_wayland_display (wayland_display);
-  if (!display)
-    return FALSE;
+  G_LOCK (wayland_connection);
 
-  registry = wl_display_get_registry (display);
-  wl_registry_add_listener (registry, &registry_listener,
-                            &security_context_manager);
-  ret = wl_display_roundtrip (display);
-  wl_registry_destroy (registry);
-  if (ret < 0)
+  connection = get_wayland_connection (wayland_display, &reused);
+  if (!connection)
     goto out;
 
-  if (!security_context_manager)
+  if (!connection->manager)
     {
       g_debug ("Wayland display does not support security_context_manager_v1");
       *available_out = FALSE;
@@ -230,26 +310,31 @@ flatpak_run_create_wayland_security_context (FlatpakBwrap *bwrap,
   if (sync_fd < 0)
     goto out;
 
-  security_context = wp_security_context_manager_v1_create_listener (security_context_manager,
-                                                                     listen_fd,
-                                                                     sync_fd);
-  wp_security_context_v1_set_sandbox_engine (security_context, "org.flatpak");
-  wp_security_context_v1_set_app_id (security_context, app_id);
-  wp_security_context_v1_set_instance_id (security_context, instance_id);
-  wp_security_context_v1_commit (security_context);
-  wp_security_context_v1_destroy (security_context);
-  if (wl_display_roundtrip (display) < 0)
-    goto out;
+  if (!register_security_context (connection, listen_fd, sync_fd, app_id, instance_id))
+    {
+      /* A connection we kept around may have broken since, e.g. because
+       * the compositor was restarted, so try again with a new one */
+      wayland_connection_clear (connection);
+      if (!reused)
+        goto out;
+
+      connection = get_wayland_connection (wayland_display, &reused);
+      if (!connection || !connection->manager ||
+          !register_security_context (connection, listen_fd, sync_fd, app_id, instance_id))
+        {
+          wayland_connection_clear (&wayland_connection);
+          goto out;
+        }
+    }
 
   *socket_path_out = g_steal_pointer (&socket_path);
   res = TRUE;
 
 out:
+  G_UNLOCK (wayland_connection);
+
   if (listen_fd >= 0)
     close (listen_fd);
-  if (security_context_manager)
-    wp_security_context_manager_v1_destroy (security_context_manager);
-  wl_display_disconnect (display);
   return res;
 }
 
@@ -47,6 +47,8 @@
 #include "flatpak-syscalls-private.h"
 
 #ifdef ENABLE_SECCOMP
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 #include <seccomp.h>
 #endif
 
@@ -60,6 +62,7 @@
 #include "flatpak-run-private.h"
 #include "flatpak-run-sockets-private.h"
 #include "flatpak-run-wayland-private.h"
+#include "flatpak-trace-private.h"
 #include "flatpak-utils-base-private.h"
 #include "flatpak-dir-private.h"
 #include "flatpak-dir-utils-private.h"
@@ -131,10 +134,12 @@ flatpak_run_add_extension_args (FlatpakBwrap      *bwrap,
                                 const char        *target_path,
                                 char             **extensions_out,
                                 char             **ld_path_out,
+                                gboolean          *affects_ld_cache_out,
                                 GCancellable      *cancellable,
                                 GError           **error)
 {
   g_autoptr(GString) used_extensions = g_string_new ("");
+  gboolean affects_ld_cache = FALSE;
   GList *extensions, *path_sorted_extensions, *l;
   g_autoptr(GString) ld_library_path = g_string_new ("");
   int count = 0;
@@ -160,7 +165,6 @@ flatpak_run_add_extension_args (FlatpakBwrap      *bwrap,
       g_autofree char *directory = g_build_filename (target_path, ext->directory, NULL);
       g_autofree char *full_directory = g_build_filename (directory, ext->subdir_suffix, NULL);
       g_autofree char *ref_file = g_build_filename (full_directory, ".ref", NULL);
-      g_autofree char *real_ref = g_build_filename (ext->files_path, ext->directory, ".ref", NULL);
 
       if (ext->needs_tmpfs)
         {
@@ -179,7 +183,7 @@ flatpak_run_add_extension_args (FlatpakBwrap      *bwrap,
                               "--ro-bind", ext->files_path, full_directory,
                               NULL);
 
-      if (g_file_test (real_ref, G_FILE_TEST_EXISTS))
+      if (ext->has_ref)
         flatpak_bwrap_add_args (bwrap,
                                 "--lock-file", ref_file,
                                 NULL);
@@ -205,6 +209,12 @@ flatpak_run_add_extension_args (FlatpakBwrap      *bwrap,
       else
         g_string_append (used_extensions, "local");
 
+      /* Mounted or merged into a directory ldconfig looks at */
+      if (ext->add_ld_path ||
+          g_str_has_prefix (ext->directory, "lib") ||
+          g_str_has_prefix (ext->directory, "etc"))
+        affects_ld_cache = TRUE;
+
       if (ext->add_ld_path)
         {
           g_autofree char *ld_path = g_build_filename (full_directory, ext->add_ld_path, NULL);
@@ -216,8 +226,8 @@ flatpak_run_add_extension_args (FlatpakBwrap      *bwrap,
               g_autofree char *ld_so_conf_file = g_strdup_printf ("%s-%03d-%s.conf", flatpak_decomposed_get_kind_str (ref), ++count, ext->installed_id);
               g_autofree char *ld_so_conf_file_path = g_build_filename ("/run/flatpak/ld.so.conf.d", ld_so_conf_file, NULL);
 
-              if (!flatpak_bwrap_add_args_data (bwrap, "ld-so-conf",
-                                                contents, -1, ld_so_conf_file_path, error))
+              if (!flatpak_bwrap_add_args_static_data (bwrap, "ld-so-conf",
+                                                       contents, -1, ld_so_conf_file_path, error))
                 return FALSE;
             }
           else
@@ -228,29 +238,18 @@ flatpak_run_add_extension_args (FlatpakBwrap      *bwrap,
             }
         }
 
-      for (i = 0; ext->merge_dirs != NULL && ext->merge_dirs[i] != NULL; i++)
+      for (i = 0; ext->merged_files != NULL && ext->merged_files[i] != NULL; i++)
         {
           g_autofree char *parent = g_path_get_dirname (directory);
-          g_autofree char *merge_dir = g_build_filename (parent, ext->merge_dirs[i], NULL);
-          g_autofree char *source_dir = g_build_filename (ext->files_path, ext->merge_dirs[i], NULL);
-          g_auto(GLnxDirFdIterator) source_iter = { 0 };
-          struct dirent *dent;
-
-          if (glnx_dirfd_iterator_init_at (AT_FDCWD, source_dir, TRUE, &source_iter, NULL))
+          g_autofree char *symlink_path = g_build_filename (parent, ext->merged_files[i], NULL);
+          /* Only create the first, because extensions are listed in prio order */
+          if (!g_hash_table_contains (created_symlink, symlink_path))
             {
-              while (glnx_dirfd_iterator_next_dent (&source_iter, &dent, NULL, NULL) && dent != NULL)
-                {
-                  g_autofree char *symlink_path = g_build_filename (merge_dir, dent->d_name, NULL);
-                  /* Only create the first, because extensions are listed in prio order */
-                  if (!g_hash_table_contains (created_symlink, symlink_path))
-                    {
-                      g_autofree char *symlink = g_build_filename (directory, ext->merge_dirs[i], dent->d_name, NULL);
-                      flatpak_bwrap_add_args (bwrap,
-                                              "--symlink", symlink, symlink_path,
-                                              NULL);
-                      g_hash_table_add (created_symlink, g_steal_pointer (&symlink_path));
-                    }
-                }
+              g_autofree char *symlink = g_build_filename (directory, ext->merged_files[i], NULL);
+              flatpak_bwrap_add_args (bwrap,
+                                      "--symlink", symlink, symlink_path,
+                                      NULL);
+              g_hash_table_add (created_symlink, g_steal_pointer (&symlink_path));
             }
         }
     }
@@ -263,6 +262,9 @@ flatpak_run_add_extension_args (FlatpakBwrap      *bwrap,
   if (ld_path_out)
     *ld_path_out = g_string_free (g_steal_pointer (&ld_library_path), FALSE);
 
+  if (affects_ld_cache_out)
+    *affects_ld_cache_out = affects_ld_cache;
+
   return TRUE;
 }
 
@@ -273,6 +275,9 @@ check_usb_portal (void)
   g_autoptr(GVariant) ret = NULL;
   g_autoptr(GError) error = NULL;
 
+  if (!flatpak_run_has_session_bus ())
+    return FALSE;
+
   bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
   if (!bus)
     return FALSE;
@@ -337,6 +342,8 @@ flatpak_run_evaluate_conditions (FlatpakContextConditions condition)
 /*
  * @per_app_dir_lock_fd: If >= 0, make use of per-app directories in
  *  the host's XDG_RUNTIME_DIR to share /tmp between instances.
+ * @requests: (nullable): Session service requests sent in advance,
+ *  or %NULL to make them synchronously when needed.
  */
 gboolean
 flatpak_run_add_environment_args (FlatpakBwrap           *bwrap,
@@ -352,6 +359,7 @@ flatpak_run_add_environment_args (FlatpakBwrap           *bwrap,
                                   GPtrArray              *previous_app_id_dirs,
                                   int                     per_app_dir_lock_fd,
                                   const char             *instance_id,
+                                  FlatpakRunRequests     *requests,
                                   FlatpakExports        **exports_out,
                                   GCancellable           *cancellable,
                                   GError                **error)
@@ -599,9 +607,9 @@ flatpak_run_add_environment_args (FlatpakBwrap           *bwrap,
 
   /* Must run this before spawning the dbus proxy, to ensure it
      ends up in the app cgroup */
-  if (instance_id)
+  if (instance_id && (flags & FLATPAK_RUN_FLAG_HEADLESS) == 0)
     {
-      if (!flatpak_run_in_transient_unit (app_id, instance_id, &my_error))
+      if (!flatpak_run_in_transient_unit (app_id, instance_id, context, &my_error))
         {
           /* We still run along even if we don't get a cgroup, as nothing
              really depends on it. Its just nice to have */
@@ -852,35 +860,52 @@ flatpak_run_apply_env_vars (FlatpakBwrap *bwrap, FlatpakContext *context)
     }
 }
 
+#ifndef AT_STATX_DONT_SYNC
+#define AT_STATX_DONT_SYNC 0x4000
+#endif
+
+/* The directories below ~/.var/app/$APP_ID that must exist */
+static const char * const app_id_subdirs[] = {
+  "data",
+  "cache/fontconfig",
+  "cache/tmp",
+  "config",
+  ".local/state",
+};
+
 gboolean
 flatpak_ensure_data_dir (GFile        *app_id_dir,
                          GCancellable *cancellable,
                          GError      **error)
 {
-  g_autoptr(GFile) data_dir = g_file_get_child (app_id_dir, "data");
-  g_autoptr(GFile) cache_dir = g_file_get_child (app_id_dir, "cache");
-  g_autoptr(GFile) fontconfig_cache_dir = g_file_get_child (cache_dir, "fontconfig");
-  g_autoptr(GFile) tmp_dir = g_file_get_child (cache_dir, "tmp");
-  g_autoptr(GFile) config_dir = g_file_get_child (app_id_dir, "config");
-  g_autoptr(GFile) state_dir = g_file_get_child (app_id_dir, ".local/state");
-
-  if (!flatpak_mkdir_p (data_dir, cancellable, error))
-    return FALSE;
-
-  if (!flatpak_mkdir_p (cache_dir, cancellable, error))
-    return FALSE;
+  glnx_autofd int app_id_dfd = -1;
+  gsize i;
 
-  if (!flatpak_mkdir_p (fontconfig_cache_dir, cancellable, error))
+  if (!glnx_shutil_mkdir_p_at_open (AT_FDCWD, flatpak_file_get_path_cached (app_id_dir),
+                                    0777, &app_id_dfd, cancellable, error))
     return FALSE;
 
-  if (!flatpak_mkdir_p (tmp_dir, cancellable, error))
-    return FALSE;
+  /* Home directories are often on NFS, where looking up a path can take
+   * a round trip to the server for each component once the attribute
+   * cache has expired. So look up the subdirectories relative to the
+   * app's directory, and let the filesystem answer from its cache: that
+   * is good enough to see that a directory we created on an earlier
+   * launch is still there. Anything that looks missing goes through the
+   * usual, authoritative, mkdir -p. */
+  for (i = 0; i < G_N_ELEMENTS (app_id_subdirs); i++)
+    {
+      struct glnx_statx stx;
 
-  if (!flatpak_mkdir_p (config_dir, cancellable, error))
-    return FALSE;
+      if (glnx_statx (app_id_dfd, app_id_subdirs[i],
+                      AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                      GLNX_STATX_TYPE, &stx, NULL) &&
+          (stx.stx_mask & GLNX_STATX_TYPE) != 0 &&
+          S_ISDIR (stx.stx_mode))
+        continue;
 
-  if (!flatpak_mkdir_p (state_dir, cancellable, error))
-    return FALSE;
+      if (!glnx_shutil_mkdir_p_at (app_id_dfd, app_id_subdirs[i], 0777, cancellable, error))
+        return FALSE;
+    }
 
   return TRUE;
 }
@@ -920,9 +945,10 @@ systemd_unit_name_escape (const gchar *in)
 }
 
 gboolean
-flatpak_run_in_transient_unit (const char  *app_id,
-                               const char  *instance_id,
-                               GError     **error)
+flatpak_run_in_transient_unit (const char      *app_id,
+                               const char      *instance_id,
+                               FlatpakContext  *context,
+                               GError         **error)
 {
   g_autoptr(GDBusConnection) conn = NULL;
   g_autofree char *path = NULL;
@@ -984,6 +1010,9 @@ flatpak_run_in_transient_unit (const char  *app_id,
                          g_variant_new_fixed_array (G_VARIANT_TYPE ("u"),
                                                     &pid, 1, sizeof (guint32)));
 
+  if (context != NULL)
+    flatpak_context_add_unit_properties (context, &builder);
+
   properties = g_variant_builder_end (&builder);
 
   aux = g_variant_new_array (G_VARIANT_TYPE ("(sa(sv))"), NULL, 0);
@@ -1126,7 +1155,7 @@ add_font_path_args (FlatpakBwrap *bwrap)
   g_string_append (xml_snippet,
                    "</fontconfig>\n");
 
-  if (!flatpak_bwrap_add_args_data (bwrap, "font-dirs.xml", xml_snippet->str, xml_snippet->len, "/run/host/font-dirs.xml", NULL))
+  if (!flatpak_bwrap_add_args_static_data (bwrap, "font-dirs.xml", xml_snippet->str, xml_snippet->len, "/run/host/font-dirs.xml", NULL))
     g_warning ("Unable to add fontconfig data snippet");
 }
 
@@ -1181,6 +1210,147 @@ flatpak_app_compute_permissions (GKeyFile *app_metadata,
   return g_steal_pointer (&app_context);
 }
 
+#define LAUNCH_PLAN_VARIANT_FORMAT "(sss(ua{sv}))"
+
+/* The permissions of an app only depend on the app and runtime commits
+ * and on the overrides, so they are cached, leaving only the host
+ * dependent parts (the conditional permissions, the exports, ...) to be
+ * worked out on every launch. Like the overrides, the cache must not be
+ * writable by the apps. */
+static char *
+get_launch_plan_path (FlatpakDecomposed *app_ref,
+                      FlatpakDecomposed *runtime_ref)
+{
+  g_autofree char *key = g_strconcat (flatpak_decomposed_get_ref (app_ref), "\n",
+                                      flatpak_decomposed_get_ref (runtime_ref), NULL);
+  g_autofree char *checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+  g_autofree char *dir = flatpak_get_user_private_cache_dir ("launch-plans");
+
+  return g_build_filename (dir, checksum, NULL);
+}
+
+static FlatpakContext *
+load_cached_app_context (const char *path,
+                         const char *app_commit,
+                         const char *runtime_commit,
+                         const char *overrides_stamp)
+{
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) plan = NULL;
+  g_autoptr(GVariant) serialized_context = NULL;
+  g_autoptr(FlatpakContext) context = NULL;
+  const char *cached_app_commit;
+  const char *cached_runtime_commit;
+  const char *cached_overrides;
+  g_autoptr(GError) local_error = NULL;
+
+  mfile = g_mapped_file_new (path, FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  plan = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (LAUNCH_PLAN_VARIANT_FORMAT),
+                                                       bytes, FALSE));
+
+  g_variant_get (plan, "(&s&s&s@(ua{sv}))",
+                 &cached_app_commit, &cached_runtime_commit, &cached_overrides,
+                 &serialized_context);
+  if (g_strcmp0 (cached_app_commit, app_commit) != 0 ||
+      g_strcmp0 (cached_runtime_commit, runtime_commit) != 0 ||
+      g_strcmp0 (cached_overrides, overrides_stamp) != 0)
+    return NULL;
+
+  context = flatpak_context_deserialize (serialized_context, &local_error);
+  if (context == NULL)
+    {
+      g_info ("Ignoring invalid launch plan %s: %s", path, local_error->message);
+      return NULL;
+    }
+
+  g_info ("Using cached launch plan %s", path);
+
+  return g_steal_pointer (&context);
+}
+
+static void
+save_cached_app_context (const char     *path,
+                         const char     *app_commit,
+                         const char     *runtime_commit,
+                         const char     *overrides_stamp,
+                         FlatpakContext *context)
+{
+  g_autoptr(GVariant) serialized_context = flatpak_context_serialize (context);
+  g_autoptr(GVariant) plan = NULL;
+  g_autofree char *dir = g_path_get_dirname (path);
+  g_autoptr(GError) local_error = NULL;
+
+  plan = g_variant_ref_sink (g_variant_new ("(sss@(ua{sv}))",
+                                            app_commit, runtime_commit, overrides_stamp,
+                                            serialized_context));
+
+  if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+      g_info ("Failed to save launch plan: %s", g_strerror (errno));
+      return;
+    }
+
+  if (!g_file_set_contents (path, g_variant_get_data (plan), g_variant_get_size (plan), &local_error))
+    g_info ("Failed to save launch plan: %s", local_error->message);
+}
+
+/* Computes the permissions of @app_deploy with its overrides applied */
+static FlatpakContext *
+compute_app_context (FlatpakDecomposed *app_ref,
+                     FlatpakDeploy     *app_deploy,
+                     GBytes            *app_deploy_data,
+                     GKeyFile          *metakey,
+                     FlatpakDecomposed *runtime_ref,
+                     GBytes            *runtime_deploy_data,
+                     GKeyFile          *runtime_metakey,
+                     GError           **error)
+{
+  g_autoptr(FlatpakContext) app_context = NULL;
+  g_autoptr(FlatpakContext) overrides = NULL;
+  g_autofree char *plan_path = NULL;
+  g_autofree char *overrides_stamp = NULL;
+  const char *app_commit = NULL;
+  const char *runtime_commit;
+
+  runtime_commit = flatpak_deploy_data_get_commit (runtime_deploy_data);
+
+  if (app_deploy != NULL)
+    {
+      app_commit = flatpak_deploy_data_get_commit (app_deploy_data);
+      overrides_stamp = flatpak_deploy_get_overrides_stamp (app_deploy);
+      plan_path = get_launch_plan_path (app_ref, runtime_ref);
+
+      app_context = load_cached_app_context (plan_path, app_commit, runtime_commit, overrides_stamp);
+      if (app_context != NULL)
+        {
+          flatpak_context_dump (app_context, "Cached metadata and overrides");
+          return g_steal_pointer (&app_context);
+        }
+    }
+
+  app_context = flatpak_app_compute_permissions (metakey, runtime_metakey, error);
+  if (app_context == NULL)
+    return NULL;
+
+  if (app_deploy != NULL)
+    {
+      overrides = flatpak_deploy_get_overrides (app_deploy, error);
+      if (overrides == NULL)
+        return NULL;
+
+      flatpak_context_merge (app_context, overrides);
+
+      save_cached_app_context (plan_path, app_commit, runtime_commit, overrides_stamp, app_context);
+    }
+
+  return g_steal_pointer (&app_context);
+}
+
 #ifdef HAVE_DCONF
 
 static void
@@ -1355,19 +1525,19 @@ flatpak_run_add_dconf_args (FlatpakBwrap *bwrap,
                   &locks, &locks_size);
 
   if (defaults_size != 0 &&
-      !flatpak_bwrap_add_args_data (bwrap,
-                                    "dconf-defaults",
-                                    defaults, defaults_size,
-                                    "/etc/glib-2.0/settings/defaults",
-                                    error))
+      !flatpak_bwrap_add_args_static_data (bwrap,
+                                           "dconf-defaults",
+                                           defaults, defaults_size,
+                                           "/etc/glib-2.0/settings/defaults",
+                                           error))
     return FALSE;
 
   if (locks_size != 0 &&
-      !flatpak_bwrap_add_args_data (bwrap,
-                                    "dconf-locks",
-                                    locks, locks_size,
-                                    "/etc/glib-2.0/settings/locks",
-                                    error))
+      !flatpak_bwrap_add_args_static_data (bwrap,
+                                           "dconf-locks",
+                                           locks, locks_size,
+                                           "/etc/glib-2.0/settings/locks",
+                                           error))
     return FALSE;
 
   /* We do a one-time conversion of existing dconf settings to a keyfile.
@@ -1613,6 +1783,21 @@ flatpak_run_add_app_info_args (FlatpakBwrap           *bwrap,
   if (!g_key_file_save_to_file (keyfile, info_path, error))
     return FALSE;
 
+  /* The same, in a form that is quicker to load for flatpak ps and
+   * other users of FlatpakInstance. It is optional, readers fall back
+   * to the keyfile. */
+  {
+    g_autoptr(GVariant) info_variant = flatpak_keyfile_to_variant (keyfile);
+    g_autofree char *info_variant_path = g_build_filename (instance_id_host_dir, "info.variant", NULL);
+    g_autoptr(GError) local_error = NULL;
+
+    if (!g_file_set_contents (info_variant_path,
+                              g_variant_get_data (info_variant),
+                              g_variant_get_size (info_variant),
+                              &local_error))
+      g_info ("Unable to write %s: %s", info_variant_path, local_error->message);
+  }
+
   /* We want to create a file on /.flatpak-info that the app cannot modify, which
      we do by creating a read-only bind mount. This way one can openat()
      /proc/$pid/root, and if that succeeds use openat via that to find the
@@ -1652,11 +1837,11 @@ flatpak_run_add_app_info_args (FlatpakBwrap           *bwrap,
   flatpak_bwrap_add_args (bwrap,
                           "--setenv", "container", "flatpak",
                           NULL);
-  if (!flatpak_bwrap_add_args_data (bwrap,
-                                    "container-manager",
-                                    "flatpak\n", -1,
-                                    "/run/host/container-manager",
-                                    error))
+  if (!flatpak_bwrap_add_args_static_data (bwrap,
+                                           "container-manager",
+                                           "flatpak\n", -1,
+                                           "/run/host/container-manager",
+                                           error))
     return FALSE;
 
   bwrapinfo_path = g_build_filename (instance_id_host_dir, "bwrapinfo.json", NULL);
@@ -1776,34 +1961,190 @@ add_tzdata_args (FlatpakBwrap *bwrap,
         }
     }
 
-  flatpak_bwrap_add_args_data (bwrap, "timezone",
-                               timezone_content, -1, "/etc/timezone",
-                               NULL);
+  flatpak_bwrap_add_args_static_data (bwrap, "timezone",
+                                      timezone_content, -1, "/etc/timezone",
+                                      NULL);
+}
+
+/* The session services that flatpak_run_app() needs answers from are
+ * all asked up front, on a private main context, and the replies are
+ * only waited for when they are used. This way the round trips overlap
+ * with each other and with the rest of the launch preparation. */
+struct _FlatpakRunRequests
+{
+  GMainContext *context;
+  GCancellable *cancellable;
+  guint         n_pending;
+
+  gboolean      session_helper_pending;
+  GVariant     *session_data;
+
+  gboolean      doc_portal_pending;
+  GDBusMessage *doc_portal_reply;
+};
+
+static void
+session_helper_request_cb (GObject      *source,
+                           GAsyncResult *res,
+                           gpointer      user_data)
+{
+  FlatpakRunRequests *requests = user_data;
+  g_autoptr(GVariant) reply = NULL;
+
+  reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), res, NULL);
+  if (reply != NULL)
+    g_variant_get (reply, "(@a{sv})", &requests->session_data);
+
+  requests->session_helper_pending = FALSE;
+  requests->n_pending--;
+}
+
+static void
+doc_portal_request_cb (GObject      *source,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+  FlatpakRunRequests *requests = user_data;
+
+  requests->doc_portal_reply =
+    g_dbus_connection_send_message_with_reply_finish (G_DBUS_CONNECTION (source), res, NULL);
+
+  requests->doc_portal_pending = FALSE;
+  requests->n_pending--;
+}
+
+static FlatpakRunRequests *
+flatpak_run_requests_new (gboolean use_session_helper,
+                          gboolean use_doc_portal)
+{
+  FlatpakRunRequests *requests = g_new0 (FlatpakRunRequests, 1);
+  g_autoptr(GDBusConnection) session_bus = NULL;
+
+  requests->context = g_main_context_new ();
+  requests->cancellable = g_cancellable_new ();
+
+  if (!use_session_helper && !use_doc_portal)
+    return requests;
+
+  session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
+  if (session_bus == NULL)
+    return requests;
+
+  g_main_context_push_thread_default (requests->context);
+
+  if (use_session_helper)
+    {
+      g_dbus_connection_call (session_bus,
+                              FLATPAK_SESSION_HELPER_BUS_NAME,
+                              FLATPAK_SESSION_HELPER_PATH,
+                              FLATPAK_SESSION_HELPER_INTERFACE,
+                              "RequestSession",
+                              NULL,
+                              G_VARIANT_TYPE ("(a{sv})"),
+                              G_DBUS_CALL_FLAGS_NONE,
+                              -1,
+                              requests->cancellable,
+                              session_helper_request_cb,
+                              requests);
+      requests->session_helper_pending = TRUE;
+      requests->n_pending++;
+    }
+
+  if (use_doc_portal)
+    {
+      g_autoptr(GDBusMessage) msg =
+        g_dbus_message_new_method_call ("org.freedesktop.portal.Documents",
+                                        "/org/freedesktop/portal/documents",
+                                        "org.freedesktop.portal.Documents",
+                                        "GetMountPoint");
+      g_dbus_message_set_body (msg, g_variant_new ("()"));
+      g_dbus_connection_send_message_with_reply (session_bus, msg,
+                                                 G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+                                                 30000,
+                                                 NULL,
+                                                 requests->cancellable,
+                                                 doc_portal_request_cb,
+                                                 requests);
+      requests->doc_portal_pending = TRUE;
+      requests->n_pending++;
+    }
+
+  g_main_context_pop_thread_default (requests->context);
+
+  return requests;
 }
 
 static void
-add_monitor_path_args (gboolean      use_session_helper,
-                       FlatpakBwrap *bwrap)
+flatpak_run_requests_wait (FlatpakRunRequests *requests,
+                           const gboolean     *pending)
+{
+  while (*pending)
+    g_main_context_iteration (requests->context, TRUE);
+}
+
+static void
+flatpak_run_requests_free (FlatpakRunRequests *requests)
+{
+  /* The callbacks point to us, so they must have run before we go */
+  g_cancellable_cancel (requests->cancellable);
+  while (requests->n_pending > 0)
+    g_main_context_iteration (requests->context, TRUE);
+
+  g_clear_pointer (&requests->session_data, g_variant_unref);
+  g_clear_object (&requests->doc_portal_reply);
+  g_clear_object (&requests->cancellable);
+  g_main_context_unref (requests->context);
+  g_free (requests);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakRunRequests, flatpak_run_requests_free)
+
+static GVariant *
+get_session_data (gboolean            use_session_helper,
+                  FlatpakRunRequests *requests)
 {
   g_autoptr(AutoFlatpakSessionHelper) session_helper = NULL;
-  g_autofree char *monitor_path = NULL;
-  g_autofree char *pkcs11_socket_path = NULL;
   g_autoptr(GVariant) session_data = NULL;
 
-  if (use_session_helper)
+  if (requests != NULL)
     {
-      session_helper =
-        flatpak_session_helper_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                                       G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
-                                                       FLATPAK_SESSION_HELPER_BUS_NAME,
-                                                       FLATPAK_SESSION_HELPER_PATH,
-                                                       NULL, NULL);
+      flatpak_run_requests_wait (requests, &requests->session_helper_pending);
+      if (requests->session_data != NULL)
+        return g_variant_ref (requests->session_data);
+      return NULL;
     }
 
+  if (!use_session_helper)
+    return NULL;
+
+  session_helper =
+    flatpak_session_helper_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
+                                                   G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                                   FLATPAK_SESSION_HELPER_BUS_NAME,
+                                                   FLATPAK_SESSION_HELPER_PATH,
+                                                   NULL, NULL);
+
   if (session_helper &&
       flatpak_session_helper_call_request_session_sync (session_helper,
                                                         &session_data,
                                                         NULL, NULL))
+    return g_steal_pointer (&session_data);
+
+  return NULL;
+}
+
+static void
+add_monitor_path_args (gboolean            use_session_helper,
+                       FlatpakRunRequests *requests,
+                       FlatpakBwrap       *bwrap)
+{
+  g_autofree char *monitor_path = NULL;
+  g_autofree char *pkcs11_socket_path = NULL;
+  g_autoptr(GVariant) session_data = NULL;
+
+  session_data = get_session_data (use_session_helper, requests);
+
+  if (session_data != NULL)
     {
       if (g_variant_lookup (session_data, "path", "s", &monitor_path))
         flatpak_bwrap_add_args (bwrap,
@@ -1821,9 +2162,9 @@ add_monitor_path_args (gboolean      use_session_helper,
             "# This overrides the runtime p11-kit-trusted module with a client one talking to the trust module on the host\n"
             "module: p11-kit-client.so\n";
 
-          if (flatpak_bwrap_add_args_data (bwrap, "p11-kit-trust.module",
-                                           trusted_module_contents, -1,
-                                           "/etc/pkcs11/modules/p11-kit-trust.module", NULL))
+          if (flatpak_bwrap_add_args_static_data (bwrap, "p11-kit-trust.module",
+                                                  trusted_module_contents, -1,
+                                                  "/etc/pkcs11/modules/p11-kit-trust.module", NULL))
             {
               flatpak_bwrap_add_args (bwrap,
                                       "--ro-bind", pkcs11_socket_path, sandbox_pkcs11_socket_path,
@@ -1855,52 +2196,39 @@ add_monitor_path_args (gboolean      use_session_helper,
 }
 
 static void
-add_document_portal_args (FlatpakBwrap *bwrap,
-                          const char   *app_id,
-                          char        **out_mount_path)
+add_document_portal_args (FlatpakBwrap       *bwrap,
+                          const char         *app_id,
+                          FlatpakRunRequests *requests,
+                          char              **out_mount_path)
 {
-  g_autoptr(GDBusConnection) session_bus = NULL;
   g_autofree char *doc_mount_path = NULL;
+  GDBusMessage *reply;
 
-  session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
-  if (session_bus)
+  flatpak_run_requests_wait (requests, &requests->doc_portal_pending);
+  reply = requests->doc_portal_reply;
+
+  if (reply)
     {
       g_autoptr(GError) local_error = NULL;
-      g_autoptr(GDBusMessage) reply = NULL;
-      g_autoptr(GDBusMessage) msg =
-        g_dbus_message_new_method_call ("org.freedesktop.portal.Documents",
-                                        "/org/freedesktop/portal/documents",
-                                        "org.freedesktop.portal.Documents",
-                                        "GetMountPoint");
-      g_dbus_message_set_body (msg, g_variant_new ("()"));
-      reply =
-        g_dbus_connection_send_message_with_reply_sync (session_bus, msg,
-                                                        G_DBUS_SEND_MESSAGE_FLAGS_NONE,
-                                                        30000,
-                                                        NULL,
-                                                        NULL,
-                                                        NULL);
-      if (reply)
+
+      if (g_dbus_message_to_gerror (reply, &local_error))
         {
-          if (g_dbus_message_to_gerror (reply, &local_error))
-            {
-              if (g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN))
-                g_info ("Document portal not available, not mounting /run/flatpak/doc");
-              else
-                g_message ("Can't get document portal: %s", local_error->message);
-            }
+          if (g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN))
+            g_info ("Document portal not available, not mounting /run/flatpak/doc");
           else
-            {
-              static const char dst_path[] = "/run/flatpak/doc";
-              g_autofree char *src_path = NULL;
-              g_variant_get (g_dbus_message_get_body (reply),
-                             "(^ay)", &doc_mount_path);
-
-              src_path = g_strdup_printf ("%s/by-app/%s",
-                                          doc_mount_path, app_id);
-              flatpak_bwrap_add_args (bwrap, "--bind", src_path, dst_path, NULL);
-              flatpak_bwrap_add_runtime_dir_member (bwrap, "doc");
-            }
+            g_message ("Can't get document portal: %s", local_error->message);
+        }
+      else
+        {
+          static const char dst_path[] = "/run/flatpak/doc";
+          g_autofree char *src_path = NULL;
+          g_variant_get (g_dbus_message_get_body (reply),
+                         "(^ay)", &doc_mount_path);
+
+          src_path = g_strdup_printf ("%s/by-app/%s",
+                                      doc_mount_path, app_id);
+          flatpak_bwrap_add_args (bwrap, "--bind", src_path, dst_path, NULL);
+          flatpak_bwrap_add_runtime_dir_member (bwrap, "doc");
         }
     }
 
@@ -1955,6 +2283,91 @@ cleanup_seccomp (void *p)
     seccomp_release (*pp);
 }
 
+/* The exported filter only depends on these, so it's cached by them.
+ * Other versions of flatpak or libseccomp may generate a different
+ * filter for the same flags, so they are part of the key too. */
+static char *
+get_seccomp_cache_path (const char     *arch,
+                        gulong          allowed_personality,
+                        FlatpakRunFlags run_flags)
+{
+  const struct scmp_version *version = seccomp_version ();
+  FlatpakRunFlags relevant_flags = run_flags & (FLATPAK_RUN_FLAG_MULTIARCH |
+                                                FLATPAK_RUN_FLAG_DEVEL |
+                                                FLATPAK_RUN_FLAG_CANBUS |
+                                                FLATPAK_RUN_FLAG_BLUETOOTH);
+  g_autofree char *key = NULL;
+  g_autofree char *checksum = NULL;
+  g_autofree char *dir = NULL;
+
+  key = g_strdup_printf ("%s\n%u.%u.%u\n%u\n%s\n%lu\n%x",
+                         PACKAGE_VERSION,
+                         version->major, version->minor, version->micro,
+                         seccomp_arch_native (),
+                         arch ? arch : "",
+                         allowed_personality,
+                         (guint) relevant_flags);
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+
+  dir = flatpak_get_user_private_cache_dir ("seccomp");
+
+  return g_build_filename (dir, checksum, NULL);
+}
+
+/* Returns an fd for the cached filter at @path, or -1 */
+static int
+open_cached_seccomp (const char *path)
+{
+  glnx_autofd int fd = -1;
+  struct stat stbuf;
+  struct sock_filter first, last;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0)
+    return -1;
+
+  /* Only trust filters written by ourselves that look like an array of
+   * BPF instructions */
+  if (fstat (fd, &stbuf) != 0 ||
+      !S_ISREG (stbuf.st_mode) ||
+      stbuf.st_uid != getuid () ||
+      (stbuf.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+      stbuf.st_size == 0 ||
+      stbuf.st_size % sizeof (struct sock_filter) != 0)
+    return -1;
+
+  /* Filters from libseccomp always start by checking the arch and end
+   * with a return, anything else isn't one of ours */
+  if (pread (fd, &first, sizeof (first), 0) != sizeof (first) ||
+      pread (fd, &last, sizeof (last), stbuf.st_size - sizeof (last)) != sizeof (last) ||
+      first.code != (BPF_LD | BPF_W | BPF_ABS) ||
+      first.k != offsetof (struct seccomp_data, arch) ||
+      BPF_CLASS (last.code) != BPF_RET)
+    return -1;
+
+  return g_steal_fd (&fd);
+}
+
+static void
+save_cached_seccomp (const char *path,
+                     int         fd)
+{
+  g_autofree char *dir = g_path_get_dirname (path);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (lseek (fd, 0, SEEK_SET) < 0 ||
+      (bytes = glnx_fd_readall_bytes (fd, NULL, &local_error)) == NULL ||
+      !glnx_shutil_mkdir_p_at (AT_FDCWD, dir, 0700, NULL, &local_error) ||
+      !glnx_file_replace_contents_with_perms_at (AT_FDCWD, path,
+                                                 g_bytes_get_data (bytes, NULL),
+                                                 g_bytes_get_size (bytes),
+                                                 0600, (uid_t) -1, (gid_t) -1,
+                                                 GLNX_FILE_REPLACE_NODATASYNC,
+                                                 NULL, &local_error))
+    g_info ("Failed to cache seccomp filter: %s", local_error ? local_error->message : g_strerror (errno));
+}
+
 static gboolean
 setup_seccomp (FlatpakBwrap   *bwrap,
                const char     *arch,
@@ -2090,6 +2503,19 @@ setup_seccomp (FlatpakBwrap   *bwrap,
   int last_allowed_family;
   int i, r;
   g_auto(GLnxTmpfile) seccomp_tmpf  = { 0, };
+  g_autofree char *cache_path = NULL;
+  int cached_fd;
+
+  /* Building the filter rule by rule is a noticeable part of the
+   * startup time, and it's always the same for the same inputs */
+  cache_path = get_seccomp_cache_path (arch, allowed_personality, run_flags);
+  cached_fd = open_cached_seccomp (cache_path);
+  if (cached_fd >= 0)
+    {
+      g_info ("Using cached seccomp filter %s", cache_path);
+      flatpak_bwrap_add_args_data_fd (bwrap, "--seccomp", cached_fd, NULL);
+      return TRUE;
+    }
 
   seccomp = seccomp_init (SCMP_ACT_ALLOW);
   if (!seccomp)
@@ -2246,6 +2672,8 @@ setup_seccomp (FlatpakBwrap   *bwrap,
   if (r != 0)
     return flatpak_fail_error (error, FLATPAK_ERROR_SETUP_FAILED, _("Failed to export bpf: %s"), flatpak_seccomp_strerror (r));
 
+  save_cached_seccomp (cache_path, seccomp_tmpf.fd);
+
   lseek (seccomp_tmpf.fd, 0, SEEK_SET);
 
   flatpak_bwrap_add_args_data_fd (bwrap,
@@ -2441,13 +2869,13 @@ flatpak_run_setup_base_argv (FlatpakBwrap   *bwrap,
                             "--symlink", "usr/etc", "/etc",
                             NULL);
 
-  if (!flatpak_bwrap_add_args_data (bwrap, "passwd", passwd_contents, -1, "/etc/passwd", error))
+  if (!flatpak_bwrap_add_args_static_data (bwrap, "passwd", passwd_contents, -1, "/etc/passwd", error))
     return FALSE;
 
-  if (!flatpak_bwrap_add_args_data (bwrap, "group", group_contents->str, -1, "/etc/group", error))
+  if (!flatpak_bwrap_add_args_static_data (bwrap, "group", group_contents->str, -1, "/etc/group", error))
     return FALSE;
 
-  if (!flatpak_bwrap_add_args_data (bwrap, "pkcs11.conf", pkcs11_conf_contents, -1, "/etc/pkcs11/pkcs11.conf", error))
+  if (!flatpak_bwrap_add_args_static_data (bwrap, "pkcs11.conf", pkcs11_conf_contents, -1, "/etc/pkcs11/pkcs11.conf", error))
     return FALSE;
 
   if (g_file_test ("/etc/machine-id", G_FILE_TEST_EXISTS))
@@ -2556,13 +2984,17 @@ flatpak_run_setup_base_argv (FlatpakBwrap   *bwrap,
   /* Always set the personallity, and clear all weird flags */
   personality (pers);
 
+  flatpak_startup_profile_mark ("environment");
+
 #ifdef ENABLE_SECCOMP
   if (!setup_seccomp (bwrap, arch, pers, flags, error))
     return FALSE;
 #endif
 
+  flatpak_startup_profile_mark ("seccomp");
+
   if ((flags & FLATPAK_RUN_FLAG_WRITABLE_ETC) == 0)
-    add_monitor_path_args ((flags & FLATPAK_RUN_FLAG_NO_SESSION_HELPER) == 0, bwrap);
+    add_monitor_path_args ((flags & FLATPAK_RUN_FLAG_NO_SESSION_HELPER) == 0, requests, bwrap);
 
   return TRUE;
 }
@@ -2773,7 +3205,10 @@ flatpak_context_load_for_deploy (FlatpakDeploy *deploy,
   if (context == NULL)
     return NULL;
 
-  overrides = flatpak_deploy_get_overrides (deploy);
+  overrides = flatpak_deploy_get_overrides (deploy, error);
+  if (overrides == NULL)
+    return NULL;
+
   flatpak_context_merge (context, overrides);
 
   return g_steal_pointer (&context);
@@ -2807,8 +3242,65 @@ add_ld_so_conf (FlatpakBwrap *bwrap,
     "/app/lib\n"
     "include /run/flatpak/ld.so.conf.d/runtime-*.conf\n";
 
-  return flatpak_bwrap_add_args_data (bwrap, "ld-so-conf",
-                                      contents, -1, "/etc/ld.so.conf", error);
+  return flatpak_bwrap_add_args_static_data (bwrap, "ld-so-conf",
+                                             contents, -1, "/etc/ld.so.conf", error);
+}
+
+/* The ld.so.cache only depends on the app if it ships libraries in the
+ * places ldconfig looks at, or has extensions that do. Apps that don't can
+ * share the cache of their runtime with every other such app. */
+static gboolean
+app_affects_ld_cache (int      app_fd,
+                      gboolean app_extensions_affect_ld_cache)
+{
+  const char *paths[] = { "lib", "lib64", "etc/ld.so.conf" };
+  gsize i;
+
+  if (app_extensions_affect_ld_cache)
+    return TRUE;
+
+  for (i = 0; i < G_N_ELEMENTS (paths); i++)
+    {
+      if (!glnx_fstatat_allow_noent (app_fd, paths[i], NULL, AT_SYMLINK_NOFOLLOW, NULL) ||
+          errno != ENOENT)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+#define SHARED_LD_CACHE_MAX_AGE_SECS (30 * 24 * 60 * 60)
+
+/* Shared caches are touched whenever they are used, so the ones that
+ * haven't been for a while belong to runtimes that are gone */
+static void
+prune_shared_ld_caches (GFile *ld_so_dir)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, flatpak_file_get_path_cached (ld_so_dir),
+                                    FALSE, &iter, NULL))
+    return;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, NULL) || dent == NULL)
+        break;
+
+      if (!glnx_fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, NULL) ||
+          !S_ISREG (stbuf.st_mode))
+        continue;
+
+      if (now - stbuf.st_mtime > SHARED_LD_CACHE_MAX_AGE_SECS)
+        {
+          g_info ("Removing unused ld.so.cache %s", dent->d_name);
+          (void) unlinkat (iter.fd, dent->d_name, 0);
+        }
+    }
 }
 
 static int
@@ -2816,6 +3308,7 @@ regenerate_ld_cache (GPtrArray    *base_argv_array,
                      GArray       *base_fd_array,
                      GFile        *app_id_dir,
                      const char   *checksum,
+                     gboolean      shared,
                      int           runtime_fd,
                      gboolean      generate_ld_so_conf,
                      GCancellable *cancellable,
@@ -2829,11 +3322,18 @@ regenerate_ld_cache (GPtrArray    *base_argv_array,
   g_autofree char *tmp_basename = NULL;
   g_auto(GStrv) minimal_envp = NULL;
   g_autofree char *commandline = NULL;
-  int exit_status;
+  int exit_status = 0;
+  gboolean spawned;
   glnx_autofd int ld_so_fd = -1;
   g_autoptr(GFile) ld_so_dir = NULL;
 
-  if (app_id_dir)
+  if (shared)
+    {
+      /* Other apps load this, so it must not be writable by any of them */
+      g_autofree char *shared_dir = flatpak_get_user_private_cache_dir ("ld.so.shared");
+      ld_so_dir = g_file_new_for_path (shared_dir);
+    }
+  else if (app_id_dir)
     ld_so_dir = g_file_get_child (app_id_dir, ".ld.so");
   else
     {
@@ -2844,7 +3344,11 @@ regenerate_ld_cache (GPtrArray    *base_argv_array,
   ld_so_cache = g_file_get_child (ld_so_dir, checksum);
   ld_so_fd = open (flatpak_file_get_path_cached (ld_so_cache), O_RDONLY);
   if (ld_so_fd >= 0)
-    return g_steal_fd (&ld_so_fd);
+    {
+      if (shared)
+        (void) futimens (ld_so_fd, NULL);
+      return g_steal_fd (&ld_so_fd);
+    }
 
   g_info ("Regenerating ld.so.cache %s", flatpak_file_get_path_cached (ld_so_cache));
 
@@ -2900,16 +3404,22 @@ regenerate_ld_cache (GPtrArray    *base_argv_array,
   g_array_append_vals (combined_fd_array, base_fd_array->data, base_fd_array->len);
   g_array_append_vals (combined_fd_array, bwrap->fds->data, bwrap->fds->len);
 
+  FLATPAK_TRACE2 (ld_cache_start, checksum, shared);
+
   /* We use LEAVE_DESCRIPTORS_OPEN and close them in the child_setup
    * to work around a deadlock in GLib < 2.60 */
-  if (!g_spawn_sync (NULL,
-                     (char **) bwrap->argv->pdata,
-                     bwrap->envp,
-                     G_SPAWN_SEARCH_PATH | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
-                     flatpak_bwrap_child_setup_cb, combined_fd_array,
-                     NULL, NULL,
-                     &exit_status,
-                     error))
+  spawned = g_spawn_sync (NULL,
+                          (char **) bwrap->argv->pdata,
+                          bwrap->envp,
+                          G_SPAWN_SEARCH_PATH | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
+                          flatpak_bwrap_child_setup_cb, combined_fd_array,
+                          NULL, NULL,
+                          &exit_status,
+                          error);
+
+  FLATPAK_TRACE2 (ld_cache_done, checksum, exit_status);
+
+  if (!spawned)
     return -1;
 
   if (!WIFEXITED (exit_status) || WEXITSTATUS (exit_status) != 0)
@@ -2926,7 +3436,18 @@ regenerate_ld_cache (GPtrArray    *base_argv_array,
       return -1;
     }
 
-  if (app_id_dir == NULL)
+  if (shared)
+    {
+      /* Rename to known name, possibly overwriting existing one if race */
+      if (rename (flatpak_file_get_path_cached (ld_so_cache_tmp), flatpak_file_get_path_cached (ld_so_cache)) == -1)
+        {
+          glnx_set_error_from_errno (error);
+          return -1;
+        }
+
+      prune_shared_ld_caches (ld_so_dir);
+    }
+  else if (app_id_dir == NULL)
     {
       /* For runs without an app id dir we always regenerate the ld.so.cache */
       unlink (flatpak_file_get_path_cached (ld_so_cache_tmp));
@@ -3146,11 +3667,12 @@ flatpak_run_app (FlatpakDecomposed   *app_ref,
   g_autofree char *instance_id_host_private_dir = NULL;
   g_autofree char *instance_id = NULL;
   g_autoptr(FlatpakContext) app_context = NULL;
-  g_autoptr(FlatpakContext) overrides = NULL;
   g_autoptr(FlatpakExports) exports = NULL;
   g_autofree char *commandline = NULL;
   g_autofree char *doc_mount_path = NULL;
+  g_autoptr(FlatpakRunRequests) requests = NULL;
   g_autofree char *app_extensions = NULL;
+  gboolean app_extensions_affect_ld_cache = FALSE;
   g_autofree char *runtime_extensions = NULL;
   g_autofree char *runtime_ld_path = NULL;
   g_autofree char *checksum = NULL;
@@ -3206,6 +3728,21 @@ flatpak_run_app (FlatpakDecomposed   *app_ref,
                                  "Use `sudo -i` or `su -l` instead and invoke \"flatpak run\" from "
                                  "inside the new shell."));
 
+  /* Batch jobs and containers often have no session at all, don't spend
+   * time trying to reach the services that would be on it */
+  if ((flags & FLATPAK_RUN_FLAG_HEADLESS) == 0 &&
+      !flatpak_run_has_session_bus ())
+    {
+      g_info ("No session bus, running headless");
+      flags |= FLATPAK_RUN_FLAG_HEADLESS;
+    }
+
+  if (flags & FLATPAK_RUN_FLAG_HEADLESS)
+    flags |= (FLATPAK_RUN_FLAG_NO_SESSION_HELPER |
+              FLATPAK_RUN_FLAG_NO_DOCUMENTS_PORTAL |
+              FLATPAK_RUN_FLAG_NO_SESSION_BUS_PROXY |
+              FLATPAK_RUN_FLAG_NO_A11Y_BUS_PROXY);
+
   app_id = flatpak_decomposed_dup_id (app_ref);
   g_return_val_if_fail (app_id != NULL, FALSE);
   app_arch = flatpak_decomposed_dup_arch (app_ref);
@@ -3298,16 +3835,12 @@ flatpak_run_app (FlatpakDecomposed   *app_ref,
 
   runtime_metakey = flatpak_deploy_get_metadata (runtime_deploy);
 
-  app_context = flatpak_app_compute_permissions (metakey, runtime_metakey, error);
+  app_context = compute_app_context (app_ref, app_deploy, app_deploy_data, metakey,
+                                     runtime_ref, runtime_deploy_data, runtime_metakey,
+                                     error);
   if (app_context == NULL)
     return FALSE;
 
-  if (app_deploy != NULL)
-    {
-      overrides = flatpak_deploy_get_overrides (app_deploy);
-      flatpak_context_merge (app_context, overrides);
-    }
-
   if (sandboxed)
     {
       flatpak_context_make_sandboxed (app_context);
@@ -3322,6 +3855,16 @@ flatpak_run_app (FlatpakDecomposed   *app_ref,
 
   flatpak_context_dump (app_context, "Final context");
 
+  /* Ask the session services for what we need from them now, so that
+   * they can answer while we set up the rest */
+  if ((flags & FLATPAK_RUN_FLAG_PREPARE_ONLY) == 0)
+    requests = flatpak_run_requests_new ((flags & (FLATPAK_RUN_FLAG_WRITABLE_ETC |
+                                                   FLATPAK_RUN_FLAG_NO_SESSION_HELPER)) == 0,
+                                         !sandboxed &&
+                                         (flags & FLATPAK_RUN_FLAG_NO_DOCUMENTS_PORTAL) == 0);
+
+  flatpak_startup_profile_mark ("context");
+
   shares = flatpak_run_compute_allowed_shares (app_context);
   devices = flatpak_run_compute_allowed_devices (app_context);
   sockets = flatpak_run_compute_allowed_sockets (app_context);
@@ -3632,15 +4175,18 @@ flatpak_run_app (FlatpakDecomposed   *app_ref,
       !flatpak_run_add_extension_args (bwrap, metakey, app_ref,
                                        use_ld_so_cache, original_app_target_path,
                                        &app_extensions, &app_ld_path,
+                                       &app_extensions_affect_ld_cache,
                                        cancellable, error))
     return FALSE;
 
   if (!flatpak_run_add_extension_args (bwrap, runtime_metakey, runtime_ref,
                                        use_ld_so_cache, original_runtime_target_path,
-                                       &runtime_extensions, &runtime_ld_path,
+                                       &runtime_extensions, &runtime_ld_path, NULL,
                                        cancellable, error))
     return FALSE;
 
+  flatpak_startup_profile_mark ("extensions");
+
   if (runtime_fd == original_runtime_fd)
     flatpak_run_extend_ld_path (bwrap, NULL, runtime_ld_path);
 
@@ -3666,12 +4212,22 @@ flatpak_run_app (FlatpakDecomposed   *app_ref,
      We can reuse this to generate the ld.so.cache (if needed) */
   if (use_ld_so_cache)
     {
-      checksum = calculate_ld_cache_checksum (app_deploy_data, runtime_deploy_data,
-                                              app_extensions, runtime_extensions);
+      gboolean shared_ld_cache = FALSE;
+
+      if (app_id_dir != NULL)
+        shared_ld_cache = app_fd < 0 || !app_affects_ld_cache (app_fd, app_extensions_affect_ld_cache);
+
+      if (shared_ld_cache)
+        checksum = calculate_ld_cache_checksum (NULL, runtime_deploy_data,
+                                                NULL, runtime_extensions);
+      else
+        checksum = calculate_ld_cache_checksum (app_deploy_data, runtime_deploy_data,
+                                                app_extensions, runtime_extensions);
       ld_so_fd = regenerate_ld_cache (bwrap->argv,
                                       bwrap->fds,
                                       app_id_dir,
                                       checksum,
+                                      shared_ld_cache,
                                       runtime_fd,
                                       generate_ld_so_conf,
                                       cancellable, error);
@@ -3680,6 +4236,13 @@ flatpak_run_app (FlatpakDecomposed   *app_ref,
       flatpak_bwrap_add_fd (bwrap, ld_so_fd);
     }
 
+  flatpak_startup_profile_mark ("ld-cache");
+
+  /* Used to warm the per-app caches after an update, without starting
+   * anything */
+  if (flags & FLATPAK_RUN_FLAG_PREPARE_ONLY)
+    return TRUE;
+
   flags |= flatpak_context_features_to_run_flags (features);
 
   if (!flatpak_run_setup_base_argv (bwrap, runtime_fd, app_id_dir, app_arch, flags, error))
@@ -3718,6 +4281,8 @@ flatpak_run_app (FlatpakDecomposed   *app_ref,
                                  error))
     return FALSE;
 
+  flatpak_startup_profile_mark ("instance");
+
   if (!sandboxed)
     {
       if (!flatpak_instance_ensure_per_app_dir (app_id,
@@ -3740,15 +4305,19 @@ flatpak_run_app (FlatpakDecomposed   *app_ref,
   if (!flatpak_run_add_dconf_args (bwrap, app_id, metakey, error))
     return FALSE;
 
+  flatpak_startup_profile_mark ("dconf");
+
   if (!sandboxed && !(flags & FLATPAK_RUN_FLAG_NO_DOCUMENTS_PORTAL))
-    add_document_portal_args (bwrap, app_id, &doc_mount_path);
+    add_document_portal_args (bwrap, app_id, requests, &doc_mount_path);
+
+  flatpak_startup_profile_mark ("document-portal");
 
   if (!flatpak_run_add_environment_args (bwrap, app_info_path, flags,
                                          app_id, app_context,
                                          shares, devices, sockets, features,
                                          app_id_dir, previous_app_id_dirs,
                                          per_app_dir_lock_fd, instance_id,
-                                         &exports, cancellable, error))
+                                         requests, &exports, cancellable, error))
     return FALSE;
 
   if (per_app_dir_lock_path != NULL)
@@ -3874,11 +4443,23 @@ flatpak_run_app (FlatpakDecomposed   *app_ref,
   /* Hold onto the lock until we execute bwrap */
   flatpak_bwrap_add_noinherit_fd (bwrap, g_steal_fd (&per_app_dir_lock_fd));
 
+  flatpak_startup_profile_mark ("sandbox-setup");
+
+  if (!flatpak_run_wait_dbus_proxy (bwrap, error))
+    return FALSE;
+
+  flatpak_startup_profile_mark ("dbus-proxy");
+
   flatpak_bwrap_finish (bwrap);
 
   commandline = flatpak_quote_argv ((const char **) bwrap->argv->pdata, -1);
   g_info ("Running '%s'", commandline);
 
+  flatpak_startup_profile_mark ("bwrap-exec");
+  flatpak_startup_profile_write (app_id);
+
+  FLATPAK_TRACE2 (bwrap_exec, app_id, bwrap->argv->len);
+
   if ((flags & (FLATPAK_RUN_FLAG_BACKGROUND)) != 0 ||
       g_getenv ("FLATPAK_TEST_COVERAGE") != NULL)
     {
@@ -0,0 +1,60 @@
+/*
+ * Copyright © 2025 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_TRACE_PRIVATE_H__
+#define __FLATPAK_TRACE_PRIVATE_H__
+
+/* Static (USDT) tracepoints in the "flatpak" provider, for use with
+ * e.g. bpftrace or perf:
+ *
+ *   bpftrace -e 'usdt:/usr/lib64/libflatpak.so.0:flatpak:op_done { ... }'
+ *
+ * Probes are compiled to a nop when nothing is attached, and to nothing
+ * at all when sys/sdt.h is not available. Arguments are evaluated even
+ * when nothing is attached, so keep them cheap.
+ *
+ * The probes are:
+ *
+ *   startup_phase (phase)                      flatpak run startup profile marks
+ *   bwrap_exec (app_id, argc)                  flatpak run, just before bwrap starts
+ *   ld_cache_start (checksum, shared)          regenerating ld.so.cache
+ *   ld_cache_done (checksum, wait_status)
+ *   op_start (ref, kind)                       each transaction operation
+ *   op_done (ref, kind, success)
+ *   http_request_start (uri)                   each HTTP request attempt
+ *   http_request_done (uri, success, bytes)
+ *   oci_layer_start (digest)                   each OCI layer fetch
+ *   oci_layer_done (digest, success, bytes)
+ *   checkout_start (ref, commit)               the checkout when deploying
+ *   checkout_done (ref, commit)                (only on success)
+ *   trigger_start (name)                       each trigger that runs
+ *   trigger_done (name, wait_status)
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define FLATPAK_TRACE1(name, a1) DTRACE_PROBE1 (flatpak, name, a1)
+#define FLATPAK_TRACE2(name, a1, a2) DTRACE_PROBE2 (flatpak, name, a1, a2)
+#define FLATPAK_TRACE3(name, a1, a2, a3) DTRACE_PROBE3 (flatpak, name, a1, a2, a3)
+#else
+#define FLATPAK_TRACE1(name, a1) do { } while (0)
+#define FLATPAK_TRACE2(name, a1, a2) do { } while (0)
+#define FLATPAK_TRACE3(name, a1, a2, a3) do { } while (0)
+#endif
+
+#endif /* __FLATPAK_TRACE_PRIVATE_H__ */
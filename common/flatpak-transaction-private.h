@@ -32,6 +32,10 @@ FlatpakRemoteState *flatpak_transaction_ensure_remote_state (FlatpakTransaction
 
 FlatpakDecomposed * flatpak_transaction_operation_get_decomposed (FlatpakTransactionOperation *self);
 
+gboolean flatpak_transaction_resolve_for_update_check (FlatpakTransaction *self,
+                                                       GCancellable       *cancellable,
+                                                       GError            **error);
+
 #include "flatpak-dir-private.h"
 
 #endif /* __FLATPAK_TRANSACTION_PRIVATE_H__ */
@@ -21,17 +21,23 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <glib/gi18n-lib.h>
+#include <gobject/gvaluecollector.h>
 
 #include "flatpak-auth-private.h"
 #include "flatpak-dir-private.h"
+#include "flatpak-dir-utils-private.h"
 #include "flatpak-error.h"
 #include "flatpak-image-collection-private.h"
 #include "flatpak-image-source-private.h"
 #include "flatpak-installation-private.h"
+#include "flatpak-metadata-private.h"
 #include "flatpak-oci-registry-private.h"
 #include "flatpak-progress-private.h"
 #include "flatpak-repo-utils-private.h"
+#include "flatpak-trace-private.h"
 #include "flatpak-transaction-private.h"
 #include "flatpak-utils-http-private.h"
 #include "flatpak-utils-private.h"
@@ -116,6 +122,11 @@ struct _FlatpakTransactionOperation
   gboolean                        update_only_deploy;
   gboolean                        pin_on_deploy;
   gboolean                        update_preinstalled_on_deploy;
+  gboolean                        prefetched; /* Pulled ahead of time, only the deploy is left */
+  gboolean                        prefetch_pending; /* Protected by prefetch_lock */
+  GVariant                       *prefetch_metrics; /* Protected by prefetch_lock */
+  gboolean                        done;
+  GVariant                       *metrics;
 
   gboolean                        resolved;
   char                           *resolved_commit;
@@ -170,7 +181,7 @@ typedef struct _FlatpakTransactionPrivate
 
   FlatpakInstallation         *installation;
   FlatpakDir                  *dir;
-  GHashTable                  *last_op_for_ref;
+  GHashTable                  *ops_for_ref; /* FlatpakDecomposed -> GPtrArray of ops, in the order added */
   GHashTable                  *remote_states; /* (element-type utf8 FlatpakRemoteState) */
   GPtrArray                   *extra_dependency_dirs;
   GPtrArray                   *extra_sideload_repos;
@@ -194,6 +205,7 @@ typedef struct _FlatpakTransactionPrivate
   gboolean                     disable_auto_pin;
   gboolean                     disable_static_deltas;
   gboolean                     disable_prune;
+  gboolean                     disable_triggers;
   gboolean                     disable_deps;
   gboolean                     disable_related;
   gboolean                     reinstall;
@@ -204,9 +216,21 @@ typedef struct _FlatpakTransactionPrivate
   gboolean                     auto_install_debug;
   char                        *default_arch;
   guint                        max_op;
+  guint                        max_parallel_ops;
+  gboolean                     pipelined;
+  gboolean                     batch_pulls;
+  gboolean                     prefer_small_downloads;
+  guint64                      max_download_rate;
+  gboolean                     background_priority;
+  gboolean                     prepare_launches;
+  GMutex                       prefetch_lock;
+  GCond                        prefetch_cond;
 
   gboolean                     needs_resolve;
   gboolean                     needs_tokens;
+  gboolean                     update_check; /* Only resolving, never running or authenticating */
+
+  GMainContext                *emit_context; /* The caller's context when run asynchronously */
 } FlatpakTransactionPrivate;
 
 enum {
@@ -236,6 +260,14 @@ struct _FlatpakTransactionProgress
   GObject              parent;
 
   FlatpakProgress     *progress_obj;
+  GMainContext        *emit_context;
+
+  /* If set, ::changed is only emitted when the progress moved this much */
+  guint                progress_step;
+  guint64              bytes_step;
+  guint                last_emitted_progress;
+  guint64              last_emitted_bytes;
+  gboolean             last_emitted_estimating;
 };
 
 enum {
@@ -243,6 +275,115 @@ enum {
   LAST_PROGRESS_SIGNAL
 };
 
+typedef struct
+{
+  GValue  *instance_and_params;
+  guint    signal_id;
+  GValue  *return_value;
+  GMutex   lock;
+  GCond    cond;
+  gboolean done;
+} EmitData;
+
+static gboolean
+emit_in_context_cb (gpointer user_data)
+{
+  EmitData *data = user_data;
+
+  g_signal_emitv (data->instance_and_params, data->signal_id, 0, data->return_value);
+
+  g_mutex_lock (&data->lock);
+  data->done = TRUE;
+  g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Like g_signal_emit_valist(), but if @context is set and not owned by the
+ * current thread, the handlers are called in @context, waiting for them to
+ * return. This is used to call the handlers in the caller's main context for
+ * transactions run with flatpak_transaction_run_async(). */
+static void
+emit_signal_valist (gpointer      instance,
+                    GMainContext *context,
+                    guint         signal_id,
+                    va_list       var_args)
+{
+  GSignalQuery query;
+  g_autofree GValue *instance_and_params = NULL;
+  GValue return_value = G_VALUE_INIT;
+  GType return_type;
+  EmitData data = { 0, };
+  guint i;
+
+  if (context == NULL || g_main_context_is_owner (context))
+    {
+      g_signal_emit_valist (instance, signal_id, 0, var_args);
+      return;
+    }
+
+  g_signal_query (signal_id, &query);
+
+  instance_and_params = g_new0 (GValue, query.n_params + 1);
+  g_value_init_from_instance (&instance_and_params[0], instance);
+  for (i = 0; i < query.n_params; i++)
+    {
+      g_autofree char *collect_error = NULL;
+      GType type = query.param_types[i] & ~G_SIGNAL_TYPE_STATIC_SCOPE;
+
+      G_VALUE_COLLECT_INIT (&instance_and_params[i + 1], type, var_args, 0, &collect_error);
+      if (collect_error != NULL)
+        g_error ("%s: %s", G_STRFUNC, collect_error);
+    }
+
+  return_type = query.return_type & ~G_SIGNAL_TYPE_STATIC_SCOPE;
+  if (return_type != G_TYPE_NONE)
+    g_value_init (&return_value, return_type);
+
+  data.instance_and_params = instance_and_params;
+  data.signal_id = signal_id;
+  data.return_value = return_type != G_TYPE_NONE ? &return_value : NULL;
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+
+  g_main_context_invoke (context, emit_in_context_cb, &data);
+
+  g_mutex_lock (&data.lock);
+  while (!data.done)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+
+  if (return_type != G_TYPE_NONE)
+    {
+      g_autofree char *lcopy_error = NULL;
+
+      G_VALUE_LCOPY (&return_value, var_args, 0, &lcopy_error);
+      if (lcopy_error != NULL)
+        g_error ("%s: %s", G_STRFUNC, lcopy_error);
+      g_value_unset (&return_value);
+    }
+
+  for (i = 0; i < query.n_params + 1; i++)
+    g_value_unset (&instance_and_params[i]);
+}
+
+static void
+emit_signal (gpointer      instance,
+             GMainContext *context,
+             guint         signal_id,
+             ...)
+{
+  va_list var_args;
+
+  va_start (var_args, signal_id);
+  emit_signal_valist (instance, context, signal_id, var_args);
+  va_end (var_args);
+}
+
 static gboolean op_may_need_token (FlatpakTransactionOperation *op);
 
 static void flatpak_transaction_normalize_ops (FlatpakTransaction *self);
@@ -411,12 +552,36 @@ flatpak_transaction_progress_get_bytes_per_second (FlatpakTransactionProgress *s
   return flatpak_progress_get_bytes_per_second (self->progress_obj);
 }
 
+/**
+ * flatpak_transaction_progress_set_thresholds:
+ * @self: a #FlatpakTransactionProgress
+ * @progress_step: emit ::changed when the progress grew by this many percent, or 0
+ * @bytes_step: emit ::changed when this many more bytes were transferred, or 0
+ *
+ * Limits how often #FlatpakTransactionProgress::changed is emitted to
+ * when the progress crossed one of the given thresholds since the last
+ * emission, or when the estimating state changed. If both are 0, which
+ * is the default, the signal is emitted on every update (see
+ * flatpak_transaction_progress_set_update_frequency()).
+ *
+ * Since: 1.19.0
+ */
+void
+flatpak_transaction_progress_set_thresholds (FlatpakTransactionProgress *self,
+                                             guint                       progress_step,
+                                             guint64                     bytes_step)
+{
+  self->progress_step = progress_step;
+  self->bytes_step = bytes_step;
+}
+
 static void
 flatpak_transaction_progress_finalize (GObject *object)
 {
   FlatpakTransactionProgress *self = (FlatpakTransactionProgress *) object;
 
   g_object_unref (self->progress_obj);
+  g_clear_pointer (&self->emit_context, g_main_context_unref);
 
   G_OBJECT_CLASS (flatpak_transaction_progress_parent_class)->finalize (object);
 }
@@ -452,14 +617,41 @@ got_progress_cb (const char *status,
 {
   FlatpakTransactionProgress *p = user_data;
 
-  if (!flatpak_progress_is_done (p->progress_obj))
-    g_signal_emit (p, progress_signals[CHANGED], 0);
+  if (flatpak_progress_is_done (p->progress_obj))
+    return;
+
+  /* Don't do any work if nobody is listening */
+  if (!g_signal_has_handler_pending (p, progress_signals[CHANGED], 0, TRUE))
+    return;
+
+  if (p->progress_step != 0 || p->bytes_step != 0)
+    {
+      guint64 bytes = flatpak_transaction_progress_get_bytes_transferred (p);
+      gboolean crossed = FALSE;
+
+      if (p->progress_step != 0 && progress >= p->last_emitted_progress + p->progress_step)
+        crossed = TRUE;
+      if (p->bytes_step != 0 && bytes >= p->last_emitted_bytes + p->bytes_step)
+        crossed = TRUE;
+
+      if (!crossed && progress != 100 && estimating == p->last_emitted_estimating)
+        return;
+
+      p->last_emitted_progress = progress;
+      p->last_emitted_bytes = bytes;
+      p->last_emitted_estimating = estimating;
+    }
+
+  emit_signal (p, p->emit_context, progress_signals[CHANGED]);
 }
 
 static void
 flatpak_transaction_progress_init (FlatpakTransactionProgress *self)
 {
   self->progress_obj = flatpak_progress_new (got_progress_cb, self);
+  /* The status is only formatted if someone asks for it */
+  flatpak_progress_set_lazy_status (self->progress_obj, TRUE);
+  self->last_emitted_estimating = TRUE;
 }
 
 static void
@@ -482,6 +674,19 @@ G_DEFINE_TYPE_WITH_CODE (FlatpakTransaction, flatpak_transaction, G_TYPE_OBJECT,
                          G_ADD_PRIVATE (FlatpakTransaction)
                          G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE, initable_iface_init))
 
+static void
+transaction_emit (FlatpakTransaction *self,
+                  guint               signal_id,
+                  ...)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  va_list var_args;
+
+  va_start (var_args, signal_id);
+  emit_signal_valist (self, priv->emit_context, signal_id, var_args);
+  va_end (var_args);
+}
+
 static gboolean
 transaction_is_local_only (FlatpakTransaction             *self,
                            FlatpakTransactionOperationType kind)
@@ -690,6 +895,8 @@ flatpak_transaction_operation_finalize (GObject *object)
   g_clear_pointer (&self->run_before_ops, g_list_free);
   g_clear_pointer (&self->related_to_ops, g_ptr_array_unref);
   g_clear_pointer (&self->summary_metadata, g_variant_unref);
+  g_clear_pointer (&self->prefetch_metrics, g_variant_unref);
+  g_clear_pointer (&self->metrics, g_variant_unref);
   g_clear_object (&self->image_source);
   g_clear_object (&self->resolved_image_source);
 
@@ -1039,6 +1246,38 @@ flatpak_transaction_operation_get_requires_authentication (FlatpakTransactionOpe
     !self->requested_token;
 }
 
+/**
+ * flatpak_transaction_operation_get_metrics:
+ * @self: a #FlatpakTransactionOperation
+ *
+ * Gets performance metrics for the operation, once it is done. This is
+ * a dictionary (`a{sv}`) with the following keys:
+ *
+ * - `duration-usec` (`t`): how long the operation took, in microseconds
+ * - `source` (`s`): where the data was pulled from, one of `remote`,
+ *   `sideload`, `oci`, `bundle` or `none`
+ * - `bytes-transferred` (`t`): the number of bytes downloaded
+ * - `delta-bytes` (`t`): the number of bytes of static deltas downloaded
+ * - `delta-parts-fetched` (`u`): the number of static delta parts downloaded
+ * - `objects-fetched` (`u`): the number of objects downloaded
+ * - `metadata-fetched` (`u`): the number of metadata objects downloaded
+ * - `extra-data-bytes` (`t`): the number of bytes of extra data downloaded
+ *
+ * The download counters are missing if nothing was pulled, or if the
+ * data was pulled together with other operations. More keys may be
+ * added in the future. The same values are logged to the journal when
+ * the data is pulled.
+ *
+ * Returns: (transfer none) (nullable): the metrics, or %NULL if the
+ *   operation is not done
+ * Since: 1.19.0
+ */
+GVariant *
+flatpak_transaction_operation_get_metrics (FlatpakTransactionOperation *self)
+{
+  return self->metrics;
+}
+
 /**
  * flatpak_transaction_is_empty:
  * @self: a #FlatpakTransaction
@@ -1071,13 +1310,14 @@ flatpak_transaction_finalize (GObject *object)
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
 
   g_clear_object (&priv->installation);
+  g_clear_pointer (&priv->emit_context, g_main_context_unref);
 
   g_free (priv->parent_window);
   g_list_free_full (priv->flatpakrefs, (GDestroyNotify) g_key_file_unref);
   g_list_free_full (priv->bundles, (GDestroyNotify) bundle_data_free);
   g_list_free_full (priv->images, (GDestroyNotify) image_data_free);
   g_free (priv->default_arch);
-  g_hash_table_unref (priv->last_op_for_ref);
+  g_hash_table_unref (priv->ops_for_ref);
   g_hash_table_unref (priv->remote_states);
   g_list_free_full (priv->ops, (GDestroyNotify) g_object_unref);
   g_clear_object (&priv->dir);
@@ -1088,6 +1328,9 @@ flatpak_transaction_finalize (GObject *object)
   g_ptr_array_free (priv->extra_sideload_repos, TRUE);
   g_ptr_array_free (priv->sideload_image_collections, TRUE);
 
+  g_mutex_clear (&priv->prefetch_lock);
+  g_cond_clear (&priv->prefetch_cond);
+
   G_OBJECT_CLASS (flatpak_transaction_parent_class)->finalize (object);
 }
 
@@ -1557,13 +1800,16 @@ flatpak_transaction_init (FlatpakTransaction *self)
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
 
-  priv->last_op_for_ref = g_hash_table_new_full ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal, (GDestroyNotify) flatpak_decomposed_unref, NULL);
+  priv->ops_for_ref = g_hash_table_new_full ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal, (GDestroyNotify) flatpak_decomposed_unref, (GDestroyNotify) g_ptr_array_unref);
   priv->remote_states = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) flatpak_remote_state_unref);
   priv->added_origin_remotes = g_ptr_array_new_with_free_func (g_free);
   priv->extra_dependency_dirs = g_ptr_array_new_with_free_func (g_object_unref);
   priv->extra_sideload_repos = g_ptr_array_new_with_free_func (g_free);
   priv->sideload_image_collections = g_ptr_array_new_with_free_func (g_object_unref);
   priv->can_run = TRUE;
+  priv->max_parallel_ops = 1;
+  g_mutex_init (&priv->prefetch_lock);
+  g_cond_init (&priv->prefetch_cond);
 }
 
 
@@ -1774,6 +2020,28 @@ flatpak_transaction_set_disable_prune (FlatpakTransaction *self,
   priv->disable_prune = disable_prune;
 }
 
+/**
+ * flatpak_transaction_set_disable_triggers:
+ * @self: a #FlatpakTransaction
+ * @disable_triggers: whether to avoid running triggers
+ *
+ * Sets whether the transaction should avoid running the triggers after
+ * deploying or uninstalling. If set, the caller must later call
+ * flatpak_installation_run_triggers() to update the exported files.
+ * This lets callers that run several transactions back to back only
+ * run the triggers once.
+ *
+ * Since: 1.19.0
+ */
+void
+flatpak_transaction_set_disable_triggers (FlatpakTransaction *self,
+                                          gboolean            disable_triggers)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  priv->disable_triggers = disable_triggers;
+}
+
 /**
  * flatpak_transaction_set_disable_auto_pin:
  * @self: a #FlatpakTransaction
@@ -2046,111 +2314,432 @@ flatpak_transaction_get_auto_install_debug (FlatpakTransaction *self)
   return priv->auto_install_debug;
 }
 
-static FlatpakTransactionOperation *
-flatpak_transaction_get_last_op_for_ref (FlatpakTransaction *self,
-                                         FlatpakDecomposed *ref)
+/**
+ * flatpak_transaction_set_max_parallel_ops:
+ * @self: a #FlatpakTransaction
+ * @max_parallel_ops: the maximum number of operations to pull at the same time
+ *
+ * Sets how many operations the transaction may download at the same time.
+ *
+ * When this is larger than 1, the transaction pulls the data for all the
+ * install and update operations that don't go through the system helper
+ * concurrently, using at most @max_parallel_ops threads, before running the
+ * operations. The operations themselves (and all signals) are still
+ * deployed one at a time in the usual order, so dependencies are respected,
+ * and a concurrent prune cannot remove the pulled objects because each pull
+ * holds the repo lock in shared mode.
+ *
+ * The default is 1, which pulls each operation right before deploying it.
+ * A value of 0 is treated as 1.
+ *
+ * See also flatpak_transaction_set_pipelined(), which lets the deploys
+ * start before all the pulls are done.
+ *
+ * Since: 1.19.0
+ */
+void
+flatpak_transaction_set_max_parallel_ops (FlatpakTransaction *self,
+                                          guint               max_parallel_ops)
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
-  FlatpakTransactionOperation *op;
-
-  op = g_hash_table_lookup (priv->last_op_for_ref, ref);
 
-  return op;
+  priv->max_parallel_ops = MAX (max_parallel_ops, 1);
 }
 
-static char *
-subpaths_to_string (const char **subpaths)
+/**
+ * flatpak_transaction_get_max_parallel_ops:
+ * @self: a #FlatpakTransaction
+ *
+ * Gets the value set by flatpak_transaction_set_max_parallel_ops().
+ *
+ * Returns: the maximum number of operations pulled at the same time
+ *
+ * Since: 1.19.0
+ */
+guint
+flatpak_transaction_get_max_parallel_ops (FlatpakTransaction *self)
 {
-  GString *s = NULL;
-  int i;
-
-  if (subpaths == NULL)
-    return g_strdup ("[$old]");
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
 
-  if (*subpaths == 0)
-    return g_strdup ("[*]");
+  return priv->max_parallel_ops;
+}
 
-  s = g_string_new ("[");
-  for (i = 0; subpaths[i] != NULL; i++)
-    {
-      if (i != 0)
-        g_string_append (s, ", ");
-      g_string_append (s, subpaths[i]);
-    }
-  g_string_append (s, "]");
+/**
+ * flatpak_transaction_set_pipelined:
+ * @self: a #FlatpakTransaction
+ * @pipelined: whether to overlap pulls and deploys
+ *
+ * Sets whether the transaction should pull the data for the following
+ * operations while the current operation is being deployed.
+ *
+ * In pipelined mode, up to flatpak_transaction_get_max_parallel_ops()
+ * pulls run in the background in the order the operations will run, and
+ * each operation is deployed as soon as its own pull has finished, rather
+ * than waiting for all pulls to complete. This keeps the network busy
+ * while the (mostly disk bound) checkout of the previous operation
+ * happens.
+ *
+ * The same restrictions as for flatpak_transaction_set_max_parallel_ops()
+ * apply to which operations can be pulled ahead of time.
+ *
+ * Since: 1.19.0
+ */
+void
+flatpak_transaction_set_pipelined (FlatpakTransaction *self,
+                                   gboolean            pipelined)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
 
-  return g_string_free (s, FALSE);
+  priv->pipelined = pipelined;
 }
 
-static const char *
-kind_to_str (FlatpakTransactionOperationType kind)
+/**
+ * flatpak_transaction_get_pipelined:
+ * @self: a #FlatpakTransaction
+ *
+ * Gets the value set by flatpak_transaction_set_pipelined().
+ *
+ * Returns: %TRUE if pulls and deploys are overlapped, %FALSE otherwise
+ *
+ * Since: 1.19.0
+ */
+gboolean
+flatpak_transaction_get_pipelined (FlatpakTransaction *self)
 {
-  switch ((int) kind)
-    {
-    case FLATPAK_TRANSACTION_OPERATION_INSTALL:
-      return "install";
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
 
-    case FLATPAK_TRANSACTION_OPERATION_UPDATE:
-      return "update";
+  return priv->pipelined;
+}
 
-    case FLATPAK_TRANSACTION_OPERATION_INSTALL_OR_UPDATE:
-      return "install/update";
+/**
+ * flatpak_transaction_set_batch_pulls:
+ * @self: a #FlatpakTransaction
+ * @batch_pulls: whether to pull the refs from each remote in one go
+ *
+ * Sets whether the transaction should download the objects for all the
+ * refs it installs or updates from the same remote in a single pull, before
+ * running the operations.
+ *
+ * This lets objects that are shared between refs (for instance between
+ * runtimes and their extensions) be downloaded only once, and avoids
+ * setting up the connections and fetching the delta indexes again for each
+ * ref. The individual operations then find everything they need locally.
+ *
+ * Refs that use subpaths, sideload repos or authentication tokens, OCI
+ * remotes and operations going through the system helper are still pulled
+ * individually. Note that as the objects are not fetched per ref, the
+ * remote server will not see the usual per-ref request headers for the
+ * batched refs.
+ *
+ * Since: 1.19.0
+ */
+void
+flatpak_transaction_set_batch_pulls (FlatpakTransaction *self,
+                                     gboolean            batch_pulls)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
 
-    case FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE:
-      return "install bundle";
+  priv->batch_pulls = batch_pulls;
+}
 
-    case FLATPAK_TRANSACTION_OPERATION_UNINSTALL:
-      return "uninstall";
+/**
+ * flatpak_transaction_get_batch_pulls:
+ * @self: a #FlatpakTransaction
+ *
+ * Gets the value set by flatpak_transaction_set_batch_pulls().
+ *
+ * Returns: %TRUE if pulls are batched per remote, %FALSE otherwise
+ *
+ * Since: 1.19.0
+ */
+gboolean
+flatpak_transaction_get_batch_pulls (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
 
-    case FLATPAK_TRANSACTION_OPERATION_LAST_TYPE:
-    default:
-      return "unknown";
-    }
+  return priv->batch_pulls;
 }
 
-FlatpakRemoteState *
-flatpak_transaction_ensure_remote_state (FlatpakTransaction             *self,
-                                         FlatpakTransactionOperationType kind,
-                                         const char                     *remote,
-                                         const char                     *opt_arch,
-                                         GError                        **error)
+/**
+ * flatpak_transaction_set_prefer_small_downloads:
+ * @self: a #FlatpakTransaction
+ * @prefer_small_downloads: whether to run the smallest downloads first
+ *
+ * Sets whether operations that don't depend on each other should be run
+ * in order of increasing download size (as returned by
+ * flatpak_transaction_operation_get_download_size()), rather than in
+ * alphabetical order of their refs.
+ *
+ * This gets as many operations as possible done early, which is useful
+ * when running with a limited bandwidth or when the transaction may be
+ * interrupted. Dependencies are still run before the operations that need
+ * them, and related refs right after the operation that pulled them in.
+ *
+ * Since: 1.19.0
+ */
+void
+flatpak_transaction_set_prefer_small_downloads (FlatpakTransaction *self,
+                                                gboolean            prefer_small_downloads)
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
-  g_autoptr(FlatpakRemoteState) state = NULL;
-  FlatpakRemoteState *cached_state;
-
-  /* We don't cache local-only states, as we might later need the same state with non-local state */
-  if (transaction_is_local_only (self, kind))
-    return flatpak_dir_get_remote_state_local_only (priv->dir, remote, NULL, error);
 
-  cached_state = g_hash_table_lookup (priv->remote_states, remote);
-  if (cached_state)
-    state = flatpak_remote_state_ref (cached_state);
-  else
-    {
-      state = flatpak_dir_get_remote_state_optional (priv->dir, remote, FALSE, NULL, error);
-      if (state == NULL)
-        return NULL;
+  priv->prefer_small_downloads = prefer_small_downloads;
+}
 
-      g_hash_table_insert (priv->remote_states, state->remote_name, flatpak_remote_state_ref (state));
+/**
+ * flatpak_transaction_get_prefer_small_downloads:
+ * @self: a #FlatpakTransaction
+ *
+ * Gets the value set by flatpak_transaction_set_prefer_small_downloads().
+ *
+ * Returns: %TRUE if the smallest downloads are run first, %FALSE otherwise
+ *
+ * Since: 1.19.0
+ */
+gboolean
+flatpak_transaction_get_prefer_small_downloads (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
 
-      for (int i = 0; i < priv->extra_sideload_repos->len; i++)
-        {
-          const char *path = g_ptr_array_index (priv->extra_sideload_repos, i);
-          g_autoptr(GFile) f = g_file_new_for_path (path);
-          flatpak_remote_state_add_sideload_dir (state, f);
-        }
+  return priv->prefer_small_downloads;
+}
 
-      for (int i = 0; i < priv->sideload_image_collections->len; i++)
-        {
-          FlatpakImageCollection *collection = g_ptr_array_index (priv->sideload_image_collections, i);
-          flatpak_remote_state_add_sideload_image_collection (state, collection);
-        }
+/**
+ * flatpak_transaction_set_max_download_rate:
+ * @self: a #FlatpakTransaction
+ * @bytes_per_sec: the maximum download rate, or 0 for no limit
+ *
+ * Limits the rate at which each download done over HTTP by the
+ * transaction (OCI images, extra data, summaries and indexes) receives
+ * data. Note that this is a per-download limit, so when pulling several
+ * operations in parallel (see flatpak_transaction_set_max_parallel_ops())
+ * the total rate can be higher.
+ *
+ * OSTree pulls are not limited, as libostree has no support for this.
+ *
+ * The default is 0, which means no limit.
+ *
+ * Since: 1.19.0
+ */
+void
+flatpak_transaction_set_max_download_rate (FlatpakTransaction *self,
+                                           guint64             bytes_per_sec)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
 
-    }
+  priv->max_download_rate = bytes_per_sec;
+}
 
-  if (opt_arch != NULL &&
-      !flatpak_remote_state_ensure_subsummary (state, priv->dir, opt_arch, FALSE, NULL, error))
+/**
+ * flatpak_transaction_get_max_download_rate:
+ * @self: a #FlatpakTransaction
+ *
+ * Gets the value set by flatpak_transaction_set_max_download_rate().
+ *
+ * Returns: the maximum download rate in bytes per second, or 0 for no limit
+ *
+ * Since: 1.19.0
+ */
+guint64
+flatpak_transaction_get_max_download_rate (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  return priv->max_download_rate;
+}
+
+/**
+ * flatpak_transaction_set_background_priority:
+ * @self: a #FlatpakTransaction
+ * @background_priority: whether to deploy with background priority
+ *
+ * Sets whether the transaction should keep out of the way of the rest of
+ * the system. If this is %TRUE, the checkouts are done with idle I/O
+ * priority and the lowest CPU priority, and so are the triggers they run.
+ * This is meant for updates done in the background. Combine it with
+ * flatpak_transaction_set_max_download_rate() to also limit the network
+ * usage.
+ *
+ * The default is %FALSE.
+ *
+ * Since: 1.19.0
+ */
+void
+flatpak_transaction_set_background_priority (FlatpakTransaction *self,
+                                             gboolean            background_priority)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  priv->background_priority = background_priority;
+}
+
+/**
+ * flatpak_transaction_get_background_priority:
+ * @self: a #FlatpakTransaction
+ *
+ * Gets the value set by flatpak_transaction_set_background_priority().
+ *
+ * Returns: %TRUE if the transaction deploys with background priority
+ *
+ * Since: 1.19.0
+ */
+gboolean
+flatpak_transaction_get_background_priority (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  return priv->background_priority;
+}
+
+/**
+ * flatpak_transaction_set_prepare_launches:
+ * @self: a #FlatpakTransaction
+ * @prepare_launches: whether to prepare the launch of the affected apps
+ *
+ * Sets whether the transaction should prepare the first launch of the
+ * apps it updated, or whose runtime it updated, after it succeeded. If
+ * this is %TRUE, a few of the most recently used of those apps get their
+ * caches regenerated by a detached, low priority "flatpak run" process.
+ * Only apps in the installation of the transaction are considered.
+ *
+ * The default is %FALSE.
+ *
+ * Since: 1.19.0
+ */
+void
+flatpak_transaction_set_prepare_launches (FlatpakTransaction *self,
+                                          gboolean            prepare_launches)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  priv->prepare_launches = prepare_launches;
+}
+
+/**
+ * flatpak_transaction_get_prepare_launches:
+ * @self: a #FlatpakTransaction
+ *
+ * Gets the value set by flatpak_transaction_set_prepare_launches().
+ *
+ * Returns: %TRUE if the transaction prepares the launch of the affected apps
+ *
+ * Since: 1.19.0
+ */
+gboolean
+flatpak_transaction_get_prepare_launches (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  return priv->prepare_launches;
+}
+
+static FlatpakTransactionOperation *
+flatpak_transaction_get_last_op_for_ref (FlatpakTransaction *self,
+                                         FlatpakDecomposed *ref)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  GPtrArray *ops;
+
+  ops = g_hash_table_lookup (priv->ops_for_ref, ref);
+  if (ops == NULL)
+    return NULL;
+
+  return g_ptr_array_index (ops, ops->len - 1);
+}
+
+static char *
+subpaths_to_string (const char **subpaths)
+{
+  GString *s = NULL;
+  int i;
+
+  if (subpaths == NULL)
+    return g_strdup ("[$old]");
+
+  if (*subpaths == 0)
+    return g_strdup ("[*]");
+
+  s = g_string_new ("[");
+  for (i = 0; subpaths[i] != NULL; i++)
+    {
+      if (i != 0)
+        g_string_append (s, ", ");
+      g_string_append (s, subpaths[i]);
+    }
+  g_string_append (s, "]");
+
+  return g_string_free (s, FALSE);
+}
+
+static const char *
+kind_to_str (FlatpakTransactionOperationType kind)
+{
+  switch ((int) kind)
+    {
+    case FLATPAK_TRANSACTION_OPERATION_INSTALL:
+      return "install";
+
+    case FLATPAK_TRANSACTION_OPERATION_UPDATE:
+      return "update";
+
+    case FLATPAK_TRANSACTION_OPERATION_INSTALL_OR_UPDATE:
+      return "install/update";
+
+    case FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE:
+      return "install bundle";
+
+    case FLATPAK_TRANSACTION_OPERATION_UNINSTALL:
+      return "uninstall";
+
+    case FLATPAK_TRANSACTION_OPERATION_LAST_TYPE:
+    default:
+      return "unknown";
+    }
+}
+
+FlatpakRemoteState *
+flatpak_transaction_ensure_remote_state (FlatpakTransaction             *self,
+                                         FlatpakTransactionOperationType kind,
+                                         const char                     *remote,
+                                         const char                     *opt_arch,
+                                         GError                        **error)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(FlatpakRemoteState) state = NULL;
+  FlatpakRemoteState *cached_state;
+
+  /* We don't cache local-only states, as we might later need the same state with non-local state */
+  if (transaction_is_local_only (self, kind))
+    return flatpak_dir_get_remote_state_local_only (priv->dir, remote, NULL, error);
+
+  cached_state = g_hash_table_lookup (priv->remote_states, remote);
+  if (cached_state)
+    state = flatpak_remote_state_ref (cached_state);
+  else
+    {
+      state = flatpak_dir_get_remote_state_optional (priv->dir, remote, FALSE, NULL, error);
+      if (state == NULL)
+        return NULL;
+
+      g_hash_table_insert (priv->remote_states, state->remote_name, flatpak_remote_state_ref (state));
+
+      for (int i = 0; i < priv->extra_sideload_repos->len; i++)
+        {
+          const char *path = g_ptr_array_index (priv->extra_sideload_repos, i);
+          g_autoptr(GFile) f = g_file_new_for_path (path);
+          flatpak_remote_state_add_sideload_dir (state, f);
+        }
+
+      for (int i = 0; i < priv->sideload_image_collections->len; i++)
+        {
+          FlatpakImageCollection *collection = g_ptr_array_index (priv->sideload_image_collections, i);
+          flatpak_remote_state_add_sideload_image_collection (state, collection);
+        }
+
+    }
+
+  if (opt_arch != NULL &&
+      !flatpak_remote_state_ensure_subsummary (state, priv->dir, opt_arch, FALSE, NULL, error))
     return FALSE;
 
   return g_steal_pointer (&state);
@@ -2199,6 +2788,7 @@ flatpak_transaction_add_op (FlatpakTransaction             *self,
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
   FlatpakTransactionOperation *op;
+  GPtrArray *ref_ops;
   g_autofree char *subpaths_str = NULL;
 
   subpaths_str = subpaths_to_string (subpaths);
@@ -2227,7 +2817,13 @@ flatpak_transaction_add_op (FlatpakTransaction             *self,
   op = flatpak_transaction_operation_new (remote, ref, subpaths, previous_ids,
                                           commit, bundle, kind, pin_on_deploy,
                                           update_preinstalled_on_deploy);
-  g_hash_table_insert (priv->last_op_for_ref, flatpak_decomposed_ref (ref), op);
+  ref_ops = g_hash_table_lookup (priv->ops_for_ref, ref);
+  if (ref_ops == NULL)
+    {
+      ref_ops = g_ptr_array_new ();
+      g_hash_table_insert (priv->ops_for_ref, flatpak_decomposed_ref (ref), ref_ops);
+    }
+  g_ptr_array_add (ref_ops, op);
 
   priv->ops = g_list_prepend (priv->ops, op);
 
@@ -2516,7 +3112,7 @@ find_runtime_remote (FlatpakTransaction             *self,
   if (priv->no_pull && g_strv_length (found_remotes) == 1)
     res = 0;
   else
-    g_signal_emit (self, signals[CHOOSE_REMOTE_FOR_REF], 0, flatpak_decomposed_get_ref (app_ref), flatpak_decomposed_get_ref (runtime_ref), found_remotes, &res);
+    transaction_emit (self, signals[CHOOSE_REMOTE_FOR_REF], flatpak_decomposed_get_ref (app_ref), flatpak_decomposed_get_ref (runtime_ref), found_remotes, &res);
 
   if (res >= 0 && res < g_strv_length (found_remotes))
     return g_strdup (found_remotes[res]);
@@ -3476,7 +4072,13 @@ flatpak_transaction_add_auto_install (FlatpakTransaction *self,
 static void
 emit_new_op (FlatpakTransaction *self, FlatpakTransactionOperation *op, FlatpakTransactionProgress *progress)
 {
-  g_signal_emit (self, signals[NEW_OPERATION], 0, op, progress);
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  /* The progress is updated from the thread running the transaction */
+  if (priv->emit_context)
+    progress->emit_context = g_main_context_ref (priv->emit_context);
+
+  transaction_emit (self, signals[NEW_OPERATION], op, progress);
 }
 
 static void
@@ -3496,7 +4098,7 @@ emit_op_done (FlatpakTransaction          *self,
         commit = g_strdup (flatpak_deploy_data_get_commit (deploy_data));
     }
 
-  g_signal_emit (self, signals[OPERATION_DONE], 0, op, commit, details);
+  transaction_emit (self, signals[OPERATION_DONE], op, commit, details);
 }
 
 static GBytes *
@@ -3552,7 +4154,7 @@ emit_eol_and_maybe_skip (FlatpakTransaction          *self,
   id = flatpak_decomposed_dup_id (op->ref);
   previous_ids[0] = id;
 
-  g_signal_emit (self, signals[END_OF_LIFED_WITH_REBASE], 0, op->remote, flatpak_decomposed_get_ref (op->ref), op->eol, op->eol_rebase, previous_ids, &op->skip);
+  transaction_emit (self, signals[END_OF_LIFED_WITH_REBASE], op->remote, flatpak_decomposed_get_ref (op->ref), op->eol, op->eol_rebase, previous_ids, &op->skip);
 }
 
 static gboolean
@@ -3932,6 +4534,20 @@ resolve_ops (FlatpakTransaction *self,
                                                                   NULL, NULL, &local_error);
               if (commit_data == NULL)
                 {
+                  if (g_error_matches (local_error, FLATPAK_HTTP_ERROR, FLATPAK_HTTP_ERROR_UNAUTHORIZED) &&
+                      priv->update_check)
+                    {
+                      /* We know the commit, which is all an update check
+                       * needs, so don't ask for authentication. This means
+                       * we can't follow the dependencies of this op. */
+                      g_info ("Unauthorized access during update check of %s, not resolving metadata",
+                              flatpak_decomposed_get_ref (op->ref));
+                      g_clear_error (&local_error);
+                      if (!mark_op_resolved (op, checksum, sideload_path, image_source, NULL, NULL, error))
+                        return FALSE;
+                      continue;
+                    }
+
                   if (g_error_matches (local_error, FLATPAK_HTTP_ERROR, FLATPAK_HTTP_ERROR_UNAUTHORIZED) && !op->requested_token)
                     {
 
@@ -4022,7 +4638,7 @@ request_tokens_webflow (FlatpakAuthenticatorRequest *object,
   priv->active_request_id = ++priv->next_request_id;
 
   g_info ("Webflow start %s", arg_uri);
-  g_signal_emit (transaction, signals[WEBFLOW_START], 0, data->remote, arg_uri, options, priv->active_request_id, &retval);
+  transaction_emit (transaction, signals[WEBFLOW_START], data->remote, arg_uri, options, priv->active_request_id, &retval);
   if (!retval)
     {
       g_autoptr(GError) local_error = NULL;
@@ -4052,7 +4668,7 @@ request_tokens_webflow_done (FlatpakAuthenticatorRequest *object,
   priv->active_request_id = 0;
 
   g_info ("Webflow done");
-  g_signal_emit (transaction, signals[WEBFLOW_DONE], 0, options, id);
+  transaction_emit (transaction, signals[WEBFLOW_DONE], options, id);
 }
 
 static void
@@ -4072,7 +4688,7 @@ request_tokens_basic_auth (FlatpakAuthenticatorRequest *object,
   priv->active_request_id = ++priv->next_request_id;
 
   g_info ("BasicAuth start %s", arg_realm);
-  g_signal_emit (transaction, signals[BASIC_AUTH_START], 0, data->remote, arg_realm, options, priv->active_request_id, &retval);
+  transaction_emit (transaction, signals[BASIC_AUTH_START], data->remote, arg_realm, options, priv->active_request_id, &retval);
   if (!retval)
     {
       g_autoptr(GError) local_error = NULL;
@@ -4217,8 +4833,8 @@ request_tokens_for_remote (FlatpakTransaction *self,
       deploy = flatpak_dir_get_if_deployed (priv->dir, auto_install_ref, NULL, cancellable);
       if (deploy == NULL)
         {
-          g_signal_emit (self, signals[INSTALL_AUTHENTICATOR], 0,
-                         remote, flatpak_decomposed_get_ref (auto_install_ref));
+          transaction_emit (self, signals[INSTALL_AUTHENTICATOR],
+                            remote, flatpak_decomposed_get_ref (auto_install_ref));
           deploy = flatpak_dir_get_if_deployed (priv->dir, auto_install_ref, NULL, cancellable);
         }
       if (deploy == NULL)
@@ -4430,6 +5046,18 @@ compare_op_ref (FlatpakTransactionOperation *a, FlatpakTransactionOperation *b)
   return g_strcmp0 (aa, bb);
 }
 
+static int
+compare_op_download_size (FlatpakTransactionOperation *a, FlatpakTransactionOperation *b)
+{
+  if (a->run_last != b->run_last)
+    return compare_op_ref (a, b);
+
+  if (a->download_size != b->download_size)
+    return a->download_size < b->download_size ? -1 : 1;
+
+  return compare_op_ref (a, b);
+}
+
 static int
 compare_op_prio (FlatpakTransactionOperation *a, FlatpakTransactionOperation *b)
 {
@@ -4441,30 +5069,27 @@ sort_ops (FlatpakTransaction *self)
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
   GList *sorted = NULL;
-  GList *remaining;
   GList *runnable = NULL;
-  GList *l, *next;
-
-  remaining = priv->ops;
-  priv->ops = NULL;
+  gboolean have_remaining = FALSE;
+  GList *l;
 
   /* First mark runnable all jobs that depend on nothing.
      Note that this essentially reverses the original list, so these
      are in the same order as specified */
-  for (l = remaining; l != NULL; l = next)
+  for (l = priv->ops; l != NULL; l = l->next)
     {
       FlatpakTransactionOperation *op = l->data;
-      next = l->next;
 
       if (op->run_after_count == 0)
-        {
-          remaining = g_list_remove_link (remaining, l);
-          runnable = g_list_concat (l, runnable);
-        }
+        runnable = g_list_prepend (runnable, op);
     }
 
-  /* If no other order, start in alphabetical ref-order */
-  runnable = g_list_sort (runnable, (GCompareFunc) compare_op_ref);
+  /* If no other order, start in alphabetical ref-order, or with the
+   * smallest downloads if asked to */
+  if (priv->prefer_small_downloads)
+    runnable = g_list_sort (runnable, (GCompareFunc) compare_op_download_size);
+  else
+    runnable = g_list_sort (runnable, (GCompareFunc) compare_op_ref);
 
   while (runnable)
     {
@@ -4483,21 +5108,28 @@ sort_ops (FlatpakTransaction *self)
           FlatpakTransactionOperation *after_op = l->data;
           after_op->run_after_count--;
           if (after_op->run_after_count == 0)
-            {
-              GList *after_l = g_list_find (remaining, after_op);
-              g_assert (after_l != NULL);
-              remaining = g_list_remove_link (remaining, after_l);
-              runnable = g_list_concat (after_l, runnable);
-            }
+            runnable = g_list_prepend (runnable, after_op);
         }
     }
 
-  if (remaining != NULL)
+  /* Ops that never became runnable still have a non-zero count. We
+   * add them last, in reverse order, same as before sorting. */
+  for (l = g_list_last (priv->ops); l != NULL; l = l->prev)
     {
-      g_warning ("ops remaining after sort, maybe there is a dependency loop?");
-      sorted = g_list_concat (remaining, sorted);
+      FlatpakTransactionOperation *op = l->data;
+
+      if (op->run_after_count > 0)
+        {
+          sorted = g_list_prepend (sorted, op);
+          have_remaining = TRUE;
+        }
     }
 
+  if (have_remaining)
+    g_warning ("ops remaining after sort, maybe there is a dependency loop?");
+
+  /* The references to the ops are now owned by the sorted list */
+  g_list_free (priv->ops);
   priv->ops = g_list_reverse (sorted);
 }
 
@@ -4571,7 +5203,7 @@ flatpak_transaction_get_operation_for_ref (FlatpakTransaction *self,
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
   g_autoptr(FlatpakDecomposed) decomposed_ref = NULL;
   g_autoptr(FlatpakTransactionOperation) matching_op = NULL;
-  GList *l;
+  GPtrArray *ref_ops;
 
   g_return_val_if_fail (ref != NULL, NULL);
 
@@ -4579,24 +5211,23 @@ flatpak_transaction_get_operation_for_ref (FlatpakTransaction *self,
   if (decomposed_ref == NULL)
     return NULL;
 
-  for (l = priv->ops; l != NULL; l = l->next)
+  ref_ops = g_hash_table_lookup (priv->ops_for_ref, decomposed_ref);
+
+  for (guint i = 0; ref_ops != NULL && i < ref_ops->len; i++)
     {
-      FlatpakTransactionOperation *op = l->data;
+      FlatpakTransactionOperation *op = g_ptr_array_index (ref_ops, i);
 
       if (remote != NULL && g_strcmp0 (remote, op->remote) != 0)
         continue;
 
-      if (flatpak_decomposed_equal (op->ref, decomposed_ref))
+      if (matching_op == NULL)
+        matching_op = g_object_ref (op);
+      else
         {
-          if (matching_op == NULL)
-            matching_op = g_object_ref (op);
-          else
-            {
-              flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
-                                  _("Ref %s from %s matches more than one transaction operation"),
-                                  ref, remote ? remote : _("any remote"));
-              return NULL;
-            }
+          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                              _("Ref %s from %s matches more than one transaction operation"),
+                              ref, remote ? remote : _("any remote"));
+          return NULL;
         }
     }
 
@@ -4644,106 +5275,187 @@ remote_is_already_configured (FlatpakTransaction *self,
 }
 
 static gboolean
-handle_suggested_remote_name (FlatpakTransaction *self,
-                              GKeyFile *keyfile,
-                              GKeyFile *runtime_repo_keyfile, /* nullable */
-                              GError **error)
+load_flatpakrepo_file (FlatpakTransaction *self,
+                       const char         *dep_url,
+                       GKeyFile          **out_keyfile,
+                       GCancellable       *cancellable,
+                       GError            **error)
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
-  g_autofree char *suggested_name = NULL;
-  g_autofree char *name = NULL;
-  g_autofree char *url = NULL;
-  g_autoptr(GKeyFile) config = NULL;
-  g_autoptr(GBytes) gpg_key = NULL;
-  gboolean res;
-
-  suggested_name = g_key_file_get_string (keyfile, FLATPAK_REF_GROUP,
-                                          FLATPAK_REF_SUGGEST_REMOTE_NAME_KEY, NULL);
-  if (suggested_name == NULL)
-    return TRUE;
-
-  name = g_key_file_get_string (keyfile, FLATPAK_REF_GROUP, FLATPAK_REF_NAME_KEY, NULL);
-  if (name == NULL)
-    return TRUE;
-
-  url = g_key_file_get_string (keyfile, FLATPAK_REF_GROUP, FLATPAK_REF_URL_KEY, NULL);
-  if (url == NULL)
-    return TRUE;
+  g_autoptr(GBytes) dep_data = NULL;
+  g_autoptr(GKeyFile) dep_keyfile = g_key_file_new ();
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(FlatpakHttpSession) http_session = NULL;
 
-  if (remote_is_already_configured (self, url))
+  if (priv->disable_deps)
     return TRUE;
 
-  /* The name is already used, ignore */
-  if (ostree_repo_remote_get_url (flatpak_dir_get_repo (priv->dir), suggested_name, NULL, NULL))
-    return TRUE;
+  if (!g_str_has_prefix (dep_url, "http:") &&
+      !g_str_has_prefix (dep_url, "https:") &&
+      !g_str_has_prefix (dep_url, "file:"))
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Flatpakrepo URL %s not file, HTTP or HTTPS"), dep_url);
 
-  res = FALSE;
-  g_signal_emit (self, signals[ADD_NEW_REMOTE], 0, FLATPAK_TRANSACTION_REMOTE_GENERIC_REPO,
-                 name, suggested_name, url, &res);
-  if (res)
+  http_session = flatpak_create_http_session (PACKAGE_STRING);
+  dep_data = flatpak_load_uri (http_session, dep_url, FLATPAK_HTTP_FLAGS_USE_CACHE, NULL, NULL, NULL, NULL, cancellable, error);
+  if (dep_data == NULL)
     {
-      g_autofree char *runtime_repo_url = NULL;
+      g_prefix_error (error, _("Can't load dependent file %s: "), dep_url);
+      return FALSE;
+    }
 
-      /* In case the runtime repo is the same repo, use its title, comment,
-       * description, etc. since flatpakref files don't have those fields. */
-      runtime_repo_url = g_key_file_get_string (runtime_repo_keyfile, FLATPAK_REPO_GROUP, FLATPAK_REPO_URL_KEY, NULL);
-      if (runtime_repo_url != NULL && flatpak_uri_equal (runtime_repo_url, url))
-        config = flatpak_parse_repofile (suggested_name, FALSE, runtime_repo_keyfile, &gpg_key, NULL, error);
-      else
-        config = flatpak_parse_repofile (suggested_name, TRUE, keyfile, &gpg_key, NULL, error);
+  if (!g_key_file_load_from_data (dep_keyfile,
+                                  g_bytes_get_data (dep_data, NULL),
+                                  g_bytes_get_size (dep_data),
+                                  0, &local_error))
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid .flatpakrepo: %s"), local_error->message);
 
-      if (config == NULL)
-        return FALSE;
+  if (out_keyfile)
+    *out_keyfile = g_steal_pointer (&dep_keyfile);
 
-      if (!flatpak_dir_modify_remote (priv->dir, suggested_name, config, gpg_key, NULL, error))
-        return FALSE;
+  return TRUE;
+}
 
-      if (!flatpak_dir_recreate_repo (priv->dir, NULL, error))
-        return FALSE;
+/* A RuntimeRepo file being downloaded in a thread */
+typedef struct
+{
+  FlatpakTransaction *self;
+  char               *url;
+  GCancellable       *cancellable;
+  GThread            *thread;
+  GKeyFile           *keyfile;
+  GError             *error;
+} RuntimeRepoLoad;
 
-      flatpak_installation_drop_caches (priv->installation, NULL, NULL);
+static gpointer
+runtime_repo_load_thread (gpointer data)
+{
+  RuntimeRepoLoad *load = data;
+
+  load_flatpakrepo_file (load->self, load->url, &load->keyfile,
+                         load->cancellable, &load->error);
+
+  return NULL;
+}
+
+static RuntimeRepoLoad *
+runtime_repo_load_start (FlatpakTransaction *self,
+                         const char         *url,
+                         GCancellable       *cancellable)
+{
+  RuntimeRepoLoad *load = g_new0 (RuntimeRepoLoad, 1);
+
+  load->self = g_object_ref (self);
+  load->url = g_strdup (url);
+  load->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  load->thread = g_thread_new ("flatpak-runtime-repo", runtime_repo_load_thread, load);
+
+  return load;
+}
+
+/* Waits for the download. This can be called several times, the
+ * returned keyfile is owned by @load */
+static GKeyFile *
+runtime_repo_load_finish (RuntimeRepoLoad *load,
+                          GError         **error)
+{
+  if (load->thread)
+    g_thread_join (g_steal_pointer (&load->thread));
+
+  if (load->error)
+    {
+      g_propagate_error (error, g_error_copy (load->error));
+      return NULL;
     }
 
-  return TRUE;
+  return load->keyfile;
+}
+
+static void
+runtime_repo_load_free (RuntimeRepoLoad *load)
+{
+  if (load == NULL)
+    return;
+
+  if (load->thread)
+    g_thread_join (load->thread);
+
+  g_object_unref (load->self);
+  g_free (load->url);
+  g_clear_object (&load->cancellable);
+  g_clear_pointer (&load->keyfile, g_key_file_unref);
+  g_clear_error (&load->error);
+  g_free (load);
 }
 
 static gboolean
-load_flatpakrepo_file (FlatpakTransaction *self,
-                       const char         *dep_url,
-                       GKeyFile          **out_keyfile,
-                       GCancellable       *cancellable,
-                       GError            **error)
+handle_suggested_remote_name (FlatpakTransaction *self,
+                              GKeyFile *keyfile,
+                              RuntimeRepoLoad *runtime_repo_load, /* nullable */
+                              GError **error)
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
-  g_autoptr(GBytes) dep_data = NULL;
-  g_autoptr(GKeyFile) dep_keyfile = g_key_file_new ();
-  g_autoptr(GError) local_error = NULL;
-  g_autoptr(FlatpakHttpSession) http_session = NULL;
+  g_autofree char *suggested_name = NULL;
+  g_autofree char *name = NULL;
+  g_autofree char *url = NULL;
+  g_autoptr(GKeyFile) config = NULL;
+  g_autoptr(GBytes) gpg_key = NULL;
+  gboolean res;
 
-  if (priv->disable_deps)
+  suggested_name = g_key_file_get_string (keyfile, FLATPAK_REF_GROUP,
+                                          FLATPAK_REF_SUGGEST_REMOTE_NAME_KEY, NULL);
+  if (suggested_name == NULL)
     return TRUE;
 
-  if (!g_str_has_prefix (dep_url, "http:") &&
-      !g_str_has_prefix (dep_url, "https:") &&
-      !g_str_has_prefix (dep_url, "file:"))
-    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Flatpakrepo URL %s not file, HTTP or HTTPS"), dep_url);
+  name = g_key_file_get_string (keyfile, FLATPAK_REF_GROUP, FLATPAK_REF_NAME_KEY, NULL);
+  if (name == NULL)
+    return TRUE;
 
-  http_session = flatpak_create_http_session (PACKAGE_STRING);
-  dep_data = flatpak_load_uri (http_session, dep_url, 0, NULL, NULL, NULL, NULL, cancellable, error);
-  if (dep_data == NULL)
+  url = g_key_file_get_string (keyfile, FLATPAK_REF_GROUP, FLATPAK_REF_URL_KEY, NULL);
+  if (url == NULL)
+    return TRUE;
+
+  if (remote_is_already_configured (self, url))
+    return TRUE;
+
+  /* The name is already used, ignore */
+  if (ostree_repo_remote_get_url (flatpak_dir_get_repo (priv->dir), suggested_name, NULL, NULL))
+    return TRUE;
+
+  res = FALSE;
+  transaction_emit (self, signals[ADD_NEW_REMOTE], FLATPAK_TRANSACTION_REMOTE_GENERIC_REPO,
+                    name, suggested_name, url, &res);
+  if (res)
     {
-      g_prefix_error (error, _("Can't load dependent file %s: "), dep_url);
-      return FALSE;
-    }
+      g_autofree char *runtime_repo_url = NULL;
+      GKeyFile *runtime_repo_keyfile = NULL;
 
-  if (!g_key_file_load_from_data (dep_keyfile,
-                                  g_bytes_get_data (dep_data, NULL),
-                                  g_bytes_get_size (dep_data),
-                                  0, &local_error))
-    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid .flatpakrepo: %s"), local_error->message);
+      if (runtime_repo_load != NULL)
+        {
+          runtime_repo_keyfile = runtime_repo_load_finish (runtime_repo_load, error);
+          if (runtime_repo_keyfile == NULL)
+            return FALSE;
+        }
 
-  if (out_keyfile)
-    *out_keyfile = g_steal_pointer (&dep_keyfile);
+      /* In case the runtime repo is the same repo, use its title, comment,
+       * description, etc. since flatpakref files don't have those fields. */
+      if (runtime_repo_keyfile != NULL)
+        runtime_repo_url = g_key_file_get_string (runtime_repo_keyfile, FLATPAK_REPO_GROUP, FLATPAK_REPO_URL_KEY, NULL);
+      if (runtime_repo_url != NULL && flatpak_uri_equal (runtime_repo_url, url))
+        config = flatpak_parse_repofile (suggested_name, FALSE, runtime_repo_keyfile, &gpg_key, NULL, error);
+      else
+        config = flatpak_parse_repofile (suggested_name, TRUE, keyfile, &gpg_key, NULL, error);
+
+      if (config == NULL)
+        return FALSE;
+
+      if (!flatpak_dir_modify_remote (priv->dir, suggested_name, config, gpg_key, NULL, error))
+        return FALSE;
+
+      if (!flatpak_dir_recreate_repo (priv->dir, NULL, error))
+        return FALSE;
+
+      flatpak_installation_drop_caches (priv->installation, NULL, NULL);
+    }
 
   return TRUE;
 }
@@ -4812,8 +5524,8 @@ handle_runtime_repo_deps (FlatpakTransaction *self,
     return TRUE;
 
   res = FALSE;
-  g_signal_emit (self, signals[ADD_NEW_REMOTE], 0, FLATPAK_TRANSACTION_REMOTE_RUNTIME_DEPS,
-                 id, new_remote, runtime_url, &res);
+  transaction_emit (self, signals[ADD_NEW_REMOTE], FLATPAK_TRANSACTION_REMOTE_RUNTIME_DEPS,
+                    id, new_remote, runtime_url, &res);
   if (res)
     {
       if (!flatpak_dir_modify_remote (priv->dir, new_remote, config, gpg_key, NULL, error))
@@ -4855,37 +5567,55 @@ flatpak_transaction_resolve_flatpakrefs (FlatpakTransaction *self,
                                          GError            **error)
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GPtrArray) runtime_repo_loads = g_ptr_array_new_with_free_func ((GDestroyNotify) runtime_repo_load_free);
   GList *l;
+  guint i;
 
+  /* Download the RuntimeRepo files of all the flatpakrefs at the same
+   * time, in the background while we ask about adding their remotes */
   for (l = priv->flatpakrefs; l != NULL; l = l->next)
     {
       GKeyFile *flatpakref = l->data;
-      g_autofree char *remote = NULL;
       g_autofree char *runtime_repo_url = NULL;
-      g_autoptr(FlatpakDecomposed) ref = NULL;
-      g_autoptr(GKeyFile) runtime_repo_keyfile = NULL;
 
       if (!priv->disable_deps)
-        {
-          runtime_repo_url = g_key_file_get_string (flatpakref, FLATPAK_REF_GROUP,
-                                                    FLATPAK_REF_RUNTIME_REPO_KEY, NULL);
-          if (runtime_repo_url == NULL)
-            g_warning ("Flatpakref file does not contain a %s", FLATPAK_REF_RUNTIME_REPO_KEY);
-          else if (!load_flatpakrepo_file (self, runtime_repo_url, &runtime_repo_keyfile, cancellable, error))
-            return FALSE;
-        }
+        runtime_repo_url = g_key_file_get_string (flatpakref, FLATPAK_REF_GROUP,
+                                                  FLATPAK_REF_RUNTIME_REPO_KEY, NULL);
+
+      if (runtime_repo_url != NULL)
+        g_ptr_array_add (runtime_repo_loads, runtime_repo_load_start (self, runtime_repo_url, cancellable));
+      else
+        g_ptr_array_add (runtime_repo_loads, NULL);
+    }
+
+  for (l = priv->flatpakrefs, i = 0; l != NULL; l = l->next, i++)
+    {
+      GKeyFile *flatpakref = l->data;
+      RuntimeRepoLoad *runtime_repo_load = g_ptr_array_index (runtime_repo_loads, i);
+      g_autofree char *remote = NULL;
+      g_autoptr(FlatpakDecomposed) ref = NULL;
+      GKeyFile *runtime_repo_keyfile;
+
+      if (!priv->disable_deps && runtime_repo_load == NULL)
+        g_warning ("Flatpakref file does not contain a %s", FLATPAK_REF_RUNTIME_REPO_KEY);
 
       /* Handle SuggestRemoteName before the runtime deps, because they might
-       * be the same. Pass in the RuntimeRepo keyfile so its metadata can be
+       * be the same. Pass in the RuntimeRepo download so its metadata can be
        * used in that case. */
-      if (!handle_suggested_remote_name (self, flatpakref, runtime_repo_keyfile, error))
+      if (!handle_suggested_remote_name (self, flatpakref, runtime_repo_load, error))
         return FALSE;
 
-      if (runtime_repo_keyfile != NULL &&
-          !handle_runtime_repo_deps_from_keyfile (self, flatpakref,
-                                                  runtime_repo_url, runtime_repo_keyfile,
-                                                  cancellable, error))
-        return FALSE;
+      if (runtime_repo_load != NULL)
+        {
+          runtime_repo_keyfile = runtime_repo_load_finish (runtime_repo_load, error);
+          if (runtime_repo_keyfile == NULL)
+            return FALSE;
+
+          if (!handle_runtime_repo_deps_from_keyfile (self, flatpakref,
+                                                      runtime_repo_load->url, runtime_repo_keyfile,
+                                                      cancellable, error))
+            return FALSE;
+        }
 
       if (!flatpak_dir_create_remote_for_ref_file (priv->dir, flatpakref, priv->default_arch,
                                                    &remote, NULL, &ref, error))
@@ -5080,6 +5810,149 @@ flatpak_transaction_run (FlatpakTransaction *transaction,
   return FLATPAK_TRANSACTION_GET_CLASS (transaction)->run (transaction, cancellable, error);
 }
 
+static void
+run_in_thread (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
+{
+  FlatpakTransaction *self = source_object;
+  g_autoptr(GMainContext) context = g_main_context_new ();
+  g_autoptr(GError) local_error = NULL;
+  gboolean res;
+
+  /* Don't let anything the transaction attaches end up in the caller's context */
+  g_main_context_push_thread_default (context);
+  res = flatpak_transaction_run (self, cancellable, &local_error);
+  g_main_context_pop_thread_default (context);
+
+  if (res)
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, g_steal_pointer (&local_error));
+}
+
+/**
+ * flatpak_transaction_run_async:
+ * @transaction: a #FlatpakTransaction
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when the transaction is done
+ * @user_data: the data to pass to @callback
+ *
+ * Executes the transaction asynchronously, see flatpak_transaction_run()
+ * for details.
+ *
+ * The transaction runs in a separate thread, but all its signals, as well
+ * as the #FlatpakTransactionProgress::changed signals of the operations,
+ * are emitted in the thread-default main context of the caller, so it must
+ * be iterated until @callback is called. Signals that return a value
+ * block the transaction until their handlers return.
+ *
+ * Since: 1.19.0
+ */
+void
+flatpak_transaction_run_async (FlatpakTransaction  *transaction,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (transaction);
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (transaction, cancellable, callback, user_data);
+  g_task_set_source_tag (task, flatpak_transaction_run_async);
+
+  if (!priv->can_run)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                               _("Transaction already executed"));
+      return;
+    }
+
+  g_clear_pointer (&priv->emit_context, g_main_context_unref);
+  priv->emit_context = g_main_context_ref_thread_default ();
+
+  g_task_run_in_thread (task, run_in_thread);
+}
+
+/**
+ * flatpak_transaction_run_finish:
+ * @transaction: a #FlatpakTransaction
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for an error
+ *
+ * Finishes a transaction started with flatpak_transaction_run_async().
+ *
+ * Returns: %TRUE on success, %FALSE if an error occurred
+ *
+ * Since: 1.19.0
+ */
+gboolean
+flatpak_transaction_run_finish (FlatpakTransaction *transaction,
+                                GAsyncResult       *result,
+                                GError            **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, transaction), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static const char *
+op_get_pull_source (FlatpakTransaction          *self,
+                    FlatpakTransactionOperation *op)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  if (op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE)
+    return "bundle";
+  if (priv->no_pull || op->update_only_deploy ||
+      op->kind == FLATPAK_TRANSACTION_OPERATION_UNINSTALL)
+    return "none";
+  if (op->resolved_sideload_path != NULL)
+    return "sideload";
+  if (op->resolved_image_source != NULL)
+    return "oci";
+  return "remote";
+}
+
+/* See flatpak_transaction_operation_get_metrics() */
+static void
+set_op_metrics (FlatpakTransaction          *self,
+                FlatpakTransactionOperation *op,
+                FlatpakProgress             *progress, /* nullable */
+                gint64                       start_time)
+{
+  g_autoptr(GVariant) pull_metrics = NULL;
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+
+  /* A prefetched op was pulled by another FlatpakProgress */
+  if (op->prefetched)
+    pull_metrics = op->prefetch_metrics ? g_variant_ref (op->prefetch_metrics) : NULL;
+  else if (progress != NULL)
+    pull_metrics = flatpak_progress_get_metrics (progress);
+
+  if (pull_metrics != NULL)
+    {
+      GVariantIter iter;
+      const char *key;
+      GVariant *value;
+
+      g_variant_iter_init (&iter, pull_metrics);
+      while (g_variant_iter_loop (&iter, "{&sv}", &key, &value))
+        g_variant_builder_add (&builder, "{sv}", key, value);
+    }
+
+  g_variant_builder_add (&builder, "{sv}", "source",
+                         g_variant_new_string (op_get_pull_source (self, op)));
+  g_variant_builder_add (&builder, "{sv}", "duration-usec",
+                         g_variant_new_uint64 (g_get_monotonic_time () - start_time));
+
+  g_clear_pointer (&op->metrics, g_variant_unref);
+  op->metrics = g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
 static gboolean
 _run_op_kind (FlatpakTransaction           *self,
               FlatpakTransactionOperation  *op,
@@ -5092,9 +5965,13 @@ _run_op_kind (FlatpakTransaction           *self,
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
   gboolean res = TRUE;
+  gint64 start_time = g_get_monotonic_time ();
 
   g_return_val_if_fail (remote_state != NULL || op->kind == FLATPAK_TRANSACTION_OPERATION_UNINSTALL, FALSE);
 
+  FLATPAK_TRACE2 (op_start, flatpak_decomposed_get_ref (op->ref),
+                  flatpak_transaction_operation_type_to_string (op->kind));
+
   if (op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL)
     {
       g_autoptr(FlatpakTransactionProgress) progress = flatpak_transaction_progress_new ();
@@ -5110,7 +5987,7 @@ _run_op_kind (FlatpakTransaction           *self,
         res = FALSE;
       else
         res = flatpak_dir_install (priv->dir,
-                                   priv->no_pull,
+                                   priv->no_pull || op->prefetched,
                                    priv->no_deploy,
                                    priv->disable_static_deltas,
                                    priv->reinstall,
@@ -5146,6 +6023,7 @@ _run_op_kind (FlatpakTransaction           *self,
 
       if (res)
         {
+          set_op_metrics (self, op, progress->progress_obj, start_time);
           emit_op_done (self, op, result_details);
 
           /* Normally we don't need to prune after install, because it makes no old objects
@@ -5184,7 +6062,7 @@ _run_op_kind (FlatpakTransaction           *self,
                                              cancellable, &local_error);
           else
             res = flatpak_dir_update (priv->dir,
-                                      priv->no_pull,
+                                      priv->no_pull || op->prefetched,
                                       priv->no_deploy,
                                       priv->disable_static_deltas,
                                       op->commit != NULL, /* Allow downgrade if we specify commit */
@@ -5218,6 +6096,7 @@ _run_op_kind (FlatpakTransaction           *self,
 
           if (res)
             {
+              set_op_metrics (self, op, progress->progress_obj, start_time);
               emit_op_done (self, op, result_details);
 
               if (!priv->no_pull)
@@ -5245,6 +6124,7 @@ _run_op_kind (FlatpakTransaction           *self,
 
       if (res)
         {
+          set_op_metrics (self, op, NULL, start_time);
           emit_op_done (self, op, 0);
           *out_needs_prune = TRUE;
           *out_needs_triggers = TRUE;
@@ -5273,6 +6153,7 @@ _run_op_kind (FlatpakTransaction           *self,
 
       if (res)
         {
+          set_op_metrics (self, op, NULL, start_time);
           emit_op_done (self, op, 0);
           *out_needs_prune = TRUE;
 
@@ -5283,6 +6164,9 @@ _run_op_kind (FlatpakTransaction           *self,
   else
     g_assert_not_reached ();
 
+  FLATPAK_TRACE3 (op_done, flatpak_decomposed_get_ref (op->ref),
+                  flatpak_transaction_operation_type_to_string (op->kind), res);
+
   return res;
 }
 
@@ -5337,6 +6221,7 @@ add_uninstall_unused_ops (FlatpakTransaction  *self,
   g_autoptr(GHashTable) eol_injection = NULL;
   g_autoptr(GPtrArray) to_be_excluded = NULL;
   g_auto(GStrv) old_unused_refs = NULL;
+  g_autoptr(GHashTable) old_unused_refs_set = NULL;
   g_auto(GStrv) unused_refs = NULL;
   const char * const *to_be_excluded_strv = NULL;
   GList *l, *next;
@@ -5356,6 +6241,10 @@ add_uninstall_unused_ops (FlatpakTransaction  *self,
                                                       cancellable, error);
       if (old_unused_refs == NULL)
         return FALSE;
+
+      old_unused_refs_set = g_hash_table_new (g_str_hash, g_str_equal);
+      for (i = 0; old_unused_refs[i] != NULL; i++)
+        g_hash_table_add (old_unused_refs_set, old_unused_refs[i]);
     }
 
   /* This is a mapping from refs to #GKeyFile metadata objects, for each ref
@@ -5426,8 +6315,8 @@ add_uninstall_unused_ops (FlatpakTransaction  *self,
         continue;
 
       /* Don't uninstall refs that were already unused before the transaction (unless include_unused_uninstall_ops is set) */
-      if (old_unused_refs &&
-          g_strv_contains ((const char * const*)old_unused_refs, flatpak_decomposed_get_ref (unused_ref)))
+      if (old_unused_refs_set &&
+          g_hash_table_contains (old_unused_refs_set, flatpak_decomposed_get_ref (unused_ref)))
         continue;
 
       origin = flatpak_dir_get_origin (priv->dir, unused_ref, NULL, NULL);
@@ -5452,71 +6341,375 @@ add_uninstall_unused_ops (FlatpakTransaction  *self,
   return TRUE;
 }
 
+typedef struct {
+  FlatpakTransaction          *transaction;
+  FlatpakTransactionOperation *op;
+  /* A copy only used by the worker, as states are not threadsafe */
+  FlatpakRemoteState          *state;
+  GCancellable                *cancellable;
+} PrefetchData;
+
+static void
+prefetch_data_free (PrefetchData *data)
+{
+  g_object_unref (data->op);
+  flatpak_remote_state_unref (data->state);
+  g_free (data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PrefetchData, prefetch_data_free)
+
+static void
+prefetch_progress_cb (const char *status,
+                      guint       progress,
+                      gboolean    estimating,
+                      gpointer    user_data)
+{
+}
+
 static gboolean
-flatpak_transaction_real_run (FlatpakTransaction *self,
-                              GCancellable       *cancellable,
-                              GError            **error)
+op_can_prefetch (FlatpakTransaction          *self,
+                 FlatpakTransactionOperation *op)
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
-  GList *l;
-  gboolean succeeded = TRUE;
-  gboolean needs_prune = FALSE;
-  gboolean needs_triggers = FALSE;
-  gboolean needs_cache_drop = FALSE;
-  gboolean ready_res = FALSE;
-  int i;
 
-  if (!priv->can_run)
-    return flatpak_fail (error, _("Transaction already executed"));
+  if (op->skip || op->update_only_deploy || op->prefetched)
+    return FALSE;
 
-  priv->can_run = FALSE;
+  if (op->kind != FLATPAK_TRANSACTION_OPERATION_INSTALL &&
+      op->kind != FLATPAK_TRANSACTION_OPERATION_UPDATE)
+    return FALSE;
 
-  priv->current_op = NULL;
+  /* OCI images are mirrored as part of the install, not pulled separately */
+  if (op->resolved_image_source != NULL)
+    return FALSE;
 
-  if (flatpak_dir_is_user (priv->dir) && getuid () == 0)
-    {
-      struct stat st_buf;
-      g_autofree char *dir_path = NULL;
+  /* System helper pulls go via child repos and may need interactive
+   * authorization, so leave those to the normal sequential path */
+  if (flatpak_dir_use_system_helper (priv->dir, NULL))
+    return FALSE;
 
-      /* Check that it's not root's own user installation */
-      dir_path = g_file_get_path (flatpak_dir_get_path (priv->dir));
-      if (stat (dir_path, &st_buf) == 0 && st_buf.st_uid != 0)
-        return flatpak_fail_error (error, FLATPAK_ERROR_WRONG_USER,
-                                   _("Refusing to operate on a user installation as root! "
-                                     "This can lead to incorrect file ownership and permission errors."));
-    }
+  if (op->resolved_metakey &&
+      !flatpak_check_required_version (flatpak_decomposed_get_ref (op->ref),
+                                       op->resolved_metakey, NULL))
+    return FALSE;
 
-  if (!priv->no_pull &&
-      !flatpak_transaction_update_metadata (self, cancellable, error))
+  return TRUE;
+}
+
+/* This runs in a worker thread. It only reads the (fully resolved) op, and
+ * uses its own copy of the remote state, whose lookups fill in caches, and
+ * its own FlatpakDir so that it gets a separate OstreeRepo and thus a
+ * separate ostree transaction. */
+static void
+prefetch_op_thread_func (gpointer data,
+                         gpointer user_data)
+{
+  g_autoptr(PrefetchData) prefetch = data;
+  FlatpakTransaction *self = prefetch->transaction;
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  FlatpakTransactionOperation *op = prefetch->op;
+  g_autoptr(FlatpakDir) dir = flatpak_dir_clone (priv->dir);
+  g_autoptr(FlatpakProgress) progress = flatpak_progress_new (prefetch_progress_cb, NULL);
+  g_autoptr(GError) local_error = NULL;
+  gboolean res;
+
+  flatpak_progress_set_lazy_status (progress, TRUE);
+
+  if (g_cancellable_set_error_if_cancelled (prefetch->cancellable, &local_error) ||
+      !flatpak_dir_ensure_repo (dir, prefetch->cancellable, &local_error))
+    res = FALSE;
+  else if (op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL)
+    res = flatpak_dir_install (dir,
+                               FALSE, /* no_pull */
+                               TRUE, /* no_deploy */
+                               priv->disable_static_deltas,
+                               priv->reinstall,
+                               priv->max_op >= APP_UPDATE,
+                               op->pin_on_deploy,
+                               op->update_preinstalled_on_deploy,
+                               prefetch->state, op->ref,
+                               op->resolved_commit,
+                               (const char **) op->subpaths,
+                               (const char **) op->previous_ids,
+                               op->resolved_sideload_path,
+                               NULL,
+                               op->resolved_metadata,
+                               op->resolved_token,
+                               progress,
+                               prefetch->cancellable, &local_error);
+  else
+    res = flatpak_dir_update (dir,
+                              FALSE, /* no_pull */
+                              TRUE, /* no_deploy */
+                              priv->disable_static_deltas,
+                              op->commit != NULL,
+                              priv->max_op >= APP_UPDATE,
+                              priv->max_op == APP_INSTALL || priv->max_op == RUNTIME_INSTALL,
+                              prefetch->state,
+                              op->ref,
+                              op->resolved_commit,
+                              (const char **) op->subpaths,
+                              (const char **) op->previous_ids,
+                              op->resolved_sideload_path,
+                              NULL,
+                              op->resolved_metadata,
+                              op->resolved_token,
+                              progress,
+                              prefetch->cancellable, &local_error);
+
+  flatpak_progress_done (progress);
+
+  /* On failure we just fall back to pulling in the normal run, which will
+   * report the error through the usual signals. */
+  if (!res)
+    g_info ("Failed to prefetch %s, pulling it again later: %s",
+            flatpak_decomposed_get_ref (op->ref), local_error->message);
+
+  g_mutex_lock (&priv->prefetch_lock);
+  op->prefetched = res;
+  op->prefetch_pending = FALSE;
+  if (res)
+    op->prefetch_metrics = flatpak_progress_get_metrics (progress);
+  g_cond_broadcast (&priv->prefetch_cond);
+  g_mutex_unlock (&priv->prefetch_lock);
+}
+
+static void
+wait_for_prefetch (FlatpakTransaction          *self,
+                   FlatpakTransactionOperation *op)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  g_mutex_lock (&priv->prefetch_lock);
+  while (op->prefetch_pending)
+    g_cond_wait (&priv->prefetch_cond, &priv->prefetch_lock);
+  g_mutex_unlock (&priv->prefetch_lock);
+}
+
+/* Start pulling the data for all ops that support it in a thread pool, in
+ * the order the ops will run. The returned pool must be freed (which waits
+ * for the pulls) with finish_prefetch_ops(). */
+static GThreadPool *
+start_prefetch_ops (FlatpakTransaction *self,
+                    GCancellable       *cancellable)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GError) local_error = NULL;
+  GThreadPool *pool;
+  GList *l;
+
+  pool = g_thread_pool_new (prefetch_op_thread_func, NULL,
+                            priv->max_parallel_ops, FALSE, &local_error);
+  if (pool == NULL)
     {
-      g_assert (error == NULL || *error != NULL);
-      return FALSE;
+      g_info ("Not prefetching operations: %s", local_error->message);
+      return NULL;
     }
 
-  if (!flatpak_transaction_add_auto_install (self, cancellable, error))
+  for (l = priv->ops; l != NULL; l = l->next)
     {
-      g_assert (error == NULL || *error != NULL);
-      return FALSE;
+      FlatpakTransactionOperation *op = l->data;
+      g_autoptr(GError) state_error = NULL;
+      g_autoptr(FlatpakRemoteState) state = NULL;
+      PrefetchData *data;
+
+      if (!op_can_prefetch (self, op))
+        continue;
+
+      /* Remote states are not threadsafe, so get them here and give each
+       * worker a copy of its own */
+      state = flatpak_transaction_ensure_remote_state (self, op->kind, op->remote, NULL, &state_error);
+      if (state == NULL)
+        continue;
+
+      data = g_new0 (PrefetchData, 1);
+      data->transaction = self;
+      data->op = g_object_ref (op);
+      data->state = flatpak_remote_state_copy (state);
+      data->cancellable = cancellable;
+
+      op->prefetch_pending = TRUE;
+      if (!g_thread_pool_push (pool, data, &local_error))
+        {
+          g_info ("Failed to queue prefetch of %s: %s",
+                  flatpak_decomposed_get_ref (op->ref), local_error->message);
+          g_clear_error (&local_error);
+          op->prefetch_pending = FALSE;
+          prefetch_data_free (data);
+        }
     }
 
-  if (!flatpak_transaction_resolve_flatpakrefs (self, cancellable, error))
+  return pool;
+}
+
+static void
+finish_prefetch_ops (GThreadPool *pool)
+{
+  /* Not immediate, as the queued data would leak otherwise; if the
+   * transaction was aborted the cancellable makes the pulls return early. */
+  if (pool != NULL)
+    g_thread_pool_free (pool, FALSE, TRUE);
+}
+
+static void
+cancel_prefetch_cb (GCancellable *cancellable,
+                    GCancellable *prefetch_cancellable)
+{
+  g_cancellable_cancel (prefetch_cancellable);
+}
+
+static gboolean
+op_can_batch_pull (FlatpakTransaction          *self,
+                   FlatpakTransactionOperation *op)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  if (!op_can_prefetch (self, op))
+    return FALSE;
+
+  if (op->resolved_sideload_path != NULL || op->resolved_token != NULL)
+    return FALSE;
+
+  if (op->subpaths != NULL && op->subpaths[0] != NULL)
+    return FALSE;
+
+  /* Updates keep the previously deployed subpaths unless overridden */
+  if (op->kind == FLATPAK_TRANSACTION_OPERATION_UPDATE && op->subpaths == NULL)
     {
-      g_assert (error == NULL || *error != NULL);
-      return FALSE;
+      g_autoptr(GBytes) deploy_data = flatpak_dir_get_deploy_data (priv->dir, op->ref,
+                                                                   FLATPAK_DEPLOY_VERSION_ANY,
+                                                                   NULL, NULL);
+      g_autofree const char **old_subpaths = NULL;
+
+      if (deploy_data != NULL)
+        old_subpaths = flatpak_deploy_data_get_subpaths (deploy_data);
+
+      if (old_subpaths != NULL && old_subpaths[0] != NULL)
+        return FALSE;
     }
 
-  if (!flatpak_transaction_resolve_bundles (self, cancellable, error))
+  return TRUE;
+}
+
+/* Download the objects of all the suitable ops in one pull per remote. The
+ * ops then still run their own pull, which doesn't need to download much. */
+static void
+batch_pull_ops (FlatpakTransaction *self,
+                GCancellable       *cancellable)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GHashTable) ops_by_remote = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  GList *l;
+
+  ops_by_remote = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_ptr_array_unref);
+
+  for (l = priv->ops; l != NULL; l = l->next)
     {
-      g_assert (error == NULL || *error != NULL);
-      return FALSE;
+      FlatpakTransactionOperation *op = l->data;
+      GPtrArray *remote_ops;
+
+      if (!op_can_batch_pull (self, op))
+        continue;
+
+      remote_ops = g_hash_table_lookup (ops_by_remote, op->remote);
+      if (remote_ops == NULL)
+        {
+          remote_ops = g_ptr_array_new ();
+          g_hash_table_insert (ops_by_remote, op->remote, remote_ops);
+        }
+
+      g_ptr_array_add (remote_ops, op);
     }
 
-  if (!flatpak_transaction_resolve_images (self, cancellable, error))
+  g_hash_table_iter_init (&iter, ops_by_remote);
+  while (g_hash_table_iter_next (&iter, &key, &value))
     {
-      g_assert (error == NULL || *error != NULL);
-      return FALSE;
+      const char *remote = key;
+      GPtrArray *remote_ops = value;
+      g_autoptr(FlatpakRemoteState) state = NULL;
+      g_autoptr(FlatpakProgress) progress = NULL;
+      g_autoptr(GPtrArray) refs = NULL;
+      g_autoptr(GPtrArray) revs = NULL;
+      g_autoptr(GError) local_error = NULL;
+      FlatpakPullFlags flatpak_flags = FLATPAK_PULL_FLAGS_NONE;
+
+      /* Nothing to share with a single ref */
+      if (remote_ops->len < 2)
+        continue;
+
+      state = flatpak_transaction_ensure_remote_state (self, FLATPAK_TRANSACTION_OPERATION_UPDATE,
+                                                       remote, NULL, &local_error);
+      if (state == NULL)
+        {
+          g_info ("Not batching pulls from %s: %s", remote, local_error->message);
+          continue;
+        }
+
+      refs = g_ptr_array_new ();
+      revs = g_ptr_array_new ();
+      for (guint i = 0; i < remote_ops->len; i++)
+        {
+          FlatpakTransactionOperation *op = g_ptr_array_index (remote_ops, i);
+
+          g_ptr_array_add (refs, (char *) flatpak_decomposed_get_ref (op->ref));
+          g_ptr_array_add (revs, op->resolved_commit);
+        }
+      g_ptr_array_add (refs, NULL);
+      g_ptr_array_add (revs, NULL);
+
+      if (priv->disable_static_deltas)
+        flatpak_flags |= FLATPAK_PULL_FLAGS_NO_STATIC_DELTAS;
+
+      progress = flatpak_progress_new (prefetch_progress_cb, NULL);
+      flatpak_progress_set_lazy_status (progress, TRUE);
+      if (!flatpak_dir_pull_batch (priv->dir, state,
+                                   (const char * const *) refs->pdata,
+                                   (const char * const *) revs->pdata,
+                                   NULL, flatpak_flags, progress,
+                                   cancellable, &local_error))
+        g_info ("Batch pull from %s failed, pulling refs individually: %s",
+                remote, local_error->message);
+      flatpak_progress_done (progress);
+    }
+}
+
+/* Adds when @dir last changed to @checksum */
+static gboolean
+checksum_dir_changed (GChecksum  *checksum,
+                      FlatpakDir *dir)
+{
+  g_autoptr(GFile) changed_file = flatpak_dir_get_changed_path (dir);
+  g_autofree char *timestamp = NULL;
+  struct stat st_buf;
+
+  if (stat (flatpak_file_get_path_cached (changed_file), &st_buf) != 0)
+    {
+      if (errno != ENOENT)
+        return FALSE;
+      st_buf.st_mtim.tv_sec = 0;
+      st_buf.st_mtim.tv_nsec = 0;
     }
 
+  timestamp = g_strdup_printf ("%" G_GINT64_FORMAT ".%ld",
+                               (gint64) st_buf.st_mtim.tv_sec, (long) st_buf.st_mtim.tv_nsec);
+  g_checksum_update (checksum, (const guchar *) timestamp, -1);
+
+  return TRUE;
+}
+
+/* Resolve the ops, add all the dependencies and related refs they need and
+ * the uninstalls they make possible. */
+static gboolean
+resolve_transaction (FlatpakTransaction *self,
+                     GCancellable       *cancellable,
+                     GError            **error)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  GList *l;
+
   /* Resolve initial ops */
   if (!resolve_all_ops (self, cancellable, error))
     {
@@ -5575,10 +6768,689 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
       return FALSE;
     }
 
+  return TRUE;
+}
+
+/* Starts a key for everything the outcome of resolve_transaction() depends
+ * on: the requested ops, the transaction flags, the installation config and
+ * installed refs. The summaries of the remotes that resolution consults are
+ * added by plan_key_finish(). Returns %NULL for transactions that can't be
+ * cached, which is everything but plain updates (and installs of already
+ * installed refs) from remotes. */
+static GChecksum *
+plan_key_start (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *flags = NULL;
+  g_autofree char *config_data = NULL;
+  GKeyFile *config;
+  GList *l;
+
+  if (priv->ops == NULL ||
+      priv->flatpakrefs != NULL || priv->bundles != NULL || priv->images != NULL ||
+      priv->extra_sideload_repos->len > 0 || priv->sideload_image_collections->len > 0)
+    return NULL;
+
+  if (flatpak_dir_get_repo (priv->dir) == NULL || flatpak_dir_get_cache_dir (priv->dir) == NULL)
+    return NULL;
+
+  g_checksum_update (checksum, (const guchar *) PACKAGE_VERSION, -1);
+
+  flags = g_strdup_printf ("%d%d%d%d%d%d%d%d%d:%s",
+                           priv->no_pull, priv->no_deploy, priv->disable_deps,
+                           priv->disable_related, priv->reinstall,
+                           priv->include_unused_uninstall_ops,
+                           priv->auto_install_sdk, priv->auto_install_debug,
+                           priv->disable_auto_pin,
+                           priv->default_arch ? priv->default_arch : "");
+  g_checksum_update (checksum, (const guchar *) flags, -1);
+
+  /* This covers remotes, masks, pins and languages */
+  config = ostree_repo_get_config (flatpak_dir_get_repo (priv->dir));
+  config_data = g_key_file_to_data (config, NULL, NULL);
+  g_checksum_update (checksum, (const guchar *) config_data, -1);
+
+  /* The .changed file is touched whenever something is deployed or
+   * undeployed, which covers the related refs we don't look at here */
+  if (!checksum_dir_changed (checksum, priv->dir))
+    return NULL;
+
+  for (guint i = 0; i < priv->extra_dependency_dirs->len; i++)
+    {
+      if (!checksum_dir_changed (checksum, g_ptr_array_index (priv->extra_dependency_dirs, i)))
+        return NULL;
+    }
+
+  for (l = priv->ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+      g_autofree char *subpaths = NULL;
+
+      if (op->kind != FLATPAK_TRANSACTION_OPERATION_UPDATE &&
+          op->kind != FLATPAK_TRANSACTION_OPERATION_INSTALL_OR_UPDATE)
+        return NULL;
+
+      subpaths = subpaths_to_string ((const char **) op->subpaths);
+      g_checksum_update (checksum, (const guchar *) flatpak_decomposed_get_ref (op->ref), -1);
+      g_checksum_update (checksum, (const guchar *) op->remote, -1);
+      g_checksum_update (checksum, (const guchar *) (op->commit ? op->commit : "-"), -1);
+      g_checksum_update (checksum, (const guchar *) subpaths, -1);
+    }
+
+  return g_steal_pointer (&checksum);
+}
+
+/* Completes the key from plan_key_start() with the summaries of @remotes,
+ * all the remotes resolution consulted (dependencies and related refs may
+ * come from other remotes than the requested ones), and the deployed
+ * commits of @refs, all the refs it looked at. */
+static char *
+plan_key_finish (FlatpakTransaction *self,
+                 GChecksum          *start,
+                 GPtrArray          *remotes,
+                 GPtrArray          *refs)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GChecksum) checksum = g_checksum_copy (start);
+
+  for (guint i = 0; i < remotes->len; i++)
+    {
+      const char *remote = g_ptr_array_index (remotes, i);
+      g_autoptr(FlatpakRemoteState) state = NULL;
+      GVariant *summary_data;
+
+      state = flatpak_transaction_ensure_remote_state (self, FLATPAK_TRANSACTION_OPERATION_UPDATE,
+                                                       remote, NULL, NULL);
+      if (state == NULL)
+        return NULL;
+
+      /* The index references the subsummaries by digest */
+      summary_data = state->index ? state->index : state->summary;
+      if (summary_data == NULL)
+        return NULL;
+
+      g_checksum_update (checksum, (const guchar *) remote, -1);
+      g_checksum_update (checksum, g_variant_get_data (summary_data), g_variant_get_size (summary_data));
+    }
+
+  for (guint i = 0; i < refs->len; i++)
+    {
+      const char *ref = g_ptr_array_index (refs, i);
+      g_autoptr(FlatpakDecomposed) decomposed = flatpak_decomposed_new_from_ref (ref, NULL);
+      g_autoptr(GBytes) deploy_data = NULL;
+
+      if (decomposed == NULL)
+        return NULL;
+
+      g_checksum_update (checksum, (const guchar *) ref, -1);
+
+      deploy_data = flatpak_dir_get_deploy_data (priv->dir, decomposed, FLATPAK_DEPLOY_VERSION_ANY, NULL, NULL);
+      g_checksum_update (checksum,
+                         (const guchar *) (deploy_data ? flatpak_deploy_data_get_commit (deploy_data) : "-"),
+                         -1);
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static GFile *
+get_plan_cache_file (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  return g_file_get_child (flatpak_dir_get_cache_dir (priv->dir), "transaction-noop-plan");
+}
+
+#define PLAN_CACHE_REMOTE_PREFIX "remote "
+#define PLAN_CACHE_REF_PREFIX "ref "
+
+/* The cache file has the key on its first line, followed by the remotes
+ * and refs it was computed from, one per line, as we only know those
+ * after resolving. */
+static gboolean
+plan_cache_matches (FlatpakTransaction *self,
+                    GChecksum          *key_start)
+{
+  g_autoptr(GFile) cache_file = get_plan_cache_file (self);
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  g_autoptr(GPtrArray) remotes = g_ptr_array_new ();
+  g_autoptr(GPtrArray) refs = g_ptr_array_new ();
+  g_autofree char *plan_key = NULL;
+
+  if (!g_file_load_contents (cache_file, NULL, &contents, NULL, NULL, NULL))
+    return FALSE;
+
+  lines = g_strsplit (contents, "\n", -1);
+  if (lines[0] == NULL)
+    return FALSE;
+
+  for (guint i = 1; lines[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (lines[i], PLAN_CACHE_REMOTE_PREFIX))
+        g_ptr_array_add (remotes, lines[i] + strlen (PLAN_CACHE_REMOTE_PREFIX));
+      else if (g_str_has_prefix (lines[i], PLAN_CACHE_REF_PREFIX))
+        g_ptr_array_add (refs, lines[i] + strlen (PLAN_CACHE_REF_PREFIX));
+    }
+
+  /* Something went wrong when writing it */
+  if (remotes->len == 0)
+    return FALSE;
+
+  plan_key = plan_key_finish (self, key_start, remotes, refs);
+
+  return plan_key != NULL && strcmp (lines[0], plan_key) == 0;
+}
+
+/* We only cache that there was nothing to do, as that is the common case
+ * for repeated update checks, and otherwise the plan gets executed anyway */
+static void
+plan_cache_update (FlatpakTransaction *self,
+                   GChecksum          *key_start)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GFile) cache_file = get_plan_cache_file (self);
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GPtrArray) remotes = g_ptr_array_new ();
+  g_autoptr(GPtrArray) refs = g_ptr_array_new ();
+  g_autoptr(GString) contents = NULL;
+  g_autofree char *plan_key = NULL;
+  gboolean nothing_to_do = TRUE;
+  GList *l;
+
+  for (l = priv->ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+
+      /* The eol signals are emitted during resolve, so don't skip that */
+      if (!op->skip || op->eol != NULL || op->eol_rebase != NULL)
+        {
+          nothing_to_do = FALSE;
+          break;
+        }
+
+      g_ptr_array_add (refs, (char *) flatpak_decomposed_get_ref (op->ref));
+    }
+
+  /* Every remote state resolution looked at is kept here */
+  GLNX_HASH_TABLE_FOREACH (priv->remote_states, const char *, remote)
+    g_ptr_array_add (remotes, (char *) remote);
+
+  if (nothing_to_do && remotes->len > 0)
+    {
+      g_ptr_array_sort (remotes, flatpak_strcmp0_ptr);
+      g_ptr_array_sort (refs, flatpak_strcmp0_ptr);
+      plan_key = plan_key_finish (self, key_start, remotes, refs);
+    }
+
+  if (plan_key == NULL)
+    {
+      (void) g_file_delete (cache_file, NULL, NULL);
+      return;
+    }
+
+  contents = g_string_new (plan_key);
+  g_string_append_c (contents, '\n');
+  for (guint i = 0; i < remotes->len; i++)
+    g_string_append_printf (contents, PLAN_CACHE_REMOTE_PREFIX "%s\n",
+                            (const char *) g_ptr_array_index (remotes, i));
+  for (guint i = 0; i < refs->len; i++)
+    g_string_append_printf (contents, PLAN_CACHE_REF_PREFIX "%s\n",
+                            (const char *) g_ptr_array_index (refs, i));
+
+  if (!flatpak_mkdir_p (flatpak_dir_get_cache_dir (priv->dir), NULL, &local_error) ||
+      !g_file_replace_contents (cache_file, contents->str, contents->len, NULL, FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, &local_error))
+    g_info ("Failed to write transaction plan cache: %s", local_error->message);
+}
+
+/* The journal records how far a transaction got, so that if it gets
+ * interrupted, the next run of the same transaction doesn't have to pull
+ * the operations that were already pulled again. It lives next to the
+ * other per-installation caches, i.e. under repo/tmp for writable
+ * installations. Partially downloaded objects are kept by ostree in its
+ * staging directories, so we don't need to track those ourselves. */
+static GFile *
+get_journal_file (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  GFile *cache_dir = flatpak_dir_get_cache_dir (priv->dir);
+
+  if (cache_dir == NULL)
+    return NULL;
+
+  return g_file_get_child (cache_dir, "transaction-journal");
+}
+
+static void
+journal_save (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GFile) journal_file = get_journal_file (self);
+  g_autoptr(GKeyFile) journal = g_key_file_new ();
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *data = NULL;
+  gsize data_len;
+  gboolean have_entries = FALSE;
+  GList *l;
+
+  if (journal_file == NULL)
+    return;
+
+  g_mutex_lock (&priv->prefetch_lock);
+  for (l = priv->ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+      const char *ref = flatpak_decomposed_get_ref (op->ref);
+
+      /* Only the ops that were pulled but not deployed are of use to a
+       * retry, the deployed ones are no-ops for it anyway */
+      if (op->skip || op->done || !op->prefetched || op->resolved_commit == NULL ||
+          (op->kind != FLATPAK_TRANSACTION_OPERATION_INSTALL &&
+           op->kind != FLATPAK_TRANSACTION_OPERATION_UPDATE))
+        continue;
+
+      g_key_file_set_string (journal, ref, "remote", op->remote);
+      g_key_file_set_string (journal, ref, "commit", op->resolved_commit);
+      have_entries = TRUE;
+    }
+  g_mutex_unlock (&priv->prefetch_lock);
+
+  if (!have_entries)
+    {
+      (void) g_file_delete (journal_file, NULL, NULL);
+      return;
+    }
+
+  data = g_key_file_to_data (journal, &data_len, NULL);
+  if (!flatpak_mkdir_p (flatpak_dir_get_cache_dir (priv->dir), NULL, &local_error) ||
+      !g_file_replace_contents (journal_file, data, data_len, NULL, FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, &local_error))
+    g_info ("Failed to write transaction journal: %s", local_error->message);
+}
+
+static void
+journal_clear (FlatpakTransaction *self)
+{
+  g_autoptr(GFile) journal_file = get_journal_file (self);
+
+  if (journal_file != NULL)
+    (void) g_file_delete (journal_file, NULL, NULL);
+}
+
+/* If a previous run was interrupted after pulling some of the commits we
+ * now resolved to, only deploy those. As the commits were not deployed, a
+ * prune may have removed them since, so check that they are still fully
+ * in the repo. Installs deploy whatever the local ref points to, so also
+ * check that nothing moved that in the meantime. */
+static void
+journal_resume (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GFile) journal_file = get_journal_file (self);
+  g_autoptr(GKeyFile) journal = g_key_file_new ();
+  g_autofree char *journal_path = NULL;
+  OstreeRepo *repo = flatpak_dir_get_repo (priv->dir);
+  guint n_resumed = 0;
+  GList *l;
+
+  if (journal_file == NULL || repo == NULL)
+    return;
+
+  journal_path = g_file_get_path (journal_file);
+  if (!g_key_file_load_from_file (journal, journal_path, G_KEY_FILE_NONE, NULL))
+    return;
+
+  for (l = priv->ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+      const char *ref = flatpak_decomposed_get_ref (op->ref);
+      g_autofree char *remote = NULL;
+      g_autofree char *commit = NULL;
+      g_autofree char *local_commit = NULL;
+      OstreeRepoCommitState commit_state;
+
+      if (op->resolved_commit == NULL || !op_can_prefetch (self, op))
+        continue;
+
+      remote = g_key_file_get_string (journal, ref, "remote", NULL);
+      commit = g_key_file_get_string (journal, ref, "commit", NULL);
+
+      if (g_strcmp0 (remote, op->remote) != 0 ||
+          g_strcmp0 (commit, op->resolved_commit) != 0)
+        continue;
+
+      if (!ostree_repo_load_commit (repo, commit, NULL, &commit_state, NULL) ||
+          (commit_state & OSTREE_REPO_COMMIT_STATE_PARTIAL) != 0)
+        continue;
+
+      local_commit = flatpak_dir_read_latest (priv->dir, op->remote, ref, NULL, NULL, NULL);
+      if (g_strcmp0 (local_commit, commit) != 0)
+        continue;
+
+      op->prefetched = TRUE;
+      n_resumed++;
+    }
+
+  if (n_resumed > 0)
+    g_info ("Resuming interrupted transaction, %u operations already pulled", n_resumed);
+}
+
+static void
+prepare_launch_child_setup (gpointer user_data)
+{
+  /* Runs between fork and exec, so no logging here */
+  setsid ();
+  (void) setpriority (PRIO_PROCESS, 0, 19);
+#ifdef SYS_ioprio_set
+  (void) syscall (SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0,
+                  3 /* IOPRIO_CLASS_IDLE */ << 13);
+#endif
+}
+
+typedef struct
+{
+  char   *app_id;
+  gint64  last_used;
+} PrepareLaunch;
+
+static void
+prepare_launch_free (PrepareLaunch *prepare)
+{
+  g_free (prepare->app_id);
+  g_free (prepare);
+}
+
+static int
+prepare_launch_compare_last_used (gconstpointer a,
+                                  gconstpointer b)
+{
+  const PrepareLaunch *pa = *(const PrepareLaunch **) a;
+  const PrepareLaunch *pb = *(const PrepareLaunch **) b;
+
+  if (pa->last_used != pb->last_used)
+    return pa->last_used > pb->last_used ? -1 : 1;
+
+  return strcmp (pa->app_id, pb->app_id);
+}
+
+/* The option selecting @dir in "flatpak run", or %NULL if it has none */
+static char *
+get_run_installation_arg (FlatpakDir *dir)
+{
+  const char *id = flatpak_dir_get_id (dir);
+
+  if (flatpak_dir_is_user (dir))
+    return g_strdup ("--user");
+  else if (g_strcmp0 (id, SYSTEM_DIR_DEFAULT_ID) == 0)
+    return g_strdup ("--system");
+  else if (id != NULL)
+    return g_strdup_printf ("--installation=%s", id);
+
+  return NULL;
+}
+
+/* At most this many apps are prepared after a transaction, the most
+ * recently used ones first */
+#define PREPARE_LAUNCHES_MAX 4
+
+/* Regenerating the ld.so.cache of an app is the slowest part of its
+ * first launch after it or its runtime was updated. For the apps of this
+ * installation that were run before (they have a data dir) and are
+ * affected by this transaction, start a detached low priority
+ * "flatpak run --prepare-only" so the cache is ready by the time the
+ * user launches them. */
+static void
+prepare_launches (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GHashTable) changed = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GPtrArray) prepares = g_ptr_array_new_with_free_func ((GDestroyNotify) prepare_launch_free);
+  g_autofree char *apps_path = NULL;
+  g_autofree char *installation_arg = NULL;
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  const char *flatpak;
+  GList *l;
+  guint i;
+
+  for (l = priv->ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+
+      if (op->kind != FLATPAK_TRANSACTION_OPERATION_UNINSTALL && !op->skip && !op->failed)
+        g_hash_table_add (changed, (char *) flatpak_decomposed_get_ref (op->ref));
+    }
+
+  if (g_hash_table_size (changed) == 0)
+    return;
+
+  installation_arg = get_run_installation_arg (priv->dir);
+  if (installation_arg == NULL)
+    return;
+
+  apps_path = g_build_filename (g_get_home_dir (), ".var/app", NULL);
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, apps_path, FALSE, &iter, NULL))
+    return;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+      g_autoptr(FlatpakDecomposed) app_ref = NULL;
+      g_autoptr(FlatpakDeploy) deploy = NULL;
+      g_autofree char *runtime = NULL;
+      g_autofree char *runtime_ref = NULL;
+      PrepareLaunch *prepare;
+      GKeyFile *metakey;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL, NULL) || dent == NULL)
+        break;
+
+      if (dent->d_type != DT_DIR ||
+          !glnx_fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, NULL))
+        continue;
+
+      app_ref = flatpak_dir_current_ref (priv->dir, dent->d_name, NULL);
+      if (app_ref == NULL)
+        continue;
+
+      deploy = flatpak_dir_load_deployed (priv->dir, app_ref, NULL, NULL, NULL);
+      if (deploy == NULL)
+        continue;
+
+      metakey = flatpak_deploy_get_metadata (deploy);
+      runtime = g_key_file_get_string (metakey, FLATPAK_METADATA_GROUP_APPLICATION,
+                                       FLATPAK_METADATA_KEY_RUNTIME, NULL);
+      if (runtime != NULL)
+        runtime_ref = g_strconcat ("runtime/", runtime, NULL);
+
+      if (!g_hash_table_contains (changed, flatpak_decomposed_get_ref (app_ref)) &&
+          (runtime_ref == NULL || !g_hash_table_contains (changed, runtime_ref)))
+        continue;
+
+      prepare = g_new0 (PrepareLaunch, 1);
+      prepare->app_id = g_strdup (dent->d_name);
+      prepare->last_used = stbuf.st_mtime;
+      g_ptr_array_add (prepares, prepare);
+    }
+
+  g_ptr_array_sort (prepares, prepare_launch_compare_last_used);
+
+  if ((flatpak = g_getenv ("FLATPAK_BINARY")) == NULL)
+    flatpak = FLATPAK_BINDIR "/flatpak";
+
+  for (i = 0; i < prepares->len && i < PREPARE_LAUNCHES_MAX; i++)
+    {
+      PrepareLaunch *prepare = g_ptr_array_index (prepares, i);
+      const char *argv[] = { flatpak, "run", installation_arg, "--prepare-only", prepare->app_id, NULL };
+      g_autoptr(GError) local_error = NULL;
+
+      g_info ("Regenerating ld.so.cache of %s in the background", prepare->app_id);
+      if (!g_spawn_async (NULL, (char **) argv, NULL,
+                          G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                          prepare_launch_child_setup, NULL, NULL, &local_error))
+        g_info ("Failed to spawn %s: %s", flatpak, local_error->message);
+    }
+}
+
+/* Runs resolve_transaction(), unless the plan cache says it would find
+ * nothing to do */
+static gboolean
+resolve_plan (FlatpakTransaction *self,
+              GCancellable       *cancellable,
+              GError            **error)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GChecksum) key_start = NULL;
+  GList *l;
+
+  key_start = plan_key_start (self);
+  if (key_start != NULL && plan_cache_matches (self, key_start))
+    {
+      /* Nothing the resolution depends on changed since the last time it
+       * found nothing to do, so don't redo it */
+      g_info ("Transaction plan unchanged since last run, nothing to do");
+      for (l = priv->ops; l != NULL; l = l->next)
+        {
+          FlatpakTransactionOperation *op = l->data;
+
+          /* Anything not installed would have had something to do */
+          if (op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL_OR_UPDATE)
+            op->kind = FLATPAK_TRANSACTION_OPERATION_UPDATE;
+          op->skip = TRUE;
+        }
+    }
+  else
+    {
+      if (!resolve_transaction (self, cancellable, error))
+        return FALSE;
+
+      if (key_start != NULL)
+        plan_cache_update (self, key_start);
+    }
+
+  return TRUE;
+}
+
+/* Resolves the transaction the same way flatpak_transaction_run() does,
+ * but stops there: no operations are run, no signals other than those
+ * emitted during resolve are emitted, and no authentication is requested.
+ * Afterwards flatpak_transaction_get_operations() returns what a run would
+ * do, except that the dependencies of refs which need authentication to
+ * read their commits are not followed. */
+gboolean
+flatpak_transaction_resolve_for_update_check (FlatpakTransaction *self,
+                                              GCancellable       *cancellable,
+                                              GError            **error)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  if (!priv->can_run)
+    return flatpak_fail (error, _("Transaction already executed"));
+
+  priv->can_run = FALSE;
+  priv->update_check = TRUE;
+
+  if (!priv->no_pull &&
+      !flatpak_transaction_update_metadata (self, cancellable, error))
+    return FALSE;
+
+  return resolve_plan (self, cancellable, error);
+}
+
+static gboolean
+flatpak_transaction_real_run (FlatpakTransaction *self,
+                              GCancellable       *cancellable,
+                              GError            **error)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  GList *l;
+  gboolean succeeded = TRUE;
+  gboolean needs_prune = FALSE;
+  gboolean needs_triggers = FALSE;
+  gboolean needs_cache_drop = FALSE;
+  gboolean ready_res = FALSE;
+  g_autoptr(GCancellable) prefetch_cancellable = NULL;
+  GThreadPool *prefetch_pool = NULL;
+  gulong cancelled_id = 0;
+  int i;
+
+  if (!priv->can_run)
+    return flatpak_fail (error, _("Transaction already executed"));
+
+  priv->can_run = FALSE;
+
+  priv->current_op = NULL;
+
+  flatpak_dir_set_max_download_rate (priv->dir, priv->max_download_rate);
+  flatpak_dir_set_background_priority (priv->dir, priv->background_priority);
+
+  /* Finish deleting whatever earlier transactions undeployed, in case
+   * they exited before their reaper was done. The system helper does
+   * this itself for system installations. */
+  if (!flatpak_dir_use_system_helper (priv->dir, NULL))
+    flatpak_dir_reap_removed (priv->dir);
+
+  if (flatpak_dir_is_user (priv->dir) && getuid () == 0)
+    {
+      struct stat st_buf;
+      g_autofree char *dir_path = NULL;
+
+      /* Check that it's not root's own user installation */
+      dir_path = g_file_get_path (flatpak_dir_get_path (priv->dir));
+      if (stat (dir_path, &st_buf) == 0 && st_buf.st_uid != 0)
+        return flatpak_fail_error (error, FLATPAK_ERROR_WRONG_USER,
+                                   _("Refusing to operate on a user installation as root! "
+                                     "This can lead to incorrect file ownership and permission errors."));
+    }
+
+  if (!priv->no_pull &&
+      !flatpak_transaction_update_metadata (self, cancellable, error))
+    {
+      g_assert (error == NULL || *error != NULL);
+      return FALSE;
+    }
+
+  if (!flatpak_transaction_add_auto_install (self, cancellable, error))
+    {
+      g_assert (error == NULL || *error != NULL);
+      return FALSE;
+    }
+
+  if (!flatpak_transaction_resolve_flatpakrefs (self, cancellable, error))
+    {
+      g_assert (error == NULL || *error != NULL);
+      return FALSE;
+    }
+
+  if (!flatpak_transaction_resolve_bundles (self, cancellable, error))
+    {
+      g_assert (error == NULL || *error != NULL);
+      return FALSE;
+    }
+
+  if (!flatpak_transaction_resolve_images (self, cancellable, error))
+    {
+      g_assert (error == NULL || *error != NULL);
+      return FALSE;
+    }
+
+  if (!resolve_plan (self, cancellable, error))
+    {
+      g_assert (error == NULL || *error != NULL);
+      return FALSE;
+    }
+
   sort_ops (self);
 
+  /* Nothing looks up refs by name from here on, and the remote states
+   * are kept until the transaction is freed */
+  GLNX_HASH_TABLE_FOREACH_V (priv->remote_states, FlatpakRemoteState *, state)
+    flatpak_remote_state_compact (state);
+
   ready_res = FALSE;
-  g_signal_emit (self, signals[READY_PRE_AUTH], 0, &ready_res);
+  transaction_emit (self, signals[READY_PRE_AUTH], &ready_res);
   if (!ready_res)
     return flatpak_fail_error (error, FLATPAK_ERROR_ABORTED, _("Aborted by user"));
 
@@ -5591,10 +7463,40 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
     }
 
   ready_res = FALSE;
-  g_signal_emit (self, signals[READY], 0, &ready_res);
+  transaction_emit (self, signals[READY], &ready_res);
   if (!ready_res)
     return flatpak_fail_error (error, FLATPAK_ERROR_ABORTED, _("Aborted by user"));
 
+  if (!priv->no_pull)
+    journal_resume (self);
+
+  if (priv->batch_pulls && !priv->no_pull)
+    batch_pull_ops (self, cancellable);
+
+  if ((priv->max_parallel_ops > 1 || priv->pipelined) && !priv->no_pull)
+    {
+      /* This is cancelled if the transaction is aborted, so that pending
+       * pulls don't continue after we stop running ops */
+      prefetch_cancellable = g_cancellable_new ();
+      if (cancellable)
+        cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (cancel_prefetch_cb),
+                                              prefetch_cancellable, NULL);
+
+      prefetch_pool = start_prefetch_ops (self, prefetch_cancellable);
+
+      /* Without pipelining, all the pulls finish before the first deploy */
+      if (!priv->pipelined)
+        finish_prefetch_ops (g_steal_pointer (&prefetch_pool));
+    }
+
+  if (!priv->no_pull)
+    journal_save (self);
+
+  /* Clean up the old exports and mirror refs once after all the ops,
+   * rather than after each */
+  flatpak_dir_set_defer_exports_cleanup (priv->dir, TRUE);
+  flatpak_dir_set_defer_uninstall_cleanup (priv->dir, TRUE);
+
   for (l = priv->ops; l != NULL; l = l->next)
     {
       FlatpakTransactionOperation *op = l->data;
@@ -5608,6 +7510,8 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
 
       priv->current_op = op;
 
+      wait_for_prefetch (self, op);
+
       pref = flatpak_decomposed_get_pref (op->ref);
 
       if (op->fail_if_op_fails && (op->fail_if_op_fails->failed) &&
@@ -5636,6 +7540,11 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
       if (res)
         {
           g_autoptr(GBytes) deploy_data = NULL;
+
+          op->done = TRUE;
+          if (!priv->no_pull)
+            journal_save (self);
+
           /* deploy v4 guarantees eol/eolr info */
           deploy_data = flatpak_dir_get_deploy_data (priv->dir, op->ref, 4, NULL, NULL);
 
@@ -5645,8 +7554,8 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
               const char *eol_rebase = flatpak_deploy_data_get_eol_rebase (deploy_data);
 
               if (eol || eol_rebase)
-                g_signal_emit (self, signals[END_OF_LIFED], 0,
-                               flatpak_decomposed_get_ref (op->ref), eol, eol_rebase);
+                transaction_emit (self, signals[END_OF_LIFED],
+                                  flatpak_decomposed_get_ref (op->ref), eol, eol_rebase);
             }
         }
 
@@ -5660,9 +7569,9 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
           if (op->non_fatal)
             error_details |= FLATPAK_TRANSACTION_ERROR_DETAILS_NON_FATAL;
 
-          g_signal_emit (self, signals[OPERATION_ERROR], 0, op,
-                         local_error, error_details,
-                         &do_cont);
+          transaction_emit (self, signals[OPERATION_ERROR], op,
+                            local_error, error_details,
+                            &do_cont);
 
           if (!do_cont)
             {
@@ -5680,12 +7589,40 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
     }
   priv->current_op = NULL;
 
-  if (needs_triggers)
+  if (prefetch_cancellable)
+    {
+      if (!succeeded)
+        g_cancellable_cancel (prefetch_cancellable);
+      finish_prefetch_ops (g_steal_pointer (&prefetch_pool));
+      g_cancellable_disconnect (cancellable, cancelled_id);
+    }
+
+  /* Keep the journal of failed transactions, so that a retry can use
+   * whatever was pulled in the background before we gave up */
+  if (!priv->no_pull)
+    {
+      if (succeeded)
+        journal_clear (self);
+      else
+        journal_save (self);
+    }
+
+  flatpak_dir_set_defer_exports_cleanup (priv->dir, FALSE);
+  flatpak_dir_flush_exports (priv->dir, cancellable, NULL);
+  flatpak_dir_set_defer_uninstall_cleanup (priv->dir, FALSE);
+  flatpak_dir_flush_uninstall_cleanup (priv->dir, cancellable, NULL);
+
+  /* The triggers are run once for all the ops, and skip themselves if
+   * their inputs didn't change */
+  if (needs_triggers && !priv->disable_triggers)
     flatpak_dir_run_triggers (priv->dir, cancellable, NULL);
 
   if (needs_prune && !priv->disable_prune)
     flatpak_dir_prune (priv->dir, cancellable, NULL);
 
+  if (succeeded && !priv->no_deploy && priv->prepare_launches)
+    prepare_launches (self);
+
   for (i = 0; i < priv->added_origin_remotes->len; i++)
     flatpak_dir_prune_origin_remote (priv->dir, g_ptr_array_index (priv->added_origin_remotes, i));
 
@@ -177,6 +177,10 @@ FLATPAK_EXTERN
 guint64     flatpak_transaction_progress_get_start_time (FlatpakTransactionProgress *self);
 FLATPAK_EXTERN
 guint64     flatpak_transaction_progress_get_bytes_per_second (FlatpakTransactionProgress *self);
+FLATPAK_EXTERN
+void        flatpak_transaction_progress_set_thresholds (FlatpakTransactionProgress *self,
+                                                         guint                       progress_step,
+                                                         guint64                     bytes_step);
 
 
 FLATPAK_EXTERN
@@ -206,6 +210,8 @@ const char * const *            flatpak_transaction_operation_get_subpaths (Flat
 FLATPAK_EXTERN
 gboolean                        flatpak_transaction_operation_get_requires_authentication (FlatpakTransactionOperation *self);
 FLATPAK_EXTERN
+GVariant *                      flatpak_transaction_operation_get_metrics (FlatpakTransactionOperation *self);
+FLATPAK_EXTERN
 const char *                    flatpak_transaction_operation_type_to_string (FlatpakTransactionOperationType kind);
 
 FLATPAK_EXTERN
@@ -225,6 +231,9 @@ FLATPAK_EXTERN
 void                flatpak_transaction_set_disable_prune (FlatpakTransaction *self,
                                                            gboolean            disable_prune);
 FLATPAK_EXTERN
+void                flatpak_transaction_set_disable_triggers (FlatpakTransaction *self,
+                                                              gboolean            disable_triggers);
+FLATPAK_EXTERN
 void                flatpak_transaction_set_disable_dependencies (FlatpakTransaction *self,
                                                                   gboolean            disable_dependencies);
 FLATPAK_EXTERN
@@ -268,6 +277,41 @@ void                flatpak_transaction_set_auto_install_debug (FlatpakTransacti
 FLATPAK_EXTERN
 gboolean            flatpak_transaction_get_auto_install_debug (FlatpakTransaction *self);
 FLATPAK_EXTERN
+void                flatpak_transaction_set_max_parallel_ops (FlatpakTransaction *self,
+                                                              guint               max_parallel_ops);
+FLATPAK_EXTERN
+guint               flatpak_transaction_get_max_parallel_ops (FlatpakTransaction *self);
+FLATPAK_EXTERN
+void                flatpak_transaction_set_pipelined (FlatpakTransaction *self,
+                                                       gboolean            pipelined);
+FLATPAK_EXTERN
+gboolean            flatpak_transaction_get_pipelined (FlatpakTransaction *self);
+FLATPAK_EXTERN
+void                flatpak_transaction_set_batch_pulls (FlatpakTransaction *self,
+                                                         gboolean            batch_pulls);
+FLATPAK_EXTERN
+gboolean            flatpak_transaction_get_batch_pulls (FlatpakTransaction *self);
+FLATPAK_EXTERN
+void                flatpak_transaction_set_prefer_small_downloads (FlatpakTransaction *self,
+                                                                    gboolean            prefer_small_downloads);
+FLATPAK_EXTERN
+gboolean            flatpak_transaction_get_prefer_small_downloads (FlatpakTransaction *self);
+FLATPAK_EXTERN
+void                flatpak_transaction_set_max_download_rate (FlatpakTransaction *self,
+                                                               guint64             bytes_per_sec);
+FLATPAK_EXTERN
+guint64             flatpak_transaction_get_max_download_rate (FlatpakTransaction *self);
+FLATPAK_EXTERN
+void                flatpak_transaction_set_background_priority (FlatpakTransaction *self,
+                                                                 gboolean            background_priority);
+FLATPAK_EXTERN
+gboolean            flatpak_transaction_get_background_priority (FlatpakTransaction *self);
+FLATPAK_EXTERN
+void                flatpak_transaction_set_prepare_launches (FlatpakTransaction *self,
+                                                              gboolean            prepare_launches);
+FLATPAK_EXTERN
+gboolean            flatpak_transaction_get_prepare_launches (FlatpakTransaction *self);
+FLATPAK_EXTERN
 void                flatpak_transaction_add_dependency_source (FlatpakTransaction  *self,
                                                                FlatpakInstallation *installation);
 FLATPAK_EXTERN
@@ -285,6 +329,15 @@ gboolean            flatpak_transaction_run (FlatpakTransaction *transaction,
                                              GCancellable       *cancellable,
                                              GError            **error);
 FLATPAK_EXTERN
+void                flatpak_transaction_run_async (FlatpakTransaction  *transaction,
+                                                   GCancellable        *cancellable,
+                                                   GAsyncReadyCallback  callback,
+                                                   gpointer             user_data);
+FLATPAK_EXTERN
+gboolean            flatpak_transaction_run_finish (FlatpakTransaction *transaction,
+                                                    GAsyncResult       *result,
+                                                    GError            **error);
+FLATPAK_EXTERN
 FlatpakTransactionOperation *flatpak_transaction_get_current_operation (FlatpakTransaction *self);
 FLATPAK_EXTERN
 FlatpakTransactionOperation *flatpak_transaction_get_operation_for_ref (FlatpakTransaction  *self,
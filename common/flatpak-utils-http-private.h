@@ -36,6 +36,10 @@ typedef struct FlatpakHttpSession FlatpakHttpSession;
 
 FlatpakHttpSession* flatpak_create_http_session (const char *user_agent);
 void flatpak_http_session_free (FlatpakHttpSession* http_session);
+void flatpak_http_session_set_max_recv_speed (FlatpakHttpSession *http_session,
+                                              guint64             bytes_per_sec);
+void flatpak_http_session_set_http3 (FlatpakHttpSession *http_session,
+                                     gboolean            enable);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(FlatpakHttpSession, flatpak_http_session_free)
 
@@ -54,6 +58,18 @@ typedef enum {
   FLATPAK_HTTP_FLAGS_STORE_COMPRESSED = 1 << 1,
   FLATPAK_HTTP_FLAGS_NOCHECK_STATUS = 1 << 2,
   FLATPAK_HTTP_FLAGS_HEAD = 1 << 3,
+  /* Writing to the output can block for a long time (e.g. it is a pipe),
+   * so don't let it hold up the other requests of the session */
+  FLATPAK_HTTP_FLAGS_NO_MULTIPLEX = 1 << 4,
+  /* Keep the response in the shared http cache, and revalidate it from
+   * there next time. Only for flatpak_load_uri_full() requests which
+   * aren't authenticated and don't need the response headers. */
+  FLATPAK_HTTP_FLAGS_USE_CACHE = 1 << 5,
+  /* Try HTTP/3, falling back to earlier versions, if curl supports it */
+  FLATPAK_HTTP_FLAGS_HTTP3 = 1 << 6,
+  /* The server may well be gone (e.g. it is another machine on the local
+   * network), so use short timeouts and don't retry */
+  FLATPAK_HTTP_FLAGS_FAIL_FAST = 1 << 7,
 } FlatpakHTTPFlags;
 
 typedef void (*FlatpakLoadUriProgress) (guint64  downloaded_bytes,
@@ -91,6 +107,28 @@ gboolean flatpak_download_http_uri (FlatpakHttpSession    *http_session,
                                     gpointer               user_data,
                                     GCancellable          *cancellable,
                                     GError               **error);
+gboolean flatpak_download_http_uri_range (FlatpakHttpSession    *http_session,
+                                          const char            *uri,
+                                          FlatpakCertificates   *certificates,
+                                          FlatpakHTTPFlags       flags,
+                                          guint64                offset,
+                                          guint64                length,
+                                          GOutputStream         *out,
+                                          const char            *token,
+                                          FlatpakLoadUriProgress progress,
+                                          gpointer               user_data,
+                                          GCancellable          *cancellable,
+                                          GError               **error);
+gboolean flatpak_download_http_uri_resumable (FlatpakHttpSession    *http_session,
+                                              const char            *uri,
+                                              FlatpakCertificates   *certificates,
+                                              FlatpakHTTPFlags       flags,
+                                              int                    dest_dfd,
+                                              const char            *dest_subpath,
+                                              FlatpakLoadUriProgress progress,
+                                              gpointer               user_data,
+                                              GCancellable          *cancellable,
+                                              GError               **error);
 gboolean flatpak_cache_http_uri (FlatpakHttpSession    *http_session,
                                  const char            *uri,
                                  FlatpakCertificates   *certificates,
@@ -102,4 +140,47 @@ gboolean flatpak_cache_http_uri (FlatpakHttpSession    *http_session,
                                  GCancellable          *cancellable,
                                  GError               **error);
 
+void flatpak_load_uri_full_async (FlatpakHttpSession    *http_session,
+                                  const char            *uri,
+                                  FlatpakCertificates   *certificates,
+                                  FlatpakHTTPFlags       flags,
+                                  const char            *auth,
+                                  const char            *token,
+                                  FlatpakLoadUriProgress progress,
+                                  gpointer               progress_data,
+                                  GCancellable          *cancellable,
+                                  GAsyncReadyCallback    callback,
+                                  gpointer               user_data);
+GBytes * flatpak_load_uri_full_finish (GAsyncResult *result,
+                                       int          *out_status,
+                                       char        **out_content_type,
+                                       char        **out_www_authenticate,
+                                       GError      **error);
+void flatpak_download_http_uri_async (FlatpakHttpSession    *http_session,
+                                      const char            *uri,
+                                      FlatpakCertificates   *certificates,
+                                      FlatpakHTTPFlags       flags,
+                                      GOutputStream         *out,
+                                      const char            *token,
+                                      FlatpakLoadUriProgress progress,
+                                      gpointer               progress_data,
+                                      GCancellable          *cancellable,
+                                      GAsyncReadyCallback    callback,
+                                      gpointer               user_data);
+gboolean flatpak_download_http_uri_finish (GAsyncResult *result,
+                                           GError      **error);
+void flatpak_cache_http_uri_async (FlatpakHttpSession    *http_session,
+                                   const char            *uri,
+                                   FlatpakCertificates   *certificates,
+                                   FlatpakHTTPFlags       flags,
+                                   int                    dest_dfd,
+                                   const char            *dest_subpath,
+                                   FlatpakLoadUriProgress progress,
+                                   gpointer               progress_data,
+                                   GCancellable          *cancellable,
+                                   GAsyncReadyCallback    callback,
+                                   gpointer               user_data);
+gboolean flatpak_cache_http_uri_finish (GAsyncResult *result,
+                                        GError      **error);
+
 #endif /* __FLATPAK_UTILS_HTTP_H__ */
@@ -25,10 +25,12 @@
 #include "flatpak-utils-http-private.h"
 #include "flatpak-uri-private.h"
 #include "flatpak-oci-registry-private.h"
+#include "flatpak-trace-private.h"
 
 #include <gio/gunixoutputstream.h>
 #include "libglnx.h"
 
+#include <sys/file.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <curl/curl.h>
@@ -44,11 +46,32 @@
 #define CURL_AT_LEAST_VERSION(x,y,z) (LIBCURL_VERSION_NUM >= CURL_VERSION_BITS(x, y, z))
 #endif
 
+#if CURL_AT_LEAST_VERSION(7, 68, 0)
+/* Needs curl_multi_poll() and curl_multi_wakeup() */
+#define HTTP_SESSION_USE_MULTI 1
+#endif
+
+#if CURL_AT_LEAST_VERSION(7, 88, 0)
+/* Before this, CURL_HTTP_VERSION_3 didn't fall back to earlier versions */
+#define HTTP_SESSION_HTTP3 1
+#endif
+
+#if CURL_AT_LEAST_VERSION(8, 12, 0) && defined(CURL_VERSION_SSLS_EXPORT)
+/* Needs curl_easy_ssls_import() and curl_easy_ssls_export() */
+#define HTTP_SESSION_PERSIST_TLS 1
+#endif
+
 #define FLATPAK_HTTP_TIMEOUT_SECS 60
+#define FLATPAK_HTTP_FAIL_FAST_TIMEOUT_SECS 3
 
 /* copied from libostree */
 #define DEFAULT_N_NETWORK_RETRIES 5
 
+/* The delay before a retry doubles with each attempt, from the initial
+ * one up to the max one. */
+#define RETRY_INITIAL_DELAY_MSEC 250
+#define RETRY_MAX_DELAY_MSEC 8000
+
 G_DEFINE_QUARK (flatpak_http_error, flatpak_http_error)
 
 /* Holds information about CA and client certificates found in
@@ -90,6 +113,17 @@ typedef struct
   gpointer               user_data;
   CacheHttpData         *cache_data;
 
+  /* If set, ask only for the part of the file after resume_offset, which we
+   * already have, if it still matches resume_validator (an ETag or http date) */
+  guint64                resume_offset;
+  char                  *resume_validator;
+  gboolean               no_content_encoding;
+
+  /* If range_length is set, ask only for that many bytes of the file,
+   * starting at range_start (plus resume_offset when resuming) */
+  guint64                range_start;
+  guint64                range_length;
+
   /* Output from the request, set even on http server errors */
 
   guint64               downloaded_bytes;
@@ -101,6 +135,7 @@ typedef struct
   char                  *hdr_cache_control;
   char                  *hdr_expires;
   char                  *hdr_content_encoding;
+  char                  *hdr_content_range;
 
   /* Data destination */
 
@@ -113,7 +148,11 @@ typedef struct
 
   char                   buffer[16 * 1024];
   guint64                last_progress_time;
+  FlatpakHttpSession    *session;
+  gboolean               multiplexed;
   gboolean               store_compressed;
+  gboolean               got_data;
+  gboolean               range_not_honored;
 
 } LoadUriData;
 
@@ -127,6 +166,7 @@ clear_load_uri_data_headers (LoadUriData *data)
   g_clear_pointer (&data->hdr_cache_control, g_free);
   g_clear_pointer (&data->hdr_expires, g_free);
   g_clear_pointer (&data->hdr_content_encoding, g_free);
+  g_clear_pointer (&data->hdr_content_range, g_free);
 }
 
 /* Reset between requests retries */
@@ -136,6 +176,10 @@ reset_load_uri_data (LoadUriData *data)
   g_clear_error (&data->error);
   data->status = 0;
   data->downloaded_bytes = 0;
+  data->got_data = FALSE;
+  data->range_not_honored = FALSE;
+  data->resume_offset = 0;
+  g_clear_pointer (&data->resume_validator, g_free);
   if (data->content)
     g_string_set_size (data->content, 0);
 
@@ -152,6 +196,101 @@ reset_load_uri_data (LoadUriData *data)
     data->progress (0, data->user_data);
 }
 
+/* Returns a value for If-Range that makes sure a range request gets a
+ * part of the same version of the file as the previous response, or %NULL
+ * if the server gave us nothing that can be used for that. */
+static char *
+get_range_validator (const char *etag,
+                     const char *last_modified)
+{
+  /* Weak etags are not allowed in If-Range */
+  if (etag != NULL && *etag != '\0' && !g_str_has_prefix (etag, "W/"))
+    return g_strdup (etag);
+
+  if (last_modified != NULL && *last_modified != '\0')
+    return g_strdup (last_modified);
+
+  return NULL;
+}
+
+/* Set up for retrying a request that failed after getting some of the
+ * data, so that it continues where it stopped rather than starting over.
+ * Returns %FALSE if that is not possible, and the data is kept as is. */
+static gboolean
+prepare_resume_load_uri_data (LoadUriData *data)
+{
+  g_autofree char *validator = NULL;
+
+  /* The cache code writes to a new tmpfile each time, and may compress it */
+  if (data->out_tmpfile != NULL)
+    return FALSE;
+
+  /* Byte ranges are in the encoded data, but we get it decoded */
+  if (data->hdr_content_encoding != NULL &&
+      g_ascii_strcasecmp (data->hdr_content_encoding, "identity") != 0)
+    return FALSE;
+
+  validator = get_range_validator (data->hdr_etag, data->hdr_last_modified);
+  if (validator == NULL)
+    return FALSE;
+
+  g_info ("Resuming download at byte %" G_GUINT64_FORMAT, data->downloaded_bytes);
+
+  g_clear_error (&data->error);
+  data->status = 0;
+  data->got_data = FALSE;
+  data->resume_offset = data->downloaded_bytes;
+  g_free (data->resume_validator);
+  data->resume_validator = g_steal_pointer (&validator);
+
+  clear_load_uri_data_headers (data);
+
+  return TRUE;
+}
+
+/* Called when the first data of a response arrives. If we asked for a range
+ * but the server sent the whole file instead, drop what we had and start
+ * over from the beginning. That is not possible if the caller only wants
+ * a part of the file, so then this fails. */
+static gboolean
+check_resumed_response (LoadUriData *data)
+{
+  g_autofree char *expected_range = NULL;
+
+  if (data->resume_offset == 0 && data->range_length == 0)
+    return TRUE;
+
+  expected_range = g_strdup_printf ("bytes %" G_GUINT64_FORMAT "-", data->range_start + data->resume_offset);
+  if (data->hdr_content_range != NULL &&
+      g_str_has_prefix (data->hdr_content_range, expected_range))
+    return TRUE;
+
+  if (data->range_length > 0)
+    {
+      data->range_not_honored = TRUE;
+      return FALSE;
+    }
+
+  g_info ("Server did not honor range request, restarting download");
+
+  data->resume_offset = 0;
+  g_clear_pointer (&data->resume_validator, g_free);
+  data->downloaded_bytes = 0;
+
+  if (data->content)
+    {
+      g_string_set_size (data->content, 0);
+      return TRUE;
+    }
+
+  if (data->out != NULL && G_IS_SEEKABLE (data->out) &&
+      g_seekable_can_truncate (G_SEEKABLE (data->out)))
+    return g_seekable_truncate (G_SEEKABLE (data->out), 0, NULL, NULL) &&
+           g_seekable_seek (G_SEEKABLE (data->out), 0, G_SEEK_SET, NULL, NULL);
+
+  return FALSE;
+}
+
 /* Free allocated data at end of full repeated download */
 static void
 clear_load_uri_data (LoadUriData *data)
@@ -163,6 +302,7 @@ clear_load_uri_data (LoadUriData *data)
     }
 
   g_clear_error (&data->error);
+  g_clear_pointer (&data->resume_validator, g_free);
 
   clear_load_uri_data_headers (data);
 }
@@ -379,9 +519,31 @@ typedef struct curl_slist auto_curl_slist;
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (auto_curl_slist, curl_slist_free_all)
 
+/* A session keeps a curl handle per concurrent request, but they all share
+ * the connection, DNS and TLS session caches, so that parallel requests to
+ * the same server reuse the connections of the previous ones.
+ *
+ * Where curl supports it the requests are run by a thread of the session
+ * on a curl multi handle, while the callers wait for them. That way
+ * concurrent requests to a HTTP/2 server are multiplexed over a single
+ * connection, rather than each opening its own. */
 struct FlatpakHttpSession {
-  CURL *curl;
+  char *user_agent;
+  CURLSH *share;
+  GMutex share_locks[CURL_LOCK_DATA_LAST];
   GMutex lock;
+  GPtrArray *idle_curls; /* protected by lock */
+  guint64 max_recv_speed; /* protected by lock */
+  FlatpakHTTPFlags flags; /* protected by lock, added to all requests */
+  char *altsvc_path;
+#ifdef HTTP_SESSION_USE_MULTI
+  CURLM *multi;
+  GThread *multi_thread;
+  GMutex multi_lock;
+  GCond multi_cond;
+  GPtrArray *new_transfers; /* protected by multi_lock */
+  gboolean multi_quit; /* protected by multi_lock */
+#endif
 };
 
 static void
@@ -432,6 +594,7 @@ _header_cb (char *buffer,
   check_header(&data->hdr_cache_control, "Cache-Control", buffer, realsize);
   check_header(&data->hdr_expires, "Expires", buffer, realsize);
   check_header(&data->hdr_content_encoding, "Content-Encoding", buffer, realsize);
+  check_header(&data->hdr_content_range, "Content-Range", buffer, realsize);
 
   return realsize;
 }
@@ -478,6 +641,13 @@ _write_cb (void *content_data,
   if (g_cancellable_is_cancelled (data->cancellable))
     return 0; /* Returning 0 (short read) makes curl abort the transfer */
 
+  if (!data->got_data)
+    {
+      data->got_data = TRUE;
+      if (!check_resumed_response (data))
+        return 0;
+    }
+
   if (data->content)
     {
       g_string_append_len (data->content, content_data, realsize);
@@ -491,6 +661,18 @@ _write_cb (void *content_data,
         return n_written;
     }
 
+#ifdef HTTP_SESSION_USE_MULTI
+  if (data->multiplexed)
+    {
+      /* We're on the session thread, the caller reports the progress */
+      g_mutex_lock (&data->session->multi_lock);
+      data->downloaded_bytes += realsize;
+      g_mutex_unlock (&data->session->multi_lock);
+
+      return realsize;
+    }
+#endif
+
   data->downloaded_bytes += realsize;
 
   if (g_get_monotonic_time () - data->last_progress_time > 1 * G_USEC_PER_SEC)
@@ -503,19 +685,39 @@ _write_cb (void *content_data,
   return realsize;
 }
 
-FlatpakHttpSession *
-flatpak_create_http_session (const char *user_agent)
+static void
+share_lock_cb (CURL             *handle,
+               curl_lock_data    data,
+               curl_lock_access  access,
+               void             *userptr)
+{
+  FlatpakHttpSession *session = userptr;
+
+  g_mutex_lock (&session->share_locks[data]);
+}
+
+static void
+share_unlock_cb (CURL           *handle,
+                 curl_lock_data  data,
+                 void           *userptr)
+{
+  FlatpakHttpSession *session = userptr;
+
+  g_mutex_unlock (&session->share_locks[data]);
+}
+
+static CURL *
+http_session_new_curl (FlatpakHttpSession *session)
 {
-  FlatpakHttpSession *session = g_new0 (FlatpakHttpSession, 1);
   CURLcode rc;
   CURL *curl;
 
-  session->curl = curl = curl_easy_init();
-  g_assert (session->curl != NULL);
+  curl = curl_easy_init();
+  g_assert (curl != NULL);
 
-  g_mutex_init (&session->lock);
+  curl_easy_setopt (curl, CURLOPT_SHARE, session->share);
 
-  curl_easy_setopt (curl, CURLOPT_USERAGENT, user_agent);
+  curl_easy_setopt (curl, CURLOPT_USERAGENT, session->user_agent);
 #if CURL_AT_LEAST_VERSION(7, 85, 0)
   rc = curl_easy_setopt (curl, CURLOPT_PROTOCOLS_STR, "http,https");
 #else
@@ -530,16 +732,6 @@ flatpak_create_http_session (const char *user_agent)
   if (g_getenv ("OSTREE_DEBUG_HTTP"))
     curl_easy_setopt (curl, CURLOPT_VERBOSE, 1L);
 
-  /* Picked the current version in F25 as of 20170127, since
-   * there are numerous HTTP/2 fixes since the original version in
-   * libcurl 7.43.0.
-   */
-#if CURL_AT_LEAST_VERSION(7, 51, 0)
-  if ((curl_version_info (CURLVERSION_NOW))->features & CURL_VERSION_HTTP2) {
-    rc = curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_0);
-    g_assert (rc == CURLE_OK);
-  }
-#endif
   /* https://github.com/curl/curl/blob/curl-7_53_0/docs/examples/http2-download.c */
 #if (CURLPIPE_MULTIPLEX > 0)
   /* wait for pipe connection to confirm */
@@ -560,187 +752,833 @@ flatpak_create_http_session (const char *user_agent)
   curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)FLATPAK_HTTP_TIMEOUT_SECS);
   curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 10000L);
 
-  return session;
+  return curl;
 }
 
-void
-flatpak_http_session_free (FlatpakHttpSession* session)
-{
-  g_mutex_lock (&session->lock);
-  curl_easy_cleanup (session->curl);
-  g_mutex_unlock (&session->lock);
-  g_mutex_clear (&session->lock);
-  g_free (session);
-}
+#ifdef HTTP_SESSION_USE_MULTI
 
-static void
-set_error_from_curl (GError        **error,
-                     const char     *uri,
-                     CURLcode        res,
-                     GCancellable   *cancellable)
+typedef struct {
+  CURL    *curl;
+  CURLcode result;
+  gboolean done; /* protected by multi_lock */
+
+  /* If set, called on the session thread when the transfer is done */
+  void   (*done_func) (gpointer user_data);
+  gpointer user_data;
+} HttpTransfer;
+
+static gpointer
+http_session_multi_thread_func (gpointer user_data)
 {
-  GQuark domain = G_IO_ERROR;
-  int code;
+  FlatpakHttpSession *session = user_data;
 
-  switch (res)
+  while (TRUE)
     {
-    case CURLE_WRITE_ERROR:
-      /* Check if this was due to cancellation */
-      if (g_cancellable_is_cancelled (cancellable))
-        code = G_IO_ERROR_CANCELLED;
-      else
-        code = G_IO_ERROR_FAILED;
-      break;
-    case CURLE_COULDNT_CONNECT:
-    case CURLE_COULDNT_RESOLVE_HOST:
-    case CURLE_COULDNT_RESOLVE_PROXY:
-      code = G_IO_ERROR_HOST_NOT_FOUND;
-      break;
-    case CURLE_OPERATION_TIMEDOUT:
-      code = G_IO_ERROR_TIMED_OUT;
-      break;
-    default:
-      code =  G_IO_ERROR_FAILED;
+      CURLMsg *msg;
+      int n_running, n_msgs;
+
+      g_mutex_lock (&session->multi_lock);
+      if (session->multi_quit)
+        {
+          g_mutex_unlock (&session->multi_lock);
+          break;
+        }
+
+      for (guint i = 0; i < session->new_transfers->len; i++)
+        {
+          HttpTransfer *transfer = g_ptr_array_index (session->new_transfers, i);
+          curl_multi_add_handle (session->multi, transfer->curl);
+        }
+      g_ptr_array_set_size (session->new_transfers, 0);
+      g_mutex_unlock (&session->multi_lock);
+
+      curl_multi_perform (session->multi, &n_running);
+
+      while ((msg = curl_multi_info_read (session->multi, &n_msgs)) != NULL)
+        {
+          CURL *curl = msg->easy_handle;
+          CURLcode result = msg->data.result;
+          HttpTransfer *transfer = NULL;
+          void (*done_func) (gpointer user_data);
+          gpointer done_data;
+
+          if (msg->msg != CURLMSG_DONE)
+            continue;
+
+          /* This invalidates msg */
+          curl_multi_remove_handle (session->multi, curl);
+
+          curl_easy_getinfo (curl, CURLINFO_PRIVATE, (char **) &transfer);
+
+          /* A waiting caller may free the transfer as soon as it is done */
+          g_mutex_lock (&session->multi_lock);
+          done_func = transfer->done_func;
+          done_data = transfer->user_data;
+          transfer->result = result;
+          transfer->done = TRUE;
+          g_cond_broadcast (&session->multi_cond);
+          g_mutex_unlock (&session->multi_lock);
+
+          if (done_func)
+            done_func (done_data);
+        }
+
+      curl_multi_poll (session->multi, NULL, 0, 1000, NULL);
     }
 
-  g_set_error (error, domain, code,
-               "While fetching %s: [%u] %s", uri, res,
-               curl_easy_strerror (res));
+  return NULL;
 }
 
-static gboolean
-flatpak_download_http_uri_once (FlatpakHttpSession    *session,
-                                LoadUriData           *data,
-                                const char            *uri,
-                                GError               **error)
+/* Hands @transfer over to the session thread, which runs it */
+static void
+http_session_start_transfer (FlatpakHttpSession *session,
+                             HttpTransfer       *transfer)
 {
-  CURLcode res;
-  g_autofree char *auth_header = NULL;
-  g_autofree char *cache_header = NULL;
-  g_autoptr(auto_curl_slist) header_list = NULL;
-  g_autoptr(GMutexLocker) curl_lock = g_mutex_locker_new (&session->lock);
-  long response;
-  CURL *curl = session->curl;
+  curl_easy_setopt (transfer->curl, CURLOPT_PRIVATE, (char *) transfer);
 
-  g_info ("Loading %s using curl", uri);
+  g_mutex_lock (&session->multi_lock);
+  if (session->multi_thread == NULL)
+    session->multi_thread = g_thread_new ("http-session", http_session_multi_thread_func, session);
+  g_ptr_array_add (session->new_transfers, transfer);
+  g_mutex_unlock (&session->multi_lock);
 
-  curl_easy_setopt (curl, CURLOPT_URL, uri);
-  curl_easy_setopt (curl, CURLOPT_WRITEDATA, (void *)data);
-  curl_easy_setopt (curl, CURLOPT_HEADERDATA, (void *)data);
+  curl_multi_wakeup (session->multi);
+}
 
-  curl_easy_setopt (curl, CURLOPT_CAINFO, NULL);
-  curl_easy_setopt (curl, CURLOPT_SSLCERT, NULL);
-  curl_easy_setopt (curl, CURLOPT_SSLKEY, NULL);
+/* Runs the request on the session thread and waits for it, reporting
+ * progress from this thread meanwhile */
+static CURLcode
+http_session_perform_multi (FlatpakHttpSession *session,
+                            CURL               *curl,
+                            LoadUriData        *data)
+{
+  HttpTransfer transfer = { curl, CURLE_OK, FALSE };
 
-  if (data->certificates)
+  http_session_start_transfer (session, &transfer);
+
+  g_mutex_lock (&session->multi_lock);
+  while (!transfer.done)
     {
-      if (data->certificates->ca_cert_file)
-        curl_easy_setopt (curl, CURLOPT_CAINFO, data->certificates->ca_cert_file);
+      g_cond_wait_until (&session->multi_cond, &session->multi_lock,
+                         g_get_monotonic_time () + G_USEC_PER_SEC);
 
-      if (data->certificates->client_cert_file)
+      if (!transfer.done && data->progress &&
+          g_get_monotonic_time () - data->last_progress_time > 1 * G_USEC_PER_SEC)
         {
-          curl_easy_setopt (curl, CURLOPT_SSLCERT, data->certificates->client_cert_file);
-          curl_easy_setopt (curl, CURLOPT_SSLKEY, data->certificates->client_key_file);
+          guint64 downloaded_bytes = data->downloaded_bytes;
+
+          g_mutex_unlock (&session->multi_lock);
+          data->progress (downloaded_bytes, data->user_data);
+          data->last_progress_time = g_get_monotonic_time ();
+          g_mutex_lock (&session->multi_lock);
         }
     }
+  g_mutex_unlock (&session->multi_lock);
 
-  if (data->flags & FLATPAK_HTTP_FLAGS_HEAD)
-    curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
-  else
-    curl_easy_setopt (curl, CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt (curl, CURLOPT_PRIVATE, NULL);
 
-  if (data->flags & FLATPAK_HTTP_FLAGS_ACCEPT_OCI)
-    header_list = curl_slist_append (header_list,
-                                     "Accept: " FLATPAK_OCI_MEDIA_TYPE_IMAGE_MANIFEST ", " FLATPAK_DOCKER_MEDIA_TYPE_IMAGE_MANIFEST2 ", " FLATPAK_OCI_MEDIA_TYPE_IMAGE_INDEX);
+  return transfer.result;
+}
 
-  if (data->auth)
-    auth_header = g_strdup_printf ("Authorization: Basic %s", data->auth);
-  else if (data->token)
-    auth_header = g_strdup_printf ("Authorization: Bearer %s", data->token);
-  if (auth_header)
-    header_list = curl_slist_append (header_list, auth_header);
+#endif
 
-  if (data->cache_data)
+static CURLcode
+http_session_perform (FlatpakHttpSession *session,
+                      CURL               *curl,
+                      LoadUriData        *data)
+{
+#ifdef HTTP_SESSION_USE_MULTI
+  if ((data->flags & FLATPAK_HTTP_FLAGS_NO_MULTIPLEX) == 0)
     {
-      CacheHttpData *cache_data = data->cache_data;
+      CURLcode res;
 
-      if (cache_data->etag && cache_data->etag[0])
-        cache_header = g_strdup_printf ("If-None-Match: %s", cache_data->etag);
-      else if (cache_data->last_modified != 0)
-        {
-          g_autoptr(GDateTime) date = g_date_time_new_from_unix_utc (cache_data->last_modified);
-          g_autofree char *date_str = flatpak_format_http_date (date);
-          cache_header = g_strdup_printf ("If-Modified-Since: %s", date_str);
-        }
-      if (cache_header)
-        header_list = curl_slist_append (header_list, cache_header);
+      data->session = session;
+      data->multiplexed = TRUE;
+      res = http_session_perform_multi (session, curl, data);
+      data->multiplexed = FALSE;
+
+      return res;
     }
+#endif
 
-  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, header_list);
+  return curl_easy_perform (curl);
+}
 
-  if (data->flags & FLATPAK_HTTP_FLAGS_STORE_COMPRESSED)
-    {
-      curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
-      curl_easy_setopt(curl, CURLOPT_HTTP_CONTENT_DECODING, 0L);
-      data->store_compressed = TRUE;
-    }
-  else
-    {
-      /* enable all supported built-in compressions */
-      curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
-      curl_easy_setopt(curl, CURLOPT_HTTP_CONTENT_DECODING, 1L);
-      data->store_compressed = FALSE;
-    }
+#ifdef HTTP_SESSION_PERSIST_TLS
 
-  res = curl_easy_perform (session->curl);
+/* The TLS sessions of the server connections are kept between runs, so
+ * the next run can resume them rather than doing full handshakes. They
+ * are secrets, so this is only readable by the user. DNS results are not
+ * kept, as they would outlive their TTL. Each session is stored with the
+ * time it expires at, which is also used to keep the newest ones. */
+#define TLS_SESSIONS_FILE "tls-sessions"
+#define TLS_SESSIONS_LOCK_FILE "tls-sessions.lock"
+#define TLS_SESSIONS_TYPE "a(sayayx)"
+#define TLS_SESSIONS_MAX 64
 
-  curl_easy_setopt (session->curl, CURLOPT_HTTPHEADER, NULL); /* Don't point to freed list */
+static char *
+get_tls_sessions_dir (void)
+{
+  return g_build_filename (g_get_user_cache_dir (), "flatpak", NULL);
+}
 
-  if (res != CURLE_OK)
-    {
-      set_error_from_curl (error, uri, res, data->cancellable);
+static gboolean
+tls_sessions_supported (void)
+{
+  return ((curl_version_info (CURLVERSION_NOW))->features & CURL_VERSION_SSLS_EXPORT) != 0;
+}
 
-      /* Make sure we clear the tmpfile stream we possible created during the request */
-      if (data->out_tmpfile && data->out)
-        g_clear_pointer (&data->out, g_object_unref);
+static GVariant *
+load_tls_sessions (const char *dir)
+{
+  g_autofree char *path = g_build_filename (dir, TLS_SESSIONS_FILE, NULL);
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
 
-      return FALSE;
-    }
+  mfile = g_mapped_file_new (path, FALSE, NULL);
+  if (mfile == NULL)
+    return NULL;
 
-  if (data->out_tmpfile && data->out)
+  bytes = g_mapped_file_get_bytes (mfile);
+  return g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (TLS_SESSIONS_TYPE), bytes, FALSE));
+}
+
+/* Imports the saved TLS sessions into the share of @curl */
+static void
+http_session_import_tls_sessions (CURL *curl)
+{
+  g_autofree char *dir = get_tls_sessions_dir ();
+  g_autoptr(GVariant) sessions = NULL;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  GVariantIter iter;
+  const char *session_key;
+  GVariant *shmac_v, *sdata_v;
+  gint64 valid_until;
+
+  if (!tls_sessions_supported ())
+    return;
+
+  sessions = load_tls_sessions (dir);
+  if (sessions == NULL)
+    return;
+
+  g_variant_iter_init (&iter, sessions);
+  while (g_variant_iter_next (&iter, "(&s@ay@ayx)", &session_key, &shmac_v, &sdata_v, &valid_until))
     {
-      /* Flush the writes */
-      if (!g_output_stream_close (data->out, data->cancellable, error))
-        return FALSE;
+      g_autoptr(GVariant) shmac = shmac_v;
+      g_autoptr(GVariant) sdata = sdata_v;
+      gsize shmac_len, sdata_len;
+      const guchar *shmac_data;
+      const guchar *sdata_data;
 
-      g_clear_pointer (&data->out, g_object_unref);
+      if (valid_until <= now)
+        continue;
+
+      shmac_data = g_variant_get_fixed_array (shmac, &shmac_len, 1);
+      sdata_data = g_variant_get_fixed_array (sdata, &sdata_len, 1);
+
+      (void) curl_easy_ssls_import (curl, *session_key ? session_key : NULL,
+                                    shmac_data, shmac_len, sdata_data, sdata_len);
     }
+}
 
-  if (data->progress)
-    data->progress (data->downloaded_bytes, data->user_data);
+static CURLcode
+export_tls_session_cb (CURL                *curl,
+                       void                *userptr,
+                       const char          *session_key,
+                       const unsigned char *shmac,
+                       size_t               shmac_len,
+                       const unsigned char *sdata,
+                       size_t               sdata_len,
+                       curl_off_t           valid_until,
+                       int                  ietf_tls_id,
+                       const char          *alpn,
+                       size_t               earlydata_max)
+{
+  GPtrArray *sessions = userptr;
+  curl_off_t now = g_get_real_time () / G_USEC_PER_SEC;
 
-  curl_easy_getinfo (session->curl, CURLINFO_RESPONSE_CODE, &response);
+  if (valid_until <= now)
+    return CURLE_OK;
 
-  data->status = response;
+  g_ptr_array_add (sessions,
+                   g_variant_ref_sink (g_variant_new ("(s@ay@ayx)",
+                                                      session_key ? session_key : "",
+                                                      g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, shmac, shmac_len, 1),
+                                                      g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, sdata, sdata_len, 1),
+                                                      (gint64) valid_until)));
 
-  if ((data->flags & FLATPAK_HTTP_FLAGS_NOCHECK_STATUS) == 0 &&
-      !check_http_status (data->status, error))
-    return FALSE;
+  return CURLE_OK;
+}
 
-  g_info ("Received %" G_GUINT64_FORMAT " bytes", data->downloaded_bytes);
+static int
+compare_tls_sessions_newest_first (gconstpointer a,
+                                   gconstpointer b)
+{
+  gint64 valid_until_a, valid_until_b;
 
-  /* This is not really needed, but the auto-pointer confuses some compilers in the CI */
-  g_clear_pointer (&curl_lock, g_mutex_locker_free);
+  g_variant_get_child (*(GVariant **) a, 3, "x", &valid_until_a);
+  g_variant_get_child (*(GVariant **) b, 3, "x", &valid_until_b);
 
-  return TRUE;
+  return (valid_until_a < valid_until_b) - (valid_until_a > valid_until_b);
 }
 
-/* Check whether a particular operation should be retried. This is entirely
- * based on how it failed (if at all) last time, and whether the operation has
- * some retries left. The retry count is set when the operation is first
- * created, and must be decremented by the caller. (@n_retries_remaining == 0)
- * will always return %FALSE from this function.
- *
+/* Saves the TLS sessions of the share of @curl for the next run. Other
+ * processes may have saved sessions for other servers since we loaded
+ * the file, so those are merged in under a lock rather than overwritten. */
+static void
+http_session_export_tls_sessions (CURL *curl)
+{
+  g_autofree char *dir = get_tls_sessions_dir ();
+  g_autoptr(GPtrArray) sessions = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  g_autoptr(GHashTable) exported_keys = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GVariant) old_sessions = NULL;
+  g_autoptr(GVariant) new_sessions = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_auto(GLnxLockFile) lock = { 0, };
+  glnx_autofd int dfd = -1;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  gsize i;
+
+  if (!tls_sessions_supported ())
+    return;
+
+  if (curl_easy_ssls_export (curl, export_tls_session_cb, sessions) != CURLE_OK)
+    return;
+
+  /* Nothing new to save, e.g. there were no https requests */
+  if (sessions->len == 0)
+    return;
+
+  for (i = 0; i < sessions->len; i++)
+    {
+      const char *session_key;
+
+      g_variant_get_child (g_ptr_array_index (sessions, i), 0, "&s", &session_key);
+      g_hash_table_add (exported_keys, (char *) session_key);
+    }
+
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, dir, 0755, NULL, &local_error) ||
+      !glnx_opendirat (AT_FDCWD, dir, TRUE, &dfd, &local_error) ||
+      !glnx_make_lock_file (dfd, TLS_SESSIONS_LOCK_FILE, LOCK_EX, &lock, &local_error))
+    {
+      g_info ("Failed to save TLS sessions: %s", local_error->message);
+      return;
+    }
+
+  /* We imported the saved sessions when starting, so ours are the current
+   * ones for the servers we talked to */
+  old_sessions = load_tls_sessions (dir);
+  for (i = 0; old_sessions != NULL && i < g_variant_n_children (old_sessions); i++)
+    {
+      g_autoptr(GVariant) old_session = g_variant_get_child_value (old_sessions, i);
+      const char *session_key;
+      gint64 valid_until;
+
+      g_variant_get_child (old_session, 0, "&s", &session_key);
+      g_variant_get_child (old_session, 3, "x", &valid_until);
+
+      if (valid_until > now && !g_hash_table_contains (exported_keys, session_key))
+        g_ptr_array_add (sessions, g_steal_pointer (&old_session));
+    }
+
+  g_ptr_array_sort (sessions, compare_tls_sessions_newest_first);
+  if (sessions->len > TLS_SESSIONS_MAX)
+    g_ptr_array_set_size (sessions, TLS_SESSIONS_MAX);
+
+  new_sessions = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("(sayayx)"),
+                                                          (GVariant **) sessions->pdata,
+                                                          sessions->len));
+
+  /* This writes a tmpfile and renames it over the old one, so readers
+   * never see a partial file */
+  if (!glnx_file_replace_contents_with_perms_at (dfd, TLS_SESSIONS_FILE,
+                                                 g_variant_get_data (new_sessions),
+                                                 g_variant_get_size (new_sessions),
+                                                 0600, (uid_t) -1, (gid_t) -1,
+                                                 GLNX_FILE_REPLACE_NODATASYNC,
+                                                 NULL, &local_error))
+    g_info ("Failed to save TLS sessions: %s", local_error->message);
+}
+
+#endif
+
+FlatpakHttpSession *
+flatpak_create_http_session (const char *user_agent)
+{
+  FlatpakHttpSession *session = g_new0 (FlatpakHttpSession, 1);
+  guint i;
+
+  session->user_agent = g_strdup (user_agent);
+  session->altsvc_path = g_build_filename (g_get_user_cache_dir (), "flatpak", "altsvc.txt", NULL);
+
+  g_mutex_init (&session->lock);
+  for (i = 0; i < G_N_ELEMENTS (session->share_locks); i++)
+    g_mutex_init (&session->share_locks[i]);
+
+  session->share = curl_share_init ();
+  g_assert (session->share != NULL);
+
+  curl_share_setopt (session->share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+  curl_share_setopt (session->share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+  curl_share_setopt (session->share, CURLSHOPT_USERDATA, session);
+  curl_share_setopt (session->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt (session->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if CURL_AT_LEAST_VERSION(7, 57, 0) && !defined(HTTP_SESSION_USE_MULTI)
+  /* With the multi handle the connections are shared through that instead,
+   * which is what allows multiplexing */
+  curl_share_setopt (session->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+  session->idle_curls = g_ptr_array_new ();
+
+#ifdef HTTP_SESSION_USE_MULTI
+  g_mutex_init (&session->multi_lock);
+  g_cond_init (&session->multi_cond);
+  session->new_transfers = g_ptr_array_new ();
+  session->multi = curl_multi_init ();
+  g_assert (session->multi != NULL);
+  curl_multi_setopt (session->multi, CURLMOPT_PIPELINING, (long) CURLPIPE_MULTIPLEX);
+#endif
+
+  /* Most sessions only ever do one request at a time, so have one ready */
+  g_ptr_array_add (session->idle_curls, http_session_new_curl (session));
+
+#ifdef HTTP_SESSION_PERSIST_TLS
+  http_session_import_tls_sessions (g_ptr_array_index (session->idle_curls, 0));
+#endif
+
+  return session;
+}
+
+/* Gets a curl handle for a request, which must be given back with
+ * http_session_release_curl() when done */
+static CURL *
+http_session_acquire_curl (FlatpakHttpSession *session,
+                           guint64            *out_max_recv_speed,
+                           FlatpakHTTPFlags   *out_flags)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&session->lock);
+
+  *out_max_recv_speed = session->max_recv_speed;
+  *out_flags = session->flags;
+
+  if (session->idle_curls->len > 0)
+    return g_ptr_array_steal_index (session->idle_curls, session->idle_curls->len - 1);
+
+  return http_session_new_curl (session);
+}
+
+static void
+http_session_release_curl (FlatpakHttpSession *session,
+                           CURL               *curl)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&session->lock);
+
+  g_ptr_array_add (session->idle_curls, curl);
+}
+
+/* Limits the download rate of all following requests on @session to
+ * @bytes_per_sec, or removes the limit if it is 0. */
+void
+flatpak_http_session_set_max_recv_speed (FlatpakHttpSession *session,
+                                         guint64             bytes_per_sec)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&session->lock);
+
+  session->max_recv_speed = bytes_per_sec;
+}
+
+/* Makes all following requests on @session try HTTP/3 if @enable is
+ * set, like FLATPAK_HTTP_FLAGS_HTTP3 does for a single request. */
+void
+flatpak_http_session_set_http3 (FlatpakHttpSession *session,
+                                gboolean            enable)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&session->lock);
+
+  if (enable)
+    session->flags |= FLATPAK_HTTP_FLAGS_HTTP3;
+  else
+    session->flags &= ~FLATPAK_HTTP_FLAGS_HTTP3;
+}
+
+void
+flatpak_http_session_free (FlatpakHttpSession* session)
+{
+  guint i;
+
+#ifdef HTTP_SESSION_USE_MULTI
+  if (session->multi_thread)
+    {
+      g_mutex_lock (&session->multi_lock);
+      session->multi_quit = TRUE;
+      g_mutex_unlock (&session->multi_lock);
+
+      curl_multi_wakeup (session->multi);
+      g_thread_join (session->multi_thread);
+    }
+
+  /* No requests are running, so nothing is added to it any more */
+  curl_multi_cleanup (session->multi);
+  g_ptr_array_unref (session->new_transfers);
+  g_cond_clear (&session->multi_cond);
+  g_mutex_clear (&session->multi_lock);
+#endif
+
+#ifdef HTTP_SESSION_PERSIST_TLS
+  if (session->idle_curls->len > 0)
+    http_session_export_tls_sessions (g_ptr_array_index (session->idle_curls, 0));
+#endif
+
+  /* The handles must go before the share they use */
+  for (i = 0; i < session->idle_curls->len; i++)
+    curl_easy_cleanup (g_ptr_array_index (session->idle_curls, i));
+  g_ptr_array_unref (session->idle_curls);
+
+  curl_share_cleanup (session->share);
+
+  for (i = 0; i < G_N_ELEMENTS (session->share_locks); i++)
+    g_mutex_clear (&session->share_locks[i]);
+  g_mutex_clear (&session->lock);
+  g_free (session->user_agent);
+  g_free (session->altsvc_path);
+  g_free (session);
+}
+
+static void
+set_error_from_curl (GError        **error,
+                     const char     *uri,
+                     CURLcode        res,
+                     GCancellable   *cancellable)
+{
+  GQuark domain = G_IO_ERROR;
+  int code;
+
+  switch (res)
+    {
+    case CURLE_WRITE_ERROR:
+      /* Check if this was due to cancellation */
+      if (g_cancellable_is_cancelled (cancellable))
+        code = G_IO_ERROR_CANCELLED;
+      else
+        code = G_IO_ERROR_FAILED;
+      break;
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_RESOLVE_PROXY:
+      code = G_IO_ERROR_HOST_NOT_FOUND;
+      break;
+    case CURLE_OPERATION_TIMEDOUT:
+      code = G_IO_ERROR_TIMED_OUT;
+      break;
+    case CURLE_PARTIAL_FILE:
+      code = G_IO_ERROR_PARTIAL_INPUT;
+      break;
+    case CURLE_RECV_ERROR:
+    case CURLE_SEND_ERROR:
+      code = G_IO_ERROR_CONNECTION_CLOSED;
+      break;
+    default:
+      code =  G_IO_ERROR_FAILED;
+    }
+
+  g_set_error (error, domain, code,
+               "While fetching %s: [%u] %s", uri, res,
+               curl_easy_strerror (res));
+}
+
+#ifdef HTTP_SESSION_HTTP3
+static gboolean
+http3_supported (void)
+{
+  return ((curl_version_info (CURLVERSION_NOW))->features & CURL_VERSION_HTTP3) != 0;
+}
+#endif
+
+/* The handles are reused, so this is set for each request */
+static void
+http_request_setup_version (CURL        *curl,
+                            LoadUriData *data)
+{
+  long http_version = CURL_HTTP_VERSION_NONE;
+
+  /* Picked the current version in F25 as of 20170127, since
+   * there are numerous HTTP/2 fixes since the original version in
+   * libcurl 7.43.0.
+   */
+#if CURL_AT_LEAST_VERSION(7, 51, 0)
+  if ((curl_version_info (CURLVERSION_NOW))->features & CURL_VERSION_HTTP2)
+    http_version = CURL_HTTP_VERSION_2_0;
+#endif
+
+#ifdef HTTP_SESSION_HTTP3
+  /* This falls back to earlier versions if HTTP/3 doesn't work out. The
+   * Alt-Svc cache remembers which servers offer it, so we can use it
+   * from the start next time. */
+  if ((data->flags & FLATPAK_HTTP_FLAGS_HTTP3) != 0 && http3_supported ())
+    {
+      g_autofree char *altsvc_dir = g_path_get_dirname (data->session->altsvc_path);
+
+      http_version = CURL_HTTP_VERSION_3;
+      if (g_mkdir_with_parents (altsvc_dir, 0755) == 0)
+        curl_easy_setopt (curl, CURLOPT_ALTSVC, data->session->altsvc_path);
+      curl_easy_setopt (curl, CURLOPT_ALTSVC_CTRL,
+                        (long) (CURLALTSVC_H1 | CURLALTSVC_H2 | CURLALTSVC_H3));
+    }
+  else
+    curl_easy_setopt (curl, CURLOPT_ALTSVC_CTRL, 0L);
+#endif
+
+  curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, http_version);
+}
+
+/* Sets up @curl for the request, and returns the header list, which
+ * must be kept until the request is done and then freed */
+static struct curl_slist *
+http_request_setup (CURL                  *curl,
+                    guint64                max_recv_speed,
+                    LoadUriData           *data,
+                    const char            *uri)
+{
+  g_autofree char *auth_header = NULL;
+  g_autofree char *cache_header = NULL;
+  g_autofree char *range_header = NULL;
+  g_autofree char *if_range_header = NULL;
+  struct curl_slist *header_list = NULL;
+
+  g_info ("Loading %s using curl", uri);
+
+  curl_easy_setopt (curl, CURLOPT_URL, uri);
+  curl_easy_setopt (curl, CURLOPT_WRITEDATA, (void *)data);
+  curl_easy_setopt (curl, CURLOPT_HEADERDATA, (void *)data);
+
+  curl_easy_setopt (curl, CURLOPT_CAINFO, NULL);
+  curl_easy_setopt (curl, CURLOPT_SSLCERT, NULL);
+  curl_easy_setopt (curl, CURLOPT_SSLKEY, NULL);
+
+  if (data->certificates)
+    {
+      if (data->certificates->ca_cert_file)
+        curl_easy_setopt (curl, CURLOPT_CAINFO, data->certificates->ca_cert_file);
+
+      if (data->certificates->client_cert_file)
+        {
+          curl_easy_setopt (curl, CURLOPT_SSLCERT, data->certificates->client_cert_file);
+          curl_easy_setopt (curl, CURLOPT_SSLKEY, data->certificates->client_key_file);
+        }
+    }
+
+  if (data->flags & FLATPAK_HTTP_FLAGS_HEAD)
+    curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+  else
+    curl_easy_setopt (curl, CURLOPT_HTTPGET, 1L);
+
+  /* The handles are reused, so always set these */
+  if (data->flags & FLATPAK_HTTP_FLAGS_FAIL_FAST)
+    {
+      curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT, (long)FLATPAK_HTTP_FAIL_FAST_TIMEOUT_SECS);
+      curl_easy_setopt (curl, CURLOPT_LOW_SPEED_TIME, (long)FLATPAK_HTTP_FAIL_FAST_TIMEOUT_SECS);
+    }
+  else
+    {
+      curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT, (long)FLATPAK_HTTP_TIMEOUT_SECS);
+      curl_easy_setopt (curl, CURLOPT_LOW_SPEED_TIME, (long)FLATPAK_HTTP_TIMEOUT_SECS);
+    }
+
+  if (data->flags & FLATPAK_HTTP_FLAGS_ACCEPT_OCI)
+    header_list = curl_slist_append (header_list,
+                                     "Accept: " FLATPAK_OCI_MEDIA_TYPE_IMAGE_MANIFEST ", " FLATPAK_DOCKER_MEDIA_TYPE_IMAGE_MANIFEST2 ", " FLATPAK_OCI_MEDIA_TYPE_IMAGE_INDEX);
+
+  if (data->auth)
+    auth_header = g_strdup_printf ("Authorization: Basic %s", data->auth);
+  else if (data->token)
+    auth_header = g_strdup_printf ("Authorization: Bearer %s", data->token);
+  if (auth_header)
+    header_list = curl_slist_append (header_list, auth_header);
+
+  if (data->range_length > 0)
+    {
+      range_header = g_strdup_printf ("Range: bytes=%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+                                      data->range_start + data->resume_offset,
+                                      data->range_start + data->range_length - 1);
+      header_list = curl_slist_append (header_list, range_header);
+      if (data->resume_validator)
+        {
+          if_range_header = g_strdup_printf ("If-Range: %s", data->resume_validator);
+          header_list = curl_slist_append (header_list, if_range_header);
+        }
+    }
+  else if (data->resume_offset > 0)
+    {
+      range_header = g_strdup_printf ("Range: bytes=%" G_GUINT64_FORMAT "-", data->resume_offset);
+      header_list = curl_slist_append (header_list, range_header);
+      if (data->resume_validator)
+        {
+          if_range_header = g_strdup_printf ("If-Range: %s", data->resume_validator);
+          header_list = curl_slist_append (header_list, if_range_header);
+        }
+    }
+
+  if (data->cache_data)
+    {
+      CacheHttpData *cache_data = data->cache_data;
+
+      if (cache_data->etag && cache_data->etag[0])
+        cache_header = g_strdup_printf ("If-None-Match: %s", cache_data->etag);
+      else if (cache_data->last_modified != 0)
+        {
+          g_autoptr(GDateTime) date = g_date_time_new_from_unix_utc (cache_data->last_modified);
+          g_autofree char *date_str = flatpak_format_http_date (date);
+          cache_header = g_strdup_printf ("If-Modified-Since: %s", date_str);
+        }
+      if (cache_header)
+        header_list = curl_slist_append (header_list, cache_header);
+    }
+
+  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, header_list);
+
+  http_request_setup_version (curl, data);
+
+  /* Don't let the low speed check abort downloads that are only slow
+   * because we asked for them to be */
+  curl_easy_setopt (curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t) max_recv_speed);
+  if (max_recv_speed != 0 && max_recv_speed < 2 * 10000)
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_LIMIT, (long) (max_recv_speed / 2));
+  else
+    curl_easy_setopt (curl, CURLOPT_LOW_SPEED_LIMIT, 10000L);
+
+  if (data->flags & FLATPAK_HTTP_FLAGS_STORE_COMPRESSED)
+    {
+      curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+      curl_easy_setopt(curl, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+      data->store_compressed = TRUE;
+    }
+  else if (data->resume_offset > 0 || data->range_length > 0 || data->no_content_encoding)
+    {
+      /* Ranges are only useful if we store the data as it was sent */
+      curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, NULL);
+      curl_easy_setopt(curl, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+      data->store_compressed = FALSE;
+    }
+  else
+    {
+      /* enable all supported built-in compressions */
+      curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+      curl_easy_setopt(curl, CURLOPT_HTTP_CONTENT_DECODING, 1L);
+      data->store_compressed = FALSE;
+    }
+
+  return header_list;
+}
+
+/* Handles the result @res of the request done on @curl */
+static gboolean
+http_request_finish (CURL                  *curl,
+                     LoadUriData           *data,
+                     const char            *uri,
+                     CURLcode               res,
+                     GError               **error)
+{
+  long response;
+
+  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, NULL); /* Don't point to freed list */
+
+  if (res != CURLE_OK)
+    {
+      /* An error page has no Content-Range either, so report that instead */
+      if (data->range_not_honored)
+        {
+          curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &response);
+          if (check_http_status (response, error))
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                         "While fetching %s: Server does not support range requests", uri);
+        }
+      else
+        set_error_from_curl (error, uri, res, data->cancellable);
+
+      /* Make sure we clear the tmpfile stream we possible created during the request */
+      if (data->out_tmpfile && data->out)
+        g_clear_pointer (&data->out, g_object_unref);
+
+      return FALSE;
+    }
+
+  if (data->out_tmpfile && data->out)
+    {
+      /* Flush the writes */
+      if (!g_output_stream_close (data->out, data->cancellable, error))
+        return FALSE;
+
+      g_clear_pointer (&data->out, g_object_unref);
+    }
+
+  if (data->progress)
+    data->progress (data->downloaded_bytes, data->user_data);
+
+  curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &response);
+
+  data->status = response;
+
+  if ((data->flags & FLATPAK_HTTP_FLAGS_NOCHECK_STATUS) == 0 &&
+      !check_http_status (data->status, error))
+    return FALSE;
+
+  g_info ("Received %" G_GUINT64_FORMAT " bytes", data->downloaded_bytes);
+
+  return TRUE;
+}
+
+static gboolean
+flatpak_download_http_uri_with_curl (FlatpakHttpSession    *session,
+                                     CURL                  *curl,
+                                     guint64                max_recv_speed,
+                                     LoadUriData           *data,
+                                     const char            *uri,
+                                     GError               **error)
+{
+  g_autoptr(auto_curl_slist) header_list = NULL;
+  CURLcode res;
+  gboolean success;
+
+  FLATPAK_TRACE1 (http_request_start, uri);
+
+  header_list = http_request_setup (curl, max_recv_speed, data, uri);
+  res = http_session_perform (session, curl, data);
+
+  success = http_request_finish (curl, data, uri, res, error);
+
+  FLATPAK_TRACE3 (http_request_done, uri, success, data->downloaded_bytes);
+
+  return success;
+}
+
+static gboolean
+flatpak_download_http_uri_once (FlatpakHttpSession    *session,
+                                LoadUriData           *data,
+                                const char            *uri,
+                                GError               **error)
+{
+  guint64 max_recv_speed;
+  FlatpakHTTPFlags session_flags;
+  CURL *curl = http_session_acquire_curl (session, &max_recv_speed, &session_flags);
+  gboolean res;
+
+  data->flags |= session_flags;
+  data->session = session;
+  res = flatpak_download_http_uri_with_curl (session, curl, max_recv_speed, data, uri, error);
+
+  http_session_release_curl (session, curl);
+
+  return res;
+}
+
+/* Check whether a particular operation should be retried. This is entirely
+ * based on how it failed (if at all) last time, and whether the operation has
+ * some retries left. The retry count is set when the operation is first
+ * created, and must be decremented by the caller. (@n_retries_remaining == 0)
+ * will always return %FALSE from this function.
+ *
  * This code is copied from libostree's _ostree_fetcher_should_retry_request()
  */
 static gboolean
@@ -764,9 +1602,119 @@ flatpak_http_should_retry_request (const GError *error,
       return TRUE;
     }
 
-  return FALSE;
+  return FALSE;
+}
+
+typedef enum {
+  LOAD_URI_RETRY_RESTART,     /* Start over */
+  LOAD_URI_RETRY_RESUME,      /* Continue where we stopped if we can, otherwise start over */
+  LOAD_URI_RETRY_RESUME_ONLY, /* Continue where we stopped, as we can't take back what is in the output */
+} LoadUriRetryMode;
+
+/* Exponential backoff, with a random half of the delay so that clients
+ * which failed at the same time (e.g. because of a server outage) don't
+ * all retry at the same time too. */
+static guint
+get_retry_delay_msec (guint n_retries_remaining)
+{
+  guint attempt = DEFAULT_N_NETWORK_RETRIES - n_retries_remaining;
+  guint delay_msec = MIN (RETRY_INITIAL_DELAY_MSEC << (attempt - 1), RETRY_MAX_DELAY_MSEC);
+
+  return delay_msec / 2 + g_random_int_range (0, delay_msec / 2 + 1);
+}
+
+/* Called after a failed attempt with @error. Returns whether to try
+ * again, and if so gets @data ready for it and sets @out_delay_msec to
+ * how long to wait before doing so. This is shared by the sync and async
+ * variants, so they retry the same way. */
+static gboolean
+load_uri_data_prepare_retry (LoadUriData      *data,
+                             LoadUriRetryMode  mode,
+                             const GError     *error,
+                             guint            *n_retries_remaining,
+                             guint            *out_delay_msec)
+{
+  gboolean resume = FALSE;
+
+  g_assert (error != NULL);
+
+  if (mode != LOAD_URI_RETRY_RESTART && data->downloaded_bytes > 0)
+    {
+      resume = prepare_resume_load_uri_data (data);
+      if (!resume && mode == LOAD_URI_RETRY_RESUME_ONLY)
+        return FALSE;
+    }
+
+  if (!flatpak_http_should_retry_request (error, (*n_retries_remaining)--))
+    return FALSE;
+
+  if (!resume)
+    reset_load_uri_data (data);
+
+  *out_delay_msec = get_retry_delay_msec (*n_retries_remaining);
+  g_info ("Retrying in %u ms", *out_delay_msec);
+
+  return TRUE;
+}
+
+static gboolean
+wait_before_retry (guint          delay_msec,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  GPollFD pollfd;
+
+  if (cancellable != NULL && g_cancellable_make_pollfd (cancellable, &pollfd))
+    {
+      g_poll (&pollfd, 1, delay_msec);
+      g_cancellable_release_fd (cancellable);
+    }
+  else
+    g_usleep (delay_msec * (G_USEC_PER_SEC / 1000));
+
+  return !g_cancellable_set_error_if_cancelled (cancellable, error);
+}
+
+/* Does the request, retrying on transient errors as allowed by @mode */
+static gboolean
+download_http_uri_with_retries (FlatpakHttpSession *http_session,
+                                LoadUriData        *data,
+                                const char         *uri,
+                                LoadUriRetryMode    mode,
+                                GError            **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  guint n_retries_remaining = (data->flags & FLATPAK_HTTP_FLAGS_FAIL_FAST) ? 0 : DEFAULT_N_NETWORK_RETRIES;
+  guint delay_msec;
+
+  while (!flatpak_download_http_uri_once (http_session, data, uri, &local_error))
+    {
+      if (!load_uri_data_prepare_retry (data, mode, local_error, &n_retries_remaining, &delay_msec))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      g_clear_error (&local_error);
+
+      if (!wait_before_retry (delay_msec, data->cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
 }
 
+static int open_http_cache_dir (void);
+static GBytes *load_uri_from_http_cache (FlatpakHttpSession    *http_session,
+                                         int                    cache_dfd,
+                                         const char            *uri,
+                                         FlatpakCertificates   *certificates,
+                                         FlatpakHTTPFlags       flags,
+                                         FlatpakLoadUriProgress progress,
+                                         gpointer               user_data,
+                                         GCancellable          *cancellable,
+                                         GError               **error);
+
 GBytes *
 flatpak_load_uri_full (FlatpakHttpSession    *http_session,
                        const char            *uri,
@@ -783,10 +1731,7 @@ flatpak_load_uri_full (FlatpakHttpSession    *http_session,
                        GError               **error)
 {
   g_auto(LoadUriData) data = { NULL };
-  g_autoptr(GError) local_error = NULL;
-  guint n_retries_remaining = DEFAULT_N_NETWORK_RETRIES;
   g_autoptr(GMainContextPopDefault) main_context = NULL;
-  gboolean success = FALSE;
 
   /* Ensure we handle file: uris the same independent of backend */
   if (g_ascii_strncasecmp (uri, "file:", 5) == 0)
@@ -801,6 +1746,19 @@ flatpak_load_uri_full (FlatpakHttpSession    *http_session,
       return g_bytes_new_take (g_steal_pointer (&contents), len);
     }
 
+  /* Authenticated responses are not for sharing, and the cache only
+   * keeps the content */
+  if ((flags & FLATPAK_HTTP_FLAGS_USE_CACHE) != 0 &&
+      auth == NULL && token == NULL && out_status == NULL &&
+      out_content_type == NULL && out_www_authenticate == NULL)
+    {
+      glnx_autofd int cache_dfd = open_http_cache_dir ();
+
+      if (cache_dfd != -1)
+        return load_uri_from_http_cache (http_session, cache_dfd, uri, certificates, flags,
+                                         progress, user_data, cancellable, error);
+    }
+
   main_context = flatpak_main_context_new_default ();
 
   data.context = main_context;
@@ -815,24 +1773,7 @@ flatpak_load_uri_full (FlatpakHttpSession    *http_session,
 
   data.content = g_string_new ("");
 
-  do
-    {
-      if (n_retries_remaining < DEFAULT_N_NETWORK_RETRIES)
-        {
-          g_clear_error (&local_error);
-          reset_load_uri_data (&data);
-        }
-
-      success = flatpak_download_http_uri_once (http_session, &data, uri, &local_error);
-
-      if (success)
-        break;
-
-      g_assert (local_error != NULL);
-    }
-  while (flatpak_http_should_retry_request (local_error, n_retries_remaining--));
-
-  if (success)
+  if (download_http_uri_with_retries (http_session, &data, uri, LOAD_URI_RETRY_RESUME, error))
     {
       if (out_content_type)
         *out_content_type = g_steal_pointer (&data.hdr_content_type);
@@ -846,8 +1787,6 @@ flatpak_load_uri_full (FlatpakHttpSession    *http_session,
       return g_string_free_to_bytes (g_steal_pointer (&data.content));
     }
 
-  g_assert (local_error != NULL);
-  g_propagate_error (error, g_steal_pointer (&local_error));
   return NULL;
 }
 
@@ -868,6 +1807,21 @@ flatpak_load_uri (FlatpakHttpSession    *http_session,
                                 cancellable, error);
 }
 
+/* Downloads @uri to @data->out, retrying on transient errors. Once some
+ * data has been written the retries ask for the rest of the file, as we
+ * can't take back what is in the stream. */
+static gboolean
+download_http_uri_to_stream (FlatpakHttpSession    *http_session,
+                             LoadUriData           *data,
+                             const char            *uri,
+                             GError               **error)
+{
+  /* If the output stream has already been written to we can only
+   * retry by asking for the rest of the file */
+  return download_http_uri_with_retries (http_session, data, uri,
+                                         LOAD_URI_RETRY_RESUME_ONLY, error);
+}
+
 gboolean
 flatpak_download_http_uri (FlatpakHttpSession    *http_session,
                            const char            *uri,
@@ -881,10 +1835,7 @@ flatpak_download_http_uri (FlatpakHttpSession    *http_session,
                            GError               **error)
 {
   g_auto(LoadUriData) data = { NULL };
-  g_autoptr(GError) local_error = NULL;
-  guint n_retries_remaining = DEFAULT_N_NETWORK_RETRIES;
   g_autoptr(GMainContextPopDefault) main_context = NULL;
-  gboolean success = FALSE;
 
   main_context = flatpak_main_context_new_default ();
 
@@ -899,34 +1850,58 @@ flatpak_download_http_uri (FlatpakHttpSession    *http_session,
 
   data.out = out;
 
-  do
-    {
-      if (n_retries_remaining < DEFAULT_N_NETWORK_RETRIES)
-        {
-          g_clear_error (&local_error);
-          reset_load_uri_data (&data);
-        }
+  return download_http_uri_to_stream (http_session, &data, uri, error);
+}
 
-      success =  flatpak_download_http_uri_once (http_session, &data, uri, &local_error);
+/* Like flatpak_download_http_uri(), but only downloads @length bytes of
+ * the file, starting at @offset. Fails with %G_IO_ERROR_NOT_SUPPORTED if
+ * the server doesn't do range requests. */
+gboolean
+flatpak_download_http_uri_range (FlatpakHttpSession    *http_session,
+                                 const char            *uri,
+                                 FlatpakCertificates   *certificates,
+                                 FlatpakHTTPFlags       flags,
+                                 guint64                offset,
+                                 guint64                length,
+                                 GOutputStream         *out,
+                                 const char            *token,
+                                 FlatpakLoadUriProgress progress,
+                                 gpointer               user_data,
+                                 GCancellable          *cancellable,
+                                 GError               **error)
+{
+  g_auto(LoadUriData) data = { NULL };
+  g_autoptr(GMainContextPopDefault) main_context = NULL;
 
-      if (success)
-        break;
+  g_return_val_if_fail (length > 0, FALSE);
 
-      g_assert (local_error != NULL);
+  main_context = flatpak_main_context_new_default ();
 
-      /* If the output stream has already been written to we can't retry.
-       * TODO: use a range request to resume the download */
-      if (data.downloaded_bytes > 0)
-        break;
-    }
-  while (flatpak_http_should_retry_request (local_error, n_retries_remaining--));
+  data.context = main_context;
+  data.progress = progress;
+  data.user_data = user_data;
+  data.last_progress_time = g_get_monotonic_time ();
+  data.cancellable = cancellable;
+  data.certificates = certificates;
+  data.flags = flags;
+  data.token = token;
+  data.range_start = offset;
+  data.range_length = length;
 
-  if (success)
-    return TRUE;
+  data.out = out;
 
-  g_assert (local_error != NULL);
-  g_propagate_error (error, g_steal_pointer (&local_error));
-  return FALSE;
+  if (!download_http_uri_to_stream (http_session, &data, uri, error))
+    return FALSE;
+
+  if (data.downloaded_bytes != length)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "While fetching %s: Expected %" G_GUINT64_FORMAT " bytes, got %" G_GUINT64_FORMAT,
+                   uri, length, data.downloaded_bytes);
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
 /************************************************************************
@@ -1224,58 +2199,448 @@ set_cache_http_data_from_headers (CacheHttpData *cache_data,
     }
 }
 
+/* State of a request updating a cached file, shared by the sync and
+ * async variants */
+typedef struct
+{
+  CacheHttpData *cache_data;
+  char          *name;
+  int            cache_dfd;
+  gboolean       no_xattr;
+  GLnxTmpfile    out_tmpfile;
+
+  /* Always revalidate unless the server says how long the file is valid */
+  gboolean       no_heuristic_expiry;
+} CacheHttpRequest;
+
+static void
+clear_cache_http_request (CacheHttpRequest *request)
+{
+  g_clear_pointer (&request->cache_data, free_cache_http_data);
+  g_clear_pointer (&request->name, g_free);
+  glnx_close_fd (&request->cache_dfd);
+  glnx_tmpfile_clear (&request->out_tmpfile);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(CacheHttpRequest, clear_cache_http_request)
+
+/* Loads the cache data for @dest_subpath, failing with
+ * %FLATPAK_HTTP_ERROR_NOT_CHANGED if it is still valid. Otherwise sets
+ * up @data to revalidate or download it. */
+static gboolean
+cache_http_request_begin (CacheHttpRequest *request,
+                          LoadUriData      *data,
+                          const char       *uri,
+                          int               dest_dfd,
+                          const char       *dest_subpath,
+                          GCancellable     *cancellable,
+                          GError          **error)
+{
+  g_autofree char *parent_path = g_path_get_dirname (dest_subpath);
+
+  request->cache_dfd = -1;
+  request->name = g_path_get_basename (dest_subpath);
+
+  if (!glnx_opendirat (dest_dfd, parent_path, TRUE, &request->cache_dfd, error))
+    return FALSE;
+
+  request->cache_data = load_cache_http_data (request->cache_dfd, request->name,
+                                              &request->no_xattr,
+                                              cancellable, error);
+  if (!request->cache_data)
+    return FALSE;
+
+  if (g_strcmp0 (request->cache_data->uri, uri) != 0)
+    clear_cache_http_data (request->cache_data, TRUE);
+
+  if (request->cache_data->uri)
+    {
+      if (request->cache_data->expires > (g_get_real_time () / G_USEC_PER_SEC))
+        {
+          g_set_error (error, FLATPAK_HTTP_ERROR,
+                       FLATPAK_HTTP_ERROR_NOT_CHANGED,
+                       "Reusing cached value");
+          return FALSE;
+        }
+    }
+
+  if (request->cache_data->uri == NULL)
+    request->cache_data->uri = g_strdup (uri);
+
+  /* Missing from cache, or expired so must revalidate via etag/last-modified headers */
+
+  data->cache_data = request->cache_data;
+
+  data->out_tmpfile = &request->out_tmpfile;
+  data->out_tmpfile_parent_dfd = request->cache_dfd;
+
+  return TRUE;
+}
+
+/* Stores the outcome of the request, which failed with @local_error
+ * unless it is %NULL. This takes ownership of @local_error. */
+static gboolean
+cache_http_request_end (CacheHttpRequest *request,
+                        LoadUriData      *data,
+                        GError           *local_error,
+                        GCancellable     *cancellable,
+                        GError          **error)
+{
+  g_auto(GLnxTmpfile) cache_tmpfile = { 0 };
+  g_autoptr(GBytes) cache_bytes = NULL;
+  const char *name = request->name;
+  int cache_dfd = request->cache_dfd;
+
+  /* Update the cache data on success or cache-valid */
+  if (local_error == NULL || g_error_matches (local_error, FLATPAK_HTTP_ERROR, FLATPAK_HTTP_ERROR_NOT_CHANGED))
+    {
+      set_cache_http_data_from_headers (request->cache_data, data);
+      if (request->no_heuristic_expiry &&
+          data->hdr_cache_control == NULL && data->hdr_expires == NULL)
+        request->cache_data->expires = 0;
+      cache_bytes = serialize_cache_http_data (request->cache_data);
+    }
+
+  if (local_error)
+    {
+      if (cache_bytes)
+        {
+          GError *tmp_error = NULL;
+
+          if (!save_cache_http_data_to_file (cache_dfd, name, cache_bytes, request->no_xattr,
+                                             cancellable, &tmp_error))
+            {
+              g_clear_error (&local_error);
+              g_propagate_error (error, tmp_error);
+
+              return FALSE;
+            }
+        }
+
+      g_propagate_error (error, local_error);
+      return FALSE;
+    }
+
+  if (!request->no_xattr)
+    {
+      if (!save_cache_http_data_xattr (request->out_tmpfile.fd, cache_bytes, error))
+        {
+          if (errno != ENOTSUP)
+            return FALSE;
+
+          g_clear_error (error);
+          request->no_xattr = TRUE;
+        }
+    }
+
+  if (request->no_xattr)
+    {
+      if (!glnx_open_tmpfile_linkable_at (cache_dfd, ".", O_WRONLY, &cache_tmpfile, error))
+        return FALSE;
+
+      if (!save_cache_http_data_fallback (cache_tmpfile.fd, cache_bytes, error))
+        return FALSE;
+    }
+
+  if (!sync_and_rename_tmpfile (&request->out_tmpfile, name, error))
+    return FALSE;
+
+  if (request->no_xattr)
+    {
+      g_autofree char *fallback_name = g_strconcat (name, CACHE_HTTP_SUFFIX, NULL);
+
+      if (!sync_and_rename_tmpfile (&cache_tmpfile, fallback_name, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+cache_http_uri (FlatpakHttpSession    *http_session,
+                const char            *uri,
+                FlatpakCertificates   *certificates,
+                FlatpakHTTPFlags       flags,
+                int                    dest_dfd,
+                const char            *dest_subpath,
+                gboolean               no_heuristic_expiry,
+                FlatpakLoadUriProgress progress,
+                gpointer               user_data,
+                GCancellable          *cancellable,
+                GError               **error)
+{
+  g_auto(LoadUriData) data = { NULL };
+  g_auto(CacheHttpRequest) request = { NULL };
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GMainContextPopDefault) main_context = NULL;
+
+  request.no_heuristic_expiry = no_heuristic_expiry;
+
+  if (!cache_http_request_begin (&request, &data, uri, dest_dfd, dest_subpath,
+                                 cancellable, error))
+    return FALSE;
+
+  main_context = flatpak_main_context_new_default ();
+
+  data.context = main_context;
+  data.progress = progress;
+  data.user_data = user_data;
+  data.last_progress_time = g_get_monotonic_time ();
+  data.cancellable = cancellable;
+  data.flags = flags;
+  data.certificates = certificates;
+
+  download_http_uri_with_retries (http_session, &data, uri, LOAD_URI_RETRY_RESTART, &local_error);
+
+  return cache_http_request_end (&request, &data, g_steal_pointer (&local_error),
+                                 cancellable, error);
+}
+
+gboolean
+flatpak_cache_http_uri (FlatpakHttpSession    *http_session,
+                        const char            *uri,
+                        FlatpakCertificates   *certificates,
+                        FlatpakHTTPFlags       flags,
+                        int                    dest_dfd,
+                        const char            *dest_subpath,
+                        FlatpakLoadUriProgress progress,
+                        gpointer               user_data,
+                        GCancellable          *cancellable,
+                        GError               **error)
+{
+  return cache_http_uri (http_session, uri, certificates, flags,
+                         dest_dfd, dest_subpath, FALSE,
+                         progress, user_data, cancellable, error);
+}
+
+/************************************************************************
+ *                        Shared http cache                             *
+ ***********************************************************************/
+
+/* Requests with FLATPAK_HTTP_FLAGS_USE_CACHE keep the response in a cache
+ * directory shared by all of them, named by the checksum of the uri. When
+ * it grows over the max size, the least recently used files are removed
+ * until it is down to the low water mark. */
+#define HTTP_CACHE_MAX_SIZE (64 * 1024 * 1024)
+#define HTTP_CACHE_LOW_WATER_SIZE (HTTP_CACHE_MAX_SIZE / 4 * 3)
+
+typedef struct
+{
+  char   *name;
+  gint64  atime;
+  guint64 size;
+} HttpCacheEntry;
+
+static void
+clear_http_cache_entry (HttpCacheEntry *entry)
+{
+  g_free (entry->name);
+}
+
+static int
+compare_http_cache_entry_by_atime (gconstpointer a,
+                                   gconstpointer b)
+{
+  const HttpCacheEntry *entry_a = a;
+  const HttpCacheEntry *entry_b = b;
+
+  if (entry_a->atime < entry_b->atime)
+    return -1;
+  if (entry_a->atime > entry_b->atime)
+    return 1;
+  return 0;
+}
+
+static int
+open_http_cache_dir (void)
+{
+  g_autofree char *path = g_build_filename (g_get_user_cache_dir (), "flatpak", "http-cache", NULL);
+  g_autoptr(GError) local_error = NULL;
+  glnx_autofd int dfd = -1;
+
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, path, 0700, NULL, &local_error) ||
+      !glnx_opendirat (AT_FDCWD, path, TRUE, &dfd, &local_error))
+    {
+      g_info ("Not using the http cache: %s", local_error->message);
+      return -1;
+    }
+
+  return g_steal_fd (&dfd);
+}
+
+/* Removes the least recently used files, other than @keep_name, if the
+ * cache is too large. This is best effort, errors are ignored. */
+static void
+prune_http_cache (int         cache_dfd,
+                  const char *keep_name)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  g_autoptr(GArray) entries = g_array_new (FALSE, TRUE, sizeof (HttpCacheEntry));
+  guint64 total_size = 0;
+  guint i;
+
+  g_array_set_clear_func (entries, (GDestroyNotify) clear_http_cache_entry);
+
+  if (!glnx_dirfd_iterator_init_at (cache_dfd, ".", FALSE, &iter, NULL))
+    return;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+      HttpCacheEntry entry;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL, NULL) ||
+          dent == NULL)
+        break;
+
+      if (dent->d_type != DT_REG ||
+          fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        continue;
+
+      total_size += stbuf.st_size;
+
+      /* The cache data files without xattrs go away with their file */
+      if (g_str_has_suffix (dent->d_name, CACHE_HTTP_SUFFIX) ||
+          strcmp (dent->d_name, keep_name) == 0)
+        continue;
+
+      entry.name = g_strdup (dent->d_name);
+      entry.atime = stbuf.st_atime;
+      entry.size = stbuf.st_size;
+      g_array_append_val (entries, entry);
+    }
+
+  if (total_size <= HTTP_CACHE_MAX_SIZE)
+    return;
+
+  g_array_sort (entries, compare_http_cache_entry_by_atime);
+
+  for (i = 0; i < entries->len && total_size > HTTP_CACHE_LOW_WATER_SIZE; i++)
+    {
+      HttpCacheEntry *entry = &g_array_index (entries, HttpCacheEntry, i);
+      g_autofree char *fallback_name = g_strconcat (entry->name, CACHE_HTTP_SUFFIX, NULL);
+      struct stat stbuf;
+
+      if (unlinkat (cache_dfd, entry->name, 0) == 0)
+        total_size -= MIN (entry->size, total_size);
+
+      if (fstatat (cache_dfd, fallback_name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0 &&
+          unlinkat (cache_dfd, fallback_name, 0) == 0)
+        total_size -= MIN ((guint64) stbuf.st_size, total_size);
+    }
+}
+
+static GBytes *
+load_uri_from_http_cache (FlatpakHttpSession    *http_session,
+                          int                    cache_dfd,
+                          const char            *uri,
+                          FlatpakCertificates   *certificates,
+                          FlatpakHTTPFlags       flags,
+                          FlatpakLoadUriProgress progress,
+                          gpointer               user_data,
+                          GCancellable          *cancellable,
+                          GError               **error)
+{
+  g_autofree char *name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, uri, -1);
+  g_autoptr(GError) local_error = NULL;
+  glnx_autofd int fd = -1;
+
+  flags &= ~(FLATPAK_HTTP_FLAGS_USE_CACHE | FLATPAK_HTTP_FLAGS_STORE_COMPRESSED);
+
+  if (cache_http_uri (http_session, uri, certificates, flags, cache_dfd, name, TRUE,
+                      progress, user_data, cancellable, &local_error))
+    {
+      prune_http_cache (cache_dfd, name);
+    }
+  else if (g_error_matches (local_error, FLATPAK_HTTP_ERROR, FLATPAK_HTTP_ERROR_NOT_CHANGED))
+    {
+      const struct timespec times[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+
+      /* Mark it as recently used, for the pruning */
+      (void) utimensat (cache_dfd, name, times, 0);
+    }
+  else
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+  if (!glnx_openat_rdonly (cache_dfd, name, FALSE, &fd, error))
+    return NULL;
+
+  return glnx_fd_readall_bytes (fd, cancellable, error);
+}
+
+/* Downloads @uri to @dest_subpath in @dest_dfd, like
+ * flatpak_download_http_uri(), but if the download fails after getting
+ * some of the data, the partial file is kept with a note of which version
+ * of the file it is for. A later call for the same uri then continues from
+ * there with a range request, if the server still has that version.
+ *
+ * On success the file is complete and it is up to the caller to move it
+ * away or delete it. */
 gboolean
-flatpak_cache_http_uri (FlatpakHttpSession    *http_session,
-                        const char            *uri,
-                        FlatpakCertificates   *certificates,
-                        FlatpakHTTPFlags       flags,
-                        int                    dest_dfd,
-                        const char            *dest_subpath,
-                        FlatpakLoadUriProgress progress,
-                        gpointer               user_data,
-                        GCancellable          *cancellable,
-                        GError               **error)
+flatpak_download_http_uri_resumable (FlatpakHttpSession    *http_session,
+                                     const char            *uri,
+                                     FlatpakCertificates   *certificates,
+                                     FlatpakHTTPFlags       flags,
+                                     int                    dest_dfd,
+                                     const char            *dest_subpath,
+                                     FlatpakLoadUriProgress progress,
+                                     gpointer               user_data,
+                                     GCancellable          *cancellable,
+                                     GError               **error)
 {
   g_auto(LoadUriData) data = { NULL };
   g_autoptr(GError) local_error = NULL;
-  guint n_retries_remaining = DEFAULT_N_NETWORK_RETRIES;
   g_autoptr(CacheHttpData) cache_data = NULL;
   g_autoptr(GMainContextPopDefault) main_context = NULL;
   g_autofree char *parent_path = g_path_get_dirname (dest_subpath);
   g_autofree char *name = g_path_get_basename (dest_subpath);
-  g_auto(GLnxTmpfile) out_tmpfile = { 0 };
-  g_auto(GLnxTmpfile) cache_tmpfile = { 0 };
+  g_autofree char *fallback_name = g_strconcat (name, CACHE_HTTP_SUFFIX, NULL);
+  g_autofree char *path = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GFileOutputStream) out = NULL;
+  g_autofree char *validator = NULL;
   g_autoptr(GBytes) cache_bytes = NULL;
   gboolean no_xattr = FALSE;
-  glnx_autofd int cache_dfd = -1;
+  glnx_autofd int dfd = -1;
+  struct stat stbuf;
+  guint64 resume_offset = 0;
   gboolean success;
 
-  if (!glnx_opendirat (dest_dfd, parent_path, TRUE, &cache_dfd, error))
+  if (!glnx_opendirat (dest_dfd, parent_path, TRUE, &dfd, error))
     return FALSE;
 
-  cache_data = load_cache_http_data (cache_dfd, name, &no_xattr,
-                                     cancellable, error);
-  if (!cache_data)
+  if (!glnx_fstatat_allow_noent (dfd, name, &stbuf, 0, error))
     return FALSE;
 
-  if (g_strcmp0 (cache_data->uri, uri) != 0)
-    clear_cache_http_data (cache_data, TRUE);
-
-  if (cache_data->uri)
+  /* For partial downloads, the etag field holds the If-Range validator,
+   * which may be an etag or a http date. If we can't read it we just
+   * start over. */
+  if (errno == 0 && stbuf.st_size > 0)
     {
-      if (cache_data->expires > (g_get_real_time () / G_USEC_PER_SEC))
+      cache_data = load_cache_http_data (dfd, name, &no_xattr, cancellable, &local_error);
+      if (cache_data == NULL)
+        g_clear_error (&local_error);
+      else if (g_strcmp0 (cache_data->uri, uri) == 0 &&
+               cache_data->etag != NULL && *cache_data->etag != '\0')
         {
-          g_set_error (error, FLATPAK_HTTP_ERROR,
-                       FLATPAK_HTTP_ERROR_NOT_CHANGED,
-                       "Reusing cached value");
-          return FALSE;
+          validator = g_strdup (cache_data->etag);
+          resume_offset = stbuf.st_size;
         }
     }
 
-  if (cache_data->uri == NULL)
-    cache_data->uri = g_strdup (uri);
+  path = glnx_fdrel_abspath (dfd, name);
+  file = g_file_new_for_path (path);
+  out = g_file_append_to (file, G_FILE_CREATE_NONE, cancellable, error);
+  if (out == NULL)
+    return FALSE;
 
-  /* Missing from cache, or expired so must revalidate via etag/last-modified headers */
+  if (resume_offset == 0 &&
+      !g_seekable_truncate (G_SEEKABLE (out), 0, cancellable, error))
+    return FALSE;
 
   main_context = flatpak_main_context_new_default ();
 
@@ -1284,89 +2649,632 @@ flatpak_cache_http_uri (FlatpakHttpSession    *http_session,
   data.user_data = user_data;
   data.last_progress_time = g_get_monotonic_time ();
   data.cancellable = cancellable;
-  data.flags = flags;
   data.certificates = certificates;
+  data.flags = flags;
 
-  data.cache_data = cache_data;
+  data.out = G_OUTPUT_STREAM (out);
+  data.no_content_encoding = TRUE;
+
+  if (resume_offset > 0)
+    {
+      g_info ("Resuming download of %s at byte %" G_GUINT64_FORMAT, uri, resume_offset);
+      data.resume_offset = resume_offset;
+      data.resume_validator = g_steal_pointer (&validator);
+      data.downloaded_bytes = resume_offset;
+    }
 
-  data.out_tmpfile = &out_tmpfile;
-  data.out_tmpfile_parent_dfd = cache_dfd;
+  success = download_http_uri_to_stream (http_session, &data, uri, &local_error);
 
-  do
+  /* We may already have had all of it, or something else is wrong with the
+   * partial file, so try once more from scratch. */
+  if (!success && resume_offset > 0 && data.status == 416 /* Range Not Satisfiable */)
     {
-      if (n_retries_remaining < DEFAULT_N_NETWORK_RETRIES)
-        {
-          g_clear_error (&local_error);
-          reset_load_uri_data (&data);
-        }
+      g_clear_error (&local_error);
+      reset_load_uri_data (&data);
+
+      if (!g_seekable_truncate (G_SEEKABLE (out), 0, cancellable, error))
+        return FALSE;
+
+      success = download_http_uri_to_stream (http_session, &data, uri, &local_error);
+    }
 
-      success = flatpak_download_http_uri_once (http_session, &data, uri, &local_error);
+  if (!g_output_stream_close (G_OUTPUT_STREAM (out), NULL, success ? &local_error : NULL))
+    success = FALSE;
 
-      if (success)
-        break;
+  if (success)
+    {
+      /* The file is complete, so drop the resume data */
+      if (!no_xattr)
+        (void) TEMP_FAILURE_RETRY (lremovexattr (path, CACHE_HTTP_XATTR));
+      (void) unlinkat (dfd, fallback_name, 0);
 
-      g_assert (local_error != NULL);
+      return TRUE;
     }
-  while (flatpak_http_should_retry_request (local_error, n_retries_remaining--));
 
-  /* Update the cache data on success or cache-valid */
-  if (success || g_error_matches (local_error, FLATPAK_HTTP_ERROR, FLATPAK_HTTP_ERROR_NOT_CHANGED))
+  g_assert (local_error != NULL);
+
+  /* Remember what version of the file we got the data for, if anything */
+  validator = get_range_validator (data.hdr_etag, data.hdr_last_modified);
+  if (validator == NULL)
+    validator = g_strdup (data.resume_validator);
+
+  if (data.downloaded_bytes > 0 && validator != NULL)
     {
-      set_cache_http_data_from_headers (cache_data, &data);
-      cache_bytes = serialize_cache_http_data (cache_data);
+      g_autoptr(CacheHttpData) partial_data = g_new0 (CacheHttpData, 1);
+      g_autoptr(GError) save_error = NULL;
+
+      partial_data->uri = g_strdup (uri);
+      partial_data->etag = g_steal_pointer (&validator);
+      cache_bytes = serialize_cache_http_data (partial_data);
+
+      if (!save_cache_http_data_to_file (dfd, name, cache_bytes, no_xattr,
+                                         NULL, &save_error))
+        g_info ("Failed to save resume data for %s: %s", uri, save_error->message);
     }
 
-  if (local_error)
+  g_propagate_error (error, g_steal_pointer (&local_error));
+  return FALSE;
+}
+
+/************************************************************************
+ *                        Async http support                            *
+ ***********************************************************************/
+
+/* The async variants run the request on the session thread when the
+ * session multiplexes requests, and report back to the thread-default
+ * main context of the caller, so many requests can be in flight without
+ * a thread each. Otherwise, or for FLATPAK_HTTP_FLAGS_NO_MULTIPLEX, the
+ * request runs in a worker thread. Either way the progress callback and
+ * the callback are called in the caller's main context, and the retries
+ * are the same as for the sync variants. */
+
+typedef enum {
+  LOAD_URI_ASYNC_CONTENT,
+  LOAD_URI_ASYNC_STREAM,
+  LOAD_URI_ASYNC_CACHE,
+} LoadUriAsyncKind;
+
+typedef struct
+{
+  LoadUriAsyncKind       kind;
+  FlatpakHttpSession    *session;
+  char                  *uri;
+  char                  *auth;
+  char                  *token;
+  FlatpakCertificates   *certificates;
+  GOutputStream         *out;
+  GCancellable          *cancellable;
+  FlatpakLoadUriProgress progress;
+  gpointer               progress_data;
+
+  LoadUriData            data;
+  CacheHttpRequest       cache_request;
+  guint                  n_retries_remaining;
+  GSource               *progress_source;
+
+  /* Set if the request runs in a worker thread, which reports the
+   * progress through thread_bytes */
+  gboolean               threaded;
+  GMutex                 lock;
+  guint64                thread_bytes;
+
+#ifdef HTTP_SESSION_USE_MULTI
+  CURL                  *curl;
+  struct curl_slist     *header_list;
+  HttpTransfer           transfer;
+#endif
+} LoadUriAsync;
+
+static void
+load_uri_async_free (LoadUriAsync *async)
+{
+#ifdef HTTP_SESSION_USE_MULTI
+  g_assert (async->curl == NULL);
+#endif
+
+  if (async->progress_source)
     {
-      if (cache_bytes)
-        {
-          GError *tmp_error = NULL;
+      g_source_destroy (async->progress_source);
+      g_source_unref (async->progress_source);
+    }
 
-          if (!save_cache_http_data_to_file (cache_dfd, name, cache_bytes, no_xattr,
-                                             cancellable, &tmp_error))
-            {
-              g_clear_error (&local_error);
-              g_propagate_error (error, tmp_error);
+  clear_load_uri_data (&async->data);
+  clear_cache_http_request (&async->cache_request);
+
+  g_free (async->uri);
+  g_free (async->auth);
+  g_free (async->token);
+  g_clear_pointer (&async->certificates, flatpak_certificates_free);
+  g_clear_object (&async->out);
+  g_clear_object (&async->cancellable);
+  g_mutex_clear (&async->lock);
+  g_free (async);
+}
 
-              return FALSE;
-            }
-        }
+static void
+load_uri_async_thread_progress (guint64  downloaded_bytes,
+                                gpointer user_data)
+{
+  LoadUriAsync *async = user_data;
 
-      g_propagate_error (error, g_steal_pointer (&local_error));
-      return FALSE;
+  g_mutex_lock (&async->lock);
+  async->thread_bytes = downloaded_bytes;
+  g_mutex_unlock (&async->lock);
+}
+
+static gboolean
+load_uri_async_progress_cb (gpointer user_data)
+{
+  GTask *task = user_data;
+  LoadUriAsync *async = g_task_get_task_data (task);
+  guint64 downloaded_bytes;
+
+  if (async->threaded)
+    {
+      g_mutex_lock (&async->lock);
+      downloaded_bytes = async->thread_bytes;
+      g_mutex_unlock (&async->lock);
+    }
+  else
+    {
+#ifdef HTTP_SESSION_USE_MULTI
+      g_mutex_lock (&async->session->multi_lock);
+      downloaded_bytes = async->data.downloaded_bytes;
+      g_mutex_unlock (&async->session->multi_lock);
+#else
+      g_assert_not_reached ();
+#endif
     }
 
-  if (!no_xattr)
+  async->progress (downloaded_bytes, async->progress_data);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GTask *
+load_uri_async_new (FlatpakHttpSession    *session,
+                    LoadUriAsyncKind       kind,
+                    const char            *uri,
+                    FlatpakCertificates   *certificates,
+                    FlatpakHTTPFlags       flags,
+                    const char            *auth,
+                    const char            *token,
+                    FlatpakLoadUriProgress progress,
+                    gpointer               progress_data,
+                    GCancellable          *cancellable,
+                    GAsyncReadyCallback    callback,
+                    gpointer               user_data)
+{
+  g_autoptr(GTask) task = g_task_new (NULL, cancellable, callback, user_data);
+  LoadUriAsync *async = g_new0 (LoadUriAsync, 1);
+
+  g_task_set_task_data (task, async, (GDestroyNotify) load_uri_async_free);
+
+  g_mutex_init (&async->lock);
+  async->kind = kind;
+  async->session = session;
+  async->uri = g_strdup (uri);
+  async->auth = g_strdup (auth);
+  async->token = g_strdup (token);
+  if (certificates)
+    async->certificates = flatpak_certificates_copy (certificates);
+  if (cancellable)
+    async->cancellable = g_object_ref (cancellable);
+  async->progress = progress;
+  async->progress_data = progress_data;
+  async->n_retries_remaining = (flags & FLATPAK_HTTP_FLAGS_FAIL_FAST) ? 0 : DEFAULT_N_NETWORK_RETRIES;
+  async->cache_request.cache_dfd = -1;
+
+#ifdef HTTP_SESSION_USE_MULTI
+  async->threaded = (flags & FLATPAK_HTTP_FLAGS_NO_MULTIPLEX) != 0;
+#else
+  async->threaded = TRUE;
+#endif
+
+  async->data.progress = async->threaded ? load_uri_async_thread_progress : progress;
+  async->data.user_data = async->threaded ? (gpointer) async : progress_data;
+  async->data.last_progress_time = g_get_monotonic_time ();
+  async->data.cancellable = async->cancellable;
+  async->data.flags = flags;
+  async->data.certificates = async->certificates;
+  async->data.auth = async->auth;
+  async->data.token = async->token;
+
+  return g_steal_pointer (&task);
+}
+
+static LoadUriRetryMode
+load_uri_async_get_retry_mode (LoadUriAsync *async)
+{
+  switch (async->kind)
     {
-      if (!save_cache_http_data_xattr (out_tmpfile.fd, cache_bytes, error))
-        {
-          if (errno != ENOTSUP)
-            return FALSE;
+    case LOAD_URI_ASYNC_CONTENT:
+      return LOAD_URI_RETRY_RESUME;
 
-          g_clear_error (error);
-          no_xattr = TRUE;
-        }
+    case LOAD_URI_ASYNC_STREAM:
+      return LOAD_URI_RETRY_RESUME_ONLY;
+
+    case LOAD_URI_ASYNC_CACHE:
+    default:
+      return LOAD_URI_RETRY_RESTART;
+    }
+}
+
+/* Returns the outcome of the request, which failed with @local_error
+ * unless it is %NULL. This takes ownership of @local_error. */
+static void
+load_uri_async_return (GTask  *task,
+                       GError *local_error)
+{
+  LoadUriAsync *async = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  if (async->progress_source)
+    {
+      g_source_destroy (async->progress_source);
+      g_clear_pointer (&async->progress_source, g_source_unref);
     }
 
-  if (no_xattr)
+  if (local_error == NULL && async->threaded && async->progress)
+    async->progress (async->data.downloaded_bytes, async->progress_data);
+
+  switch (async->kind)
     {
-      if (!glnx_open_tmpfile_linkable_at (cache_dfd, ".", O_WRONLY, &cache_tmpfile, error))
-        return FALSE;
+    case LOAD_URI_ASYNC_CONTENT:
+      if (local_error)
+        g_task_return_error (task, local_error);
+      else
+        g_task_return_pointer (task, g_string_free_to_bytes (g_steal_pointer (&async->data.content)),
+                               (GDestroyNotify) g_bytes_unref);
+      break;
 
-      if (!save_cache_http_data_fallback (cache_tmpfile.fd, cache_bytes, error))
-        return FALSE;
+    case LOAD_URI_ASYNC_STREAM:
+      if (local_error)
+        g_task_return_error (task, local_error);
+      else
+        g_task_return_boolean (task, TRUE);
+      break;
+
+    case LOAD_URI_ASYNC_CACHE:
+      if (cache_http_request_end (&async->cache_request, &async->data, local_error,
+                                  async->cancellable, &error))
+        g_task_return_boolean (task, TRUE);
+      else
+        g_task_return_error (task, error);
+      break;
+
+    default:
+      g_assert_not_reached ();
     }
+}
 
-  if (!sync_and_rename_tmpfile (&out_tmpfile, name, error))
-    return FALSE;
+static void
+load_uri_async_thread (GTask        *thread_task,
+                       gpointer      source_object,
+                       gpointer      task_data,
+                       GCancellable *cancellable)
+{
+  GTask *task = task_data;
+  LoadUriAsync *async = g_task_get_task_data (task);
+  LoadUriRetryMode retry_mode = load_uri_async_get_retry_mode (async);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!download_http_uri_with_retries (async->session, &async->data, async->uri,
+                                       retry_mode, &local_error))
+    g_task_return_error (thread_task, g_steal_pointer (&local_error));
+  else
+    g_task_return_boolean (thread_task, TRUE);
+}
+
+static void
+load_uri_async_thread_done (GObject      *source_object,
+                            GAsyncResult *result,
+                            gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GError *local_error = NULL;
+
+  g_task_propagate_boolean (G_TASK (result), &local_error);
+  load_uri_async_return (task, local_error);
+}
+
+#ifdef HTTP_SESSION_USE_MULTI
+
+static void load_uri_async_start_transfer (GTask *task);
 
-  if (no_xattr)
+static gboolean
+load_uri_async_retry_cb (gpointer user_data)
+{
+  load_uri_async_start_transfer (user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+load_uri_async_transfer_done_cb (gpointer user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  LoadUriAsync *async = g_task_get_task_data (task);
+  g_autoptr(GError) local_error = NULL;
+  gboolean success;
+  guint delay_msec;
+
+  curl_easy_setopt (async->curl, CURLOPT_PRIVATE, NULL);
+  async->data.multiplexed = FALSE;
+
+  success = http_request_finish (async->curl, &async->data, async->uri,
+                                 async->transfer.result, &local_error);
+
+  FLATPAK_TRACE3 (http_request_done, async->uri, success, async->data.downloaded_bytes);
+
+  g_clear_pointer (&async->header_list, curl_slist_free_all);
+  http_session_release_curl (async->session, g_steal_pointer (&async->curl));
+
+  if (!success &&
+      load_uri_data_prepare_retry (&async->data, load_uri_async_get_retry_mode (async),
+                                   local_error, &async->n_retries_remaining, &delay_msec))
     {
-      g_autofree char *fallback_name = g_strconcat (name, CACHE_HTTP_SUFFIX, NULL);
+      g_autoptr(GSource) source = g_timeout_source_new (delay_msec);
 
-      if (!sync_and_rename_tmpfile (&cache_tmpfile, fallback_name, error))
-        return FALSE;
+      g_task_attach_source (task, source, load_uri_async_retry_cb);
+      task = NULL; /* The retry has our reference now */
     }
+  else
+    load_uri_async_return (task, g_steal_pointer (&local_error));
 
-  return TRUE;
+  return G_SOURCE_REMOVE;
+}
+
+/* Called on the session thread */
+static void
+load_uri_async_transfer_done (gpointer user_data)
+{
+  GTask *task = user_data;
+  g_autoptr(GSource) source = g_idle_source_new ();
+
+  /* This takes over the reference of the transfer */
+  g_task_attach_source (task, source, load_uri_async_transfer_done_cb);
+}
+
+/* Takes ownership of @task */
+static void
+load_uri_async_start_transfer (GTask *task)
+{
+  LoadUriAsync *async = g_task_get_task_data (task);
+  guint64 max_recv_speed;
+  FlatpakHTTPFlags session_flags;
+
+  if (g_cancellable_is_cancelled (async->cancellable))
+    {
+      GError *local_error = NULL;
+
+      g_cancellable_set_error_if_cancelled (async->cancellable, &local_error);
+      load_uri_async_return (task, local_error);
+      g_object_unref (task);
+      return;
+    }
+
+  async->curl = http_session_acquire_curl (async->session, &max_recv_speed, &session_flags);
+  async->data.flags |= session_flags;
+  async->data.session = async->session;
+  FLATPAK_TRACE1 (http_request_start, async->uri);
+
+  async->header_list = http_request_setup (async->curl, max_recv_speed, &async->data, async->uri);
+
+  async->data.multiplexed = TRUE;
+
+  async->transfer.curl = async->curl;
+  async->transfer.result = CURLE_OK;
+  async->transfer.done = FALSE;
+  async->transfer.done_func = load_uri_async_transfer_done;
+  async->transfer.user_data = task;
+
+  http_session_start_transfer (async->session, &async->transfer);
+}
+
+#endif
+
+static void
+load_uri_async_start (GTask *task)
+{
+  LoadUriAsync *async = g_task_get_task_data (task);
+
+  if (async->progress)
+    {
+      async->progress_source = g_timeout_source_new_seconds (1);
+      g_task_attach_source (task, async->progress_source, load_uri_async_progress_cb);
+    }
+
+  if (async->threaded)
+    {
+      g_autoptr(GTask) thread_task = g_task_new (NULL, async->cancellable,
+                                                 load_uri_async_thread_done,
+                                                 g_object_ref (task));
+
+      /* The callback holds a reference until the thread is done */
+      g_task_set_task_data (thread_task, task, NULL);
+      g_task_run_in_thread (thread_task, load_uri_async_thread);
+      return;
+    }
+
+#ifdef HTTP_SESSION_USE_MULTI
+  load_uri_async_start_transfer (g_object_ref (task));
+#else
+  g_assert_not_reached ();
+#endif
+}
+
+static void
+load_uri_file_contents_cb (GObject      *source_object,
+                           GAsyncResult *result,
+                           gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  GError *error = NULL;
+  gchar *contents;
+  gsize len;
+
+  if (!g_file_load_contents_finish (G_FILE (source_object), result, &contents, &len, NULL, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, g_bytes_new_take (contents, len),
+                           (GDestroyNotify) g_bytes_unref);
+}
+
+/* Async variant of flatpak_load_uri_full(). @http_session must be kept
+ * alive until @callback is called. */
+void
+flatpak_load_uri_full_async (FlatpakHttpSession    *http_session,
+                             const char            *uri,
+                             FlatpakCertificates   *certificates,
+                             FlatpakHTTPFlags       flags,
+                             const char            *auth,
+                             const char            *token,
+                             FlatpakLoadUriProgress progress,
+                             gpointer               progress_data,
+                             GCancellable          *cancellable,
+                             GAsyncReadyCallback    callback,
+                             gpointer               user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  LoadUriAsync *async;
+
+  task = load_uri_async_new (http_session, LOAD_URI_ASYNC_CONTENT, uri, certificates, flags,
+                             auth, token, progress, progress_data,
+                             cancellable, callback, user_data);
+  g_task_set_source_tag (task, flatpak_load_uri_full_async);
+  async = g_task_get_task_data (task);
+
+  /* Ensure we handle file: uris the same independent of backend */
+  if (g_ascii_strncasecmp (uri, "file:", 5) == 0)
+    {
+      g_autoptr(GFile) file = g_file_new_for_uri (uri);
+
+      g_file_load_contents_async (file, cancellable, load_uri_file_contents_cb,
+                                  g_steal_pointer (&task));
+      return;
+    }
+
+  async->data.content = g_string_new ("");
+
+  load_uri_async_start (task);
+}
+
+GBytes *
+flatpak_load_uri_full_finish (GAsyncResult *result,
+                              int          *out_status,
+                              char        **out_content_type,
+                              char        **out_www_authenticate,
+                              GError      **error)
+{
+  GTask *task = G_TASK (result);
+  LoadUriAsync *async;
+  GBytes *bytes;
+
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (task) == flatpak_load_uri_full_async, NULL);
+
+  bytes = g_task_propagate_pointer (task, error);
+  if (bytes == NULL)
+    return NULL;
+
+  async = g_task_get_task_data (task);
+
+  if (out_content_type)
+    *out_content_type = g_steal_pointer (&async->data.hdr_content_type);
+
+  if (out_www_authenticate)
+    *out_www_authenticate = g_steal_pointer (&async->data.hdr_www_authenticate);
+
+  if (out_status)
+    *out_status = async->data.status;
+
+  return bytes;
+}
+
+/* Async variant of flatpak_download_http_uri(). @http_session must be
+ * kept alive until @callback is called, and @out must not be used
+ * meanwhile, as it is written to from another thread. */
+void
+flatpak_download_http_uri_async (FlatpakHttpSession    *http_session,
+                                 const char            *uri,
+                                 FlatpakCertificates   *certificates,
+                                 FlatpakHTTPFlags       flags,
+                                 GOutputStream         *out,
+                                 const char            *token,
+                                 FlatpakLoadUriProgress progress,
+                                 gpointer               progress_data,
+                                 GCancellable          *cancellable,
+                                 GAsyncReadyCallback    callback,
+                                 gpointer               user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  LoadUriAsync *async;
+
+  task = load_uri_async_new (http_session, LOAD_URI_ASYNC_STREAM, uri, certificates, flags,
+                             NULL, token, progress, progress_data,
+                             cancellable, callback, user_data);
+  g_task_set_source_tag (task, flatpak_download_http_uri_async);
+  async = g_task_get_task_data (task);
+
+  async->out = g_object_ref (out);
+  async->data.out = async->out;
+
+  load_uri_async_start (task);
+}
+
+gboolean
+flatpak_download_http_uri_finish (GAsyncResult *result,
+                                  GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == flatpak_download_http_uri_async, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/* Async variant of flatpak_cache_http_uri(). @http_session must be kept
+ * alive until @callback is called. */
+void
+flatpak_cache_http_uri_async (FlatpakHttpSession    *http_session,
+                              const char            *uri,
+                              FlatpakCertificates   *certificates,
+                              FlatpakHTTPFlags       flags,
+                              int                    dest_dfd,
+                              const char            *dest_subpath,
+                              FlatpakLoadUriProgress progress,
+                              gpointer               progress_data,
+                              GCancellable          *cancellable,
+                              GAsyncReadyCallback    callback,
+                              gpointer               user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) local_error = NULL;
+  LoadUriAsync *async;
+
+  task = load_uri_async_new (http_session, LOAD_URI_ASYNC_CACHE, uri, certificates, flags,
+                             NULL, NULL, progress, progress_data,
+                             cancellable, callback, user_data);
+  g_task_set_source_tag (task, flatpak_cache_http_uri_async);
+  async = g_task_get_task_data (task);
+
+  /* This is only local I/O, and answers most calls without a request */
+  if (!cache_http_request_begin (&async->cache_request, &async->data, uri,
+                                 dest_dfd, dest_subpath, cancellable, &local_error))
+    {
+      g_task_return_error (task, g_steal_pointer (&local_error));
+      return;
+    }
+
+  load_uri_async_start (task);
+}
+
+gboolean
+flatpak_cache_http_uri_finish (GAsyncResult *result,
+                               GError      **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == flatpak_cache_http_uri_async, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
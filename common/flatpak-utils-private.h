@@ -22,10 +22,12 @@
 #define __FLATPAK_UTILS_H__
 
 #include <string.h>
+#include <sys/uio.h>
 
 #include "libglnx.h"
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
+#include "flatpak-common-types-private.h"
 #include "flatpak-error.h"
 #include "flatpak-glib-backports-private.h"
 
@@ -169,6 +171,11 @@ char *flatpak_keyfile_get_string_non_empty (GKeyFile *keyfile,
                                             const char *group,
                                             const char *key);
 
+GVariant *flatpak_keyfile_to_variant         (GKeyFile    *keyfile);
+GKeyFile *flatpak_keyfile_new_from_variant   (GVariant    *variant);
+GKeyFile *flatpak_keyfile_load_variant_file  (const char  *path,
+                                              GError     **error);
+
 GBytes *flatpak_zlib_compress_bytes   (GBytes  *bytes,
                                        int      level,
                                        GError **error);
@@ -219,6 +226,8 @@ gboolean flatpak_rm_rf (GFile        *dir,
                         GCancellable *cancellable,
                         GError      **error);
 
+void flatpak_set_thread_background_priority (void);
+
 gboolean flatpak_canonicalize_permissions (int         parent_dfd,
                                            const char *rel_path,
                                            int         uid,
@@ -242,6 +251,11 @@ gboolean flatpak_buffer_to_sealed_memfd_or_tmpfile (GLnxTmpfile *tmpf,
                                                     const char  *str,
                                                     size_t       len,
                                                     GError     **error);
+gboolean flatpak_iovec_to_sealed_memfd_or_tmpfile  (GLnxTmpfile        *tmpf,
+                                                    const char         *name,
+                                                    const struct iovec *iov,
+                                                    int                 n_iov,
+                                                    GError            **error);
 
 static inline void
 flatpak_temp_dir_destroy (void *p)
@@ -289,12 +303,25 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (GMainContextPopDefault, flatpak_main_context_pop_
 #define AUTOLOCK(name) G_GNUC_UNUSED __attribute__((cleanup (flatpak_auto_unlock_helper))) GMutex * G_PASTE (auto_unlock, __LINE__) = flatpak_auto_lock_helper (&G_LOCK_NAME (name))
 
 char * flatpak_filter_glob_to_regexp (const char *glob, gboolean runtime_only, GError **error);
+
+FlatpakFilter *flatpak_filter_new (void);
+FlatpakFilter *flatpak_filter_ref (FlatpakFilter *filter);
+void flatpak_filter_unref (FlatpakFilter *filter);
+gboolean flatpak_filter_add_glob (FlatpakFilter *filter,
+                                  const char    *glob,
+                                  gboolean       runtime_only,
+                                  GError       **error);
+gboolean flatpak_filter_matches (FlatpakFilter *filter,
+                                 const char    *ref);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakFilter, flatpak_filter_unref)
+
 gboolean flatpak_parse_filters (const char *data,
-                                GRegex **allow_refs_out,
-                                GRegex **deny_refs_out,
+                                FlatpakFilter **allow_refs_out,
+                                FlatpakFilter **deny_refs_out,
                                 GError **error);
-gboolean flatpak_filters_allow_ref (GRegex *allow_refs,
-                                    GRegex *deny_refs,
+gboolean flatpak_filters_allow_ref (FlatpakFilter *allow_refs,
+                                    FlatpakFilter *deny_refs,
                                     const char *ref);
 
 gboolean flatpak_allocate_tmpdir (int           tmpdir_dfd,
@@ -325,6 +352,11 @@ int flatpak_levenshtein_distance (const char *s,
                                   gssize      ls,
                                   const char *t,
                                   gssize      lt);
+int flatpak_levenshtein_distance_bounded (const char *s,
+                                          gssize      ls,
+                                          const char *t,
+                                          gssize      lt,
+                                          int         max);
 
 char *   flatpak_dconf_path_for_app_id (const char *app_id);
 gboolean flatpak_dconf_path_is_similar (const char *path1,
@@ -365,6 +397,11 @@ gboolean running_under_sudo_root (void);
 void flatpak_set_debugging (gboolean debugging);
 gboolean flatpak_is_debugging (void);
 
+void flatpak_startup_profile_start (const char *output,
+                                    gint64      start_time);
+void flatpak_startup_profile_mark  (const char *phase);
+void flatpak_startup_profile_write (const char *app_id);
+
 int flatpak_parse_fd (const char  *fd_string,
                       GError     **error);
 
@@ -28,6 +28,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
@@ -35,14 +36,18 @@
 #include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <termios.h>
 
 #include <glib.h>
 #include <gio/gunixoutputstream.h>
 
 #include "flatpak-error.h"
+#include "flatpak-trace-private.h"
 #include "flatpak-utils-base-private.h"
 #include "flatpak-utils-private.h"
 #include "libglnx.h"
@@ -788,20 +793,349 @@ flatpak_filter_glob_to_regexp (const char  *glob,
   return g_string_free (g_steal_pointer (&regexp), FALSE);
 }
 
+/* A compiled set of ref globs, as used for remote filters, masks and
+ * pins. Each glob is stored in a trie under the literal prefix of its id
+ * part (up to the first '*'), so matching a ref walks the trie along its
+ * id and only tries the globs on that path, rather than every glob. */
+
+typedef struct
+{
+  gboolean match_apps;
+  gboolean match_runtimes;
+  char    *segments[3]; /* id, arch, branch; NULL matches anything */
+} FilterGlob;
+
+typedef struct _FilterTrieNode FilterTrieNode;
+
+struct _FilterTrieNode
+{
+  char            c;
+  FilterTrieNode *first_child;
+  FilterTrieNode *next_sibling;
+  GPtrArray      *globs; /* FilterGlob, nullable */
+};
+
+struct _FlatpakFilter
+{
+  int            ref_count;
+  gboolean       empty;
+  FilterTrieNode root;
+};
+
+static void
+filter_glob_free (FilterGlob *glob)
+{
+  for (gsize i = 0; i < G_N_ELEMENTS (glob->segments); i++)
+    g_free (glob->segments[i]);
+  g_free (glob);
+}
+
+static void
+filter_trie_node_clear (FilterTrieNode *node)
+{
+  FilterTrieNode *child = node->first_child;
+
+  while (child != NULL)
+    {
+      FilterTrieNode *next = child->next_sibling;
+
+      filter_trie_node_clear (child);
+      g_free (child);
+      child = next;
+    }
+
+  g_clear_pointer (&node->globs, g_ptr_array_unref);
+}
+
+static FilterTrieNode *
+filter_trie_node_get_child (FilterTrieNode *node,
+                            char            c,
+                            gboolean        create)
+{
+  FilterTrieNode *child;
+
+  for (child = node->first_child; child != NULL; child = child->next_sibling)
+    {
+      if (child->c == c)
+        return child;
+    }
+
+  if (!create)
+    return NULL;
+
+  child = g_new0 (FilterTrieNode, 1);
+  child->c = c;
+  child->next_sibling = node->first_child;
+  node->first_child = child;
+
+  return child;
+}
+
+FlatpakFilter *
+flatpak_filter_new (void)
+{
+  FlatpakFilter *filter = g_new0 (FlatpakFilter, 1);
+
+  filter->ref_count = 1;
+  filter->empty = TRUE;
+
+  return filter;
+}
+
+FlatpakFilter *
+flatpak_filter_ref (FlatpakFilter *filter)
+{
+  g_atomic_int_inc (&filter->ref_count);
+  return filter;
+}
+
+void
+flatpak_filter_unref (FlatpakFilter *filter)
+{
+  if (g_atomic_int_dec_and_test (&filter->ref_count))
+    {
+      filter_trie_node_clear (&filter->root);
+      g_free (filter);
+    }
+}
+
+static gboolean
+filter_glob_char_is_valid (char c)
+{
+  return g_ascii_isalnum (c) || c == '-' || c == '_' || c == '.';
+}
+
+/* Accepts the same globs as flatpak_filter_glob_to_regexp(), with the
+ * same errors. Must not be called once the filter is shared. */
 gboolean
-flatpak_parse_filters (const char *data,
-                       GRegex **allow_refs_out,
-                       GRegex **deny_refs_out,
-                       GError **error)
+flatpak_filter_add_glob (FlatpakFilter *filter,
+                         const char    *glob,
+                         gboolean       runtime_only,
+                         GError       **error)
+{
+  g_autoptr(GString) segment = g_string_new ("");
+  FilterGlob *filter_glob;
+  FilterTrieNode *node;
+  char *segments[3] = { NULL, NULL, NULL };
+  gboolean match_apps, match_runtimes;
+  int parts = 1;
+
+  if (g_str_has_prefix (glob, "app/"))
+    {
+      if (runtime_only)
+        return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Glob can't match apps"));
+
+      glob += strlen ("app/");
+      match_apps = TRUE;
+      match_runtimes = FALSE;
+    }
+  else if (g_str_has_prefix (glob, "runtime/"))
+    {
+      glob += strlen ("runtime/");
+      match_apps = FALSE;
+      match_runtimes = TRUE;
+    }
+  else
+    {
+      match_apps = !runtime_only;
+      match_runtimes = TRUE;
+    }
+
+  /* We really need an id part, the rest is optional */
+  if (*glob == 0)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Empty glob"));
+
+  for (;; glob++)
+    {
+      char c = *glob;
+
+      if (c == '/' || c == 0)
+        {
+          /* An empty part matches anything, like a missing one, except
+           * that a trailing '/' only matches an empty part */
+          if (segment->len > 0 || c == 0)
+            segments[parts - 1] = g_strdup (segment->str);
+          g_string_truncate (segment, 0);
+
+          if (c == 0)
+            break;
+
+          parts++;
+          if (parts > 3)
+            {
+              for (gsize i = 0; i < G_N_ELEMENTS (segments); i++)
+                g_free (segments[i]);
+              return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Too many segments in glob"));
+            }
+        }
+      else if (c == '*' || filter_glob_char_is_valid (c))
+        g_string_append_c (segment, c);
+      else
+        {
+          for (gsize i = 0; i < G_N_ELEMENTS (segments); i++)
+            g_free (segments[i]);
+          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid glob character '%c'"), c);
+        }
+    }
+
+  filter_glob = g_new0 (FilterGlob, 1);
+  filter_glob->match_apps = match_apps;
+  filter_glob->match_runtimes = match_runtimes;
+  memcpy (filter_glob->segments, segments, sizeof (segments));
+
+  node = &filter->root;
+  for (const char *p = filter_glob->segments[0]; p != NULL && *p != 0 && *p != '*'; p++)
+    node = filter_trie_node_get_child (node, *p, TRUE);
+
+  if (node->globs == NULL)
+    node->globs = g_ptr_array_new_with_free_func ((GDestroyNotify) filter_glob_free);
+  g_ptr_array_add (node->globs, filter_glob);
+  filter->empty = FALSE;
+
+  return TRUE;
+}
+
+/* A '*' matches any run of valid glob characters */
+static gboolean
+filter_segment_matches (const char *pattern,
+                        const char *str,
+                        gsize       len)
+{
+  const char *star_p = NULL;
+  gsize star_s = 0;
+  gsize s = 0;
+
+  /* Nothing but a '*' can match other characters, so once they are
+   * ruled out the classic wildcard matching below is enough */
+  for (gsize i = 0; i < len; i++)
+    {
+      if (!filter_glob_char_is_valid (str[i]))
+        return FALSE;
+    }
+
+  if (pattern == NULL)
+    return TRUE;
+
+  while (s < len)
+    {
+      if (*pattern == '*')
+        {
+          star_p = pattern++;
+          star_s = s;
+        }
+      else if (*pattern != 0 && *pattern == str[s])
+        {
+          pattern++;
+          s++;
+        }
+      else if (star_p != NULL)
+        {
+          pattern = star_p + 1;
+          s = ++star_s;
+        }
+      else
+        return FALSE;
+    }
+
+  while (*pattern == '*')
+    pattern++;
+
+  return *pattern == 0;
+}
+
+static gboolean
+filter_globs_match (GPtrArray  *globs,
+                    gboolean    is_app,
+                    const char *parts[3],
+                    gsize       part_lens[3])
+{
+  for (guint i = 0; globs != NULL && i < globs->len; i++)
+    {
+      FilterGlob *glob = g_ptr_array_index (globs, i);
+
+      if (!(is_app ? glob->match_apps : glob->match_runtimes))
+        continue;
+
+      if (filter_segment_matches (glob->segments[0], parts[0], part_lens[0]) &&
+          filter_segment_matches (glob->segments[1], parts[1], part_lens[1]) &&
+          filter_segment_matches (glob->segments[2], parts[2], part_lens[2]))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+gboolean
+flatpak_filter_matches (FlatpakFilter *filter,
+                        const char    *ref)
+{
+  const char *parts[3];
+  gsize part_lens[3];
+  const char *p;
+  gboolean is_app;
+  FilterTrieNode *node;
+
+  if (filter->empty)
+    return FALSE;
+
+  if (g_str_has_prefix (ref, "app/"))
+    {
+      is_app = TRUE;
+      p = ref + strlen ("app/");
+    }
+  else if (g_str_has_prefix (ref, "runtime/"))
+    {
+      is_app = FALSE;
+      p = ref + strlen ("runtime/");
+    }
+  else
+    return FALSE;
+
+  for (int i = 0; i < 3; i++)
+    {
+      const char *end = strchr (p, '/');
+
+      if (i < 2 && end == NULL)
+        return FALSE;
+      if (i == 2)
+        {
+          if (end != NULL)
+            return FALSE;
+          end = p + strlen (p);
+        }
+
+      parts[i] = p;
+      part_lens[i] = end - p;
+      p = end + 1;
+    }
+
+  node = &filter->root;
+  if (filter_globs_match (node->globs, is_app, parts, part_lens))
+    return TRUE;
+
+  for (gsize i = 0; i < part_lens[0]; i++)
+    {
+      node = filter_trie_node_get_child (node, parts[0][i], FALSE);
+      if (node == NULL)
+        break;
+
+      if (filter_globs_match (node->globs, is_app, parts, part_lens))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+gboolean
+flatpak_parse_filters (const char     *data,
+                       FlatpakFilter **allow_refs_out,
+                       FlatpakFilter **deny_refs_out,
+                       GError        **error)
 {
   g_auto(GStrv) lines = NULL;
   int i;
-  g_autoptr(GString) allow_regexp = g_string_new ("^(");
-  g_autoptr(GString) deny_regexp = g_string_new ("^(");
-  gboolean has_allow = FALSE;
-  gboolean has_deny = FALSE;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
+  g_autoptr(FlatpakFilter) allow_refs = flatpak_filter_new ();
+  g_autoptr(FlatpakFilter) deny_refs = flatpak_filter_new ();
 
   lines = g_strsplit (data, "\n", -1);
   for (i = 0; lines[i] != NULL; i++)
@@ -822,9 +1156,6 @@ flatpak_parse_filters (const char *data,
       if (strcmp (command, "allow") == 0 || strcmp (command, "deny") == 0)
         {
           char *glob, *next;
-          g_autofree char *ref_regexp = NULL;
-          GString *command_regexp;
-          gboolean *has_type = NULL;
 
           glob = line_get_word (&line);
           if (glob == NULL)
@@ -834,27 +1165,9 @@ flatpak_parse_filters (const char *data,
           if (next != NULL)
             return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Trailing text on line %d"), i + 1);
 
-          ref_regexp = flatpak_filter_glob_to_regexp (glob, FALSE, error);
-          if (ref_regexp == NULL)
+          if (!flatpak_filter_add_glob (strcmp (command, "allow") == 0 ? allow_refs : deny_refs,
+                                        glob, FALSE, error))
             return glnx_prefix_error (error, _("on line %d"), i + 1);
-
-          if (strcmp (command, "allow") == 0)
-            {
-              command_regexp = allow_regexp;
-              has_type = &has_allow;
-            }
-          else
-            {
-              command_regexp = deny_regexp;
-              has_type = &has_deny;
-            }
-
-          if (*has_type)
-            g_string_append (command_regexp, "|");
-          else
-            *has_type = TRUE;
-
-          g_string_append (command_regexp, ref_regexp);
         }
       else
         {
@@ -862,23 +1175,6 @@ flatpak_parse_filters (const char *data,
         }
     }
 
-  g_string_append (allow_regexp, ")$");
-  g_string_append (deny_regexp, ")$");
-
-  if (allow_regexp)
-    {
-      allow_refs = g_regex_new (allow_regexp->str, G_REGEX_DOLLAR_ENDONLY|G_REGEX_RAW|G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, error);
-      if (allow_refs == NULL)
-        return FALSE;
-    }
-
-  if (deny_regexp)
-    {
-      deny_refs = g_regex_new (deny_regexp->str, G_REGEX_DOLLAR_ENDONLY|G_REGEX_RAW|G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, error);
-      if (deny_refs == NULL)
-        return FALSE;
-    }
-
   *allow_refs_out = g_steal_pointer (&allow_refs);
   *deny_refs_out = g_steal_pointer (&deny_refs);
 
@@ -886,17 +1182,17 @@ flatpak_parse_filters (const char *data,
 }
 
 gboolean
-flatpak_filters_allow_ref (GRegex *allow_refs,
-                           GRegex *deny_refs,
-                           const char *ref)
+flatpak_filters_allow_ref (FlatpakFilter *allow_refs,
+                           FlatpakFilter *deny_refs,
+                           const char    *ref)
 {
   if (deny_refs == NULL)
     return TRUE; /* All refs are allowed by default */
 
-  if (!g_regex_match (deny_refs, ref, G_REGEX_MATCH_ANCHORED, NULL))
+  if (!flatpak_filter_matches (deny_refs, ref))
     return TRUE; /* Not denied */
 
-  if (allow_refs &&  g_regex_match (allow_refs, ref, G_REGEX_MATCH_ANCHORED, NULL))
+  if (allow_refs && flatpak_filter_matches (allow_refs, ref))
     return TRUE; /* Explicitly allowed */
 
   return FALSE;
@@ -1456,6 +1752,29 @@ _flatpak_canonicalize_permissions (int         parent_dfd,
   return res;
 }
 
+/* There is no glibc wrapper for ioprio_set() */
+#define FLATPAK_IOPRIO_WHO_PROCESS 1
+#define FLATPAK_IOPRIO_CLASS_IDLE 3
+#define FLATPAK_IOPRIO_CLASS_SHIFT 13
+
+/* Makes the calling thread only use the CPU and disk when nothing else
+ * wants them. This can't be undone without privileges, so only do it in
+ * threads that go away afterwards. */
+void
+flatpak_set_thread_background_priority (void)
+{
+  pid_t tid = syscall (SYS_gettid);
+
+  if (setpriority (PRIO_PROCESS, tid, 19) != 0)
+    g_info ("Failed to lower the CPU priority: %s", g_strerror (errno));
+
+#ifdef SYS_ioprio_set
+  if (syscall (SYS_ioprio_set, FLATPAK_IOPRIO_WHO_PROCESS, tid,
+               FLATPAK_IOPRIO_CLASS_IDLE << FLATPAK_IOPRIO_CLASS_SHIFT) != 0)
+    g_info ("Failed to lower the I/O priority: %s", g_strerror (errno));
+#endif
+}
+
 /* Canonicalizes files to the same permissions as bare-user-only checkouts */
 gboolean
 flatpak_canonicalize_permissions (int         parent_dfd,
@@ -1515,15 +1834,53 @@ flatpak_file_rename (GFile        *from,
  * @tmpf, and lseek() back to the start. See also similar uses in e.g.
  * rpm-ostree for running dracut.
  */
+/* Like glnx_loop_write(), for an array of buffers */
+static gboolean
+flatpak_loop_writev (int                 fd,
+                     const struct iovec *iov,
+                     int                 n_iov)
+{
+  g_autofree struct iovec *copy = g_memdup2 (iov, sizeof (struct iovec) * n_iov);
+  struct iovec *cur = copy;
+
+  while (n_iov > 0)
+    {
+      ssize_t res = TEMP_FAILURE_RETRY (writev (fd, cur, MIN (n_iov, IOV_MAX)));
+
+      if (res < 0)
+        return FALSE;
+
+      /* Skip what was written, and adjust a partially written buffer */
+      while (n_iov > 0 && (size_t) res >= cur->iov_len)
+        {
+          res -= cur->iov_len;
+          cur++;
+          n_iov--;
+        }
+
+      if (n_iov > 0)
+        {
+          cur->iov_base = (char *) cur->iov_base + res;
+          cur->iov_len -= res;
+        }
+    }
+
+  return TRUE;
+}
+
 gboolean
-flatpak_buffer_to_sealed_memfd_or_tmpfile (GLnxTmpfile *tmpf,
-                                           const char  *name,
-                                           const char  *str,
-                                           size_t       len,
-                                           GError     **error)
+flatpak_iovec_to_sealed_memfd_or_tmpfile (GLnxTmpfile        *tmpf,
+                                          const char         *name,
+                                          const struct iovec *iov,
+                                          int                 n_iov,
+                                          GError            **error)
 {
-  if (len == -1)
-    len = strlen (str);
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < n_iov; i++)
+    len += iov[i].iov_len;
+
   glnx_autofd int memfd = memfd_create (name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
   int fd; /* Unowned */
   if (memfd != -1)
@@ -1543,7 +1900,7 @@ flatpak_buffer_to_sealed_memfd_or_tmpfile (GLnxTmpfile *tmpf,
     }
   if (ftruncate (fd, len) < 0)
     return glnx_throw_errno_prefix (error, "ftruncate");
-  if (glnx_loop_write (fd, str, len) < 0)
+  if (!flatpak_loop_writev (fd, iov, n_iov))
     return glnx_throw_errno_prefix (error, "write");
   if (lseek (fd, 0, SEEK_SET) < 0)
     return glnx_throw_errno_prefix (error, "lseek");
@@ -1560,6 +1917,24 @@ flatpak_buffer_to_sealed_memfd_or_tmpfile (GLnxTmpfile *tmpf,
   return TRUE;
 }
 
+gboolean
+flatpak_buffer_to_sealed_memfd_or_tmpfile (GLnxTmpfile *tmpf,
+                                           const char  *name,
+                                           const char  *str,
+                                           size_t       len,
+                                           GError     **error)
+{
+  struct iovec iov;
+
+  if (len == -1)
+    len = strlen (str);
+
+  iov.iov_base = (char *) str;
+  iov.iov_len = len;
+
+  return flatpak_iovec_to_sealed_memfd_or_tmpfile (tmpf, name, &iov, 1, error);
+}
+
 gboolean
 flatpak_open_in_tmpdir_at (int             tmpdir_fd,
                            int             mode,
@@ -1674,6 +2049,92 @@ flatpak_keyfile_get_string_non_empty (GKeyFile   *keyfile,
   return g_steal_pointer (&value);
 }
 
+/* A binary form of a keyfile, for files that are written once and read
+ * often, like the instance info. The values are kept in their escaped
+ * keyfile form so that the round trip is lossless. */
+#define FLATPAK_KEYFILE_VARIANT_FORMAT "a{sa{ss}}"
+
+GVariant *
+flatpak_keyfile_to_variant (GKeyFile *keyfile)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_auto(GStrv) groups = NULL;
+  gsize i, j;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (FLATPAK_KEYFILE_VARIANT_FORMAT));
+
+  groups = g_key_file_get_groups (keyfile, NULL);
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      g_auto(GStrv) keys = g_key_file_get_keys (keyfile, groups[i], NULL, NULL);
+
+      g_variant_builder_open (&builder, G_VARIANT_TYPE ("{sa{ss}}"));
+      g_variant_builder_add (&builder, "s", groups[i]);
+      g_variant_builder_open (&builder, G_VARIANT_TYPE ("a{ss}"));
+
+      for (j = 0; keys != NULL && keys[j] != NULL; j++)
+        {
+          g_autofree char *value = g_key_file_get_value (keyfile, groups[i], keys[j], NULL);
+
+          if (value != NULL)
+            g_variant_builder_add (&builder, "{ss}", keys[j], value);
+        }
+
+      g_variant_builder_close (&builder);
+      g_variant_builder_close (&builder);
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+GKeyFile *
+flatpak_keyfile_new_from_variant (GVariant *variant)
+{
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  GVariantIter groups;
+  const char *group;
+  GVariantIter *keys;
+
+  g_return_val_if_fail (g_variant_is_of_type (variant, G_VARIANT_TYPE (FLATPAK_KEYFILE_VARIANT_FORMAT)), NULL);
+
+  g_variant_iter_init (&groups, variant);
+  while (g_variant_iter_next (&groups, "{&sa{ss}}", &group, &keys))
+    {
+      const char *key;
+      const char *value;
+
+      while (g_variant_iter_next (keys, "{&s&s}", &key, &value))
+        g_key_file_set_value (keyfile, group, key, value);
+
+      g_variant_iter_free (keys);
+    }
+
+  return g_steal_pointer (&keyfile);
+}
+
+/* Loads @path as written by flatpak_keyfile_to_variant(), and returns
+ * %NULL with @error set if it doesn't exist or isn't valid */
+GKeyFile *
+flatpak_keyfile_load_variant_file (const char  *path,
+                                   GError     **error)
+{
+  g_autoptr(GMappedFile) mapped = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) variant = NULL;
+
+  mapped = g_mapped_file_new (path, FALSE, error);
+  if (mapped == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mapped);
+  variant = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_KEYFILE_VARIANT_FORMAT),
+                                                          bytes, FALSE));
+  if (!g_variant_is_normal_form (variant))
+    return glnx_null_throw (error, "Invalid keyfile data in %s", path);
+
+  return flatpak_keyfile_new_from_variant (variant);
+}
+
 gboolean
 flatpak_extension_matches_reason (const char *extension_id,
                                   const char *reasons,
@@ -2205,6 +2666,78 @@ flatpak_levenshtein_distance (const char *s,
   return dist (s, ls, t, lt, 0, 0, d);
 }
 
+/* Like flatpak_levenshtein_distance(), but gives up as soon as the
+ * distance is known to be more than @max, returning @max + 1 then. This
+ * only fills a band of 2 * @max + 1 cells per row, and most candidates
+ * are rejected by their length alone, which makes it cheap enough to
+ * compare a query against every ref of a large remote. */
+int
+flatpak_levenshtein_distance_bounded (const char *s,
+                                      gssize      ls,
+                                      const char *t,
+                                      gssize      lt,
+                                      int         max)
+{
+  g_autofree int *prev = NULL;
+  g_autofree int *cur = NULL;
+  int i, j;
+
+  if (ls < 0)
+    ls = strlen (s);
+
+  if (lt < 0)
+    lt = strlen (t);
+
+  if (ABS (ls - lt) > max)
+    return max + 1;
+
+  prev = g_new (int, lt + 1);
+  cur = g_new (int, lt + 1);
+
+  for (j = 0; j <= lt; j++)
+    prev[j] = j;
+
+  for (i = 1; i <= ls; i++)
+    {
+      int lo = MAX (1, i - max);
+      int hi = MIN (lt, i + max);
+      int row_min;
+
+      cur[0] = i;
+      if (lo > 1)
+        cur[lo - 1] = max + 1;
+      row_min = lo == 1 ? cur[0] : max + 1;
+
+      for (j = lo; j <= hi; j++)
+        {
+          int x = prev[j - 1] + (s[i - 1] == t[j - 1] ? 0 : 1);
+
+          /* Cells outside the band of the previous row are too far anyway */
+          if (j <= i - 1 + max && prev[j] + 1 < x)
+            x = prev[j] + 1;
+          if (cur[j - 1] + 1 < x)
+            x = cur[j - 1] + 1;
+
+          cur[j] = MIN (x, max + 1);
+          row_min = MIN (row_min, cur[j]);
+        }
+
+      if (hi < lt)
+        cur[hi + 1] = max + 1;
+
+      if (row_min > max)
+        return max + 1;
+
+      {
+        int *tmp = prev;
+        prev = cur;
+        cur = tmp;
+      }
+    }
+
+  return MIN (prev[lt], max + 1);
+}
+
 /* Convert an app id to a dconf path in the obvious way.
  */
 char *
@@ -2542,12 +3075,46 @@ flatpak_escape_string (const char        *s,
   return g_string_free (g_steal_pointer (&res), FALSE);
 }
 
+/* Whether any byte in @word is outside 0x20-0x7e, i.e. is a control
+ * character, DEL or not ASCII at all */
+static inline gboolean
+word_has_unprintable_ascii (guint64 word)
+{
+  const guint64 ones = G_GUINT64_CONSTANT (0x0101010101010101);
+  const guint64 highs = G_GUINT64_CONSTANT (0x8080808080808080);
+  guint64 below_space = (word - ones * 0x20) & ~word & highs;
+  guint64 above_tilde = ((word + ones * (0x7f - 0x7e)) | word) & highs;
+
+  return (below_space | above_tilde) != 0;
+}
+
 gboolean
 flatpak_validate_path_characters (const char *path,
                                   GError    **error)
 {
+  const char *end = path + strlen (path);
+
   while (*path)
     {
+      /* Printable ASCII is always safe, so skip runs of it a word at a time */
+      while (end - path >= (gssize) sizeof (guint64))
+        {
+          guint64 word;
+
+          memcpy (&word, path, sizeof (word));
+          if (word_has_unprintable_ascii (word))
+            break;
+          path += sizeof (word);
+        }
+
+      if (*path >= 0x20 && *path <= 0x7e)
+        {
+          path++;
+          continue;
+        }
+      else if (*path == 0)
+        break;
+
       gunichar c = g_utf8_get_char_validated (path, -1);
       if (c == (gunichar)-1 || c == (gunichar)-2)
         {
@@ -2612,6 +3179,98 @@ flatpak_is_debugging (void)
   return is_debugging;
 }
 
+/* Launch time instrumentation: each flatpak_startup_profile_mark() ends a
+ * phase of the launch. The marks always fire a USDT probe (if available)
+ * so they can be traced with bpftrace, perf or systemtap; when profiling
+ * was started they are also recorded and written out as JSON before we
+ * exec bwrap. */
+typedef struct
+{
+  const char *phase;
+  gint64      time;
+} StartupProfileMark;
+
+static gint64 startup_profile_start_time;
+static char *startup_profile_output;
+static GArray *startup_profile_marks;
+
+/* @start_time: the g_get_monotonic_time() the launch started at */
+void
+flatpak_startup_profile_start (const char *output,
+                               gint64      start_time)
+{
+  g_return_if_fail (output != NULL);
+
+  g_free (startup_profile_output);
+  startup_profile_output = g_strdup (output);
+  g_clear_pointer (&startup_profile_marks, g_array_unref);
+  startup_profile_marks = g_array_new (FALSE, FALSE, sizeof (StartupProfileMark));
+  startup_profile_start_time = start_time;
+}
+
+/* @phase must be a static string */
+void
+flatpak_startup_profile_mark (const char *phase)
+{
+  FLATPAK_TRACE1 (startup_phase, phase);
+
+  if (startup_profile_marks != NULL)
+    {
+      StartupProfileMark mark = { phase, g_get_monotonic_time () };
+
+      g_array_append_val (startup_profile_marks, mark);
+    }
+}
+
+/* Writes out the recorded phases, as one JSON object, to the file given
+ * in flatpak_startup_profile_start(), or to stderr if that is "-" */
+void
+flatpak_startup_profile_write (const char *app_id)
+{
+  g_autoptr(GString) json = NULL;
+  gint64 previous;
+  guint i;
+
+  if (startup_profile_marks == NULL)
+    return;
+
+  json = g_string_new ("{\"version\": \"" PACKAGE_VERSION "\", ");
+  g_string_append_printf (json, "\"app\": \"%s\", \"phases\": [",
+                          app_id ? app_id : "");
+
+  previous = startup_profile_start_time;
+  for (i = 0; i < startup_profile_marks->len; i++)
+    {
+      const StartupProfileMark *mark = &g_array_index (startup_profile_marks, StartupProfileMark, i);
+
+      g_string_append_printf (json,
+                              "%s{\"phase\": \"%s\", \"end_usec\": %" G_GINT64_FORMAT ", \"duration_usec\": %" G_GINT64_FORMAT "}",
+                              i > 0 ? ", " : "",
+                              mark->phase,
+                              mark->time - startup_profile_start_time,
+                              mark->time - previous);
+      previous = mark->time;
+    }
+
+  g_string_append_printf (json, "], \"total_usec\": %" G_GINT64_FORMAT "}\n",
+                          previous - startup_profile_start_time);
+
+  if (strcmp (startup_profile_output, "-") == 0)
+    {
+      if (glnx_loop_write (STDERR_FILENO, json->str, json->len) < 0)
+        g_warning ("Failed to write startup profile: %s", g_strerror (errno));
+    }
+  else
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      if (!g_file_set_contents (startup_profile_output, json->str, json->len, &local_error))
+        g_warning ("Failed to write startup profile: %s", local_error->message);
+    }
+
+  g_clear_pointer (&startup_profile_marks, g_array_unref);
+}
+
 int
 flatpak_parse_fd (const char  *fd_string,
                   GError     **error)
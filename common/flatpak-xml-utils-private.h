@@ -19,6 +19,8 @@
 
 #include "libglnx.h"
 
+#include "flatpak-common-types-private.h"
+
 typedef struct FlatpakXml FlatpakXml;
 
 struct FlatpakXml
@@ -45,6 +47,10 @@ FlatpakXml *flatpak_xml_unlink (FlatpakXml *node,
 FlatpakXml *flatpak_xml_find (FlatpakXml  *node,
                               const char  *type,
                               FlatpakXml **prev_child_out);
+GVariant   *flatpak_xml_children_to_variant (FlatpakXml *parent);
+gboolean   flatpak_xml_add_children_from_variant (FlatpakXml *parent,
+                                                  GVariant   *nodes,
+                                                  GError    **error);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakXml, flatpak_xml_free);
 
@@ -59,5 +65,27 @@ gboolean flatpak_appstream_xml_root_to_data (FlatpakXml *appstream_root,
                                              GBytes    **compressed,
                                              GError    **error);
 void flatpak_appstream_xml_filter (FlatpakXml *appstream,
-                                   GRegex *allow_refs,
-                                   GRegex *deny_refs);
+                                   FlatpakFilter *allow_refs,
+                                   FlatpakFilter *deny_refs);
+
+/* A precomputed index of the searchable appstream fields, written next to
+ * appstream.xml when deploying it so that searches don't need to parse the
+ * xml. Each component is (ref, names by lang, summaries by lang, version,
+ * [(token, FlatpakAppstreamSearchMatch)]), with "" as lang when untranslated. */
+#define FLATPAK_APPSTREAM_SEARCH_INDEX "flatpak-search-index.gvariant"
+#define FLATPAK_APPSTREAM_SEARCH_INDEX_VERSION 1
+#define FLATPAK_APPSTREAM_SEARCH_INDEX_FORMAT "(ua(sa{ss}a{ss}sa(sq)))"
+
+/* Same weights as AsSearchTokenMatch, so the scores are comparable */
+typedef enum {
+  FLATPAK_APPSTREAM_SEARCH_MATCH_NONE        = 0,
+  FLATPAK_APPSTREAM_SEARCH_MATCH_PKGNAME     = 1 << 1,
+  FLATPAK_APPSTREAM_SEARCH_MATCH_DESCRIPTION = 1 << 2,
+  FLATPAK_APPSTREAM_SEARCH_MATCH_SUMMARY     = 1 << 3,
+  FLATPAK_APPSTREAM_SEARCH_MATCH_KEYWORD     = 1 << 4,
+  FLATPAK_APPSTREAM_SEARCH_MATCH_NAME        = 1 << 5,
+  FLATPAK_APPSTREAM_SEARCH_MATCH_ID          = 1 << 6,
+} FlatpakAppstreamSearchMatch;
+
+char    **flatpak_appstream_search_tokenize (const char *text);
+GVariant *flatpak_appstream_xml_build_search_index (FlatpakXml *appstream);
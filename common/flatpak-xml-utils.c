@@ -247,6 +247,90 @@ flatpak_xml_find (FlatpakXml  *node,
   return NULL;
 }
 
+static void
+xml_children_to_variant (FlatpakXml      *parent,
+                         gint32           parent_index,
+                         gint32          *n_nodes,
+                         GVariantBuilder *builder)
+{
+  for (FlatpakXml *node = parent->first_child; node != NULL; node = node->next_sibling)
+    {
+      g_auto(GVariantBuilder) attributes = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+      gint32 index = (*n_nodes)++;
+
+      g_variant_builder_init (&attributes, G_VARIANT_TYPE ("a(ss)"));
+      for (int i = 0; node->attribute_names != NULL && node->attribute_names[i] != NULL; i++)
+        g_variant_builder_add (&attributes, "(ss)", node->attribute_names[i], node->attribute_values[i]);
+
+      g_variant_builder_add (builder, "(iss@a(ss))", parent_index,
+                             node->element_name ? node->element_name : "",
+                             node->text ? node->text : "",
+                             g_variant_builder_end (&attributes));
+
+      xml_children_to_variant (node, index, n_nodes, builder);
+    }
+}
+
+/* Serializes the children of @parent losslessly, as an array of
+ * (parent index, element name or "" for text, text, attributes) in
+ * document order, with -1 as the index of @parent itself. */
+GVariant *
+flatpak_xml_children_to_variant (FlatpakXml *parent)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  gint32 n_nodes = 0;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(issa(ss))"));
+  xml_children_to_variant (parent, -1, &n_nodes, &builder);
+
+  return g_variant_builder_end (&builder);
+}
+
+/* Appends the nodes serialized by flatpak_xml_children_to_variant() to @parent */
+gboolean
+flatpak_xml_add_children_from_variant (FlatpakXml *parent,
+                                       GVariant   *nodes,
+                                       GError    **error)
+{
+  gsize n_nodes = g_variant_n_children (nodes);
+  g_autofree FlatpakXml **by_index = g_new0 (FlatpakXml *, n_nodes);
+  g_autoptr(FlatpakXml) staging = flatpak_xml_new (NULL);
+
+  for (gsize i = 0; i < n_nodes; i++)
+    {
+      g_autoptr(GVariant) attributes = NULL;
+      const char *element_name, *text;
+      FlatpakXml *node;
+      gint32 parent_index;
+      gsize n_attributes;
+
+      g_variant_get_child (nodes, i, "(i&s&s@a(ss))", &parent_index, &element_name, &text, &attributes);
+
+      if (parent_index < -1 || parent_index >= (gint32) i)
+        return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, "Invalid xml node parent %d", parent_index);
+
+      if (*element_name != 0)
+        node = flatpak_xml_new (element_name);
+      else
+        node = flatpak_xml_new_text (text);
+
+      n_attributes = g_variant_n_children (attributes);
+      node->attribute_names = g_new0 (char *, n_attributes + 1);
+      node->attribute_values = g_new0 (char *, n_attributes + 1);
+      for (gsize j = 0; j < n_attributes; j++)
+        g_variant_get_child (attributes, j, "(ss)", &node->attribute_names[j], &node->attribute_values[j]);
+
+      flatpak_xml_add (parent_index == -1 ? staging : by_index[parent_index], node);
+      by_index[i] = node;
+    }
+
+  /* Only move the nodes over once they all parsed */
+  while (staging->first_child != NULL)
+    flatpak_xml_add (parent, flatpak_xml_unlink (staging->first_child, NULL));
+
+  return TRUE;
+}
+
 
 FlatpakXml *
 flatpak_xml_parse (GInputStream *in,
@@ -353,8 +437,8 @@ flatpak_appstream_xml_root_to_data (FlatpakXml *appstream_root,
 
 void
 flatpak_appstream_xml_filter (FlatpakXml *appstream,
-                              GRegex *allow_refs,
-                              GRegex *deny_refs)
+                              FlatpakFilter *allow_refs,
+                              FlatpakFilter *deny_refs)
 {
   FlatpakXml *components;
   FlatpakXml *component;
@@ -558,3 +642,199 @@ flatpak_appstream_xml_migrate (FlatpakXml *source,
 
   return migrated;
 }
+
+/* Splits @text into lowercase words for searching */
+char **
+flatpak_appstream_search_tokenize (const char *text)
+{
+  g_autoptr(GPtrArray) tokens = g_ptr_array_new_with_free_func (g_free);
+  g_autofree char *lower = g_utf8_strdown (text, -1);
+  const char *p = lower;
+
+  while (*p != 0)
+    {
+      const char *start;
+
+      while (*p != 0 && !g_unichar_isalnum (g_utf8_get_char (p)))
+        p = g_utf8_next_char (p);
+
+      start = p;
+      while (*p != 0 && g_unichar_isalnum (g_utf8_get_char (p)))
+        p = g_utf8_next_char (p);
+
+      /* Single letters match everything as prefixes */
+      if (g_utf8_strlen (start, p - start) > 1)
+        g_ptr_array_add (tokens, g_strndup (start, p - start));
+    }
+
+  g_ptr_array_add (tokens, NULL);
+  return (char **) g_ptr_array_free (g_steal_pointer (&tokens), FALSE);
+}
+
+static const char *
+xml_get_attribute (FlatpakXml *node,
+                   const char *name)
+{
+  for (int i = 0; node->attribute_names != NULL && node->attribute_names[i] != NULL; i++)
+    {
+      if (strcmp (node->attribute_names[i], name) == 0)
+        return node->attribute_values[i];
+    }
+
+  return NULL;
+}
+
+static void
+xml_append_text (FlatpakXml *node,
+                 GString    *out)
+{
+  if (node->element_name == NULL && node->text != NULL)
+    {
+      g_string_append (out, node->text);
+      g_string_append_c (out, ' ');
+    }
+
+  for (FlatpakXml *child = node->first_child; child != NULL; child = child->next_sibling)
+    xml_append_text (child, out);
+}
+
+static void
+add_search_tokens (GHashTable                 *tokens,
+                   const char                 *text,
+                   FlatpakAppstreamSearchMatch match)
+{
+  g_auto(GStrv) words = NULL;
+
+  if (text == NULL)
+    return;
+
+  words = flatpak_appstream_search_tokenize (text);
+  for (int i = 0; words[i] != NULL; i++)
+    {
+      guint old = GPOINTER_TO_UINT (g_hash_table_lookup (tokens, words[i]));
+      g_hash_table_insert (tokens, g_strdup (words[i]), GUINT_TO_POINTER (old | match));
+    }
+}
+
+static GVariant *
+build_search_index_component (FlatpakXml *component)
+{
+  g_autoptr(GHashTable) tokens = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_auto(GVariantBuilder) names = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_auto(GVariantBuilder) summaries = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_auto(GVariantBuilder) token_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  const char *ref = NULL;
+  const char *version = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&names, G_VARIANT_TYPE ("a{ss}"));
+  g_variant_builder_init (&summaries, G_VARIANT_TYPE ("a{ss}"));
+  g_variant_builder_init (&token_builder, G_VARIANT_TYPE ("a(sq)"));
+
+  for (FlatpakXml *child = component->first_child; child != NULL; child = child->next_sibling)
+    {
+      const char *text = (child->first_child != NULL) ? child->first_child->text : NULL;
+      const char *lang;
+
+      if (child->element_name == NULL)
+        continue;
+
+      lang = xml_get_attribute (child, "xml:lang");
+      if (lang == NULL)
+        lang = "";
+
+      if (strcmp (child->element_name, "bundle") == 0 &&
+          g_strcmp0 (xml_get_attribute (child, "type"), "flatpak") == 0)
+        ref = text;
+      else if (strcmp (child->element_name, "id") == 0 && text != NULL)
+        {
+          g_autofree char *lower = g_utf8_strdown (text, -1);
+
+          g_hash_table_insert (tokens, g_steal_pointer (&lower),
+                               GUINT_TO_POINTER (FLATPAK_APPSTREAM_SEARCH_MATCH_ID));
+          add_search_tokens (tokens, text, FLATPAK_APPSTREAM_SEARCH_MATCH_ID);
+        }
+      else if (strcmp (child->element_name, "name") == 0 && text != NULL)
+        {
+          g_variant_builder_add (&names, "{ss}", lang, text);
+          add_search_tokens (tokens, text, FLATPAK_APPSTREAM_SEARCH_MATCH_NAME);
+        }
+      else if (strcmp (child->element_name, "summary") == 0 && text != NULL)
+        {
+          g_variant_builder_add (&summaries, "{ss}", lang, text);
+          add_search_tokens (tokens, text, FLATPAK_APPSTREAM_SEARCH_MATCH_SUMMARY);
+        }
+      else if (strcmp (child->element_name, "pkgname") == 0)
+        add_search_tokens (tokens, text, FLATPAK_APPSTREAM_SEARCH_MATCH_PKGNAME);
+      else if (strcmp (child->element_name, "keywords") == 0)
+        {
+          for (FlatpakXml *keyword = child->first_child; keyword != NULL; keyword = keyword->next_sibling)
+            {
+              if (g_strcmp0 (keyword->element_name, "keyword") == 0 && keyword->first_child != NULL)
+                add_search_tokens (tokens, keyword->first_child->text, FLATPAK_APPSTREAM_SEARCH_MATCH_KEYWORD);
+            }
+        }
+      else if (strcmp (child->element_name, "description") == 0 && *lang == 0)
+        {
+          g_autoptr(GString) description = g_string_new ("");
+
+          xml_append_text (child, description);
+          add_search_tokens (tokens, description->str, FLATPAK_APPSTREAM_SEARCH_MATCH_DESCRIPTION);
+        }
+      else if (strcmp (child->element_name, "releases") == 0)
+        {
+          FlatpakXml *release = flatpak_xml_find (child, "release", NULL);
+
+          if (release != NULL)
+            version = xml_get_attribute (release, "version");
+        }
+    }
+
+  if (ref == NULL)
+    return NULL;
+
+  g_hash_table_iter_init (&iter, tokens);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&token_builder, "(sq)", (const char *) key, (guint16) GPOINTER_TO_UINT (value));
+
+  return g_variant_new ("(s@a{ss}@a{ss}s@a(sq))", ref,
+                        g_variant_builder_end (&names),
+                        g_variant_builder_end (&summaries),
+                        version ? version : "",
+                        g_variant_builder_end (&token_builder));
+}
+
+GVariant *
+flatpak_appstream_xml_build_search_index (FlatpakXml *appstream)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sa{ss}a{ss}sa(sq))"));
+
+  for (FlatpakXml *components = appstream->first_child;
+       components != NULL;
+       components = components->next_sibling)
+    {
+      if (g_strcmp0 (components->element_name, "components") != 0)
+        continue;
+
+      for (FlatpakXml *component = components->first_child;
+           component != NULL;
+           component = component->next_sibling)
+        {
+          GVariant *entry;
+
+          if (g_strcmp0 (component->element_name, "component") != 0)
+            continue;
+
+          entry = build_search_index_component (component);
+          if (entry != NULL)
+            g_variant_builder_add_value (&builder, entry);
+        }
+    }
+
+  return g_variant_ref_sink (g_variant_new ("(u@a(sa{ss}a{ss}sa(sq)))",
+                                            FLATPAK_APPSTREAM_SEARCH_INDEX_VERSION,
+                                            g_variant_builder_end (&builder)));
+}
@@ -33,7 +33,8 @@ G_DECLARE_FINAL_TYPE (FlatpakZstdCompressor,
                       FLATPAK, ZSTD_COMPRESSOR,
                       GObject)
 
-FlatpakZstdCompressor *flatpak_zstd_compressor_new (int level);
+FlatpakZstdCompressor *flatpak_zstd_compressor_new (int level,
+                                                    int n_workers);
 
 G_END_DECLS
 
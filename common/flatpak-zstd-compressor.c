@@ -37,6 +37,7 @@ struct _FlatpakZstdCompressor
   GObject parent_instance;
 
   int level;
+  int n_workers;
 #ifdef HAVE_ZSTD
   ZSTD_CStream *cstream;
 #endif
@@ -106,6 +107,11 @@ flatpak_zstd_compressor_reset (GConverter *converter)
   FlatpakZstdCompressor *compressor = FLATPAK_ZSTD_COMPRESSOR (converter);
 
   ZSTD_initCStream(compressor->cstream, compressor->level);
+
+  /* This only resets the session, so the number of workers stays set, but
+   * do it anyway in case libzstd changes that */
+  if (compressor->n_workers > 0)
+    ZSTD_CCtx_setParameter (compressor->cstream, ZSTD_c_nbWorkers, compressor->n_workers);
 #endif
 }
 
@@ -141,8 +147,13 @@ flatpak_zstd_compressor_init (FlatpakZstdCompressor *compressor)
 {
 }
 
+/* If @n_workers is > 0, compression runs on that many threads, otherwise
+ * on the calling thread. The output is still reproducible for the same
+ * @level and @n_workers. If libzstd was built without threading support
+ * this silently falls back to compressing on the calling thread. */
 FlatpakZstdCompressor *
-flatpak_zstd_compressor_new (int level)
+flatpak_zstd_compressor_new (int level,
+                             int n_workers)
 {
   FlatpakZstdCompressor *compressor;
 
@@ -150,6 +161,7 @@ flatpak_zstd_compressor_new (int level)
 
 #ifdef HAVE_ZSTD
   compressor->level = level < 0 ? ZSTD_CLEVEL_DEFAULT : level;
+  compressor->n_workers = MAX (n_workers, 0);
 
   compressor->cstream = ZSTD_createCStream ();
   if (!compressor->cstream)
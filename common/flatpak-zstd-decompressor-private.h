@@ -13,6 +13,14 @@ G_DECLARE_FINAL_TYPE (FlatpakZstdDecompressor,
 
 FlatpakZstdDecompressor *flatpak_zstd_decompressor_new (void);
 
+#define FLATPAK_TYPE_ZSTD_INPUT_STREAM flatpak_zstd_input_stream_get_type ()
+G_DECLARE_FINAL_TYPE (FlatpakZstdInputStream,
+                      flatpak_zstd_input_stream,
+                      FLATPAK, ZSTD_INPUT_STREAM,
+                      GFilterInputStream)
+
+GInputStream *flatpak_zstd_input_stream_new (GInputStream *base_stream);
+
 G_END_DECLS
 
 #endif /* __FLATPAK_ZSTD_DECOMPRESSOR_H__ */
@@ -8,6 +8,13 @@
 #include <zstd.h>
 #endif
 
+/* Allow frames compressed with long distance matching (zstd --long),
+ * which use windows larger than the default limit of 128 MiB */
+#define FLATPAK_ZSTD_WINDOW_LOG_MAX (sizeof (size_t) == 4 ? 30 : 31)
+
+/* How much compressed data FlatpakZstdInputStream reads at a time */
+#define FLATPAK_ZSTD_INPUT_BUFFER_SIZE (1024 * 1024)
+
 static void flatpak_zstd_decompressor_iface_init  (GConverterIface *iface);
 
 struct _FlatpakZstdDecompressor
@@ -42,6 +49,8 @@ flatpak_zstd_decompressor_init (FlatpakZstdDecompressor *decompressor)
 {
 #ifdef HAVE_ZSTD
   decompressor->dstream = ZSTD_createDStream ();
+  if (decompressor->dstream != NULL)
+    ZSTD_DCtx_setParameter (decompressor->dstream, ZSTD_d_windowLogMax, FLATPAK_ZSTD_WINDOW_LOG_MAX);
 #endif
 }
 
@@ -139,3 +148,144 @@ flatpak_zstd_decompressor_iface_init (GConverterIface *iface)
   iface->convert = flatpak_zstd_decompressor_convert;
   iface->reset = flatpak_zstd_decompressor_reset;
 }
+
+/* A decompressing stream, for when the overhead of GConverterInputStream
+ * matters. That reads the compressed data in small chunks, and copies
+ * everything it decompresses through its own buffer, while this reads
+ * large chunks and decompresses straight into the buffer of the caller. */
+struct _FlatpakZstdInputStream
+{
+  GFilterInputStream parent_instance;
+
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *dstream;
+  guchar *buffer;
+  ZSTD_inBuffer input;
+  gboolean frame_done;
+#endif
+};
+
+G_DEFINE_TYPE (FlatpakZstdInputStream, flatpak_zstd_input_stream, G_TYPE_FILTER_INPUT_STREAM)
+
+static void
+flatpak_zstd_input_stream_finalize (GObject *object)
+{
+#ifdef HAVE_ZSTD
+  FlatpakZstdInputStream *self = FLATPAK_ZSTD_INPUT_STREAM (object);
+
+  ZSTD_freeDStream (self->dstream);
+  g_free (self->buffer);
+#endif
+
+  G_OBJECT_CLASS (flatpak_zstd_input_stream_parent_class)->finalize (object);
+}
+
+static gssize
+flatpak_zstd_input_stream_read (GInputStream  *stream,
+                                void          *buffer,
+                                gsize          count,
+                                GCancellable  *cancellable,
+                                GError       **error)
+{
+#ifdef HAVE_ZSTD
+  FlatpakZstdInputStream *self = FLATPAK_ZSTD_INPUT_STREAM (stream);
+  GInputStream *base_stream = G_FILTER_INPUT_STREAM (stream)->base_stream;
+  ZSTD_outBuffer output = { buffer, count, 0 };
+
+  if (self->dstream == NULL)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Failed to initialize libzstd");
+      return -1;
+    }
+
+  if (count == 0)
+    return 0;
+
+  while (TRUE)
+    {
+      gsize in_pos = self->input.pos;
+      gssize n_read;
+      size_t res;
+
+      res = ZSTD_decompressStream (self->dstream, &output, &self->input);
+      if (ZSTD_isError (res))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Zstd decompression error: %s", ZSTD_getErrorName (res));
+          return -1;
+        }
+
+      /* A call without any progress reports what the next frame needs */
+      if (output.pos > 0 || self->input.pos != in_pos)
+        self->frame_done = (res == 0);
+
+      if (output.pos > 0)
+        return output.pos;
+
+      if (self->input.pos != in_pos)
+        continue;
+
+      if (self->input.pos < self->input.size)
+        {
+          g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Zstd failed");
+          return -1;
+        }
+
+      n_read = g_input_stream_read (base_stream, self->buffer, FLATPAK_ZSTD_INPUT_BUFFER_SIZE,
+                                    cancellable, error);
+      if (n_read < 0)
+        return -1;
+
+      if (n_read == 0)
+        {
+          if (!self->frame_done)
+            {
+              g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                                   "Truncated zstd data");
+              return -1;
+            }
+
+          return 0;
+        }
+
+      self->input.src = self->buffer;
+      self->input.size = n_read;
+      self->input.pos = 0;
+    }
+#else
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "libzstd not available");
+  return -1;
+#endif
+}
+
+static void
+flatpak_zstd_input_stream_init (FlatpakZstdInputStream *self)
+{
+#ifdef HAVE_ZSTD
+  self->dstream = ZSTD_createDStream ();
+  if (self->dstream != NULL)
+    ZSTD_DCtx_setParameter (self->dstream, ZSTD_d_windowLogMax, FLATPAK_ZSTD_WINDOW_LOG_MAX);
+  self->buffer = g_malloc (FLATPAK_ZSTD_INPUT_BUFFER_SIZE);
+#endif
+}
+
+static void
+flatpak_zstd_input_stream_class_init (FlatpakZstdInputStreamClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  gobject_class->finalize = flatpak_zstd_input_stream_finalize;
+  stream_class->read_fn = flatpak_zstd_input_stream_read;
+}
+
+GInputStream *
+flatpak_zstd_input_stream_new (GInputStream *base_stream)
+{
+  return g_object_new (FLATPAK_TYPE_ZSTD_INPUT_STREAM,
+                       "base-stream", base_stream,
+                       "close-base-stream", FALSE,
+                       NULL);
+}
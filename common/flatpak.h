@@ -35,6 +35,7 @@
 #include <flatpak-related-ref.h>
 #include <flatpak-bundle-ref.h>
 #include <flatpak-remote.h>
+#include <flatpak-installation-monitor.h>
 #include <flatpak-installation.h>
 #include <flatpak-transaction.h>
 #include <flatpak-instance.h>
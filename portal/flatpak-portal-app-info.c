@@ -28,6 +28,95 @@
 G_LOCK_DEFINE (app_infos);
 static GHashTable *app_infos;
 
+/* Every instance has its own .flatpak-info, and all connections from an
+ * instance (including those through its D-Bus proxy) see the same file,
+ * so the parsed files are also cached by file identity. This avoids
+ * re-parsing the keyfile for each new connection from a known instance. */
+#define MAX_APP_INFO_FILES 256
+
+typedef struct
+{
+  dev_t            dev;
+  ino_t            ino;
+  off_t            size;
+  struct timespec  mtime;
+  GKeyFile        *keyfile;
+} AppInfoFile;
+
+G_LOCK_DEFINE_STATIC (app_info_files);
+static GHashTable *app_info_files;
+
+static void
+app_info_file_free (AppInfoFile *file)
+{
+  g_key_file_unref (file->keyfile);
+  g_free (file);
+}
+
+static guint
+app_info_file_hash (gconstpointer key)
+{
+  const AppInfoFile *file = key;
+
+  return (guint) (file->ino ^ (file->ino >> 32) ^ file->dev);
+}
+
+static gboolean
+app_info_file_equal (gconstpointer a,
+                     gconstpointer b)
+{
+  const AppInfoFile *file_a = a;
+  const AppInfoFile *file_b = b;
+
+  return file_a->dev == file_b->dev && file_a->ino == file_b->ino;
+}
+
+static GKeyFile *
+lookup_cached_app_info_by_file (const struct stat *stat_buf)
+{
+  AppInfoFile key = { stat_buf->st_dev, stat_buf->st_ino };
+  AppInfoFile *file;
+  GKeyFile *keyfile = NULL;
+
+  G_LOCK (app_info_files);
+  file = app_info_files ? g_hash_table_lookup (app_info_files, &key) : NULL;
+  /* The inode may have been reused for a different file */
+  if (file != NULL &&
+      file->size == stat_buf->st_size &&
+      file->mtime.tv_sec == stat_buf->st_mtim.tv_sec &&
+      file->mtime.tv_nsec == stat_buf->st_mtim.tv_nsec)
+    keyfile = g_key_file_ref (file->keyfile);
+  G_UNLOCK (app_info_files);
+
+  return keyfile;
+}
+
+static void
+add_cached_app_info_by_file (const struct stat *stat_buf,
+                             GKeyFile          *keyfile)
+{
+  AppInfoFile *file = g_new0 (AppInfoFile, 1);
+
+  file->dev = stat_buf->st_dev;
+  file->ino = stat_buf->st_ino;
+  file->size = stat_buf->st_size;
+  file->mtime = stat_buf->st_mtim;
+  file->keyfile = g_key_file_ref (keyfile);
+
+  G_LOCK (app_info_files);
+  if (app_info_files == NULL)
+    app_info_files = g_hash_table_new_full (app_info_file_hash, app_info_file_equal,
+                                            (GDestroyNotify) app_info_file_free, NULL);
+
+  /* Instances come and go, and we don't get told when, so just start
+   * over once there are too many */
+  if (g_hash_table_size (app_info_files) >= MAX_APP_INFO_FILES)
+    g_hash_table_remove_all (app_info_files);
+
+  g_hash_table_replace (app_info_files, file, file);
+  G_UNLOCK (app_info_files);
+}
+
 static void
 ensure_app_infos (void)
 {
@@ -79,6 +168,7 @@ parse_app_id_from_fileinfo (int pid)
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GMappedFile) mapped = NULL;
   g_autoptr(GKeyFile) metadata = NULL;
+  GKeyFile *cached;
 
   root_path = g_strdup_printf ("/proc/%u/root", pid);
   if (!glnx_opendirat (AT_FDCWD, root_path, TRUE,
@@ -111,6 +201,10 @@ parse_app_id_from_fileinfo (int pid)
   if (fstat (info_fd, &stat_buf) != 0 || !S_ISREG (stat_buf.st_mode))
     return NULL; /* Some weird fd => failure */
 
+  cached = lookup_cached_app_info_by_file (&stat_buf);
+  if (cached != NULL)
+    return cached;
+
   mapped = g_mapped_file_new_from_fd (info_fd, FALSE, &local_error);
   if (mapped == NULL)
     {
@@ -127,6 +221,8 @@ parse_app_id_from_fileinfo (int pid)
       return NULL;
     }
 
+  add_cached_app_info_by_file (&stat_buf, metadata);
+
   return g_steal_pointer (&metadata);
 }
 
@@ -74,6 +74,7 @@ static PortalFlatpak *portal;
 static gboolean opt_verbose;
 static int opt_poll_timeout;
 static gboolean opt_poll_when_metered;
+static int opt_trigger_delay;
 static FlatpakSpawnSupportFlags supports = 0;
 
 G_LOCK_DEFINE_STATIC (update_monitors); /* This protects the three variables below */
@@ -81,6 +82,10 @@ static GHashTable *update_monitors;
 static guint update_monitors_timeout = 0;
 static gboolean update_monitors_timeout_running_thread = FALSE;
 
+G_LOCK_DEFINE_STATIC (pending_triggers); /* This protects the two variables below */
+static GHashTable *pending_triggers;
+static guint pending_triggers_timeout = 0;
+
 /* Poll all update monitors twice an hour */
 #define DEFAULT_UPDATE_POLL_TIMEOUT_SEC (30 * 60)
 
@@ -119,10 +124,16 @@ typedef struct {
   /* Last reported values, starting at the instance commit */
   char *reported_local_commit;
   char *reported_remote_commit;
+
+  /* The commit found in the remote by the last check, and the monotonic
+   * time of that check, so Update() can use it. Protected by lock. */
+  char *checked_remote_commit;
+  gint64 checked_time;
 } UpdateMonitorData;
 
 static gboolean           check_all_for_updates_cb (void                       *data);
 static gboolean           has_update_monitors      (void);
+static gboolean           has_pending_triggers     (void);
 static UpdateMonitorData *update_monitor_get_data  (PortalFlatpakUpdateMonitor *monitor);
 static gboolean           handle_close             (PortalFlatpakUpdateMonitor *monitor,
                                                     GDBusMethodInvocation      *invocation);
@@ -175,7 +186,8 @@ idle_timeout_cb (gpointer user_data)
 {
   if (name_owner_id &&
       g_hash_table_size (client_pid_data_hash) == 0 &&
-      !has_update_monitors ())
+      !has_update_monitors () &&
+      !has_pending_triggers ())
     {
       g_info ("Idle - unowning name");
       unref_skeleton_in_timeout ();
@@ -259,6 +271,8 @@ typedef struct
   gboolean    set_tty;
   int         tty;
   int         env_fd;
+  int         shared_env_fd; /* As seen by the child, or -1 */
+  const char *shared_env_fd_path;
 } ChildSetupData;
 
 typedef struct
@@ -527,6 +541,24 @@ child_setup_func (gpointer user_data)
       drop_cloexec (fd_map[i].final);
     }
 
+  /* All the instances inherit the same open file for the environment,
+   * and the offset moves as it is read. Reopen it, so that every one
+   * reads it from the start. Otherwise the instance would start with a
+   * partial or empty environment, so rather fail it. */
+  if (data->shared_env_fd != -1)
+    {
+      int env_fd = open (data->shared_env_fd_path, O_RDONLY | O_CLOEXEC);
+
+      if (env_fd < 0)
+        {
+          g_warning ("Failed to reopen environment for child: %s", strerror (errno));
+          _exit (1);
+        }
+
+      dup2 (env_fd, data->shared_env_fd);
+      close (env_fd);
+    }
+
   /* We become our own session and process group, because it never makes sense
      to share the flatpak-session-helper dbus activated process group */
   setsid ();
@@ -627,22 +659,140 @@ fd_map_remap_fd (GArray *fd_map,
   return fd_map_entry.final;
 }
 
+/* Maps an installation path to the "flatpak run" option selecting that
+ * installation, or to "" if it isn't one we know about. It is cleared
+ * when the configuration of the system installations changes. */
+static GHashTable *installation_args = NULL;
+static GFileMonitor *installations_monitor = NULL;
+
+static void
+installations_changed_cb (GFileMonitor     *file_monitor,
+                          GFile            *file,
+                          GFile            *other_file,
+                          GFileMonitorEvent event_type,
+                          gpointer          data)
+{
+  g_info ("System installations changed");
+  g_hash_table_remove_all (installation_args);
+}
+
+static void
+ensure_installation_args (void)
+{
+  g_autoptr(GFile) installations_dir = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (installation_args != NULL)
+    return;
+
+  installation_args = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  installations_dir = flatpak_get_system_installations_config_dir ();
+  installations_monitor = g_file_monitor_directory (installations_dir,
+                                                    G_FILE_MONITOR_NONE,
+                                                    NULL,
+                                                    &local_error);
+  if (installations_monitor == NULL)
+    g_warning ("Failed to set watch on %s: %s",
+               flatpak_file_get_path_cached (installations_dir), local_error->message);
+  else
+    g_signal_connect (installations_monitor, "changed",
+                      G_CALLBACK (installations_changed_cb), NULL);
+}
+
+static char *
+lookup_installation_arg (GFile *installation_path)
+{
+  g_autoptr(FlatpakDir) user_dir = NULL;
+  g_autoptr(GPtrArray) system_dirs = NULL;
+  const char *path = flatpak_file_get_path_cached (installation_path);
+  const char *arg;
+  char *new_arg = NULL;
+  gsize i;
+
+  ensure_installation_args ();
+
+  arg = g_hash_table_lookup (installation_args, path);
+  if (arg != NULL)
+    return *arg != 0 ? g_strdup (arg) : NULL;
+
+  user_dir = flatpak_dir_get_user ();
+  if (g_file_equal (flatpak_dir_get_path (user_dir), installation_path))
+    new_arg = g_strdup ("--user");
+
+  /* The list the process read at startup may be outdated by now */
+  if (new_arg == NULL)
+    system_dirs = flatpak_dir_get_system_list_uncached (NULL, NULL);
+
+  for (i = 0; new_arg == NULL && system_dirs != NULL && i < system_dirs->len; i++)
+    {
+      FlatpakDir *dir = g_ptr_array_index (system_dirs, i);
+      const char *id = flatpak_dir_get_id (dir);
+
+      if (!g_file_equal (flatpak_dir_get_path (dir), installation_path))
+        continue;
+
+      if (g_strcmp0 (id, SYSTEM_DIR_DEFAULT_ID) == 0)
+        new_arg = g_strdup ("--system");
+      else if (id != NULL)
+        new_arg = g_strdup_printf ("--installation=%s", id);
+    }
+
+  g_hash_table_insert (installation_args, g_strdup (path), g_strdup (new_arg ? new_arg : ""));
+
+  return new_arg;
+}
+
+/* Returns the option making "flatpak run" look for the app only in the
+ * installation the caller was started from, rather than opening and
+ * searching every installation. */
+static char *
+get_installation_arg (GKeyFile *app_info)
+{
+  g_autofree char *app_path = NULL;
+  g_autoptr(GFile) app_file = NULL;
+  g_autoptr(GFile) installation_path = NULL;
+
+  app_path = g_key_file_get_string (app_info,
+                                    FLATPAK_METADATA_GROUP_INSTANCE,
+                                    FLATPAK_METADATA_KEY_ORIGINAL_APP_PATH, NULL);
+  if (app_path == NULL)
+    app_path = g_key_file_get_string (app_info,
+                                      FLATPAK_METADATA_GROUP_INSTANCE,
+                                      FLATPAK_METADATA_KEY_APP_PATH, NULL);
+  if (app_path == NULL || *app_path == 0)
+    return NULL;
+
+  /* Like in update_monitor_get_installation_path(), the app is always
+   * in $dir/app/org.the.app/x86_64/stable/$commit/files */
+  app_file = g_file_new_for_path (app_path);
+  installation_path = g_file_resolve_relative_path (app_file, "../../../../../..");
+
+  return lookup_installation_arg (installation_path);
+}
+
+/* Starts @n_instances identical copies of the requested command, which
+ * share all the setup work, and completes @invocation with the pid (for
+ * Spawn) or the pids (for SpawnMany) */
 static gboolean
-handle_spawn (PortalFlatpak         *object,
-              GDBusMethodInvocation *invocation,
-              GUnixFDList           *fd_list,
-              const gchar           *arg_cwd_path,
-              const gchar *const    *arg_argv,
-              GVariant              *arg_fds,
-              GVariant              *arg_envs,
-              guint                  arg_flags,
-              GVariant              *arg_options)
+handle_spawn_instances (PortalFlatpak         *object,
+                        GDBusMethodInvocation *invocation,
+                        GUnixFDList           *fd_list,
+                        const gchar           *arg_cwd_path,
+                        const gchar *const    *arg_argv,
+                        GVariant              *arg_fds,
+                        GVariant              *arg_envs,
+                        guint                  arg_flags,
+                        GVariant              *arg_options,
+                        guint                  n_instances,
+                        gboolean               many)
 {
   g_autoptr(GError) error = NULL;
   ChildSetupData child_setup_data = { NULL };
-  GPid pid;
+  GPid pid = 0;
   PidData *pid_data;
   InstanceIdReadData *instance_id_read_data = NULL;
+  g_autoptr(GArray) pids = NULL;
   gsize i, j, n_fds, n_envs;
   const gint *fds = NULL;
   gint fds_len = 0;
@@ -689,9 +839,11 @@ handle_spawn (PortalFlatpak         *object,
   g_autoptr(GArray) expose_fds = NULL;
   g_autoptr(GArray) expose_fds_ro = NULL;
   glnx_autofd int instance_sandbox_fd = -1;
+  g_autofree char *shared_env_fd_path = NULL;
 
   child_setup_data.instance_id_fd = -1;
   child_setup_data.env_fd = -1;
+  child_setup_data.shared_env_fd = -1;
 
   if (fd_list != NULL)
     fds = g_unix_fd_list_peek_fds (fd_list, &fds_len);
@@ -741,6 +893,22 @@ handle_spawn (PortalFlatpak         *object,
       return G_DBUS_METHOD_INVOCATION_HANDLED;
     }
 
+  if (n_instances == 0 || n_instances > FLATPAK_SPAWN_MANY_MAX)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                             "Invalid number of instances: %u", n_instances);
+      return G_DBUS_METHOD_INVOCATION_HANDLED;
+    }
+
+  /* The instance ID pipe is passed by fd number on the command line, so
+   * it can't be shared between several instances */
+  if (n_instances > 1 && (arg_flags & FLATPAK_SPAWN_FLAGS_NOTIFY_START) != 0)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                             "Notify start is not supported with more than one instance");
+      return G_DBUS_METHOD_INVOCATION_HANDLED;
+    }
+
   if (testing)
     runtime_ref = g_strdup ("runtime/com.example.Runtime/m68k/1.0");
   else
@@ -916,6 +1084,14 @@ handle_spawn (PortalFlatpak         *object,
 
   g_ptr_array_add (flatpak_argv, g_strdup ("run"));
 
+  if (!testing)
+    {
+      char *installation_arg = get_installation_arg (app_info);
+
+      if (installation_arg != NULL)
+        g_ptr_array_add (flatpak_argv, installation_arg);
+    }
+
   /* If we don't clear the env, the flatpak portal service environment would
    * leak into the flatpak instance. By default we reuse the environment of
    * the calling instance by passing it as arguments after the --clear-env.
@@ -1122,6 +1298,14 @@ handle_spawn (PortalFlatpak         *object,
 
       g_ptr_array_add (flatpak_argv,
                        g_strdup_printf ("--env-fd=%d", remapped_fd));
+
+      if (n_instances > 1)
+        {
+          /* Built here, as the child can't allocate */
+          shared_env_fd_path = g_strdup_printf ("/proc/self/fd/%d", remapped_fd);
+          child_setup_data.shared_env_fd = remapped_fd;
+          child_setup_data.shared_env_fd_path = shared_env_fd_path;
+        }
     }
 
   for (i = 0; unset_env != NULL && unset_env[i] != NULL; i++)
@@ -1503,53 +1687,112 @@ handle_spawn (PortalFlatpak         *object,
   child_setup_data.fd_map = &g_array_index (fd_map, FdMapEntry, 0);
   child_setup_data.fd_map_len = fd_map->len;
 
-  /* We use LEAVE_DESCRIPTORS_OPEN and close them in the child_setup
-   * to work around a deadlock in GLib < 2.60 */
-  if (!g_spawn_async_with_pipes (NULL,
-                                 (char **) flatpak_argv->pdata,
-                                 NULL,
-                                 G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
-                                 child_setup_func, &child_setup_data,
-                                 &pid,
-                                 NULL,
-                                 NULL,
-                                 NULL,
-                                 &error))
-    {
-      gint code = G_DBUS_ERROR_FAILED;
-      if (g_error_matches (error, G_SPAWN_ERROR, G_SPAWN_ERROR_ACCES))
-        code = G_DBUS_ERROR_ACCESS_DENIED;
-      else if (g_error_matches (error, G_SPAWN_ERROR, G_SPAWN_ERROR_NOENT))
-        code = G_DBUS_ERROR_FILE_NOT_FOUND;
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, code,
-                                             "Failed to start command: %s",
-                                             error->message);
-      return G_DBUS_METHOD_INVOCATION_HANDLED;
-    }
+  pids = g_array_sized_new (FALSE, FALSE, sizeof (guint32), n_instances);
+
+  for (i = 0; i < n_instances; i++)
+    {
+      guint32 pid_u32;
+
+      /* We use LEAVE_DESCRIPTORS_OPEN and close them in the child_setup
+       * to work around a deadlock in GLib < 2.60 */
+      if (!g_spawn_async_with_pipes (NULL,
+                                     (char **) flatpak_argv->pdata,
+                                     NULL,
+                                     G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
+                                     child_setup_func, &child_setup_data,
+                                     &pid,
+                                     NULL,
+                                     NULL,
+                                     NULL,
+                                     &error))
+        {
+          gint code = G_DBUS_ERROR_FAILED;
+          if (g_error_matches (error, G_SPAWN_ERROR, G_SPAWN_ERROR_ACCES))
+            code = G_DBUS_ERROR_ACCESS_DENIED;
+          else if (g_error_matches (error, G_SPAWN_ERROR, G_SPAWN_ERROR_NOENT))
+            code = G_DBUS_ERROR_FILE_NOT_FOUND;
+
+          /* Don't leave a partially started set of instances behind,
+           * the caller has no way to know about them. Their child watches
+           * clean up after them. */
+          for (j = 0; j < pids->len; j++)
+            kill (g_array_index (pids, guint32, j), SIGKILL);
+
+          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, code,
+                                                 "Failed to start command: %s",
+                                                 error->message);
+          return G_DBUS_METHOD_INVOCATION_HANDLED;
+        }
+
+      if (instance_id_read_data)
+        instance_id_read_data->pid = pid;
 
-  if (instance_id_read_data)
-    instance_id_read_data->pid = pid;
+      pid_data = g_new0 (PidData, 1);
+      pid_data->pid = pid;
+      pid_data->client = g_strdup (g_dbus_method_invocation_get_sender (invocation));
+      pid_data->watch_bus = (arg_flags & FLATPAK_SPAWN_FLAGS_WATCH_BUS) != 0;
+      pid_data->expose_or_share_pids = (expose_pids || share_pids);
+      pid_data->child_watch = g_child_watch_add_full (G_PRIORITY_DEFAULT,
+                                                      pid,
+                                                      child_watch_died,
+                                                      pid_data,
+                                                      NULL);
 
-  pid_data = g_new0 (PidData, 1);
-  pid_data->pid = pid;
-  pid_data->client = g_strdup (g_dbus_method_invocation_get_sender (invocation));
-  pid_data->watch_bus = (arg_flags & FLATPAK_SPAWN_FLAGS_WATCH_BUS) != 0;
-  pid_data->expose_or_share_pids = (expose_pids || share_pids);
-  pid_data->child_watch = g_child_watch_add_full (G_PRIORITY_DEFAULT,
-                                                  pid,
-                                                  child_watch_died,
-                                                  pid_data,
-                                                  NULL);
+      g_info ("Client Pid is %d", pid_data->pid);
 
-  g_info ("Client Pid is %d", pid_data->pid);
+      g_hash_table_replace (client_pid_data_hash, GUINT_TO_POINTER (pid_data->pid),
+                            pid_data);
 
-  g_hash_table_replace (client_pid_data_hash, GUINT_TO_POINTER (pid_data->pid),
-                        pid_data);
+      pid_u32 = pid;
+      g_array_append_val (pids, pid_u32);
+    }
+
+  if (many)
+    portal_flatpak_complete_spawn_many (object, invocation, NULL,
+                                        g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32,
+                                                                   pids->data, pids->len,
+                                                                   sizeof (guint32)));
+  else
+    portal_flatpak_complete_spawn (object, invocation, NULL, pid);
 
-  portal_flatpak_complete_spawn (object, invocation, NULL, pid);
   return G_DBUS_METHOD_INVOCATION_HANDLED;
 }
 
+static gboolean
+handle_spawn (PortalFlatpak         *object,
+              GDBusMethodInvocation *invocation,
+              GUnixFDList           *fd_list,
+              const gchar           *arg_cwd_path,
+              const gchar *const    *arg_argv,
+              GVariant              *arg_fds,
+              GVariant              *arg_envs,
+              guint                  arg_flags,
+              GVariant              *arg_options)
+{
+  return handle_spawn_instances (object, invocation, fd_list, arg_cwd_path,
+                                 arg_argv, arg_fds, arg_envs, arg_flags,
+                                 arg_options, 1, FALSE);
+}
+
+static gboolean
+handle_spawn_many (PortalFlatpak         *object,
+                   GDBusMethodInvocation *invocation,
+                   GUnixFDList           *fd_list,
+                   const gchar           *arg_cwd_path,
+                   const gchar *const    *arg_argv,
+                   GVariant              *arg_fds,
+                   GVariant              *arg_envs,
+                   guint                  arg_flags,
+                   guint                  arg_count,
+                   GVariant              *arg_options)
+{
+  g_info ("spawn_many(%u) called", arg_count);
+
+  return handle_spawn_instances (object, invocation, fd_list, arg_cwd_path,
+                                 arg_argv, arg_fds, arg_envs, arg_flags,
+                                 arg_options, arg_count, TRUE);
+}
+
 static gboolean
 handle_spawn_signal (PortalFlatpak         *object,
                      GDBusMethodInvocation *invocation,
@@ -1707,6 +1950,7 @@ update_monitor_data_free (gpointer data)
 
   g_free (m->reported_local_commit);
   g_free (m->reported_remote_commit);
+  g_free (m->checked_remote_commit);
 
   g_free (m);
 }
@@ -1810,8 +2054,33 @@ update_monitor_get_connection (PortalFlatpakUpdateMonitor *monitor)
   return g_dbus_interface_skeleton_get_connection (G_DBUS_INTERFACE_SKELETON (monitor));
 }
 
+/* Installations are kept across polls, as re-opening the repo every time
+ * is wasteful. Instead we revalidate them against the .changed stamp and
+ * the repo config, and drop their caches when either was modified. */
+#define INSTALLATION_CACHE_MAX_SIZE 16
+
+typedef struct
+{
+  FlatpakInstallation *installation;
+  struct timespec      changed_mtime;
+  struct timespec      config_mtime;
+} CachedInstallation;
+
 static GHashTable *installation_cache = NULL;
 
+/* Maps "$installation_path\n$remote" to the remote refs hash table
+ * (FlatpakDecomposed -> checksum) for that remote, or to NULL if
+ * fetching it failed. This way every monitor tracking an app from the
+ * same remote shares a single summary fetch per poll. */
+static GHashTable *remote_refs_cache = NULL;
+
+static void
+cached_installation_free (CachedInstallation *cached)
+{
+  g_object_unref (cached->installation);
+  g_free (cached);
+}
+
 static void
 clear_installation_cache (void)
 {
@@ -1819,19 +2088,128 @@ clear_installation_cache (void)
     g_hash_table_remove_all (installation_cache);
 }
 
+static void
+clear_remote_refs_cache (void)
+{
+  if (remote_refs_cache != NULL)
+    g_hash_table_remove_all (remote_refs_cache);
+}
+
+static void
+remote_refs_unref (gpointer data)
+{
+  if (data != NULL)
+    g_hash_table_unref (data);
+}
+
+/* Caching lookup of the refs available in a remote. Returns a borrowed
+ * reference, or NULL if the remote could not be reached. Failures are
+ * cached too, so that an unreachable remote is only tried once per poll. */
+static GHashTable *
+lookup_remote_refs (FlatpakDir   *dir,
+                    GFile        *installation_path,
+                    const char   *remote,
+                    GCancellable *cancellable)
+{
+  g_autofree char *key = NULL;
+  g_autoptr(FlatpakRemoteState) state = NULL;
+  g_autoptr(GHashTable) refs = NULL;
+  g_autoptr(GError) error = NULL;
+  gpointer cached;
+
+  if (remote_refs_cache == NULL)
+    remote_refs_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, remote_refs_unref);
+
+  key = g_strconcat (flatpak_file_get_path_cached (installation_path), "\n", remote, NULL);
+  if (g_hash_table_lookup_extended (remote_refs_cache, key, NULL, &cached))
+    return cached;
+
+  g_info ("Fetching remote state for %s in %s", remote, flatpak_file_get_path_cached (installation_path));
+
+  state = flatpak_dir_get_remote_state (dir, remote, FALSE, cancellable, &error);
+  if (state == NULL ||
+      !flatpak_dir_list_remote_refs (dir, state, &refs, cancellable, &error))
+    {
+      /* Probably some network issue, don't retry for the other monitors */
+      g_info ("getting remote refs for %s failed: %s", remote, error->message);
+      g_clear_pointer (&refs, g_hash_table_unref);
+    }
+
+  cached = refs;
+  g_hash_table_insert (remote_refs_cache, g_steal_pointer (&key), g_steal_pointer (&refs));
+  return cached;
+}
+
+static void
+get_mtime (GFile           *file,
+           struct timespec *mtime)
+{
+  struct stat stbuf;
+
+  if (stat (flatpak_file_get_path_cached (file), &stbuf) == 0)
+    *mtime = stbuf.st_mtim;
+  else
+    *mtime = (struct timespec) { 0, 0 };
+}
+
+static void
+cached_installation_get_stamps (GFile           *path,
+                                struct timespec *changed_mtime,
+                                struct timespec *config_mtime)
+{
+  g_autoptr(GFile) changed_file = g_file_get_child (path, ".changed");
+  g_autoptr(GFile) config_file = g_file_resolve_relative_path (path, "repo/config");
+
+  get_mtime (changed_file, changed_mtime);
+  get_mtime (config_file, config_mtime);
+}
+
+static gboolean
+timespec_equal (const struct timespec *a,
+                const struct timespec *b)
+{
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
 /* Caching lookup of Installation for a path */
 static FlatpakInstallation *
 lookup_installation_for_path (GFile *path, GError **error)
 {
-  FlatpakInstallation *installation;
+  CachedInstallation *cached;
+  struct timespec changed_mtime, config_mtime;
 
   if (installation_cache == NULL)
-    installation_cache = g_hash_table_new_full (g_file_hash, (GEqualFunc)g_file_equal, g_object_unref, g_object_unref);
+    installation_cache = g_hash_table_new_full (g_file_hash, (GEqualFunc)g_file_equal,
+                                                g_object_unref, (GDestroyNotify)cached_installation_free);
 
-  installation = g_hash_table_lookup (installation_cache, path);
-  if (installation == NULL)
+  cached_installation_get_stamps (path, &changed_mtime, &config_mtime);
+
+  cached = g_hash_table_lookup (installation_cache, path);
+  if (cached != NULL &&
+      (!timespec_equal (&cached->changed_mtime, &changed_mtime) ||
+       !timespec_equal (&cached->config_mtime, &config_mtime)))
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      g_info ("Installation %s changed, dropping caches", flatpak_file_get_path_cached (path));
+
+      if (flatpak_installation_drop_caches (cached->installation, NULL, &local_error))
+        {
+          cached->changed_mtime = changed_mtime;
+          cached->config_mtime = config_mtime;
+        }
+      else
+        {
+          g_info ("Failed to drop caches for %s: %s", flatpak_file_get_path_cached (path), local_error->message);
+          g_hash_table_remove (installation_cache, path);
+          cached = NULL;
+        }
+    }
+
+  if (cached == NULL)
     {
       g_autoptr(FlatpakDir) dir = NULL;
+      FlatpakInstallation *installation;
 
       dir = flatpak_dir_get_by_path (path);
       installation = flatpak_installation_new_for_dir (dir, NULL, error);
@@ -1840,10 +2218,19 @@ lookup_installation_for_path (GFile *path, GError **error)
 
       flatpak_installation_set_no_interaction (installation, TRUE);
 
-      g_hash_table_insert (installation_cache, g_object_ref (path), installation);
+      /* There are normally only a few installations, so just start over
+       * rather than tracking usage if this somehow grows too large */
+      if (g_hash_table_size (installation_cache) >= INSTALLATION_CACHE_MAX_SIZE)
+        clear_installation_cache ();
+
+      cached = g_new0 (CachedInstallation, 1);
+      cached->installation = installation;
+      cached->changed_mtime = changed_mtime;
+      cached->config_mtime = config_mtime;
+      g_hash_table_insert (installation_cache, g_object_ref (path), cached);
     }
 
-  return g_object_ref (installation);
+  return g_object_ref (cached->installation);
 }
 
 static GFile *
@@ -1867,7 +2254,8 @@ check_for_updates (PortalFlatpakUpdateMonitor *monitor)
   g_autoptr(GFile) installation_path = NULL;
   g_autoptr(FlatpakInstallation) installation = NULL;
   g_autoptr(FlatpakInstalledRef) installed_ref = NULL;
-  g_autoptr(FlatpakRemoteRef) remote_ref = NULL;
+  g_autoptr(FlatpakDecomposed) decomposed = NULL;
+  GHashTable *remote_refs;
   const char *origin = NULL;
   const char *local_commit = NULL;
   const char *remote_commit;
@@ -1908,32 +2296,37 @@ check_for_updates (PortalFlatpakUpdateMonitor *monitor)
 
   origin = flatpak_installed_ref_get_origin (installed_ref);
 
-  remote_ref = flatpak_installation_fetch_remote_ref_sync (installation, origin,
-                                                           FLATPAK_REF_KIND_APP,
-                                                           m->name, m->arch, m->branch,
-                                                           m->cancellable, &error);
-  if (remote_ref == NULL)
+  remote_refs = lookup_remote_refs (dir, installation_path, origin, m->cancellable);
+  if (remote_refs == NULL)
     {
       /* Probably some network issue.
        * Fall back to the local_commit to at least be able to pick up already installed updates.
        */
-      g_info ("getting remote ref failed: %s", error->message);
-      g_clear_error (&error);
-      remote_commit = local_commit;
+      remote_commit = NULL;
     }
   else
     {
-      remote_commit = flatpak_ref_get_commit (FLATPAK_REF (remote_ref));
+      decomposed = flatpak_decomposed_new_from_ref (ref, NULL);
+      remote_commit = decomposed ? g_hash_table_lookup (remote_refs, decomposed) : NULL;
       if (remote_commit == NULL)
         {
-          /* This can happen if we're offline and there is an update from an usb drive.
+          /* This can happen if we're offline and there is an update from an usb drive,
+           * or if the ref is no longer in the remote.
            * Not much we can do in terms of reporting it, but at least handle the case
            */
           g_info ("Unknown remote commit, setting to local_commit");
-          remote_commit = local_commit;
         }
     }
 
+  g_mutex_lock (&m->lock);
+  g_free (m->checked_remote_commit);
+  m->checked_remote_commit = g_strdup (remote_commit);
+  m->checked_time = g_get_monotonic_time ();
+  g_mutex_unlock (&m->lock);
+
+  if (remote_commit == NULL)
+    remote_commit = local_commit;
+
   if (g_strcmp0 (m->reported_local_commit, local_commit) != 0 ||
       g_strcmp0 (m->reported_remote_commit, remote_commit) != 0)
     {
@@ -2012,17 +2405,17 @@ check_all_for_updates_in_thread_func (GTask *task,
   g_list_free_full (monitors, g_object_unref);
 
 
-/* We want to cache stuff between multiple monitors
-   when a poll is scheduled, but there is no need to keep it
-   long term to the next poll, the in-memory is just
-   a waste of space then. */
-  clear_installation_cache ();
+/* The remote refs are shared between monitors within a poll, but
+   must be re-fetched on the next one to see new updates. */
+  clear_remote_refs_cache ();
 
   G_LOCK (update_monitors);
   update_monitors_timeout_running_thread = FALSE;
 
   if (g_hash_table_size (update_monitors) > 0)
     update_monitors_timeout = g_timeout_add_seconds (opt_poll_timeout, check_all_for_updates_cb, NULL);
+  else
+    clear_installation_cache (); /* No more polls, so no need to keep these */
 
   G_UNLOCK (update_monitors);
 }
@@ -2609,7 +3002,7 @@ update_child_setup_func (gpointer user_data)
    spawn) to avoid running lots of complicated code in the portal
    process and possibly long-term leaks in a long-running process. */
 static int
-do_update_child_process (const char *installation_path, const char *ref, int socket_fd)
+do_update_child_process (const char *installation_path, const char *ref, const char *commit, gboolean no_triggers, int socket_fd)
 {
   g_autoptr(GOutputStream) out = g_unix_output_stream_new (socket_fd, TRUE);
   g_autoptr(FlatpakInstallation) installation = NULL;
@@ -2639,8 +3032,12 @@ do_update_child_process (const char *installation_path, const char *ref, int soc
     }
 
   flatpak_transaction_add_default_dependency_sources (transaction);
+  /* The app keeps running while it is being updated */
+  flatpak_transaction_set_background_priority (transaction, TRUE);
+  /* The portal runs them itself once the updates have settled down */
+  flatpak_transaction_set_disable_triggers (transaction, no_triggers);
 
-  if (!flatpak_transaction_add_update (transaction, ref, NULL, NULL, &error))
+  if (!flatpak_transaction_add_update (transaction, ref, NULL, commit, &error))
     {
       send_progress (out, 0, 0, 0,
                      PROGRESS_STATUS_ERROR, error);
@@ -2668,6 +3065,88 @@ do_update_child_process (const char *installation_path, const char *ref, int soc
   return 0;
 }
 
+/* Also run out of process, with the updates whose triggers were held back */
+static int
+do_run_triggers_child_process (const char *installation_path)
+{
+  g_autoptr(GFile) f = g_file_new_for_path (installation_path);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(FlatpakDir) dir = NULL;
+
+  dir = flatpak_dir_get_by_path (f);
+
+  if (!flatpak_dir_maybe_ensure_repo (dir, NULL, &error) ||
+      !flatpak_dir_run_triggers (dir, NULL, &error))
+    {
+      g_warning ("Failed to run triggers for %s: %s", installation_path, error->message);
+      return 1;
+    }
+
+  return 0;
+}
+
+static gboolean
+has_pending_triggers (void)
+{
+  gboolean res;
+
+  G_LOCK (pending_triggers);
+  res = pending_triggers != NULL && g_hash_table_size (pending_triggers) > 0;
+  G_UNLOCK (pending_triggers);
+
+  return res;
+}
+
+/* Runs on main thread */
+static gboolean
+run_pending_triggers_cb (void *data)
+{
+  g_autoptr(GHashTable) installations = NULL;
+
+  G_LOCK (pending_triggers);
+  installations = g_steal_pointer (&pending_triggers);
+  pending_triggers_timeout = 0;
+  G_UNLOCK (pending_triggers);
+
+  if (installations != NULL)
+    {
+      GLNX_HASH_TABLE_FOREACH (installations, const char *, installation_path)
+        {
+          const char *argv[] = { "/proc/self/exe", "flatpak-portal", "--run-triggers", installation_path, NULL };
+          g_autoptr(GError) error = NULL;
+
+          g_info ("Running deferred triggers for %s", installation_path);
+          if (!g_spawn_async (NULL, (char **)argv, NULL,
+                              G_SPAWN_FILE_AND_ARGV_ZERO,
+                              NULL, NULL, NULL, &error))
+            g_warning ("Failed to run triggers for %s: %s", installation_path, error->message);
+        }
+    }
+
+  schedule_idle_callback ();
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Updates started by the monitors often come in bursts, so rather than
+   running the triggers after each one, we wait until no update has
+   finished for opt_trigger_delay seconds and run them once. */
+static void
+schedule_triggers (GFile *installation_path)
+{
+  G_LOCK (pending_triggers);
+
+  if (pending_triggers == NULL)
+    pending_triggers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_hash_table_add (pending_triggers, g_file_get_path (installation_path));
+
+  if (pending_triggers_timeout != 0)
+    g_source_remove (pending_triggers_timeout);
+  pending_triggers_timeout = g_timeout_add_seconds (opt_trigger_delay, run_pending_triggers_cb, NULL);
+
+  G_UNLOCK (pending_triggers);
+}
+
 static GVariant *
 read_variant (GInputStream *in,
               GCancellable *cancellable,
@@ -2769,10 +3248,32 @@ handle_update_in_thread_func (GTask *task,
     {
       g_autoptr(GFile) installation_path = update_monitor_get_installation_path (monitor);
       g_autofree char *ref = flatpak_build_app_ref (m->name, m->branch, m->arch);
-      const char *argv[] = { "/proc/self/exe", "flatpak-portal", "--update", flatpak_file_get_path_cached (installation_path), ref, NULL };
+      g_autoptr(GPtrArray) argv = g_ptr_array_new_with_free_func (g_free);
+      g_autofree char *commit = NULL;
       int sockets[2];
       GPid pid;
 
+      g_ptr_array_add (argv, g_strdup ("/proc/self/exe"));
+      g_ptr_array_add (argv, g_strdup ("flatpak-portal"));
+      g_ptr_array_add (argv, g_strdup ("--update"));
+      g_ptr_array_add (argv, g_strdup (flatpak_file_get_path_cached (installation_path)));
+      g_ptr_array_add (argv, g_strdup (ref));
+      if (opt_trigger_delay > 0)
+        g_ptr_array_add (argv, g_strdup ("--no-triggers"));
+
+      /* If the last check is recent, update to the commit it found (which
+       * is what we reported to the app) rather than resolving the ref again */
+      g_mutex_lock (&m->lock);
+      if (m->checked_remote_commit != NULL &&
+          g_get_monotonic_time () - m->checked_time < (gint64) opt_poll_timeout * G_USEC_PER_SEC)
+        commit = g_strdup (m->checked_remote_commit);
+      g_mutex_unlock (&m->lock);
+
+      if (commit != NULL)
+        g_ptr_array_add (argv, g_strdup_printf ("--commit=%s", commit));
+
+      g_ptr_array_add (argv, NULL);
+
       if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0)
         {
           glnx_throw_errno (&error);
@@ -2781,7 +3282,7 @@ handle_update_in_thread_func (GTask *task,
         {
           gboolean spawn_ok;
 
-          spawn_ok = g_spawn_async (NULL, (char **)argv, NULL,
+          spawn_ok = g_spawn_async (NULL, (char **)argv->pdata, NULL,
                                     G_SPAWN_FILE_AND_ARGV_ZERO |
                                     G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
                                     update_child_setup_func, &sockets[1],
@@ -2794,6 +3295,10 @@ handle_update_in_thread_func (GTask *task,
                   if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
                     kill (pid, SIGINT);
                 }
+
+              /* Even a failed update may have deployed something */
+              if (opt_trigger_delay > 0)
+                schedule_triggers (installation_path);
             }
           close (sockets[0]); // Close local side
         }
@@ -2928,10 +3433,11 @@ on_bus_acquired (GDBusConnection *connection,
 
   g_object_set_data_full (G_OBJECT (portal), "track-alive", GINT_TO_POINTER (42), skeleton_died_cb);
 
-  portal_flatpak_set_version (PORTAL_FLATPAK (portal), 8);
+  portal_flatpak_set_version (PORTAL_FLATPAK (portal), 9);
   portal_flatpak_set_supports (PORTAL_FLATPAK (portal), supports);
 
   g_signal_connect (portal, "handle-spawn", G_CALLBACK (handle_spawn), NULL);
+  g_signal_connect (portal, "handle-spawn-many", G_CALLBACK (handle_spawn_many), NULL);
   g_signal_connect (portal, "handle-spawn-signal", G_CALLBACK (handle_spawn_signal), NULL);
   g_signal_connect (portal, "handle-create-update-monitor", G_CALLBACK (handle_create_update_monitor), NULL);
 
@@ -3014,6 +3520,7 @@ main (int    argc,
     { "no-idle-exit", 0, 0, G_OPTION_ARG_NONE, &no_idle_exit,  "Don't exit when idle.", NULL },
     { "poll-timeout", 0, 0, G_OPTION_ARG_INT, &opt_poll_timeout,  "Delay in seconds between polls for updates.", NULL },
     { "poll-when-metered", 0, 0, G_OPTION_ARG_NONE, &opt_poll_when_metered, "Whether to check for updates on metered networks",  NULL },
+    { "trigger-delay", 0, 0, G_OPTION_ARG_INT, &opt_trigger_delay, "Delay in seconds to wait for more updates before running triggers, 0 runs them after each update.", NULL },
     { NULL }
   };
 
@@ -3027,7 +3534,24 @@ main (int    argc,
 
   if (argc >= 4 && strcmp (argv[1], "--update") == 0)
     {
-      return do_update_child_process (argv[2], argv[3], 3);
+      gboolean no_triggers = FALSE;
+      const char *commit = NULL;
+      int i;
+
+      for (i = 4; i < argc; i++)
+        {
+          if (strcmp (argv[i], "--no-triggers") == 0)
+            no_triggers = TRUE;
+          else if (g_str_has_prefix (argv[i], "--commit="))
+            commit = argv[i] + strlen ("--commit=");
+        }
+
+      return do_update_child_process (argv[2], argv[3], commit, no_triggers, 3);
+    }
+
+  if (argc >= 3 && strcmp (argv[1], "--run-triggers") == 0)
+    {
+      return do_run_triggers_child_process (argv[2]);
     }
 
   context = g_option_context_new ("");
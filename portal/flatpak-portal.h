@@ -73,6 +73,9 @@ typedef enum {
                                  FLATPAK_SPAWN_FLAGS_SHARE_PIDS | \
                                  FLATPAK_SPAWN_FLAGS_EMPTY_APP)
 
+/* The maximum number of instances started by one SpawnMany call */
+#define FLATPAK_SPAWN_MANY_MAX 64
+
 #define FLATPAK_SPAWN_SANDBOX_FLAGS_ALL (FLATPAK_SPAWN_SANDBOX_FLAGS_SHARE_DISPLAY | \
                                          FLATPAK_SPAWN_SANDBOX_FLAGS_SHARE_SOUND | \
                                          FLATPAK_SPAWN_SANDBOX_FLAGS_SHARE_GPU | \
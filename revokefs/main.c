@@ -546,6 +546,7 @@ main (int argc, char *argv[])
   struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
   int res;
   struct revokefs_config conf = { -1, -1 };
+  g_autofree char *max_write_opt = NULL;
   int status = 0;
 
   res = fuse_opt_parse (&args, &conf, revokefs_opts, revokefs_opt_proc);
@@ -623,6 +624,15 @@ main (int argc, char *argv[])
       writer_socket = sockets[0];
     }
 
+  setup_writer_socket (writer_socket);
+
+  /* Let the kernel send us writes as large as a single backend request */
+#if FUSE_USE_VERSION < 30
+  fuse_opt_add_arg (&args, "-obig_writes");
+#endif
+  max_write_opt = g_strdup_printf ("-omax_write=%d", MAX_DATA_SIZE);
+  fuse_opt_add_arg (&args, max_write_opt);
+
   fuse_main (args.argc, args.argv, &callback_oper, NULL);
 
 out:
@@ -46,9 +46,69 @@
 
 static int basefd = -1;
 
+G_LOCK_DEFINE_STATIC (outstanding_fds);
 static GHashTable *outstanding_fds;
 
+/* Protects the shared writer socket. FUSE runs callbacks from several
+ * threads, each of which gets its own connection to the backend when
+ * possible so that they don't all serialize on this lock. */
 static GMutex mutex;
+static gboolean thread_connections_failed;
+
+static void
+close_thread_socket (gpointer data)
+{
+  close (GPOINTER_TO_INT (data) - 1);
+}
+
+static GPrivate thread_socket = G_PRIVATE_INIT (close_thread_socket);
+
+static int
+request_new_connection (int writer_socket, int new_socket);
+
+/* Returns the calling thread's own connection, creating it on first use,
+ * or -1 if the shared one must be used. */
+static int
+get_thread_socket (int writer_socket)
+{
+  gpointer data = g_private_get (&thread_socket);
+  int sockets[2];
+
+  if (data != NULL)
+    return GPOINTER_TO_INT (data) - 1;
+
+  if (g_atomic_int_get (&thread_connections_failed))
+    return -1;
+
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1)
+    return -1;
+
+  if (request_new_connection (writer_socket, sockets[1]) != 0)
+    {
+      g_atomic_int_set (&thread_connections_failed, TRUE);
+      close (sockets[0]);
+      close (sockets[1]);
+      return -1;
+    }
+
+  close (sockets[1]);
+  setup_writer_socket (sockets[0]);
+  g_private_set (&thread_socket, GINT_TO_POINTER (sockets[0] + 1));
+
+  return sockets[0];
+}
+
+static gboolean
+is_outstanding_fd (int fd)
+{
+  gboolean res;
+
+  G_LOCK (outstanding_fds);
+  res = g_hash_table_contains (outstanding_fds, GUINT_TO_POINTER(fd));
+  G_UNLOCK (outstanding_fds);
+
+  return res;
+}
 
 static ssize_t
 do_request (int writer_socket,
@@ -69,6 +129,7 @@ do_request (int writer_socket,
   struct iovec read_vecs[2] = {};
   int n_read_vecs = 0;
   g_autoptr(GMutexLocker) locker = NULL;
+  int thread_socket_fd;
 
   request_size = sizeof (RevokefsRequest);
   write_vecs[n_write_vecs].iov_base = (char *)request;
@@ -88,7 +149,12 @@ do_request (int writer_socket,
       request_size += data2_size;
     }
 
-  locker = g_mutex_locker_new (&mutex);
+  thread_socket_fd = get_thread_socket (writer_socket);
+  if (thread_socket_fd != -1)
+    writer_socket = thread_socket_fd;
+  else
+    locker = g_mutex_locker_new (&mutex);
+
   written_size = TEMP_FAILURE_RETRY (writev (writer_socket, write_vecs, n_write_vecs));
   if (written_size == -1)
     {
@@ -556,7 +622,9 @@ handle_open (RevokefsRequest *request,
 
       if (response->result == 0)
         {
+          G_LOCK (outstanding_fds);
           g_hash_table_insert (outstanding_fds, GUINT_TO_POINTER(fd), GUINT_TO_POINTER(1));
+          G_UNLOCK (outstanding_fds);
           response->result = fd;
         }
       else
@@ -585,7 +653,7 @@ handle_read (RevokefsRequest *request,
   if (size > MAX_DATA_SIZE)
     size = MAX_DATA_SIZE;
 
-  if (g_hash_table_lookup (outstanding_fds, GUINT_TO_POINTER(fd)) == NULL)
+  if (!is_outstanding_fd (fd))
     {
       response->result = -EBADFD;
       return 0;
@@ -632,7 +700,7 @@ handle_write (RevokefsRequest *request,
   int fd = request->arg1;
   off_t offset = request->arg2;
 
-  if (g_hash_table_lookup (outstanding_fds, GUINT_TO_POINTER(fd)) == NULL)
+  if (!is_outstanding_fd (fd))
     {
       response->result = -EBADFD;
       return 0;
@@ -676,7 +744,7 @@ handle_fsync (RevokefsRequest *request,
   int r;
   int fd = request->arg1;
 
-  if (g_hash_table_lookup (outstanding_fds, GUINT_TO_POINTER(fd)) == NULL)
+  if (!is_outstanding_fd (fd))
     {
       response->result = -EBADFD;
       return 0;
@@ -714,8 +782,13 @@ handle_close (RevokefsRequest *request,
               RevokefsResponse *response)
 {
   int fd = request->arg1;
+  gboolean removed;
+
+  G_LOCK (outstanding_fds);
+  removed = g_hash_table_remove (outstanding_fds, GUINT_TO_POINTER(fd));
+  G_UNLOCK (outstanding_fds);
 
-  if (!g_hash_table_remove (outstanding_fds, GUINT_TO_POINTER(fd)))
+  if (!removed)
     {
       response->result = -EBADFD;
       return 0;
@@ -768,24 +841,151 @@ request_access (int writer_socket, const char *path, int mode)
   return request_path_int (writer_socket, REVOKE_FS_ACCESS, path, mode);
 }
 
+static void handle_connection (int      fuse_socket,
+                               int      exit_with_fd,
+                               gboolean main_connection);
+
+static gpointer
+connection_thread (gpointer data)
+{
+  int socket = GPOINTER_TO_INT (data);
+
+  handle_connection (socket, -1, FALSE);
+  close (socket);
+
+  return NULL;
+}
+
+static ssize_t
+handle_new_connection (RevokefsRequest *request,
+                       gsize data_size,
+                       RevokefsResponse *response,
+                       int socket)
+{
+  GThread *thread;
+
+  if (socket == -1)
+    {
+      response->result = -EINVAL;
+      return 0;
+    }
+
+  setup_writer_socket (socket);
+  thread = g_thread_new ("revokefs-writer", connection_thread, GINT_TO_POINTER (socket));
+  g_thread_unref (thread);
+
+  response->result = 0;
+  return 0;
+}
+
+static int
+request_new_connection (int writer_socket, int new_socket)
+{
+  RevokefsRequest request = { REVOKE_FS_NEW_CONNECTION };
+  RevokefsResponse response;
+  struct iovec iov = { &request, sizeof (request) };
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE (sizeof (int))];
+  } control = {};
+  struct msghdr msg = {};
+  struct cmsghdr *cmsg;
+  ssize_t size;
+  g_autoptr(GMutexLocker) locker = NULL;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  memcpy (CMSG_DATA (cmsg), &new_socket, sizeof (int));
+
+  locker = g_mutex_locker_new (&mutex);
+
+  size = TEMP_FAILURE_RETRY (sendmsg (writer_socket, &msg, 0));
+  if (size != sizeof (request))
+    return -EIO;
+
+  size = TEMP_FAILURE_RETRY (read (writer_socket, &response, sizeof (response)));
+  if (size != sizeof (response))
+    return -EIO;
+
+  return response.result;
+}
+
+/* Like read(), but also returns a file descriptor passed along with the
+ * request, if any */
+static ssize_t
+receive_request (int     socket,
+                 guchar *buffer,
+                 gsize   buffer_size,
+                 int    *fd_out)
+{
+  struct iovec iov = { buffer, buffer_size };
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE (sizeof (int))];
+  } control;
+  struct msghdr msg = {};
+  struct cmsghdr *cmsg;
+  ssize_t size;
+
+  *fd_out = -1;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+
+  size = TEMP_FAILURE_RETRY (recvmsg (socket, &msg, MSG_CMSG_CLOEXEC));
+  if (size == -1)
+    return -1;
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL; cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET &&
+          cmsg->cmsg_type == SCM_RIGHTS &&
+          cmsg->cmsg_len == CMSG_LEN (sizeof (int)))
+        memcpy (fd_out, CMSG_DATA (cmsg), sizeof (int));
+    }
+
+  return size;
+}
+
+/* Each request and response is a single SOCK_SEQPACKET message, so the
+ * send buffer must be able to hold the largest one. */
 void
-do_writer (int basefd_arg,
-           int fuse_socket,
-           int exit_with_fd)
+setup_writer_socket (int socket)
 {
-  guchar request_buffer[MAX_REQUEST_SIZE];
-  RevokefsRequest *request = (RevokefsRequest *)&request_buffer;
-  guchar response_buffer[MAX_RESPONSE_SIZE];
-  RevokefsResponse *response = (RevokefsResponse *)&response_buffer;
+  int size = MAX_REQUEST_SIZE * 2;
 
-  basefd = basefd_arg;
-  outstanding_fds = g_hash_table_new (g_direct_hash, g_direct_equal);
+  if (setsockopt (socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size)) == -1)
+    g_printerr ("Failed to set socket send buffer size: %s\n", g_strerror (errno));
+}
+
+/* Serves requests from one connection. The main connection is the one we
+ * were started with; when it closes the filesystem is done and we exit.
+ * Additional per-thread connections just end their thread. */
+static void
+handle_connection (int      fuse_socket,
+                   int      exit_with_fd,
+                   gboolean main_connection)
+{
+  g_autofree guchar *request_buffer = g_malloc (MAX_REQUEST_SIZE);
+  RevokefsRequest *request = (RevokefsRequest *)request_buffer;
+  g_autofree guchar *response_buffer = g_malloc (MAX_RESPONSE_SIZE);
+  RevokefsResponse *response = (RevokefsResponse *)response_buffer;
 
   while (1)
     {
       ssize_t data_size, size;
       ssize_t response_data_size, response_size, written_size;
       int res;
+      int received_fd;
       struct pollfd pollfds[2] =  {
          {fuse_socket, POLLIN, 0 },
          {exit_with_fd, POLLIN, 0 },
@@ -807,7 +1007,7 @@ do_writer (int basefd_arg,
       if ((pollfds[0].revents & POLLIN) == 0)
         continue;
 
-      size = TEMP_FAILURE_RETRY (read (fuse_socket, request_buffer, sizeof (request_buffer)));
+      size = receive_request (fuse_socket, request_buffer, MAX_REQUEST_SIZE, &received_fd);
       if (size == -1)
         {
           perror ("Got error reading from fuse socket: ");
@@ -817,7 +1017,9 @@ do_writer (int basefd_arg,
       if (size == 0)
         {
           /* Fuse filesystem finished */
-          exit (1);
+          if (main_connection)
+            exit (1);
+          return;
         }
 
       if (size < sizeof (RevokefsRequest))
@@ -879,11 +1081,19 @@ do_writer (int basefd_arg,
         case REVOKE_FS_ACCESS:
           response_data_size = handle_access (request, data_size, response);
           break;
+        case REVOKE_FS_NEW_CONNECTION:
+          response_data_size = handle_new_connection (request, data_size, response, received_fd);
+          received_fd = -1;
+          break;
         default:
           g_printerr ("Invalid request op %d", (guint) request->op);
           exit (1);
         }
 
+      /* Only new connection requests carry a file descriptor */
+      if (received_fd != -1)
+        close (received_fd);
+
       if (response_data_size < 0 || response_data_size > MAX_DATA_SIZE)
         {
           g_printerr ("Invalid response size %zd", response_data_size);
@@ -906,3 +1116,15 @@ do_writer (int basefd_arg,
         }
     }
 }
+
+void
+do_writer (int basefd_arg,
+           int fuse_socket,
+           int exit_with_fd)
+{
+  basefd = basefd_arg;
+  setup_writer_socket (fuse_socket);
+  outstanding_fds = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  handle_connection (fuse_socket, exit_with_fd, TRUE);
+}
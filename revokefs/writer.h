@@ -39,6 +39,7 @@ int request_fsync (int writer_socket, int fd);
 int request_close (int writer_socket, int fd);
 int request_access (int writer_socket, const char *path, int mode);
 
+void  setup_writer_socket (int socket);
 void  do_writer (int basefd, int socket, int exit_with_fd);
 
 
@@ -59,6 +60,7 @@ typedef enum {
   REVOKE_FS_FSYNC,
   REVOKE_FS_CLOSE,
   REVOKE_FS_ACCESS,
+  REVOKE_FS_NEW_CONNECTION,
 } RevokefsOps;
 
 typedef struct {
@@ -78,7 +80,9 @@ typedef struct {
 #define REQUEST_SIZE(__data_size) (sizeof(RevokefsRequest) + (__data_size))
 #define RESPONSE_SIZE(__data_size) (sizeof(RevokefsResponse) + (__data_size))
 
-#define MAX_DATA_SIZE 16384
+/* Matches the max_write we ask FUSE for, so that a big write is forwarded
+ * to the backend in one request instead of being split or truncated. */
+#define MAX_DATA_SIZE (128 * 1024)
 #define MAX_REQUEST_SIZE REQUEST_SIZE(MAX_DATA_SIZE)
 #define MAX_RESPONSE_SIZE RESPONSE_SIZE(MAX_DATA_SIZE)
 
@@ -519,11 +519,19 @@ typedef struct
   char         *real;
   GFileMonitor *monitor_source;
   GFileMonitor *monitor_real;
+  guint         timeout_id;
 } MonitorData;
 
+/* Files like resolv.conf tend to be rewritten several times in a row
+ * (e.g. by NetworkManager or VPN clients), so we wait for the changes
+ * to settle down before copying them. */
+#define FILE_MONITOR_DEBOUNCE_MSEC 200
+
 static void
 monitor_data_free (MonitorData *data)
 {
+  if (data->timeout_id != 0)
+    g_source_remove (data->timeout_id);
   free (data->real);
   g_signal_handlers_disconnect_by_data (data->monitor_source, data);
   g_object_unref (data->monitor_source);
@@ -544,14 +552,20 @@ copy_file (const char *source,
   char *basename = g_path_get_basename (source);
   char *dest = g_build_filename (target_dir, basename, NULL);
   gchar *contents = NULL;
-  gsize len;
-
-  if (g_file_get_contents (source, &contents, &len, NULL))
+  gchar *old_contents = NULL;
+  gsize len, old_len;
+
+  /* g_file_set_contents() replaces the file atomically, but we avoid even
+   * that if nothing changed, as sandboxes may be watching the copy */
+  if (g_file_get_contents (source, &contents, &len, NULL) &&
+      !(g_file_get_contents (dest, &old_contents, &old_len, NULL) &&
+        old_len == len && memcmp (old_contents, contents, len) == 0))
     g_file_set_contents (dest, contents, len, NULL);
 
   g_free (basename);
   g_free (dest);
   g_free (contents);
+  g_free (old_contents);
 }
 
 static void file_changed (GFileMonitor     *monitor,
@@ -637,6 +651,17 @@ file_monitor_do (MonitorData *data)
     }
 }
 
+static gboolean
+file_monitor_timeout_cb (gpointer user_data)
+{
+  MonitorData *data = user_data;
+
+  data->timeout_id = 0;
+  file_monitor_do (data);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 file_changed (GFileMonitor     *monitor,
               GFile            *file,
@@ -647,7 +672,10 @@ file_changed (GFileMonitor     *monitor,
   if (event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT)
     return;
 
-  file_monitor_do (data);
+  if (data->timeout_id != 0)
+    g_source_remove (data->timeout_id);
+
+  data->timeout_id = g_timeout_add (FILE_MONITOR_DEBOUNCE_MSEC, file_monitor_timeout_cb, data);
 }
 
 static MonitorData *
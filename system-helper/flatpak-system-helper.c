@@ -389,6 +389,8 @@ handle_deploy (FlatpakSystemHelper   *object,
       return G_DBUS_METHOD_INVOCATION_HANDLED;
     }
 
+  flatpak_dir_set_background_priority (system, (arg_flags & FLATPAK_HELPER_DEPLOY_FLAGS_BACKGROUND) != 0);
+
   if (strlen (arg_repo_path) > 0)
     {
       g_autoptr(GError) local_error = NULL;
@@ -588,10 +590,15 @@ handle_deploy (FlatpakSystemHelper   *object,
     }
   else if (strlen (arg_repo_path) > 0)
     {
+      /* A revokefs-backed pull has been revoked and chowned to root above,
+       * so the caller can't change the objects after we've verified them. */
+      gboolean src_is_sealed = ongoing_pull != NULL && getuid () == 0;
+
       if (!flatpak_dir_pull_untrusted_local (system, arg_repo_path,
                                              arg_origin,
                                              arg_ref,
                                              (const char **) arg_subpaths,
+                                             src_is_sealed,
                                              NULL, NULL, &error))
         {
           flatpak_invocation_return_error (invocation, error, "Error pulling from repo");
@@ -800,6 +807,7 @@ handle_deploy_appstream (FlatpakSystemHelper   *object,
                                              arg_origin,
                                              new_branch,
                                              NULL,
+                                             FALSE,
                                              NULL,
                                              NULL, &first_error))
         {
@@ -807,6 +815,7 @@ handle_deploy_appstream (FlatpakSystemHelper   *object,
                                                  arg_origin,
                                                  old_branch,
                                                  NULL,
+                                                 FALSE,
                                                  NULL,
                                                  NULL, &second_error))
             {
@@ -1841,6 +1850,90 @@ dir_ref_is_installed (FlatpakDir *dir,
   return deploy_data != NULL;
 }
 
+/* A transaction typically calls several helper methods in a row with
+ * identical polkit details (e.g. RunTriggers, then PruneLocalRepo), so
+ * remember positive answers for a short while per client. Only results
+ * polkit says are retained (auth_admin_keep and friends) are cached, as
+ * replaying any other answer would override the policy. Unique bus names
+ * are never reused, so keying on the sender is safe. */
+#define AUTHORIZATION_CACHE_TTL_SECS 60
+
+G_LOCK_DEFINE_STATIC (authorization_cache);
+static GHashTable *authorization_cache = NULL; /* key => expiry (gint64 *) */
+
+static char *
+authorization_cache_key (const char    *sender,
+                         const char    *action,
+                         PolkitDetails *details)
+{
+  g_autoptr(GString) key = g_string_new (sender);
+  g_auto(GStrv) keys = polkit_details_get_keys (details);
+
+  g_string_append_printf (key, "\n%s", action);
+
+  if (keys != NULL)
+    {
+      qsort (keys, g_strv_length (keys), sizeof (char *), flatpak_strcmp0_ptr);
+      for (int i = 0; keys[i] != NULL; i++)
+        g_string_append_printf (key, "\n%s=%s", keys[i],
+                                polkit_details_lookup (details, keys[i]));
+    }
+
+  return g_string_free (g_steal_pointer (&key), FALSE);
+}
+
+static gboolean
+authorization_cache_lookup (const char *key)
+{
+  gint64 *expiry;
+  gboolean found = FALSE;
+
+  G_LOCK (authorization_cache);
+
+  if (authorization_cache != NULL)
+    {
+      expiry = g_hash_table_lookup (authorization_cache, key);
+      if (expiry != NULL)
+        {
+          if (*expiry > g_get_monotonic_time ())
+            found = TRUE;
+          else
+            g_hash_table_remove (authorization_cache, key);
+        }
+    }
+
+  G_UNLOCK (authorization_cache);
+
+  return found;
+}
+
+static void
+authorization_cache_insert (const char *key)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 *expiry;
+  GHashTableIter iter;
+  gpointer value;
+
+  G_LOCK (authorization_cache);
+
+  if (authorization_cache == NULL)
+    authorization_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  g_hash_table_iter_init (&iter, authorization_cache);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      if (*(gint64 *) value <= now)
+        g_hash_table_iter_remove (&iter);
+    }
+
+  expiry = g_new (gint64, 1);
+  *expiry = now + AUTHORIZATION_CACHE_TTL_SECS * G_USEC_PER_SEC;
+  g_hash_table_replace (authorization_cache, g_strdup (key), expiry);
+
+  G_UNLOCK (authorization_cache);
+}
+
 static gboolean
 flatpak_authorize_method_handler (GDBusInterfaceSkeleton *interface,
                                   GDBusMethodInvocation  *invocation,
@@ -2110,8 +2203,16 @@ flatpak_authorize_method_handler (GDBusInterfaceSkeleton *interface,
     {
       g_autoptr(AutoPolkitAuthorizationResult) result = NULL;
       g_autoptr(GError) error = NULL;
+      g_autofree char *cache_key = NULL;
       PolkitCheckAuthorizationFlags auth_flags;
 
+      cache_key = authorization_cache_key (sender, action, details);
+      if (authorization_cache_lookup (cache_key))
+        {
+          g_debug ("Using cached authorization of %s for %s", action, sender);
+          return TRUE;
+        }
+
       if (no_interaction)
         auth_flags = POLKIT_CHECK_AUTHORIZATION_FLAGS_NONE;
       else
@@ -2130,6 +2231,10 @@ flatpak_authorize_method_handler (GDBusInterfaceSkeleton *interface,
         }
 
       authorized = polkit_authorization_result_get_is_authorized (result);
+
+      if (authorized &&
+          polkit_authorization_result_get_retains_authorization (result))
+        authorization_cache_insert (cache_key);
     }
 
   if (!authorized)
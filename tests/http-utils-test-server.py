@@ -23,6 +23,30 @@ def parse_http_date(date):
         return None
 
 class RequestHandler(http_server.BaseHTTPRequestHandler):
+    def do_resumable(self, query):
+        contents = ("path=" + self.path + "\n").encode('utf-8') * 1000
+        etag = str(server_start_time)
+
+        start = 0
+        range_header = self.headers.get("Range")
+        if range_header and range_header.startswith("bytes=") and self.headers.get("If-Range") == etag:
+            start = int(range_header[len("bytes="):].split('-')[0])
+
+        if start > 0:
+            self.send_response(206)
+            self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, len(contents) - 1, len(contents)))
+        else:
+            self.send_response(200)
+        self.send_header('Etag', etag)
+        self.send_header('Content-Length', str(len(contents) - start))
+        self.end_headers()
+
+        # Drop the connection halfway through any download from the start
+        if start == 0 and 'interrupt' in query:
+            self.wfile.write(contents[:len(contents) // 2])
+        else:
+            self.wfile.write(contents[start:])
+
     def do_GET(self):
         parts = self.path.split('?', 1)
         path = parts[0]
@@ -31,6 +55,10 @@ class RequestHandler(http_server.BaseHTTPRequestHandler):
         else:
             query = parse_qs(parts[1], keep_blank_values=True)
 
+        if 'resumable' in query:
+            self.do_resumable(query)
+            return
+
         response = 200
         add_headers = {}
 
@@ -9,6 +9,8 @@ main (int argc, char *argv[])
   g_autoptr(GError) error = NULL;
   const char *url, *dest;
   int flags = 0;
+  gboolean resumable = FALSE;
+  gboolean res;
 
   if (argc == 3)
     {
@@ -21,18 +23,32 @@ main (int argc, char *argv[])
       dest = argv[3];
       flags |= FLATPAK_HTTP_FLAGS_STORE_COMPRESSED;
     }
+  else if (argc == 4 && g_strcmp0 (argv[1], "--resumable") == 0)
+    {
+      url = argv[2];
+      dest = argv[3];
+      resumable = TRUE;
+    }
   else
     {
-      g_printerr ("Usage httpcache [--compressed] URL DEST\n");
+      g_printerr ("Usage httpcache [--compressed|--resumable] URL DEST\n");
       return 1;
     }
 
+  if (resumable)
+    res = flatpak_download_http_uri_resumable (session,
+                                               url, NULL,
+                                               flags,
+                                               AT_FDCWD, dest,
+                                               NULL, NULL, NULL, &error);
+  else
+    res = flatpak_cache_http_uri (session,
+                                  url, NULL,
+                                  flags,
+                                  AT_FDCWD, dest,
+                                  NULL, NULL, NULL, &error);
 
-  if (!flatpak_cache_http_uri (session,
-                               url, NULL,
-                               flags,
-                               AT_FDCWD, dest,
-                               NULL, NULL, NULL, &error))
+  if (!res)
     {
       g_print ("%s\n", error->message);
       return 1;
@@ -0,0 +1,104 @@
+#!/bin/bash
+#
+# Creates a synthetic repo for the performance tests: a runtime with
+# N_FILES files, its Locale extension with N_LOCALES locales and N_APPS
+# apps using it. None of this is runnable, it only exercises the
+# pull, deploy and export code.
+#
+# Usage: make-perf-repo.sh REPO N_APPS N_FILES N_LOCALES
+
+set -e
+
+# Don't inherit the -x from the testsuite
+set +x
+
+REPO=$1
+N_APPS=$2
+N_FILES=$3
+N_LOCALES=$4
+
+ARCH=`flatpak --default-arch`
+BRANCH=stable
+RUNTIME_ID=org.perf.Platform
+
+DIR=`mktemp -d`
+trap 'rm -rf ${DIR}' EXIT
+
+export_dir () {
+    flatpak build-export --no-update-summary --disable-sandbox "$@" >&2
+}
+
+# Runtime
+mkdir -p ${DIR}/runtime/usr/share/perf ${DIR}/runtime/files
+cat > ${DIR}/runtime/metadata <<EOF
+[Runtime]
+name=${RUNTIME_ID}
+
+[Extension ${RUNTIME_ID}.Locale]
+directory=share/runtime/locale
+autodelete=true
+locale-subset=true
+EOF
+
+for i in $(seq 1 ${N_FILES}); do
+    # Spread the files over some directories, and make them all different
+    d=${DIR}/runtime/usr/share/perf/$((i % 64))
+    mkdir -p $d
+    echo "perf file ${i}" > $d/file-${i}
+done
+
+export_dir --runtime ${REPO} ${DIR}/runtime ${BRANCH}
+
+# Locale extension
+mkdir -p ${DIR}/locale/usr ${DIR}/locale/files
+cat > ${DIR}/locale/metadata <<EOF
+[Runtime]
+name=${RUNTIME_ID}.Locale
+
+[ExtensionOf]
+ref=runtime/${RUNTIME_ID}/${ARCH}/${BRANCH}
+EOF
+
+for i in $(seq 1 ${N_LOCALES}); do
+    l=$(printf "l%03d" $i)
+    mkdir -p ${DIR}/locale/usr/${l}/share/${l}/LC_MESSAGES
+    echo "perf locale ${l}" > ${DIR}/locale/usr/${l}/share/${l}/LC_MESSAGES/perf.mo
+done
+
+export_dir --runtime ${REPO} ${DIR}/locale ${BRANCH}
+
+# Apps
+for i in $(seq 1 ${N_APPS}); do
+    APP_ID=org.perf.App${i}
+    APP_DIR=${DIR}/app-${i}
+
+    mkdir -p ${APP_DIR}/files/bin ${APP_DIR}/files/share/applications \
+             ${APP_DIR}/files/share/icons/hicolor/64x64/apps
+    cat > ${APP_DIR}/metadata <<EOF
+[Application]
+name=${APP_ID}
+runtime=${RUNTIME_ID}/${ARCH}/${BRANCH}
+sdk=${RUNTIME_ID}/${ARCH}/${BRANCH}
+command=perf.sh
+EOF
+
+    cat > ${APP_DIR}/files/bin/perf.sh <<EOF
+#!/bin/sh
+echo "${APP_ID}"
+EOF
+    chmod a+x ${APP_DIR}/files/bin/perf.sh
+
+    cat > ${APP_DIR}/files/share/applications/${APP_ID}.desktop <<EOF
+[Desktop Entry]
+Version=1.0
+Type=Application
+Name=Perf ${i}
+Exec=perf.sh
+Icon=${APP_ID}
+EOF
+    cp $(dirname $0)/org.test.Hello.png ${APP_DIR}/files/share/icons/hicolor/64x64/apps/${APP_ID}.png
+
+    export_dir ${REPO} ${APP_DIR} ${BRANCH}
+done
+
+flatpak build-update-repo ${REPO} >&2
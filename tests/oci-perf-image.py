@@ -0,0 +1,261 @@
+#!/usr/bin/python3
+#
+# Rewrites OCI images created by "flatpak build-bundle --oci" for the
+# OCI pull benchmark:
+#
+#   split-layers IMAGE N_LAYERS
+#     Splits the single layer of IMAGE into N_LAYERS layers, in place.
+#
+#   make-delta OLD_IMAGE NEW_IMAGE DELTA_DIR
+#     Writes a delta index to DELTA_DIR (for oci-registry-client.py
+#     add-delta) with a tar-diff from the layer of OLD_IMAGE to the one
+#     of NEW_IMAGE. Files that did not change are copied from the old
+#     deployment, everything else is included in the delta. Prints the
+#     digest of the delta layer.
+#
+#   layers-size IMAGE
+#     Prints the total (compressed) size of the layers of IMAGE.
+
+import argparse
+import gzip
+import hashlib
+import io
+import json
+import os
+import subprocess
+import sys
+import tarfile
+
+MANIFEST_MEDIA_TYPE = "application/vnd.oci.image.manifest.v1+json"
+INDEX_MEDIA_TYPE = "application/vnd.oci.image.index.v1+json"
+CONFIG_MEDIA_TYPE = "application/vnd.oci.image.config.v1+json"
+GZIP_LAYER_MEDIA_TYPE = "application/vnd.oci.image.layer.v1.tar+gzip"
+DELTA_LAYER_MEDIA_TYPE = "application/vnd.redhat.tar-diff"
+
+DELTA_HEADER = b"tardf1\n\0"
+DELTA_OP_DATA = 0
+DELTA_OP_OPEN = 1
+DELTA_OP_COPY = 2
+
+
+def blob_path(d, digest):
+    return os.path.join(d, "blobs", *digest.split(":"))
+
+
+def read_blob(d, digest):
+    with open(blob_path(d, digest), "rb") as f:
+        return f.read()
+
+
+def write_blob(d, data):
+    digest = "sha256:" + hashlib.sha256(data).hexdigest()
+    os.makedirs(os.path.join(d, "blobs", "sha256"), exist_ok=True)
+    with open(blob_path(d, digest), "wb") as f:
+        f.write(data)
+    return digest
+
+
+def write_json_blob(d, obj):
+    data = json.dumps(obj, indent=4).encode("UTF-8")
+    return write_blob(d, data), len(data)
+
+
+class Image:
+    def __init__(self, d):
+        self.dir = d
+        with open(os.path.join(d, "index.json")) as f:
+            self.index = json.load(f)
+        self.manifest_digest = self.index["manifests"][0]["digest"]
+        self.manifest = json.loads(read_blob(d, self.manifest_digest))
+        self.config = json.loads(read_blob(d, self.manifest["config"]["digest"]))
+
+    def single_layer_tar(self):
+        layers = self.manifest["layers"]
+        if len(layers) != 1:
+            sys.exit("{}: expected a single layer".format(self.dir))
+        if layers[0]["mediaType"] != GZIP_LAYER_MEDIA_TYPE:
+            sys.exit("{}: only gzip layers are supported".format(self.dir))
+        return gzip.decompress(read_blob(self.dir, layers[0]["digest"]))
+
+
+def split_layers(args):
+    image = Image(args.image)
+    raw = image.single_layer_tar()
+    old_layer = image.manifest["layers"][0]["digest"]
+    old_config = image.manifest["config"]["digest"]
+
+    with tarfile.open(fileobj=io.BytesIO(raw)) as tf:
+        members = [(m, tf.extractfile(m).read() if m.isreg() else None) for m in tf]
+
+    # Directories and symlinks go in the first layer, hardlinks in the
+    # last one so that their targets always exist, and the files are
+    # spread over all of them by size
+    files = [(m, data) for m, data in members if m.isreg()]
+    total = sum(m.size for m, data in files)
+    chunks = [[] for i in range(args.n_layers)]
+    done = 0
+    for m, data in files:
+        i = min(args.n_layers - 1, done * args.n_layers // max(total, 1))
+        chunks[i].append((m, data))
+        done += m.size
+    chunks[0] = [(m, None) for m, data in members if m.isdir() or m.issym()] + chunks[0]
+    chunks[-1] += [(m, None) for m, data in members if m.islnk()]
+
+    layers = []
+    diff_ids = []
+    for chunk in chunks:
+        out = io.BytesIO()
+        with tarfile.open(fileobj=out, mode="w", format=tarfile.PAX_FORMAT) as tf:
+            for m, data in chunk:
+                tf.addfile(m, io.BytesIO(data) if data is not None else None)
+        layer_raw = out.getvalue()
+        layer_data = gzip.compress(layer_raw, mtime=0)
+        diff_ids.append("sha256:" + hashlib.sha256(layer_raw).hexdigest())
+        layers.append(
+            {
+                "mediaType": GZIP_LAYER_MEDIA_TYPE,
+                "digest": write_blob(image.dir, layer_data),
+                "size": len(layer_data),
+            }
+        )
+
+    image.config["rootfs"]["diff_ids"] = diff_ids
+    config_digest, config_size = write_json_blob(image.dir, image.config)
+    image.manifest["config"]["digest"] = config_digest
+    image.manifest["config"]["size"] = config_size
+    image.manifest["layers"] = layers
+    manifest_digest, manifest_size = write_json_blob(image.dir, image.manifest)
+    image.index["manifests"][0]["digest"] = manifest_digest
+    image.index["manifests"][0]["size"] = manifest_size
+
+    with open(os.path.join(image.dir, "index.json"), "w") as f:
+        json.dump(image.index, f, indent=4)
+
+    for digest in (old_layer, old_config, image.manifest_digest):
+        os.unlink(blob_path(image.dir, digest))
+
+
+def varuint(value):
+    res = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            res.append(byte | 0x80)
+        else:
+            res.append(byte)
+            return bytes(res)
+
+
+def delta_op(ops, op, size, data=b""):
+    ops.append(op)
+    ops += varuint(size)
+    ops += data
+
+
+def make_delta(args):
+    old = Image(args.old_image)
+    new = Image(args.new_image)
+    old_raw = old.single_layer_tar()
+    new_raw = new.single_layer_tar()
+
+    with tarfile.open(fileobj=io.BytesIO(old_raw)) as tf:
+        old_files = {
+            os.path.normpath(m.name): tf.extractfile(m).read() for m in tf if m.isreg()
+        }
+
+    # Everything is data, except for the contents of unchanged files
+    ops = bytearray()
+    pos = 0
+    with tarfile.open(fileobj=io.BytesIO(new_raw)) as tf:
+        for m in tf:
+            if not m.isreg() or m.size == 0:
+                continue
+
+            name = os.path.normpath(m.name)
+            end = m.offset_data + m.size
+            if old_files.get(name) != new_raw[m.offset_data : end]:
+                continue
+
+            delta_op(ops, DELTA_OP_DATA, m.offset_data - pos, new_raw[pos : m.offset_data])
+            path = name.encode("UTF-8")
+            delta_op(ops, DELTA_OP_OPEN, len(path), path)
+            delta_op(ops, DELTA_OP_COPY, m.size)
+            pos = end
+    delta_op(ops, DELTA_OP_DATA, len(new_raw) - pos, new_raw[pos:])
+
+    compressed = subprocess.run(
+        ["zstd", "-q", "-c"], input=bytes(ops), stdout=subprocess.PIPE, check=True
+    ).stdout
+    delta_data = DELTA_HEADER + compressed
+
+    d = args.delta_dir
+    delta_digest = write_blob(d, delta_data)
+    config_digest = write_blob(d, b"{}")
+    delta_manifest = {
+        "schemaVersion": 2,
+        "mediaType": MANIFEST_MEDIA_TYPE,
+        "config": {
+            "mediaType": CONFIG_MEDIA_TYPE,
+            "digest": config_digest,
+            "size": 2,
+        },
+        "layers": [
+            {
+                "mediaType": DELTA_LAYER_MEDIA_TYPE,
+                "digest": delta_digest,
+                "size": len(delta_data),
+                "annotations": {
+                    "io.github.containers.delta.from": old.config["rootfs"]["diff_ids"][-1],
+                    "io.github.containers.delta.to": new.config["rootfs"]["diff_ids"][-1],
+                },
+            }
+        ],
+        "annotations": {"io.github.containers.delta.target": new.manifest_digest},
+    }
+    manifest_digest, manifest_size = write_json_blob(d, delta_manifest)
+
+    index = {
+        "schemaVersion": 2,
+        "mediaType": INDEX_MEDIA_TYPE,
+        "manifests": [
+            {
+                "mediaType": MANIFEST_MEDIA_TYPE,
+                "digest": manifest_digest,
+                "size": manifest_size,
+                "annotations": {"io.github.containers.delta.target": new.manifest_digest},
+            }
+        ],
+    }
+    with open(os.path.join(d, "index.json"), "w") as f:
+        json.dump(index, f, indent=4)
+
+    print(delta_digest)
+
+
+def layers_size(args):
+    image = Image(args.image)
+    print(sum(layer["size"] for layer in image.manifest["layers"]))
+
+
+parser = argparse.ArgumentParser()
+subparsers = parser.add_subparsers()
+subparsers.required = True
+
+split_parser = subparsers.add_parser("split-layers")
+split_parser.add_argument("image")
+split_parser.add_argument("n_layers", type=int)
+split_parser.set_defaults(func=split_layers)
+
+delta_parser = subparsers.add_parser("make-delta")
+delta_parser.add_argument("old_image")
+delta_parser.add_argument("new_image")
+delta_parser.add_argument("delta_dir")
+delta_parser.set_defaults(func=make_delta)
+
+size_parser = subparsers.add_parser("layers-size")
+size_parser.add_argument("image")
+size_parser.set_defaults(func=layers_size)
+
+args = parser.parse_args()
+args.func(args)
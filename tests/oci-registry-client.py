@@ -82,6 +82,19 @@ def run_delete_sig(args):
         sys.exit(1)
 
 
+def run_add_delta(args):
+    params = {"d": args.delta_dir}
+    query = urllib.parse.urlencode(params)
+    conn = get_conn(args)
+    path = "/testing-delta/{repo}?{query}".format(repo=args.repo, query=query)
+    conn.request("POST", path)
+    response = conn.getresponse()
+    if response.status != 200:
+        print(response.read(), file=sys.stderr)
+        print("Failed: status={}".format(response.status), file=sys.stderr)
+        sys.exit(1)
+
+
 def run_configure_auth(args):
     params = {"token": args.token}
     query = urllib.parse.urlencode(params)
@@ -127,6 +140,11 @@ delete_sig_parser.add_argument("repo")
 delete_sig_parser.add_argument("digest")
 delete_sig_parser.set_defaults(func=run_delete_sig)
 
+add_delta_parser = subparsers.add_parser("add-delta")
+add_delta_parser.add_argument("repo")
+add_delta_parser.add_argument("delta_dir")
+add_delta_parser.set_defaults(func=run_add_delta)
+
 configure_auth_parser = subparsers.add_parser("configure-auth")
 configure_auth_parser.add_argument("--token", required=True)
 configure_auth_parser.set_defaults(func=run_configure_auth)
@@ -17,6 +17,10 @@ signatures = {}
 
 required_token = None
 
+# Network conditions to simulate, see --latency and --bandwidth
+latency = 0.0
+bandwidth = 0
+
 
 def get_index():
     results = []
@@ -92,7 +96,22 @@ class RequestHandler(http_server.BaseHTTPRequestHandler):
             return False
         return auth_header[len("Bearer "):] == required_token
 
+    def write_shaped(self, data):
+        """Write data to the client, at most bandwidth bytes per second."""
+        if bandwidth <= 0:
+            self.wfile.write(data)
+            return
+
+        chunk_size = 16 * 1024
+        for i in range(0, len(data), chunk_size):
+            chunk = data[i : i + chunk_size]
+            self.wfile.write(chunk)
+            time.sleep(len(chunk) / bandwidth)
+
     def do_GET(self):
+        if latency > 0:
+            time.sleep(latency)
+
         response = 404
         response_string = b""
         response_content_type = "application/octet-stream"
@@ -164,7 +183,7 @@ class RequestHandler(http_server.BaseHTTPRequestHandler):
 
         self.end_headers()
 
-        self.wfile.write(response_string)
+        self.write_shaped(response_string)
 
     def do_HEAD(self):
         return self.do_GET()
@@ -255,6 +274,30 @@ class RequestHandler(http_server.BaseHTTPRequestHandler):
             sigs.append(signature_bytes)
             self.send_response(200)
             self.end_headers()
+        elif self.check_route("/testing-delta/@repo_name"):
+            repo_name = self.matches["repo_name"]
+            d = self.query["d"][0]
+
+            repo = repositories.setdefault(repo_name, {})
+            blobs = repo.setdefault("blobs", {})
+            manifests = repo.setdefault("manifests", {})
+
+            # The delta index, and the delta manifests it points to
+            index_path = os.path.join(d, "index.json")
+            manifests["_deltaindex"] = index_path
+
+            with open(index_path) as f:
+                index = json.load(f)
+
+            for dig in os.listdir(os.path.join(d, "blobs", "sha256")):
+                blobs["sha256:" + dig] = os.path.join(d, "blobs", "sha256", dig)
+
+            for m in index["manifests"]:
+                manifests[m["digest"]] = blobs[m["digest"]]
+
+            self.send_response(200)
+            self.end_headers()
+            return
         elif self.check_route("/testing-auth/configure"):
             global required_token
             required_token = self.query.get("token", [None])[0]
@@ -310,8 +353,14 @@ class RequestHandler(http_server.BaseHTTPRequestHandler):
 
 
 def run(args):
+    global latency, bandwidth
+    latency = args.latency / 1000
+    bandwidth = args.bandwidth * 1024
+
     RequestHandler.protocol_version = "HTTP/1.0"
-    httpd = http_server.HTTPServer(("127.0.0.1", 0), RequestHandler)
+    # Threaded, so that concurrent layer downloads are served concurrently
+    httpd = http_server.ThreadingHTTPServer(("127.0.0.1", 0), RequestHandler)
+    httpd.daemon_threads = True
 
     if args.cert:
         context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
@@ -347,6 +396,18 @@ if __name__ == "__main__":
     parser.add_argument("--cert")
     parser.add_argument("--key")
     parser.add_argument("--mtls-cacert")
+    parser.add_argument(
+        "--latency",
+        type=float,
+        default=0,
+        help="Delay every GET request by this many milliseconds",
+    )
+    parser.add_argument(
+        "--bandwidth",
+        type=int,
+        default=0,
+        help="Limit each response to this many KiB per second",
+    )
     args = parser.parse_args()
 
     run(args)
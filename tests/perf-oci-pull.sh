@@ -0,0 +1,170 @@
+#!/bin/bash
+#
+# Copyright © 2025 Red Hat, Inc
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+# Measures the throughput of pulling from an OCI registry, with images
+# split into many layers, with a delta and with an authenticated
+# registry. This is not run by default, use
+# "meson test --benchmark --suite perf".
+#
+# The network can be shaped with $FLATPAK_PERF_LATENCY_MS (added to
+# every request) and $FLATPAK_PERF_BANDWIDTH_KIB (per connection, in
+# KiB/s), and the number of layers is set with $FLATPAK_PERF_LAYERS.
+# Each measurement is reported as a JSON object on one line, and
+# appended to $FLATPAK_PERF_RESULTS if that is set.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_bwrap
+
+LATENCY=${FLATPAK_PERF_LATENCY_MS:-0}
+BANDWIDTH=${FLATPAK_PERF_BANDWIDTH_KIB:-0}
+LAYERS=${FLATPAK_PERF_LAYERS:-16}
+export LATENCY BANDWIDTH
+
+image_tool="python3 $test_srcdir/oci-perf-image.py"
+
+echo "1..4"
+
+httpd oci-registry-server.py --dir=. --latency=${LATENCY} --bandwidth=${BANDWIDTH}
+port=$(cat httpd-port)
+client="python3 $test_srcdir/oci-registry-client.py --url=http://127.0.0.1:${port}"
+
+setup_repo_no_add oci
+
+${FLATPAK} remote-add ${U} oci-registry "oci+http://127.0.0.1:${port}" >&2
+
+now_usec () {
+    echo $(( $(date +%s%N) / 1000 ))
+}
+
+# Usage: report PHASE START_USEC END_USEC BYTES [EXTRA_JSON]
+report () {
+    python3 - "$@" <<'EOF' | tee -a perf-results.json | sed 's/^/# /'
+import json
+import os
+import sys
+
+phase, start, end, size = sys.argv[1], int(sys.argv[2]), int(sys.argv[3]), int(sys.argv[4])
+seconds = (end - start) / 1000000
+result = {
+    "test": "oci-pull",
+    "phase": phase,
+    "seconds": seconds,
+    "bytes": size,
+    "mib_per_sec": size / (1024 * 1024) / seconds,
+    "latency_ms": float(os.environ["LATENCY"]),
+    "bandwidth_kib": int(os.environ["BANDWIDTH"]),
+}
+if len(sys.argv) > 5:
+    result.update(json.loads(sys.argv[5]))
+print(json.dumps(result))
+EOF
+}
+
+build_images () {
+    ${FLATPAK} build-bundle --runtime --oci $FL_GPGARGS repos/oci oci/platform-image org.test.Platform >&2
+    ${FLATPAK} build-bundle --oci $FL_GPGARGS repos/oci oci/app-image org.test.Hello >&2
+}
+
+add_images () {
+    $client add platform latest $(pwd)/oci/platform-image
+    $client add hello latest $(pwd)/oci/app-image
+}
+
+images_size () {
+    echo $(( $($image_tool layers-size oci/platform-image) + $($image_tool layers-size oci/app-image) ))
+}
+
+# Usage: timed_install PHASE REMOTE
+timed_install () {
+    local start end
+
+    start=$(now_usec)
+    ${FLATPAK} ${U} install -y $2 org.test.Hello >&2
+    end=$(now_usec)
+    report $1 $start $end $(images_size)
+
+    run org.test.Hello > hello_out
+    assert_file_has_content hello_out '^Hello world, from a sandbox$'
+}
+
+# Many layers, which are fetched concurrently
+
+rm -rf oci/platform-image oci/app-image
+build_images
+$image_tool split-layers oci/platform-image ${LAYERS}
+$image_tool split-layers oci/app-image ${LAYERS}
+add_images
+
+timed_install install-${LAYERS}-layers oci-registry
+${FLATPAK} ${U} uninstall -y --all >&2
+
+ok "install with ${LAYERS} layers"
+
+# The same images with a single layer, for comparison
+
+rm -rf oci/platform-image oci/app-image
+build_images
+add_images
+
+timed_install install-1-layer oci-registry
+
+ok "install with 1 layer"
+
+# Update the runtime with a delta against the installed version. Only
+# the changed files are in the delta, the rest is copied from the
+# deployed runtime.
+
+if ! command -v zstd > /dev/null; then
+    ok "update with delta # SKIP zstd not found"
+else
+    rm -rf oci/platform-image-old oci/platform-delta
+    mv oci/platform-image oci/platform-image-old
+    make_updated_runtime oci
+    ${FLATPAK} build-bundle --runtime --oci $FL_GPGARGS repos/oci oci/platform-image org.test.Platform >&2
+    delta_digest=$($image_tool make-delta oci/platform-image-old oci/platform-image oci/platform-delta)
+    delta_size=$(stat -c %s oci/platform-delta/blobs/sha256/${delta_digest#sha256:})
+    $client add platform latest $(pwd)/oci/platform-image
+    $client add-delta platform $(pwd)/oci/platform-delta
+
+    httpd_clear_log
+    start=$(now_usec)
+    ${FLATPAK} ${U} update -y org.test.Platform >&2
+    end=$(now_usec)
+
+    # The delta is only used if flatpak was built with zstd
+    if grep -q "${delta_digest}" httpd-log; then
+        delta_used=true
+    else
+        delta_used=false
+    fi
+    report update-delta $start $end ${delta_size} \
+        "{\"full_bytes\": $($image_tool layers-size oci/platform-image), \"delta_used\": ${delta_used}}"
+
+    run org.test.Hello > hello_out
+    assert_file_has_content hello_out '^Hello world, from a sandbox$'
+
+    ok "update with delta"
+fi
+
+# Authenticated registry, where every request needs a token from the
+# authenticator
+
+${FLATPAK} ${U} uninstall -y --all >&2
+${FLATPAK} remote-add ${U} oci-auth-registry "oci+http://127.0.0.1:${port}" \
+    --authenticator-name org.flatpak.Authenticator.test >&2
+
+echo -n "perf-token" > "${XDG_RUNTIME_DIR}/required-token"
+$client configure-auth --token perf-token
+
+timed_install install-auth oci-auth-registry
+
+ok "install with auth token"
+
+if [ -n "${FLATPAK_PERF_RESULTS:-}" ]; then
+    cat perf-results.json >> "${FLATPAK_PERF_RESULTS}"
+fi
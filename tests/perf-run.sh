@@ -0,0 +1,109 @@
+#!/bin/bash
+#
+# Copyright © 2025 Red Hat, Inc
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+# Measures the latency of flatpak run, using the startup profile (see
+# --profile-startup). This is not run by default, use
+# "meson test --benchmark --suite perf".
+#
+# Every variant launches the test app $FLATPAK_PERF_RUNS times and
+# reports the 50th, 90th and 99th percentile of each phase, and of the
+# total, as one JSON object per line. The results are also appended to
+# $FLATPAK_PERF_RESULTS if that is set.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_without_bwrap
+skip_revokefs_without_fuse
+
+RUNS=${FLATPAK_PERF_RUNS:-20}
+
+echo "1..4"
+
+setup_repo
+install_repo
+
+# A context with many permissions, to see how the size of the context
+# affects the launch
+LARGE_CONTEXT=()
+for i in $(seq 1 100); do
+    LARGE_CONTEXT+=(--env=PERF_VAR_${i}=value-${i}
+                    --filesystem=/tmp/perf-${i}:ro
+                    --talk-name=org.test.Perf${i}
+                    --own-name=org.test.Hello.Perf${i})
+done
+
+LD_SO_DIR=${HOME}/.var/app/org.test.Hello/.ld.so
+
+# Usage: run_variant NAME COLD_LD_CACHE [FLATPAK RUN OPTIONS...]
+run_variant () {
+    local name=$1
+    local cold=$2
+    shift 2
+
+    rm -f profiles.json
+    for i in $(seq 1 ${RUNS}); do
+        if [ "$cold" = "cold" ]; then
+            rm -rf "${LD_SO_DIR}"
+        fi
+
+        FLATPAK_PROFILE_STARTUP=$(pwd)/profile.json \
+            ${FLATPAK} run "$@" org.test.Hello > hello_out
+        assert_file_has_content hello_out '^Hello world, from a sandbox$'
+        cat profile.json >> profiles.json
+    done
+
+    python3 - "$name" profiles.json <<'EOF' | tee -a perf-results.json | sed 's/^/# /'
+import json
+import sys
+
+name = sys.argv[1]
+phases = {}
+order = []
+
+with open(sys.argv[2]) as f:
+    for line in f:
+        profile = json.loads(line)
+        for phase in profile["phases"]:
+            if phase["phase"] not in phases:
+                phases[phase["phase"]] = []
+                order.append(phase["phase"])
+            phases[phase["phase"]].append(phase["duration_usec"])
+        phases.setdefault("total", []).append(profile["total_usec"])
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+for phase in order + ["total"]:
+    values = phases[phase]
+    print(json.dumps({
+        "test": "run",
+        "variant": name,
+        "phase": phase,
+        "runs": len(values),
+        "p50_usec": percentile(values, 50),
+        "p90_usec": percentile(values, 90),
+        "p99_usec": percentile(values, 99),
+    }))
+EOF
+}
+
+run_variant warm-ld-cache warm
+ok "warm ld.so cache"
+
+run_variant cold-ld-cache cold
+ok "cold ld.so cache"
+
+run_variant no-dbus-proxy warm --no-session-bus --no-a11y-bus
+ok "no D-Bus proxy"
+
+run_variant large-context warm "${LARGE_CONTEXT[@]}"
+ok "large context"
+
+if [ -n "${FLATPAK_PERF_RESULTS:-}" ]; then
+    cat perf-results.json >> "${FLATPAK_PERF_RESULTS}"
+fi
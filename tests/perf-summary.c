@@ -0,0 +1,399 @@
+/*
+ * Copyright © 2025 Red Hat, Inc
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* Times the summary parsing and ref lookups against a repo with as many
+ * refs as a large remote such as Flathub. This is not run by default,
+ * use "meson test --benchmark --suite perf".
+ *
+ * The number of refs can be set with $FLATPAK_PERF_REFS. To keep the
+ * setup fast all the refs point to the same few commits, which makes
+ * no difference to the summary code. Each timed phase is reported as a
+ * JSON object on one line, in the test log and appended to
+ * $FLATPAK_PERF_RESULTS if that is set. */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include "libglnx.h"
+#include "flatpak.h"
+#include "flatpak-dir-private.h"
+#include "flatpak-ref-utils-private.h"
+#include "flatpak-repo-utils-private.h"
+
+#include "tests/testlib.h"
+
+/* One in this many refs changes between the two versions of the repo */
+#define PERF_UPDATE_RATIO 100
+
+/* How often the whole-summary operations are repeated */
+#define PERF_SUMMARY_ITERATIONS 10
+
+static guint n_refs;
+static char *repo_dir;
+static GPtrArray *refs;
+static OstreeRepo *repo;
+static char *old_digest;
+static char *new_digest;
+
+static guint
+get_size_from_env (const char *name,
+                   guint       default_value)
+{
+  const char *value = g_getenv (name);
+
+  if (value == NULL || *value == 0)
+    return default_value;
+
+  return (guint) g_ascii_strtoull (value, NULL, 10);
+}
+
+static void
+report (const char *phase,
+        guint       calls,
+        gint64      usec)
+{
+  g_autofree char *line = NULL;
+  const char *results_path = g_getenv ("FLATPAK_PERF_RESULTS");
+  double seconds = (double) usec / G_USEC_PER_SEC;
+
+  line = g_strdup_printf ("{\"test\": \"summary\", \"phase\": \"%s\", \"seconds\": %.6f, "
+                          "\"calls\": %u, \"usec_per_call\": %.3f, \"refs\": %u}",
+                          phase, seconds, calls, (double) usec / calls, n_refs);
+  g_test_message ("%s", line);
+  g_test_minimized_result (seconds, "summary %s", phase);
+
+  if (results_path != NULL && *results_path != 0)
+    {
+      g_autoptr(GFile) file = g_file_new_for_path (results_path);
+      g_autoptr(GFileOutputStream) out = NULL;
+      g_autoptr(GError) error = NULL;
+      g_autofree char *data = g_strconcat (line, "\n", NULL);
+
+      out = g_file_append_to (file, G_FILE_CREATE_NONE, NULL, &error);
+      g_assert_no_error (error);
+      g_output_stream_write_all (G_OUTPUT_STREAM (out), data, strlen (data), NULL, NULL, &error);
+      g_assert_no_error (error);
+    }
+}
+
+static char *
+write_commit (const char *subject)
+{
+  g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  g_autoptr(GFileInfo) info = g_file_info_new ();
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *dirmeta_csum = NULL;
+  g_autofree char *dirmeta_checksum = NULL;
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GVariantDict) metadata = g_variant_dict_new (NULL);
+  g_autoptr(GError) error = NULL;
+  char *commit = NULL;
+
+  g_file_info_set_attribute_uint32 (info, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (info, "unix::gid", 0);
+  g_file_info_set_attribute_uint32 (info, "unix::mode", 040755);
+  dirmeta = ostree_create_directory_metadata (info, NULL);
+
+  ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, dirmeta,
+                              &dirmeta_csum, NULL, &error);
+  g_assert_no_error (error);
+  dirmeta_checksum = ostree_checksum_from_bytes (dirmeta_csum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_checksum);
+
+  ostree_repo_write_mtree (repo, mtree, &root, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Recording the sizes saves flatpak_repo_update() from walking the tree */
+  g_variant_dict_insert (metadata, "xa.metadata", "s",
+                         "[Application]\nname=org.perf.App\n");
+  g_variant_dict_insert_value (metadata, "xa.installed-size", g_variant_new_uint64 (GUINT64_TO_BE (4096)));
+  g_variant_dict_insert_value (metadata, "xa.download-size", g_variant_new_uint64 (GUINT64_TO_BE (1024)));
+
+  ostree_repo_write_commit (repo, NULL, subject, NULL, g_variant_dict_end (metadata),
+                            OSTREE_REPO_FILE (root), &commit, NULL, &error);
+  g_assert_no_error (error);
+
+  return commit;
+}
+
+/* Points every @ratio'th ref at a new commit and regenerates the summary */
+static void
+update_repo (guint ratio)
+{
+  g_autofree char *commit = NULL;
+  g_autofree char *subject = g_strdup_printf ("Update 1/%u", ratio);
+  g_autoptr(GError) error = NULL;
+  gint64 start = g_get_monotonic_time ();
+
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  commit = write_commit (subject);
+
+  for (guint i = 0; i < refs->len; i += ratio)
+    ostree_repo_transaction_set_ref (repo, NULL, g_ptr_array_index (refs, i), commit);
+
+  ostree_repo_commit_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  flatpak_repo_update (repo, FLATPAK_REPO_UPDATE_FLAG_NONE, NULL, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Updated %u refs in %.3f s", (refs->len + ratio - 1) / ratio,
+                  (double) (g_get_monotonic_time () - start) / G_USEC_PER_SEC);
+}
+
+/* The repo has a single subsummary, so the one delta in it goes from
+ * the old version of that to the new one */
+static void
+find_subsummary_delta (void)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  g_autoptr(GError) error = NULL;
+  struct dirent *dent;
+
+  glnx_dirfd_iterator_init_at (ostree_repo_get_dfd (repo), "summaries", FALSE, &iter, &error);
+  g_assert_no_error (error);
+
+  while (glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, &error) && dent != NULL)
+    {
+      if (g_str_has_suffix (dent->d_name, ".delta") &&
+          strlen (dent->d_name) == 64 + 1 + 64 + strlen (".delta"))
+        {
+          old_digest = g_strndup (dent->d_name, 64);
+          new_digest = g_strndup (dent->d_name + 65, 64);
+          break;
+        }
+    }
+  g_assert_no_error (error);
+
+  g_assert_nonnull (old_digest);
+  g_assert_nonnull (new_digest);
+}
+
+static void
+test_perf_load_digested_summary (void)
+{
+  g_autoptr(GError) error = NULL;
+  gint64 start = g_get_monotonic_time ();
+
+  for (guint i = 0; i < PERF_SUMMARY_ITERATIONS; i++)
+    {
+      g_autoptr(GVariant) summary = flatpak_repo_load_digested_summary (repo, new_digest, &error);
+
+      g_assert_no_error (error);
+      g_assert_nonnull (summary);
+    }
+
+  report ("load-digested-summary", PERF_SUMMARY_ITERATIONS, g_get_monotonic_time () - start);
+}
+
+static void
+test_perf_apply_diff (void)
+{
+  g_autoptr(GVariant) old_summary = NULL;
+  g_autoptr(GVariant) new_summary = NULL;
+  g_autoptr(GBytes) old_bytes = NULL;
+  g_autoptr(GBytes) diff = NULL;
+  g_autofree char *diff_path = NULL;
+  g_autofree char *diff_contents = NULL;
+  gsize diff_size;
+  g_autoptr(GError) error = NULL;
+  gint64 start;
+
+  old_summary = flatpak_repo_load_digested_summary (repo, old_digest, &error);
+  g_assert_no_error (error);
+  new_summary = flatpak_repo_load_digested_summary (repo, new_digest, &error);
+  g_assert_no_error (error);
+  old_bytes = g_variant_get_data_as_bytes (old_summary);
+
+  diff_path = g_strdup_printf ("%s/summaries/%s-%s.delta", repo_dir, old_digest, new_digest);
+  g_file_get_contents (diff_path, &diff_contents, &diff_size, &error);
+  g_assert_no_error (error);
+  diff = g_bytes_new_take (g_steal_pointer (&diff_contents), diff_size);
+
+  g_test_message ("Applying a %" G_GSIZE_FORMAT " byte diff to a %" G_GSIZE_FORMAT " byte summary",
+                  diff_size, g_bytes_get_size (old_bytes));
+
+  start = g_get_monotonic_time ();
+
+  for (guint i = 0; i < PERF_SUMMARY_ITERATIONS; i++)
+    {
+      g_autoptr(GBytes) applied = flatpak_summary_apply_diff (old_bytes, diff, &error);
+
+      g_assert_no_error (error);
+      g_assert_cmpuint (g_bytes_get_size (applied), ==, g_variant_get_size (new_summary));
+    }
+
+  report ("apply-diff", PERF_SUMMARY_ITERATIONS, g_get_monotonic_time () - start);
+}
+
+static void
+test_perf_lookup_ref (void)
+{
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GPtrArray) missing = g_ptr_array_new_full (refs->len, g_free);
+  g_autoptr(GError) error = NULL;
+  gint64 start;
+
+  summary = flatpak_repo_load_digested_summary (repo, new_digest, &error);
+  g_assert_no_error (error);
+
+  for (guint i = 0; i < refs->len; i++)
+    g_ptr_array_add (missing, g_strconcat (g_ptr_array_index (refs, i), ".Missing", NULL));
+
+  start = g_get_monotonic_time ();
+  for (guint i = 0; i < refs->len; i++)
+    {
+      g_autofree char *checksum = NULL;
+
+      g_assert_true (flatpak_summary_lookup_ref (summary, NULL, g_ptr_array_index (refs, i),
+                                                 &checksum, NULL));
+    }
+  report ("lookup-ref", refs->len, g_get_monotonic_time () - start);
+
+  /* Lookups for refs that are not in the summary, such as when
+   * resolving which remote has a ref */
+  start = g_get_monotonic_time ();
+  for (guint i = 0; i < missing->len; i++)
+    g_assert_false (flatpak_summary_lookup_ref (summary, NULL, g_ptr_array_index (missing, i), NULL, NULL));
+  report ("lookup-ref-missing", missing->len, g_get_monotonic_time () - start);
+}
+
+static void
+test_perf_lookup_cache (void)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_dir_get_user ();
+  g_autoptr(FlatpakRemoteState) state = NULL;
+  g_autofree char *url = g_strconcat ("file://", repo_dir, NULL);
+  g_autoptr(GError) error = NULL;
+  gint64 start;
+
+  state = flatpak_dir_get_remote_state (dir, url, FALSE, NULL, &error);
+  g_assert_no_error (error);
+
+  /* The first lookup of a ref decodes its entry, later ones hit the
+   * decoded cache */
+  for (guint pass = 0; pass < 2; pass++)
+    {
+      start = g_get_monotonic_time ();
+      for (guint i = 0; i < refs->len; i++)
+        {
+          guint64 installed_size;
+
+          flatpak_remote_state_lookup_cache (state, g_ptr_array_index (refs, i),
+                                             NULL, &installed_size, NULL, &error);
+          g_assert_no_error (error);
+          g_assert_cmpuint (installed_size, ==, 4096);
+        }
+      report (pass == 0 ? "lookup-cache" : "lookup-cache-again", refs->len,
+              g_get_monotonic_time () - start);
+    }
+}
+
+static void
+test_perf_decomposed_new_from_ref (void)
+{
+  g_autoptr(GPtrArray) decomposed = g_ptr_array_new_full (refs->len, (GDestroyNotify) flatpak_decomposed_unref);
+  gint64 start = g_get_monotonic_time ();
+
+  for (guint i = 0; i < refs->len; i++)
+    {
+      g_autoptr(GError) error = NULL;
+      FlatpakDecomposed *d = flatpak_decomposed_new_from_ref (g_ptr_array_index (refs, i), &error);
+
+      g_assert_no_error (error);
+      g_ptr_array_add (decomposed, d);
+    }
+
+  report ("decomposed-new-from-ref", refs->len, g_get_monotonic_time () - start);
+}
+
+static void
+global_setup (void)
+{
+  g_autoptr(GFile) repo_file = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *commit = NULL;
+  const char *arch = flatpak_get_default_arch ();
+  gint64 start;
+
+  n_refs = get_size_from_env ("FLATPAK_PERF_REFS", 50000);
+
+  isolated_test_dir_global_setup ();
+
+  /* Mostly apps, with a runtime, locale and debug extension for every
+   * tenth one, which is roughly the mix on Flathub */
+  refs = g_ptr_array_new_full (n_refs, g_free);
+  for (guint i = 0; refs->len < n_refs; i++)
+    {
+      const char *kinds[] = {
+        "app/org.perf.App%u/%s/stable",
+        "runtime/org.perf.Platform%u/%s/stable",
+        "runtime/org.perf.Platform%u.Locale/%s/stable",
+        "runtime/org.perf.Platform%u.Debug/%s/stable",
+      };
+
+      g_ptr_array_add (refs, g_strdup_printf (kinds[0], i, arch));
+      for (guint j = 1; i % 10 == 0 && j < G_N_ELEMENTS (kinds) && refs->len < n_refs; j++)
+        g_ptr_array_add (refs, g_strdup_printf (kinds[j], i, arch));
+    }
+
+  repo_dir = g_build_filename (isolated_test_dir, "repos", "perf-summary", NULL);
+  g_assert_no_errno (g_mkdir_with_parents (repo_dir, 0755));
+  repo_file = g_file_new_for_path (repo_dir);
+  repo = ostree_repo_new (repo_file);
+  ostree_repo_create (repo, OSTREE_REPO_MODE_ARCHIVE, NULL, &error);
+  g_assert_no_error (error);
+
+  start = g_get_monotonic_time ();
+
+  /* The first version of the repo, with all the refs */
+  update_repo (1);
+
+  /* And a second one, with some of them updated, which gives a
+   * delta between the two subsummaries */
+  update_repo (PERF_UPDATE_RATIO);
+
+  g_test_message ("Created a repo with %u refs in %.3f s", refs->len,
+                  (double) (g_get_monotonic_time () - start) / G_USEC_PER_SEC);
+
+  find_subsummary_delta ();
+}
+
+static void
+global_teardown (void)
+{
+  g_clear_object (&repo);
+  g_clear_pointer (&refs, g_ptr_array_unref);
+  g_free (old_digest);
+  g_free (new_digest);
+  g_free (repo_dir);
+  isolated_test_dir_global_teardown ();
+}
+
+int
+main (int argc, char *argv[])
+{
+  int res;
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/perf/summary/load-digested-summary", test_perf_load_digested_summary);
+  g_test_add_func ("/perf/summary/apply-diff", test_perf_apply_diff);
+  g_test_add_func ("/perf/summary/lookup-ref", test_perf_lookup_ref);
+  g_test_add_func ("/perf/summary/lookup-cache", test_perf_lookup_cache);
+  g_test_add_func ("/perf/summary/decomposed-new-from-ref", test_perf_decomposed_new_from_ref);
+
+  global_setup ();
+
+  res = g_test_run ();
+
+  global_teardown ();
+
+  return res;
+}
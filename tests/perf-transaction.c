@@ -0,0 +1,338 @@
+/*
+ * Copyright © 2025 Red Hat, Inc
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/* Times the phases of installing, updating and uninstalling from a
+ * synthetic repo (see make-perf-repo.sh). This is not run by default,
+ * use "meson test --benchmark --suite perf".
+ *
+ * The size of the repo can be set with $FLATPAK_PERF_APPS,
+ * $FLATPAK_PERF_FILES and $FLATPAK_PERF_LOCALES. Each timed phase is
+ * reported as a JSON object on one line, in the test log and appended
+ * to $FLATPAK_PERF_RESULTS if that is set. */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+#include "libglnx.h"
+#include "flatpak.h"
+
+#include "tests/testlib.h"
+
+#define PERF_REMOTE "perf-repo"
+#define PERF_BRANCH "stable"
+
+static guint n_apps;
+static guint n_files;
+static guint n_locales;
+static char *repo_dir;
+
+typedef struct
+{
+  gint64 start;
+  gint64 ready;
+  gint64 last_op_done;
+  gint64 end;
+} PhaseTimes;
+
+static guint
+get_size_from_env (const char *name,
+                   guint       default_value)
+{
+  const char *value = g_getenv (name);
+
+  if (value == NULL || *value == 0)
+    return default_value;
+
+  return (guint) g_ascii_strtoull (value, NULL, 10);
+}
+
+static void
+report (const char *test,
+        const char *phase,
+        gint64      usec)
+{
+  g_autofree char *line = NULL;
+  const char *results_path = g_getenv ("FLATPAK_PERF_RESULTS");
+  double seconds = (double) usec / G_USEC_PER_SEC;
+
+  line = g_strdup_printf ("{\"test\": \"%s\", \"phase\": \"%s\", \"seconds\": %.6f, "
+                          "\"apps\": %u, \"files\": %u, \"locales\": %u}",
+                          test, phase, seconds, n_apps, n_files, n_locales);
+  g_test_message ("%s", line);
+  g_test_minimized_result (seconds, "%s %s", test, phase);
+
+  if (results_path != NULL && *results_path != 0)
+    {
+      g_autoptr(GFile) file = g_file_new_for_path (results_path);
+      g_autoptr(GFileOutputStream) out = NULL;
+      g_autoptr(GError) error = NULL;
+      g_autofree char *data = g_strconcat (line, "\n", NULL);
+
+      out = g_file_append_to (file, G_FILE_CREATE_NONE, NULL, &error);
+      g_assert_no_error (error);
+      g_output_stream_write_all (G_OUTPUT_STREAM (out), data, strlen (data), NULL, NULL, &error);
+      g_assert_no_error (error);
+    }
+}
+
+static void
+run_subprocess (const char * const *argv)
+{
+  g_autoptr(GSubprocess) subprocess = NULL;
+  g_autoptr(GError) error = NULL;
+
+  subprocess = g_subprocess_newv (argv, G_SUBPROCESS_FLAGS_NONE, &error);
+  g_assert_no_error (error);
+
+  g_subprocess_wait_check (subprocess, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+make_perf_repo (void)
+{
+  g_autofree char *script = g_test_build_filename (G_TEST_DIST, "make-perf-repo.sh", NULL);
+  g_autofree char *n_apps_str = g_strdup_printf ("%u", n_apps);
+  g_autofree char *n_files_str = g_strdup_printf ("%u", n_files);
+  g_autofree char *n_locales_str = g_strdup_printf ("%u", n_locales);
+  const char *argv[] = { script, repo_dir, n_apps_str, n_files_str, n_locales_str, NULL };
+  gint64 start = g_get_monotonic_time ();
+
+  run_subprocess (argv);
+
+  g_test_message ("Exported %u apps, %u files and %u locales in %.3f s",
+                  n_apps, n_files, n_locales,
+                  (double) (g_get_monotonic_time () - start) / G_USEC_PER_SEC);
+}
+
+static gboolean
+ready_cb (FlatpakTransaction *transaction,
+          PhaseTimes         *times)
+{
+  times->ready = g_get_monotonic_time ();
+  return TRUE;
+}
+
+static void
+operation_done_cb (FlatpakTransaction          *transaction,
+                   FlatpakTransactionOperation *operation,
+                   const char                  *commit,
+                   FlatpakTransactionResult     result,
+                   PhaseTimes                  *times)
+{
+  times->last_op_done = g_get_monotonic_time ();
+}
+
+static FlatpakTransaction *
+create_transaction (FlatpakInstallation *inst,
+                    PhaseTimes          *times)
+{
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(GError) error = NULL;
+
+  transaction = flatpak_transaction_new_for_installation (inst, NULL, &error);
+  g_assert_no_error (error);
+
+  flatpak_transaction_set_no_interaction (transaction, TRUE);
+
+  g_signal_connect (transaction, "ready", G_CALLBACK (ready_cb), times);
+  g_signal_connect (transaction, "operation-done", G_CALLBACK (operation_done_cb), times);
+
+  return g_steal_pointer (&transaction);
+}
+
+static void
+run_transaction (FlatpakTransaction *transaction,
+                 PhaseTimes         *times)
+{
+  g_autoptr(GError) error = NULL;
+
+  times->start = g_get_monotonic_time ();
+  flatpak_transaction_run (transaction, NULL, &error);
+  g_assert_no_error (error);
+  times->end = g_get_monotonic_time ();
+
+  g_assert_cmpint (times->ready, >=, times->start);
+  g_assert_cmpint (times->last_op_done, >=, times->ready);
+}
+
+static void
+add_installs (FlatpakTransaction *transaction)
+{
+  for (guint i = 1; i <= n_apps; i++)
+    {
+      g_autofree char *ref = g_strdup_printf ("app/org.perf.App%u/%s/" PERF_BRANCH, i,
+                                              flatpak_get_default_arch ());
+      g_autoptr(GError) error = NULL;
+
+      flatpak_transaction_add_install (transaction, PERF_REMOTE, ref, NULL, &error);
+      g_assert_no_error (error);
+    }
+}
+
+static FlatpakInstallation *
+get_installation (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(GError) error = NULL;
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+
+  return g_steal_pointer (&inst);
+}
+
+/* The install is done as a pull-only transaction followed by a
+ * deploy-only one, so that the two can be timed separately. The time
+ * after the last operation is done is mostly spent running the
+ * triggers and updating the exports. */
+static void
+test_perf_install (void)
+{
+  g_autoptr(FlatpakInstallation) inst = get_installation ();
+  g_autoptr(FlatpakTransaction) pull = NULL;
+  g_autoptr(FlatpakTransaction) deploy = NULL;
+  PhaseTimes pull_times = { 0, };
+  PhaseTimes deploy_times = { 0, };
+
+  pull = create_transaction (inst, &pull_times);
+  flatpak_transaction_set_no_deploy (pull, TRUE);
+  add_installs (pull);
+  run_transaction (pull, &pull_times);
+
+  report ("install", "resolve", pull_times.ready - pull_times.start);
+  report ("install", "pull", pull_times.end - pull_times.ready);
+
+  deploy = create_transaction (inst, &deploy_times);
+  flatpak_transaction_set_no_pull (deploy, TRUE);
+  add_installs (deploy);
+  run_transaction (deploy, &deploy_times);
+
+  report ("install", "deploy", deploy_times.last_op_done - deploy_times.ready);
+  report ("install", "triggers", deploy_times.end - deploy_times.last_op_done);
+}
+
+static void
+test_perf_update (void)
+{
+  g_autoptr(FlatpakInstallation) inst = get_installation ();
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(GError) error = NULL;
+  PhaseTimes times = { 0, };
+  g_autofree char *runtime_ref = g_strdup_printf ("runtime/org.perf.Platform/%s/" PERF_BRANCH,
+                                                  flatpak_get_default_arch ());
+
+  /* Exporting everything again gives new commits (with the same
+   * contents) for all the refs */
+  make_perf_repo ();
+
+  transaction = create_transaction (inst, &times);
+  flatpak_transaction_add_update (transaction, runtime_ref, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  for (guint i = 1; i <= n_apps; i++)
+    {
+      g_autofree char *ref = g_strdup_printf ("app/org.perf.App%u/%s/" PERF_BRANCH, i,
+                                              flatpak_get_default_arch ());
+
+      flatpak_transaction_add_update (transaction, ref, NULL, NULL, &error);
+      g_assert_no_error (error);
+    }
+
+  run_transaction (transaction, &times);
+
+  report ("update", "resolve", times.ready - times.start);
+  report ("update", "pull+deploy", times.last_op_done - times.ready);
+  report ("update", "triggers", times.end - times.last_op_done);
+}
+
+static void
+test_perf_uninstall (void)
+{
+  g_autoptr(FlatpakInstallation) inst = get_installation ();
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  PhaseTimes times = { 0, };
+
+  transaction = create_transaction (inst, &times);
+
+  for (guint i = 1; i <= n_apps; i++)
+    {
+      g_autofree char *ref = g_strdup_printf ("app/org.perf.App%u/%s/" PERF_BRANCH, i,
+                                              flatpak_get_default_arch ());
+      g_autoptr(GError) error = NULL;
+
+      flatpak_transaction_add_uninstall (transaction, ref, &error);
+      g_assert_no_error (error);
+    }
+
+  run_transaction (transaction, &times);
+
+  report ("uninstall", "resolve", times.ready - times.start);
+  report ("uninstall", "undeploy", times.last_op_done - times.ready);
+  report ("uninstall", "triggers", times.end - times.last_op_done);
+}
+
+static void
+global_setup (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(FlatpakRemote) remote = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) repo_file = NULL;
+  g_autofree char *repo_url = NULL;
+
+  n_apps = get_size_from_env ("FLATPAK_PERF_APPS", 20);
+  n_files = get_size_from_env ("FLATPAK_PERF_FILES", 5000);
+  n_locales = get_size_from_env ("FLATPAK_PERF_LOCALES", 50);
+
+  isolated_test_dir_global_setup ();
+
+  repo_dir = g_build_filename (isolated_test_dir, "repos", "perf", NULL);
+  make_perf_repo ();
+
+  inst = get_installation ();
+
+  /* Pull all the locales */
+  flatpak_installation_set_config_sync (inst, "languages", "*", NULL, &error);
+  g_assert_no_error (error);
+
+  repo_file = g_file_new_for_path (repo_dir);
+  repo_url = g_file_get_uri (repo_file);
+
+  remote = flatpak_remote_new (PERF_REMOTE);
+  flatpak_remote_set_url (remote, repo_url);
+  flatpak_remote_set_gpg_verify (remote, FALSE);
+  flatpak_installation_add_remote (inst, remote, FALSE, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+global_teardown (void)
+{
+  g_free (repo_dir);
+  isolated_test_dir_global_teardown ();
+}
+
+int
+main (int argc, char *argv[])
+{
+  int res;
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/perf/install", test_perf_install);
+  g_test_add_func ("/perf/update", test_perf_update);
+  g_test_add_func ("/perf/uninstall", test_perf_uninstall);
+
+  global_setup ();
+
+  res = g_test_run ();
+
+  global_teardown ();
+
+  return res;
+}
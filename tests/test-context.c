@@ -162,6 +162,184 @@ context_parse_args (FlatpakContext *context,
   g_option_context_parse_strv (oc, &argv, error);
 }
 
+
+static GPtrArray *
+context_to_sorted_args (FlatpakContext *context)
+{
+  GPtrArray *args = g_ptr_array_new_with_free_func (g_free);
+
+  flatpak_context_to_args (context, args);
+  g_ptr_array_sort (args, flatpak_strcmp0_ptr);
+
+  return args;
+}
+
+static void
+test_context_serialize (void)
+{
+  static const char metadata[] =
+    "[Context]\n"
+    "shared=network;!ipc;\n"
+    "sockets=!x11;wayland;if:pulseaudio:has-wayland;\n"
+    "devices=dri;\n"
+    "features=devel;\n"
+    "filesystems=host-reset;xdg-download:ro;~/foo:create;\n"
+    "persistent=.foo;\n"
+    "unset-environment=UNSET;\n"
+    "\n"
+    "[Environment]\n"
+    "ONE=one\n"
+    "EMPTY=\n"
+    "\n"
+    "[Resources]\n"
+    "cpu-weight=50\n"
+    "memory-high=2G\n"
+    "\n"
+    "[Session Bus Policy]\n"
+    "org.example.Own=own\n"
+    "org.example.None=none\n"
+    "\n"
+    "[System Bus Policy]\n"
+    "org.example.Talk=talk\n"
+    "\n"
+    "[Policy subsystem]\n"
+    "key=value;!other;\n"
+    "\n"
+    "[USB Devices]\n"
+    "enumerable-devices=vnd:0fd9+dev:0063;cls:03:*;\n"
+    "hidden-devices=vnd:0fd9;\n";
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr(FlatpakContext) context = flatpak_context_new ();
+  g_autoptr(FlatpakContext) copy = NULL;
+  g_autoptr(GVariant) serialized = NULL;
+  g_autoptr(GVariant) reserialized = NULL;
+  g_autoptr(GVariant) bad_version = NULL;
+  g_autoptr(GPtrArray) args = NULL;
+  g_autoptr(GPtrArray) copy_args = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean ok;
+  guint i;
+
+  ok = g_key_file_load_from_data (keyfile, metadata, -1, G_KEY_FILE_NONE, &error);
+  g_assert_no_error (error);
+  g_assert_true (ok);
+  ok = flatpak_context_load_metadata (context, keyfile, &error);
+  g_assert_no_error (error);
+  g_assert_true (ok);
+
+  serialized = flatpak_context_serialize (context);
+  g_assert_true (g_variant_is_of_type (serialized, G_VARIANT_TYPE ("(ua{sv})")));
+
+  /* Go through the raw bytes, as the launch plan cache does */
+  reserialized = g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE ("(ua{sv})"),
+                                                              g_variant_get_data (serialized),
+                                                              g_variant_get_size (serialized),
+                                                              FALSE, NULL, NULL));
+  copy = flatpak_context_deserialize (reserialized, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (copy);
+
+  args = context_to_sorted_args (context);
+  copy_args = context_to_sorted_args (copy);
+  g_assert_cmpuint (copy_args->len, ==, args->len);
+  for (i = 0; i < args->len; i++)
+    g_assert_cmpstr (copy_args->pdata[i], ==, args->pdata[i]);
+
+  g_assert_true (g_hash_table_contains (copy->env_vars, "UNSET"));
+  g_assert_null (g_hash_table_lookup (copy->env_vars, "UNSET"));
+  g_assert_cmpstr (g_hash_table_lookup (copy->env_vars, "EMPTY"), ==, "");
+  g_assert_cmpuint (g_hash_table_size (copy->enumerable_usb_devices), ==, 2);
+  g_assert_cmpuint (g_hash_table_size (copy->hidden_usb_devices), ==, 1);
+  g_assert_cmpstr (g_hash_table_lookup (copy->resources, "memory-high"), ==, "2147483648");
+
+  bad_version = g_variant_ref_sink (g_variant_new ("(u@a{sv})", 0,
+                                                   g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)));
+  g_clear_pointer (&copy, flatpak_context_free);
+  copy = flatpak_context_deserialize (bad_version, &error);
+  g_assert_nonnull (error);
+  g_assert_null (copy);
+}
+static void
+test_context_resources (void)
+{
+  static const char metadata[] =
+    "[Resources]\n"
+    "cpu-weight=50\n"
+    "io-weight=0\n"
+    "memory-max=512M\n"
+    "tasks-max=infinity\n"
+    "not-a-resource=1\n";
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr(FlatpakContext) context = flatpak_context_new ();
+  g_autoptr(FlatpakContext) override = flatpak_context_new ();
+  g_autoptr(GVariant) properties = NULL;
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(sv)"));
+  g_autoptr(GError) error = NULL;
+  const char *invalid[] = { "cpu-weight=10001", "memory-high=1X", "memory-high=1KB",
+                            "cpu-weight=infinity", "nope=1", "cpu-weight" };
+  guint64 value;
+  gboolean ok;
+  guint i;
+
+  ok = g_key_file_load_from_data (keyfile, metadata, -1, G_KEY_FILE_NONE, &error);
+  g_assert_no_error (error);
+  g_assert_true (ok);
+
+  /* Invalid and unknown entries are ignored */
+  ok = flatpak_context_load_metadata (context, keyfile, &error);
+  g_assert_no_error (error);
+  g_assert_true (ok);
+  g_assert_cmpuint (g_hash_table_size (context->resources), ==, 3);
+  g_assert_cmpstr (g_hash_table_lookup (context->resources, "cpu-weight"), ==, "50");
+  g_assert_cmpstr (g_hash_table_lookup (context->resources, "memory-max"), ==, "536870912");
+  g_assert_cmpstr (g_hash_table_lookup (context->resources, "tasks-max"), ==, "infinity");
+
+  context_parse_args (override, &error,
+                      "--resource=cpu-weight=200",
+                      "--resource=memory-high=1g",
+                      NULL);
+  g_assert_no_error (error);
+
+  for (i = 0; i < G_N_ELEMENTS (invalid); i++)
+    {
+      g_autoptr(FlatpakContext) bad = flatpak_context_new ();
+      g_autofree char *arg = g_strdup_printf ("--resource=%s", invalid[i]);
+
+      context_parse_args (bad, &error, arg, NULL);
+      g_assert_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED);
+      g_test_message ("Got error as expected: %s", error->message);
+      g_clear_error (&error);
+      g_assert_cmpuint (g_hash_table_size (bad->resources), ==, 0);
+    }
+
+  flatpak_context_merge (context, override);
+  g_assert_cmpstr (g_hash_table_lookup (context->resources, "cpu-weight"), ==, "200");
+
+  flatpak_context_add_unit_properties (context, &builder);
+  properties = g_variant_ref_sink (g_variant_builder_end (&builder));
+  g_assert_cmpuint (g_variant_n_children (properties), ==, 4);
+
+  for (i = 0; i < g_variant_n_children (properties); i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) v = NULL;
+
+      g_variant_get_child (properties, i, "(&sv)", &name, &v);
+      value = g_variant_get_uint64 (v);
+
+      if (g_str_equal (name, "CPUWeight"))
+        g_assert_cmpuint (value, ==, 200);
+      else if (g_str_equal (name, "MemoryHigh"))
+        g_assert_cmpuint (value, ==, 1024 * 1024 * 1024);
+      else if (g_str_equal (name, "MemoryMax"))
+        g_assert_cmpuint (value, ==, 512 * 1024 * 1024);
+      else if (g_str_equal (name, "TasksMax"))
+        g_assert_cmpuint (value, ==, G_MAXUINT64);
+      else
+        g_assert_not_reached ();
+    }
+}
+
 static void
 test_context_merge_fs (void)
 {
@@ -1030,6 +1208,8 @@ main (int argc, char *argv[])
 
   g_test_add_func ("/context/env", test_context_env);
   g_test_add_func ("/context/env-fd", test_context_env_fd);
+  g_test_add_func ("/context/serialize", test_context_serialize);
+  g_test_add_func ("/context/resources", test_context_resources);
   g_test_add_func ("/context/merge-fs", test_context_merge_fs);
   g_test_add_func ("/context/validate-path-args", test_validate_path_args);
   g_test_add_func ("/context/validate-path-meta", test_validate_path_meta);
@@ -23,7 +23,7 @@ set -euo pipefail
 
 skip_without_bwrap
 
-echo "1..2"
+echo "1..3"
 
 make_extension () {
     local ID=$1
@@ -153,6 +153,16 @@ assert_has_extension_file /usr multiversion/notmaster/extension-org.test.Multive
 
 ok "runtime extensions"
 
+# The extensions found above are cached, make sure that removing one
+# is noticed
+assert_has_dir $USERDIR/.cache/extensions
+${FLATPAK} --user uninstall -y org.test.Extension1//master >&2
+assert_not_has_extension_file /usr ext1/extension-org.test.Extension1:master
+${FLATPAK} --user install -y test-repo org.test.Extension1 master >&2
+assert_has_extension_file /usr ext1/extension-org.test.Extension1:master
+
+ok "extension cache invalidation"
+
 # Modify app metadata
 ostree checkout -U --repo=repos/test app/org.test.Hello/${ARCH}/master hello >&2
 add_extensions hello
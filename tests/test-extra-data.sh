@@ -45,7 +45,7 @@ curl "${EXTRA_DATA_URL}" -o "${DOWNLOADED_EXTRA_DATA}"
 EXTRA_DATA_SIZE=$(stat --printf="%s" "${DOWNLOADED_EXTRA_DATA}")
 EXTRA_DATA_SHA256=$(sha256sum "${DOWNLOADED_EXTRA_DATA}" | cut -f1 -d' ')
 
-echo "1..3"
+echo "1..5"
 
 # build the app with the extra data
 EXTRA_DATA="--extra-data=test:${EXTRA_DATA_SHA256}:${EXTRA_DATA_SIZE}:${EXTRA_DATA_SIZE}:${EXTRA_DATA_URL}"
@@ -62,6 +62,50 @@ ${FLATPAK} ${U} uninstall -y org.test.Hello >&2
 
 ok "install extra data app with ostree"
 
+# with a cache, the second install doesn't need the server
+export FLATPAK_EXTRA_DATA_CACHE_DIR="${TEST_DATA_DIR}/extra-data-cache"
+install_repo ${REPONAME} ${BRANCH}
+assert_has_file "${FLATPAK_EXTRA_DATA_CACHE_DIR}/${EXTRA_DATA_SHA256}"
+${FLATPAK} ${U} uninstall -y org.test.Hello >&2
+
+mv "${EXTRA_DATA_DIR}/${EXTRA_DATA_FILE}" "${TEST_DATA_DIR}/extra-data-moved"
+install_repo ${REPONAME} ${BRANCH}
+${FLATPAK} run --command=sh org.test.Hello -c "cat /app/extra/test" > out
+assert_file_has_content out "extra-data-test-content"
+${FLATPAK} ${U} uninstall -y org.test.Hello >&2
+
+mv "${TEST_DATA_DIR}/extra-data-moved" "${EXTRA_DATA_DIR}/${EXTRA_DATA_FILE}"
+unset FLATPAK_EXTRA_DATA_CACHE_DIR
+
+ok "install extra data app from extra data cache"
+
+# Several sources are downloaded at the same time, and if one of them
+# fails, so does the install
+EXTRA_DATA_FILE2="extra-data-test2"
+echo "extra-data-test2-content" > "${EXTRA_DATA_DIR}/${EXTRA_DATA_FILE2}"
+EXTRA_DATA2_URL="http://127.0.0.1:$(cat httpd-port)/${EXTRA_DATA_FILE2}"
+EXTRA_DATA2_SIZE=$(stat --printf="%s" "${EXTRA_DATA_DIR}/${EXTRA_DATA_FILE2}")
+EXTRA_DATA2_SHA256=$(sha256sum "${EXTRA_DATA_DIR}/${EXTRA_DATA_FILE2}" | cut -f1 -d' ')
+EXTRA_DATA2="--extra-data=test2:${EXTRA_DATA2_SHA256}:${EXTRA_DATA2_SIZE}:${EXTRA_DATA2_SIZE}:${EXTRA_DATA2_URL}"
+BUILD_FINISH_ARGS="${EXTRA_DATA} ${EXTRA_DATA2}" make_updated_app ${REPONAME} ${COLLECTION_ID} ${BRANCH} UPDATE2
+
+mv "${EXTRA_DATA_DIR}/${EXTRA_DATA_FILE2}" "${TEST_DATA_DIR}/extra-data-moved"
+assert_fail ${FLATPAK} ${U} install -y ${REPONAME}-repo org.test.Hello ${BRANCH} >&2
+${FLATPAK} ${U} list --columns=application > list-log
+assert_not_file_has_content list-log "^org\.test\.Hello$"
+
+mv "${TEST_DATA_DIR}/extra-data-moved" "${EXTRA_DATA_DIR}/${EXTRA_DATA_FILE2}"
+${FLATPAK} ${U} install -y ${REPONAME}-repo org.test.Hello ${BRANCH} >&2
+${FLATPAK} run --command=sh org.test.Hello -c "cat /app/extra/test /app/extra/test2" > out
+assert_file_has_content out "^extra-data-test-content$"
+assert_file_has_content out "^extra-data-test2-content$"
+${FLATPAK} ${U} uninstall -y org.test.Hello >&2
+
+# The other tests use the app with a single source
+BUILD_FINISH_ARGS=${EXTRA_DATA} make_updated_app ${REPONAME} ${COLLECTION_ID} ${BRANCH} UPDATE3
+
+ok "install extra data app with several sources"
+
 # Start the fake registry server
 
 httpd oci-registry-server.py --dir=.
@@ -196,6 +196,17 @@ EOF
 
 diff history-log expected-log >&2
 
+if ! ${FLATPAK} --installation=history-installation history --since="${HISTORY_START_TIME}" \
+    --columns=change,application,installation --json-lines > history-log 2>&1; then
+    cat history-log >&2
+    echo "Bail out! 'flatpak history --json-lines' failed"
+    exit 1
+fi
+
+assert_streq "$(wc -l < history-log)" "15"
+assert_streq "$(head -n1 history-log)" '{"change":"add remote","application":"","installation":"system (history-installation)"}'
+assert_streq "$(tail -n1 history-log)" '{"change":"remove remote","application":"","installation":"system (history-installation)"}'
+
 rm -f ${FLATPAK_CONFIG_DIR}/installations.d/history-inst.conf
 rm -rf ${TEST_DATA_DIR}/system-history-installation
 
@@ -26,15 +26,15 @@ port=$(cat httpd-port)
 
 assert_result() {
     test_string=$1
-    compressed=
-    if [ "$2" = "--compressed" ] ; then
-	compressed="--compressed"
+    mode=
+    if [ "$2" = "--compressed" ] || [ "$2" = "--resumable" ] ; then
+	mode="$2"
 	shift
     fi
     remote=$2
     local=$3
 
-    out=`${test_builddir}/httpcache $compressed "http://localhost:$port$remote" $local || :`
+    out=`${test_builddir}/httpcache $mode "http://localhost:$port$remote" $local || :`
 
     case "$out" in
 	$test_string*)
@@ -65,7 +65,7 @@ have_xattrs() {
     setfattr -n user.testvalue -v somevalue $1/test-xattrs > /dev/null 2>&1
 }
 
-echo "1..6"
+echo "1..7"
 
 # Without anything else, cached for 30 minutes
 assert_ok "/" $test_tmpdir/output
@@ -126,6 +126,14 @@ rm -f $test_tmpdir/output*
 
 ok 'compress after download'
 
+# Test that an interrupted download continues with a range request
+assert_ok --resumable "/?resumable&interrupt" $test_tmpdir/output
+assert_streq "$(wc -l < $test_tmpdir/output)" 1000
+assert_streq "$(sort -u $test_tmpdir/output)" "path=/?resumable&interrupt"
+rm -f $test_tmpdir/output*
+
+ok 'resumed download'
+
 # Testing that things work without xattr support
 
 if command -v setfattr >/dev/null &&
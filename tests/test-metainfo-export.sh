@@ -21,7 +21,7 @@ set -euo pipefail
 
 source "$(dirname "$0")/libtest.sh"
 
-echo "1..2"
+echo "1..4"
 
 setup_repo
 install_repo
@@ -77,3 +77,33 @@ assert_file_has_content "${APP_DIR}/export/share/metainfo/releases/${APP_ID}.rel
   '<release version="1.0.0" date="2026-06-14"/>'
 
 ok "install exported metainfo and releases"
+
+assert_has_file "${APP_DIR}/.flatpak-export-cache"
+
+ostree --repo="$REPO" ls -R -C "app/${APP_ID}/${ARCH}/master" > tree-before
+
+echo "1.0.1" > "${APP_DIR}/files/version"
+$FLATPAK build-export "$REPO" "$APP_DIR" >&2
+
+ostree --repo="$REPO" ls -R -C "app/${APP_ID}/${ARCH}/master" > tree-after
+assert_file_has_content tree-after '/files/version$'
+grep -v '/files/version$' tree-after | grep -v ' /files$' | grep -v ' /$' > tree-after-unchanged
+grep -v ' /files$' tree-before | grep -v ' /$' > tree-before-unchanged
+diff -u tree-before-unchanged tree-after-unchanged >&2
+ostree --repo="$REPO" cat "app/${APP_ID}/${ARCH}/master" /files/version > version
+assert_file_has_content version '^1\.0\.1$'
+
+ok "re-export reuses the export cache"
+
+SERIAL_REPO="$(mktemp -d)"
+PARALLEL_REPO="$(mktemp -d)"
+rm -f "${APP_DIR}/.flatpak-export-cache"
+$FLATPAK build-export --jobs=1 "$SERIAL_REPO" "$APP_DIR" >&2
+rm -f "${APP_DIR}/.flatpak-export-cache"
+$FLATPAK build-export --jobs=4 "$PARALLEL_REPO" "$APP_DIR" >&2
+
+ostree --repo="$SERIAL_REPO" ls -R -C "app/${APP_ID}/${ARCH}/master" > tree-serial
+ostree --repo="$PARALLEL_REPO" ls -R -C "app/${APP_ID}/${ARCH}/master" > tree-parallel
+diff -u tree-serial tree-parallel >&2
+
+ok "parallel export gives the same tree"
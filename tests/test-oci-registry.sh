@@ -23,7 +23,7 @@ set -euo pipefail
 
 skip_without_bwrap
 
-echo "1..18"
+echo "1..20"
 
 # Start the fake registry server
 
@@ -115,6 +115,19 @@ images=$(${FLATPAK} remote-ls ${U} --columns=app oci-registry | sort | tr '\n' '
 assert_streq "$images" "org.test.Hello org.test.Platform"
 ok "list remote"
 
+# The commit made up from the image is cached, so asking again doesn't
+# need the manifest
+
+${FLATPAK} remote-info ${U} oci-registry org.test.Hello > remote-info-1
+assert_file_has_content remote-info-1 "Ref: app/org.test.Hello/$ARCH/master"
+
+httpd_clear_log
+${FLATPAK} remote-info ${U} oci-registry org.test.Hello > remote-info-2
+assert_not_file_has_content httpd-log "/manifests/"
+diff -u remote-info-1 remote-info-2 >&2
+
+ok "remote-info uses cached commit"
+
 # Pull appstream data
 
 ${FLATPAK} update ${U} --appstream oci-registry >&2
@@ -182,6 +195,16 @@ assert_file_has_content hello_out '^Hello world, from a sandboxUPDATED$'
 
 ok "update"
 
+# The TLS sessions of the registry connections are kept for the next run
+if [ x${USE_HTTPS} = xyes ] && curl --version | grep -q SSLS-EXPORT; then
+    assert_has_file ${XDG_CACHE_HOME}/flatpak/tls-sessions
+    assert_file_has_mode ${XDG_CACHE_HOME}/flatpak/tls-sessions 600
+
+    ok "TLS sessions saved"
+else
+    ok "TLS sessions saved # skip  Needs https and curl with SSLS-EXPORT"
+fi
+
 # Remove the app from the registry, check that things were removed properly
 
 $client delete hello latest
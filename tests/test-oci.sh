@@ -23,7 +23,7 @@ set -euo pipefail
 
 skip_without_bwrap
 
-echo "1..4"
+echo "1..5"
 
 setup_repo_no_add oci
 
@@ -65,6 +65,12 @@ assert_has_dir checked-out/files
 assert_has_file checked-out/files/bin/hello.sh
 assert_has_file checked-out/metadata
 
+# The sizes are recorded at import time
+ostree show --repo=repo2 --print-metadata-key=xa.installed-size app/org.test.Hello/$ARCH/master > installed-size
+assert_file_has_content installed-size '^uint64 [0-9]'
+ostree show --repo=repo2 --print-metadata-key=xa.download-size app/org.test.Hello/$ARCH/master > download-size
+assert_file_has_content download-size '^uint64 [0-9]'
+
 ok "import oci"
 
 # Trying installing the bundle directly
@@ -108,3 +114,25 @@ ${FLATPAK} --user remotes --show-disabled > remotes-list
 assert_file_has_content remotes-list '^platform-origin'
 
 ok "install oci archive"
+
+# Export several refs to one image directory
+
+cat > oci-refs <<EOF2
+# The app and its runtime
+app/org.test.Hello/$ARCH/master
+runtime/org.test.Platform/$ARCH/master
+EOF2
+
+${FLATPAK} build-bundle --oci --refs-from=oci-refs --jobs=2 $FL_GPGARGS repos/oci oci/catalog >&2
+
+assert_has_file oci/catalog/index.json
+assert_file_has_content oci/catalog/index.json "app/org\.test\.Hello/$ARCH/master"
+assert_file_has_content oci/catalog/index.json "runtime/org\.test\.Platform/$ARCH/master"
+
+rm -f sums
+for i in oci/catalog/blobs/sha256/*; do
+     echo $(basename $i) $i >> sums
+done
+sha256sum -c sums >&2
+
+ok "export oci catalog"
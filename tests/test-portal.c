@@ -249,7 +249,7 @@ test_basic (Fixture *f,
   /* We can't easily tell whether EXPOSE_PIDS ought to be set or not */
   g_assert_cmpuint ((portal_flatpak_get_supports (f->proxy) &
                      (~FLATPAK_SPAWN_SUPPORT_FLAGS_EXPOSE_PIDS)), ==, 0);
-  g_assert_cmpuint (portal_flatpak_get_version (f->proxy), ==, 8);
+  g_assert_cmpuint (portal_flatpak_get_version (f->proxy), ==, 9);
 
   handler_id = g_signal_connect (f->proxy, "spawn-exited",
                                  G_CALLBACK (count_successful_exit_cb),
@@ -284,6 +284,164 @@ test_basic (Fixture *f,
   g_assert_no_error (error);
 }
 
+static void
+test_spawn_many (Fixture *f,
+                 gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GUnixFDList) fds_out = NULL;
+  g_autoptr(GVariant) pids = NULL;
+  const guint32 *pid_array;
+  gsize n_pids;
+  gboolean ok;
+  const char * const argv[] = { "hello", NULL };
+  gsize times_exited = 0;
+  gulong handler_id;
+  gsize i;
+
+  fixture_start_portal (f);
+
+  handler_id = g_signal_connect (f->proxy, "spawn-exited",
+                                 G_CALLBACK (count_successful_exit_cb),
+                                 &times_exited);
+
+  ok = portal_flatpak_call_spawn_many_sync (f->proxy,
+                                            "/",           /* cwd */
+                                            argv,          /* argv */
+                                            g_variant_new ("a{uh}", NULL),
+                                            g_variant_new ("a{ss}", NULL),
+                                            FLATPAK_SPAWN_FLAGS_NONE,
+                                            3,             /* count */
+                                            g_variant_new ("a{sv}", NULL),
+                                            NULL,          /* fd list */
+                                            &pids,
+                                            &fds_out,
+                                            NULL,
+                                            &error);
+  g_assert_no_error (error);
+  g_assert_true (ok);
+
+  pid_array = g_variant_get_fixed_array (pids, &n_pids, sizeof (guint32));
+  g_assert_cmpuint (n_pids, ==, 3);
+
+  for (i = 0; i < n_pids; i++)
+    {
+      gsize j;
+
+      g_assert_cmpuint (pid_array[i], >, 1);
+
+      for (j = 0; j < i; j++)
+        g_assert_cmpuint (pid_array[i], !=, pid_array[j]);
+    }
+
+  while (times_exited < n_pids)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_clear_pointer (&pids, g_variant_unref);
+  g_clear_object (&fds_out);
+
+  /* Notify start can't be used with more than one instance */
+  ok = portal_flatpak_call_spawn_many_sync (f->proxy,
+                                            "/",           /* cwd */
+                                            argv,          /* argv */
+                                            g_variant_new ("a{uh}", NULL),
+                                            g_variant_new ("a{ss}", NULL),
+                                            FLATPAK_SPAWN_FLAGS_NOTIFY_START,
+                                            2,             /* count */
+                                            g_variant_new ("a{sv}", NULL),
+                                            NULL,          /* fd list */
+                                            &pids,
+                                            &fds_out,
+                                            NULL,
+                                            &error);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+  g_assert_false (ok);
+  g_clear_error (&error);
+
+  g_signal_handler_disconnect (f->proxy, handler_id);
+
+  g_subprocess_send_signal (f->portal, SIGTERM);
+  g_subprocess_wait (f->portal, NULL, &error);
+  g_assert_no_error (error);
+}
+
+/* Every instance must get the environment, not just the first one to
+ * read it */
+static void
+test_spawn_many_env (Fixture *f,
+                     gconstpointer context G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GUnixFDList) fds_in = g_unix_fd_list_new ();
+  g_autoptr(GUnixFDList) fds_out = NULL;
+  g_autoptr(GVariant) pids = NULL;
+  g_auto(GVariantBuilder) fd_map_builder = {};
+  g_auto(GVariantBuilder) env_builder = {};
+  g_autofree char *tempfile_path = g_strdup ("/tmp/flatpak-portal-test.XXXXXX");
+  g_autofree char *output = NULL;
+  glnx_autofd int tempfile_fd = -1;
+  const char * const argv[] = { "hello", NULL };
+  const char *p;
+  gsize times_exited = 0;
+  gsize n_found = 0;
+  gulong handler_id;
+  int handle;
+  gboolean ok;
+
+  fixture_start_portal (f);
+
+  handler_id = g_signal_connect (f->proxy, "spawn-exited",
+                                 G_CALLBACK (count_successful_exit_cb),
+                                 &times_exited);
+
+  tempfile_fd = g_mkstemp (tempfile_path);
+  g_assert_no_errno (tempfile_fd);
+
+  handle = g_unix_fd_list_append (fds_in, tempfile_fd, &error);
+  g_assert_no_error (error);
+
+  g_variant_builder_init (&fd_map_builder, G_VARIANT_TYPE ("a{uh}"));
+  g_variant_builder_add (&fd_map_builder, "{uh}", (guint32) STDOUT_FILENO, (gint32) handle);
+  g_variant_builder_init (&env_builder, G_VARIANT_TYPE ("a{ss}"));
+  g_variant_builder_add (&env_builder, "{ss}", "FOO", "bar");
+
+  ok = portal_flatpak_call_spawn_many_sync (f->proxy,
+                                            "/",           /* cwd */
+                                            argv,          /* argv */
+                                            g_variant_builder_end (&fd_map_builder),
+                                            g_variant_builder_end (&env_builder),
+                                            FLATPAK_SPAWN_FLAGS_NONE,
+                                            3,             /* count */
+                                            g_variant_new ("a{sv}", NULL),
+                                            fds_in,
+                                            &pids,
+                                            &fds_out,
+                                            NULL,
+                                            &error);
+  g_assert_no_error (error);
+  g_assert_true (ok);
+
+  while (times_exited < 3)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_no_errno (lseek (tempfile_fd, 0, SEEK_SET));
+  output = glnx_fd_readall_utf8 (tempfile_fd, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_test_message ("Output from mock Flatpak: %s", output);
+
+  for (p = strstr (output, "env[FOO] = bar"); p != NULL; p = strstr (p + 1, "env[FOO] = bar"))
+    n_found++;
+
+  g_assert_cmpuint (n_found, ==, 3);
+
+  g_signal_handler_disconnect (f->proxy, handler_id);
+  g_assert_no_errno (unlink (tempfile_path));
+
+  g_subprocess_send_signal (f->portal, SIGTERM);
+  g_subprocess_wait (f->portal, NULL, &error);
+  g_assert_no_error (error);
+}
+
 static void
 test_fd_passing (Fixture *f,
                  gconstpointer context G_GNUC_UNUSED)
@@ -477,6 +635,8 @@ main (int argc,
 
   g_test_add ("/help", Fixture, NULL, setup, test_help, teardown);
   g_test_add ("/basic", Fixture, NULL, setup, test_basic, teardown);
+  g_test_add ("/spawn-many", Fixture, NULL, setup, test_spawn_many, teardown);
+  g_test_add ("/spawn-many-env", Fixture, NULL, setup, test_spawn_many_env, teardown);
   g_test_add ("/fd-passing", Fixture, NULL, setup, test_fd_passing, teardown);
   g_test_add ("/replace", Fixture, NULL, setup, test_replace, teardown);
 
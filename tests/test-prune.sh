@@ -113,6 +113,9 @@ assert_streq $NUM_DIRMETA 2
 assert_streq $NUM_COMMITMETA2 $NUM_COMMIT
 assert_streq $NUM_OBJECT 71
 
+# The set of reachable commits is recorded so the next prune can be incremental
+assert_has_file repo/.flatpak-prune-generation
+
 cp -a repo incremental-repo # Make a copy of the orig repo with the commitmeta2 objects
 
 # Try again with the commitmeta existing
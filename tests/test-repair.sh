@@ -8,7 +8,7 @@ set -euo pipefail
 
 . $(dirname $0)/libtest.sh
 
-echo "1..2"
+echo "1..3"
 
 setup_repo
 ${FLATPAK} ${U} install -y test-repo org.test.Hello >&2
@@ -30,6 +30,18 @@ assert_file_has_content list-log "org\.test\.Hello/"
 
 ok "repair command handles missing files"
 
+# the previous repair should have checkpointed the verified objects
+assert_has_file ${FL_DIR}/repo/.flatpak-repair-checkpoint
+
+# an object modified after it was verified must be checked again
+HELLO_OBJ=${FL_DIR}/repo/objects/0d/30582c0ac8a2f89f23c0f62e548ba7853f5285d21848dd503460a567b5d253.file
+chmod u+w ${HELLO_OBJ}
+echo "corrupted" >> ${HELLO_OBJ}
+${FLATPAK} ${U} repair >&2
+assert_not_file_has_content ${HELLO_OBJ} "corrupted"
+
+ok "repair re-verifies objects changed since the last checkpoint"
+
 # Test that flatpak repair --reinstall-all does not change pin state
 # https://github.com/flatpak/flatpak/issues/6565
 # Reuse the repo and installation from the previous test.
@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 skip_revokefs_without_fuse
 
-echo "1..47"
+echo "1..48"
 
 #Regular repo
 setup_repo
@@ -102,6 +102,7 @@ assert_has_file $FL_DIR/appstream/test-repo/$ARCH/.timestamp
 assert_has_symlink $FL_DIR/appstream/test-repo/$ARCH/active
 assert_has_file $FL_DIR/appstream/test-repo/$ARCH/active/appstream.xml
 assert_has_file $FL_DIR/appstream/test-repo/$ARCH/active/appstream.xml.gz
+assert_has_file $FL_DIR/appstream/test-repo/$ARCH/active/flatpak-search-index.gvariant
 
 ok "update appstream"
 
@@ -109,6 +110,10 @@ ok "update appstream"
 ${FLATPAK} search Hello > search-results
 assert_file_has_content search-results "Print a greeting"
 
+# Prefixes of words in the summary match through the search index
+${FLATPAK} search greet > search-results
+assert_file_has_content search-results "org.test.Hello"
+
 ok "search"
 
 if [ x${USE_COLLECTIONS_IN_CLIENT-} != xyes ] ; then
@@ -416,6 +421,22 @@ assert_file_has_content branches-log "^app/org\.test\.Hello/.*eol=Reason1"
 
 ok "eol build-commit-from"
 
+ostree init --repo=repos/test-batch --mode=archive-z2 >&2
+cat > ref-mappings <<EOF
+# Promote the app as is, and the locale under a new branch
+app/org.test.Hello/$ARCH/master
+
+runtime/org.test.Hello.Locale/$ARCH/master runtime/org.test.Hello.Locale/$ARCH/stable
+EOF
+${FLATPAK} build-commit-from --no-update-summary --src-repo=repos/test --refs-from=- repos/test-batch < ref-mappings >&2
+
+ostree refs --repo=repos/test-batch > batch-refs
+assert_file_has_content batch-refs "^app/org\.test\.Hello/$ARCH/master$"
+assert_file_has_content batch-refs "^runtime/org\.test\.Hello\.Locale/$ARCH/stable$"
+assert_not_file_has_content batch-refs "^runtime/org\.test\.Hello\.Locale/$ARCH/master$"
+
+ok "build-commit-from --refs-from"
+
 ${FLATPAK} ${U} install -y test-repo org.test.Hello >&2
 
 EXPORT_ARGS="--end-of-life=Reason2" make_updated_app
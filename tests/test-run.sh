@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 skip_revokefs_without_fuse
 
-echo "1..27"
+echo "1..29"
 
 # Use stable rather than master as the branch so we can test that the run
 # command automatically finds the branch correctly
@@ -55,6 +55,10 @@ assert_file_has_content $FL_DIR/exports/share/krunner/dbusplugins/org.test.Hello
 assert_has_file $FL_DIR/exports/share/icons/hicolor/64x64/apps/org.test.Hello.png
 assert_not_has_file $FL_DIR/exports/share/icons/hicolor/64x64/apps/dont-export.png
 assert_has_file $FL_DIR/exports/share/icons/HighContrast/64x64/apps/org.test.Hello.png
+# The exported symlinks are recorded for incremental updates
+assert_has_file $FL_DIR/exports/.manifests/org.test.Hello
+assert_file_has_content $FL_DIR/exports/.manifests/org.test.Hello "^share/applications/org.test.Hello.desktop$"
+assert_file_has_content $FL_DIR/exports/.manifests/org.test.Hello "^share/icons/hicolor/64x64/apps/org.test.Hello.png$"
 
 $FLATPAK list ${U} | grep org.test.Hello > /dev/null
 $FLATPAK list ${U} -d | grep org.test.Hello | grep test-repo > /dev/null
@@ -64,6 +68,8 @@ $FLATPAK list ${U} -d | grep org.test.Hello | grep ${ID:0:12} > /dev/null
 $FLATPAK info ${U} org.test.Hello > /dev/null
 $FLATPAK info ${U} org.test.Hello | grep test-repo > /dev/null
 $FLATPAK info ${U} org.test.Hello | grep $ID > /dev/null
+# The listings above are served from the index of deployed refs
+assert_has_file $FL_DIR/.deployed-index
 
 ok "install"
 
@@ -75,6 +81,9 @@ if command -v update-desktop-database >/dev/null &&
     assert_file_has_content $FL_DIR/exports/share/applications/mimeinfo.cache x-test/Hello
     assert_has_file $FL_DIR/exports/share/icons/hicolor/icon-theme.cache
     assert_has_file $FL_DIR/exports/share/icons/hicolor/index.theme
+    # The icon cache trigger is tracked per theme
+    assert_file_has_content $FL_DIR/.trigger-inputs '^\[gtk-icon-cache\.trigger\]$'
+    assert_file_has_content $FL_DIR/.trigger-inputs '^hicolor='
 
     ok "install triggers"
 else
@@ -83,9 +92,38 @@ fi
 
 run org.test.Hello &> hello_out
 assert_file_has_content hello_out '^Hello world, from a sandbox$'
+assert_has_dir $USERDIR/.cache/launch-plans
+# The app has no libraries of its own, so it uses the runtime's ld.so.cache
+assert_has_dir $USERDIR/.cache/ld.so.shared
+assert_not_has_dir $HOME/.var/app/org.test.Hello/.ld.so
+
+# Only warms the caches, the app itself doesn't run
+${FLATPAK} run --prepare-only org.test.Hello &> prepare_out
+assert_not_file_has_content prepare_out 'Hello world'
 
 ok "hello"
 
+${FLATPAK} run --profile-startup org.test.Hello > /dev/null 2> profile_out
+assert_file_has_content profile_out '"app": "org.test.Hello"'
+assert_file_has_content profile_out '"phase": "deploy-lookup"'
+assert_file_has_content profile_out '"phase": "bwrap-exec"'
+
+FLATPAK_PROFILE_STARTUP=$(pwd)/profile.json ${FLATPAK} run org.test.Hello > hello_out
+assert_file_has_content hello_out '^Hello world, from a sandbox$'
+assert_file_has_content profile.json '"phase": "ld-cache"'
+
+ok "profile startup"
+
+${FLATPAK} run --headless org.test.Hello > hello_out
+assert_file_has_content hello_out '^Hello world, from a sandbox$'
+
+# Without a session bus we run headless on our own
+env -u DBUS_SESSION_BUS_ADDRESS ${FLATPAK} -v run org.test.Hello > hello_out 2> headless_err
+assert_file_has_content hello_out '^Hello world, from a sandbox$'
+assert_file_has_content headless_err 'No session bus, running headless'
+
+ok "headless"
+
 # This should try and fail to run e.g. /usr/bin/--tmpfs, which will
 # exit with a nonzero status because there is no such executable.
 # It should not pass "--tmpfs /blah hello.sh" as bwrap options.
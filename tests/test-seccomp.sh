@@ -9,7 +9,7 @@ set -euo pipefail
 skip_without_seccomp
 skip_without_bwrap
 
-echo "1..18"
+echo "1..19"
 
 setup_repo
 install_repo
@@ -99,3 +99,8 @@ for extra_argv in "" "--allow=multiarch"; do
   assert_streq "$e" "$EFAULT"
   ok "prctl not blocked"
 done
+
+# The filters were compiled once and reused from the cache afterwards
+assert_has_dir "$USERDIR/.cache/seccomp"
+test -n "$(ls "$USERDIR/.cache/seccomp")"
+ok "seccomp filters cached"
@@ -0,0 +1,126 @@
+#!/bin/bash
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the
+# Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+# Boston, MA 02111-1307, USA.
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+skip_revokefs_without_fuse
+
+echo "1..6"
+
+# The app comes from test-repo, its runtime from platform-repo
+setup_repo
+setup_repo platform
+
+${FLATPAK} ${U} install -y platform-repo org.test.Platform >&2
+${FLATPAK} ${U} install -y test-repo org.test.Hello >&2
+
+# The first update with nothing to do records that in the plan cache, the
+# second one uses it
+${FLATPAK} ${U} -v update -y org.test.Hello > update-log 2>&1
+assert_not_file_has_content update-log "Transaction plan unchanged"
+${FLATPAK} ${U} -v update -y org.test.Hello > update-log 2>&1
+assert_file_has_content update-log "Transaction plan unchanged"
+
+ok "no-op plan cache hit"
+
+# The runtime only gets into the transaction as a dependency of the app, so
+# an update of its remote must still invalidate the cache
+RUNTIME_COMMIT=$(${FLATPAK} ${U} info --show-commit org.test.Platform)
+
+make_updated_runtime platform
+${FLATPAK} ${U} -v update -y org.test.Hello > update-log 2>&1
+assert_not_file_has_content update-log "Transaction plan unchanged"
+
+NEW_RUNTIME_COMMIT=$(${FLATPAK} ${U} info --show-commit org.test.Platform)
+assert_not_streq "$RUNTIME_COMMIT" "$NEW_RUNTIME_COMMIT"
+assert_streq "$NEW_RUNTIME_COMMIT" "$(ostree --repo=repos/platform rev-parse runtime/org.test.Platform/$ARCH/master)"
+
+ok "no-op plan cache invalidated by dependency remote update"
+
+# A runtime deployed behind the transaction's back must not hit the cache
+# either, as that changes what the update has to do
+${FLATPAK} ${U} update -y org.test.Hello >&2
+${FLATPAK} ${U} update -y --commit=${RUNTIME_COMMIT} org.test.Platform >&2
+${FLATPAK} ${U} -v update -y org.test.Hello > update-log 2>&1
+assert_not_file_has_content update-log "Transaction plan unchanged"
+
+ok "no-op plan cache invalidated by dependency deploy"
+
+# Preinstall with several jobs batches the pulls per remote and pipelines
+# them with the deploys
+${FLATPAK} ${U} uninstall -y --all >&2
+
+mkdir -p $FLATPAK_DATA_DIR/preinstall.d
+cat << EOF > $FLATPAK_DATA_DIR/preinstall.d/hello.preinstall
+[Flatpak Preinstall org.test.Hello]
+EOF
+
+${FLATPAK} ${U} preinstall -y --jobs=4 >&2
+
+${FLATPAK} ${U} list --columns=ref > list-log
+assert_file_has_content list-log "^org\.test\.Hello/.*/master$"
+assert_file_has_content list-log "^org\.test\.Platform/.*/master$"
+
+ok "parallel preinstall"
+
+# The pulls only run in the background without the system helper
+if [ x${USE_SYSTEMDIR-} != xyes ]; then
+    JOURNAL=$FL_DIR/repo/tmp/cache/transaction-journal
+
+    ${FLATPAK} ${U} uninstall -y --all >&2
+
+    # Make the deploy of the app fail after it was pulled
+    mkdir -p $FL_DIR/app
+    touch $FL_DIR/app/org.test.Hello
+
+    assert_fail ${FLATPAK} ${U} preinstall -y --jobs=4 >&2
+    assert_has_file $JOURNAL
+    assert_file_has_content $JOURNAL "^\[app/org\.test\.Hello/$ARCH/master\]$"
+
+    # The retry only deploys what was already pulled
+    rm $FL_DIR/app/org.test.Hello
+    ${FLATPAK} ${U} -v preinstall -y --jobs=4 > preinstall-log 2>&1
+    assert_file_has_content preinstall-log "Resuming interrupted transaction"
+    assert_not_has_file $JOURNAL
+
+    ${FLATPAK} ${U} list --columns=ref > list-log
+    assert_file_has_content list-log "^org\.test\.Hello/.*/master$"
+
+    ok "interrupted transaction resumed"
+else
+    ok "interrupted transaction resumed # skip  Not supported with the system helper"
+fi
+
+# The test app exports no mime types, so the mime database trigger has
+# nothing to do once it ran. The system helper runs the triggers itself,
+# so we can't see its logs.
+if [ x${USE_SYSTEMDIR-} != xyes ] &&
+   command -v update-desktop-database >/dev/null &&
+   command -v update-mime-database >/dev/null &&
+   command -v gtk-update-icon-cache >/dev/null; then
+    ORIGIN=$(${FLATPAK} ${U} info --show-origin org.test.Hello)
+    make_updated_app ${ORIGIN%-repo}
+    ${FLATPAK} ${U} -v update -y org.test.Hello > update-log 2>&1
+    assert_file_has_content update-log "running trigger desktop-database\.trigger"
+    assert_file_has_content update-log "skipping trigger mime-database\.trigger, its inputs are unchanged"
+
+    ok "unchanged triggers skipped"
+else
+    ok "unchanged triggers skipped # skip  Dependencies not available"
+fi
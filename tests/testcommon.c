@@ -10,6 +10,8 @@
 #include "flatpak-appdata-private.h"
 #include "flatpak-run-private.h"
 #include "flatpak-run-x11-private.h"
+#include "flatpak-zstd-compressor-private.h"
+#include "flatpak-zstd-decompressor-private.h"
 
 static void
 test_has_path_prefix (void)
@@ -467,6 +469,45 @@ test_decompose (void)
   }
 }
 
+static void
+test_decompose_interned (void)
+{
+  g_autoptr(FlatpakDecomposed) a = NULL;
+  g_autoptr(FlatpakDecomposed) b = NULL;
+  g_autoptr(FlatpakDecomposed) c = NULL;
+  g_autoptr(FlatpakDecomposed) col = NULL;
+  g_autoptr(GError) error = NULL;
+
+  a = flatpak_decomposed_new_from_ref ("app/org.the.app/mips64/master", &error);
+  g_assert_no_error (error);
+  b = flatpak_decomposed_new_from_ref_take (g_strdup ("app/org.the.app/mips64/master"), &error);
+  g_assert_no_error (error);
+  c = flatpak_decomposed_new_from_parts (FLATPAK_KINDS_APP, "org.the.app", "mips64", "master", &error);
+  g_assert_no_error (error);
+
+  /* The same ref is shared, no matter how it was created */
+  g_assert_true (a == b);
+  g_assert_true (a == c);
+  g_assert_true (flatpak_decomposed_equal (a, c));
+
+  /* Refs with a collection id are never shared */
+  col = flatpak_decomposed_new_from_col_ref ("app/org.the.app/mips64/master", "org.the.Collection", &error);
+  g_assert_no_error (error);
+  g_assert_true (col != a);
+  g_assert_false (flatpak_decomposed_equal (a, col));
+  g_assert_cmpstr (flatpak_decomposed_get_collection_id (a), ==, NULL);
+
+  /* Once all references are dropped, the ref can be created again */
+  g_clear_pointer (&a, flatpak_decomposed_unref);
+  g_clear_pointer (&b, flatpak_decomposed_unref);
+  g_clear_pointer (&c, flatpak_decomposed_unref);
+
+  a = flatpak_decomposed_new_from_ref ("app/org.the.app/mips64/master", &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (flatpak_decomposed_get_ref (a), ==, "app/org.the.app/mips64/master");
+  g_assert_true (flatpak_decomposed_hash (a) == g_str_hash ("app/org.the.app/mips64/master"));
+}
+
 
 typedef struct
 {
@@ -563,7 +604,10 @@ static Levenshtein levenshtein_tests[] = {
   { "", "", 0 },
   { "abcdef", "abcdef", 0 },
   { "kitten", "sitting", 3 },
-  { "Saturday", "Sunday", 3 }
+  { "Saturday", "Sunday", 3 },
+  { "org.gnome.Maps", "org.gnome.Mahjongg", 6 },
+  { "org.test.Hello", "org.test.Hallo", 1 },
+  { "flathub", "", 7 }
 };
 
 static void
@@ -577,6 +621,14 @@ test_levenshtein (void)
 
       g_assert_cmpint (flatpak_levenshtein_distance (data->a, -1, data->b, -1), ==, data->distance);
       g_assert_cmpint (flatpak_levenshtein_distance (data->b, -1, data->a, -1), ==, data->distance);
+
+      for (int max = 0; max <= 4; max++)
+        {
+          int expected = MIN (data->distance, max + 1);
+
+          g_assert_cmpint (flatpak_levenshtein_distance_bounded (data->a, -1, data->b, -1, max), ==, expected);
+          g_assert_cmpint (flatpak_levenshtein_distance_bounded (data->b, -1, data->a, -1, max), ==, expected);
+        }
     }
 }
 
@@ -682,6 +734,25 @@ test_parse_appdata (void)
     "    </content_rating>\n"
     "  </component>\n"
     "</components>";
+  const char appdata3[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<components version=\"0.8\">\n"
+    "  <component type=\"desktop\">\n"
+    "    <id>org.test.Other</id>\n"
+    "    <name>Some other app</name>\n"
+    "    <releases>\n"
+    "      <release timestamp=\"1625132800\" version=\"2.0\"/>\n"
+    "    </releases>\n"
+    "  </component>\n"
+    "  <component type=\"desktop\">\n"
+    "    <id>org.test.Hello</id>\n"
+    "    <name>Hello world test app: org.test.Hello</name>\n"
+    "    <releases>\n"
+    "      <release timestamp=\"1525132800\" version=\"0.1.0\"/>\n"
+    "    </releases>\n"
+    "  </component>\n"
+    /* Not parsed, as the matching component comes first */
+    "  <component><<<\n";
   g_autoptr(GHashTable) names = NULL;
   g_autoptr(GHashTable) comments = NULL;
   g_autofree char *version = NULL;
@@ -735,6 +806,22 @@ test_parse_appdata (void)
   g_assert_cmpstr (comment, ==, "Schreib mal was");
   g_assert_cmpstr (content_rating_type, ==, "oars-1.1");
   g_assert_cmpuint (g_hash_table_size (content_rating), ==, 0);
+
+  g_clear_pointer (&names, g_hash_table_unref);
+  g_clear_pointer (&comments, g_hash_table_unref);
+  g_clear_pointer (&version, g_free);
+  g_clear_pointer (&license, g_free);
+  g_clear_pointer (&content_rating_type, g_free);
+  g_clear_pointer (&content_rating, g_hash_table_unref);
+
+  res = flatpak_parse_appdata (appdata3, "org.test.Hello", &names, &comments, &version, &license, &content_rating_type, &content_rating);
+  g_assert_true (res);
+  g_assert_cmpstr (version, ==, "0.1.0");
+  g_assert_cmpint (g_hash_table_size (names), ==, 1);
+  name = g_hash_table_lookup (names, "C");
+  g_assert_cmpstr (name, ==, "Hello world test app: org.test.Hello");
+  g_assert_null (content_rating_type);
+  g_assert_null (content_rating);
 }
 
 static void
@@ -841,8 +928,8 @@ test_filter_parser (void)
   for (i = 0; i < G_N_ELEMENTS(filters); i++)
     {
       g_autoptr(GError) error = NULL;
-      g_autoptr(GRegex) allow_refs = NULL;
-      g_autoptr(GRegex) deny_refs = NULL;
+      g_autoptr(FlatpakFilter) allow_refs = NULL;
+      g_autoptr(FlatpakFilter) deny_refs = NULL;
 
       ret = flatpak_parse_filters (filters[i].filter, &allow_refs, &deny_refs, &error);
       g_assert_error (error, FLATPAK_ERROR, filters[i].expected_error);
@@ -856,8 +943,8 @@ static void
 test_filter (void)
 {
   GError *error = NULL;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
+  g_autoptr(FlatpakFilter) allow_refs = NULL;
+  g_autoptr(FlatpakFilter) deny_refs = NULL;
   gboolean ret;
   int i;
   const char *filter =
@@ -937,6 +1024,63 @@ test_filter (void)
     g_assert_cmpint (flatpak_filters_allow_ref (allow_refs, deny_refs, filter_refs[i].ref), ==, filter_refs[i].expected_result);
 }
 
+static void
+test_filter_matches (void)
+{
+  g_autoptr(FlatpakFilter) filter = flatpak_filter_new ();
+  g_autoptr(FlatpakFilter) pins = flatpak_filter_new ();
+  g_autoptr(GError) error = NULL;
+  const char *globs[] = {
+    "org.*.Platform",
+    "runtime/org.gnome.Sdk",
+    "org.kde.*/x86_64",
+    "/aarch64/stable",
+    "com.example*app*/*/beta",
+    "net.trailing/",
+  };
+  struct {
+    const char *ref;
+    gboolean expected_result;
+  } refs[] = {
+    { "runtime/org.gnome.Platform/x86_64/45", TRUE },
+    { "app/org.kde.Platform/arm/5.15", TRUE },
+    { "runtime/org.gnome.PlatformX/x86_64/45", FALSE },
+    { "runtime/org.gnome.Sdk/x86_64/45", TRUE },
+    { "app/org.gnome.Sdk/x86_64/45", FALSE },
+    { "app/org.kde.kate/x86_64/stable", TRUE },
+    { "app/org.kde.kate/aarch64/stable", TRUE },
+    { "app/org.kde.kate/aarch64/beta", FALSE },
+    { "app/com.example.myapp.Debug/arm/beta", TRUE },
+    { "app/com.exampleapp/arm/beta", TRUE },
+    { "app/com.example.my/arm/beta", FALSE },
+    { "app/net.trailing/x86_64/stable", FALSE },
+    { "app/org.kde.kate/x86_64", FALSE },
+    { "app/org.kde.kate/x86_64/stable/extra", FALSE },
+    { "app/org.kde.ka+te/x86_64/stable", FALSE },
+    { "org.kde.kate/x86_64/stable", FALSE },
+  };
+  int i;
+
+  g_assert_false (flatpak_filter_matches (filter, "app/org.kde.kate/x86_64/stable"));
+
+  for (i = 0; i < G_N_ELEMENTS (globs); i++)
+    {
+      g_assert_true (flatpak_filter_add_glob (filter, globs[i], FALSE, &error));
+      g_assert_no_error (error);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (refs); i++)
+    g_assert_cmpint (flatpak_filter_matches (filter, refs[i].ref), ==, refs[i].expected_result);
+
+  /* Pins only match runtimes */
+  g_assert_true (flatpak_filter_add_glob (pins, "org.gnome.*", TRUE, &error));
+  g_assert_no_error (error);
+  g_assert_false (flatpak_filter_add_glob (pins, "app/org.gnome.*", TRUE, &error));
+  g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_INVALID_DATA);
+  g_assert_true (flatpak_filter_matches (pins, "runtime/org.gnome.Platform/x86_64/45"));
+  g_assert_false (flatpak_filter_matches (pins, "app/org.gnome.Maps/x86_64/stable"));
+}
+
 static void
 test_dconf_app_id (void)
 {
@@ -1330,6 +1474,12 @@ static PathValidityData paths[] = {
   {"\xF0\x93\x90\xBF", FALSE},
   /* invalid utf-8 */
   {"\xD8\1", FALSE},
+  /* long runs of ASCII, with the interesting bytes past the first words */
+  {"/home/user/.var/app/org.example.App/data/~file name", TRUE},
+  {"/home/user/.var/app/org.example.App/data/やあ", TRUE},
+  {"/home/user/.var/app/org.example.App/data/\tfile", FALSE},
+  {"/home/user/.var/app/org.example.App/data/\x7f", FALSE},
+  {"/home/user/.var/app/org.example.App/data/؜", FALSE},
 };
 
 /* CVE-2023-28101 */
@@ -1348,6 +1498,140 @@ test_validate_path_characters (void)
     }
 }
 
+static void
+test_keyfile_variant (void)
+{
+  static const char data[] =
+    "[Application]\n"
+    "name=org.example.App\n"
+    "runtime=runtime/org.example.Platform/x86_64/1\n"
+    "\n"
+    "[Context]\n"
+    "shared=network;ipc;\n"
+    "filesystems=xdg-download;~/with\\sspace;\n"
+    "\n"
+    "[Empty]\n";
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr(GKeyFile) copy = NULL;
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *expected = NULL;
+  g_autofree char *result = NULL;
+  g_auto(GStrv) filesystems = NULL;
+
+  g_key_file_load_from_data (keyfile, data, -1, G_KEY_FILE_NONE, &error);
+  g_assert_no_error (error);
+
+  variant = flatpak_keyfile_to_variant (keyfile);
+  copy = flatpak_keyfile_new_from_variant (variant);
+
+  expected = g_key_file_to_data (keyfile, NULL, NULL);
+  result = g_key_file_to_data (copy, NULL, NULL);
+  g_assert_cmpstr (result, ==, expected);
+
+  filesystems = g_key_file_get_string_list (copy, "Context", "filesystems", NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (g_strv_length (filesystems), ==, 2);
+  g_assert_cmpstr (filesystems[1], ==, "~/with space");
+}
+
+#ifdef HAVE_ZSTD
+static GBytes *
+zstd_compress (GBytes *data)
+{
+  g_autoptr(FlatpakZstdCompressor) compressor = flatpak_zstd_compressor_new (3, 0);
+  g_autoptr(GOutputStream) mem = g_memory_output_stream_new_resizable ();
+  g_autoptr(GOutputStream) out = g_converter_output_stream_new (mem, G_CONVERTER (compressor));
+  g_autoptr(GError) error = NULL;
+
+  g_output_stream_write_all (out, g_bytes_get_data (data, NULL), g_bytes_get_size (data),
+                             NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_output_stream_close (out, NULL, &error);
+  g_assert_no_error (error);
+
+  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (mem));
+}
+#endif
+
+static void
+test_zstd_input_stream (void)
+{
+#ifdef HAVE_ZSTD
+  g_autoptr(GByteArray) expected = g_byte_array_new ();
+  g_autoptr(GByteArray) compressed = g_byte_array_new ();
+  g_autoptr(GBytes) compressed_bytes = NULL;
+  g_autoptr(GBytes) truncated = NULL;
+  g_autoptr(GInputStream) mem = NULL;
+  g_autoptr(GInputStream) in = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guchar *result = g_malloc (3 * 1024 * 1024);
+  gsize n_read = 0;
+  gssize res;
+  guint i;
+
+  /* Two frames, which is what a compressed stream that was appended to
+   * looks like */
+  for (i = 0; i < 2; i++)
+    {
+      g_autoptr(GByteArray) frame = g_byte_array_new ();
+      g_autoptr(GBytes) frame_bytes = NULL;
+      g_autoptr(GBytes) frame_compressed = NULL;
+
+      for (guint j = 0; j < 1024 * 1024; j++)
+        {
+          guint8 byte = (j * (i + 7)) % 251;
+          g_byte_array_append (frame, &byte, 1);
+        }
+
+      g_byte_array_append (expected, frame->data, frame->len);
+      frame_bytes = g_byte_array_free_to_bytes (g_steal_pointer (&frame));
+      frame_compressed = zstd_compress (frame_bytes);
+      g_byte_array_append (compressed, g_bytes_get_data (frame_compressed, NULL),
+                           g_bytes_get_size (frame_compressed));
+    }
+  compressed_bytes = g_byte_array_free_to_bytes (g_steal_pointer (&compressed));
+
+  mem = g_memory_input_stream_new_from_bytes (compressed_bytes);
+  in = flatpak_zstd_input_stream_new (mem);
+
+  /* Some single bytes, then whatever fits */
+  for (i = 0; i < 100; i++)
+    {
+      res = g_input_stream_read (in, result + n_read, 1, NULL, &error);
+      g_assert_no_error (error);
+      g_assert_cmpint (res, ==, 1);
+      n_read += res;
+    }
+
+  do
+    {
+      res = g_input_stream_read (in, result + n_read, 3 * 1024 * 1024 - n_read, NULL, &error);
+      g_assert_no_error (error);
+      g_assert_cmpint (res, >=, 0);
+      n_read += res;
+    }
+  while (res > 0);
+
+  g_assert_cmpmem (result, n_read, expected->data, expected->len);
+
+  g_clear_object (&in);
+  g_clear_object (&mem);
+
+  truncated = g_bytes_new_from_bytes (compressed_bytes, 0, g_bytes_get_size (compressed_bytes) - 1);
+  mem = g_memory_input_stream_new_from_bytes (truncated);
+  in = flatpak_zstd_input_stream_new (mem);
+
+  do
+    res = g_input_stream_read (in, result, 3 * 1024 * 1024, NULL, &error);
+  while (res > 0);
+  g_assert_cmpint (res, ==, -1);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT);
+#else
+  g_test_skip ("Built without libzstd");
+#endif
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -1367,16 +1651,20 @@ main (int argc, char *argv[])
   g_test_add_func ("/common/name-matching", test_name_matching);
   g_test_add_func ("/common/filter_parser", test_filter_parser);
   g_test_add_func ("/common/filter", test_filter);
+  g_test_add_func ("/common/filter_matches", test_filter_matches);
   g_test_add_func ("/common/dconf-app-id", test_dconf_app_id);
   g_test_add_func ("/common/dconf-paths", test_dconf_paths);
   g_test_add_func ("/common/decompose-ref", test_decompose);
+  g_test_add_func ("/common/decompose-ref-interned", test_decompose_interned);
   g_test_add_func ("/common/envp-cmp", test_envp_cmp);
   g_test_add_func ("/common/needs-quoting", test_needs_quoting);
   g_test_add_func ("/common/quote-argv", test_quote_argv);
+  g_test_add_func ("/common/zstd-input-stream", test_zstd_input_stream);
   g_test_add_func ("/common/str-is-integer", test_str_is_integer);
   g_test_add_func ("/common/parse-x11-display", test_parse_x11_display);
   g_test_add_func ("/common/string-escape", test_string_escape);
   g_test_add_func ("/common/validate-path-characters", test_validate_path_characters);
+  g_test_add_func ("/common/keyfile-variant", test_keyfile_variant);
 
   res = g_test_run ();
 
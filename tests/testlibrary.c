@@ -1162,6 +1162,52 @@ test_list_remote_refs (void)
     }
 }
 
+static void
+test_fetch_remote_data_multiple (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(GPtrArray) metadatas = NULL;
+  g_autoptr(GArray) download_sizes = NULL;
+  g_autoptr(GArray) installed_sizes = NULL;
+  gboolean res;
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+
+  refs = flatpak_installation_list_remote_refs_sync (inst, repo_name, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (refs);
+  g_assert_cmpint (refs->len, >, 1);
+
+  res = flatpak_installation_fetch_remote_size_multiple_sync (inst, repo_name, refs,
+                                                              &download_sizes, &installed_sizes,
+                                                              NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_cmpuint (download_sizes->len, ==, refs->len);
+  g_assert_cmpuint (installed_sizes->len, ==, refs->len);
+
+  metadatas = flatpak_installation_fetch_remote_metadata_multiple_sync (inst, repo_name, refs,
+                                                                        NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (metadatas);
+  g_assert_cmpuint (metadatas->len, ==, refs->len);
+
+  for (guint i = 0; i < refs->len; i++)
+    {
+      FlatpakRemoteRef *remote_ref = g_ptr_array_index (refs, i);
+
+      g_assert_cmpuint (g_array_index (download_sizes, guint64, i), ==,
+                        flatpak_remote_ref_get_download_size (remote_ref));
+      g_assert_cmpuint (g_array_index (installed_sizes, guint64, i), ==,
+                        flatpak_remote_ref_get_installed_size (remote_ref));
+      g_assert_true (g_bytes_equal (g_ptr_array_index (metadatas, i),
+                                    flatpak_remote_ref_get_metadata (remote_ref)));
+    }
+}
+
 /* Test the xa.noenumerate option on a remote, which should mask non-installed refs */
 static void
 test_list_remote_refs_noenumerate (void)
@@ -1615,6 +1661,19 @@ changed_cb (GFileMonitor     *monitor,
   *count += 1;
 }
 
+static void
+changes_cb (FlatpakInstallationMonitor *monitor,
+            GPtrArray                  *added,
+            GPtrArray                  *removed,
+            GPtrArray                  *updated,
+            gpointer                    user_data)
+{
+  GPtrArray *added_refs = user_data;
+
+  for (guint i = 0; i < added->len; i++)
+    g_ptr_array_add (added_refs, flatpak_ref_format_ref (g_ptr_array_index (added, i)));
+}
+
 static gboolean
 timeout_cb (gpointer data)
 {
@@ -1651,6 +1710,8 @@ test_install_launch_uninstall (void)
 {
   g_autoptr(FlatpakInstallation) inst = NULL;
   g_autoptr(GFileMonitor) monitor = NULL;
+  g_autoptr(FlatpakInstallationMonitor) changes_monitor = NULL;
+  g_autoptr(GPtrArray) added_refs = g_ptr_array_new_with_free_func (g_free);
   g_autoptr(GError) error = NULL;
   g_autoptr(FlatpakInstalledRef) ref = NULL;
   g_autoptr(FlatpakInstalledRef) runtime_ref = NULL;
@@ -1677,6 +1738,12 @@ test_install_launch_uninstall (void)
 
   g_signal_connect (monitor, "changed", G_CALLBACK (changed_cb), &changed_count);
 
+  changes_monitor = flatpak_installation_create_changes_monitor (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (FLATPAK_IS_INSTALLATION_MONITOR (changes_monitor));
+
+  g_signal_connect (changes_monitor, "changes", G_CALLBACK (changes_cb), added_refs);
+
   refs = flatpak_installation_list_installed_refs (inst, NULL, &error);
   g_assert_no_error (error);
   g_assert_cmpint (refs->len, ==, 0);
@@ -1708,6 +1775,18 @@ test_install_launch_uninstall (void)
 
   g_assert_cmpint (changed_count, >, 0);
 
+  /* The changes monitor reports the whole install as one change set */
+  timeout_reached = FALSE;
+  timeout_id = g_timeout_add (20000, timeout_cb, &timeout_reached);
+  while (!timeout_reached && added_refs->len == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_source_remove (timeout_id);
+
+  g_assert_cmpuint (added_refs->len, ==, 1);
+  assert_cmpstr_free_both (g_strdup (g_ptr_array_index (added_refs, 0)), ==,
+                           flatpak_ref_format_ref (FLATPAK_REF (ref)));
+  flatpak_installation_monitor_cancel (changes_monitor);
+
   g_assert_cmpstr (flatpak_ref_get_name (FLATPAK_REF (ref)), ==, "org.test.Platform");
   g_assert_cmpstr (flatpak_ref_get_arch (FLATPAK_REF (ref)), ==, flatpak_get_default_arch ());
   g_assert_cmpstr (flatpak_ref_get_branch (FLATPAK_REF (ref)), ==, "master");
@@ -3077,6 +3156,8 @@ op_done (FlatpakTransaction          *transaction,
          int                          result)
 {
   g_auto(GStrv) refs = NULL;
+  GVariant *metrics;
+  const char *source;
 
   refs = g_new0 (gchar *, 4);
   refs[0] = g_strdup_printf ("runtime/org.test.Platform/%s/master",
@@ -3092,6 +3173,12 @@ op_done (FlatpakTransaction          *transaction,
   g_assert_cmpint (flatpak_transaction_operation_get_operation_type (op), ==, FLATPAK_TRANSACTION_OPERATION_INSTALL);
   g_assert_true (g_strv_contains ((const gchar * const *) refs, flatpak_transaction_operation_get_ref (op)));
 
+  metrics = flatpak_transaction_operation_get_metrics (op);
+  g_assert_nonnull (metrics);
+  g_assert_true (g_variant_lookup (metrics, "duration-usec", "t", NULL));
+  g_assert_true (g_variant_lookup (metrics, "source", "&s", &source));
+  g_assert_cmpstr (source, ==, "remote");
+
   g_assert_cmpint (result, ==, 0);
 }
 
@@ -3922,6 +4009,302 @@ test_transaction_deps (void)
   g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_ABORTED);
 }
 
+static gboolean
+check_ready_main_thread (FlatpakTransaction *transaction,
+                         gpointer            user_data)
+{
+  GThread *main_thread = user_data;
+
+  g_assert_true (g_thread_self () == main_thread);
+
+  return TRUE;
+}
+
+static void
+check_op_done_main_thread (FlatpakTransaction          *transaction,
+                           FlatpakTransactionOperation *op,
+                           const char                  *commit,
+                           int                          result,
+                           gpointer                     user_data)
+{
+  GThread *main_thread = user_data;
+
+  g_assert_true (g_thread_self () == main_thread);
+}
+
+static void
+run_async_done (GObject      *source,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  GAsyncResult **result_out = user_data;
+
+  *result_out = g_object_ref (result);
+}
+
+/* Run a transaction asynchronously, and check that the signals are
+ * emitted in the caller's thread */
+static void
+test_transaction_run_async (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean res;
+  g_autofree char *app = NULL;
+
+  app = g_strdup_printf ("app/org.test.Hello/%s/master",
+                         flatpak_get_default_arch ());
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (inst);
+
+  empty_installation (inst);
+
+  transaction = flatpak_transaction_new_for_installation (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (transaction);
+
+  res = flatpak_transaction_add_install (transaction, repo_name, app, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  g_signal_connect (transaction, "ready", G_CALLBACK (check_ready_main_thread), g_thread_self ());
+  g_signal_connect (transaction, "operation-done", G_CALLBACK (check_op_done_main_thread), g_thread_self ());
+
+  flatpak_transaction_run_async (transaction, NULL, run_async_done, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  res = flatpak_transaction_run_finish (transaction, result, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  empty_installation (inst);
+}
+
+static void
+record_op_done (FlatpakTransaction          *transaction,
+                FlatpakTransactionOperation *op,
+                const char                  *commit,
+                int                          result,
+                gpointer                     user_data)
+{
+  GPtrArray *done = user_data;
+
+  g_ptr_array_add (done, g_strdup (flatpak_transaction_operation_get_ref (op)));
+}
+
+static guint
+find_done_op (GPtrArray  *done,
+              const char *ref)
+{
+  guint i;
+
+  for (i = 0; i < done->len; i++)
+    if (strcmp (g_ptr_array_index (done, i), ref) == 0)
+      return i;
+
+  g_assert_not_reached ();
+}
+
+/* Install an app with its runtime and extensions from one remote with the
+ * pulls running in parallel, and check that everything ends up installed
+ * and that the runtime was deployed before the app */
+static void
+run_parallel_install (gboolean pipelined)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(GPtrArray) done = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean res;
+  g_autofree char *app = NULL;
+  g_autofree char *runtime = NULL;
+  guint i;
+
+  app = g_strdup_printf ("app/org.test.Hello/%s/master",
+                         flatpak_get_default_arch ());
+  runtime = g_strdup_printf ("runtime/org.test.Platform/%s/master",
+                             flatpak_get_default_arch ());
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (inst);
+
+  empty_installation (inst);
+
+  transaction = flatpak_transaction_new_for_installation (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (transaction);
+
+  flatpak_transaction_set_max_parallel_ops (transaction, 4);
+  flatpak_transaction_set_pipelined (transaction, pipelined);
+
+  res = flatpak_transaction_add_install (transaction, repo_name, app, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  g_signal_connect (transaction, "operation-done", G_CALLBACK (record_op_done), done);
+
+  res = flatpak_transaction_run (transaction, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  g_assert_cmpuint (done->len, >, 2);
+  g_assert_cmpuint (find_done_op (done, runtime), <, find_done_op (done, app));
+
+  refs = flatpak_installation_list_installed_refs (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (refs->len, ==, done->len);
+
+  for (i = 0; i < refs->len; i++)
+    {
+      FlatpakInstalledRef *ref = g_ptr_array_index (refs, i);
+      g_autofree char *ref_str = flatpak_ref_format_ref (FLATPAK_REF (ref));
+
+      find_done_op (done, ref_str);
+    }
+
+  empty_installation (inst);
+}
+
+static void
+test_transaction_parallel_ops (void)
+{
+  run_parallel_install (FALSE);
+}
+
+static void
+test_transaction_pipelined (void)
+{
+  run_parallel_install (TRUE);
+}
+
+static void
+assert_commit_pulled (OstreeRepo                  *repo,
+                      FlatpakTransactionOperation *op)
+{
+  g_autoptr(GError) error = NULL;
+  OstreeRepoCommitState state;
+  gboolean res;
+
+  res = ostree_repo_load_commit (repo, flatpak_transaction_operation_get_commit (op),
+                                 NULL, &state, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+  g_assert_false (state & OSTREE_REPO_COMMIT_STATE_PARTIAL);
+}
+
+static void
+check_batch_pulled (FlatpakTransaction          *transaction,
+                    FlatpakTransactionOperation *op,
+                    FlatpakTransactionProgress  *progress,
+                    gpointer                     user_data)
+{
+  gboolean *checked = user_data;
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(GFile) inst_file = NULL;
+  g_autoptr(GFile) repo_file = NULL;
+  g_autoptr(OstreeRepo) repo = NULL;
+  g_autolist(FlatpakTransactionOperation) ops = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean res;
+  GList *l;
+
+  if (*checked)
+    return;
+
+  /* Before the first op runs, the batch pull must already have fetched
+   * the app and the runtime */
+  inst = flatpak_transaction_get_installation (transaction);
+  inst_file = flatpak_installation_get_path (inst);
+  repo_file = g_file_get_child (inst_file, "repo");
+  repo = ostree_repo_new (repo_file);
+  res = ostree_repo_open (repo, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  ops = flatpak_transaction_get_operations (transaction);
+  for (l = ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *o = l->data;
+      const char *ref = flatpak_transaction_operation_get_ref (o);
+
+      if (g_str_has_prefix (ref, "app/org.test.Hello/") ||
+          g_str_has_prefix (ref, "runtime/org.test.Platform/"))
+        assert_commit_pulled (repo, o);
+    }
+
+  *checked = TRUE;
+}
+
+/* Install an app with its runtime with batched pulls, and check that both
+ * were pulled before running any op, and that everything got installed */
+static void
+test_transaction_batch_pulls (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(GPtrArray) done = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean checked = FALSE;
+  gboolean res;
+  g_autofree char *app = NULL;
+  g_autofree char *runtime = NULL;
+  guint i;
+
+  app = g_strdup_printf ("app/org.test.Hello/%s/master",
+                         flatpak_get_default_arch ());
+  runtime = g_strdup_printf ("runtime/org.test.Platform/%s/master",
+                             flatpak_get_default_arch ());
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (inst);
+
+  empty_installation (inst);
+
+  transaction = flatpak_transaction_new_for_installation (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (transaction);
+
+  flatpak_transaction_set_batch_pulls (transaction, TRUE);
+  g_assert_true (flatpak_transaction_get_batch_pulls (transaction));
+
+  res = flatpak_transaction_add_install (transaction, repo_name, app, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  g_signal_connect (transaction, "new-operation", G_CALLBACK (check_batch_pulled), &checked);
+  g_signal_connect (transaction, "operation-done", G_CALLBACK (record_op_done), done);
+
+  res = flatpak_transaction_run (transaction, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  g_assert_true (checked);
+  g_assert_cmpuint (find_done_op (done, runtime), <, find_done_op (done, app));
+
+  refs = flatpak_installation_list_installed_refs (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (refs->len, ==, done->len);
+
+  for (i = 0; i < refs->len; i++)
+    {
+      FlatpakInstalledRef *ref = g_ptr_array_index (refs, i);
+      g_autofree char *ref_str = flatpak_ref_format_ref (FLATPAK_REF (ref));
+
+      find_done_op (done, ref_str);
+    }
+
+  empty_installation (inst);
+}
+
 /* install from a local repository */
 static void
 test_transaction_install_local (void)
@@ -5137,6 +5520,7 @@ main (int argc, char *argv[])
   g_test_add_func ("/library/remote-new", test_remote_new);
   g_test_add_func ("/library/remote-new-from-file", test_remote_new_from_file);
   g_test_add_func ("/library/list-remote-refs", test_list_remote_refs);
+  g_test_add_func ("/library/fetch-remote-data-multiple", test_fetch_remote_data_multiple);
   g_test_add_func ("/library/list-remote-refs-noenumerate", test_list_remote_refs_noenumerate);
   g_test_add_func ("/library/list-remote-related-refs", test_list_remote_related_refs);
   g_test_add_func ("/library/list-remote-related-refs-for-installed", test_list_remote_related_refs_for_installed);
@@ -5153,6 +5537,10 @@ main (int argc, char *argv[])
   g_test_add_func ("/library/transaction-flatpakref-remote-creation", test_transaction_flatpakref_remote_creation);
   g_test_add_func ("/library/transaction-flatpakref-origin-remote-creation", test_transaction_flatpakref_origin_remote_creation);
   g_test_add_func ("/library/transaction-deps", test_transaction_deps);
+  g_test_add_func ("/library/transaction-run-async", test_transaction_run_async);
+  g_test_add_func ("/library/transaction-parallel-ops", test_transaction_parallel_ops);
+  g_test_add_func ("/library/transaction-pipelined", test_transaction_pipelined);
+  g_test_add_func ("/library/transaction-batch-pulls", test_transaction_batch_pulls);
   g_test_add_func ("/library/transaction-install-local", test_transaction_install_local);
   g_test_add_func ("/library/transaction-app-runtime-same-remote", test_transaction_app_runtime_same_remote);
   g_test_add_func ("/library/transaction-update-related-from-different-remote", test_transaction_update_related_from_different_remote);